@@ -13,6 +13,10 @@ package notmuch
 import "C"
 import "unsafe"
 
+// A Database, and every object derived from it, must only be used by
+// one goroutine at a time. Concurrent readers should each take their
+// own read-only handle, e.g. from a DatabasePool.
+
 // Status codes used for the return values of most functions
 type Status C.notmuch_status_t
 
@@ -884,6 +888,75 @@ func (self *Messages) CollectTags() *Tags {
 	return &Tags{tags: tags}
 }
 
+// Some fields of a message, as returned by Messages.Fetch.
+type MessageRow struct {
+	MessageId string
+	ThreadId  string
+	Date      int64
+	Tags      []string
+	Excluded  bool
+}
+
+// The largest number of entries of a C array viewed as a Go slice.
+const maxArrayLen = 1 << 28
+
+// Get the message IDs, thread IDs, dates, tags and excluded flags of
+// up to 'n' messages from the current position of 'messages', and
+// move 'messages' past them, in a single call into the library.
+//
+// The returned slice is shorter than 'n' only once 'messages' is
+// exhausted. This is much faster than calling Get and the Message
+// accessors for each message.
+func (self *Messages) Fetch(n int) ([]MessageRow, Status) {
+	if self.messages == nil {
+		return nil, STATUS_NULL_POINTER
+	}
+	if n <= 0 || n > maxArrayLen {
+		return nil, STATUS_SUCCESS
+	}
+
+	ptr_size := C.size_t(unsafe.Sizeof((*C.char)(nil)))
+	var columns C.notmuch_message_columns_t
+	columns.message_ids = (**C.char)(C.calloc(C.size_t(n), ptr_size))
+	defer C.free(unsafe.Pointer(columns.message_ids))
+	columns.thread_ids = (**C.char)(C.calloc(C.size_t(n), ptr_size))
+	defer C.free(unsafe.Pointer(columns.thread_ids))
+	columns.dates = (*C.time_t)(C.calloc(C.size_t(n), C.size_t(unsafe.Sizeof(C.time_t(0)))))
+	defer C.free(unsafe.Pointer(columns.dates))
+	columns.tags = (***C.char)(C.calloc(C.size_t(n), ptr_size))
+	defer C.free(unsafe.Pointer(columns.tags))
+	columns.excluded = (*C.notmuch_bool_t)(C.calloc(C.size_t(n), C.size_t(unsafe.Sizeof(C.notmuch_bool_t(0)))))
+	defer C.free(unsafe.Pointer(columns.excluded))
+	if columns.message_ids == nil || columns.thread_ids == nil ||
+		columns.dates == nil || columns.tags == nil || columns.excluded == nil {
+		return nil, STATUS_OUT_OF_MEMORY
+	}
+
+	var filled C.uint
+	st := Status(C.notmuch_messages_get_columns(self.messages, &columns, C.uint(n), &filled))
+
+	message_ids := (*[maxArrayLen]*C.char)(unsafe.Pointer(columns.message_ids))[:filled:filled]
+	thread_ids := (*[maxArrayLen]*C.char)(unsafe.Pointer(columns.thread_ids))[:filled:filled]
+	dates := (*[maxArrayLen]C.time_t)(unsafe.Pointer(columns.dates))[:filled:filled]
+	tags := (*[maxArrayLen]**C.char)(unsafe.Pointer(columns.tags))[:filled:filled]
+	excluded := (*[maxArrayLen]C.notmuch_bool_t)(unsafe.Pointer(columns.excluded))[:filled:filled]
+
+	rows := make([]MessageRow, filled)
+	for i := range rows {
+		rows[i].MessageId = C.GoString(message_ids[i])
+		rows[i].ThreadId = C.GoString(thread_ids[i])
+		rows[i].Date = int64(dates[i])
+		rows[i].Excluded = excluded[i] != 0
+		for _, tag := range (*[maxArrayLen]*C.char)(unsafe.Pointer(tags[i]))[:] {
+			if tag == nil {
+				break
+			}
+			rows[i].Tags = append(rows[i].Tags, C.GoString(tag))
+		}
+	}
+	return rows, st
+}
+
 // Get the message ID of 'message'.
 //
 // The returned string belongs to 'message' and as such, should not be
@@ -1387,3 +1460,49 @@ func (self *Filenames) Destroy() {
 }
 
 // EOF
+
+// A fixed set of read-only handles on one database, for goroutines
+// that search it concurrently. Each goroutine takes a handle with
+// Get, uses it and the objects derived from it on its own, and gives
+// it back with Put.
+type DatabasePool struct {
+	handles chan *Database
+}
+
+// Open 'size' read-only handles on the database at 'path'.
+func NewDatabasePool(path string, size int) (*DatabasePool, Status) {
+	self := &DatabasePool{handles: make(chan *Database, size)}
+	for i := 0; i < size; i++ {
+		db, st := OpenDatabase(path, DATABASE_MODE_READ_ONLY)
+		if st != STATUS_SUCCESS {
+			self.Close()
+			return nil, st
+		}
+		self.handles <- db
+	}
+	return self, STATUS_SUCCESS
+}
+
+// Take a handle from the pool, waiting until one is free.
+func (self *DatabasePool) Get() *Database {
+	return <-self.handles
+}
+
+// Give back a handle taken with Get. Queries made on it should have
+// been destroyed.
+func (self *DatabasePool) Put(db *Database) {
+	self.handles <- db
+}
+
+// Close the handles of the pool, once all handles taken have been
+// given back.
+func (self *DatabasePool) Close() {
+	for {
+		select {
+		case db := <-self.handles:
+			db.Close()
+		default:
+			return
+		}
+	}
+}
@@ -0,0 +1,129 @@
+// Benchmarks for the notmuch bindings
+//
+// These read the database named by the NOTMUCH_BENCH_DATABASE
+// environment variable, and are skipped when it is not set:
+//
+//	NOTMUCH_BENCH_DATABASE=~/mail make bench
+
+package notmuch
+
+import (
+	"os"
+	"sync"
+	"testing"
+)
+
+func benchDatabasePath(b *testing.B) string {
+	path := os.Getenv("NOTMUCH_BENCH_DATABASE")
+	if path == "" {
+		b.Skip("NOTMUCH_BENCH_DATABASE is not set")
+	}
+	return path
+}
+
+func openBenchDatabase(b *testing.B) *Database {
+	db, st := OpenDatabase(benchDatabasePath(b), DATABASE_MODE_READ_ONLY)
+	if st != STATUS_SUCCESS {
+		b.Fatalf("opening database: %v", st)
+	}
+	return db
+}
+
+// Read the fields of every message of 'db' one accessor at a time,
+// returning the number of messages read.
+func readMessages(db *Database) int {
+	query := db.CreateQuery("*")
+	defer query.Destroy()
+
+	count := 0
+	for msgs := query.SearchMessages(); msgs.Valid(); msgs.MoveToNext() {
+		msg := msgs.Get()
+		msg.GetMessageId()
+		msg.GetThreadId()
+		msg.GetDate()
+		for tags := msg.GetTags(); tags.Valid(); tags.MoveToNext() {
+			tags.Get()
+		}
+		msg.Destroy()
+		count++
+	}
+	return count
+}
+
+// The same as readMessages with Messages.Fetch.
+func fetchMessages(db *Database) int {
+	query := db.CreateQuery("*")
+	defer query.Destroy()
+
+	count := 0
+	msgs := query.SearchMessages()
+	for {
+		rows, st := msgs.Fetch(1024)
+		if st != STATUS_SUCCESS {
+			return count
+		}
+		count += len(rows)
+		if len(rows) < 1024 {
+			return count
+		}
+	}
+}
+
+func benchmarkMessages(b *testing.B, read func(*Database) int) {
+	db := openBenchDatabase(b)
+	defer db.Close()
+
+	messages := 0
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		messages += read(db)
+	}
+	b.StopTimer()
+	if messages > 0 {
+		b.ReportMetric(float64(b.Elapsed().Nanoseconds())/float64(messages), "ns/message")
+	}
+}
+
+func BenchmarkMessagesGet(b *testing.B) {
+	benchmarkMessages(b, readMessages)
+}
+
+func BenchmarkMessagesFetch(b *testing.B) {
+	benchmarkMessages(b, fetchMessages)
+}
+
+// Fetch all messages from four goroutines at once, each on a handle
+// of its own.
+func BenchmarkMessagesFetchPool(b *testing.B) {
+	const readers = 4
+
+	pool, st := NewDatabasePool(benchDatabasePath(b), readers)
+	if st != STATUS_SUCCESS {
+		b.Fatalf("opening database pool: %v", st)
+	}
+	defer pool.Close()
+
+	var messages int
+	var lock sync.Mutex
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		var wg sync.WaitGroup
+		for j := 0; j < readers; j++ {
+			wg.Add(1)
+			go func() {
+				defer wg.Done()
+				db := pool.Get()
+				defer pool.Put(db)
+				count := fetchMessages(db)
+				lock.Lock()
+				messages += count
+				lock.Unlock()
+			}()
+		}
+		wg.Wait()
+	}
+	b.StopTimer()
+	if messages > 0 {
+		b.ReportMetric(float64(b.Elapsed().Nanoseconds())/float64(messages), "ns/message")
+	}
+}
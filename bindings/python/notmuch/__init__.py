@@ -78,6 +78,8 @@ from .errors import (
     UnsupportedOperationError,
     UpgradeRequiredError,
     PathError,
+    QueryInterruptedError,
+    IllegalArgumentError,
 )
 from .version import __VERSION__
 __LICENSE__ = "GPL v3+"
@@ -59,6 +59,8 @@ STATUS = Status(['SUCCESS',
   'UNSUPPORTED_OPERATION',
   'UPGRADE_REQUIRED',
   'PATH_ERROR',
+  'QUERY_INTERRUPTED',
+  'ILLEGAL_ARGUMENT',
   'NOT_INITIALIZED'])
 """STATUS is a class, whose attributes provide constants that serve as return
 indicators for notmuch functions. Currently the following ones are defined. For
@@ -79,6 +81,8 @@ description.
   * UNSUPPORTED_OPERATION
   * UPGRADE_REQUIRED
   * PATH_ERROR
+  * QUERY_INTERRUPTED
+  * ILLEGAL_ARGUMENT
   * NOT_INITIALIZED
 
 Invoke the class method `notmuch.STATUS.status2str` with a status value as
@@ -110,6 +114,8 @@ class NotmuchError(Exception, Python3StringMixIn):
             STATUS.UNSUPPORTED_OPERATION: UnsupportedOperationError,
             STATUS.UPGRADE_REQUIRED: UpgradeRequiredError,
             STATUS.PATH_ERROR: PathError,
+            STATUS.QUERY_INTERRUPTED: QueryInterruptedError,
+            STATUS.ILLEGAL_ARGUMENT: IllegalArgumentError,
             STATUS.NOT_INITIALIZED: NotInitializedError,
         }
         assert 0 < status <= len(subclasses)
@@ -196,6 +202,14 @@ class PathError(NotmuchError):
     status = STATUS.PATH_ERROR
 
 
+class QueryInterruptedError(NotmuchError):
+    status = STATUS.QUERY_INTERRUPTED
+
+
+class IllegalArgumentError(NotmuchError):
+    status = STATUS.ILLEGAL_ARGUMENT
+
+
 class NotInitializedError(NotmuchError):
     """Derived from NotmuchError, this occurs if the underlying data
     structure (e.g. database is not initialized (yet) or an iterator has
@@ -17,7 +17,7 @@ along with notmuch.  If not, see <http://www.gnu.org/licenses/>.
 Copyright 2010 Sebastian Spaeth <Sebastian@SSpaeth.de>
 """
 
-from ctypes import CDLL, Structure, POINTER
+from ctypes import CDLL, Structure, POINTER, c_char_p, c_long, c_int
 from notmuch.version import SOVERSION
 
 #-----------------------------------------------------------------------------
@@ -88,3 +88,12 @@ NotmuchDirectoryP = POINTER(NotmuchDirectoryS)
 class NotmuchFilenamesS(Structure):
     pass
 NotmuchFilenamesP = POINTER(NotmuchFilenamesS)
+
+
+class NotmuchMessageColumnsS(Structure):
+    _fields_ = [('message_ids', POINTER(c_char_p)),
+                ('thread_ids', POINTER(c_char_p)),
+                ('dates', POINTER(c_long)),
+                ('tags', POINTER(POINTER(c_char_p))),
+                ('excluded', POINTER(c_int))]
+NotmuchMessageColumnsP = POINTER(NotmuchMessageColumnsS)
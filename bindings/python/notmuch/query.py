@@ -17,7 +17,7 @@ along with notmuch.  If not, see <http://www.gnu.org/licenses/>.
 Copyright 2010 Sebastian Spaeth <Sebastian@SSpaeth.de>
 """
 
-from ctypes import c_char_p, c_uint, POINTER, byref
+from ctypes import c_char_p, c_uint, c_int, POINTER, byref
 from .globals import (
     nmlib,
     Enum,
@@ -185,6 +185,62 @@ class Query(object):
             raise NullPointerError
         return Messages(msgs_p, self)
 
+    def search_messages_columns(self, columns=Messages.COLUMNS,
+                                batch_size=1024):
+        """Filter messages according to the query and return some of
+        their fields, in the defined sort order
+
+        This is the same as :meth:`search_messages` followed by
+        :meth:`Messages.fetch` until the messages are exhausted, for
+        scripts that want only a few fields of many messages.
+
+        :param columns: The fields to return (see :meth:`Messages.fetch`)
+        :param batch_size: How many messages to read per call into the
+            library
+        :returns: An iterator over tuples with the fields in the order
+            of *columns*
+        :raises: :exc:`NullPointerError` if search_messages failed
+        """
+        msgs = self.search_messages()
+        while True:
+            rows = msgs.fetch(batch_size, columns)
+            for row in rows:
+                yield row
+            if len(rows) < batch_size:
+                break
+
+    _change_tags = nmlib.notmuch_query_change_tags
+    _change_tags.argtypes = [NotmuchQueryP, POINTER(c_char_p),
+                             POINTER(c_char_p), c_int, POINTER(c_uint)]
+    _change_tags.restype = c_uint
+
+    def tag_all(self, add=(), remove=(), remove_all=False):
+        """Change the tags of every message matching the query
+
+        All messages are changed in one atomic operation in the
+        library, which is much faster than changing the tags of each
+        :class:`Message` in turn.  Maildir flags are not synchronized.
+
+        :param add: Tags to add
+        :param remove: Tags to remove
+        :param remove_all: Whether to remove all tags first, so that
+            the messages end up with just the tags in *add*
+        :returns: The number of messages whose tags changed
+        :raises: :exc:`NotmuchError` if the tags could not be changed,
+            e.g. :attr:`STATUS`.READ_ONLY_DATABASE
+        """
+        self._assert_query_is_initialized()
+        add = [_str(tag) for tag in add]
+        remove = [_str(tag) for tag in remove]
+        add_p = (c_char_p * (len(add) + 1))(*add)
+        remove_p = (c_char_p * (len(remove) + 1))(*remove)
+        changed = c_uint(0)
+        status = Query._change_tags(self._query, add_p, remove_p,
+                                    int(bool(remove_all)), byref(changed))
+        if status != 0:
+            raise NotmuchError(status)
+        return changed.value
+
     _count_messages = nmlib.notmuch_query_count_messages_st
     _count_messages.argtypes = [NotmuchQueryP, POINTER(c_uint)]
     _count_messages.restype = c_uint
@@ -33,6 +33,7 @@ extern VALUE notmuch_rb_cThread;
 extern VALUE notmuch_rb_cMessages;
 extern VALUE notmuch_rb_cMessage;
 extern VALUE notmuch_rb_cTags;
+extern VALUE notmuch_rb_cMessageRow;
 
 extern VALUE notmuch_rb_eBaseError;
 extern VALUE notmuch_rb_eDatabaseError;
@@ -49,6 +50,9 @@ extern VALUE notmuch_rb_eUnbalancedAtomicError;
 extern ID ID_call;
 extern ID ID_db_create;
 extern ID ID_db_mode;
+extern ID ID_tag_add;
+extern ID ID_tag_remove;
+extern ID ID_tag_remove_all;
 
 /* RSTRING_PTR() is new in ruby-1.9 */
 #if !defined(RSTRING_PTR)
@@ -234,6 +238,9 @@ notmuch_rb_query_count_messages (VALUE self);
 VALUE
 notmuch_rb_query_count_threads (VALUE self);
 
+VALUE
+notmuch_rb_query_tag_all (int argc, VALUE *argv, VALUE self);
+
 /* threads.c */
 VALUE
 notmuch_rb_threads_destroy (VALUE self);
@@ -248,6 +255,12 @@ notmuch_rb_messages_destroy (VALUE self);
 VALUE
 notmuch_rb_messages_each (VALUE self);
 
+VALUE
+notmuch_rb_messages_each_batch (int argc, VALUE *argv, VALUE self);
+
+VALUE
+notmuch_rb_messages_each_row (int argc, VALUE *argv, VALUE self);
+
 VALUE
 notmuch_rb_messages_collect_tags (VALUE self);
 
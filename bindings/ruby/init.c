@@ -29,6 +29,7 @@ VALUE notmuch_rb_cThread;
 VALUE notmuch_rb_cMessages;
 VALUE notmuch_rb_cMessage;
 VALUE notmuch_rb_cTags;
+VALUE notmuch_rb_cMessageRow;
 
 VALUE notmuch_rb_eBaseError;
 VALUE notmuch_rb_eDatabaseError;
@@ -45,6 +46,9 @@ VALUE notmuch_rb_eUnbalancedAtomicError;
 ID ID_call;
 ID ID_db_create;
 ID ID_db_mode;
+ID ID_tag_add;
+ID ID_tag_remove;
+ID ID_tag_remove_all;
 
 /*
  * Document-module: Notmuch
@@ -76,6 +80,9 @@ Init_notmuch (void)
     ID_call = rb_intern ("call");
     ID_db_create = rb_intern ("create");
     ID_db_mode = rb_intern ("mode");
+    ID_tag_add = rb_intern ("add");
+    ID_tag_remove = rb_intern ("remove");
+    ID_tag_remove_all = rb_intern ("remove_all");
 
     mod = rb_define_module ("Notmuch");
 
@@ -272,6 +279,7 @@ Init_notmuch (void)
     rb_define_method (notmuch_rb_cQuery, "search_messages", notmuch_rb_query_search_messages, 0); /* in query.c */
     rb_define_method (notmuch_rb_cQuery, "count_messages", notmuch_rb_query_count_messages, 0); /* in query.c */
     rb_define_method (notmuch_rb_cQuery, "count_threads", notmuch_rb_query_count_threads, 0); /* in query.c */
+    rb_define_method (notmuch_rb_cQuery, "tag_all", notmuch_rb_query_tag_all, -1); /* in query.c */
 
     /*
      * Document-class: Notmuch::Threads
@@ -294,8 +302,21 @@ Init_notmuch (void)
     rb_define_method (notmuch_rb_cMessages, "destroy!", notmuch_rb_messages_destroy, 0); /* in messages.c */
     rb_define_method (notmuch_rb_cMessages, "each", notmuch_rb_messages_each, 0); /* in messages.c */
     rb_define_method (notmuch_rb_cMessages, "tags", notmuch_rb_messages_collect_tags, 0); /* in messages.c */
+    rb_define_method (notmuch_rb_cMessages, "each_batch", notmuch_rb_messages_each_batch, -1); /* in messages.c */
+    rb_define_method (notmuch_rb_cMessages, "each_row", notmuch_rb_messages_each_row, -1); /* in messages.c */
     rb_include_module (notmuch_rb_cMessages, rb_mEnumerable);
 
+    /*
+     * Document-class: Notmuch::MessageRow
+     *
+     * Some fields of a message, as yielded (frozen) by
+     * Notmuch::Messages#each_row: +message_id+, +thread_id+, +date+,
+     * +tags+ (an Array of Strings) and +excluded+.
+     */
+    notmuch_rb_cMessageRow = rb_struct_define_under (mod, "MessageRow",
+						     "message_id", "thread_id", "date",
+						     "tags", "excluded", NULL);
+
     /*
      * Document-class: Notmuch::Thread
      *
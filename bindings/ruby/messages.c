@@ -78,3 +78,125 @@ notmuch_rb_messages_collect_tags (VALUE self)
 
     return Data_Wrap_Struct (notmuch_rb_cTags, NULL, NULL, tags);
 }
+
+#define NOTMUCH_RB_BATCH_SIZE 1024
+
+/* Read up to 'count' rows from 'messages', returning them as an Array
+ * of frozen Notmuch::MessageRow.  The rows are copied into Ruby
+ * objects before anything can raise, so the C arrays never leak. */
+static VALUE
+notmuch_rb_messages_fetch (notmuch_messages_t *messages, unsigned int count)
+{
+    notmuch_message_columns_t columns;
+    notmuch_status_t status;
+    unsigned int filled, i, j;
+    VALUE rows, tags, row;
+
+    columns.message_ids = ALLOC_N (const char *, count);
+    columns.thread_ids = ALLOC_N (const char *, count);
+    columns.dates = ALLOC_N (time_t, count);
+    columns.tags = ALLOC_N (const char **, count);
+    columns.excluded = ALLOC_N (notmuch_bool_t, count);
+
+    status = notmuch_messages_get_columns (messages, &columns, count, &filled);
+
+    rows = rb_ary_new2 (filled);
+    for (i = 0; i < filled; i++) {
+	tags = rb_ary_new ();
+	for (j = 0; columns.tags[i][j]; j++)
+	    rb_ary_push (tags, rb_str_new2 (columns.tags[i][j]));
+	rb_obj_freeze (tags);
+
+	row = rb_struct_new (notmuch_rb_cMessageRow,
+			     rb_str_new2 (columns.message_ids[i]),
+			     rb_str_new2 (columns.thread_ids[i]),
+			     UINT2NUM (columns.dates[i]),
+			     tags,
+			     columns.excluded[i] ? Qtrue : Qfalse);
+	rb_ary_push (rows, rb_obj_freeze (row));
+    }
+
+    xfree (columns.message_ids);
+    xfree (columns.thread_ids);
+    xfree (columns.dates);
+    xfree (columns.tags);
+    xfree (columns.excluded);
+
+    if (status)
+	notmuch_rb_status_raise (status);
+
+    return rows;
+}
+
+static unsigned int
+notmuch_rb_batch_size (int argc, VALUE *argv)
+{
+    VALUE sizev;
+
+    rb_scan_args (argc, argv, "01", &sizev);
+    if (NIL_P (sizev))
+	return NOTMUCH_RB_BATCH_SIZE;
+    if (!FIXNUM_P (sizev) || FIX2INT (sizev) <= 0)
+	rb_raise (rb_eArgError, "batch size must be a positive Fixnum");
+
+    return FIX2UINT (sizev);
+}
+
+/*
+ * call-seq: MESSAGES.each_batch([size]) {|rows| block } => MESSAGES
+ *
+ * Calls +block+ with Arrays of up to +size+ (default 1024) frozen
+ * Notmuch::MessageRow, one per remaining message in +self+.  Each
+ * batch is read in one call into the library, without wrapping every
+ * message as a Notmuch::Message, which is much faster for large
+ * results.
+ */
+VALUE
+notmuch_rb_messages_each_batch (int argc, VALUE *argv, VALUE self)
+{
+    notmuch_messages_t *messages;
+    unsigned int size;
+    VALUE rows;
+
+    RETURN_ENUMERATOR (self, argc, argv);
+
+    size = notmuch_rb_batch_size (argc, argv);
+    Data_Get_Notmuch_Messages (self, messages);
+
+    do {
+	rows = notmuch_rb_messages_fetch (messages, size);
+	if (RARRAY_LEN (rows))
+	    rb_yield (rows);
+    } while (RARRAY_LEN (rows) == (long) size);
+
+    return self;
+}
+
+/*
+ * call-seq: MESSAGES.each_row([size]) {|row| block } => MESSAGES
+ *
+ * Calls +block+ once for each remaining message in +self+, passing a
+ * frozen Notmuch::MessageRow.  The rows are read in batches of +size+
+ * (default 1024), as for #each_batch.
+ */
+VALUE
+notmuch_rb_messages_each_row (int argc, VALUE *argv, VALUE self)
+{
+    notmuch_messages_t *messages;
+    unsigned int size;
+    long i;
+    VALUE rows;
+
+    RETURN_ENUMERATOR (self, argc, argv);
+
+    size = notmuch_rb_batch_size (argc, argv);
+    Data_Get_Notmuch_Messages (self, messages);
+
+    do {
+	rows = notmuch_rb_messages_fetch (messages, size);
+	for (i = 0; i < RARRAY_LEN (rows); i++)
+	    rb_yield (rb_ary_entry (rows, i));
+    } while (RARRAY_LEN (rows) == (long) size);
+
+    return self;
+}
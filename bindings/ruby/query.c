@@ -207,3 +207,83 @@ notmuch_rb_query_count_threads (VALUE self)
 
     return UINT2NUM(count);
 }
+
+/* Raise unless 'tagsv' is nil or an Array of Strings. */
+static void
+notmuch_rb_check_tags (VALUE tagsv)
+{
+    long i;
+
+    if (NIL_P (tagsv))
+	return;
+
+    Check_Type (tagsv, T_ARRAY);
+    for (i = 0; i < RARRAY_LEN (tagsv); i++)
+	SafeStringValue (RARRAY_PTR (tagsv)[i]);
+}
+
+/* Return a NULL-terminated array, allocated with ALLOC_N, of the
+ * strings of 'tagsv', which has passed notmuch_rb_check_tags. */
+static const char **
+notmuch_rb_tag_array (VALUE tagsv)
+{
+    const char **tags;
+    long i;
+
+    if (NIL_P (tagsv))
+	tagsv = rb_ary_new ();
+
+    tags = ALLOC_N (const char *, RARRAY_LEN (tagsv) + 1);
+    for (i = 0; i < RARRAY_LEN (tagsv); i++)
+	tags[i] = RSTRING_PTR (RARRAY_PTR (tagsv)[i]);
+    tags[i] = NULL;
+
+    return tags;
+}
+
+/*
+ * call-seq: QUERY.tag_all(add: [tags], remove: [tags], remove_all: false) => Fixnum
+ *
+ * Add and remove tags on all messages matching +QUERY+ in one atomic
+ * operation, returning the number of messages whose tags changed.
+ * With +remove_all+, the messages end up with just the tags in +add+.
+ * Maildir flags are not synchronized.
+ */
+VALUE
+notmuch_rb_query_tag_all (int argc, VALUE *argv, VALUE self)
+{
+    notmuch_query_t *query;
+    notmuch_status_t status;
+    const char **add_tags, **remove_tags;
+    notmuch_bool_t remove_all = FALSE;
+    unsigned int changed;
+    VALUE hashv, addv = Qnil, removev = Qnil;
+
+    Data_Get_Notmuch_Query (self, query);
+
+    rb_scan_args (argc, argv, "01", &hashv);
+    if (!NIL_P (hashv)) {
+	Check_Type (hashv, T_HASH);
+	addv = rb_hash_aref (hashv, ID2SYM (ID_tag_add));
+	removev = rb_hash_aref (hashv, ID2SYM (ID_tag_remove));
+	remove_all = RTEST (rb_hash_aref (hashv, ID2SYM (ID_tag_remove_all)));
+    }
+
+    /* Check everything before allocating, so nothing leaks. */
+    notmuch_rb_check_tags (addv);
+    notmuch_rb_check_tags (removev);
+
+    add_tags = notmuch_rb_tag_array (addv);
+    remove_tags = notmuch_rb_tag_array (removev);
+
+    status = notmuch_query_change_tags (query, add_tags, remove_tags,
+					remove_all, &changed);
+
+    xfree (add_tags);
+    xfree (remove_tags);
+
+    if (status)
+	notmuch_rb_status_raise (status);
+
+    return UINT2NUM (changed);
+}
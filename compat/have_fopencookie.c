@@ -0,0 +1,9 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+
+int main()
+{
+    cookie_io_functions_t io = { NULL, NULL, NULL, NULL };
+
+    return fopencookie (NULL, "r", io) == NULL;
+}
@@ -0,0 +1,8 @@
+#include <sys/inotify.h>
+
+int main()
+{
+    int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+
+    return inotify_add_watch (fd, ".", IN_CREATE | IN_MOVED_TO) < 0;
+}
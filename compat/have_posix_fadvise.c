@@ -0,0 +1,6 @@
+#include <fcntl.h>
+
+int main()
+{
+    return posix_fadvise (0, 0, 0, POSIX_FADV_WILLNEED);
+}
@@ -0,0 +1,16 @@
+#include <pthread.h>
+
+static void *
+start (void *arg)
+{
+    return arg;
+}
+
+int main()
+{
+    pthread_t thread;
+
+    if (pthread_create (&thread, NULL, start, NULL))
+	return 1;
+    return pthread_join (thread, NULL);
+}
@@ -0,0 +1,8 @@
+#include <sys/sendfile.h>
+
+int main()
+{
+    off_t offset = 0;
+
+    return sendfile (1, 0, &offset, 1) < 0;
+}
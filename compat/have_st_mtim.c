@@ -0,0 +1,10 @@
+#include <sys/stat.h>
+
+int main()
+{
+    struct stat st;
+
+    (void) st.st_mtim.tv_nsec;
+
+    return 0;
+}
@@ -0,0 +1,7 @@
+#include <sys/sdt.h>
+
+int main()
+{
+    DTRACE_PROBE1 (notmuch, configure_test, 0);
+    return 0;
+}
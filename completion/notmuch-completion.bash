@@ -27,7 +27,7 @@
 # on completion.
 #
 
-_notmuch_shared_options="--help --uuid= --version"
+_notmuch_shared_options="--help --memstats --uuid= --version"
 
 # $1: current input of the form prefix:partialinput, where prefix is
 # to or from.
@@ -111,7 +111,7 @@ _notmuch_compact()
     ! $split &&
     case "${cur}" in
 	-*)
-	    local options="--backup= --quiet ${_notmuch_shared_options}"
+	    local options="--backup= --quiet --online ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    ;;
@@ -155,6 +155,10 @@ _notmuch_count()
 	    COMPREPLY=( $( compgen -W "true false" -- "${cur}" ) )
 	    return
 	    ;;
+	--facet)
+	    COMPREPLY=( $( compgen -W "tag" -- "${cur}" ) )
+	    return
+	    ;;
 	--input)
 	    _filedir
 	    return
@@ -164,7 +168,7 @@ _notmuch_count()
     ! $split &&
     case "${cur}" in
 	-*)
-	    local options="--output= --exclude= --batch --input= --lastmod ${_notmuch_shared_options}"
+	    local options="--output= --exclude= --facet= --batch --input= --lastmod --estimate ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    ;;
@@ -182,7 +186,7 @@ _notmuch_dump()
     $split &&
     case "${prev}" in
 	--format)
-	    COMPREPLY=( $( compgen -W "sup batch-tag" -- "${cur}" ) )
+	    COMPREPLY=( $( compgen -W "sup batch-tag binary" -- "${cur}" ) )
 	    return
 	    ;;
 	--output)
@@ -194,7 +198,7 @@ _notmuch_dump()
     ! $split &&
     case "${cur}" in
 	-*)
-	    local options="--gzip --format= --output= ${_notmuch_shared_options}"
+	    local options="--gzip --format= --since= --output= ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    ;;
@@ -219,12 +223,16 @@ _notmuch_insert()
 		sed "s|^$path/||" | grep -v "\(^\|/\)\(cur\|new\|tmp\)$" ) )
 	    return
 	    ;;
+	--batch)
+	    COMPREPLY=( $(compgen -W "mbox files" -- ${cur}) )
+	    return
+	    ;;
     esac
 
     ! $split &&
     case "${cur}" in
 	--*)
-	    local options="--create-folder --folder= --keep --no-hooks ${_notmuch_shared_options}"
+	    local options="--create-folder --folder= --keep --no-hooks --defer-body --batch= ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    return
@@ -240,14 +248,67 @@ _notmuch_insert()
     __ltrim_colon_completions "${cur}"
 }
 
+_notmuch_index_attachments()
+{
+    local cur prev words cword split
+    _init_completion -s || return
+
+    ! $split &&
+    case "${cur}" in
+	-*)
+	    local options="--batch-size= --jobs= --quiet ${_notmuch_shared_options}"
+	    compopt -o nospace
+	    COMPREPLY=( $(compgen -W "${options}" -- ${cur}) )
+	    ;;
+    esac
+}
+
+_notmuch_index_pending()
+{
+    local cur prev words cword split
+    _init_completion -s || return
+
+    ! $split &&
+    case "${cur}" in
+	-*)
+	    local options="--batch-size= --quiet ${_notmuch_shared_options}"
+	    compopt -o nospace
+	    COMPREPLY=( $(compgen -W "${options}" -- ${cur}) )
+	    ;;
+    esac
+}
+
 _notmuch_new()
+{
+    local cur prev words cword split
+    _init_completion -s || return
+
+    $split &&
+    case "${prev}" in
+	--stats)
+	    COMPREPLY=( $( compgen -W "none json" -- "${cur}" ) )
+	    return
+	    ;;
+    esac
+
+    ! $split &&
+    case "${cur}" in
+	-*)
+	    local options="--no-hooks --quiet --jobs= --defer-body --stats= ${_notmuch_shared_options}"
+	    compopt -o nospace
+	    COMPREPLY=( $(compgen -W "${options}" -- ${cur}) )
+	    ;;
+    esac
+}
+
+_notmuch_watch()
 {
     local cur prev words cword split
     _init_completion || return
 
     case "${cur}" in
 	-*)
-	    local options="--no-hooks --quiet ${_notmuch_shared_options}"
+	    local options="--no-hooks --quiet --verbose ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "${options}" -- ${cur}) )
 	    ;;
@@ -311,6 +372,92 @@ _notmuch_restore()
     esac
 }
 
+_notmuch_roll_archive()
+{
+    local cur prev words cword split
+    _init_completion -s || return
+
+    ! $split &&
+    case "${cur}" in
+	-*)
+	    local options="--quiet ${_notmuch_shared_options}"
+	    compopt -o nospace
+	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
+	    ;;
+	*)
+	    _notmuch_search_terms
+	    ;;
+    esac
+}
+
+_notmuch_replicate()
+{
+    local cur prev words cword split
+    _init_completion -s || return
+
+    $split &&
+    case "${prev}" in
+	--interval)
+	    return
+	    ;;
+    esac
+
+    ! $split &&
+    case "${cur}" in
+	-*)
+	    local options="--interval= ${_notmuch_shared_options}"
+	    compopt -o nospace
+	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
+	    ;;
+	*)
+	    if [ ${cword} -eq 2 ]; then
+		COMPREPLY=( $(compgen -W "serve pull" -- ${cur}) )
+	    fi
+	    ;;
+    esac
+}
+
+_notmuch_stats()
+{
+    local cur prev words cword split
+    _init_completion -s || return
+
+    $split &&
+    case "${prev}" in
+	--format)
+	    COMPREPLY=( $( compgen -W "text json sexp" -- "${cur}" ) )
+	    return
+	    ;;
+	--top)
+	    return
+	    ;;
+    esac
+
+    ! $split &&
+    case "${cur}" in
+	-*)
+	    local options="--format= --top= ${_notmuch_shared_options}"
+	    compopt -o nospace
+	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
+	    ;;
+    esac
+}
+
+_notmuch_server()
+{
+    local cur prev words cword split
+    _init_completion -s || return
+
+    ! $split &&
+    case "${cur}" in
+	-*)
+	    local options="--quiet ${_notmuch_shared_options}"
+	    compopt -o nospace
+	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
+	    ;;
+    esac
+}
+
 _notmuch_search()
 {
     local cur prev words cword split
@@ -339,7 +486,7 @@ _notmuch_search()
     ! $split &&
     case "${cur}" in
 	-*)
-	    local options="--format= --output= --sort= --offset= --limit= --exclude= --duplicate= ${_notmuch_shared_options}"
+	    local options="--format= --output= --sort= --offset= --limit= --exclude= --duplicate= --jobs= --profile ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    ;;
@@ -415,7 +562,7 @@ _notmuch_show()
     ! $split &&
     case "${cur}" in
 	-*)
-	    local options="--entire-thread= --format= --exclude= --body= --format-version= --part= --verify --decrypt --include-html ${_notmuch_shared_options}"
+	    local options="--entire-thread= --format= --exclude= --body= --format-version= --part= --verify --decrypt --include-html --jobs= ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    ;;
@@ -442,7 +589,7 @@ _notmuch_tag()
     ! $split &&
     case "${cur}" in
 	--*)
-	    local options="--batch --input= --remove-all ${_notmuch_shared_options}"
+	    local options="--batch --input= --remove-all --group-lines= --group-seconds= --verbose ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    return
@@ -464,7 +611,7 @@ _notmuch_tag()
 
 _notmuch()
 {
-    local _notmuch_commands="compact config count dump help insert new reply restore search address setup show tag"
+    local _notmuch_commands="compact config count dump help index-attachments index-pending insert new replicate reply restore roll-archive search server address setup show stats tag watch"
     local arg cur prev words cword split
 
     # require bash-completion with _init_completion
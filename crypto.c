@@ -19,6 +19,11 @@
  */
 
 #include "notmuch-client.h"
+#include "hex-escape.h"
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 /* Create a GPG context (GMime 2.6) */
 static notmuch_crypto_context_t *
@@ -132,3 +137,299 @@ notmuch_crypto_cleanup (notmuch_crypto_t *crypto)
 
     return 0;
 }
+
+/* The cache of signature verifications is a file of lines
+ *
+ *	<sha1 of the signed part> <number of signatures> <signature>...
+ *
+ * where each signature is the six fields
+ *
+ *	<created> <expires> <trust> <fingerprint> <key id> <name>
+ *
+ * and each string is either "-" for none, or "=" followed by its hex
+ * escaped value.  Only lists of good signatures without errors are
+ * kept, so a failure (say, for want of a key that is imported later)
+ * is always checked again.  Lines are only ever appended. */
+struct notmuch_signature_cache {
+    char *path;
+    /* sha1 -> the rest of its line, both owned by the table. */
+    GHashTable *entries;
+#if HAVE_PTHREAD
+    /* The threads of notmuch show --jobs share the cache. */
+    pthread_mutex_t lock;
+#endif
+};
+
+static int
+_signature_cache_destroy (notmuch_signature_cache_t *cache)
+{
+    g_hash_table_destroy (cache->entries);
+#if HAVE_PTHREAD
+    pthread_mutex_destroy (&cache->lock);
+#endif
+    return 0;
+}
+
+notmuch_signature_cache_t *
+notmuch_signature_cache_open (const void *ctx, const char *path)
+{
+    notmuch_signature_cache_t *cache;
+    FILE *file;
+    char *line = NULL;
+    size_t line_size;
+    ssize_t line_len;
+
+    cache = talloc_zero (ctx, notmuch_signature_cache_t);
+    if (cache == NULL)
+	return NULL;
+
+    cache->path = talloc_strdup (cache, path);
+    cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+					    g_free, g_free);
+#if HAVE_PTHREAD
+    pthread_mutex_init (&cache->lock, NULL);
+#endif
+    talloc_set_destructor (cache, _signature_cache_destroy);
+
+    file = fopen (path, "r");
+    if (file == NULL)
+	return cache;
+
+    while ((line_len = getline (&line, &line_size, file)) != -1) {
+	char *value;
+
+	if (line_len > 0 && line[line_len - 1] == '\n')
+	    line[line_len - 1] = '\0';
+
+	value = strchr (line, ' ');
+	if (value == NULL)
+	    continue;
+	*value++ = '\0';
+
+	g_hash_table_replace (cache->entries, g_strdup (line),
+			      g_strdup (value));
+    }
+
+    free (line);
+    fclose (file);
+
+    return cache;
+}
+
+/* Return the cache key of 'part', to be freed with g_free. */
+static char *
+_signature_cache_key (GMimeObject *part)
+{
+    char *content = g_mime_object_to_string (part);
+    char *key;
+
+    if (content == NULL)
+	return NULL;
+
+    key = g_compute_checksum_for_string (G_CHECKSUM_SHA1, content, -1);
+    g_free (content);
+
+    return key;
+}
+
+static char *
+_next_field (char **fields)
+{
+    return strsep (fields, " ");
+}
+
+/* Parse a string field in place, setting *out to NULL for none. */
+static notmuch_bool_t
+_parse_string_field (char *field, char **out)
+{
+    if (field == NULL)
+	return FALSE;
+
+    if (strcmp (field, "-") == 0) {
+	*out = NULL;
+	return TRUE;
+    }
+
+    if (field[0] != '=' || hex_decode_inplace (field + 1) != HEX_SUCCESS)
+	return FALSE;
+
+    *out = field + 1;
+    return TRUE;
+}
+
+/* Rebuild the list of signatures of a cache entry, or return NULL if
+ * it is damaged. */
+static GMimeSignatureList *
+_parse_signatures (char *fields)
+{
+    GMimeSignatureList *list;
+    char *field;
+    long count, i;
+
+    field = _next_field (&fields);
+    if (field == NULL)
+	return NULL;
+    count = strtol (field, NULL, 10);
+    if (count <= 0)
+	return NULL;
+
+    list = g_mime_signature_list_new ();
+
+    for (i = 0; i < count; i++) {
+	GMimeSignature *signature;
+	GMimeCertificate *certificate;
+	char *created, *expires, *trust;
+	char *fingerprint, *key_id, *name;
+
+	created = _next_field (&fields);
+	expires = _next_field (&fields);
+	trust = _next_field (&fields);
+	if (trust == NULL ||
+	    ! _parse_string_field (_next_field (&fields), &fingerprint) ||
+	    ! _parse_string_field (_next_field (&fields), &key_id) ||
+	    ! _parse_string_field (_next_field (&fields), &name)) {
+	    g_object_unref (list);
+	    return NULL;
+	}
+
+	certificate = g_mime_certificate_new ();
+	g_mime_certificate_set_trust (certificate, strtol (trust, NULL, 10));
+	if (fingerprint)
+	    g_mime_certificate_set_fingerprint (certificate, fingerprint);
+	if (key_id)
+	    g_mime_certificate_set_key_id (certificate, key_id);
+	if (name)
+	    g_mime_certificate_set_name (certificate, name);
+
+	signature = g_mime_signature_new ();
+	g_mime_signature_set_status (signature, GMIME_SIGNATURE_STATUS_GOOD);
+	g_mime_signature_set_created (signature, strtol (created, NULL, 10));
+	g_mime_signature_set_expires (signature, strtol (expires, NULL, 10));
+	g_mime_signature_set_certificate (signature, certificate);
+	g_object_unref (certificate);
+
+	g_mime_signature_list_add (list, signature);
+	g_object_unref (signature);
+    }
+
+    return list;
+}
+
+GMimeSignatureList *
+notmuch_crypto_lookup_signatures (notmuch_crypto_t *crypto,
+				  GMimeObject *part, char **key_out)
+{
+    notmuch_signature_cache_t *cache = crypto->sigcache;
+    GMimeSignatureList *list = NULL;
+    char *value = NULL;
+    char *key;
+
+    *key_out = NULL;
+
+    if (cache == NULL)
+	return NULL;
+
+    key = _signature_cache_key (part);
+    if (key == NULL)
+	return NULL;
+
+#if HAVE_PTHREAD
+    pthread_mutex_lock (&cache->lock);
+#endif
+    value = g_strdup (g_hash_table_lookup (cache->entries, key));
+#if HAVE_PTHREAD
+    pthread_mutex_unlock (&cache->lock);
+#endif
+
+    if (value) {
+	list = _parse_signatures (value);
+	g_free (value);
+    }
+
+    if (list)
+	g_free (key);
+    else
+	*key_out = key;
+
+    return list;
+}
+
+/* Append the hex escaped 'value' of a string field to 'line'. */
+static char *
+_append_string_field (char *line, const char *value)
+{
+    char *encoded = NULL;
+    size_t encoded_size = 0;
+
+    if (value == NULL || *value == '\0')
+	return talloc_strdup_append (line, " -");
+
+    if (hex_encode (line, value, &encoded, &encoded_size) != HEX_SUCCESS)
+	return NULL;
+
+    line = talloc_asprintf_append (line, " =%s", encoded);
+    talloc_free (encoded);
+
+    return line;
+}
+
+void
+notmuch_crypto_save_signatures (notmuch_crypto_t *crypto, const char *key,
+				GMimeSignatureList *list)
+{
+    notmuch_signature_cache_t *cache = crypto->sigcache;
+    int i, count;
+    char *line;
+    FILE *file;
+
+    if (cache == NULL || key == NULL || list == NULL)
+	return;
+
+    count = g_mime_signature_list_length (list);
+    if (count <= 0)
+	return;
+
+    line = talloc_asprintf (NULL, "%s %d", key, count);
+
+    for (i = 0; i < count && line; i++) {
+	GMimeSignature *signature = g_mime_signature_list_get_signature (list, i);
+	GMimeCertificate *certificate = g_mime_signature_get_certificate (signature);
+
+	if (g_mime_signature_get_status (signature) != GMIME_SIGNATURE_STATUS_GOOD ||
+	    g_mime_signature_get_errors (signature) != GMIME_SIGNATURE_ERROR_NONE ||
+	    certificate == NULL) {
+	    talloc_free (line);
+	    return;
+	}
+
+	line = talloc_asprintf_append (line, " %ld %ld %d",
+				       (long) g_mime_signature_get_created (signature),
+				       (long) g_mime_signature_get_expires (signature),
+				       (int) g_mime_certificate_get_trust (certificate));
+	if (line)
+	    line = _append_string_field (line, g_mime_certificate_get_fingerprint (certificate));
+	if (line)
+	    line = _append_string_field (line, g_mime_certificate_get_key_id (certificate));
+	if (line)
+	    line = _append_string_field (line, g_mime_certificate_get_name (certificate));
+    }
+
+    if (line == NULL)
+	return;
+
+#if HAVE_PTHREAD
+    pthread_mutex_lock (&cache->lock);
+#endif
+    file = fopen (cache->path, "a");
+    if (file) {
+	fprintf (file, "%s\n", line);
+	fclose (file);
+    }
+    g_hash_table_replace (cache->entries, g_strdup (key),
+			  g_strdup (line + strlen (key) + 1));
+#if HAVE_PTHREAD
+    pthread_mutex_unlock (&cache->lock);
+#endif
+
+    talloc_free (line);
+}
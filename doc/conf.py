@@ -86,6 +86,14 @@ man_pages = [
         u'hooks for notmuch',
         [u'Carl Worth and many others'], 5),
 
+('man1/notmuch-index-attachments','notmuch-index-attachments',
+        u'extract and index the text of attachments',
+        [u'Carl Worth and many others'], 1),
+
+('man1/notmuch-index-pending','notmuch-index-pending',
+        u'index message bodies deferred by new or insert',
+        [u'Carl Worth and many others'], 1),
+
 ('man1/notmuch-insert','notmuch-insert',
         u'add a message to the maildir and notmuch database',
         [u'Carl Worth and many others'], 1),
@@ -98,14 +106,26 @@ man_pages = [
         u'constructs a reply template for a set of messages',
         [u'Carl Worth and many others'], 1),
 
+('man1/notmuch-replicate','notmuch-replicate',
+        u'keep read-only replicas of the database up to date',
+        [u'Carl Worth and many others'], 1),
+
 ('man1/notmuch-restore','notmuch-restore',
         u'restores the tags from the given file (see notmuch dump)',
         [u'Carl Worth and many others'], 1),
 
+('man1/notmuch-roll-archive','notmuch-roll-archive',
+        u'move old messages into a read-only archive shard',
+        [u'Carl Worth and many others'], 1),
+
 ('man1/notmuch-search','notmuch-search',
         u'search for messages matching the given search terms',
         [u'Carl Worth and many others'], 1),
 
+('man1/notmuch-server','notmuch-server',
+        u'keep the database open and serve notmuch commands',
+        [u'Carl Worth and many others'], 1),
+
 ('man7/notmuch-search-terms','notmuch-search-terms',
         u'syntax for notmuch queries',
         [u'Carl Worth and many others'], 7),
@@ -114,10 +134,18 @@ man_pages = [
         u'show messages matching the given search terms',
         [u'Carl Worth and many others'], 1),
 
+('man1/notmuch-stats','notmuch-stats',
+        u'report the shape of the database',
+        [u'Carl Worth and many others'], 1),
+
 ('man1/notmuch-tag','notmuch-tag',
         u'add/remove tags for all messages matching the search terms',
         [u'Carl Worth and many others'], 1),
 
+('man1/notmuch-watch','notmuch-watch',
+        u'keep the notmuch database up to date as mail arrives',
+        [u'Carl Worth and many others'], 1),
+
 
 ]
 # If true, show URL addresses after external links.
@@ -156,6 +184,12 @@ texinfo_documents = [
 ('man5/notmuch-hooks','notmuch-hooks',u'notmuch Documentation',
       u'Carl Worth and many others', 'notmuch-hooks',
       'hooks for notmuch','Miscellaneous'),
+('man1/notmuch-index-attachments','notmuch-index-attachments',u'notmuch Documentation',
+      u'Carl Worth and many others', 'notmuch-index-attachments',
+      'extract and index the text of attachments','Miscellaneous'),
+('man1/notmuch-index-pending','notmuch-index-pending',u'notmuch Documentation',
+      u'Carl Worth and many others', 'notmuch-index-pending',
+      'index message bodies deferred by new or insert','Miscellaneous'),
 ('man1/notmuch-insert','notmuch-insert',u'notmuch Documentation',
       u'Carl Worth and many others', 'notmuch-insert',
       'add a message to the maildir and notmuch database','Miscellaneous'),
@@ -165,19 +199,34 @@ texinfo_documents = [
 ('man1/notmuch-reply','notmuch-reply',u'notmuch Documentation',
       u'Carl Worth and many others', 'notmuch-reply',
       'constructs a reply template for a set of messages','Miscellaneous'),
+('man1/notmuch-replicate','notmuch-replicate',u'notmuch Documentation',
+      u'Carl Worth and many others', 'notmuch-replicate',
+      'keep read-only replicas of the database up to date','Miscellaneous'),
 ('man1/notmuch-restore','notmuch-restore',u'notmuch Documentation',
       u'Carl Worth and many others', 'notmuch-restore',
       'restores the tags from the given file (see notmuch dump)','Miscellaneous'),
+('man1/notmuch-roll-archive','notmuch-roll-archive',u'notmuch Documentation',
+      u'Carl Worth and many others', 'notmuch-roll-archive',
+      'move old messages into a read-only archive shard','Miscellaneous'),
 ('man1/notmuch-search','notmuch-search',u'notmuch Documentation',
       u'Carl Worth and many others', 'notmuch-search',
       'search for messages matching the given search terms','Miscellaneous'),
+('man1/notmuch-server','notmuch-server',u'notmuch Documentation',
+      u'Carl Worth and many others', 'notmuch-server',
+      'keep the database open and serve notmuch commands','Miscellaneous'),
 ('man7/notmuch-search-terms','notmuch-search-terms',u'notmuch Documentation',
       u'Carl Worth and many others', 'notmuch-search-terms',
       'syntax for notmuch queries','Miscellaneous'),
 ('man1/notmuch-show','notmuch-show',u'notmuch Documentation',
       u'Carl Worth and many others', 'notmuch-show',
       'show messages matching the given search terms','Miscellaneous'),
+('man1/notmuch-stats','notmuch-stats',u'notmuch Documentation',
+      u'Carl Worth and many others', 'notmuch-stats',
+      'report the shape of the database','Miscellaneous'),
 ('man1/notmuch-tag','notmuch-tag',u'notmuch Documentation',
       u'Carl Worth and many others', 'notmuch-tag',
       'add/remove tags for all messages matching the search terms','Miscellaneous'),
+('man1/notmuch-watch','notmuch-watch',u'notmuch Documentation',
+      u'Carl Worth and many others', 'notmuch-watch',
+      'keep the notmuch database up to date as mail arrives','Miscellaneous'),
 ]
@@ -25,6 +25,13 @@
 
 int
 notmuch_run_hook (const char *db_path, const char *hook)
+{
+    return notmuch_run_hook_env (db_path, hook, NULL);
+}
+
+int
+notmuch_run_hook_env (const char *db_path, const char *hook,
+		      const char **env)
 {
     char *hook_path;
     int status = 0;
@@ -60,6 +67,8 @@ notmuch_run_hook (const char *db_path, const char *hook)
 	status = 1;
 	goto DONE;
     } else if (pid == 0) {
+	for (; env && *env; env++)
+	    putenv ((char *) *env);
 	execl (hook_path, hook_path, NULL);
 	/* Same as above for ENOENT, but unlikely now. Indicate all other errors
 	 * to parent through non-zero exit status. */
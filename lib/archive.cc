@@ -0,0 +1,598 @@
+/* archive.cc - Read-only archive shards of a database
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Old mail that no longer changes can be moved out of the database
+ * into archive shards, so that writes and compaction only touch the
+ * mail that is still live.  Each shard is a Xapian database of its
+ * own under .notmuch/archive/<name>, holding message documents exactly
+ * as they were in the database; directory documents, ghosts and all
+ * metadata stay behind.
+ *
+ * Readers open the database and all the shards as one Xapian
+ * database, so every query searches them all.  Xapian numbers the
+ * documents of a combined database by interleaving: document d of the
+ * i-th of n databases becomes (d - 1) * n + i + 1.  Since the file
+ * names of messages in the shards still refer to directory documents
+ * by their document ID in the database, those IDs are mapped with
+ * this formula.
+ *
+ * Readers also keep each shard apart, with the range of dates of its
+ * messages.  A query that is restricted to a range of dates missing
+ * from some shards runs against a database combining only the others
+ * (see _notmuch_database_route_query), whose document IDs are mapped
+ * back to those of the full combined database.
+ *
+ * Writers change only the database itself, so archived messages are
+ * read-only.  Writers do open the shards, to put new replies to
+ * archived messages into their threads and to know which files of a
+ * directory are already archived.
+ */
+
+#define NOTMUCH_ARCHIVE_DIR "archive"
+
+struct _notmuch_archive {
+    /* The database itself, without the shards. */
+    Xapian::Database primary;
+    std::vector<Xapian::Database> shards;
+    /* The range of NOTMUCH_VALUE_TIMESTAMP in each shard. */
+    std::vector<double> first_dates, last_dates;
+};
+
+struct _notmuch_archive_route {
+    Xapian::Database db;
+    /* For each database combined in 'db', its position in the full
+     * combined database: 0 for the database itself, i + 1 for the
+     * i-th shard. */
+    std::vector<unsigned int> positions;
+};
+
+static char *
+_archive_dir (void *ctx, notmuch_database_t *notmuch)
+{
+    return talloc_asprintf (ctx, "%s/.notmuch/%s", notmuch->path,
+			    NOTMUCH_ARCHIVE_DIR);
+}
+
+/* Return the names of the shards in the archive directory, sorted.
+ * Names starting with '.' are shards still being written. */
+static std::vector<std::string>
+_archive_shard_names (notmuch_database_t *notmuch)
+{
+    std::vector<std::string> names;
+    char *dir_path = _archive_dir (notmuch, notmuch);
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir (dir_path);
+    if (dir == NULL) {
+	talloc_free (dir_path);
+	return names;
+    }
+
+    while ((entry = readdir (dir)) != NULL) {
+	char *path;
+	struct stat st;
+
+	if (entry->d_name[0] == '.')
+	    continue;
+
+	path = talloc_asprintf (dir_path, "%s/%s", dir_path, entry->d_name);
+	if (path && stat (path, &st) == 0 && S_ISDIR (st.st_mode))
+	    names.push_back (entry->d_name);
+	talloc_free (path);
+    }
+
+    closedir (dir);
+    talloc_free (dir_path);
+
+    std::sort (names.begin (), names.end ());
+    return names;
+}
+
+/* Open the shard called 'name' alongside the database. */
+static void
+_archive_add_shard (notmuch_database_t *notmuch, const std::string &name)
+{
+    char *dir_path = _archive_dir (notmuch, notmuch);
+    std::string path = std::string (dir_path) + "/" + name;
+
+    talloc_free (dir_path);
+    Xapian::Database shard (path);
+
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY) {
+	notmuch_archive_t *archive = notmuch->archive;
+	std::string first, last;
+
+	/* Copies of a Xapian::Database share the databases they
+	 * combine, so reopening xapian_db reopens these too. */
+	if (archive == NULL) {
+	    archive = notmuch->archive = new notmuch_archive_t;
+	    archive->primary = *notmuch->xapian_db;
+	}
+
+	first = shard.get_value_lower_bound (NOTMUCH_VALUE_TIMESTAMP);
+	last = shard.get_value_upper_bound (NOTMUCH_VALUE_TIMESTAMP);
+	archive->shards.push_back (shard);
+	if (first.empty () || last.empty ()) {
+	    /* No message matches any date. */
+	    archive->first_dates.push_back (1);
+	    archive->last_dates.push_back (0);
+	} else {
+	    archive->first_dates.push_back (Xapian::sortable_unserialise (first));
+	    archive->last_dates.push_back (Xapian::sortable_unserialise (last));
+	}
+
+	notmuch->xapian_db->add_database (shard);
+	notmuch->num_archive_shards++;
+    } else {
+	if (notmuch->archive_db == NULL)
+	    notmuch->archive_db = new Xapian::Database;
+	notmuch->archive_db->add_database (shard);
+    }
+
+    if (notmuch->archive_shards == NULL)
+	notmuch->archive_shards = _notmuch_string_list_create (notmuch);
+    _notmuch_string_list_append (notmuch->archive_shards,
+				 talloc_strdup (notmuch->archive_shards,
+						name.c_str ()));
+}
+
+static notmuch_bool_t
+_archive_has_shard (notmuch_database_t *notmuch, const std::string &name)
+{
+    notmuch_string_node_t *node;
+
+    if (notmuch->archive_shards == NULL)
+	return FALSE;
+
+    for (node = notmuch->archive_shards->head; node; node = node->next)
+	if (name == node->string)
+	    return TRUE;
+
+    return FALSE;
+}
+
+notmuch_bool_t
+_notmuch_database_open_archive_shards (notmuch_database_t *notmuch)
+{
+    std::vector<std::string> names = _archive_shard_names (notmuch);
+    notmuch_bool_t added = FALSE;
+
+    for (size_t i = 0; i < names.size (); i++) {
+	if (_archive_has_shard (notmuch, names[i]))
+	    continue;
+	_archive_add_shard (notmuch, names[i]);
+	added = TRUE;
+    }
+
+    return added;
+}
+
+void
+_notmuch_database_close_archive_shards (notmuch_database_t *notmuch)
+{
+    delete notmuch->archive;
+    notmuch->archive = NULL;
+    delete notmuch->archive_db;
+    notmuch->archive_db = NULL;
+}
+
+enum _notmuch_features
+_notmuch_database_archive_features (notmuch_database_t *notmuch,
+				    enum _notmuch_features features)
+{
+    /* Thread summaries are written by writers, from the messages
+     * they see: those not archived. */
+    if (notmuch->num_archive_shards)
+	features &= ~NOTMUCH_FEATURE_THREAD_SUMMARIES;
+
+    /* Shards may have been rolled before the recipient headers were
+     * recorded, so their empty values prove nothing. */
+    if (notmuch->num_archive_shards)
+	features &= ~NOTMUCH_FEATURE_RECIPIENT_VALUES;
+
+    return features;
+}
+
+unsigned int
+_notmuch_database_primary_doc_id (notmuch_database_t *notmuch,
+				  unsigned int doc_id)
+{
+    unsigned int n = notmuch->num_archive_shards + 1;
+
+    return (doc_id - 1) / n + 1;
+}
+
+unsigned int
+_notmuch_database_combined_doc_id (notmuch_database_t *notmuch,
+				   unsigned int primary_doc_id)
+{
+    unsigned int n = notmuch->num_archive_shards + 1;
+
+    return (primary_doc_id - 1) * n + 1;
+}
+
+/* If 'query_string' is a conjunction including date: ranges, set
+ * '*first' and '*last' to the range of dates it is restricted to and
+ * return TRUE.  Anything that might match outside of the ranges, like
+ * an OR, a negated range or a range in parentheses is given up on. */
+static notmuch_bool_t
+_archive_query_dates (notmuch_database_t *notmuch,
+		      const char *query_string,
+		      double *first, double *last)
+{
+    const char *prefix = "date:";
+    notmuch_bool_t found = FALSE, have_first = FALSE, have_last = FALSE;
+    const char *s = query_string;
+
+    while (*s) {
+	size_t len = strcspn (s, " \t\n");
+	std::string token (s, len), begin, end;
+	size_t dots;
+
+	s += len;
+	s += strspn (s, " \t\n");
+
+	if (token.find ('"') != std::string::npos ||
+	    strcasecmp (token.c_str (), "or") == 0 ||
+	    strcasecmp (token.c_str (), "xor") == 0 ||
+	    strcasecmp (token.c_str (), "not") == 0)
+	    return FALSE;
+
+	if (token.find (prefix) == std::string::npos)
+	    continue;
+
+	dots = token.find ("..");
+	if (token.compare (0, strlen (prefix), prefix) != 0 ||
+	    dots == std::string::npos)
+	    return FALSE;
+
+	begin = token.substr (0, dots);
+	end = token.substr (dots + 2);
+	_notmuch_database_get_query_parser (notmuch);
+	if ((*notmuch->date_range_processor) (begin, end) == Xapian::BAD_VALUENO)
+	    return FALSE;
+
+	if (! begin.empty ()) {
+	    double date = Xapian::sortable_unserialise (begin);
+
+	    if (! have_first || date > *first)
+		*first = date;
+	    have_first = TRUE;
+	}
+	if (! end.empty ()) {
+	    double date = Xapian::sortable_unserialise (end);
+
+	    if (! have_last || date < *last)
+		*last = date;
+	    have_last = TRUE;
+	}
+	found = TRUE;
+    }
+
+    if (found && ! have_first)
+	*first = -HUGE_VAL;
+    if (found && ! have_last)
+	*last = HUGE_VAL;
+
+    return found;
+}
+
+notmuch_archive_route_t *
+_notmuch_database_route_query (notmuch_database_t *notmuch,
+			       const char *query_string)
+{
+    notmuch_archive_t *archive = notmuch->archive;
+    notmuch_archive_route_t *route;
+    double first, last;
+
+    if (archive == NULL ||
+	! _archive_query_dates (notmuch, query_string, &first, &last))
+	return NULL;
+
+    route = new notmuch_archive_route_t;
+    route->db = archive->primary;
+    route->positions.push_back (0);
+
+    for (size_t i = 0; i < archive->shards.size (); i++) {
+	if (archive->first_dates[i] > last || archive->last_dates[i] < first)
+	    continue;
+	route->db.add_database (archive->shards[i]);
+	route->positions.push_back (i + 1);
+    }
+
+    /* Every shard is needed. */
+    if (route->positions.size () == archive->shards.size () + 1) {
+	delete route;
+	return NULL;
+    }
+
+    return route;
+}
+
+Xapian::Database &
+_notmuch_archive_route_database (notmuch_database_t *notmuch,
+				 notmuch_archive_route_t *route)
+{
+    return route ? route->db : *notmuch->xapian_db;
+}
+
+unsigned int
+_notmuch_archive_route_doc_id (notmuch_database_t *notmuch,
+			       notmuch_archive_route_t *route,
+			       unsigned int doc_id)
+{
+    unsigned int n = notmuch->num_archive_shards + 1;
+    unsigned int m, position;
+
+    if (route == NULL)
+	return doc_id;
+
+    m = route->positions.size ();
+    position = route->positions[(doc_id - 1) % m];
+
+    return ((doc_id - 1) / m) * n + position + 1;
+}
+
+void
+_notmuch_archive_route_destroy (notmuch_archive_route_t *route)
+{
+    delete route;
+}
+
+const char *
+_notmuch_database_find_archived_thread_id (notmuch_database_t *notmuch,
+					   void *ctx,
+					   const char *message_id)
+{
+    const char *thread_prefix = NOTMUCH_PREFIX_THREAD;
+    Xapian::PostingIterator i;
+    Xapian::TermIterator j, end;
+    Xapian::Document doc;
+    std::string term;
+
+    if (notmuch->archive_db == NULL)
+	return NULL;
+
+    /* Callers are already inside Xapian try blocks of their own. */
+    term = std::string (NOTMUCH_PREFIX_ID) + message_id;
+    i = notmuch->archive_db->postlist_begin (term);
+    if (i == notmuch->archive_db->postlist_end (term))
+	return NULL;
+
+    doc = notmuch->archive_db->get_document (*i);
+    j = doc.termlist_begin ();
+    end = doc.termlist_end ();
+    j.skip_to (thread_prefix);
+    if (j == end || (*j).compare (0, strlen (thread_prefix), thread_prefix))
+	return NULL;
+
+    return talloc_strdup (ctx, _notmuch_database_resolve_thread_id (
+			      notmuch, (*j).c_str () + strlen (thread_prefix)));
+}
+
+notmuch_bool_t
+_notmuch_database_has_archived_thread (notmuch_database_t *notmuch,
+				      const char *thread_id)
+{
+    std::string term;
+
+    if (notmuch->archive_db == NULL)
+	return FALSE;
+
+    term = std::string (NOTMUCH_PREFIX_THREAD) + thread_id;
+    return notmuch->archive_db->term_exists (term);
+}
+
+void
+_notmuch_database_append_archived_terms (notmuch_database_t *notmuch,
+					 notmuch_string_list_t *list,
+					 const char *prefix)
+{
+    Xapian::TermIterator i, end;
+    int length;
+
+    if (notmuch->archive_db == NULL)
+	return;
+
+    length = list->length;
+    end = notmuch->archive_db->allterms_end (prefix);
+    for (i = notmuch->archive_db->allterms_begin (prefix); i != end; i++)
+	_notmuch_string_list_append (list, talloc_strdup (
+					 list, (*i).c_str () + strlen (prefix)));
+
+    if (list->length != length)
+	_notmuch_string_list_sort (list);
+}
+
+typedef struct {
+    Xapian::docid doc_id;
+    std::string message_id;
+    std::string thread_id;
+} _archived_message_t;
+
+/* List the messages matching 'query_string', in document order. */
+static notmuch_status_t
+_archive_find_messages (notmuch_database_t *notmuch,
+			const char *query_string,
+			std::vector<_archived_message_t> &messages)
+{
+    notmuch_query_t *query;
+    notmuch_messages_t *results;
+    notmuch_status_t status;
+
+    query = notmuch_query_create (notmuch, query_string);
+    if (query == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    notmuch_query_set_sort (query, NOTMUCH_SORT_UNSORTED);
+    notmuch_query_set_omit_excluded (query, NOTMUCH_EXCLUDE_FALSE);
+
+    status = notmuch_query_search_messages_st (query, &results);
+    if (status)
+	goto DONE;
+
+    for (;
+	 notmuch_messages_valid (results);
+	 notmuch_messages_move_to_next (results)) {
+	notmuch_message_t *message = notmuch_messages_get (results);
+	_archived_message_t archived;
+
+	archived.doc_id = _notmuch_message_get_doc_id (message);
+	archived.message_id = notmuch_message_get_message_id (message);
+	archived.thread_id = notmuch_message_get_thread_id (message);
+	messages.push_back (archived);
+
+	notmuch_message_destroy (message);
+    }
+
+  DONE:
+    notmuch_query_destroy (query);
+    return status;
+}
+
+notmuch_status_t
+notmuch_database_roll_archive (notmuch_database_t *notmuch,
+			       const char *name,
+			       const char *query_string,
+			       unsigned int *count)
+{
+    std::vector<_archived_message_t> messages;
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status, ret;
+    char *dir_path, *path, *tmp_path;
+    struct stat st;
+
+    if (count)
+	*count = 0;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    if (name == NULL || query_string == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    /* The shard is committed on its own, so it cannot be part of a
+     * larger atomic section. */
+    if (notmuch->atomic_nesting)
+	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
+
+    if (*name == '\0' || *name == '.' || strchr (name, '/')) {
+	_notmuch_database_log (notmuch, "Invalid archive shard name: %s\n",
+			       name);
+	return NOTMUCH_STATUS_PATH_ERROR;
+    }
+
+    dir_path = _archive_dir (notmuch, notmuch);
+    path = talloc_asprintf (dir_path, "%s/%s", dir_path, name);
+    tmp_path = talloc_asprintf (dir_path, "%s/.%s.tmp", dir_path, name);
+
+    if (stat (path, &st) == 0) {
+	_notmuch_database_log (notmuch, "An archive shard named %s already exists.\n",
+			       name);
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    if (mkdir (dir_path, 0755) && errno != EEXIST) {
+	_notmuch_database_log (notmuch, "Error creating %s: %s\n",
+			       dir_path, strerror (errno));
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    status = _archive_find_messages (notmuch, query_string, messages);
+    if (status || messages.empty ())
+	goto DONE;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    try {
+	/* Write the shard aside, so that a roll that is interrupted
+	 * leaves nothing for readers to open. */
+	Xapian::WritableDatabase shard (tmp_path,
+					Xapian::DB_CREATE_OR_OVERWRITE);
+
+	for (size_t i = 0; i < messages.size (); i++)
+	    shard.add_document (db->get_document (messages[i].doc_id));
+	shard.commit ();
+	shard.close ();
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred writing archive shard %s: %s\n",
+			       name, error.get_msg ().c_str ());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	goto DONE;
+    }
+
+    /* From here on, the messages are in the shard.  If the database
+     * cannot be changed below, readers see them twice until the
+     * messages are removed by hand. */
+    if (rename (tmp_path, path)) {
+	_notmuch_database_log (notmuch, "Error renaming %s to %s: %s\n",
+			       tmp_path, path, strerror (errno));
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status)
+	goto DONE;
+
+    try {
+	for (size_t i = 0; i < messages.size (); i++) {
+	    db->delete_document (messages[i].doc_id);
+	    _notmuch_database_forget_message_id (
+		notmuch, messages[i].message_id.c_str ());
+	    _notmuch_database_invalidate_thread_summary (
+		notmuch, messages[i].thread_id.c_str ());
+	}
+
+	_archive_add_shard (notmuch, name);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred removing archived messages: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    /* Even a partial removal leaves fewer duplicates behind. */
+    ret = notmuch_database_end_atomic (notmuch);
+    if (status == NOTMUCH_STATUS_SUCCESS)
+	status = ret;
+    if (status == NOTMUCH_STATUS_SUCCESS && count)
+	*count = messages.size ();
+
+  DONE:
+    talloc_free (dir_path);
+    return status;
+}
@@ -0,0 +1,520 @@
+/* async-query.cc - Thread searches run on a thread of their own
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* An asynchronous search runs notmuch_query_search_threads_st for a
+ * copy of the caller's query on a worker thread, with a read-only
+ * handle of its own on the database, as the workers of
+ * notmuch_threads_set_jobs do.  Nothing the worker allocates from its
+ * handle reaches the caller: each thread found is copied into a batch
+ * of plain strings and numbers, and the finished batches are queued
+ * for the caller, who is told of them through a pipe.
+ *
+ * The batches being filled are allocated under 'pending', and taken
+ * from it into the search by the caller, both under the lock, since
+ * talloc does no locking of its own.  Everything else below a batch
+ * is only touched by one thread at a time: the worker's until it is
+ * queued, the caller's from then on. */
+
+typedef struct {
+    const char *thread_id;
+    const char *subject;
+    const char *authors;
+    int matched_messages;
+    int total_messages;
+    time_t oldest;
+    time_t newest;
+    notmuch_string_list_t *tags;
+} _notmuch_async_thread_t;
+
+struct _notmuch_async_threads {
+    _notmuch_async_thread_t *threads;
+    unsigned int count;
+    unsigned int position;
+    struct _notmuch_async_threads *next;
+};
+
+struct _notmuch_async_search {
+#if HAVE_PTHREAD
+    pthread_t thread;
+    pthread_mutex_t lock;
+#endif
+    notmuch_bool_t started;
+
+    /* The worker's handle on the database, and its copy of the
+     * query, which watches 'cancel'. */
+    notmuch_database_t *notmuch;
+    notmuch_query_t *query;
+    unsigned int batch_size;
+    volatile int cancel;
+
+    /* The worker writes a byte to fds[1] whenever it queues a batch
+     * and when it finishes; both ends are non-blocking. */
+    int fds[2];
+
+    /* Under the lock: the parent of the batches being filled, the
+     * batches queued, oldest first, and once 'finished' is set, how
+     * the search ended. */
+    void *pending;
+    notmuch_async_threads_t *head;
+    notmuch_async_threads_t **tail;
+    notmuch_bool_t finished;
+    notmuch_status_t status;
+};
+
+#if HAVE_PTHREAD
+static void
+_async_search_signal (notmuch_async_search_t *search)
+{
+    /* A full pipe is readable already, so the byte is not needed. */
+    IGNORE_RESULT (write (search->fds[1], "", 1));
+}
+
+static notmuch_async_threads_t *
+_async_batch_create (notmuch_async_search_t *search)
+{
+    notmuch_async_threads_t *batch;
+
+    pthread_mutex_lock (&search->lock);
+    batch = talloc_zero (search->pending, notmuch_async_threads_t);
+    pthread_mutex_unlock (&search->lock);
+    if (unlikely (batch == NULL))
+	return NULL;
+
+    batch->threads = talloc_array (batch, _notmuch_async_thread_t,
+				   search->batch_size);
+    if (unlikely (batch->threads == NULL))
+	return NULL;
+
+    return batch;
+}
+
+static notmuch_status_t
+_async_batch_add (notmuch_async_threads_t *batch, notmuch_thread_t *thread)
+{
+    _notmuch_async_thread_t *copy = &batch->threads[batch->count];
+    const char *subject = notmuch_thread_get_subject (thread);
+    const char *authors = notmuch_thread_get_authors (thread);
+    notmuch_tags_t *tags;
+
+    copy->thread_id = talloc_strdup (batch,
+				     notmuch_thread_get_thread_id (thread));
+    copy->subject = subject ? talloc_strdup (batch, subject) : NULL;
+    copy->authors = authors ? talloc_strdup (batch, authors) : NULL;
+    copy->matched_messages = notmuch_thread_get_matched_messages (thread);
+    copy->total_messages = notmuch_thread_get_total_messages (thread);
+    copy->oldest = notmuch_thread_get_oldest_date (thread);
+    copy->newest = notmuch_thread_get_newest_date (thread);
+    copy->tags = _notmuch_string_list_create (batch);
+    if (unlikely (copy->thread_id == NULL || copy->tags == NULL ||
+		  (subject && copy->subject == NULL) ||
+		  (authors && copy->authors == NULL)))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    for (tags = notmuch_thread_get_tags (thread);
+	 notmuch_tags_valid (tags);
+	 notmuch_tags_move_to_next (tags))
+	_notmuch_string_list_append (copy->tags, notmuch_tags_get (tags));
+    notmuch_tags_destroy (tags);
+
+    batch->count++;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+static void
+_async_batch_queue (notmuch_async_search_t *search,
+		    notmuch_async_threads_t *batch)
+{
+    pthread_mutex_lock (&search->lock);
+    *search->tail = batch;
+    search->tail = &batch->next;
+    pthread_mutex_unlock (&search->lock);
+
+    _async_search_signal (search);
+}
+
+static void *
+_async_search_worker (void *closure)
+{
+    notmuch_async_search_t *search = (notmuch_async_search_t *) closure;
+    notmuch_async_threads_t *batch = NULL;
+    notmuch_threads_t *threads;
+    notmuch_status_t status;
+
+    status = notmuch_query_search_threads_st (search->query, &threads);
+    if (status)
+	goto DONE;
+
+    for (;
+	 notmuch_threads_valid (threads) && ! search->cancel;
+	 notmuch_threads_move_to_next (threads))
+    {
+	notmuch_thread_t *thread = notmuch_threads_get (threads);
+
+	if (thread == NULL)
+	    continue;
+
+	if (batch == NULL)
+	    batch = _async_batch_create (search);
+	status = batch ? _async_batch_add (batch, thread)
+	    : NOTMUCH_STATUS_OUT_OF_MEMORY;
+	notmuch_thread_destroy (thread);
+	if (status)
+	    break;
+
+	if (batch->count == search->batch_size) {
+	    _async_batch_queue (search, batch);
+	    batch = NULL;
+	}
+    }
+
+    if (status == NOTMUCH_STATUS_SUCCESS)
+	status = search->cancel ? NOTMUCH_STATUS_QUERY_INTERRUPTED
+	    : notmuch_query_get_status (search->query);
+
+    notmuch_threads_destroy (threads);
+
+  DONE:
+    if (batch && batch->count)
+	_async_batch_queue (search, batch);
+
+    pthread_mutex_lock (&search->lock);
+    search->status = status;
+    search->finished = TRUE;
+    pthread_mutex_unlock (&search->lock);
+
+    _async_search_signal (search);
+
+    return NULL;
+}
+
+static int
+_notmuch_async_search_destructor (notmuch_async_search_t *search)
+{
+    search->cancel = 1;
+    if (search->started)
+	pthread_join (search->thread, NULL);
+
+    if (search->notmuch)
+	notmuch_database_destroy (search->notmuch);
+
+    if (search->fds[0] >= 0)
+	close (search->fds[0]);
+    if (search->fds[1] >= 0)
+	close (search->fds[1]);
+
+    pthread_mutex_destroy (&search->lock);
+
+    return 0;
+}
+
+static notmuch_bool_t
+_set_nonblocking (int fd)
+{
+    int flags = fcntl (fd, F_GETFL);
+
+    return flags >= 0 && fcntl (fd, F_SETFL, flags | O_NONBLOCK) == 0 &&
+	fcntl (fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+#endif
+
+notmuch_status_t
+notmuch_query_search_threads_async (notmuch_query_t *query,
+				    unsigned int batch_size,
+				    notmuch_async_search_t **search_out)
+{
+#if HAVE_PTHREAD
+    notmuch_database_t *notmuch;
+    notmuch_async_search_t *search;
+    char *status_string = NULL;
+    notmuch_status_t status;
+    int err;
+
+    if (query == NULL || search_out == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    *search_out = NULL;
+    notmuch = notmuch_query_get_database (query);
+
+    search = talloc_zero (query, notmuch_async_search_t);
+    if (unlikely (search == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    search->fds[0] = search->fds[1] = -1;
+    search->batch_size = batch_size ? batch_size : 1;
+    search->tail = &search->head;
+    pthread_mutex_init (&search->lock, NULL);
+    talloc_set_destructor (search, _notmuch_async_search_destructor);
+
+    search->pending = talloc_new (search);
+    if (unlikely (search->pending == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto FAIL;
+    }
+
+    if (pipe (search->fds) ||
+	! _set_nonblocking (search->fds[0]) ||
+	! _set_nonblocking (search->fds[1])) {
+	_notmuch_database_log (notmuch, "Error creating a pipe for an asynchronous search: %s\n",
+			       strerror (errno));
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto FAIL;
+    }
+
+    status = notmuch_database_open_verbose (notmuch_database_get_path (notmuch),
+					    NOTMUCH_DATABASE_MODE_READ_ONLY,
+					    &search->notmuch, &status_string);
+    if (status) {
+	if (status_string) {
+	    _notmuch_database_log (notmuch, "%s", status_string);
+	    free (status_string);
+	}
+	search->notmuch = NULL;
+	goto FAIL;
+    }
+
+    search->query = _notmuch_query_copy (search->notmuch, query);
+    if (unlikely (search->query == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto FAIL;
+    }
+    notmuch_query_set_cancel (search->query, &search->cancel);
+
+    /* pthread_create returns its error rather than setting errno. */
+    err = pthread_create (&search->thread, NULL, _async_search_worker, search);
+    if (err) {
+	_notmuch_database_log (notmuch, "Error starting an asynchronous search: %s\n",
+			       strerror (err));
+	status = (err == ENOMEM || err == EAGAIN) ?
+	    NOTMUCH_STATUS_OUT_OF_MEMORY : NOTMUCH_STATUS_FILE_ERROR;
+	goto FAIL;
+    }
+    search->started = TRUE;
+
+    *search_out = search;
+    return NOTMUCH_STATUS_SUCCESS;
+
+  FAIL:
+    talloc_free (search);
+    return status;
+#else
+    (void) query;
+    (void) batch_size;
+
+    if (search_out)
+	*search_out = NULL;
+
+    return NOTMUCH_STATUS_UNSUPPORTED_OPERATION;
+#endif
+}
+
+int
+notmuch_async_search_get_fd (notmuch_async_search_t *search)
+{
+    return search->fds[0];
+}
+
+notmuch_status_t
+notmuch_async_search_next (notmuch_async_search_t *search,
+			   notmuch_async_threads_t **threads)
+{
+    notmuch_async_threads_t *batch;
+    char buf[64];
+
+    if (threads == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    /* Drain the pipe before looking at the queue, so that a batch
+     * queued from now on leaves the pipe readable. */
+    while (read (search->fds[0], buf, sizeof (buf)) > 0)
+	;
+
+#if HAVE_PTHREAD
+    pthread_mutex_lock (&search->lock);
+#endif
+    batch = search->head;
+    if (batch) {
+	search->head = batch->next;
+	if (search->head == NULL)
+	    search->tail = &search->head;
+	batch->next = NULL;
+	talloc_steal (search, batch);
+    }
+#if HAVE_PTHREAD
+    pthread_mutex_unlock (&search->lock);
+#endif
+
+    *threads = batch;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_bool_t
+notmuch_async_search_finished (notmuch_async_search_t *search)
+{
+    notmuch_bool_t finished;
+
+#if HAVE_PTHREAD
+    pthread_mutex_lock (&search->lock);
+#endif
+    finished = search->finished && search->head == NULL;
+#if HAVE_PTHREAD
+    pthread_mutex_unlock (&search->lock);
+#endif
+
+    return finished;
+}
+
+notmuch_status_t
+notmuch_async_search_get_status (notmuch_async_search_t *search)
+{
+    notmuch_status_t status;
+
+#if HAVE_PTHREAD
+    pthread_mutex_lock (&search->lock);
+#endif
+    status = search->status;
+#if HAVE_PTHREAD
+    pthread_mutex_unlock (&search->lock);
+#endif
+
+    return status;
+}
+
+void
+notmuch_async_search_cancel (notmuch_async_search_t *search)
+{
+    search->cancel = 1;
+}
+
+void
+notmuch_async_search_destroy (notmuch_async_search_t *search)
+{
+    talloc_free (search);
+}
+
+static _notmuch_async_thread_t *
+_async_threads_current (notmuch_async_threads_t *threads)
+{
+    if (threads == NULL || threads->position >= threads->count)
+	return NULL;
+
+    return &threads->threads[threads->position];
+}
+
+notmuch_bool_t
+notmuch_async_threads_valid (notmuch_async_threads_t *threads)
+{
+    return _async_threads_current (threads) != NULL;
+}
+
+void
+notmuch_async_threads_move_to_next (notmuch_async_threads_t *threads)
+{
+    if (_async_threads_current (threads))
+	threads->position++;
+}
+
+const char *
+notmuch_async_threads_get_thread_id (notmuch_async_threads_t *threads)
+{
+    _notmuch_async_thread_t *thread = _async_threads_current (threads);
+
+    return thread ? thread->thread_id : NULL;
+}
+
+const char *
+notmuch_async_threads_get_subject (notmuch_async_threads_t *threads)
+{
+    _notmuch_async_thread_t *thread = _async_threads_current (threads);
+
+    return thread ? thread->subject : NULL;
+}
+
+const char *
+notmuch_async_threads_get_authors (notmuch_async_threads_t *threads)
+{
+    _notmuch_async_thread_t *thread = _async_threads_current (threads);
+
+    return thread ? thread->authors : NULL;
+}
+
+int
+notmuch_async_threads_get_matched_messages (notmuch_async_threads_t *threads)
+{
+    _notmuch_async_thread_t *thread = _async_threads_current (threads);
+
+    return thread ? thread->matched_messages : 0;
+}
+
+int
+notmuch_async_threads_get_total_messages (notmuch_async_threads_t *threads)
+{
+    _notmuch_async_thread_t *thread = _async_threads_current (threads);
+
+    return thread ? thread->total_messages : 0;
+}
+
+time_t
+notmuch_async_threads_get_oldest_date (notmuch_async_threads_t *threads)
+{
+    _notmuch_async_thread_t *thread = _async_threads_current (threads);
+
+    return thread ? thread->oldest : 0;
+}
+
+time_t
+notmuch_async_threads_get_newest_date (notmuch_async_threads_t *threads)
+{
+    _notmuch_async_thread_t *thread = _async_threads_current (threads);
+
+    return thread ? thread->newest : 0;
+}
+
+notmuch_tags_t *
+notmuch_async_threads_get_tags (notmuch_async_threads_t *threads)
+{
+    _notmuch_async_thread_t *thread = _async_threads_current (threads);
+    notmuch_string_list_t *tags;
+    notmuch_string_node_t *node;
+
+    if (thread == NULL)
+	return NULL;
+
+    /* The iterator takes the list it is given. */
+    tags = _notmuch_string_list_create (threads);
+    if (unlikely (tags == NULL))
+	return NULL;
+    for (node = thread->tags->head; node; node = node->next)
+	_notmuch_string_list_append (tags, node->string);
+
+    return _notmuch_tags_create (threads, tags);
+}
+
+void
+notmuch_async_threads_destroy (notmuch_async_threads_t *threads)
+{
+    talloc_free (threads);
+}
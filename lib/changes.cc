@@ -0,0 +1,352 @@
+/* changes.cc - The messages changed since a database revision
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+/* Messages record the revision of their last change in
+ * NOTMUCH_VALUE_LAST_MOD, so the messages changed since a revision
+ * are found by a range over that value.  A removed message leaves a
+ * tombstone in the database metadata:
+ *
+ *	tombstone_<message-id>	<revision> <thread-id>
+ *
+ * and the highest revision given to a tombstone is kept in
+ * last_tombstone, as no document value records it.  A tombstone is
+ * ignored once its message has been added again.
+ */
+
+typedef struct _notmuch_tombstone {
+    unsigned long revision;
+    char *message_id;
+    char *thread_id;
+} notmuch_tombstone_t;
+
+struct _notmuch_changes {
+    notmuch_database_t *notmuch;
+    /* The messages changed, by increasing revision. */
+    Xapian::MSet mset;
+    Xapian::MSetIterator iterator;
+    Xapian::MSetIterator iterator_end;
+    /* The tombstones, by increasing revision. */
+    notmuch_tombstone_t *tombstones;
+    size_t num_tombstones;
+    size_t tombstone;
+    /* The message at iterator, kept while earlier tombstones are
+     * walked, and its revision. */
+    notmuch_message_t *message;
+    unsigned long message_revision;
+    /* TRUE if the current change is the tombstone at 'tombstone'
+     * rather than 'message'. */
+    notmuch_bool_t deleted;
+};
+
+void
+_notmuch_database_add_tombstone (notmuch_database_t *notmuch,
+				 const char *message_id,
+				 const char *thread_id)
+{
+    Xapian::WritableDatabase *db;
+    unsigned long revision;
+    char *value;
+
+    revision = _notmuch_database_new_revision (notmuch);
+    value = talloc_asprintf (notmuch, "%lu %s", revision, thread_id);
+
+    /* Callers are already inside Xapian try blocks of their own. */
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    db->set_metadata (NOTMUCH_METADATA_TOMBSTONE_PREFIX +
+		      std::string (message_id), value);
+    db->set_metadata (NOTMUCH_METADATA_LAST_TOMBSTONE,
+		      Xapian::sortable_serialise (revision));
+
+    talloc_free (value);
+}
+
+unsigned long
+_notmuch_database_get_last_tombstone (notmuch_database_t *notmuch)
+{
+    std::string last = notmuch->xapian_db->get_metadata (
+	NOTMUCH_METADATA_LAST_TOMBSTONE);
+
+    if (last.empty ())
+	return 0;
+
+    return Xapian::sortable_unserialise (last);
+}
+
+static int
+_compare_tombstones (const void *a, const void *b)
+{
+    const notmuch_tombstone_t *x = (const notmuch_tombstone_t *) a;
+    const notmuch_tombstone_t *y = (const notmuch_tombstone_t *) b;
+
+    if (x->revision != y->revision)
+	return x->revision < y->revision ? -1 : 1;
+    return strcmp (x->message_id, y->message_id);
+}
+
+/* Return TRUE if 'message_id' names a message that is in the database
+ * again. */
+static notmuch_bool_t
+_message_exists (notmuch_database_t *notmuch, const char *message_id)
+{
+    notmuch_message_t *message;
+    notmuch_bool_t exists;
+
+    if (notmuch_database_find_message (notmuch, message_id, &message) ||
+	message == NULL)
+	return FALSE;
+
+    exists = ! notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_GHOST);
+    notmuch_message_destroy (message);
+
+    return exists;
+}
+
+/* Read the tombstones of revisions after 'since'.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static notmuch_status_t
+_changes_read_tombstones (notmuch_changes_t *changes, unsigned long since)
+{
+    notmuch_database_t *notmuch = changes->notmuch;
+    const std::string prefix = NOTMUCH_METADATA_TOMBSTONE_PREFIX;
+    Xapian::TermIterator i, end;
+    size_t size = 0;
+
+    end = notmuch->xapian_db->metadata_keys_end (prefix);
+    for (i = notmuch->xapian_db->metadata_keys_begin (prefix); i != end; i++) {
+	std::string value = notmuch->xapian_db->get_metadata (*i);
+	const char *message_id = (*i).c_str () + prefix.size ();
+	notmuch_tombstone_t *tombstone;
+	unsigned long revision;
+	char *thread_id;
+
+	revision = strtoul (value.c_str (), &thread_id, 10);
+	if (revision <= since || *thread_id != ' ')
+	    continue;
+
+	if (_message_exists (notmuch, message_id))
+	    continue;
+
+	if (changes->num_tombstones == size) {
+	    size = size ? 2 * size : 16;
+	    changes->tombstones = talloc_realloc (changes, changes->tombstones,
+						  notmuch_tombstone_t, size);
+	    if (unlikely (changes->tombstones == NULL))
+		return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	}
+
+	tombstone = &changes->tombstones[changes->num_tombstones++];
+	tombstone->revision = revision;
+	tombstone->message_id = talloc_strdup (changes->tombstones,
+					       message_id);
+	tombstone->thread_id = talloc_strdup (changes->tombstones,
+					      thread_id + 1);
+	if (unlikely (tombstone->message_id == NULL ||
+		      tombstone->thread_id == NULL))
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    if (changes->num_tombstones)
+	qsort (changes->tombstones, changes->num_tombstones,
+	       sizeof (notmuch_tombstone_t), _compare_tombstones);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Point 'changes' at the earliest of its next message and its next
+ * tombstone. */
+static void
+_changes_load (notmuch_changes_t *changes)
+{
+    notmuch_tombstone_t *tombstone = NULL;
+
+    try {
+	while (changes->message == NULL &&
+	       changes->iterator != changes->iterator_end) {
+	    changes->message = _notmuch_message_create (changes,
+							changes->notmuch,
+							*changes->iterator,
+							NULL);
+	    if (changes->message)
+		changes->message_revision =
+		    _notmuch_message_get_revision (changes->message);
+	    else
+		changes->iterator++;
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (changes->notmuch,
+			       "A Xapian exception occurred reading changes: %s\n",
+			       error.get_msg ().c_str ());
+	changes->notmuch->exception_reported = TRUE;
+	changes->iterator = changes->iterator_end;
+    }
+
+    if (changes->tombstone < changes->num_tombstones)
+	tombstone = &changes->tombstones[changes->tombstone];
+
+    changes->deleted = tombstone &&
+	(changes->message == NULL ||
+	 tombstone->revision < changes->message_revision);
+}
+
+static int
+_notmuch_changes_destructor (notmuch_changes_t *changes)
+{
+    changes->iterator.~MSetIterator ();
+    changes->iterator_end.~MSetIterator ();
+    changes->mset.~MSet ();
+
+    return 0;
+}
+
+notmuch_status_t
+notmuch_database_get_changes (notmuch_database_t *notmuch,
+			      unsigned long since,
+			      notmuch_changes_t **changes_out)
+{
+    notmuch_changes_t *changes;
+    notmuch_status_t status;
+
+    *changes_out = NULL;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD))
+	return NOTMUCH_STATUS_UPGRADE_REQUIRED;
+
+    changes = talloc_zero (notmuch, notmuch_changes_t);
+    if (unlikely (changes == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    changes->notmuch = notmuch;
+    new (&changes->mset) Xapian::MSet ();
+    new (&changes->iterator) Xapian::MSetIterator ();
+    new (&changes->iterator_end) Xapian::MSetIterator ();
+    talloc_set_destructor (changes, _notmuch_changes_destructor);
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::Query query (
+	    Xapian::Query::OP_FILTER,
+	    Xapian::Query (std::string (NOTMUCH_PREFIX_TYPE) + "mail"),
+	    Xapian::Query (Xapian::Query::OP_VALUE_GE, NOTMUCH_VALUE_LAST_MOD,
+			   Xapian::sortable_serialise (since + 1)));
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_sort_by_value (NOTMUCH_VALUE_LAST_MOD, FALSE);
+	enquire.set_query (query);
+
+	changes->mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+	changes->iterator = changes->mset.begin ();
+	changes->iterator_end = changes->mset.end ();
+
+	status = _changes_read_tombstones (changes, since);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred reading changes: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    if (status) {
+	talloc_free (changes);
+	return status;
+    }
+
+    _changes_load (changes);
+
+    *changes_out = changes;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_bool_t
+notmuch_changes_valid (notmuch_changes_t *changes)
+{
+    return changes->deleted || changes->message != NULL;
+}
+
+void
+notmuch_changes_move_to_next (notmuch_changes_t *changes)
+{
+    if (changes->deleted) {
+	changes->tombstone++;
+    } else if (changes->message) {
+	notmuch_message_destroy (changes->message);
+	changes->message = NULL;
+	changes->iterator++;
+    } else {
+	return;
+    }
+
+    _changes_load (changes);
+}
+
+unsigned long
+notmuch_changes_get_revision (notmuch_changes_t *changes)
+{
+    if (changes->deleted)
+	return changes->tombstones[changes->tombstone].revision;
+    if (changes->message)
+	return changes->message_revision;
+    return 0;
+}
+
+notmuch_bool_t
+notmuch_changes_get_deleted (notmuch_changes_t *changes)
+{
+    return changes->deleted;
+}
+
+const char *
+notmuch_changes_get_message_id (notmuch_changes_t *changes)
+{
+    if (changes->deleted)
+	return changes->tombstones[changes->tombstone].message_id;
+    if (changes->message)
+	return notmuch_message_get_message_id (changes->message);
+    return NULL;
+}
+
+const char *
+notmuch_changes_get_thread_id (notmuch_changes_t *changes)
+{
+    if (changes->deleted)
+	return changes->tombstones[changes->tombstone].thread_id;
+    if (changes->message)
+	return notmuch_message_get_thread_id (changes->message);
+    return NULL;
+}
+
+notmuch_tags_t *
+notmuch_changes_get_tags (notmuch_changes_t *changes)
+{
+    if (changes->deleted || changes->message == NULL)
+	return NULL;
+
+    return notmuch_message_get_tags (changes->message);
+}
+
+void
+notmuch_changes_destroy (notmuch_changes_t *changes)
+{
+    talloc_free (changes);
+}
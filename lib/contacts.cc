@@ -0,0 +1,428 @@
+/* contacts.cc - The addresses seen in messages, for completion
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+/* With NOTMUCH_FEATURE_CONTACTS, every address in the From, To, Cc or
+ * Bcc header of a message has a record in the database metadata,
+ * keyed on the address in lower case:
+ *
+ *	contact_<address>	<sent> <received> <last seen>
+ *				<count> <name>
+ *				...
+ *
+ * where <sent> counts the messages from the address, <received> those
+ * to it, <last seen> is the newest date of any of them, and each
+ * further line counts the messages giving the address a display name.
+ * Writers update the records in the transaction that adds or removes
+ * the message, so that listing the contacts for completion is a scan
+ * over the keys with a prefix, instead of a pass over every message.
+ * A record goes away with the last message naming its address; the
+ * last-seen date is not brought back by removals. */
+
+/* Longer addresses would not fit in a metadata key, and are unlikely
+ * to be completed. */
+#define NOTMUCH_CONTACT_ADDRESS_MAX \
+    (200 - sizeof (NOTMUCH_METADATA_CONTACT_PREFIX))
+
+typedef struct {
+    unsigned int sent;
+    unsigned int received;
+    long last_seen;
+    std::map<std::string, unsigned int> names;
+} _contact_record_t;
+
+/* How one message uses an address. */
+typedef struct {
+    bool sent;
+    bool received;
+    std::set<std::string> names;
+} _contact_use_t;
+
+typedef std::map<std::string, _contact_use_t> _contact_uses_t;
+
+typedef struct _notmuch_contact {
+    char *address;
+    char *name;
+    unsigned int sent;
+    unsigned int received;
+    time_t last_seen;
+} notmuch_contact_t;
+
+struct _notmuch_contacts {
+    notmuch_contact_t *contacts;
+    size_t count;
+    size_t position;
+};
+
+static std::string
+_contact_key (const char *address)
+{
+    char *lower = g_ascii_strdown (address, -1);
+    std::string key = std::string (NOTMUCH_METADATA_CONTACT_PREFIX) + lower;
+
+    g_free (lower);
+    return key;
+}
+
+static void
+_contact_record_parse (const std::string &value, _contact_record_t &record)
+{
+    const char *line = value.c_str ();
+    const char *end;
+
+    record.sent = record.received = 0;
+    record.last_seen = 0;
+    record.names.clear ();
+
+    if (sscanf (line, "%u %u %ld", &record.sent, &record.received,
+		&record.last_seen) != 3)
+	return;
+
+    for (line = strchr (line, '\n'); line; line = end) {
+	unsigned int count;
+	int name = 0;
+
+	line++;
+	end = strchr (line, '\n');
+	if (sscanf (line, "%u %n", &count, &name) == 1 && name)
+	    record.names[std::string (line + name,
+				      end ? end - line - name
+					  : strlen (line + name))] = count;
+    }
+}
+
+static std::string
+_contact_record_format (const _contact_record_t &record)
+{
+    std::map<std::string, unsigned int>::const_iterator i;
+    char buf[64];
+    std::string value;
+
+    snprintf (buf, sizeof (buf), "%u %u %ld", record.sent, record.received,
+	      record.last_seen);
+    value = buf;
+    for (i = record.names.begin (); i != record.names.end (); i++) {
+	snprintf (buf, sizeof (buf), "\n%u ", i->second);
+	value += buf;
+	value += i->first;
+    }
+
+    return value;
+}
+
+static void
+_contact_uses_add_list (_contact_uses_t &uses, InternetAddressList *list,
+			bool sent)
+{
+    int i;
+
+    for (i = 0; i < internet_address_list_length (list); i++) {
+	InternetAddress *address = internet_address_list_get_address (list, i);
+
+	if (INTERNET_ADDRESS_IS_GROUP (address)) {
+	    InternetAddressList *members = internet_address_group_get_members (
+		INTERNET_ADDRESS_GROUP (address));
+
+	    if (members)
+		_contact_uses_add_list (uses, members, sent);
+	} else {
+	    const char *addr = internet_address_mailbox_get_addr (
+		INTERNET_ADDRESS_MAILBOX (address));
+	    const char *name = internet_address_get_name (address);
+	    _contact_use_t *use;
+
+	    if (addr == NULL || *addr == '\0' ||
+		strlen (addr) > NOTMUCH_CONTACT_ADDRESS_MAX ||
+		strchr (addr, '\n'))
+		continue;
+
+	    use = &uses[_contact_key (addr)];
+	    if (sent)
+		use->sent = true;
+	    else
+		use->received = true;
+	    if (name && *name && ! strchr (name, '\n'))
+		use->names.insert (name);
+	}
+    }
+}
+
+static void
+_contact_uses_add_header (_contact_uses_t &uses, const char *header,
+			  bool sent)
+{
+    InternetAddressList *list;
+
+    if (header == NULL || *header == '\0')
+	return;
+
+    list = internet_address_list_parse_string (header);
+    if (list == NULL)
+	return;
+
+    _contact_uses_add_list (uses, list, sent);
+    g_object_unref (list);
+}
+
+void
+_notmuch_database_update_contacts (notmuch_database_t *notmuch,
+				   const char *from,
+				   const char *to,
+				   const char *cc,
+				   const char *bcc,
+				   time_t date,
+				   int delta)
+{
+    Xapian::WritableDatabase *db;
+    _contact_uses_t uses;
+    _contact_uses_t::iterator i;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_CONTACTS))
+	return;
+
+    _contact_uses_add_header (uses, from, true);
+    _contact_uses_add_header (uses, to, false);
+    _contact_uses_add_header (uses, cc, false);
+    _contact_uses_add_header (uses, bcc, false);
+
+    /* Callers are already inside Xapian try blocks of their own. */
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    for (i = uses.begin (); i != uses.end (); i++) {
+	const _contact_use_t &use = i->second;
+	std::set<std::string>::const_iterator name;
+	_contact_record_t record;
+
+	_contact_record_parse (db->get_metadata (i->first), record);
+
+	if (delta > 0) {
+	    record.sent += use.sent;
+	    record.received += use.received;
+	    if (date > record.last_seen)
+		record.last_seen = date;
+	    for (name = use.names.begin (); name != use.names.end (); name++)
+		record.names[*name]++;
+	} else {
+	    /* Messages counted before the table existed (in archive
+	     * shards, say) are not there to take away. */
+	    if (use.sent && record.sent)
+		record.sent--;
+	    if (use.received && record.received)
+		record.received--;
+	    for (name = use.names.begin (); name != use.names.end (); name++) {
+		std::map<std::string, unsigned int>::iterator n =
+		    record.names.find (*name);
+
+		if (n != record.names.end () && --n->second == 0)
+		    record.names.erase (n);
+	    }
+	}
+
+	if (record.sent == 0 && record.received == 0)
+	    db->set_metadata (i->first, "");
+	else
+	    db->set_metadata (i->first, _contact_record_format (record));
+    }
+}
+
+void
+_notmuch_database_clear_contacts (notmuch_database_t *notmuch)
+{
+    Xapian::WritableDatabase *db =
+	static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    std::vector<std::string> keys;
+    Xapian::TermIterator i, end;
+
+    end = db->metadata_keys_end (NOTMUCH_METADATA_CONTACT_PREFIX);
+    for (i = db->metadata_keys_begin (NOTMUCH_METADATA_CONTACT_PREFIX);
+	 i != end; i++)
+	keys.push_back (*i);
+
+    for (size_t j = 0; j < keys.size (); j++)
+	db->set_metadata (keys[j], "");
+}
+
+/* The most common display name of 'record', or NULL for none. */
+static const char *
+_contact_record_name (const _contact_record_t &record)
+{
+    std::map<std::string, unsigned int>::const_iterator i, best;
+
+    best = record.names.end ();
+    for (i = record.names.begin (); i != record.names.end (); i++) {
+	if (best == record.names.end () || i->second > best->second)
+	    best = i;
+    }
+
+    return best == record.names.end () ? NULL : best->first.c_str ();
+}
+
+notmuch_status_t
+notmuch_database_get_contacts (notmuch_database_t *notmuch,
+			       const char *prefix,
+			       notmuch_contacts_t **contacts_out)
+{
+    notmuch_contacts_t *contacts;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    size_t size = 0;
+
+    if (contacts_out == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    *contacts_out = NULL;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_CONTACTS))
+	return NOTMUCH_STATUS_UPGRADE_REQUIRED;
+
+    contacts = talloc_zero (notmuch, notmuch_contacts_t);
+    if (unlikely (contacts == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    try {
+	std::string key_prefix = _contact_key (prefix ? prefix : "");
+	Xapian::TermIterator i, end;
+
+	end = notmuch->xapian_db->metadata_keys_end (key_prefix);
+	for (i = notmuch->xapian_db->metadata_keys_begin (key_prefix);
+	     i != end; i++) {
+	    _contact_record_t record;
+	    notmuch_contact_t *contact;
+	    const char *name;
+
+	    _contact_record_parse (notmuch->xapian_db->get_metadata (*i),
+				   record);
+	    if (record.sent == 0 && record.received == 0)
+		continue;
+
+	    if (contacts->count == size) {
+		size = size ? 2 * size : 16;
+		contacts->contacts = talloc_realloc (contacts,
+						     contacts->contacts,
+						     notmuch_contact_t, size);
+		if (unlikely (contacts->contacts == NULL)) {
+		    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		    break;
+		}
+	    }
+
+	    contact = &contacts->contacts[contacts->count++];
+	    contact->address = talloc_strdup (
+		contacts, (*i).c_str () + strlen (NOTMUCH_METADATA_CONTACT_PREFIX));
+	    name = _contact_record_name (record);
+	    contact->name = name ? talloc_strdup (contacts, name) : NULL;
+	    contact->sent = record.sent;
+	    contact->received = record.received;
+	    contact->last_seen = record.last_seen;
+	    if (unlikely (contact->address == NULL ||
+			  (name && contact->name == NULL))) {
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		break;
+	    }
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred reading contacts: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    if (status) {
+	talloc_free (contacts);
+	return status;
+    }
+
+    *contacts_out = contacts;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_bool_t
+notmuch_contacts_valid (notmuch_contacts_t *contacts)
+{
+    return contacts && contacts->position < contacts->count;
+}
+
+void
+notmuch_contacts_move_to_next (notmuch_contacts_t *contacts)
+{
+    if (contacts->position < contacts->count)
+	contacts->position++;
+}
+
+static notmuch_contact_t *
+_contacts_current (notmuch_contacts_t *contacts)
+{
+    if (! notmuch_contacts_valid (contacts))
+	return NULL;
+
+    return &contacts->contacts[contacts->position];
+}
+
+const char *
+notmuch_contacts_get_address (notmuch_contacts_t *contacts)
+{
+    notmuch_contact_t *contact = _contacts_current (contacts);
+
+    return contact ? contact->address : NULL;
+}
+
+const char *
+notmuch_contacts_get_name (notmuch_contacts_t *contacts)
+{
+    notmuch_contact_t *contact = _contacts_current (contacts);
+
+    return contact ? contact->name : NULL;
+}
+
+unsigned int
+notmuch_contacts_get_sent (notmuch_contacts_t *contacts)
+{
+    notmuch_contact_t *contact = _contacts_current (contacts);
+
+    return contact ? contact->sent : 0;
+}
+
+unsigned int
+notmuch_contacts_get_received (notmuch_contacts_t *contacts)
+{
+    notmuch_contact_t *contact = _contacts_current (contacts);
+
+    return contact ? contact->received : 0;
+}
+
+time_t
+notmuch_contacts_get_last_seen (notmuch_contacts_t *contacts)
+{
+    notmuch_contact_t *contact = _contacts_current (contacts);
+
+    return contact ? contact->last_seen : 0;
+}
+
+void
+notmuch_contacts_destroy (notmuch_contacts_t *contacts)
+{
+    talloc_free (contacts);
+}
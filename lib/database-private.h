@@ -34,6 +34,8 @@
 
 #include <xapian.h>
 
+#include <set>
+
 #pragma GCC visibility push(hidden)
 
 /* Bit masks for _notmuch_database::features.  Features are named,
@@ -106,6 +108,54 @@ enum _notmuch_features {
      *
      * Introduced: version 3. */
     NOTMUCH_FEATURE_LAST_MOD = 1 << 6,
+
+    /* If set, every document with a thread ID also stores it in
+     * NOTMUCH_VALUE_THREAD_ID, so that threads can be counted by
+     * collapsing on that value.
+     *
+     * Introduced: version 3. */
+    NOTMUCH_FEATURE_THREAD_ID_VALUES = 1 << 7,
+
+    /* If set, each thread has a summary record in the database
+     * metadata, which every writer must keep up to date (see
+     * thread.cc).
+     *
+     * Introduced: version 3. */
+    NOTMUCH_FEATURE_THREAD_SUMMARIES = 1 << 8,
+
+    /* If set, messages store their To, Cc and Bcc headers in
+     * NOTMUCH_VALUE_TO, NOTMUCH_VALUE_CC and NOTMUCH_VALUE_BCC, and
+     * empty values indicate empty headers.
+     *
+     * Introduced: version 3. */
+    NOTMUCH_FEATURE_RECIPIENT_VALUES = 1 << 9,
+
+    /* If set, the body text of messages added from now on is indexed
+     * without term positions, and phrase queries are treated as
+     * conjunctions of their words.  Header text keeps its positions.
+     * This is a choice (see notmuch_database_set_body_positions)
+     * rather than part of NOTMUCH_FEATURES_CURRENT.
+     *
+     * Introduced: version 3. */
+    NOTMUCH_FEATURE_BODY_NO_POSITIONS = 1 << 10,
+
+    /* If set, the database metadata counts the messages from and to
+     * each address, which every writer must keep up to date (see
+     * contacts.cc).
+     *
+     * Introduced: version 3. */
+    NOTMUCH_FEATURE_CONTACTS = 1 << 11,
+
+    /* If set, messages only carry the path: term of the directory of
+     * each of their files, and recursive path: queries (for <dir>
+     * followed by slash and two stars) are expanded to the
+     * directories below <dir>, found through the directory
+     * documents, rather than matching a term for every ancestor
+     * directory.  Readers that don't know about it would miss the
+     * messages below <dir>.
+     *
+     * Introduced: version 3. */
+    NOTMUCH_FEATURE_SUBTREE_PATHS = 1 << 12,
 };
 
 /* In C++, a named enum is its own type, so define bitwise operators
@@ -154,6 +204,12 @@ struct _notmuch_database {
     /* TRUE if changes have been made in this atomic section */
     notmuch_bool_t atomic_dirty;
     Xapian::Database *xapian_db;
+    /* TRUE if .notmuch/xapian is a Xapian stub file naming the
+     * database, e.g. a remote one, rather than the database. */
+    notmuch_bool_t xapian_stub;
+    /* Counts the times notmuch_database_yield opened xapian_db again,
+     * leaving Xapian documents read before stale. */
+    unsigned int generation;
 
     /* Bit mask of features used by this database.  This is a
      * bitwise-OR of NOTMUCH_FEATURE_* values (above). */
@@ -161,6 +217,9 @@ struct _notmuch_database {
 
     unsigned int last_doc_id;
     uint64_t last_thread_id;
+    /* The last thread ID recorded as used in the database; thread IDs
+     * up to here can be handed out without writing anything. */
+    uint64_t reserved_thread_id;
 
     /* error reporting; this value persists only until the
      * next library call. May be NULL */
@@ -172,15 +231,125 @@ struct _notmuch_database {
     unsigned long revision;
     const char *uuid;
 
+    /* Set up on first use; see _notmuch_database_get_query_parser
+     * and _notmuch_database_get_term_gen. */
     Xapian::QueryParser *query_parser;
     Xapian::TermGenerator *term_gen;
+    /* Bumped whenever the handle writes a document or drops what it
+     * knows of the database, either of which may change what a query
+     * string parses to; queries keep their parse until then. */
+    unsigned int parse_generation;
     Xapian::ValueRangeProcessor *value_range_processor;
     Xapian::ValueRangeProcessor *date_range_processor;
     Xapian::ValueRangeProcessor *last_mod_range_processor;
+
+    /* On-disk cache of query counts; see query-cache.cc.  The cache
+     * is loaded on first use. */
+    notmuch_bool_t query_cache_enabled;
+    notmuch_query_cache_t *query_cache;
+
+    /* Cached sets of excluded messages; see exclude-cache.cc.  The
+     * cache is loaded on first use, and kept across reopens. */
+    notmuch_bool_t exclude_cache_enabled;
+    notmuch_exclude_cache_t *exclude_cache;
+
+    /* Number of documents of the results of a query to fetch ahead
+     * of the one being read, or 0 for none; see
+     * notmuch_database_set_prefetch. */
+    unsigned int prefetch;
+
+    /* IDs of the threads whose summary records have been discarded
+     * by this writer, to be written again on close. */
+    GHashTable *dirty_thread_summaries;
+
+    /* Nesting of notmuch_database_begin_removals, and the messages
+     * removed meanwhile, as a map from thread ID to a GPtrArray of
+     * message IDs, whose ghosts are still to be brought up to date. */
+    int removal_nesting;
+    GHashTable *deferred_ghosts;
+
+    /* Map from directory document ID to the directory's path, for
+     * turning filename terms into filenames. */
+    GHashTable *directory_paths;
+
+    /* Map from thread ID to the ID of the thread it was merged into;
+     * see thread-alias.cc.  The map is loaded on first use. */
+    GHashTable *thread_aliases;
+
+    /* Map from message ID to the message's document and thread, for
+     * writers; see notmuch_database_find_message. */
+    GHashTable *message_ids;
+
+    /* Filter ruling out absent message IDs, for writers; see
+     * message-id-filter.cc. */
+    notmuch_message_id_filter_t *message_id_filter;
+
+    /* Tag changes journaled but not yet in the database, for
+     * readers; see tag-journal.cc. */
+    notmuch_tag_journal_t *tag_journal;
+
+    /* All tags and their message counts, as read at the given
+     * revision and document count; see
+     * notmuch_database_get_tag_catalogue. */
+    notmuch_string_list_t *tag_catalogue;
+    unsigned int *tag_catalogue_counts;
+    unsigned long tag_catalogue_revision;
+    unsigned int tag_catalogue_doccount;
+
+    /* Numbers for the tags seen by this handle, read on first use;
+     * see tag-set.cc.  Kept until the handle is destroyed. */
+    notmuch_tag_dictionary_t *tag_dictionary;
+
+    /* If TRUE, new messages are added with only their headers
+     * indexed; see notmuch_database_set_defer_body. */
+    notmuch_bool_t defer_body;
+
+    /* If TRUE, messages with attachments are marked for the
+     * extraction of their text; see
+     * notmuch_database_set_extract_attachments. */
+    notmuch_bool_t extract_attachments;
+
+    /* The lower-cased names of the headers recorded in the header
+     * record of new messages, or NULL for the default set; see
+     * notmuch_database_set_recorded_headers. */
+    notmuch_string_list_t *recorded_headers;
+
+    /* The tagging rules applied to new messages before they are
+     * first written, or NULL for none; see
+     * notmuch_database_set_tag_rules. */
+    notmuch_tag_rules_t *tag_rules;
+
+    /* The length in characters of the body snippet stored for new
+     * messages, or 0 to store none; see
+     * notmuch_database_set_snippet_length. */
+    unsigned int snippet_length;
+
+    /* The estimated memory, in bytes, Xapian holds for the changes
+     * written since they were last flushed, and the estimate at which
+     * to flush them, or 0 to leave flushing to Xapian; see
+     * notmuch_database_set_flush_budget. */
+    size_t pending_bytes;
+    size_t flush_budget;
+
+    /* Names of the archive shards opened; see archive.cc.  Readers
+     * open the shards as part of xapian_db, and keep them apart in
+     * archive for routing queries; writers open them as archive_db.
+     * Both are NULL if there are no shards. */
+    notmuch_string_list_t *archive_shards;
+    unsigned int num_archive_shards;
+    notmuch_archive_t *archive;
+    Xapian::Database *archive_db;
+
+    /* Where queries record their phases, or NULL; see
+     * notmuch_database_set_profile. */
+    notmuch_profile_t *profile;
 };
 
 /* Prior to database version 3, features were implied by the database
  * version number, so hard-code them for earlier versions. */
+/* The default for notmuch_database_set_prefetch. */
+#define NOTMUCH_PREFETCH_DEFAULT 64
+
 #define NOTMUCH_FEATURES_V0 ((enum _notmuch_features)0)
 #define NOTMUCH_FEATURES_V1 (NOTMUCH_FEATURES_V0 | NOTMUCH_FEATURE_FILE_TERMS | \
 			     NOTMUCH_FEATURE_DIRECTORY_DOCS)
@@ -195,7 +364,89 @@ struct _notmuch_database {
 #define NOTMUCH_FEATURES_CURRENT \
     (NOTMUCH_FEATURE_FILE_TERMS | NOTMUCH_FEATURE_DIRECTORY_DOCS | \
      NOTMUCH_FEATURE_BOOL_FOLDER | NOTMUCH_FEATURE_GHOSTS | \
-     NOTMUCH_FEATURE_LAST_MOD)
+     NOTMUCH_FEATURE_LAST_MOD | NOTMUCH_FEATURE_THREAD_ID_VALUES | \
+     NOTMUCH_FEATURE_THREAD_SUMMARIES | NOTMUCH_FEATURE_RECIPIENT_VALUES | \
+     NOTMUCH_FEATURE_CONTACTS | NOTMUCH_FEATURE_SUBTREE_PATHS)
+
+/* Return the query parser, and with it the value range processors,
+ * setting them up on first use. */
+Xapian::QueryParser *
+_notmuch_database_get_query_parser (notmuch_database_t *notmuch);
+
+/* Return the term generator, setting it up on first use. */
+Xapian::TermGenerator *
+_notmuch_database_get_term_gen (notmuch_database_t *notmuch);
+
+/* Return 'features' without those that readers cannot use with the
+ * archive shards open; see archive.cc. */
+enum _notmuch_features
+_notmuch_database_archive_features (notmuch_database_t *notmuch,
+				    enum _notmuch_features features);
+
+/* For readers, return the databases to evaluate 'query_string'
+ * against when it cannot match the messages of some archive shards,
+ * or NULL to use the whole of xapian_db. */
+notmuch_archive_route_t *
+_notmuch_database_route_query (notmuch_database_t *notmuch,
+			       const char *query_string);
+
+/* Return the database of 'route', which may be NULL. */
+Xapian::Database &
+_notmuch_archive_route_database (notmuch_database_t *notmuch,
+				 notmuch_archive_route_t *route);
+
+/* Map the ID of a document matched through 'route' to its ID in
+ * xapian_db. */
+unsigned int
+_notmuch_archive_route_doc_id (notmuch_database_t *notmuch,
+			       notmuch_archive_route_t *route,
+			       unsigned int doc_id);
+
+void
+_notmuch_archive_route_destroy (notmuch_archive_route_t *route);
+
+/* exclude-cache.cc */
+
+/* Return a posting source matching the documents of xapian_db that
+ * carry any of 'terms', from the cached set for them, or NULL if the
+ * cache is disabled or cannot be used for this database.  The caller
+ * owns the source, and has to keep it as long as any query using it.
+ * Xapian exceptions are caught (returning NULL). */
+Xapian::PostingSource *
+_notmuch_exclude_cache_source (notmuch_database_t *notmuch,
+			       const std::vector<std::string> &terms);
+
+void
+_notmuch_exclude_cache_flush (notmuch_database_t *notmuch);
+
+/* message.cc */
+
+/* Create a message object for 'doc', the document 'doc_id' of
+ * xapian_db, already read; otherwise like _notmuch_message_create. */
+notmuch_message_t *
+_notmuch_message_create_for_document (const void *talloc_owner,
+				      notmuch_database_t *notmuch,
+				      unsigned int doc_id,
+				      Xapian::Document doc,
+				      notmuch_private_status_t *status);
+
+/* Record that 'doc' is being rewritten: give it a new revision and
+ * invalidate the summary record of its thread. */
+void
+_notmuch_database_touch_document (notmuch_database_t *notmuch,
+				  Xapian::Document &doc);
+
+/* Change the tag terms of document 'doc_id' (see
+ * notmuch_query_change_tags) and rewrite it if they changed.  Returns
+ * TRUE if they did.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+notmuch_bool_t
+_notmuch_database_change_document_tags (notmuch_database_t *notmuch,
+					unsigned int doc_id,
+					const std::set<std::string> &add_terms,
+					const std::set<std::string> &remove_terms,
+					notmuch_bool_t remove_all);
 
 /* Return the list of terms from the given iterator matching a prefix.
  * The prefix will be stripped from the strings in the returned list.
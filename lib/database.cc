@@ -21,9 +21,14 @@
 #include "database-private.h"
 #include "parse-time-vrp.h"
 #include "string-util.h"
+#include "zlib-extra.h"
 
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <vector>
 
+#include <float.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <signal.h>
@@ -104,6 +109,23 @@ typedef struct {
  *	LAST_MOD:	The revision number as of the last tag or
  *			filename change.
  *
+ *	TO, CC, BCC:	The values of the "To", "Cc" and "Bcc" headers
+ *
+ *	HEADERS:	"name\0value\0" pairs for each of the recorded
+ *			headers (see notmuch_database_set_recorded_headers)
+ *			as of when the message was added.  An absent
+ *			header has an empty value.
+ *
+ *	PARENT:		The document ID of the message (or ghost) this
+ *			one replies to, as of when it was added, if
+ *			known.
+ *
+ *	SNIPPET:	The start of the first text/plain part of the
+ *			body, without quoted lines and with runs of
+ *			white space collapsed, if the message was added
+ *			while snippets were stored (see
+ *			notmuch_database_set_snippet_length).
+ *
  * In addition, terms from the content of the message are added with
  * "from", "to", "attachment", and "subject" prefixes for use by the
  * user in searching. Similarly, terms from the path of the mail
@@ -143,10 +165,18 @@ typedef struct {
  *		            document, and STRING is the name of this
  *		            directory within that parent.
  *
- * All directory documents have a single value:
+ * All directory documents have a value:
  *
  *	TIMESTAMP:	The mtime of the directory (at last scan)
  *
+ * and may have two more:
+ *
+ *	MTIME_NSEC:	The nanoseconds of that mtime, when recorded
+ *			by notmuch_directory_set_mtime_ns
+ *
+ *	MANIFEST:	A digest of the entries of the directory at
+ *			last scan, stored by the client
+ *
  * The data portion of a directory document contains the path of the
  * directory (relative to the database path).
  *
@@ -182,7 +212,23 @@ typedef struct {
  *			as a 16-byte hexadecimal ASCII representation
  *			of a 64-bit unsigned integer. The first ID
  *			generated is 1 and the value will be
- *			incremented for each thread ID.
+ *			incremented for each thread ID.  Writers
+ *			reserve IDs in blocks, so while a database is
+ *			open for writing (or after a writer crashed),
+ *			this may be ahead of the last ID actually used.
+ *
+ *	tombstone_*	The revision at which a message was removed,
+ *			followed by a space and its thread ID.  The
+ *			name is "tombstone_" followed by the message
+ *			ID.  Only written if NOTMUCH_FEATURE_LAST_MOD.
+ *
+ *	last_tombstone	The highest revision of a tombstone, as
+ *			serialised by Xapian::sortable_serialise.
+ *
+ *	tag_journal_sequence
+ *			The sequence number, in decimal, of the last
+ *			entry of .notmuch/tag-journal written to the
+ *			database.  See tag-journal.cc.
  *
  * Obsolete metadata
  * -----------------
@@ -230,56 +276,88 @@ typedef struct {
  */
 
 static prefix_t BOOLEAN_PREFIX_INTERNAL[] = {
-    { "type",			"T" },
-    { "reference",		"XREFERENCE" },
-    { "replyto",		"XREPLYTO" },
-    { "directory",		"XDIRECTORY" },
-    { "file-direntry",		"XFDIRENTRY" },
-    { "directory-direntry",	"XDDIRENTRY" },
+    { "type",			NOTMUCH_PREFIX_TYPE },
+    { "reference",		NOTMUCH_PREFIX_REFERENCE },
+    { "replyto",		NOTMUCH_PREFIX_REPLYTO },
+    { "directory",		NOTMUCH_PREFIX_DIRECTORY },
+    { "file-direntry",		NOTMUCH_PREFIX_FILE_DIRENTRY },
+    { "directory-direntry",	NOTMUCH_PREFIX_DIRECTORY_DIRENTRY },
+    { "pending",		NOTMUCH_PREFIX_PENDING },
 };
 
 static prefix_t BOOLEAN_PREFIX_EXTERNAL[] = {
-    { "thread",			"G" },
-    { "tag",			"K" },
-    { "is",			"K" },
-    { "id",			"Q" },
-    { "path",			"P" },
+    { "thread",			NOTMUCH_PREFIX_THREAD },
+    { "tag",			NOTMUCH_PREFIX_TAG },
+    { "is",			NOTMUCH_PREFIX_IS },
+    { "id",			NOTMUCH_PREFIX_ID },
+    { "path",			NOTMUCH_PREFIX_PATH },
     /*
      * Without the ":", since this is a multi-letter prefix, Xapian
      * will add a colon itself if the first letter of the path is
      * upper-case ASCII. Including the ":" forces there to always be a
      * colon, which keeps our own logic simpler.
      */
-    { "folder",			"XFOLDER:" },
+    { "folder",			NOTMUCH_PREFIX_FOLDER },
 };
 
 static prefix_t PROBABILISTIC_PREFIX[]= {
-    { "from",			"XFROM" },
-    { "to",			"XTO" },
-    { "attachment",		"XATTACHMENT" },
-    { "mimetype",		"XMIMETYPE"},
-    { "subject",		"XSUBJECT"},
+    { "from",			NOTMUCH_PREFIX_FROM },
+    { "to",			NOTMUCH_PREFIX_TO },
+    { "attachment",		NOTMUCH_PREFIX_ATTACHMENT },
+    { "mimetype",		NOTMUCH_PREFIX_MIMETYPE},
+    { "subject",		NOTMUCH_PREFIX_SUBJECT},
 };
 
-const char *
-_find_prefix (const char *name)
+/* _find_prefix looks names up in a perfect hash of all of the names
+ * above: the hash of the length and first two characters of each is
+ * different, which is checked as the table is filled in, when the
+ * library is loaded.  A new name that collides needs a new
+ * PREFIX_HASH_SIZE or multiplier. */
+#define PREFIX_HASH_SIZE 29
+
+static unsigned int
+_prefix_hash (const char *name)
 {
-    unsigned int i;
+    unsigned char c0 = name[0], c1 = c0 ? name[1] : 0;
 
-    for (i = 0; i < ARRAY_SIZE (BOOLEAN_PREFIX_INTERNAL); i++) {
-	if (strcmp (name, BOOLEAN_PREFIX_INTERNAL[i].name) == 0)
-	    return BOOLEAN_PREFIX_INTERNAL[i].prefix;
-    }
+    return (strlen (name) + 7 * (c0 + c1)) % PREFIX_HASH_SIZE;
+}
 
-    for (i = 0; i < ARRAY_SIZE (BOOLEAN_PREFIX_EXTERNAL); i++) {
-	if (strcmp (name, BOOLEAN_PREFIX_EXTERNAL[i].name) == 0)
-	    return BOOLEAN_PREFIX_EXTERNAL[i].prefix;
+static const prefix_t *prefix_slots[PREFIX_HASH_SIZE];
+
+static void
+_add_prefix_slots (const prefix_t *prefixes, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+	const prefix_t **slot = &prefix_slots[_prefix_hash (prefixes[i].name)];
+
+	if (*slot)
+	    INTERNAL_ERROR ("Prefix names '%s' and '%s' have the same hash\n",
+			    (*slot)->name, prefixes[i].name);
+	*slot = &prefixes[i];
     }
+}
 
-    for (i = 0; i < ARRAY_SIZE (PROBABILISTIC_PREFIX); i++) {
-	if (strcmp (name, PROBABILISTIC_PREFIX[i].name) == 0)
-	    return PROBABILISTIC_PREFIX[i].prefix;
+static struct _prefix_slots_init {
+    _prefix_slots_init () {
+	_add_prefix_slots (BOOLEAN_PREFIX_INTERNAL,
+			   ARRAY_SIZE (BOOLEAN_PREFIX_INTERNAL));
+	_add_prefix_slots (BOOLEAN_PREFIX_EXTERNAL,
+			   ARRAY_SIZE (BOOLEAN_PREFIX_EXTERNAL));
+	_add_prefix_slots (PROBABILISTIC_PREFIX,
+			   ARRAY_SIZE (PROBABILISTIC_PREFIX));
     }
+} prefix_slots_init;
+
+const char *
+_find_prefix (const char *name)
+{
+    const prefix_t *prefix = prefix_slots[_prefix_hash (name)];
+
+    if (likely (prefix && strcmp (name, prefix->name) == 0))
+	return prefix->prefix;
 
     INTERNAL_ERROR ("No prefix exists for '%s'\n", name);
 
@@ -315,6 +393,26 @@ static const struct {
       "indexed MIME types", "w"},
     { NOTMUCH_FEATURE_LAST_MOD,
       "modification tracking", "w"},
+    /* Readers that don't know about the thread ID value just count
+     * threads the slow way. */
+    { NOTMUCH_FEATURE_THREAD_ID_VALUES,
+      "thread ID values", "w"},
+    /* Readers can always fall back to loading a thread's
+     * messages. */
+    { NOTMUCH_FEATURE_THREAD_SUMMARIES,
+      "thread summaries", "w"},
+    /* As for from/subject, readers can refer to the message file. */
+    { NOTMUCH_FEATURE_RECIPIENT_VALUES,
+      "to/cc/bcc in database", "w"},
+    /* Readers that don't know about it just find no body phrases.
+     * Writers that don't would index bodies with positions again. */
+    { NOTMUCH_FEATURE_BODY_NO_POSITIONS,
+      "body terms without positions", "w"},
+    /* Readers that don't know about it just don't list contacts. */
+    { NOTMUCH_FEATURE_CONTACTS,
+      "contacts table", "w"},
+    { NOTMUCH_FEATURE_SUBTREE_PATHS,
+      "path: subtrees through directories", "rw"},
 };
 
 const char *
@@ -349,6 +447,10 @@ notmuch_status_to_string (notmuch_status_t status)
 	return "Operation requires a database upgrade";
     case NOTMUCH_STATUS_PATH_ERROR:
 	return "Path supplied is illegal for this function";
+    case NOTMUCH_STATUS_QUERY_INTERRUPTED:
+	return "Query ran out of time or was cancelled";
+    case NOTMUCH_STATUS_ILLEGAL_ARGUMENT:
+	return "Illegal argument for function";
     default:
     case NOTMUCH_STATUS_LAST_STATUS:
 	return "Unknown error status value";
@@ -451,12 +553,99 @@ _notmuch_message_id_compressed (void *ctx, const char *message_id)
     return compressed;
 }
 
+/* While adding messages, the same parents are looked up again and
+ * again, so a writer remembers the document of each message ID it
+ * has seen, and the message's thread ID once known.  Only the writer
+ * changes these, so the cache stays valid until a message is removed
+ * or a thread rewritten.  Keys are message IDs as stored in the
+ * database, i.e. already compressed if too long. */
+#define NOTMUCH_MESSAGE_ID_CACHE_MAX 16384
+
+typedef struct {
+    unsigned int doc_id;
+    /* As stored in the message, before resolving thread aliases; NULL
+     * if not known yet. */
+    char *thread_id;
+} _message_id_entry_t;
+
+static void
+_message_id_entry_free (gpointer data)
+{
+    _message_id_entry_t *entry = (_message_id_entry_t *) data;
+
+    g_free (entry->thread_id);
+    g_free (entry);
+}
+
+static _message_id_entry_t *
+_message_id_cache_lookup (notmuch_database_t *notmuch,
+			  const char *message_id)
+{
+    if (notmuch->message_ids == NULL)
+	return NULL;
+
+    return (_message_id_entry_t *) g_hash_table_lookup (notmuch->message_ids,
+							message_id);
+}
+
+static void
+_message_id_cache_store (notmuch_database_t *notmuch,
+			 const char *message_id,
+			 unsigned int doc_id,
+			 const char *thread_id)
+{
+    _message_id_entry_t *entry;
+
+    if (notmuch->mode != NOTMUCH_DATABASE_MODE_READ_WRITE)
+	return;
+
+    if (notmuch->message_ids == NULL)
+	notmuch->message_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+						      g_free,
+						      _message_id_entry_free);
+
+    entry = _message_id_cache_lookup (notmuch, message_id);
+    if (entry && entry->doc_id == doc_id) {
+	if (thread_id && entry->thread_id == NULL)
+	    entry->thread_id = g_strdup (thread_id);
+	return;
+    }
+
+    /* Threads are usually added together, so starting over now and
+     * then loses little. */
+    if (g_hash_table_size (notmuch->message_ids) >= NOTMUCH_MESSAGE_ID_CACHE_MAX)
+	g_hash_table_remove_all (notmuch->message_ids);
+
+    entry = g_new (_message_id_entry_t, 1);
+    entry->doc_id = doc_id;
+    entry->thread_id = g_strdup (thread_id);
+    g_hash_table_insert (notmuch->message_ids, g_strdup (message_id), entry);
+}
+
+void
+_notmuch_database_forget_message_id (notmuch_database_t *notmuch,
+				     const char *message_id)
+{
+    if (notmuch->message_ids)
+	g_hash_table_remove (notmuch->message_ids, message_id);
+}
+
+static void
+_message_id_cache_clear (notmuch_database_t *notmuch)
+{
+    if (notmuch->message_ids) {
+	g_hash_table_destroy (notmuch->message_ids);
+	notmuch->message_ids = NULL;
+    }
+}
+
 notmuch_status_t
 notmuch_database_find_message (notmuch_database_t *notmuch,
 			       const char *message_id,
 			       notmuch_message_t **message_ret)
 {
     notmuch_private_status_t status;
+    _message_id_entry_t *entry;
     unsigned int doc_id;
 
     if (message_ret == NULL)
@@ -466,8 +655,20 @@ notmuch_database_find_message (notmuch_database_t *notmuch,
 	message_id = _notmuch_message_id_compressed (notmuch, message_id);
 
     try {
-	status = _notmuch_database_find_unique_doc_id (notmuch, "id",
-						       message_id, &doc_id);
+	entry = _message_id_cache_lookup (notmuch, message_id);
+	if (entry) {
+	    doc_id = entry->doc_id;
+	    status = NOTMUCH_PRIVATE_STATUS_SUCCESS;
+	} else if (! _notmuch_database_may_have_message_id (notmuch,
+							     message_id)) {
+	    status = NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND;
+	} else {
+	    status = _notmuch_database_find_unique_doc_id (notmuch, "id",
+							   message_id,
+							   &doc_id);
+	    if (status == NOTMUCH_PRIVATE_STATUS_SUCCESS)
+		_message_id_cache_store (notmuch, message_id, doc_id, NULL);
+	}
 
 	if (status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND)
 	    *message_ret = NULL;
@@ -855,6 +1056,186 @@ notmuch_database_open (const char *path,
     return status;
 }
 
+/* Get current highest revision number. */
+static unsigned long
+_read_revision (notmuch_database_t *notmuch)
+{
+    string last_mod = notmuch->xapian_db->get_value_upper_bound (
+	NOTMUCH_VALUE_LAST_MOD);
+    unsigned long revision = 0, tombstone;
+
+    if (! last_mod.empty ())
+	revision = Xapian::sortable_unserialise (last_mod);
+
+    /* Removing the last message changed takes its revision out of
+     * the values, but not out of the tombstones. */
+    tombstone = _notmuch_database_get_last_tombstone (notmuch);
+    if (tombstone > revision)
+	revision = tombstone;
+
+    return revision;
+}
+
+/* Write the tag changes that readers journaled to the newly opened
+ * writable database.  Failing to only delays them to the next
+ * writer, so it is not an error to open the database. */
+static void
+_fold_tag_journal (notmuch_database_t *notmuch)
+{
+    notmuch_status_t status;
+
+    status = _notmuch_database_fold_tag_journal (notmuch);
+    if (status)
+	_notmuch_database_log (notmuch,
+			       "Warning: cannot apply the tag journal: %s\n",
+			       notmuch_status_to_string (status));
+}
+
+/* Get the last thread ID recorded as used.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static uint64_t
+_read_last_thread_id (notmuch_database_t *notmuch)
+{
+    string last_thread_id;
+    uint64_t id;
+    const char *str;
+    char *end;
+
+    last_thread_id = notmuch->xapian_db->get_metadata ("last_thread_id");
+    if (last_thread_id.empty ())
+	return 0;
+
+    str = last_thread_id.c_str ();
+    id = strtoull (str, &end, 16);
+    if (*end != '\0')
+	INTERNAL_ERROR ("Malformed database last_thread_id: %s", str);
+
+    return id;
+}
+
+/* Xapian lets one writer at a time hold the database.  Rather than
+ * failing when another writer holds it, a writer being opened waits
+ * for it, and on every attempt touches .notmuch/write-request to ask
+ * it to step aside.  Long-running writers look for a recent request
+ * between their changes; see notmuch_database_yield. */
+#define NOTMUCH_WRITE_REQUEST_FILE "write-request"
+
+/* How long a writer being opened waits for the write lock, and the
+ * longest pause between its attempts. */
+#define NOTMUCH_WRITE_LOCK_WAIT_SECONDS 10
+#define NOTMUCH_WRITE_LOCK_MAX_DELAY_MS 200
+
+/* A request touched longer ago than this is from a writer that has
+ * got the lock, or given up. */
+#define NOTMUCH_WRITE_REQUEST_SECONDS 2
+
+/* How long a yielding writer leaves the lock alone, which must be
+ * longer than the pause of a waiting writer, and how long it then
+ * waits to get the lock back. */
+#define NOTMUCH_YIELD_PAUSE_MS 500
+#define NOTMUCH_YIELD_WAIT_SECONDS 300
+
+static char *
+_write_request_path (void *ctx, const char *path)
+{
+    return talloc_asprintf (ctx, "%s/.notmuch/%s", path,
+			    NOTMUCH_WRITE_REQUEST_FILE);
+}
+
+/* Ask the writer holding the lock to yield it.  The request is just
+ * the modification time of the file, so failing to touch it (in a
+ * read-only .notmuch, say) only means waiting longer. */
+static void
+_touch_write_request (const char *request_path)
+{
+    int fd;
+
+    fd = open (request_path, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0)
+	return;
+    close (fd);
+
+    utimes (request_path, NULL);
+}
+
+/* Open the Xapian database at 'xapian_path' for writing, waiting for
+ * up to 'wait_seconds' for another writer to release the lock.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static Xapian::WritableDatabase *
+_open_writable (const char *xapian_path, const char *request_path,
+		unsigned int wait_seconds)
+{
+    time_t deadline = time (NULL) + wait_seconds;
+    unsigned int delay_ms = 10;
+
+    for (;;) {
+	try {
+	    return new Xapian::WritableDatabase (xapian_path,
+						 Xapian::DB_CREATE_OR_OPEN);
+	} catch (const Xapian::DatabaseLockError &error) {
+	    if (time (NULL) >= deadline)
+		throw;
+	}
+
+	_touch_write_request (request_path);
+	usleep (delay_ms * 1000);
+	delay_ms = MIN (2 * delay_ms, NOTMUCH_WRITE_LOCK_MAX_DELAY_MS);
+    }
+}
+
+/* The query parser and term generator are only needed by commands
+ * that search or index, so they are set up on first use rather than
+ * by every open.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+Xapian::QueryParser *
+_notmuch_database_get_query_parser (notmuch_database_t *notmuch)
+{
+    unsigned int i;
+
+    if (notmuch->query_parser)
+	return notmuch->query_parser;
+
+    notmuch->value_range_processor = new Xapian::NumberValueRangeProcessor (NOTMUCH_VALUE_TIMESTAMP);
+    notmuch->date_range_processor = new ParseTimeValueRangeProcessor (NOTMUCH_VALUE_TIMESTAMP);
+    notmuch->last_mod_range_processor = new Xapian::NumberValueRangeProcessor (NOTMUCH_VALUE_LAST_MOD, "lastmod:");
+
+    notmuch->query_parser = new Xapian::QueryParser;
+    notmuch->query_parser->set_default_op (Xapian::Query::OP_AND);
+    notmuch->query_parser->set_database (*notmuch->xapian_db);
+    notmuch->query_parser->set_stemmer (Xapian::Stem ("english"));
+    notmuch->query_parser->set_stemming_strategy (Xapian::QueryParser::STEM_SOME);
+    notmuch->query_parser->add_valuerangeprocessor (notmuch->value_range_processor);
+    notmuch->query_parser->add_valuerangeprocessor (notmuch->date_range_processor);
+    notmuch->query_parser->add_valuerangeprocessor (notmuch->last_mod_range_processor);
+
+    for (i = 0; i < ARRAY_SIZE (BOOLEAN_PREFIX_EXTERNAL); i++) {
+	prefix_t *prefix = &BOOLEAN_PREFIX_EXTERNAL[i];
+	notmuch->query_parser->add_boolean_prefix (prefix->name,
+						   prefix->prefix);
+    }
+
+    for (i = 0; i < ARRAY_SIZE (PROBABILISTIC_PREFIX); i++) {
+	prefix_t *prefix = &PROBABILISTIC_PREFIX[i];
+	notmuch->query_parser->add_prefix (prefix->name, prefix->prefix);
+    }
+
+    return notmuch->query_parser;
+}
+
+Xapian::TermGenerator *
+_notmuch_database_get_term_gen (notmuch_database_t *notmuch)
+{
+    if (notmuch->term_gen == NULL) {
+	notmuch->term_gen = new Xapian::TermGenerator;
+	notmuch->term_gen->set_stemmer (Xapian::Stem ("english"));
+    }
+
+    return notmuch->term_gen;
+}
+
 notmuch_status_t
 notmuch_database_open_verbose (const char *path,
 			       notmuch_database_mode_t mode,
@@ -868,7 +1249,7 @@ notmuch_database_open_verbose (const char *path,
     char *message = NULL;
     struct stat st;
     int err;
-    unsigned int i, version;
+    unsigned int version;
     static int initialized = 0;
 
     if (path == NULL) {
@@ -924,13 +1305,30 @@ notmuch_database_open_verbose (const char *path,
 
     notmuch->mode = mode;
     notmuch->atomic_nesting = 0;
-    try {
-	string last_thread_id;
-	string last_mod;
+    notmuch->prefetch = NOTMUCH_PREFETCH_DEFAULT;
+
+    /* Xapian opens the database named by a stub file itself, such as
+     * a remote one served by xapian-tcpsrv or xapian-progsrv. */
+    notmuch->xapian_stub = (stat (xapian_path, &st) == 0 &&
+			    S_ISREG (st.st_mode));
+
+    /* Changes to a replica would be lost with the next full copy,
+     * and break the next changeset. */
+    if (mode == NOTMUCH_DATABASE_MODE_READ_WRITE &&
+	_notmuch_xapian_path_is_replica (xapian_path)) {
+	IGNORE_RESULT (asprintf (&message, "Error: The database at %s is a read-only replica.\n",
+				 notmuch_path));
+	talloc_free (notmuch);
+	notmuch = NULL;
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
 
+    try {
 	if (mode == NOTMUCH_DATABASE_MODE_READ_WRITE) {
-	    notmuch->xapian_db = new Xapian::WritableDatabase (xapian_path,
-							       Xapian::DB_CREATE_OR_OPEN);
+	    notmuch->xapian_db = _open_writable (
+		xapian_path, _write_request_path (local, notmuch->path),
+		NOTMUCH_WRITE_LOCK_WAIT_SECONDS);
 	} else {
 	    notmuch->xapian_db = new Xapian::Database (xapian_path);
 	}
@@ -971,55 +1369,42 @@ notmuch_database_open_verbose (const char *path,
 	    goto DONE;
 	}
 
+	/* The UUID of a database combined with archive shards is not
+	 * that of the database itself. */
+	notmuch->uuid = talloc_strdup (
+	    notmuch, notmuch->xapian_db->get_uuid ().c_str ());
+
+	/* Readers see the database and its archive shards as one. */
+	_notmuch_database_open_archive_shards (notmuch);
+	notmuch->features = _notmuch_database_archive_features (
+	    notmuch, notmuch->features);
+
 	notmuch->last_doc_id = notmuch->xapian_db->get_lastdocid ();
-	last_thread_id = notmuch->xapian_db->get_metadata ("last_thread_id");
-	if (last_thread_id.empty ()) {
-	    notmuch->last_thread_id = 0;
-	} else {
-	    const char *str;
-	    char *end;
+	notmuch->last_thread_id = _read_last_thread_id (notmuch);
+	notmuch->reserved_thread_id = notmuch->last_thread_id;
 
-	    str = last_thread_id.c_str ();
-	    notmuch->last_thread_id = strtoull (str, &end, 16);
-	    if (*end != '\0')
-		INTERNAL_ERROR ("Malformed database last_thread_id: %s", str);
-	}
+	notmuch->revision = _read_revision (notmuch);
 
-	/* Get current highest revision number. */
-	last_mod = notmuch->xapian_db->get_value_upper_bound (
-	    NOTMUCH_VALUE_LAST_MOD);
-	if (last_mod.empty ())
-	    notmuch->revision = 0;
-	else
-	    notmuch->revision = Xapian::sortable_unserialise (last_mod);
-	notmuch->uuid = talloc_strdup (
-	    notmuch, notmuch->xapian_db->get_uuid ().c_str ());
+	_notmuch_database_open_message_id_filter (notmuch);
 
-	notmuch->query_parser = new Xapian::QueryParser;
-	notmuch->term_gen = new Xapian::TermGenerator;
-	notmuch->term_gen->set_stemmer (Xapian::Stem ("english"));
-	notmuch->value_range_processor = new Xapian::NumberValueRangeProcessor (NOTMUCH_VALUE_TIMESTAMP);
-	notmuch->date_range_processor = new ParseTimeValueRangeProcessor (NOTMUCH_VALUE_TIMESTAMP);
-	notmuch->last_mod_range_processor = new Xapian::NumberValueRangeProcessor (NOTMUCH_VALUE_LAST_MOD, "lastmod:");
-
-	notmuch->query_parser->set_default_op (Xapian::Query::OP_AND);
-	notmuch->query_parser->set_database (*notmuch->xapian_db);
-	notmuch->query_parser->set_stemmer (Xapian::Stem ("english"));
-	notmuch->query_parser->set_stemming_strategy (Xapian::QueryParser::STEM_SOME);
-	notmuch->query_parser->add_valuerangeprocessor (notmuch->value_range_processor);
-	notmuch->query_parser->add_valuerangeprocessor (notmuch->date_range_processor);
-	notmuch->query_parser->add_valuerangeprocessor (notmuch->last_mod_range_processor);
-
-	for (i = 0; i < ARRAY_SIZE (BOOLEAN_PREFIX_EXTERNAL); i++) {
-	    prefix_t *prefix = &BOOLEAN_PREFIX_EXTERNAL[i];
-	    notmuch->query_parser->add_boolean_prefix (prefix->name,
-						       prefix->prefix);
-	}
+	/* A writer must not hand out revisions that archived messages
+	 * already have. */
+	if (notmuch->archive_db) {
+	    string archived_mod;
 
-	for (i = 0; i < ARRAY_SIZE (PROBABILISTIC_PREFIX); i++) {
-	    prefix_t *prefix = &PROBABILISTIC_PREFIX[i];
-	    notmuch->query_parser->add_prefix (prefix->name, prefix->prefix);
+	    archived_mod = notmuch->archive_db->get_value_upper_bound (
+		NOTMUCH_VALUE_LAST_MOD);
+	    if (! archived_mod.empty () &&
+		Xapian::sortable_unserialise (archived_mod) > notmuch->revision)
+		notmuch->revision = Xapian::sortable_unserialise (archived_mod);
 	}
+
+	/* Readers see the tag changes journaled since the last
+	 * writer, and the next writer writes them. */
+	if (mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
+	    _fold_tag_journal (notmuch);
+	else
+	    _notmuch_database_load_tag_journal (notmuch);
     } catch (const Xapian::Error &error) {
 	IGNORE_RESULT (asprintf (&message, "A Xapian exception occurred opening database: %s\n",
 				 error.get_msg().c_str()));
@@ -1045,6 +1430,66 @@ notmuch_database_open_verbose (const char *path,
     return status;
 }
 
+void
+_notmuch_database_invalidate_thread_summary (notmuch_database_t *notmuch,
+					     const char *thread_id)
+{
+    Xapian::WritableDatabase *db;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_THREAD_SUMMARIES) ||
+	notmuch->mode != NOTMUCH_DATABASE_MODE_READ_WRITE)
+	return;
+
+    thread_id = _notmuch_database_resolve_thread_id (notmuch, thread_id);
+
+    if (notmuch->dirty_thread_summaries &&
+	g_hash_table_lookup_extended (notmuch->dirty_thread_summaries,
+				      thread_id, NULL, NULL))
+	return;
+
+    /* Callers are already inside Xapian try blocks of their own. */
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    db->set_metadata (
+	std::string (NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX) + thread_id, "");
+
+    if (notmuch->dirty_thread_summaries == NULL)
+	notmuch->dirty_thread_summaries =
+	    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_insert (notmuch->dirty_thread_summaries,
+			 g_strdup (thread_id), NULL);
+}
+
+/* Write the summary records of all threads invalidated since the
+ * database was opened.  Failing to write one is not fatal; readers
+ * fall back to loading the thread's messages. */
+static void
+_notmuch_database_flush_thread_summaries (notmuch_database_t *notmuch)
+{
+    GHashTable *dirty = notmuch->dirty_thread_summaries;
+    GHashTableIter iter;
+    gpointer thread_id;
+
+    if (dirty == NULL)
+	return;
+
+    /* Writing a summary reads messages, which must not invalidate
+     * anything further. */
+    notmuch->dirty_thread_summaries = NULL;
+
+    g_hash_table_iter_init (&iter, dirty);
+    while (g_hash_table_iter_next (&iter, &thread_id, NULL)) {
+	/* Threads merged into another since have no record to write. */
+	if (strcmp (_notmuch_database_resolve_thread_id (
+			notmuch, (const char *) thread_id),
+		    (const char *) thread_id) != 0)
+	    continue;
+
+	_notmuch_thread_write_summary (notmuch, (const char *) thread_id);
+    }
+
+    g_hash_table_destroy (dirty);
+}
+
 notmuch_status_t
 notmuch_database_close (notmuch_database_t *notmuch)
 {
@@ -1055,6 +1500,11 @@ notmuch_database_close (notmuch_database_t *notmuch)
      * close it.  Thus, we explicitly close it here. */
     if (notmuch->xapian_db != NULL) {
 	try {
+	    notmuch_profile_timer_t timer;
+
+	    NOTMUCH_TRACE (flush_start);
+	    _notmuch_profile_start (notmuch, &timer);
+
 	    /* If there's an outstanding transaction, it's unclear if
 	     * closing the Xapian database commits everything up to
 	     * that transaction, or may discard committed (but
@@ -1065,11 +1515,25 @@ notmuch_database_close (notmuch_database_t *notmuch)
 		(static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db))
 		    ->cancel_transaction ();
 
+	    /* Removals still open leave their ghosts as they would at
+	     * the end. */
+	    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
+		_notmuch_database_reconcile_deferred_ghosts (notmuch);
+	    _notmuch_database_flush_thread_summaries (notmuch);
+	    _notmuch_database_flush_message_id_filter (notmuch);
+	    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
+		_notmuch_database_release_thread_ids (notmuch);
+	    else
+		status = notmuch_database_flush_tag_journal (notmuch);
+
 	    /* Close the database.  This implicitly flushes
 	     * outstanding changes. */
 	    notmuch->xapian_db->close();
+	    _notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_COMMIT);
+	    NOTMUCH_TRACE1 (flush_done, NOTMUCH_STATUS_SUCCESS);
 	} catch (const Xapian::Error &error) {
 	    status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	    NOTMUCH_TRACE1 (flush_done, status);
 	    if (! notmuch->exception_reported) {
 		_notmuch_database_log (notmuch, "Error: A Xapian exception occurred closing database: %s\n",
 			 error.get_msg().c_str());
@@ -1077,12 +1541,41 @@ notmuch_database_close (notmuch_database_t *notmuch)
 	}
     }
 
+    _notmuch_query_cache_flush (notmuch);
+    _notmuch_exclude_cache_flush (notmuch);
+
+    talloc_free (notmuch->tag_journal);
+    notmuch->tag_journal = NULL;
+
+    if (notmuch->dirty_thread_summaries) {
+	g_hash_table_destroy (notmuch->dirty_thread_summaries);
+	notmuch->dirty_thread_summaries = NULL;
+    }
+
+    if (notmuch->deferred_ghosts) {
+	g_hash_table_destroy (notmuch->deferred_ghosts);
+	notmuch->deferred_ghosts = NULL;
+    }
+
+    if (notmuch->directory_paths) {
+	g_hash_table_destroy (notmuch->directory_paths);
+	notmuch->directory_paths = NULL;
+    }
+
+    if (notmuch->thread_aliases) {
+	g_hash_table_destroy (notmuch->thread_aliases);
+	notmuch->thread_aliases = NULL;
+    }
+
+    _message_id_cache_clear (notmuch);
+
     delete notmuch->term_gen;
     notmuch->term_gen = NULL;
     delete notmuch->query_parser;
     notmuch->query_parser = NULL;
     delete notmuch->xapian_db;
     notmuch->xapian_db = NULL;
+    _notmuch_database_close_archive_shards (notmuch);
     delete notmuch->value_range_processor;
     notmuch->value_range_processor = NULL;
     delete notmuch->date_range_processor;
@@ -1093,83 +1586,796 @@ notmuch_database_close (notmuch_database_t *notmuch)
     return status;
 }
 
-#if HAVE_XAPIAN_COMPACT
-static int
-unlink_cb (const char *path,
-	   unused (const struct stat *sb),
-	   unused (int type),
-	   unused (struct FTW *ftw))
+/* Forget what the handle knows about the database contents, which
+ * another process may have changed.  Counts are written out first,
+ * and are kept for the revision they were made for.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static void
+_notmuch_database_drop_caches (notmuch_database_t *notmuch)
 {
-    return remove (path);
-}
+    notmuch->parse_generation++;
 
-static int
-rmtree (const char *path)
-{
-    return nftw (path, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
+    _notmuch_query_cache_flush (notmuch);
+    talloc_free (notmuch->query_cache);
+    notmuch->query_cache = NULL;
+
+    talloc_free (notmuch->tag_catalogue);
+    notmuch->tag_catalogue = NULL;
+    talloc_free (notmuch->tag_catalogue_counts);
+    notmuch->tag_catalogue_counts = NULL;
+
+    if (notmuch->thread_aliases) {
+	g_hash_table_destroy (notmuch->thread_aliases);
+	notmuch->thread_aliases = NULL;
+    }
+
+    if (notmuch->directory_paths) {
+	g_hash_table_destroy (notmuch->directory_paths);
+	notmuch->directory_paths = NULL;
+    }
 }
 
-class NotmuchCompactor : public Xapian::Compactor
+notmuch_status_t
+notmuch_database_reopen (notmuch_database_t *notmuch,
+			 notmuch_bool_t *changed)
 {
-    notmuch_compact_status_cb_t status_cb;
-    void *status_closure;
+    unsigned long revision;
+    unsigned int doccount, last_doc_id;
+    enum _notmuch_features features;
+    char *incompat_features = NULL;
+    notmuch_bool_t shards_added, journaled;
+    std::string uuid;
+
+    if (changed)
+	*changed = FALSE;
+
+    /* A writer is the only one changing the database, and always
+     * sees its own changes. */
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
+	return NOTMUCH_STATUS_SUCCESS;
 
-public:
-    NotmuchCompactor(notmuch_compact_status_cb_t cb, void *closure) :
-	status_cb (cb), status_closure (closure) { }
+    try {
+	doccount = notmuch->xapian_db->get_doccount ();
 
-    virtual void
-    set_status (const std::string &table, const std::string &status)
-    {
-	char *msg;
+	notmuch->xapian_db->reopen ();
 
-	if (status_cb == NULL)
-	    return;
+	features = _parse_features (
+	    notmuch, notmuch->xapian_db->get_metadata ("features").c_str (),
+	    notmuch_database_get_version (notmuch), 'r', &incompat_features);
+	if (incompat_features) {
+	    _notmuch_database_log (notmuch,
+				   "Error: Notmuch database at %s\n"
+				   "       now requires features (%s)\n"
+				   "       not supported by this version of notmuch.\n",
+				   notmuch->path, incompat_features);
+	    talloc_free (incompat_features);
+	    return NOTMUCH_STATUS_FILE_ERROR;
+	}
 
-	if (status.length () == 0)
-	    msg = talloc_asprintf (NULL, "compacting table %s", table.c_str());
+	if (notmuch->num_archive_shards == 0)
+	    uuid = notmuch->xapian_db->get_uuid ();
 	else
-	    msg = talloc_asprintf (NULL, "     %s", status.c_str());
+	    uuid = notmuch->uuid;
+
+	/* Messages rolled into a new shard disappear from the database
+	 * itself, so look for new shards as well. */
+	shards_added = _notmuch_database_open_archive_shards (notmuch);
+	features = _notmuch_database_archive_features (notmuch, features);
+
+	revision = _read_revision (notmuch);
+	last_doc_id = notmuch->xapian_db->get_lastdocid ();
+
+	/* Other readers may have journaled tag changes meanwhile. */
+	journaled = notmuch->tag_journal != NULL;
+	_notmuch_database_load_tag_journal (notmuch);
+	journaled = journaled || notmuch->tag_journal != NULL;
+
+	/* Without modification tracking, changes that add and remove
+	 * no documents go unnoticed. */
+	if (! shards_added && ! journaled &&
+	    revision == notmuch->revision &&
+	    last_doc_id == notmuch->last_doc_id &&
+	    doccount == notmuch->xapian_db->get_doccount () &&
+	    features == notmuch->features &&
+	    uuid == notmuch->uuid)
+	    return NOTMUCH_STATUS_SUCCESS;
+
+	_notmuch_database_drop_caches (notmuch);
+
+	notmuch->features = features;
+	notmuch->revision = revision;
+	notmuch->last_doc_id = last_doc_id;
+	talloc_free ((char *) notmuch->uuid);
+	notmuch->uuid = talloc_strdup (notmuch, uuid.c_str ());
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred reopening database: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
 
-	if (msg == NULL) {
-	    return;
-	}
+    if (changed)
+	*changed = TRUE;
 
-	status_cb (msg, status_closure);
-	talloc_free (msg);
-    }
-};
+    return NOTMUCH_STATUS_SUCCESS;
+}
 
-/* Compacts the given database, optionally saving the original database
- * in backup_path. Additionally, a callback function can be provided to
- * give the user feedback on the progress of the (likely long-lived)
- * compaction process.
- *
- * The backup path must point to a directory on the same volume as the
- * original database. Passing a NULL backup_path will result in the
- * uncompacted database being deleted after compaction has finished.
- * Note that the database write lock will be held during the
- * compaction process to protect data integrity.
- */
-notmuch_status_t
-notmuch_database_compact (const char *path,
-			  const char *backup_path,
-			  notmuch_compact_status_cb_t status_cb,
-			  void *closure)
+/* How many times one read is retried after the database was modified
+ * underneath it.  Each retry follows a commit that overwrote the
+ * revision being read, so running out takes a writer committing
+ * faster than the reader can read a document.  Callers count the
+ * retries of each read apart, so that a long walk over results
+ * survives any number of commits between its reads. */
+#define NOTMUCH_MODIFIED_RETRIES 8
+
+/* Unlike notmuch_database_reopen, this keeps the caches of 'notmuch',
+ * which the iterators being read from may be using: a few stale
+ * entries only cost what they did before the retry. */
+notmuch_bool_t
+_notmuch_database_reopen_modified (notmuch_database_t *notmuch,
+				   unsigned int *attempts)
 {
-    void *local;
-    char *notmuch_path, *xapian_path, *compact_xapian_path;
+    if (notmuch->mode != NOTMUCH_DATABASE_MODE_READ_ONLY ||
+	*attempts >= NOTMUCH_MODIFIED_RETRIES)
+	return FALSE;
+
+    (*attempts)++;
+
+    try {
+	notmuch->xapian_db->reopen ();
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred reopening database: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+notmuch_bool_t
+notmuch_database_write_requested (notmuch_database_t *notmuch)
+{
+    struct stat st;
+    char *request_path;
+    int err;
+
+    if (notmuch->mode != NOTMUCH_DATABASE_MODE_READ_WRITE ||
+	notmuch->xapian_db == NULL)
+	return FALSE;
+
+    request_path = _write_request_path (notmuch, notmuch->path);
+    if (request_path == NULL)
+	return FALSE;
+
+    err = stat (request_path, &st);
+    talloc_free (request_path);
+
+    return err == 0 &&
+	st.st_mtime >= time (NULL) - NOTMUCH_WRITE_REQUEST_SECONDS;
+}
+
+notmuch_status_t
+notmuch_database_yield (notmuch_database_t *notmuch,
+			notmuch_bool_t *yielded)
+{
+    Xapian::WritableDatabase *db;
+    enum _notmuch_features features;
+    char *incompat_features = NULL;
+    char *request_path;
+    unsigned long revision;
+
+    if (yielded)
+	*yielded = FALSE;
+
+    if (notmuch->atomic_nesting || ! notmuch_database_write_requested (notmuch))
+	return NOTMUCH_STATUS_SUCCESS;
+
+    request_path = _write_request_path (notmuch, notmuch->path);
+    if (request_path == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    /* Write out what close would, and release the lock. */
+    try {
+	_notmuch_database_reconcile_deferred_ghosts (notmuch);
+	_notmuch_database_flush_thread_summaries (notmuch);
+	_notmuch_database_flush_message_id_filter (notmuch);
+	_notmuch_database_release_thread_ids (notmuch);
+	_notmuch_database_drop_caches (notmuch);
+
+	/* A writer still waiting touches the request again. */
+	unlink (request_path);
+	notmuch->xapian_db->close ();
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred yielding the database: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (request_path);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    /* The query parser refers to the old database. */
+    delete notmuch->query_parser;
+    notmuch->query_parser = NULL;
+    delete notmuch->value_range_processor;
+    notmuch->value_range_processor = NULL;
+    delete notmuch->date_range_processor;
+    notmuch->date_range_processor = NULL;
+    delete notmuch->last_mod_range_processor;
+    notmuch->last_mod_range_processor = NULL;
+    delete notmuch->xapian_db;
+    notmuch->xapian_db = NULL;
+
+    _message_id_cache_clear (notmuch);
+    talloc_free (notmuch->message_id_filter);
+    notmuch->message_id_filter = NULL;
+
+    usleep (NOTMUCH_YIELD_PAUSE_MS * 1000);
+
+    try {
+	char *xapian_path = talloc_asprintf (request_path, "%s/.notmuch/xapian",
+					     notmuch->path);
+
+	db = _open_writable (xapian_path, request_path,
+			     NOTMUCH_YIELD_WAIT_SECONDS);
+	notmuch->xapian_db = db;
+	notmuch->generation++;
+
+	features = _parse_features (
+	    request_path, db->get_metadata ("features").c_str (),
+	    notmuch_database_get_version (notmuch), 'w', &incompat_features);
+	if (incompat_features) {
+	    _notmuch_database_log (notmuch,
+				   "Error: Notmuch database at %s\n"
+				   "       now requires features (%s)\n"
+				   "       not supported by this version of notmuch.\n",
+				   notmuch->path, incompat_features);
+	    talloc_free (request_path);
+	    return NOTMUCH_STATUS_FILE_ERROR;
+	}
+	notmuch->features = _notmuch_database_archive_features (notmuch,
+								  features);
+
+	/* Take up where the other writer left off. */
+	notmuch->last_doc_id = db->get_lastdocid ();
+	notmuch->last_thread_id = _read_last_thread_id (notmuch);
+	notmuch->reserved_thread_id = notmuch->last_thread_id;
+	revision = _read_revision (notmuch);
+	if (revision > notmuch->revision)
+	    notmuch->revision = revision;
+	talloc_free ((char *) notmuch->uuid);
+	notmuch->uuid = talloc_strdup (notmuch, db->get_uuid ().c_str ());
+
+	_notmuch_database_open_message_id_filter (notmuch);
+
+	_fold_tag_journal (notmuch);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred reopening database: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (request_path);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    talloc_free (request_path);
+
+    if (yielded)
+	*yielded = TRUE;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+#if HAVE_XAPIAN_COMPACT
+static int
+unlink_cb (const char *path,
+	   unused (const struct stat *sb),
+	   unused (int type),
+	   unused (struct FTW *ftw))
+{
+    return remove (path);
+}
+
+static int
+rmtree (const char *path)
+{
+    return nftw (path, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+class NotmuchCompactor : public Xapian::Compactor
+{
+    notmuch_compact_status_cb_t status_cb;
+    void *status_closure;
+
+public:
+    NotmuchCompactor(notmuch_compact_status_cb_t cb, void *closure) :
+	status_cb (cb), status_closure (closure) { }
+
+    virtual void
+    set_status (const std::string &table, const std::string &status)
+    {
+	char *msg;
+
+	if (status_cb == NULL)
+	    return;
+
+	if (status.length () == 0)
+	    msg = talloc_asprintf (NULL, "compacting table %s", table.c_str());
+	else
+	    msg = talloc_asprintf (NULL, "     %s", status.c_str());
+
+	if (msg == NULL) {
+	    return;
+	}
+
+	status_cb (msg, status_closure);
+	talloc_free (msg);
+    }
+};
+
+/* Take the lock that keeps two compactions of the database at 'path'
+ * from sharing the work-in-progress directory.  Returns the locked
+ * file descriptor, or -1 if another compaction holds the lock (or
+ * the lock file cannot be created), having logged why.
+ *
+ * Online compaction holds the database write lock only at its end, so
+ * that lock could not protect the directory. */
+static int
+_compact_lock (void *ctx, notmuch_database_t *notmuch, const char *path)
+{
+    struct flock lock;
+    char *lock_path;
+    int fd;
+
+    lock_path = talloc_asprintf (ctx, "%s/.notmuch/xapian.compact.lock",
+				 path);
+    if (lock_path == NULL)
+	return -1;
+
+    fd = open (lock_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+	_notmuch_database_log (notmuch, "Error creating %s: %s\n",
+			       lock_path, strerror (errno));
+	return -1;
+    }
+
+    memset (&lock, 0, sizeof (lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl (fd, F_SETLK, &lock) < 0) {
+	_notmuch_database_log (notmuch, "Another compaction of %s is in progress.\n",
+			       path);
+	close (fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+/* The revision of the last change in 'db', as _read_revision reads
+ * it for an open database. */
+static unsigned long
+_compact_revision (Xapian::Database &db)
+{
+    string last_mod = db.get_value_upper_bound (NOTMUCH_VALUE_LAST_MOD);
+    string tombstone = db.get_metadata (NOTMUCH_METADATA_LAST_TOMBSTONE);
+    unsigned long revision = 0;
+
+    if (! last_mod.empty ())
+	revision = Xapian::sortable_unserialise (last_mod);
+    if (! tombstone.empty () &&
+	Xapian::sortable_unserialise (tombstone) > revision)
+	revision = Xapian::sortable_unserialise (tombstone);
+
+    return revision;
+}
+
+/* Bring 'dst', a compacted copy of 'src' as it was at revision
+ * 'since' or later, up to date with 'src'.
+ *
+ * Compaction keeps document IDs, so the two are compared by ID: the
+ * documents missing from 'src' were removed, and those missing from
+ * 'dst' or changed after 'since' are copied.  Only messages record
+ * when they last changed, so the few other documents (directories)
+ * are always copied, as are the metadata entries that differ.
+ *
+ * Returns the number of messages removed and copied and of metadata
+ * entries changed.  The caller is responsible for catching Xapian
+ * exceptions and for committing 'dst'. */
+static unsigned long
+_compact_replay (Xapian::Database &src, Xapian::WritableDatabase &dst,
+		 unsigned long since)
+{
+    std::vector<Xapian::docid> removed, copied;
+    std::vector<string> changed_keys;
+    unsigned long changes = 0;
+
+    /* Decide everything first, as changing 'dst' would invalidate
+     * the iterators over it. */
+    {
+	Xapian::PostingIterator s = src.postlist_begin ("");
+	Xapian::PostingIterator s_end = src.postlist_end ("");
+	Xapian::PostingIterator d = dst.postlist_begin ("");
+	Xapian::PostingIterator d_end = dst.postlist_end ("");
+	Xapian::ValueIterator mod = src.valuestream_begin (NOTMUCH_VALUE_LAST_MOD);
+	Xapian::ValueIterator mod_end = src.valuestream_end (NOTMUCH_VALUE_LAST_MOD);
+
+	while (s != s_end || d != d_end) {
+	    if (s == s_end || (d != d_end && *d < *s)) {
+		removed.push_back (*d);
+		changes++;
+		++d;
+		continue;
+	    }
+
+	    Xapian::docid doc_id = *s;
+	    notmuch_bool_t present = (d != d_end && *d == doc_id);
+
+	    if (present)
+		++d;
+	    ++s;
+
+	    if (mod != mod_end && mod.get_docid () < doc_id)
+		mod.skip_to (doc_id);
+	    if (mod == mod_end || mod.get_docid () != doc_id) {
+		/* Not a message. */
+		copied.push_back (doc_id);
+	    } else if (! present ||
+		       Xapian::sortable_unserialise (*mod) > since) {
+		copied.push_back (doc_id);
+		changes++;
+	    }
+	}
+    }
+
+    {
+	Xapian::TermIterator s = src.metadata_keys_begin ();
+	Xapian::TermIterator s_end = src.metadata_keys_end ();
+	Xapian::TermIterator d = dst.metadata_keys_begin ();
+	Xapian::TermIterator d_end = dst.metadata_keys_end ();
+
+	while (s != s_end || d != d_end) {
+	    if (s == s_end || (d != d_end && *d < *s)) {
+		changed_keys.push_back (*d);
+		++d;
+		continue;
+	    }
+	    if (d != d_end && *d == *s) {
+		if (src.get_metadata (*s) != dst.get_metadata (*d))
+		    changed_keys.push_back (*s);
+		++d;
+	    } else {
+		changed_keys.push_back (*s);
+	    }
+	    ++s;
+	}
+    }
+
+    for (size_t i = 0; i < removed.size (); i++)
+	dst.delete_document (removed[i]);
+    for (size_t i = 0; i < copied.size (); i++)
+	dst.replace_document (copied[i], src.get_document (copied[i]));
+    /* An empty value removes the entry. */
+    for (size_t i = 0; i < changed_keys.size (); i++)
+	dst.set_metadata (changed_keys[i], src.get_metadata (changed_keys[i]));
+
+    return changes + changed_keys.size ();
+}
+
+/* At most this many passes over the changes made during an online
+ * compaction are made before taking the write lock, and none once a
+ * pass finds no more than NOTMUCH_COMPACT_REPLAY_SMALL changes. */
+#define NOTMUCH_COMPACT_REPLAY_PASSES 3
+#define NOTMUCH_COMPACT_REPLAY_SMALL 100
+
+/* A writer that commits twice while Xapian reads the database to
+ * compact it may overwrite what is being read.  The compaction is
+ * then started again, at most this many times in all. */
+#define NOTMUCH_COMPACT_ATTEMPTS 3
+
+/* How many times, a second apart, online compaction tries to take
+ * the write lock from a writer that is busy.  Each attempt itself
+ * waits for up to NOTMUCH_WRITE_LOCK_WAIT_SECONDS. */
+#define NOTMUCH_COMPACT_LOCK_ATTEMPTS 6
+
+static void
+_compact_status (notmuch_compact_status_cb_t status_cb, void *closure,
+		 const char *format, ...)
+{
+    va_list va_args;
+    char *msg;
+
+    if (status_cb == NULL)
+	return;
+
+    va_start (va_args, format);
+    msg = talloc_vasprintf (NULL, format, va_args);
+    va_end (va_args);
+
+    if (msg == NULL)
+	return;
+
+    status_cb (msg, closure);
+    talloc_free (msg);
+}
+
+/* Renumbering a database by thread (NOTMUCH_COMPACT_RENUMBER_THREAD)
+ * gives the documents new IDs in this order: first the directories,
+ * then the messages and ghosts grouped by thread, the threads by the
+ * date of their first message and the messages of a thread by date,
+ * their ghosts last.  Since Xapian keeps documents in the order of
+ * their IDs, the documents of a thread then lie together, and reading
+ * a thread, or messages by date, mostly reads neighbouring blocks.
+ *
+ * Document IDs are stored in file-direntry terms, directory-direntry
+ * terms, the PARENT value and thread summary records, which are all
+ * rewritten with the new IDs.  Archive shards refer to directories
+ * by their IDs too, so databases with shards cannot be renumbered. */
+
+typedef struct {
+    Xapian::docid doc_id;
+    /* Index of the thread in _renumber_order_t::first_dates. */
+    unsigned int thread;
+    double date;
+} _renumber_entry_t;
+
+struct _renumber_order_t {
+    const std::vector<double> &first_dates;
+
+    _renumber_order_t (const std::vector<double> &dates) :
+	first_dates (dates) { }
+
+    bool
+    operator() (const _renumber_entry_t &a, const _renumber_entry_t &b) const
+    {
+	if (first_dates[a.thread] != first_dates[b.thread])
+	    return first_dates[a.thread] < first_dates[b.thread];
+	if (a.thread != b.thread)
+	    return a.thread < b.thread;
+	if (a.date != b.date)
+	    return a.date < b.date;
+	return a.doc_id < b.doc_id;
+    }
+};
+
+/* Rewrite the "<doc id>:" that follows 'prefix' in the terms of
+ * 'doc'. */
+static void
+_renumber_terms (Xapian::Document &doc, const char *prefix,
+		 const std::vector<Xapian::docid> &new_ids)
+{
+    std::vector<std::pair<std::string, Xapian::termcount> > terms, renumbered;
+    size_t prefix_len = strlen (prefix);
+    Xapian::TermIterator i = doc.termlist_begin ();
+    Xapian::TermIterator end = doc.termlist_end ();
+
+    for (i.skip_to (prefix); i != end; i++) {
+	if ((*i).compare (0, prefix_len, prefix) != 0)
+	    break;
+	terms.push_back (std::make_pair (*i, i.get_wdf ()));
+    }
+
+    for (size_t j = 0; j < terms.size (); j++) {
+	const char *id = terms[j].first.c_str () + prefix_len;
+	char *colon;
+	unsigned long old_id = strtoul (id, &colon, 10);
+	char new_id[32];
+
+	if (*colon != ':' || old_id >= new_ids.size () || ! new_ids[old_id])
+	    continue;
+
+	snprintf (new_id, sizeof (new_id), "%u", new_ids[old_id]);
+	renumbered.push_back (
+	    std::make_pair (std::string (prefix) + new_id + colon,
+			    terms[j].second));
+	doc.remove_term (terms[j].first);
+    }
+
+    /* Only now, as a new term may be one just removed. */
+    for (size_t j = 0; j < renumbered.size (); j++)
+	doc.add_term (renumbered[j].first, renumbered[j].second);
+}
+
+static void
+_renumber_document (Xapian::Document &doc,
+		    const std::vector<Xapian::docid> &new_ids)
+{
+    std::string parent = doc.get_value (NOTMUCH_VALUE_PARENT);
+
+    if (! parent.empty ()) {
+	Xapian::docid old_id = Xapian::sortable_unserialise (parent);
+
+	if (old_id < new_ids.size () && new_ids[old_id])
+	    doc.add_value (NOTMUCH_VALUE_PARENT,
+			   Xapian::sortable_serialise (new_ids[old_id]));
+	else
+	    doc.remove_value (NOTMUCH_VALUE_PARENT);
+    }
+
+    _renumber_terms (doc, NOTMUCH_PREFIX_FILE_DIRENTRY, new_ids);
+    _renumber_terms (doc, NOTMUCH_PREFIX_DIRECTORY_DIRENTRY, new_ids);
+}
+
+/* Rewrite the document IDs starting the lines of a thread summary
+ * record after its version line.  Returns an empty string, for no
+ * record, if an ID is unknown; the record is then written again the
+ * next time the thread is summarized. */
+static std::string
+_renumber_summary (const std::string &record,
+		   const std::vector<Xapian::docid> &new_ids)
+{
+    std::string renumbered;
+    size_t start = record.find ('\n');
+
+    if (start == std::string::npos)
+	return record;
+    renumbered = record.substr (0, ++start);
+
+    while (start < record.size ()) {
+	size_t end = record.find ('\n', start);
+	std::string line = record.substr (start, end == std::string::npos ?
+					  std::string::npos : end - start + 1);
+	char *rest;
+	unsigned long old_id = strtoul (line.c_str (), &rest, 10);
+	char new_id[32];
+
+	if (*rest != ' ' || old_id >= new_ids.size () || ! new_ids[old_id])
+	    return "";
+
+	snprintf (new_id, sizeof (new_id), "%u", new_ids[old_id]);
+	renumbered += new_id;
+	renumbered += rest;
+
+	if (end == std::string::npos)
+	    break;
+	start = end + 1;
+    }
+
+    return renumbered;
+}
+
+/* Copy 'src' into a new database at 'dst_path', renumbered by thread.
+ * The caller is responsible for catching Xapian exceptions. */
+static void
+_compact_renumber (Xapian::Database &src, const char *dst_path,
+		   notmuch_compact_status_cb_t status_cb, void *closure)
+{
+    std::map<std::string, unsigned int> threads;
+    std::vector<double> first_dates;
+    std::vector<_renumber_entry_t> messages;
+    std::vector<Xapian::docid> others;
+    std::vector<Xapian::docid> new_ids (src.get_lastdocid () + 1, 0);
+    Xapian::docid next_id = 1;
+
+    {
+	Xapian::PostingIterator i = src.postlist_begin ("");
+	Xapian::PostingIterator end = src.postlist_end ("");
+	Xapian::ValueIterator thread = src.valuestream_begin (NOTMUCH_VALUE_THREAD_ID);
+	Xapian::ValueIterator thread_end = src.valuestream_end (NOTMUCH_VALUE_THREAD_ID);
+	Xapian::ValueIterator date = src.valuestream_begin (NOTMUCH_VALUE_TIMESTAMP);
+	Xapian::ValueIterator date_end = src.valuestream_end (NOTMUCH_VALUE_TIMESTAMP);
+
+	for (; i != end; i++) {
+	    Xapian::docid doc_id = *i;
+	    _renumber_entry_t entry;
+
+	    if (thread != thread_end && thread.get_docid () < doc_id)
+		thread.skip_to (doc_id);
+	    if (thread == thread_end || thread.get_docid () != doc_id) {
+		/* Not a message or ghost. */
+		others.push_back (doc_id);
+		continue;
+	    }
+
+	    std::map<std::string, unsigned int>::iterator t = threads.find (*thread);
+	    if (t == threads.end ()) {
+		t = threads.insert (std::make_pair (*thread,
+						     (unsigned int) first_dates.size ())).first;
+		first_dates.push_back (DBL_MAX);
+	    }
+
+	    if (date != date_end && date.get_docid () < doc_id)
+		date.skip_to (doc_id);
+	    entry.doc_id = doc_id;
+	    entry.thread = t->second;
+	    /* Ghosts have no date. */
+	    if (date != date_end && date.get_docid () == doc_id)
+		entry.date = Xapian::sortable_unserialise (*date);
+	    else
+		entry.date = DBL_MAX;
+	    if (entry.date < first_dates[entry.thread])
+		first_dates[entry.thread] = entry.date;
+	    messages.push_back (entry);
+	}
+    }
+
+    std::sort (messages.begin (), messages.end (),
+	       _renumber_order_t (first_dates));
+
+    for (size_t j = 0; j < others.size (); j++)
+	new_ids[others[j]] = next_id++;
+    for (size_t j = 0; j < messages.size (); j++)
+	new_ids[messages[j].doc_id] = next_id++;
+
+    Xapian::WritableDatabase dst (dst_path, Xapian::DB_CREATE_OR_OVERWRITE);
+
+    for (size_t j = 0; j < others.size () + messages.size (); j++) {
+	Xapian::docid old_id = j < others.size () ? others[j] :
+	    messages[j - others.size ()].doc_id;
+	Xapian::Document doc = src.get_document (old_id);
+
+	_renumber_document (doc, new_ids);
+	dst.replace_document (new_ids[old_id], doc);
+    }
+
+    for (Xapian::TermIterator key = src.metadata_keys_begin ();
+	 key != src.metadata_keys_end (); key++) {
+	std::string value = src.get_metadata (*key);
+
+	if ((*key).compare (0, strlen (NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX),
+			    NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX) == 0)
+	    value = _renumber_summary (value, new_ids);
+	if (! value.empty ())
+	    dst.set_metadata (*key, value);
+    }
+
+    dst.commit ();
+    dst.close ();
+
+    _compact_status (status_cb, closure,
+		     "renumbered %lu documents in %lu threads",
+		     (unsigned long) (others.size () + messages.size ()),
+		     (unsigned long) first_dates.size ());
+}
+
+/* Compacts the given database, optionally saving the original database
+ * in backup_path. Additionally, a callback function can be provided to
+ * give the user feedback on the progress of the (likely long-lived)
+ * compaction process.
+ *
+ * The backup path must point to a directory on the same volume as the
+ * original database. Passing a NULL backup_path will result in the
+ * uncompacted database being deleted after compaction has finished.
+ *
+ * Unless 'online', the database write lock will be held during the
+ * compaction process to protect data integrity.  If 'online', the
+ * database is compacted while writes go on, the changes they make
+ * are then copied into the compacted database, and the write lock is
+ * only held for the last of those copies and the swap.
+ *
+ * With 'renumber', the database is first copied with new document
+ * IDs (see _compact_renumber), and the copy compacted.  This needs
+ * the write lock throughout, so cannot be done 'online'.
+ */
+static notmuch_status_t
+_notmuch_database_compact (const char *path,
+			   const char *backup_path,
+			   notmuch_bool_t online,
+			   notmuch_compact_renumber_t renumber,
+			   notmuch_compact_status_cb_t status_cb,
+			   void *closure)
+{
+    void *local;
+    char *notmuch_path, *xapian_path, *compact_xapian_path;
+    char *renumber_xapian_path = NULL;
+    const char *source_path;
     notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
-    notmuch_database_t *notmuch = NULL;
+    notmuch_database_t *notmuch = NULL, *writer = NULL;
     struct stat statbuf;
     notmuch_bool_t keep_backup;
     char *message = NULL;
+    unsigned long since = 0;
+    int lock_fd = -1, attempt;
+
+    if (online && renumber != NOTMUCH_COMPACT_RENUMBER_NONE)
+	return NOTMUCH_STATUS_UNSUPPORTED_OPERATION;
 
     local = talloc_new (NULL);
     if (! local)
 	return NOTMUCH_STATUS_OUT_OF_MEMORY;
 
     ret = notmuch_database_open_verbose (path,
+					 online ? NOTMUCH_DATABASE_MODE_READ_ONLY :
 					 NOTMUCH_DATABASE_MODE_READ_WRITE,
 					 &notmuch,
 					 &message);
@@ -1178,6 +2384,38 @@ notmuch_database_compact (const char *path,
 	goto DONE;
     }
 
+    /* Finding what changed during the compaction needs the revision
+     * of each message. */
+    if (online && ! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD)) {
+	_notmuch_database_log (notmuch, "Online compaction needs a database upgrade.\n");
+	ret = NOTMUCH_STATUS_UPGRADE_REQUIRED;
+	goto DONE;
+    }
+
+    /* The files to compact are where the stub points, possibly on
+     * another machine. */
+    if (notmuch->xapian_stub) {
+	_notmuch_database_log (notmuch, "Cannot compact a database named by a Xapian stub file;\n"
+			       "compact it where it is stored.\n");
+	ret = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    if (renumber == NOTMUCH_COMPACT_RENUMBER_THREAD) {
+	/* Threads are found by their thread ID values. */
+	if (! (notmuch->features & NOTMUCH_FEATURE_THREAD_ID_VALUES)) {
+	    _notmuch_database_log (notmuch, "Renumbering by thread needs a database upgrade.\n");
+	    ret = NOTMUCH_STATUS_UPGRADE_REQUIRED;
+	    goto DONE;
+	}
+	if (notmuch->archive_shards) {
+	    _notmuch_database_log (notmuch, "Cannot renumber a database with archive shards,\n"
+				   "which refer to its documents by ID.\n");
+	    ret = NOTMUCH_STATUS_UNSUPPORTED_OPERATION;
+	    goto DONE;
+	}
+    }
+
     if (! (notmuch_path = talloc_asprintf (local, "%s/%s", path, ".notmuch"))) {
 	ret = NOTMUCH_STATUS_OUT_OF_MEMORY;
 	goto DONE;
@@ -1216,23 +2454,128 @@ notmuch_database_compact (const char *path,
 	goto DONE;
     }
 
-    /* Unconditionally attempt to remove old work-in-progress database (if
-     * any). This is "protected" by database lock. If this fails due to write
-     * errors (etc), the following code will fail and provide error message.
-     */
+    lock_fd = _compact_lock (local, notmuch, path);
+    if (lock_fd < 0) {
+	ret = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    /* Unconditionally attempt to remove old work-in-progress database (if
+     * any). This is "protected" by the compaction lock. If this fails due
+     * to write errors (etc), the following code will fail and provide error
+     * message.
+     */
     (void) rmtree (compact_xapian_path);
 
-    try {
-	NotmuchCompactor compactor (status_cb, closure);
+    source_path = xapian_path;
+    if (renumber == NOTMUCH_COMPACT_RENUMBER_THREAD) {
+	if (! (renumber_xapian_path = talloc_asprintf (local, "%s.renumber",
+						       xapian_path))) {
+	    ret = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    goto DONE;
+	}
+	(void) rmtree (renumber_xapian_path);
 
-	compactor.set_renumber (false);
-	compactor.add_source (xapian_path);
-	compactor.set_destdir (compact_xapian_path);
-	compactor.compact ();
-    } catch (const Xapian::Error &error) {
-	_notmuch_database_log (notmuch, "Error while compacting: %s\n", error.get_msg().c_str());
-	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
-	goto DONE;
+	try {
+	    _compact_renumber (*notmuch->xapian_db, renumber_xapian_path,
+			       status_cb, closure);
+	} catch (const Xapian::Error &error) {
+	    _notmuch_database_log (notmuch, "Error while renumbering: %s\n", error.get_msg().c_str());
+	    ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	    goto DONE;
+	}
+	source_path = renumber_xapian_path;
+    }
+
+    for (attempt = 1; ; attempt++) {
+	try {
+	    NotmuchCompactor compactor (status_cb, closure);
+
+	    /* Everything changed after this revision is copied into
+	     * the compacted database later, whichever revision Xapian
+	     * ends up compacting. */
+	    if (online) {
+		Xapian::Database snapshot (xapian_path);
+		since = _compact_revision (snapshot);
+	    }
+
+	    compactor.set_renumber (false);
+	    compactor.add_source (source_path);
+	    compactor.set_destdir (compact_xapian_path);
+	    compactor.compact ();
+	    break;
+	} catch (const Xapian::DatabaseModifiedError &error) {
+	    (void) rmtree (compact_xapian_path);
+	    if (attempt == NOTMUCH_COMPACT_ATTEMPTS) {
+		_notmuch_database_log (notmuch, "Error while compacting: %s\n", error.get_msg().c_str());
+		ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+		goto DONE;
+	    }
+	    _compact_status (status_cb, closure,
+			     "database changed too much while compacting, starting again");
+	} catch (const Xapian::Error &error) {
+	    _notmuch_database_log (notmuch, "Error while compacting: %s\n", error.get_msg().c_str());
+	    ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	    goto DONE;
+	}
+    }
+
+    if (online) {
+	try {
+	    Xapian::WritableDatabase compacted (compact_xapian_path,
+						Xapian::DB_OPEN);
+	    unsigned long changes;
+	    int pass;
+
+	    for (pass = 1; pass <= NOTMUCH_COMPACT_REPLAY_PASSES; pass++) {
+		Xapian::Database live (xapian_path);
+		unsigned long revision = _compact_revision (live);
+
+		changes = _compact_replay (live, compacted, since);
+		compacted.commit ();
+		since = revision;
+		_compact_status (status_cb, closure,
+				 "copied %lu changes made while compacting",
+				 changes);
+		if (changes <= NOTMUCH_COMPACT_REPLAY_SMALL)
+		    break;
+	    }
+
+	    /* Hold off writers for the last changes and the swap,
+	     * waiting for one that is busy to finish. */
+	    for (attempt = 1; ; attempt++) {
+		ret = notmuch_database_open_verbose (path,
+						     NOTMUCH_DATABASE_MODE_READ_WRITE,
+						     &writer, &message);
+		if (ret == NOTMUCH_STATUS_SUCCESS)
+		    break;
+		if (attempt == NOTMUCH_COMPACT_LOCK_ATTEMPTS) {
+		    if (status_cb) status_cb (message, closure);
+		    goto DONE;
+		}
+		if (attempt == 1)
+		    _compact_status (status_cb, closure,
+				     "waiting for the database write lock");
+		if (message) {
+		    free (message);
+		    message = NULL;
+		}
+		sleep (1);
+	    }
+
+	    Xapian::Database live (xapian_path);
+	    changes = _compact_replay (live, compacted, since);
+	    compacted.commit ();
+	    compacted.close ();
+	    _compact_status (status_cb, closure,
+			     "copied %lu changes with the database locked",
+			     changes);
+	} catch (const Xapian::Error &error) {
+	    _notmuch_database_log (notmuch, "Error while copying changes made during compaction: %s\n",
+				   error.get_msg().c_str());
+	    ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	    goto DONE;
+	}
     }
 
     if (rename (xapian_path, backup_path)) {
@@ -1259,6 +2602,16 @@ notmuch_database_compact (const char *path,
     }
 
   DONE:
+    if (writer) {
+	notmuch_status_t ret2;
+
+	/* The writer's database is the one moved out of the way, so
+	 * closing it writes nothing into the compacted one. */
+	ret2 = notmuch_database_destroy (writer);
+	if (ret == NOTMUCH_STATUS_SUCCESS && ret2 != NOTMUCH_STATUS_SUCCESS)
+	    ret = ret2;
+    }
+
     if (notmuch) {
 	notmuch_status_t ret2;
 
@@ -1273,10 +2626,52 @@ notmuch_database_compact (const char *path,
 	    ret = ret2;
     }
 
+    if (renumber_xapian_path)
+	(void) rmtree (renumber_xapian_path);
+
+    if (lock_fd >= 0)
+	close (lock_fd);
+
+    if (message)
+	free (message);
+
     talloc_free (local);
 
     return ret;
 }
+
+notmuch_status_t
+notmuch_database_compact (const char *path,
+			  const char *backup_path,
+			  notmuch_compact_status_cb_t status_cb,
+			  void *closure)
+{
+    return _notmuch_database_compact (path, backup_path, FALSE,
+				      NOTMUCH_COMPACT_RENUMBER_NONE,
+				      status_cb, closure);
+}
+
+notmuch_status_t
+notmuch_database_compact_online (const char *path,
+				 const char *backup_path,
+				 notmuch_compact_status_cb_t status_cb,
+				 void *closure)
+{
+    return _notmuch_database_compact (path, backup_path, TRUE,
+				      NOTMUCH_COMPACT_RENUMBER_NONE,
+				      status_cb, closure);
+}
+
+notmuch_status_t
+notmuch_database_compact_renumber (const char *path,
+				   const char *backup_path,
+				   notmuch_compact_renumber_t renumber,
+				   notmuch_compact_status_cb_t status_cb,
+				   void *closure)
+{
+    return _notmuch_database_compact (path, backup_path, FALSE, renumber,
+				      status_cb, closure);
+}
 #else
 notmuch_status_t
 notmuch_database_compact (unused (const char *path),
@@ -1287,6 +2682,27 @@ notmuch_database_compact (unused (const char *path),
     _notmuch_database_log (notmuch, "notmuch was compiled against a xapian version lacking compaction support.\n");
     return NOTMUCH_STATUS_UNSUPPORTED_OPERATION;
 }
+
+notmuch_status_t
+notmuch_database_compact_online (unused (const char *path),
+				 unused (const char *backup_path),
+				 unused (notmuch_compact_status_cb_t status_cb),
+				 unused (void *closure))
+{
+    _notmuch_database_log (notmuch, "notmuch was compiled against a xapian version lacking compaction support.\n");
+    return NOTMUCH_STATUS_UNSUPPORTED_OPERATION;
+}
+
+notmuch_status_t
+notmuch_database_compact_renumber (unused (const char *path),
+				   unused (const char *backup_path),
+				   unused (notmuch_compact_renumber_t renumber),
+				   unused (notmuch_compact_status_cb_t status_cb),
+				   unused (void *closure))
+{
+    _notmuch_database_log (notmuch, "notmuch was compiled against a xapian version lacking compaction support.\n");
+    return NOTMUCH_STATUS_UNSUPPORTED_OPERATION;
+}
 #endif
 
 notmuch_status_t
@@ -1345,6 +2761,217 @@ handle_sigalrm (unused (int signal))
     do_progress_notify = 1;
 }
 
+/* The features whose upgrade changes how a reader that only knows the
+ * old features understands the documents already upgraded: filenames
+ * move out of the document data, directory timestamps move to
+ * documents of their own and folder terms become boolean.  These are
+ * upgraded in a single transaction.
+ *
+ * All the other upgrades only add to documents, so they are committed
+ * in batches of NOTMUCH_UPGRADE_BATCH messages, metadata entries or
+ * threads.  Readers see the database grow the new features as it
+ * goes, and keep using it with the old ones until the upgrade
+ * completes. */
+#define NOTMUCH_FEATURES_UPGRADE_AT_ONCE \
+    (NOTMUCH_FEATURE_FILE_TERMS | NOTMUCH_FEATURE_DIRECTORY_DOCS | \
+     NOTMUCH_FEATURE_BOOL_FOLDER)
+
+#define NOTMUCH_UPGRADE_BATCH 1000
+
+/* After each batch, a batched upgrade records how far it got in the
+ * metadata entry NOTMUCH_METADATA_UPGRADE_CURSOR:
+ *
+ *	<target features, in hex> <step> <position>
+ *
+ * where the position is the last document ID, metadata key or term
+ * upgraded in the step.  An upgrade to the same features that finds
+ * the cursor carries on from there; the upgrades are idempotent, so
+ * the cursor only saves work. */
+typedef enum {
+    UPGRADE_STEP_MESSAGES,
+    UPGRADE_STEP_DIRECTORIES,
+    UPGRADE_STEP_GHOSTS,
+    UPGRADE_STEP_THREAD_ID_VALUES,
+    UPGRADE_STEP_THREAD_SUMMARIES,
+    UPGRADE_STEP_CONTACTS
+} upgrade_step_t;
+
+typedef struct {
+    Xapian::WritableDatabase *db;
+    notmuch_bool_t batched;
+    unsigned int target_features;
+    /* Where an earlier upgrade stopped. */
+    int resume_step;
+    std::string resume_position;
+} upgrade_state_t;
+
+static void
+_upgrade_read_cursor (upgrade_state_t *state)
+{
+    std::string cursor = state->db->get_metadata (
+	NOTMUCH_METADATA_UPGRADE_CURSOR);
+    unsigned int features;
+    int step, position = 0;
+
+    state->resume_step = UPGRADE_STEP_MESSAGES;
+    state->resume_position.clear ();
+
+    if (sscanf (cursor.c_str (), "%x %d %n", &features, &step,
+		&position) < 2 ||
+	position == 0 || features != state->target_features)
+	return;
+
+    state->resume_step = step;
+    state->resume_position = cursor.substr (position);
+}
+
+/* Return where 'step' starts: after the resume position if an
+ * earlier upgrade stopped during it, or at the beginning. */
+static std::string
+_upgrade_start (upgrade_state_t *state, int step)
+{
+    if (state->resume_step == step)
+	return state->resume_position;
+    return "";
+}
+
+/* Commit the upgrades of the current batch, recording that 'step' is
+ * done up to 'position', and start the next batch. */
+static void
+_upgrade_checkpoint (upgrade_state_t *state, int step,
+		     const std::string &position)
+{
+    char prefix[32];
+
+    if (! state->batched)
+	return;
+
+    snprintf (prefix, sizeof (prefix), "%x %d ",
+	      state->target_features, step);
+    state->db->set_metadata (NOTMUCH_METADATA_UPGRADE_CURSOR,
+			     prefix + position);
+    state->db->commit_transaction ();
+    state->db->begin_transaction (true);
+}
+
+/* Collect in 'batch' up to NOTMUCH_UPGRADE_BATCH of the terms
+ * starting with 'prefix' that sort after 'last' (all of them for an
+ * empty 'last').  With 'metadata', collect metadata keys instead. */
+static void
+_upgrade_next_keys (Xapian::Database *db, const char *prefix,
+		    notmuch_bool_t metadata, const std::string &last,
+		    std::vector<std::string> &batch)
+{
+    Xapian::TermIterator t, t_end;
+
+    if (metadata) {
+	t = db->metadata_keys_begin (prefix);
+	t_end = db->metadata_keys_end (prefix);
+    } else {
+	t = db->allterms_begin (prefix);
+	t_end = db->allterms_end (prefix);
+    }
+
+    batch.clear ();
+    if (! last.empty ()) {
+	t.skip_to (last);
+	if (t != t_end && *t == last)
+	    t++;
+    }
+    for (; t != t_end && batch.size () < NOTMUCH_UPGRADE_BATCH; t++)
+	batch.push_back (*t);
+}
+
+/* Apply the per-message upgrades to 'new_features' to 'message'. */
+static void
+_upgrade_message (notmuch_message_t *message,
+		  enum _notmuch_features new_features)
+{
+    char *filename;
+
+    /* Before version 1, each message document had its
+     * filename in the data field. Copy that into the new
+     * format by calling notmuch_message_add_filename.
+     */
+    if (new_features & NOTMUCH_FEATURE_FILE_TERMS) {
+	filename = _notmuch_message_talloc_copy_data (message);
+	if (filename && *filename != '\0') {
+	    _notmuch_message_add_filename (message, filename);
+	    _notmuch_message_clear_data (message);
+	}
+	talloc_free (filename);
+    }
+
+    /* Prior to version 2, the "folder:" prefix was
+     * probabilistic and stemmed. Change it to the current
+     * boolean prefix. Add "path:" prefixes while at it.
+     */
+    if (new_features & NOTMUCH_FEATURE_BOOL_FOLDER)
+	_notmuch_message_upgrade_folder (message);
+
+    /* Prior to NOTMUCH_FEATURE_LAST_MOD, messages did not
+     * track modification revisions.  Give all messages the
+     * next available revision; since we just started tracking
+     * revisions for this database, that will be 1.
+     */
+    if (new_features & NOTMUCH_FEATURE_LAST_MOD)
+	_notmuch_message_upgrade_last_mod (message);
+
+    /* Prior to NOTMUCH_FEATURE_RECIPIENT_VALUES, the To, Cc
+     * and Bcc headers were only in the message file.  Read
+     * them from there once. */
+    if (new_features & NOTMUCH_FEATURE_RECIPIENT_VALUES)
+	_notmuch_message_upgrade_recipients (message);
+
+    /* Prior to NOTMUCH_FEATURE_SUBTREE_PATHS, messages carried a
+     * path: term for every ancestor of their directories.  Subtree
+     * queries now go through the directory documents. */
+    if (new_features & NOTMUCH_FEATURE_SUBTREE_PATHS)
+	_notmuch_message_upgrade_subtree_paths (message);
+}
+
+/* Turn the thread ID recorded in the metadata entry 'key' for a
+ * missing message into a ghost message. */
+static notmuch_status_t
+_upgrade_ghost (notmuch_database_t *notmuch, const std::string &key)
+{
+    Xapian::WritableDatabase *db =
+	static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    notmuch_private_status_t private_status;
+    notmuch_message_t *message;
+    std::string message_id, thread_id;
+
+    message_id = key.substr (strlen (NOTMUCH_METADATA_THREAD_ID_PREFIX));
+    thread_id = db->get_metadata (key);
+
+    /* Create ghost message */
+    message = _notmuch_message_create_for_message_id (
+	notmuch, message_id.c_str (), &private_status);
+    if (private_status == NOTMUCH_PRIVATE_STATUS_SUCCESS) {
+	/* Document already exists; ignore the stored thread ID */
+    } else if (private_status ==
+	       NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND) {
+	private_status = _notmuch_message_initialize_ghost (
+	    message, thread_id.c_str ());
+	if (! private_status)
+	    _notmuch_message_sync (message);
+    }
+
+    if (message)
+	notmuch_message_destroy (message);
+
+    if (private_status) {
+	_notmuch_database_log (notmuch,
+		 "Upgrade failed while creating ghost messages.\n");
+	return COERCE_STATUS (private_status, "Unexpected status from _notmuch_message_initialize_ghost");
+    }
+
+    /* Clear saved metadata thread ID */
+    db->set_metadata (key, "");
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 /* Upgrade the current database.
  *
  * After opening a database in read-write mode, the client should
@@ -1356,6 +2983,9 @@ handle_sigalrm (unused (int signal))
  * called periodically with 'count' as the number of messages upgraded
  * so far and 'total' the overall number of messages that will be
  * converted.
+ *
+ * See NOTMUCH_FEATURES_UPGRADE_AT_ONCE for which upgrades are
+ * committed in batches, and can be resumed.
  */
 notmuch_status_t
 notmuch_database_upgrade (notmuch_database_t *notmuch,
@@ -1374,6 +3004,7 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
     notmuch_private_status_t private_status;
     notmuch_query_t *query = NULL;
     unsigned int count = 0, total = 0;
+    upgrade_state_t state;
 
     status = _notmuch_database_ensure_writable (notmuch);
     if (status)
@@ -1408,7 +3039,8 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
     /* Figure out how much total work we need to do. */
     if (new_features &
 	(NOTMUCH_FEATURE_FILE_TERMS | NOTMUCH_FEATURE_BOOL_FOLDER |
-	 NOTMUCH_FEATURE_LAST_MOD)) {
+	 NOTMUCH_FEATURE_LAST_MOD | NOTMUCH_FEATURE_RECIPIENT_VALUES |
+	 NOTMUCH_FEATURE_SUBTREE_PATHS)) {
 	query = notmuch_query_create (notmuch, "");
 	unsigned msg_count;
 
@@ -1432,8 +3064,25 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
 	for (t = db->metadata_keys_begin ("thread_id_"); t != t_end; ++t)
 	    ++total;
     }
+    if (new_features & NOTMUCH_FEATURE_THREAD_ID_VALUES) {
+	t_end = db->allterms_end (NOTMUCH_PREFIX_THREAD);
+	for (t = db->allterms_begin (NOTMUCH_PREFIX_THREAD); t != t_end; t++)
+	    ++total;
+    }
+    if (new_features & NOTMUCH_FEATURE_THREAD_SUMMARIES) {
+	t_end = db->allterms_end (NOTMUCH_PREFIX_THREAD);
+	for (t = db->allterms_begin (NOTMUCH_PREFIX_THREAD); t != t_end; t++)
+	    ++total;
+    }
+    if (new_features & NOTMUCH_FEATURE_CONTACTS)
+	total += db->get_termfreq (std::string (NOTMUCH_PREFIX_TYPE) + "mail");
 
-    /* Perform the upgrade in a transaction. */
+    state.db = db;
+    state.batched = ! (new_features & NOTMUCH_FEATURES_UPGRADE_AT_ONCE);
+    state.target_features = target_features;
+    _upgrade_read_cursor (&state);
+
+    /* Perform the upgrade in a transaction, or in one per batch. */
     db->begin_transaction (true);
 
     /* Set the target features so we write out changes in the desired
@@ -1441,66 +3090,55 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
     notmuch->features = target_features;
 
     /* Perform per-message upgrades. */
-    if (new_features &
-	(NOTMUCH_FEATURE_FILE_TERMS | NOTMUCH_FEATURE_BOOL_FOLDER |
-	 NOTMUCH_FEATURE_LAST_MOD)) {
-	notmuch_messages_t *messages;
+    if ((new_features &
+	 (NOTMUCH_FEATURE_FILE_TERMS | NOTMUCH_FEATURE_BOOL_FOLDER |
+	  NOTMUCH_FEATURE_LAST_MOD | NOTMUCH_FEATURE_RECIPIENT_VALUES |
+	  NOTMUCH_FEATURE_SUBTREE_PATHS)) &&
+	state.resume_step <= UPGRADE_STEP_MESSAGES) {
+	std::string mail_term = std::string (NOTMUCH_PREFIX_TYPE) + "mail";
+	std::string start = _upgrade_start (&state, UPGRADE_STEP_MESSAGES);
+	Xapian::docid last = strtoul (start.c_str (), NULL, 10);
 	notmuch_message_t *message;
-	char *filename;
-
-	query = notmuch_query_create (notmuch, "");
 
-	status = notmuch_query_search_messages_st (query, &messages);
-	if (status)
-	    goto DONE;
-	for (;
-	     notmuch_messages_valid (messages);
-	     notmuch_messages_move_to_next (messages))
-	{
-	    if (do_progress_notify) {
-		progress_notify (closure, (double) count / total);
-		do_progress_notify = 0;
-	    }
+	/* The messages are walked by document ID, which is what the
+	 * cursor records. */
+	for (;;) {
+	    std::vector<Xapian::docid> batch;
+	    Xapian::PostingIterator p = db->postlist_begin (mail_term);
+	    Xapian::PostingIterator p_end = db->postlist_end (mail_term);
+
+	    if (last)
+		p.skip_to (last + 1);
+	    for (; p != p_end && batch.size () < NOTMUCH_UPGRADE_BATCH; p++)
+		batch.push_back (*p);
+	    if (batch.empty ())
+		break;
 
-	    message = notmuch_messages_get (messages);
-
-	    /* Before version 1, each message document had its
-	     * filename in the data field. Copy that into the new
-	     * format by calling notmuch_message_add_filename.
-	     */
-	    if (new_features & NOTMUCH_FEATURE_FILE_TERMS) {
-		filename = _notmuch_message_talloc_copy_data (message);
-		if (filename && *filename != '\0') {
-		    _notmuch_message_add_filename (message, filename);
-		    _notmuch_message_clear_data (message);
+	    for (size_t i = 0; i < batch.size (); i++) {
+		if (do_progress_notify) {
+		    progress_notify (closure, (double) count / total);
+		    do_progress_notify = 0;
 		}
-		talloc_free (filename);
-	    }
 
-	    /* Prior to version 2, the "folder:" prefix was
-	     * probabilistic and stemmed. Change it to the current
-	     * boolean prefix. Add "path:" prefixes while at it.
-	     */
-	    if (new_features & NOTMUCH_FEATURE_BOOL_FOLDER)
-		_notmuch_message_upgrade_folder (message);
-
-	    /* Prior to NOTMUCH_FEATURE_LAST_MOD, messages did not
-	     * track modification revisions.  Give all messages the
-	     * next available revision; since we just started tracking
-	     * revisions for this database, that will be 1.
-	     */
-	    if (new_features & NOTMUCH_FEATURE_LAST_MOD)
-		_notmuch_message_upgrade_last_mod (message);
+		message = _notmuch_message_create (local, notmuch, batch[i],
+						   &private_status);
+		if (message == NULL) {
+		    status = COERCE_STATUS (private_status,
+					    "Unexpected status from _notmuch_message_create");
+		    goto DONE;
+		}
 
-	    _notmuch_message_sync (message);
+		_upgrade_message (message, new_features);
+		_notmuch_message_sync (message);
+		notmuch_message_destroy (message);
 
-	    notmuch_message_destroy (message);
+		count++;
+	    }
 
-	    count++;
+	    last = batch.back ();
+	    _upgrade_checkpoint (&state, UPGRADE_STEP_MESSAGES,
+				 talloc_asprintf (local, "%u", last));
 	}
-
-	notmuch_query_destroy (query);
-	query = NULL;
     }
 
     /* Perform per-directory upgrades. */
@@ -1555,52 +3193,183 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
      * messages were stored as database metadata. Change these to
      * ghost messages.
      */
-    if (new_features & NOTMUCH_FEATURE_GHOSTS) {
-	notmuch_message_t *message;
-	std::string message_id, thread_id;
-
-	t_end = db->metadata_keys_end (NOTMUCH_METADATA_THREAD_ID_PREFIX);
-	for (t = db->metadata_keys_begin (NOTMUCH_METADATA_THREAD_ID_PREFIX);
-	     t != t_end; ++t) {
-	    if (do_progress_notify) {
-		progress_notify (closure, (double) count / total);
-		do_progress_notify = 0;
+    if ((new_features & NOTMUCH_FEATURE_GHOSTS) &&
+	state.resume_step <= UPGRADE_STEP_GHOSTS) {
+	std::string last = _upgrade_start (&state, UPGRADE_STEP_GHOSTS);
+	std::vector<std::string> batch;
+
+	for (;;) {
+	    _upgrade_next_keys (db, NOTMUCH_METADATA_THREAD_ID_PREFIX, TRUE,
+				last, batch);
+	    if (batch.empty ())
+		break;
+
+	    for (size_t i = 0; i < batch.size (); i++) {
+		if (do_progress_notify) {
+		    progress_notify (closure, (double) count / total);
+		    do_progress_notify = 0;
+		}
+
+		status = _upgrade_ghost (notmuch, batch[i]);
+		if (status)
+		    goto DONE;
+
+		++count;
 	    }
 
-	    message_id = (*t).substr (
-		strlen (NOTMUCH_METADATA_THREAD_ID_PREFIX));
-	    thread_id = db->get_metadata (*t);
-
-	    /* Create ghost message */
-	    message = _notmuch_message_create_for_message_id (
-		notmuch, message_id.c_str (), &private_status);
-	    if (private_status == NOTMUCH_PRIVATE_STATUS_SUCCESS) {
-		/* Document already exists; ignore the stored thread ID */
-	    } else if (private_status ==
-		       NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND) {
-		private_status = _notmuch_message_initialize_ghost (
-		    message, thread_id.c_str ());
-		if (! private_status)
-		    _notmuch_message_sync (message);
+	    last = batch.back ();
+	    _upgrade_checkpoint (&state, UPGRADE_STEP_GHOSTS, last);
+	}
+    }
+
+    /* Perform per-thread upgrades. */
+
+    /* Prior to NOTMUCH_FEATURE_THREAD_ID_VALUES, the thread ID was
+     * only stored as a term.  Copy it into a value for every
+     * document, ghosts included, carrying that term. */
+    if ((new_features & NOTMUCH_FEATURE_THREAD_ID_VALUES) &&
+	state.resume_step <= UPGRADE_STEP_THREAD_ID_VALUES) {
+	const char *thread_prefix = NOTMUCH_PREFIX_THREAD;
+	std::string last = _upgrade_start (&state,
+					   UPGRADE_STEP_THREAD_ID_VALUES);
+	std::vector<std::string> batch;
+
+	for (;;) {
+	    _upgrade_next_keys (db, thread_prefix, FALSE, last, batch);
+	    if (batch.empty ())
+		break;
+
+	    for (size_t i = 0; i < batch.size (); i++) {
+		Xapian::PostingIterator p, p_end;
+		std::string thread_id = batch[i].substr (strlen (thread_prefix));
+
+		if (do_progress_notify) {
+		    progress_notify (closure, (double) count / total);
+		    do_progress_notify = 0;
+		}
+
+		p_end = db->postlist_end (batch[i]);
+		for (p = db->postlist_begin (batch[i]); p != p_end; p++) {
+		    Xapian::Document document;
+
+		    document = find_document_for_doc_id (notmuch, *p);
+		    document.add_value (NOTMUCH_VALUE_THREAD_ID, thread_id);
+		    db->replace_document (*p, document);
+		}
+
+		++count;
 	    }
 
-	    if (private_status) {
-		_notmuch_database_log (notmuch,
-			 "Upgrade failed while creating ghost messages.\n");
-		status = COERCE_STATUS (private_status, "Unexpected status from _notmuch_message_initialize_ghost");
-		goto DONE;
+	    last = batch.back ();
+	    _upgrade_checkpoint (&state, UPGRADE_STEP_THREAD_ID_VALUES, last);
+	}
+    }
+
+    /* Prior to NOTMUCH_FEATURE_THREAD_SUMMARIES, threads had no
+     * summary records.  Write one for every thread, last, so that it
+     * reflects all of the message upgrades above. */
+    if (new_features & NOTMUCH_FEATURE_THREAD_SUMMARIES) {
+	const char *thread_prefix = NOTMUCH_PREFIX_THREAD;
+	std::string last = _upgrade_start (&state,
+					   UPGRADE_STEP_THREAD_SUMMARIES);
+	std::vector<std::string> batch;
+
+	/* The records written here are current; nothing needs to be
+	 * rewritten on close. */
+	if (notmuch->dirty_thread_summaries) {
+	    g_hash_table_destroy (notmuch->dirty_thread_summaries);
+	    notmuch->dirty_thread_summaries = NULL;
+	}
+
+	for (;;) {
+	    _upgrade_next_keys (db, thread_prefix, FALSE, last, batch);
+	    if (batch.empty ())
+		break;
+
+	    for (size_t i = 0; i < batch.size (); i++) {
+		const char *thread_id = batch[i].c_str () + strlen (thread_prefix);
+
+		if (do_progress_notify) {
+		    progress_notify (closure, (double) count / total);
+		    do_progress_notify = 0;
+		}
+
+		/* Merged threads are summarized under the winner's ID. */
+		if (strcmp (_notmuch_database_resolve_thread_id (notmuch,
+								 thread_id),
+			    thread_id) == 0) {
+		    status = _notmuch_thread_write_summary (notmuch, thread_id);
+		    if (status)
+			goto DONE;
+		}
+
+		++count;
 	    }
 
-	    /* Clear saved metadata thread ID */
-	    db->set_metadata (*t, "");
+	    last = batch.back ();
+	    _upgrade_checkpoint (&state, UPGRADE_STEP_THREAD_SUMMARIES, last);
+	}
+    }
+
+    /* Prior to NOTMUCH_FEATURE_CONTACTS, there was no contacts table.
+     * Count the headers of every message (those in archive shards
+     * excepted) into it.  Counting is not idempotent, so a step that
+     * starts from the beginning first drops what an upgrade to other
+     * features may have left. */
+    if ((new_features & NOTMUCH_FEATURE_CONTACTS) &&
+	state.resume_step <= UPGRADE_STEP_CONTACTS) {
+	std::string mail_term = std::string (NOTMUCH_PREFIX_TYPE) + "mail";
+	std::string start = _upgrade_start (&state, UPGRADE_STEP_CONTACTS);
+	Xapian::docid last = strtoul (start.c_str (), NULL, 10);
+
+	if (last == 0)
+	    _notmuch_database_clear_contacts (notmuch);
+
+	for (;;) {
+	    std::vector<Xapian::docid> batch;
+	    Xapian::PostingIterator p = db->postlist_begin (mail_term);
+	    Xapian::PostingIterator p_end = db->postlist_end (mail_term);
+
+	    if (last)
+		p.skip_to (last + 1);
+	    for (; p != p_end && batch.size () < NOTMUCH_UPGRADE_BATCH; p++)
+		batch.push_back (*p);
+	    if (batch.empty ())
+		break;
 
-	    ++count;
+	    for (size_t i = 0; i < batch.size (); i++) {
+		Xapian::Document document;
+		std::string date;
+
+		if (do_progress_notify) {
+		    progress_notify (closure, (double) count / total);
+		    do_progress_notify = 0;
+		}
+
+		document = find_document_for_doc_id (notmuch, batch[i]);
+		date = document.get_value (NOTMUCH_VALUE_TIMESTAMP);
+		_notmuch_database_update_contacts (
+		    notmuch,
+		    document.get_value (NOTMUCH_VALUE_FROM).c_str (),
+		    document.get_value (NOTMUCH_VALUE_TO).c_str (),
+		    document.get_value (NOTMUCH_VALUE_CC).c_str (),
+		    document.get_value (NOTMUCH_VALUE_BCC).c_str (),
+		    date.empty () ? 0 : Xapian::sortable_unserialise (date),
+		    1);
+
+		count++;
+	    }
+
+	    last = batch.back ();
+	    _upgrade_checkpoint (&state, UPGRADE_STEP_CONTACTS,
+				 talloc_asprintf (local, "%u", last));
 	}
     }
 
     status = NOTMUCH_STATUS_SUCCESS;
     db->set_metadata ("features", _print_features (local, notmuch->features));
     db->set_metadata ("version", STRINGIFY (NOTMUCH_DATABASE_VERSION));
+    db->set_metadata (NOTMUCH_METADATA_UPGRADE_CURSOR, "");
 
  DONE:
     if (status == NOTMUCH_STATUS_SUCCESS)
@@ -1631,6 +3400,8 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
 notmuch_status_t
 notmuch_database_begin_atomic (notmuch_database_t *notmuch)
 {
+    NOTMUCH_TRACE1 (atomic_begin, notmuch->atomic_nesting);
+
     if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY ||
 	notmuch->atomic_nesting > 0)
 	goto DONE;
@@ -1657,6 +3428,8 @@ notmuch_database_end_atomic (notmuch_database_t *notmuch)
 {
     Xapian::WritableDatabase *db;
 
+    NOTMUCH_TRACE1 (atomic_end, notmuch->atomic_nesting);
+
     if (notmuch->atomic_nesting == 0)
 	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
 
@@ -1666,6 +3439,10 @@ notmuch_database_end_atomic (notmuch_database_t *notmuch)
 
     db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
     try {
+	notmuch_profile_timer_t timer;
+
+	NOTMUCH_TRACE (flush_start);
+	_notmuch_profile_start (notmuch, &timer);
 	db->commit_transaction ();
 
 	/* This is a hack for testing.  Xapian never flushes on a
@@ -1674,10 +3451,20 @@ notmuch_database_end_atomic (notmuch_database_t *notmuch)
 	const char *thresh = getenv ("XAPIAN_FLUSH_THRESHOLD");
 	if (thresh && atoi (thresh) == 1)
 	    db->flush ();
+
+	if (notmuch->flush_budget &&
+	    notmuch->pending_bytes >= notmuch->flush_budget) {
+	    db->flush ();
+	    notmuch->pending_bytes = 0;
+	    _notmuch_profile_count (notmuch, NOTMUCH_PROFILE_FLUSHES, 1);
+	}
+	_notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_COMMIT);
+	NOTMUCH_TRACE1 (flush_done, NOTMUCH_STATUS_SUCCESS);
     } catch (const Xapian::Error &error) {
 	_notmuch_database_log (notmuch, "A Xapian exception occurred committing transaction: %s.\n",
 		 error.get_msg().c_str());
 	notmuch->exception_reported = TRUE;
+	NOTMUCH_TRACE1 (flush_done, NOTMUCH_STATUS_XAPIAN_EXCEPTION);
 	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 
@@ -1711,7 +3498,7 @@ notmuch_database_get_revision (notmuch_database_t *notmuch,
 const char *
 _notmuch_database_get_directory_db_path (const char *path)
 {
-    int term_len = strlen (_find_prefix ("directory")) + strlen (path);
+    int term_len = strlen (NOTMUCH_PREFIX_DIRECTORY) + strlen (path);
 
     if (term_len > NOTMUCH_TERM_MAX)
 	return _notmuch_sha1_of_string (path);
@@ -1823,16 +3610,45 @@ _notmuch_database_find_directory_id (notmuch_database_t *notmuch,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+/* Return the path of the directory with document ID 'doc_id' (in the
+ * database itself, as opposed to one combined with archive shards).
+ *
+ * A directory document keeps its path for as long as it exists, and
+ * document IDs are never reused, so the paths are cached for the
+ * lifetime of the database object. */
 const char *
 _notmuch_database_get_directory_path (void *ctx,
 				      notmuch_database_t *notmuch,
 				      unsigned int doc_id)
 {
     Xapian::Document document;
+    gpointer path;
+
+    if (notmuch->directory_paths == NULL)
+	notmuch->directory_paths = g_hash_table_new_full (NULL, NULL,
+							  NULL, g_free);
+    else if (g_hash_table_lookup_extended (notmuch->directory_paths,
+					   GUINT_TO_POINTER (doc_id),
+					   NULL, &path))
+	return talloc_strdup (ctx, (const char *) path);
+
+    document = find_document_for_doc_id (
+	notmuch, _notmuch_database_combined_doc_id (notmuch, doc_id));
+    path = g_strdup (document.get_data ().c_str ());
+    g_hash_table_insert (notmuch->directory_paths,
+			 GUINT_TO_POINTER (doc_id), path);
+
+    return talloc_strdup (ctx, (const char *) path);
+}
 
-    document = find_document_for_doc_id (notmuch, doc_id);
-
-    return talloc_strdup (ctx, document.get_data ().c_str ());
+/* Forget the cached path of a directory that is being deleted. */
+void
+_notmuch_database_forget_directory_path (notmuch_database_t *notmuch,
+					 unsigned int doc_id)
+{
+    if (notmuch->directory_paths)
+	g_hash_table_remove (notmuch->directory_paths,
+			     GUINT_TO_POINTER (doc_id));
 }
 
 /* Given a legal 'filename' for the database, (either relative to
@@ -1957,6 +3773,9 @@ _notmuch_database_generate_doc_id (notmuch_database_t *notmuch)
     return notmuch->last_doc_id;
 }
 
+/* Number of thread IDs reserved by each write of last_thread_id. */
+#define NOTMUCH_THREAD_ID_BLOCK 1024
+
 static const char *
 _notmuch_database_generate_thread_id (notmuch_database_t *notmuch)
 {
@@ -1969,13 +3788,36 @@ _notmuch_database_generate_thread_id (notmuch_database_t *notmuch)
 
     notmuch->last_thread_id++;
 
-    sprintf (thread_id, "%016" PRIx64, notmuch->last_thread_id);
+    /* Record a new block of IDs as used before handing out the first
+     * of them, so that no ID is ever handed out twice. */
+    if (notmuch->last_thread_id > notmuch->reserved_thread_id) {
+	notmuch->reserved_thread_id = notmuch->last_thread_id +
+	    NOTMUCH_THREAD_ID_BLOCK - 1;
+	sprintf (thread_id, "%016" PRIx64, notmuch->reserved_thread_id);
+	db->set_metadata ("last_thread_id", thread_id);
+    }
 
-    db->set_metadata ("last_thread_id", thread_id);
+    sprintf (thread_id, "%016" PRIx64, notmuch->last_thread_id);
 
     return thread_id;
 }
 
+/* Give back the unused part of the current block of thread IDs. */
+static void
+_notmuch_database_release_thread_ids (notmuch_database_t *notmuch)
+{
+    char thread_id[17];
+    Xapian::WritableDatabase *db;
+
+    if (notmuch->reserved_thread_id == notmuch->last_thread_id)
+	return;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    sprintf (thread_id, "%016" PRIx64, notmuch->last_thread_id);
+    db->set_metadata ("last_thread_id", thread_id);
+    notmuch->reserved_thread_id = notmuch->last_thread_id;
+}
+
 static char *
 _get_metadata_thread_id_key (void *ctx, const char *message_id)
 {
@@ -1990,7 +3832,8 @@ static notmuch_status_t
 _resolve_message_id_to_thread_id_old (notmuch_database_t *notmuch,
 				      void *ctx,
 				      const char *message_id,
-				      const char **thread_id_ret);
+				      const char **thread_id_ret,
+				      unsigned int *doc_id_ret);
 
 /* Find the thread ID to which the message with 'message_id' belongs.
  *
@@ -2003,27 +3846,58 @@ _resolve_message_id_to_thread_id_old (notmuch_database_t *notmuch,
  * message ID and stored in the database metadata so that the
  * thread ID can be looked up if the message is added to the database
  * later.
+ *
+ * '*doc_id_ret' is set to the document ID of the message (or of its
+ * new ghost), or to 0 if it has none in this database.
  */
 static notmuch_status_t
 _resolve_message_id_to_thread_id (notmuch_database_t *notmuch,
 				  void *ctx,
 				  const char *message_id,
-				  const char **thread_id_ret)
+				  const char **thread_id_ret,
+				  unsigned int *doc_id_ret)
 {
     notmuch_private_status_t status;
     notmuch_message_t *message;
+    _message_id_entry_t *entry;
+    const char *key = message_id;
+
+    *doc_id_ret = 0;
 
     if (! (notmuch->features & NOTMUCH_FEATURE_GHOSTS))
 	return _resolve_message_id_to_thread_id_old (notmuch, ctx, message_id,
-						     thread_id_ret);
+						     thread_id_ret, doc_id_ret);
 
-    /* Look for this message (regular or ghost) */
-    message = _notmuch_message_create_for_message_id (
-	notmuch, message_id, &status);
-    if (status == NOTMUCH_PRIVATE_STATUS_SUCCESS) {
+    if (strlen (message_id) > NOTMUCH_MESSAGE_ID_MAX)
+	key = _notmuch_message_id_compressed (ctx, message_id);
+
+    entry = _message_id_cache_lookup (notmuch, key);
+    if (entry && entry->thread_id) {
+	*doc_id_ret = entry->doc_id;
+	*thread_id_ret = talloc_strdup (
+	    ctx, _notmuch_database_resolve_thread_id (notmuch,
+						      entry->thread_id));
+	return *thread_id_ret ? NOTMUCH_STATUS_SUCCESS :
+	    NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    /* Look for this message (regular or ghost) */
+    message = _notmuch_message_create_for_message_id (
+	notmuch, message_id, &status);
+    if (status == NOTMUCH_PRIVATE_STATUS_SUCCESS) {
 	/* Message exists */
+	*doc_id_ret = _notmuch_message_get_doc_id (message);
 	*thread_id_ret = talloc_steal (
 	    ctx, notmuch_message_get_thread_id (message));
+	_message_id_cache_store (notmuch, key,
+				 _notmuch_message_get_doc_id (message),
+				 *thread_id_ret);
+    } else if (status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND &&
+	       (*thread_id_ret = _notmuch_database_find_archived_thread_id (
+		   notmuch, ctx, key))) {
+	/* The message is archived.  A ghost would be a second
+	 * document with its ID. */
+	status = NOTMUCH_PRIVATE_STATUS_SUCCESS;
     } else if (status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND) {
 	/* Message did not exist.  Give it a fresh thread ID and
 	 * populate this message as a ghost message. */
@@ -2033,9 +3907,14 @@ _resolve_message_id_to_thread_id (notmuch_database_t *notmuch,
 	    status = NOTMUCH_PRIVATE_STATUS_OUT_OF_MEMORY;
 	} else {
 	    status = _notmuch_message_initialize_ghost (message, *thread_id_ret);
-	    if (status == 0)
+	    if (status == 0) {
 		/* Commit the new ghost message */
 		_notmuch_message_sync (message);
+		*doc_id_ret = _notmuch_message_get_doc_id (message);
+		_message_id_cache_store (notmuch, key,
+					 _notmuch_message_get_doc_id (message),
+					 *thread_id_ret);
+	    }
 	}
     } else {
 	/* Create failed. Fall through. */
@@ -2051,7 +3930,8 @@ static notmuch_status_t
 _resolve_message_id_to_thread_id_old (notmuch_database_t *notmuch,
 				      void *ctx,
 				      const char *message_id,
-				      const char **thread_id_ret)
+				      const char **thread_id_ret,
+				      unsigned int *doc_id_ret)
 {
     notmuch_status_t status;
     notmuch_message_t *message;
@@ -2065,6 +3945,7 @@ _resolve_message_id_to_thread_id_old (notmuch_database_t *notmuch,
 	return status;
 
     if (message) {
+	*doc_id_ret = _notmuch_message_get_doc_id (message);
 	*thread_id_ret = talloc_steal (ctx,
 				       notmuch_message_get_thread_id (message));
 
@@ -2088,7 +3969,9 @@ _resolve_message_id_to_thread_id_old (notmuch_database_t *notmuch,
 					_notmuch_database_generate_thread_id (notmuch));
 	db->set_metadata (metadata_key, *thread_id_ret);
     } else {
-	*thread_id_ret = talloc_strdup (ctx, thread_id_string.c_str());
+	*thread_id_ret = talloc_strdup (
+	    ctx, _notmuch_database_resolve_thread_id (
+		notmuch, thread_id_string.c_str()));
     }
 
     talloc_free (metadata_key);
@@ -2096,38 +3979,152 @@ _resolve_message_id_to_thread_id_old (notmuch_database_t *notmuch,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+/* Merging threads only records an alias; the messages of the loser
+ * are rewritten later by notmuch_database_merge_threads, so that a
+ * message joining two large threads stays cheap to add. */
 static notmuch_status_t
 _merge_threads (notmuch_database_t *notmuch,
 		const char *winner_thread_id,
 		const char *loser_thread_id)
 {
+    return _notmuch_database_alias_thread (notmuch, winner_thread_id,
+					   loser_thread_id);
+}
+
+/* Move every message of thread 'loser_thread_id' into thread
+ * 'winner_thread_id'. */
+static notmuch_status_t
+_rewrite_thread (notmuch_database_t *notmuch,
+		 const char *winner_thread_id,
+		 const char *loser_thread_id)
+{
+    std::vector<Xapian::docid> doc_ids;
     Xapian::PostingIterator loser, loser_end;
-    notmuch_message_t *message = NULL;
+    notmuch_message_t *message;
     notmuch_private_status_t private_status;
-    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
 
+    /* Rewriting changes the posting list, so list it up front. */
     find_doc_ids (notmuch, "thread", loser_thread_id, &loser, &loser_end);
+    for ( ; loser != loser_end; loser++)
+	doc_ids.push_back (*loser);
 
-    for ( ; loser != loser_end; loser++) {
+    for (size_t n = 0; n < doc_ids.size (); n++) {
 	message = _notmuch_message_create (notmuch, notmuch,
-					   *loser, &private_status);
-	if (message == NULL) {
-	    ret = COERCE_STATUS (private_status,
-				 "Cannot find document for doc_id from query");
-	    goto DONE;
-	}
+					   doc_ids[n], &private_status);
+	if (message == NULL)
+	    return COERCE_STATUS (private_status,
+				  "Cannot find document for doc_id from query");
 
 	_notmuch_message_remove_term (message, "thread", loser_thread_id);
 	_notmuch_message_add_term (message, "thread", winner_thread_id);
 	_notmuch_message_sync (message);
 
 	notmuch_message_destroy (message);
-	message = NULL;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_merge_threads (notmuch_database_t *notmuch,
+				unsigned int *count)
+{
+    void *local;
+    notmuch_string_list_t *losers;
+    notmuch_string_node_t *node;
+    notmuch_status_t ret, ret2;
+    notmuch_bool_t in_atomic = FALSE, archived;
+    Xapian::TermIterator i, end;
+    const std::string prefix = NOTMUCH_METADATA_THREAD_ALIAS_PREFIX;
+
+    if (count)
+	*count = 0;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    if (! _notmuch_database_has_thread_aliases (notmuch))
+	return NOTMUCH_STATUS_SUCCESS;
+
+    local = talloc_new (NULL);
+    losers = _notmuch_string_list_create (local);
+
+    try {
+	Xapian::WritableDatabase *db =
+	    static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+	/* Point every alias straight at the end of its chain first, so
+	 * that dropping them one at a time never breaks a chain that
+	 * is still in use. */
+	end = db->metadata_keys_end (prefix);
+	for (i = db->metadata_keys_begin (prefix); i != end; i++) {
+	    std::string loser = (*i).substr (prefix.size ());
+	    std::string winner = db->get_metadata (*i);
+
+	    if (winner.empty ())
+		continue;
+	    _notmuch_string_list_append (losers,
+					 talloc_strdup (losers, loser.c_str ()));
+	    if (winner != _notmuch_database_resolve_thread_id (notmuch,
+							      loser.c_str ()))
+		db->set_metadata (*i, _notmuch_database_resolve_thread_id (
+				      notmuch, loser.c_str ()));
+	}
+
+	/* Each thread is moved, and its alias dropped, in a single
+	 * transaction. */
+	for (node = losers->head; node; node = node->next) {
+	    ret = notmuch_database_begin_atomic (notmuch);
+	    if (ret)
+		goto DONE;
+	    in_atomic = TRUE;
+
+	    ret = _rewrite_thread (
+		notmuch,
+		_notmuch_database_resolve_thread_id (notmuch, node->string),
+		node->string);
+	    if (ret)
+		goto DONE;
+	    /* Archived messages cannot be moved, and keep needing the
+	     * alias. */
+	    archived = _notmuch_database_has_archived_thread (notmuch,
+							      node->string);
+	    if (! archived)
+		_notmuch_database_forget_thread_alias (notmuch, node->string);
+
+	    in_atomic = FALSE;
+	    ret = notmuch_database_end_atomic (notmuch);
+	    if (ret)
+		goto DONE;
+
+	    if (count && ! archived)
+		(*count)++;
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred merging threads: %s.\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 
   DONE:
-    if (message)
-	notmuch_message_destroy (message);
+    if (in_atomic) {
+	ret2 = notmuch_database_end_atomic (notmuch);
+	if (ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = ret2;
+    }
+
+    /* Cached thread IDs may name threads that are gone now. */
+    _message_id_cache_clear (notmuch);
+
+    /* The table is reloaded from the remaining aliases on next use. */
+    if (notmuch->thread_aliases) {
+	g_hash_table_destroy (notmuch->thread_aliases);
+	notmuch->thread_aliases = NULL;
+    }
+
+    talloc_free (local);
 
     return ret;
 }
@@ -2146,7 +4143,7 @@ _notmuch_database_link_message_to_parents (notmuch_database_t *notmuch,
 {
     GHashTable *parents = NULL;
     const char *refs, *in_reply_to, *in_reply_to_message_id;
-    const char *last_ref_message_id, *this_message_id;
+    const char *last_ref_message_id, *this_message_id, *parent_id;
     GList *l, *keys = NULL;
     notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
 
@@ -2167,18 +4164,16 @@ _notmuch_database_link_message_to_parents (notmuch_database_t *notmuch,
     /* For the parent of this message, use the last message ID of the
      * References header, if available.  If not, fall back to the
      * first message ID in the In-Reply-To header. */
-    if (last_ref_message_id) {
-        _notmuch_message_add_term (message, "replyto",
-                                   last_ref_message_id);
-    } else if (in_reply_to_message_id) {
-	_notmuch_message_add_term (message, "replyto",
-			     in_reply_to_message_id);
-    }
+    parent_id = last_ref_message_id ? last_ref_message_id :
+	in_reply_to_message_id;
+    if (parent_id)
+	_notmuch_message_add_term (message, "replyto", parent_id);
 
     keys = g_hash_table_get_keys (parents);
     for (l = keys; l; l = l->next) {
 	char *parent_message_id;
 	const char *parent_thread_id = NULL;
+	unsigned int parent_doc_id;
 
 	parent_message_id = (char *) l->data;
 
@@ -2188,10 +4183,17 @@ _notmuch_database_link_message_to_parents (notmuch_database_t *notmuch,
 	ret = _resolve_message_id_to_thread_id (notmuch,
 						message,
 						parent_message_id,
-						&parent_thread_id);
+						&parent_thread_id,
+						&parent_doc_id);
 	if (ret)
 	    goto DONE;
 
+	/* Remember the document of the parent, so that threads can
+	 * be put together without looking up message IDs. */
+	if (parent_doc_id && parent_id &&
+	    strcmp (parent_message_id, parent_id) == 0)
+	    _notmuch_message_set_parent_doc_id (message, parent_doc_id);
+
 	if (*thread_id == NULL) {
 	    *thread_id = talloc_strdup (message, parent_thread_id);
 	    _notmuch_message_add_term (message, "thread", *thread_id);
@@ -2375,163 +4377,870 @@ _notmuch_database_link_message (notmuch_database_t *notmuch,
     return status;
 }
 
-notmuch_status_t
-notmuch_database_add_message (notmuch_database_t *notmuch,
-			      const char *filename,
-			      notmuch_message_t **message_ret)
+/* A message file read, parsed and indexed by
+ * notmuch_database_index_file, ready to be added to the database.
+ * Everything here belongs to this object (and so to the thread that
+ * created it) until notmuch_database_add_indexed_file. */
+struct _notmuch_indexed_file {
+    /* Status to report when the file is added, as
+     * notmuch_database_add_message would have. */
+    notmuch_status_t status;
+    /* Whether the whole message has been parsed and indexed into
+     * 'document' yet, and the status of doing so.  This only matters
+     * for a message new to the database, so notmuch_database_add_message
+     * leaves it until the message ID is known to be new. */
+    notmuch_bool_t index_done;
+    notmuch_status_t index_status;
+    /* TRUE if only the headers were indexed, leaving the body for
+     * notmuch_database_index_pending. */
+    notmuch_bool_t body_deferred;
+
+    char *filename;
+    notmuch_message_file_t *message_file;
+    char *message_id;
+    const char *from, *subject, *date;
+    const char *to, *cc, *bcc;
+    /* The header record of the message, see
+     * _notmuch_indexed_file_record_headers. */
+    char *header_record;
+    size_t header_record_length;
+
+    /* A private, detached "database" that receives any error messages
+     * and provides the term generator for 'document', so that no
+     * state is shared with the database being indexed for. */
+    notmuch_database_t *indexer;
+    /* The terms generated for the message, to be merged into its
+     * document by notmuch_database_add_indexed_file. */
+    notmuch_message_t *document;
+};
+
+static int
+_notmuch_indexer_destructor (notmuch_database_t *indexer)
 {
+    delete indexer->term_gen;
+    indexer->term_gen = NULL;
+
+    return 0;
+}
+
+static notmuch_database_t *
+_notmuch_database_create_indexer (void *ctx, notmuch_database_t *notmuch)
+{
+    notmuch_database_t *indexer;
+
+    indexer = talloc_zero (ctx, notmuch_database_t);
+    if (unlikely (indexer == NULL))
+	return NULL;
+
+    indexer->mode = NOTMUCH_DATABASE_MODE_READ_ONLY;
+    indexer->features = notmuch->features;
+    indexer->snippet_length = notmuch->snippet_length;
+    indexer->extract_attachments = notmuch->extract_attachments;
+
+    indexer->term_gen = new Xapian::TermGenerator;
+    indexer->term_gen->set_stemmer (Xapian::Stem ("english"));
+    talloc_set_destructor (indexer, _notmuch_indexer_destructor);
+
+    return indexer;
+}
+
+/* Read the headers of 'filename' into a new notmuch_indexed_file_t,
+ * leaving the body for _notmuch_indexed_file_index. */
+static notmuch_status_t
+_notmuch_database_read_file (notmuch_database_t *notmuch,
+			     const char *filename,
+			     notmuch_indexed_file_t **indexed_ret)
+{
+    notmuch_indexed_file_t *indexed;
     notmuch_message_file_t *message_file;
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+    const char *header;
+
+    *indexed_ret = NULL;
+
+    indexed = talloc_zero (NULL, notmuch_indexed_file_t);
+    if (unlikely (indexed == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    indexed->filename = talloc_strdup (indexed, filename);
+    indexed->indexer = _notmuch_database_create_indexer (indexed, notmuch);
+    if (unlikely (indexed->filename == NULL || indexed->indexer == NULL)) {
+	talloc_free (indexed);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    *indexed_ret = indexed;
+
+    message_file = _notmuch_message_file_open_ctx (indexed->indexer,
+						   indexed, filename);
+    if (message_file == NULL) {
+	ret = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+    indexed->message_file = message_file;
+
+    /* Parse the headers up front to get better error status. */
+    ret = _notmuch_message_file_parse_headers (message_file);
+    if (ret)
+	goto DONE;
+
+    /* Before we do any real work, (especially before doing a
+     * potential SHA-1 computation on the entire file's contents),
+     * let's make sure that what we're looking at looks like an
+     * actual email message.
+     */
+    indexed->from = _notmuch_message_file_get_header (message_file, "from");
+    indexed->subject = _notmuch_message_file_get_header (message_file,
+							 "subject");
+    indexed->to = _notmuch_message_file_get_header (message_file, "to");
+
+    if ((indexed->from == NULL || *indexed->from == '\0') &&
+	(indexed->subject == NULL || *indexed->subject == '\0') &&
+	(indexed->to == NULL || *indexed->to == '\0'))
+    {
+	ret = NOTMUCH_STATUS_FILE_NOT_EMAIL;
+	goto DONE;
+    }
+
+    /* Now that we're sure it's mail, the first order of business
+     * is to find a message ID (or else create one ourselves). */
+
+    header = _notmuch_message_file_get_header (message_file, "message-id");
+    if (header && *header != '\0') {
+	indexed->message_id = _parse_message_id (indexed, header, NULL);
+
+	/* So the header value isn't RFC-compliant, but it's
+	 * better than no message-id at all. */
+	if (indexed->message_id == NULL)
+	    indexed->message_id = talloc_strdup (indexed, header);
+    }
+
+    if (indexed->message_id == NULL ) {
+	/* No message-id at all, let's generate one by taking a
+	 * hash over the file's contents. */
+	char *sha1 = _notmuch_sha1_of_file (filename);
+
+	/* If that failed too, something is really wrong. Give up. */
+	if (sha1 == NULL) {
+	    ret = NOTMUCH_STATUS_FILE_ERROR;
+	    goto DONE;
+	}
+
+	indexed->message_id = talloc_asprintf (indexed,
+					       "notmuch-sha1-%s", sha1);
+	free (sha1);
+    }
+
+    indexed->date = _notmuch_message_file_get_header (message_file, "date");
+    indexed->cc = _notmuch_message_file_get_header (message_file, "cc");
+    indexed->bcc = _notmuch_message_file_get_header (message_file, "bcc");
+    _notmuch_indexed_file_record_headers (notmuch, indexed);
+
+  DONE:
+    indexed->status = ret;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* The headers recorded for new messages unless the caller chooses
+ * others: those notmuch reply reads besides the ones with values of
+ * their own. */
+static const char *default_recorded_headers[] = {
+    "date", "reply-to", "in-reply-to", "references",
+    "envelope-to", "x-original-to", "delivered-to", "list-id",
+};
+
+static void
+_notmuch_indexed_file_record_header (std::string &record,
+				     notmuch_message_file_t *message_file,
+				     const char *name)
+{
+    const char *value = _notmuch_message_file_get_header (message_file, name);
+
+    record.append (name);
+    record.push_back ('\0');
+    if (value)
+	record.append (value);
+    record.push_back ('\0');
+}
+
+/* Build the header record of the message read by
+ * _notmuch_database_read_file. */
+static void
+_notmuch_indexed_file_record_headers (notmuch_database_t *notmuch,
+				      notmuch_indexed_file_t *indexed)
+{
+    std::string record;
+    size_t i;
+
+    if (notmuch->recorded_headers) {
+	for (notmuch_string_node_t *node = notmuch->recorded_headers->head;
+	     node; node = node->next)
+	    _notmuch_indexed_file_record_header (record, indexed->message_file,
+						 node->string);
+    } else {
+	for (i = 0; i < ARRAY_SIZE (default_recorded_headers); i++)
+	    _notmuch_indexed_file_record_header (record, indexed->message_file,
+						 default_recorded_headers[i]);
+    }
+
+    if (record.empty ())
+	return;
+
+    indexed->header_record = (char *) talloc_memdup (indexed, record.data (),
+						     record.size ());
+    if (indexed->header_record)
+	indexed->header_record_length = record.size ();
+}
+
+/* Parse the whole of the message read by _notmuch_database_read_file,
+ * and generate its terms into indexed->document.  With 'defer_body',
+ * index just the headers instead. */
+static void
+_notmuch_indexed_file_index (notmuch_indexed_file_t *indexed,
+			     notmuch_bool_t defer_body)
+{
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+
+    indexed->index_done = TRUE;
+    indexed->body_deferred = defer_body;
+
+    if (! defer_body) {
+	ret = _notmuch_message_file_parse (indexed->message_file);
+	if (ret)
+	    goto DONE;
+    }
+
+    try {
+	indexed->document = _notmuch_message_create_detached (indexed,
+							      indexed->indexer);
+	if (unlikely (indexed->document == NULL)) {
+	    ret = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    goto DONE;
+	}
+
+	if (defer_body)
+	    ret = _notmuch_message_index_headers (indexed->document,
+						  indexed->message_file);
+	else
+	    ret = _notmuch_message_index_file (indexed->document,
+					       indexed->message_file);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (indexed->indexer,
+			       "A Xapian exception occurred indexing message: %s.\n",
+			       error.get_msg().c_str());
+	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    indexed->index_status = ret;
+}
+
+notmuch_status_t
+notmuch_database_index_file (notmuch_database_t *notmuch,
+			     const char *filename,
+			     notmuch_indexed_file_t **indexed_ret)
+{
+    notmuch_status_t ret;
+
+    ret = _notmuch_database_read_file (notmuch, filename, indexed_ret);
+    if (ret)
+	return ret;
+
+    if (! (*indexed_ret)->status)
+	_notmuch_indexed_file_index (*indexed_ret, notmuch->defer_body);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+static notmuch_status_t
+_notmuch_database_add_indexed_file (notmuch_database_t *notmuch,
+				    notmuch_indexed_file_t *indexed,
+				    notmuch_message_t **message_ret)
+{
     notmuch_message_t *message = NULL;
     notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS, ret2;
     notmuch_private_status_t private_status;
     notmuch_bool_t is_ghost = false;
+    notmuch_profile_timer_t timer;
+
+    if (message_ret)
+	*message_ret = NULL;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    if (indexed->indexer->status_string)
+	_notmuch_database_log (notmuch, "%s", indexed->indexer->status_string);
+
+    if (indexed->status)
+	return indexed->status;
+
+    /* Adding a message may change many documents.  Do this all
+     * atomically. */
+    ret = notmuch_database_begin_atomic (notmuch);
+    if (ret)
+	return ret;
+
+    try {
+	/* Now that we have a message ID, we get a message object,
+	 * (which may or may not reference an existing document in the
+	 * database). */
+
+	message = _notmuch_message_create_for_message_id (notmuch,
+							  indexed->message_id,
+							  &private_status);
+
+	if (message == NULL) {
+	    ret = COERCE_STATUS (private_status,
+				 "Unexpected status value from _notmuch_message_create_for_message_id");
+	    goto DONE;
+	}
+
+	_notmuch_message_add_filename (message, indexed->filename);
+
+	/* Is this a newly created message object or a ghost
+	 * message?  We have to be slightly careful: if this is a
+	 * blank message, it's not safe to call
+	 * notmuch_message_get_flag yet. */
+	if (private_status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND ||
+	    (is_ghost = notmuch_message_get_flag (
+		message, NOTMUCH_MESSAGE_FLAG_GHOST))) {
+	    /* Only now is the body worth reading, and we must do so
+	     * before changing any other document. */
+	    if (! indexed->index_done) {
+		_notmuch_profile_start (notmuch, &timer);
+		_notmuch_indexed_file_index (indexed, notmuch->defer_body);
+		_notmuch_profile_stop (notmuch, &timer,
+				       NOTMUCH_PROFILE_INDEX_TERMS);
+		if (indexed->indexer->status_string)
+		    _notmuch_database_log (notmuch, "%s",
+					   indexed->indexer->status_string);
+	    }
+
+	    ret = indexed->index_status;
+	    if (ret)
+		goto DONE;
+
+	    _notmuch_message_add_term (message, "type", "mail");
+	    if (is_ghost)
+		/* Convert ghost message to a regular message */
+		_notmuch_message_remove_term (message, "type", "ghost");
+
+	    _notmuch_profile_start (notmuch, &timer);
+	    ret = _notmuch_database_link_message (notmuch, message,
+						  indexed->message_file,
+						  is_ghost);
+	    _notmuch_profile_stop (notmuch, &timer,
+				   NOTMUCH_PROFILE_LINK_THREADS);
+	    if (ret)
+		goto DONE;
+
+	    _notmuch_message_set_header_values (message, indexed->date,
+						indexed->from,
+						indexed->subject);
+	    _notmuch_message_set_recipient_values (message, indexed->to,
+						   indexed->cc, indexed->bcc);
+	    _notmuch_database_update_contacts (
+		notmuch, indexed->from, indexed->to, indexed->cc, indexed->bcc,
+		notmuch_message_get_date (message), 1);
+	    _notmuch_message_set_header_record (message,
+						indexed->header_record,
+						indexed->header_record_length);
+
+	    _notmuch_message_merge_terms (message, indexed->document);
+	    if (indexed->body_deferred)
+		_notmuch_message_add_term (message, "pending", "body");
+
+	    _notmuch_database_apply_tag_rules (notmuch, message,
+					       indexed->message_file);
+	} else {
+	    ret = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
+	}
+
+	_notmuch_profile_start (notmuch, &timer);
+	_notmuch_message_sync (message);
+	_notmuch_profile_stop (notmuch, &timer,
+			       NOTMUCH_PROFILE_WRITE_DOCUMENTS);
+
+	/* The children of a new message are likely to follow. */
+	if (ret == NOTMUCH_STATUS_SUCCESS)
+	    _message_id_cache_store (notmuch,
+				     notmuch_message_get_message_id (message),
+				     _notmuch_message_get_doc_id (message),
+				     notmuch_message_get_thread_id (message));
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred adding message: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	/* Some of what was cached may not have been written. */
+	_message_id_cache_clear (notmuch);
+	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	goto DONE;
+    }
+
+  DONE:
+    if (message) {
+	if ((ret == NOTMUCH_STATUS_SUCCESS ||
+	     ret == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) && message_ret)
+	    *message_ret = message;
+	else
+	    notmuch_message_destroy (message);
+    }
+
+    ret2 = notmuch_database_end_atomic (notmuch);
+    if ((ret == NOTMUCH_STATUS_SUCCESS ||
+	 ret == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) &&
+	ret2 != NOTMUCH_STATUS_SUCCESS)
+	ret = ret2;
+
+    return ret;
+}
+
+notmuch_status_t
+notmuch_database_add_indexed_file (notmuch_database_t *notmuch,
+				   notmuch_indexed_file_t *indexed,
+				   notmuch_message_t **message_ret)
+{
+    notmuch_status_t ret;
+
+    NOTMUCH_TRACE1 (message_add_start, indexed->filename);
+    ret = _notmuch_database_add_indexed_file (notmuch, indexed, message_ret);
+    NOTMUCH_TRACE2 (message_add_done, indexed->filename, ret);
+
+    return ret;
+}
+
+void
+notmuch_indexed_file_destroy (notmuch_indexed_file_t *indexed)
+{
+    talloc_free (indexed);
+}
+
+notmuch_status_t
+notmuch_database_add_message (notmuch_database_t *notmuch,
+			      const char *filename,
+			      notmuch_message_t **message_ret)
+{
+    notmuch_indexed_file_t *indexed;
+    notmuch_profile_timer_t timer;
+    notmuch_status_t ret;
+
+    if (message_ret)
+	*message_ret = NULL;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    /* Only the headers are read unless the message turns out to be
+     * new, so adding another copy of a known message is cheap. */
+    _notmuch_profile_start (notmuch, &timer);
+    ret = _notmuch_database_read_file (notmuch, filename, &indexed);
+    _notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_READ_HEADERS);
+    if (ret)
+	return ret;
+
+    /* The file is read through a handle of its own, which keeps no
+     * profile. */
+    if (indexed->message_file)
+	_notmuch_profile_count (notmuch, NOTMUCH_PROFILE_FILES_OPENED, 1);
+
+    ret = notmuch_database_add_indexed_file (notmuch, indexed, message_ret);
+    notmuch_indexed_file_destroy (indexed);
+
+    return ret;
+}
+
+notmuch_status_t
+notmuch_database_set_defer_body (notmuch_database_t *notmuch,
+				 notmuch_bool_t defer)
+{
+    notmuch->defer_body = defer;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_set_extract_attachments (notmuch_database_t *notmuch,
+					  notmuch_bool_t extract)
+{
+    notmuch->extract_attachments = extract;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_set_body_positions (notmuch_database_t *notmuch,
+				     notmuch_bool_t positions)
+{
+    enum _notmuch_features features = notmuch->features;
+    notmuch_status_t status;
+
+    if (positions)
+	features &= ~NOTMUCH_FEATURE_BODY_NO_POSITIONS;
+    else
+	features |= NOTMUCH_FEATURE_BODY_NO_POSITIONS;
+
+    if (features == notmuch->features)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    try {
+	Xapian::WritableDatabase *db =
+	    static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+	db->set_metadata ("features", _print_features (notmuch, features));
+	notmuch->features = features;
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred setting the database features: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_set_snippet_length (notmuch_database_t *notmuch,
+				     unsigned int length)
+{
+    notmuch->snippet_length = length;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_set_flush_budget (notmuch_database_t *notmuch,
+				   size_t bytes)
+{
+    notmuch->flush_budget = bytes;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+void
+_notmuch_database_add_pending (notmuch_database_t *notmuch, size_t bytes)
+{
+    /* Xapian keeps a document's stored data, values and any document
+     * it replaces in memory as well as the terms. */
+    notmuch->pending_bytes += bytes + 256;
+}
+
+notmuch_status_t
+notmuch_database_set_recorded_headers (notmuch_database_t *notmuch,
+				       const char **headers,
+				       size_t num_headers)
+{
+    notmuch_string_list_t *list;
+    size_t i;
+
+    if (headers == NULL) {
+	talloc_free (notmuch->recorded_headers);
+	notmuch->recorded_headers = NULL;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    list = _notmuch_string_list_create (notmuch);
+    if (unlikely (list == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    for (i = 0; i < num_headers; i++) {
+	char *name = talloc_strdup (list, headers[i]);
+	char *c;
+
+	if (unlikely (name == NULL)) {
+	    talloc_free (list);
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	}
+
+	/* Names are compared case-insensitively; a record can't hold
+	 * an empty one. */
+	for (c = name; *c; c++)
+	    *c = g_ascii_tolower (*c);
+	if (*name == '\0')
+	    continue;
+
+	_notmuch_string_list_append (list, name);
+    }
+
+    talloc_free (notmuch->recorded_headers);
+    notmuch->recorded_headers = list;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Index the body of the message with document ID 'doc_id', whose
+ * indexing was deferred, setting *indexed to whether it was.  A
+ * message whose file cannot be read stays pending. */
+static notmuch_status_t
+_notmuch_database_index_body (notmuch_database_t *notmuch,
+			      unsigned int doc_id,
+			      notmuch_bool_t *indexed)
+{
+    notmuch_private_status_t private_status;
+    notmuch_message_file_t *message_file;
+    notmuch_message_t *message, *document;
+    const char *filename;
+
+    *indexed = FALSE;
+
+    message = _notmuch_message_create (notmuch, notmuch, doc_id,
+				       &private_status);
+    if (message == NULL) {
+	/* Removed since we listed the pending messages. */
+	if (private_status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND)
+	    return NOTMUCH_STATUS_SUCCESS;
+	return COERCE_STATUS (private_status,
+			      "Unexpected status value from _notmuch_message_create");
+    }
+
+    filename = notmuch_message_get_filename (message);
+    if (filename == NULL)
+	goto DONE;
+
+    message_file = _notmuch_message_file_open_ctx (notmuch, message, filename);
+    if (message_file == NULL)
+	goto DONE;
+
+    document = _notmuch_message_create_detached (message, notmuch);
+    if (unlikely (document == NULL)) {
+	notmuch_message_destroy (message);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    if (_notmuch_message_index_body (document, message_file))
+	goto DONE;
+
+    _notmuch_message_resume_termpos (message);
+    _notmuch_message_merge_terms (message, document);
+    _notmuch_message_remove_term (message, "pending", "body");
+    _notmuch_message_sync (message);
+    *indexed = TRUE;
+
+  DONE:
+    notmuch_message_destroy (message);
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_index_pending (notmuch_database_t *notmuch,
+				unsigned int batch_size,
+				unsigned int *count)
+{
+    std::vector<Xapian::docid> doc_ids;
+    Xapian::PostingIterator i, end;
+    notmuch_status_t ret, ret2;
+    notmuch_bool_t in_batch = FALSE;
+    char *term;
+
+    if (count)
+	*count = 0;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    term = talloc_asprintf (notmuch, "%s%s", NOTMUCH_PREFIX_PENDING, "body");
+    if (unlikely (term == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    try {
+	/* Indexing changes the posting list, so list it up front. */
+	find_doc_ids_for_term (notmuch, term, &i, &end);
+	for ( ; i != end; i++)
+	    doc_ids.push_back (*i);
+
+	for (size_t n = 0; n < doc_ids.size (); n++) {
+	    notmuch_bool_t indexed;
+
+	    /* Each batch is written out as a single transaction. */
+	    if (batch_size && n % batch_size == 0 && in_batch) {
+		ret = notmuch_database_end_atomic (notmuch);
+		in_batch = FALSE;
+		if (ret)
+		    goto DONE;
+	    }
+	    if (! in_batch) {
+		ret = notmuch_database_begin_atomic (notmuch);
+		if (ret)
+		    goto DONE;
+		in_batch = TRUE;
+	    }
+
+	    ret = _notmuch_database_index_body (notmuch, doc_ids[n], &indexed);
+	    if (ret)
+		goto DONE;
+
+	    if (indexed && count)
+		(*count)++;
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred indexing message bodies: %s.\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    talloc_free (term);
 
-    const char *date, *header;
-    const char *from, *to, *subject;
-    char *message_id = NULL;
+    if (in_batch) {
+	ret2 = notmuch_database_end_atomic (notmuch);
+	if (ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = ret2;
+    }
 
-    if (message_ret)
-	*message_ret = NULL;
+    return ret;
+}
 
-    ret = _notmuch_database_ensure_writable (notmuch);
-    if (ret)
-	return ret;
+notmuch_status_t
+notmuch_database_get_extraction_pending (notmuch_database_t *notmuch,
+					 notmuch_messages_t **messages)
+{
+    notmuch_message_list_t *list;
+    Xapian::PostingIterator i, end;
+    char *term;
 
-    message_file = _notmuch_message_file_open (notmuch, filename);
-    if (message_file == NULL)
-	return NOTMUCH_STATUS_FILE_ERROR;
+    if (messages == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+    *messages = NULL;
 
-    /* Adding a message may change many documents.  Do this all
-     * atomically. */
-    ret = notmuch_database_begin_atomic (notmuch);
-    if (ret)
-	goto DONE;
+    list = _notmuch_message_list_create (notmuch);
+    if (unlikely (list == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
 
-    /* Parse message up front to get better error status. */
-    ret = _notmuch_message_file_parse (message_file);
-    if (ret)
-	goto DONE;
+    term = talloc_asprintf (list, "%s%s", NOTMUCH_PREFIX_PENDING, "extract");
+    if (unlikely (term == NULL)) {
+	talloc_free (list);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
 
     try {
-	/* Before we do any real work, (especially before doing a
-	 * potential SHA-1 computation on the entire file's contents),
-	 * let's make sure that what we're looking at looks like an
-	 * actual email message.
-	 */
-	from = _notmuch_message_file_get_header (message_file, "from");
-	subject = _notmuch_message_file_get_header (message_file, "subject");
-	to = _notmuch_message_file_get_header (message_file, "to");
-
-	if ((from == NULL || *from == '\0') &&
-	    (subject == NULL || *subject == '\0') &&
-	    (to == NULL || *to == '\0'))
-	{
-	    ret = NOTMUCH_STATUS_FILE_NOT_EMAIL;
-	    goto DONE;
-	}
+	find_doc_ids_for_term (notmuch, term, &i, &end);
+	for ( ; i != end; i++) {
+	    notmuch_private_status_t private_status;
+	    notmuch_message_t *message;
 
-	/* Now that we're sure it's mail, the first order of business
-	 * is to find a message ID (or else create one ourselves). */
+	    message = _notmuch_message_create (list, notmuch, *i,
+					       &private_status);
+	    if (message)
+		_notmuch_message_list_add_message (list, message);
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred listing messages pending extraction: %s.\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (list);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
 
-	header = _notmuch_message_file_get_header (message_file, "message-id");
-	if (header && *header != '\0') {
-	    message_id = _parse_message_id (message_file, header, NULL);
+    *messages = _notmuch_messages_create (list);
+    if (unlikely (*messages == NULL)) {
+	talloc_free (list);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
 
-	    /* So the header value isn't RFC-compliant, but it's
-	     * better than no message-id at all. */
-	    if (message_id == NULL)
-		message_id = talloc_strdup (message_file, header);
-	}
+    return NOTMUCH_STATUS_SUCCESS;
+}
 
-	if (message_id == NULL ) {
-	    /* No message-id at all, let's generate one by taking a
-	     * hash over the file's contents. */
-	    char *sha1 = _notmuch_sha1_of_file (filename);
+notmuch_status_t
+_notmuch_database_defer_ghost (notmuch_database_t *notmuch,
+			       const char *thread_id,
+			       const char *message_id)
+{
+    GPtrArray *message_ids;
+
+    if (notmuch->deferred_ghosts == NULL)
+	notmuch->deferred_ghosts =
+	    g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+				   (GDestroyNotify) g_ptr_array_unref);
+
+    message_ids = (GPtrArray *) g_hash_table_lookup (notmuch->deferred_ghosts,
+						     thread_id);
+    if (message_ids == NULL) {
+	message_ids = g_ptr_array_new_with_free_func (g_free);
+	g_hash_table_insert (notmuch->deferred_ghosts, g_strdup (thread_id),
+			     message_ids);
+    }
+    g_ptr_array_add (message_ids, g_strdup (message_id));
 
-	    /* If that failed too, something is really wrong. Give up. */
-	    if (sha1 == NULL) {
-		ret = NOTMUCH_STATUS_FILE_ERROR;
-		goto DONE;
-	    }
+    return NOTMUCH_STATUS_SUCCESS;
+}
 
-	    message_id = talloc_asprintf (message_file,
-					  "notmuch-sha1-%s", sha1);
-	    free (sha1);
-	}
+/* Bring the ghosts of the threads that lost messages since
+ * notmuch_database_begin_removals up to date, once for each thread. */
+static notmuch_status_t
+_notmuch_database_reconcile_deferred_ghosts (notmuch_database_t *notmuch)
+{
+    GHashTable *deferred = notmuch->deferred_ghosts;
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+    GHashTableIter iter;
+    gpointer thread_id, message_ids;
 
-	/* Now that we have a message ID, we get a message object,
-	 * (which may or may not reference an existing document in the
-	 * database). */
+    if (deferred == NULL)
+	return NOTMUCH_STATUS_SUCCESS;
 
-	message = _notmuch_message_create_for_message_id (notmuch,
-							  message_id,
-							  &private_status);
+    notmuch->deferred_ghosts = NULL;
 
-	talloc_free (message_id);
+    g_hash_table_iter_init (&iter, deferred);
+    while (g_hash_table_iter_next (&iter, &thread_id, &message_ids)) {
+	GPtrArray *ids = (GPtrArray *) message_ids;
 
-	if (message == NULL) {
-	    ret = COERCE_STATUS (private_status,
-				 "Unexpected status value from _notmuch_message_create_for_message_id");
-	    goto DONE;
+	try {
+	    /* The thread may have been merged into another since. */
+	    status = _notmuch_thread_reconcile_ghosts (
+		notmuch,
+		_notmuch_database_resolve_thread_id (notmuch,
+						     (const char *) thread_id),
+		(const char **) ids->pdata, ids->len);
+	} catch (const Xapian::Error &error) {
+	    _notmuch_database_log (notmuch, "A Xapian exception occurred updating ghost messages: %s\n",
+				   error.get_msg().c_str());
+	    notmuch->exception_reported = TRUE;
+	    status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
 	}
+	/* Report the last failure, but keep going. */
+	if (status)
+	    ret = status;
+    }
 
-	_notmuch_message_add_filename (message, filename);
+    g_hash_table_destroy (deferred);
+    return ret;
+}
 
-	/* Is this a newly created message object or a ghost
-	 * message?  We have to be slightly careful: if this is a
-	 * blank message, it's not safe to call
-	 * notmuch_message_get_flag yet. */
-	if (private_status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND ||
-	    (is_ghost = notmuch_message_get_flag (
-		message, NOTMUCH_MESSAGE_FLAG_GHOST))) {
-	    _notmuch_message_add_term (message, "type", "mail");
-	    if (is_ghost)
-		/* Convert ghost message to a regular message */
-		_notmuch_message_remove_term (message, "type", "ghost");
+notmuch_status_t
+notmuch_database_begin_removals (notmuch_database_t *notmuch)
+{
+    notmuch_status_t status;
 
-	    ret = _notmuch_database_link_message (notmuch, message,
-						  message_file, is_ghost);
-	    if (ret)
-		goto DONE;
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
 
-	    date = _notmuch_message_file_get_header (message_file, "date");
-	    _notmuch_message_set_header_values (message, date, from, subject);
+    notmuch->removal_nesting++;
+    return NOTMUCH_STATUS_SUCCESS;
+}
 
-	    ret = _notmuch_message_index_file (message, message_file);
-	    if (ret)
-		goto DONE;
-	} else {
-	    ret = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
-	}
+notmuch_status_t
+notmuch_database_end_removals (notmuch_database_t *notmuch)
+{
+    notmuch_status_t status, ret;
 
-	_notmuch_message_sync (message);
-    } catch (const Xapian::Error &error) {
-	_notmuch_database_log (notmuch, "A Xapian exception occurred adding message: %s.\n",
-		 error.get_msg().c_str());
-	notmuch->exception_reported = TRUE;
-	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
-	goto DONE;
-    }
+    if (notmuch->removal_nesting == 0)
+	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
 
-  DONE:
-    if (message) {
-	if ((ret == NOTMUCH_STATUS_SUCCESS ||
-	     ret == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) && message_ret)
-	    *message_ret = message;
-	else
-	    notmuch_message_destroy (message);
-    }
+    if (--notmuch->removal_nesting)
+	return NOTMUCH_STATUS_SUCCESS;
 
-    if (message_file)
-	_notmuch_message_file_close (message_file);
+    ret = notmuch_database_begin_atomic (notmuch);
+    if (ret)
+	return ret;
 
-    ret2 = notmuch_database_end_atomic (notmuch);
-    if ((ret == NOTMUCH_STATUS_SUCCESS ||
-	 ret == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) &&
-	ret2 != NOTMUCH_STATUS_SUCCESS)
-	ret = ret2;
+    ret = _notmuch_database_reconcile_deferred_ghosts (notmuch);
 
-    return ret;
+    status = notmuch_database_end_atomic (notmuch);
+    return ret ? ret : status;
 }
 
 notmuch_status_t
@@ -2541,6 +5250,8 @@ notmuch_database_remove_message (notmuch_database_t *notmuch,
     notmuch_status_t status;
     notmuch_message_t *message;
 
+    NOTMUCH_TRACE1 (message_remove_start, filename);
+
     status = notmuch_database_find_message_by_filename (notmuch, filename,
 							&message);
 
@@ -2554,6 +5265,8 @@ notmuch_database_remove_message (notmuch_database_t *notmuch,
 	    notmuch_message_destroy (message);
     }
 
+    NOTMUCH_TRACE2 (message_remove_done, filename, status);
+
     return status;
 }
 
@@ -2563,7 +5276,7 @@ notmuch_database_find_message_by_filename (notmuch_database_t *notmuch,
 					   notmuch_message_t **message_ret)
 {
     void *local;
-    const char *prefix = _find_prefix ("file-direntry");
+    const char *prefix = NOTMUCH_PREFIX_FILE_DIRENTRY;
     char *direntry, *term;
     Xapian::PostingIterator i, end;
     notmuch_status_t status;
@@ -2614,6 +5327,174 @@ notmuch_database_find_message_by_filename (notmuch_database_t *notmuch,
     return status;
 }
 
+/* Look in the maildir subdirectory 'directory' for a file that was
+ * known by the unique name 'unique' but is gone, other than
+ * 'basename' itself.  Return the document ID of its message in
+ * *doc_id, or 0. */
+static void
+_find_moved_file (void *ctx, notmuch_database_t *notmuch,
+		  const char *directory, const char *unique,
+		  const char *basename, Xapian::docid *doc_id)
+{
+    const char *prefix = NOTMUCH_PREFIX_FILE_DIRENTRY;
+    unsigned int directory_id;
+    Xapian::TermIterator i, end;
+    notmuch_status_t status;
+    char *term_prefix;
+    size_t prefix_len;
+
+    *doc_id = 0;
+
+    status = _notmuch_database_find_directory_id (notmuch, directory,
+						  NOTMUCH_FIND_LOOKUP,
+						  &directory_id);
+    if (status || directory_id == (unsigned int) -1)
+	return;
+
+    term_prefix = talloc_asprintf (ctx, "%s%u:%s", prefix, directory_id,
+				   unique);
+    prefix_len = strlen (term_prefix);
+
+    end = notmuch->xapian_db->allterms_end (term_prefix);
+    for (i = notmuch->xapian_db->allterms_begin (term_prefix); i != end; i++) {
+	const std::string &term = *i;
+	const char *name, *path;
+
+	/* The unique name must be all of the old name, or be followed
+	 * by the maildir info, or the suffix of a compressed file. */
+	if (term[prefix_len] != '\0' && term[prefix_len] != ':' &&
+	    gz_filename_suffix (term.c_str ()) != term.c_str () + prefix_len)
+	    continue;
+
+	name = term.c_str () + prefix_len - strlen (unique);
+	if (basename && strcmp (name, basename) == 0)
+	    continue;
+
+	if (*directory)
+	    path = talloc_asprintf (ctx, "%s/%s/%s", notmuch->path,
+				    directory, name);
+	else
+	    path = talloc_asprintf (ctx, "%s/%s", notmuch->path, name);
+	if (access (path, F_OK) == 0 || errno != ENOENT)
+	    continue;
+
+	Xapian::PostingIterator doc = notmuch->xapian_db->postlist_begin (term);
+	if (doc != notmuch->xapian_db->postlist_end (term)) {
+	    *doc_id = *doc;
+	    return;
+	}
+    }
+}
+
+notmuch_status_t
+notmuch_database_add_moved_file (notmuch_database_t *notmuch,
+				 const char *filename,
+				 notmuch_message_t **message_ret)
+{
+    static const char *subdirs[] = { "cur", "new" };
+    notmuch_message_t *message = NULL;
+    notmuch_private_status_t private_status;
+    const char *relative, *directory, *basename, *maildir, *subdir;
+    notmuch_status_t ret, ret2;
+    Xapian::docid doc_id = 0;
+    const char *suffix;
+    char *unique;
+    void *local;
+    size_t i, unique_len;
+
+    if (message_ret)
+	*message_ret = NULL;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_FILE_TERMS))
+	return NOTMUCH_STATUS_UPGRADE_REQUIRED;
+
+    local = talloc_new (notmuch);
+
+    relative = _notmuch_database_relative_path (notmuch, filename);
+    _notmuch_database_split_path (local, relative, &directory, &basename);
+    _notmuch_database_split_path (local, directory, &maildir, &subdir);
+    if (basename == NULL || subdir == NULL ||
+	(strcmp (subdir, "cur") != 0 && strcmp (subdir, "new") != 0)) {
+	talloc_free (local);
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    /* Compressing or decompressing a file is a move too. */
+    unique_len = strcspn (basename, ":");
+    suffix = gz_filename_suffix (basename);
+    if (suffix && suffix < basename + unique_len)
+	unique_len = suffix - basename;
+
+    unique = talloc_strndup (local, basename, unique_len);
+    if (*unique == '\0') {
+	talloc_free (local);
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    ret = notmuch_database_begin_atomic (notmuch);
+    if (ret) {
+	talloc_free (local);
+	return ret;
+    }
+
+    try {
+	for (i = 0; i < ARRAY_SIZE (subdirs) && doc_id == 0; i++) {
+	    const char *sibling;
+
+	    if (*maildir)
+		sibling = talloc_asprintf (local, "%s/%s", maildir, subdirs[i]);
+	    else
+		sibling = subdirs[i];
+
+	    _find_moved_file (local, notmuch, sibling, unique,
+			      strcmp (subdirs[i], subdir) == 0 ? basename : NULL,
+			      &doc_id);
+	}
+
+	if (doc_id) {
+	    message = _notmuch_message_create (notmuch, notmuch, doc_id,
+					       &private_status);
+	    if (message == NULL) {
+		ret = COERCE_STATUS (private_status,
+				     "Unexpected status value from _notmuch_message_create");
+		goto DONE;
+	    }
+
+	    ret = _notmuch_message_add_filename (message, filename);
+	    if (ret)
+		goto DONE;
+	    _notmuch_message_sync (message);
+	    ret = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred adding moved file: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    if (message) {
+	if (ret == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID && message_ret)
+	    *message_ret = message;
+	else
+	    notmuch_message_destroy (message);
+    }
+
+    ret2 = notmuch_database_end_atomic (notmuch);
+    if ((ret == NOTMUCH_STATUS_SUCCESS ||
+	 ret == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) &&
+	ret2 != NOTMUCH_STATUS_SUCCESS)
+	ret = ret2;
+
+    talloc_free (local);
+    return ret;
+}
+
 notmuch_string_list_t *
 _notmuch_database_get_terms_with_prefix (void *ctx, Xapian::TermIterator &i,
 					 Xapian::TermIterator &end,
@@ -2640,22 +5521,113 @@ _notmuch_database_get_terms_with_prefix (void *ctx, Xapian::TermIterator &i,
 notmuch_tags_t *
 notmuch_database_get_all_tags (notmuch_database_t *db)
 {
+    return notmuch_database_get_tag_catalogue (db);
+}
+
+/* Read the tag catalogue again unless the cached one is current.
+ * Without modification tracking, changes cannot be detected, so the
+ * catalogue is read every time. */
+static notmuch_status_t
+_notmuch_database_update_tag_catalogue (notmuch_database_t *notmuch)
+{
+    const char *prefix = NOTMUCH_PREFIX_TAG;
+    size_t prefix_len = strlen (prefix);
     Xapian::TermIterator i, end;
+    std::vector<unsigned int> counts;
+    notmuch_string_list_t *tags;
+    unsigned int doccount;
+
+    doccount = notmuch->xapian_db->get_doccount ();
+    if (notmuch->tag_catalogue &&
+	(notmuch->features & NOTMUCH_FEATURE_LAST_MOD) &&
+	notmuch->tag_catalogue_revision == notmuch->revision &&
+	notmuch->tag_catalogue_doccount == doccount)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    tags = _notmuch_string_list_create (notmuch);
+    if (unlikely (tags == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    /* The term list is sorted, and so is the catalogue. */
+    end = notmuch->xapian_db->allterms_end (prefix);
+    for (i = notmuch->xapian_db->allterms_begin (prefix); i != end; i++) {
+	_notmuch_string_list_append (tags, (*i).c_str () + prefix_len);
+	counts.push_back (i.get_termfreq ());
+    }
+
+    talloc_free (notmuch->tag_catalogue);
+    talloc_free (notmuch->tag_catalogue_counts);
+    notmuch->tag_catalogue = tags;
+    notmuch->tag_catalogue_counts = talloc_array (notmuch, unsigned int,
+						  counts.size () + 1);
+    if (unlikely (notmuch->tag_catalogue_counts == NULL)) {
+	talloc_free (notmuch->tag_catalogue);
+	notmuch->tag_catalogue = NULL;
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+    for (size_t n = 0; n < counts.size (); n++)
+	notmuch->tag_catalogue_counts[n] = counts[n];
+    notmuch->tag_catalogue_revision = notmuch->revision;
+    notmuch->tag_catalogue_doccount = doccount;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_tags_t *
+notmuch_database_get_tag_catalogue (notmuch_database_t *notmuch)
+{
     notmuch_string_list_t *tags;
+    notmuch_string_node_t *node;
+    unsigned int *counts;
+    size_t n = 0;
 
     try {
-	i = db->xapian_db->allterms_begin();
-	end = db->xapian_db->allterms_end();
-	tags = _notmuch_database_get_terms_with_prefix (db, i, end,
-							_find_prefix ("tag"));
-	_notmuch_string_list_sort (tags);
-	return _notmuch_tags_create (db, tags);
+	if (_notmuch_database_update_tag_catalogue (notmuch))
+	    return NULL;
     } catch (const Xapian::Error &error) {
-	_notmuch_database_log (db, "A Xapian exception occurred getting tags: %s.\n",
-		 error.get_msg().c_str());
-	db->exception_reported = TRUE;
+	_notmuch_database_log (notmuch, "A Xapian exception occurred getting tags: %s.\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NULL;
+    }
+
+    /* The iterator takes its list, so hand out a copy. */
+    tags = _notmuch_string_list_create (notmuch);
+    if (unlikely (tags == NULL))
+	return NULL;
+    counts = talloc_array (tags, unsigned int,
+			   notmuch->tag_catalogue->length + 1);
+    if (unlikely (counts == NULL)) {
+	talloc_free (tags);
 	return NULL;
     }
+
+    for (node = notmuch->tag_catalogue->head; node; node = node->next) {
+	_notmuch_string_list_append (tags, node->string);
+	counts[n] = notmuch->tag_catalogue_counts[n];
+	n++;
+    }
+
+    return _notmuch_tags_create_with_counts (notmuch, tags, counts);
+}
+
+notmuch_status_t
+_notmuch_database_get_tag_catalogue_list (notmuch_database_t *notmuch,
+					  notmuch_string_list_t **tags)
+{
+    notmuch_status_t status;
+
+    try {
+	status = _notmuch_database_update_tag_catalogue (notmuch);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred getting tags: %s.\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    *tags = notmuch->tag_catalogue;
+    return status;
 }
 
 const char *
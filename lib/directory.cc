@@ -21,6 +21,102 @@
 #include "notmuch-private.h"
 #include "database-private.h"
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/* The number of terms read from each database at a time. */
+#define NOTMUCH_CHILD_TERMS_BATCH 256
+
+/* Terms with a common prefix, in order, from xapian_db and (for
+ * writers with archive shards) archive_db, read a batch at a time.
+ * Each batch opens the term lists anew after the last term returned,
+ * so no iterator is held while the caller changes the database, and
+ * memory does not grow with the number of terms. */
+typedef struct _notmuch_child_terms {
+    notmuch_database_t *notmuch;
+    std::string prefix;
+    std::vector<std::string> batch;
+    size_t position;
+    /* The last term returned, with the prefix. */
+    std::string last;
+    notmuch_bool_t exhausted;
+} notmuch_child_terms_t;
+
+static int
+_notmuch_child_terms_destructor (notmuch_child_terms_t *terms)
+{
+    terms->prefix.~basic_string ();
+    terms->batch.~vector ();
+    terms->last.~basic_string ();
+
+    return 0;
+}
+
+/* Append up to NOTMUCH_CHILD_TERMS_BATCH terms of 'db' after
+ * terms->last to 'batch'. */
+static void
+_notmuch_child_terms_read (notmuch_child_terms_t *terms,
+			   Xapian::Database *db,
+			   std::vector<std::string> &batch)
+{
+    Xapian::TermIterator i = db->allterms_begin (terms->prefix);
+    Xapian::TermIterator end = db->allterms_end (terms->prefix);
+    size_t count = 0;
+
+    if (! terms->last.empty ()) {
+	i.skip_to (terms->last);
+	if (i != end && *i == terms->last)
+	    i++;
+    }
+
+    for (; i != end && count < NOTMUCH_CHILD_TERMS_BATCH; i++, count++)
+	batch.push_back (*i);
+}
+
+static const char *
+_notmuch_child_terms_next (void *closure)
+{
+    notmuch_child_terms_t *terms = (notmuch_child_terms_t *) closure;
+    notmuch_database_t *notmuch = terms->notmuch;
+
+    if (terms->position == terms->batch.size () && ! terms->exhausted) {
+	std::vector<std::string> batch;
+
+	try {
+	    _notmuch_child_terms_read (terms, notmuch->xapian_db, batch);
+	    if (notmuch->archive_db) {
+		size_t own = batch.size ();
+
+		/* Only a batch of the merged terms is sure to come
+		 * before any term not read yet. */
+		_notmuch_child_terms_read (terms, notmuch->archive_db, batch);
+		std::inplace_merge (batch.begin (), batch.begin () + own,
+				    batch.end ());
+		if (batch.size () > NOTMUCH_CHILD_TERMS_BATCH)
+		    batch.resize (NOTMUCH_CHILD_TERMS_BATCH);
+	    }
+	} catch (const Xapian::Error &error) {
+	    _notmuch_database_log (notmuch,
+				   "A Xapian exception occurred listing directory entries: %s.\n",
+				   error.get_msg ().c_str ());
+	    notmuch->exception_reported = TRUE;
+	    batch.clear ();
+	}
+
+	if (batch.empty ())
+	    terms->exhausted = TRUE;
+	terms->batch.swap (batch);
+	terms->position = 0;
+    }
+
+    if (terms->position == terms->batch.size ())
+	return NULL;
+
+    terms->last = terms->batch[terms->position++];
+    return terms->last.c_str () + terms->prefix.size ();
+}
+
 /* Create an iterator to iterate over the basenames of files (or
  * directories) that all share a common parent directory.
  */
@@ -29,24 +125,33 @@ _create_filenames_for_terms_with_prefix (void *ctx,
 					 notmuch_database_t *notmuch,
 					 const char *prefix)
 {
-    notmuch_string_list_t *filename_list;
-    Xapian::TermIterator i, end;
-
-    i = notmuch->xapian_db->allterms_begin();
-    end = notmuch->xapian_db->allterms_end();
-    filename_list = _notmuch_database_get_terms_with_prefix (ctx, i, end,
-							     prefix);
-    if (unlikely (filename_list == NULL))
+    notmuch_child_terms_t *terms;
+
+    terms = talloc (ctx, notmuch_child_terms_t);
+    if (unlikely (terms == NULL))
 	return NULL;
 
-    return _notmuch_filenames_create (ctx, filename_list);
+    terms->notmuch = notmuch;
+    new (&terms->prefix) std::string (prefix);
+    new (&terms->batch) std::vector<std::string> ();
+    terms->position = 0;
+    new (&terms->last) std::string ();
+    terms->exhausted = FALSE;
+    talloc_set_destructor (terms, _notmuch_child_terms_destructor);
+
+    return _notmuch_filenames_create_stream (ctx, _notmuch_child_terms_next,
+					     terms);
 }
 
 struct _notmuch_directory {
     notmuch_database_t *notmuch;
     Xapian::docid document_id;
     Xapian::Document doc;
+    /* The generation of the database 'doc' was read from. */
+    unsigned int generation;
     time_t mtime;
+    /* The nanoseconds of mtime, or -1 if only seconds were stored. */
+    long mtime_nsec;
 };
 
 /* We end up having to call the destructor explicitly because we had
@@ -124,6 +229,7 @@ _notmuch_directory_create (notmuch_database_t *notmuch,
     }
 
     directory->notmuch = notmuch;
+    directory->generation = notmuch->generation;
 
     /* "placement new"---not actually allocating memory */
     new (&directory->doc) Xapian::Document;
@@ -137,7 +243,10 @@ _notmuch_directory_create (notmuch_database_t *notmuch,
 
 	private_status = find_directory_document (notmuch, db_path,
 						  &directory->doc);
-	directory->document_id = directory->doc.get_docid ();
+	/* File names refer to the directory by its ID in the database
+	 * itself. */
+	directory->document_id = _notmuch_database_primary_doc_id (
+	    notmuch, directory->doc.get_docid ());
 
 	if (private_status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND) {
 	    if (!create) {
@@ -151,7 +260,7 @@ _notmuch_directory_create (notmuch_database_t *notmuch,
 	    const char *parent, *basename;
 	    Xapian::docid parent_id;
 	    char *term = talloc_asprintf (local, "%s%s",
-					  _find_prefix ("directory"), db_path);
+					  NOTMUCH_PREFIX_DIRECTORY, db_path);
 	    directory->doc.add_term (term, 0);
 
 	    directory->doc.set_data (path);
@@ -168,7 +277,7 @@ _notmuch_directory_create (notmuch_database_t *notmuch,
 
 	    if (basename) {
 		term = talloc_asprintf (local, "%s%u:%s",
-					_find_prefix ("directory-direntry"),
+					NOTMUCH_PREFIX_DIRECTORY_DIRENTRY,
 					parent_id, basename);
 		directory->doc.add_term (term, 0);
 	    }
@@ -185,6 +294,10 @@ _notmuch_directory_create (notmuch_database_t *notmuch,
 
 	directory->mtime = Xapian::sortable_unserialise (
 	    directory->doc.get_value (NOTMUCH_VALUE_TIMESTAMP));
+
+	std::string nsec = directory->doc.get_value (NOTMUCH_VALUE_MTIME_NSEC);
+	directory->mtime_nsec = nsec.empty () ? -1 :
+	    (long) Xapian::sortable_unserialise (nsec);
     } catch (const Xapian::Error &error) {
 	_notmuch_database_log (notmuch,
 		 "A Xapian exception occurred creating a directory: %s.\n",
@@ -208,9 +321,11 @@ _notmuch_directory_get_document_id (notmuch_directory_t *directory)
     return directory->document_id;
 }
 
-notmuch_status_t
-notmuch_directory_set_mtime (notmuch_directory_t *directory,
-			     time_t mtime)
+/* Store the mtime of 'directory', with 'nsec' nanoseconds, or to the
+ * second if 'nsec' is negative. */
+static notmuch_status_t
+_notmuch_directory_set_mtime (notmuch_directory_t *directory,
+			      time_t mtime, long nsec)
 {
     notmuch_database_t *notmuch = directory->notmuch;
     Xapian::WritableDatabase *db;
@@ -223,8 +338,19 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
     db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
 
     try {
+	/* The database was closed and opened again by a yield. */
+	if (directory->generation != notmuch->generation) {
+	    directory->doc = db->get_document (directory->document_id);
+	    directory->generation = notmuch->generation;
+	}
+
 	directory->doc.add_value (NOTMUCH_VALUE_TIMESTAMP,
 				   Xapian::sortable_serialise (mtime));
+	if (nsec < 0)
+	    directory->doc.remove_value (NOTMUCH_VALUE_MTIME_NSEC);
+	else
+	    directory->doc.add_value (NOTMUCH_VALUE_MTIME_NSEC,
+				       Xapian::sortable_serialise (nsec));
 
 	db->replace_document (directory->document_id, directory->doc);
     } catch (const Xapian::Error &error) {
@@ -238,12 +364,90 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+notmuch_status_t
+notmuch_directory_set_mtime (notmuch_directory_t *directory,
+			     time_t mtime)
+{
+    return _notmuch_directory_set_mtime (directory, mtime, -1);
+}
+
+notmuch_status_t
+notmuch_directory_set_mtime_ns (notmuch_directory_t *directory,
+				time_t mtime, long nsec)
+{
+    return _notmuch_directory_set_mtime (directory, mtime, nsec);
+}
+
 time_t
 notmuch_directory_get_mtime (notmuch_directory_t *directory)
 {
     return directory->mtime;
 }
 
+long
+notmuch_directory_get_mtime_nsec (notmuch_directory_t *directory)
+{
+    return directory->mtime_nsec;
+}
+
+notmuch_status_t
+notmuch_directory_set_manifest (notmuch_directory_t *directory,
+				const char *manifest)
+{
+    notmuch_database_t *notmuch = directory->notmuch;
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    try {
+	if (directory->generation != notmuch->generation) {
+	    directory->doc = db->get_document (directory->document_id);
+	    directory->generation = notmuch->generation;
+	}
+
+	if (manifest && *manifest)
+	    directory->doc.add_value (NOTMUCH_VALUE_MANIFEST, manifest);
+	else
+	    directory->doc.remove_value (NOTMUCH_VALUE_MANIFEST);
+
+	db->replace_document (directory->document_id, directory->doc);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+		 "A Xapian exception occurred setting directory manifest: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+const char *
+notmuch_directory_get_manifest (notmuch_directory_t *directory)
+{
+    std::string manifest;
+
+    try {
+	manifest = directory->doc.get_value (NOTMUCH_VALUE_MANIFEST);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (directory->notmuch,
+		 "A Xapian exception occurred reading directory manifest: %s.\n",
+		 error.get_msg().c_str());
+	directory->notmuch->exception_reported = TRUE;
+	return NULL;
+    }
+
+    if (manifest.empty ())
+	return NULL;
+
+    return talloc_strdup (directory, manifest.c_str ());
+}
+
 notmuch_filenames_t *
 notmuch_directory_get_child_files (notmuch_directory_t *directory)
 {
@@ -251,7 +455,7 @@ notmuch_directory_get_child_files (notmuch_directory_t *directory)
     notmuch_filenames_t *child_files;
 
     term = talloc_asprintf (directory, "%s%u:",
-			    _find_prefix ("file-direntry"),
+			    NOTMUCH_PREFIX_FILE_DIRENTRY,
 			    directory->document_id);
 
     child_files = _create_filenames_for_terms_with_prefix (directory,
@@ -270,7 +474,7 @@ notmuch_directory_get_child_directories (notmuch_directory_t *directory)
     notmuch_filenames_t *child_directories;
 
     term = talloc_asprintf (directory, "%s%u:",
-			    _find_prefix ("directory-direntry"),
+			    NOTMUCH_PREFIX_DIRECTORY_DIRENTRY,
 			    directory->document_id);
 
     child_directories = _create_filenames_for_terms_with_prefix (directory,
@@ -294,6 +498,8 @@ notmuch_directory_delete (notmuch_directory_t *directory)
     try {
 	db = static_cast <Xapian::WritableDatabase *> (directory->notmuch->xapian_db);
 	db->delete_document (directory->document_id);
+	_notmuch_database_forget_directory_path (directory->notmuch,
+						 directory->document_id);
     } catch (const Xapian::Error &error) {
 	_notmuch_database_log (directory->notmuch,
 			       "A Xapian exception occurred deleting directory entry: %s.\n",
@@ -311,3 +517,155 @@ notmuch_directory_destroy (notmuch_directory_t *directory)
 {
     talloc_free (directory);
 }
+
+/* Append to 'paths' the path of the directory with document ID
+ * 'directory_id' and path 'path', and those of all the directories
+ * below it, found through the directory entries of the directory
+ * documents: reading the entries of each directory costs one term
+ * list, whatever the number of messages. */
+static void
+_notmuch_directory_subtree_paths (notmuch_database_t *notmuch,
+				  unsigned int directory_id,
+				  const std::string &path,
+				  std::vector<std::string> &paths)
+{
+    Xapian::Database &db = *notmuch->xapian_db;
+    std::vector<std::pair<unsigned int, std::string> > pending;
+
+    pending.push_back (std::make_pair (directory_id, path));
+    while (! pending.empty ()) {
+	unsigned int id = pending.back ().first;
+	std::string parent = pending.back ().second;
+	Xapian::TermIterator i, end;
+	char *prefix;
+
+	pending.pop_back ();
+	paths.push_back (parent);
+
+	prefix = talloc_asprintf (notmuch, "%s%u:",
+				  NOTMUCH_PREFIX_DIRECTORY_DIRENTRY, id);
+	end = db.allterms_end (prefix);
+	for (i = db.allterms_begin (prefix); i != end; i++) {
+	    Xapian::PostingIterator child = db.postlist_begin (*i);
+	    std::string basename = (*i).substr (strlen (prefix));
+
+	    if (child == db.postlist_end (*i))
+		continue;
+	    pending.push_back (std::make_pair (
+		_notmuch_database_primary_doc_id (notmuch, *child),
+		parent.empty () ? basename : parent + "/" + basename));
+	}
+	talloc_free (prefix);
+    }
+}
+
+static notmuch_bool_t
+_is_term_boundary (char c)
+{
+    return c == '\0' || c == ' ' || c == '\t' || c == '\n' ||
+	c == '(' || c == ')' || c == '+' || c == '-';
+}
+
+/* Append 'path' to 'expanded' as a path: term, quoted for the query
+ * parser. */
+static char *
+_append_path_term (char *expanded, const std::string &path)
+{
+    expanded = talloc_strdup_append_buffer (expanded, "path:\"");
+    for (size_t i = 0; expanded && i < path.size (); i++)
+	expanded = talloc_strndup_append_buffer (
+	    expanded, path[i] == '"' ? "\"\"" : &path[i],
+	    path[i] == '"' ? 2 : 1);
+    if (expanded)
+	expanded = talloc_strdup_append_buffer (expanded, "\"");
+
+    return expanded;
+}
+
+const char *
+_notmuch_database_expand_path_subtrees (notmuch_database_t *notmuch,
+					void *ctx,
+					const char *query_string)
+{
+    const char *prefix = "path:", *recursive = "/**";
+    size_t recursive_len = strlen (recursive);
+    const char *s = query_string, *p;
+    char *expanded;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_SUBTREE_PATHS) ||
+	strstr (query_string, recursive) == NULL)
+	return query_string;
+
+    expanded = talloc_strdup (ctx, "");
+
+    while (expanded && (p = strstr (s, prefix))) {
+	const char *value = p + strlen (prefix), *end;
+	std::vector<std::string> paths;
+	std::string path;
+	unsigned int directory_id;
+	notmuch_status_t status;
+
+	if (p > query_string && ! _is_term_boundary (p[-1])) {
+	    expanded = talloc_strndup_append_buffer (expanded, s, value - s);
+	    s = value;
+	    continue;
+	}
+
+	/* A quoted value ends at a lone quote, and doubled quotes
+	 * stand for one. */
+	if (*value == '"') {
+	    for (end = value + 1; *end; end++) {
+		if (*end == '"' && end[1] != '"')
+		    break;
+		if (*end == '"')
+		    end++;
+		path += *end;
+	    }
+	    if (*end == '"')
+		end++;
+	} else {
+	    end = value + strcspn (value, " \t\n()");
+	    path.assign (value, end - value);
+	}
+
+	if (path.size () <= recursive_len ||
+	    path.compare (path.size () - recursive_len, recursive_len,
+			  recursive) != 0) {
+	    expanded = talloc_strndup_append_buffer (expanded, s, end - s);
+	    s = end;
+	    continue;
+	}
+	path.resize (path.size () - recursive_len);
+
+	status = _notmuch_database_find_directory_id (notmuch, path.c_str (),
+						      NOTMUCH_FIND_LOOKUP,
+						      &directory_id);
+	if (status == NOTMUCH_STATUS_SUCCESS &&
+	    directory_id != (unsigned int) -1)
+	    _notmuch_directory_subtree_paths (notmuch, directory_id, path,
+					      paths);
+	else
+	    /* No messages below a directory the database never saw. */
+	    paths.push_back (path);
+
+	expanded = talloc_strndup_append_buffer (expanded, s, p - s);
+	expanded = talloc_strdup_append_buffer (expanded, "(");
+	for (size_t i = 0; i < paths.size () && expanded; i++) {
+	    if (i)
+		expanded = talloc_strdup_append_buffer (expanded, " OR ");
+	    if (expanded)
+		expanded = _append_path_term (expanded, paths[i]);
+	}
+	if (expanded)
+	    expanded = talloc_strdup_append_buffer (expanded, ")");
+
+	s = end;
+    }
+
+    if (expanded)
+	expanded = talloc_strdup_append_buffer (expanded, s);
+    if (unlikely (expanded == NULL))
+	return query_string;
+
+    return expanded;
+}
@@ -0,0 +1,568 @@
+/* exclude-cache.cc - Cached sets of excluded messages
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <algorithm>
+#include <iterator>
+
+/* The messages carrying the exclude tags (such as deleted and spam)
+ * tend to be a large part of the database, and to change little from
+ * one revision to the next.  Rather than have every query evaluate
+ * the exclude tag terms again, readers keep the set of doc ids
+ * carrying them, and bring it up to date from the messages changed
+ * since the revision it was computed at.
+ *
+ * The sets live in a single file, .notmuch/exclude-cache.  The first
+ * line identifies the database:
+ *
+ *	notmuch-exclude-cache 1 <uuid>
+ *
+ * and each set is a line
+ *
+ *	<revision> <length> <hex-encoded terms>
+ *
+ * followed by <length> bytes holding its doc ids in increasing
+ * order, each as its difference from the one before, in base-128
+ * digits, least significant first and with the high bit set on all
+ * but the last.
+ *
+ * Doc ids are never reused, so the ids of removed messages left in a
+ * set match nothing.  Sets for a database with archive shards would
+ * have to be split by shard, and remote backends cannot run posting
+ * sources of our own, so neither caches its sets.
+ */
+
+#define NOTMUCH_EXCLUDE_CACHE_FILE "exclude-cache"
+#define NOTMUCH_EXCLUDE_CACHE_MAGIC "notmuch-exclude-cache 1"
+
+/* The number of sets kept, each for a different set of terms; the
+ * one used least recently is dropped first. */
+#define NOTMUCH_EXCLUDE_CACHE_MAX_SETS 4
+
+/* A set stays alive while the cache or any posting source uses it. */
+typedef struct _notmuch_exclude_set {
+    std::string key;
+    std::vector<std::string> terms;
+    unsigned long revision;
+    std::vector<Xapian::docid> doc_ids;
+    unsigned int refs;
+    /* When the set was last used, in uses of the cache. */
+    unsigned long used;
+} notmuch_exclude_set_t;
+
+struct _notmuch_exclude_cache {
+    const char *uuid;
+    notmuch_exclude_set_t *sets[NOTMUCH_EXCLUDE_CACHE_MAX_SETS];
+    unsigned int num_sets;
+    unsigned long uses;
+    notmuch_bool_t dirty;
+};
+
+static void
+_notmuch_exclude_set_release (notmuch_exclude_set_t *set)
+{
+    if (--set->refs == 0)
+	delete set;
+}
+
+/* A posting source matching the doc ids of an exclude set, with a
+ * weight of 1, like ExcludedTermsPostingSource in query.cc. */
+class ExcludedDocIdsPostingSource : public Xapian::PostingSource {
+    notmuch_exclude_set_t *set;
+    std::vector<Xapian::docid>::const_iterator it;
+    bool started;
+
+  public:
+    ExcludedDocIdsPostingSource (notmuch_exclude_set_t *set_)
+	: set (set_), started (false) {
+	set->refs++;
+    }
+
+    ~ExcludedDocIdsPostingSource () {
+	_notmuch_exclude_set_release (set);
+    }
+
+    void init (const Xapian::Database &) {
+	started = false;
+	set_maxweight (1.0);
+    }
+
+    Xapian::doccount get_termfreq_min () const {
+	return set->doc_ids.size ();
+    }
+
+    Xapian::doccount get_termfreq_max () const {
+	return set->doc_ids.size ();
+    }
+
+    Xapian::doccount get_termfreq_est () const {
+	return set->doc_ids.size ();
+    }
+
+    Xapian::weight get_weight () const {
+	return 1.0;
+    }
+
+    void next (Xapian::weight) {
+	if (! started) {
+	    it = set->doc_ids.begin ();
+	    started = true;
+	} else {
+	    ++it;
+	}
+    }
+
+    void skip_to (Xapian::docid did, Xapian::weight) {
+	if (! started) {
+	    it = set->doc_ids.begin ();
+	    started = true;
+	}
+	it = std::lower_bound (it, set->doc_ids.end (), did);
+    }
+
+    bool at_end () const {
+	return started && it == set->doc_ids.end ();
+    }
+
+    Xapian::docid get_docid () const {
+	return *it;
+    }
+
+    std::string get_description () const {
+	return "ExcludedDocIdsPostingSource";
+    }
+};
+
+static int
+_notmuch_exclude_cache_destructor (notmuch_exclude_cache_t *cache)
+{
+    for (unsigned int i = 0; i < cache->num_sets; i++)
+	_notmuch_exclude_set_release (cache->sets[i]);
+
+    return 0;
+}
+
+static char *
+_notmuch_exclude_cache_path (void *ctx, notmuch_database_t *notmuch)
+{
+    return talloc_asprintf (ctx, "%s/.notmuch/%s", notmuch->path,
+			    NOTMUCH_EXCLUDE_CACHE_FILE);
+}
+
+/* Return the key of 'terms', which must be sorted, or an empty string
+ * if out of memory. */
+static std::string
+_notmuch_exclude_cache_key (const std::vector<std::string> &terms)
+{
+    std::string key;
+    char *encoded = NULL;
+    size_t encoded_size = 0;
+
+    for (size_t i = 0; i < terms.size (); i++) {
+	if (hex_encode (NULL, terms[i].c_str (), &encoded, &encoded_size) !=
+	    HEX_SUCCESS) {
+	    key.clear ();
+	    break;
+	}
+	if (i)
+	    key += ' ';
+	key += encoded;
+    }
+
+    talloc_free (encoded);
+    return key;
+}
+
+/* Recompute the doc ids of 'set' from the posting lists of its
+ * terms.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static void
+_notmuch_exclude_set_compute (notmuch_database_t *notmuch,
+			      notmuch_exclude_set_t *set)
+{
+    Xapian::Database *db = notmuch->xapian_db;
+
+    set->doc_ids.clear ();
+    for (size_t i = 0; i < set->terms.size (); i++) {
+	for (Xapian::PostingIterator p = db->postlist_begin (set->terms[i]);
+	     p != db->postlist_end (set->terms[i]); p++)
+	    set->doc_ids.push_back (*p);
+    }
+
+    if (set->terms.size () > 1) {
+	std::sort (set->doc_ids.begin (), set->doc_ids.end ());
+	set->doc_ids.erase (std::unique (set->doc_ids.begin (),
+					 set->doc_ids.end ()),
+			    set->doc_ids.end ());
+    }
+}
+
+/* Return the doc ids matching 'query', in increasing order.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static std::vector<Xapian::docid>
+_notmuch_exclude_set_match (notmuch_database_t *notmuch,
+			    const Xapian::Query &query)
+{
+    Xapian::Enquire enquire (*notmuch->xapian_db);
+    std::vector<Xapian::docid> doc_ids;
+    Xapian::MSet mset;
+
+    enquire.set_weighting_scheme (Xapian::BoolWeight ());
+    enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+    enquire.set_query (query);
+    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+    for (Xapian::MSetIterator i = mset.begin (); i != mset.end (); i++)
+	doc_ids.push_back (*i);
+
+    return doc_ids;
+}
+
+/* Bring 'set' up to date with the messages changed since its
+ * revision: drop those changed from the set, and add back those of
+ * them that carry any of its terms.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static void
+_notmuch_exclude_set_update (notmuch_database_t *notmuch,
+			     notmuch_exclude_set_t *set)
+{
+    Xapian::Query changed (Xapian::Query::OP_VALUE_GE, NOTMUCH_VALUE_LAST_MOD,
+			   Xapian::sortable_serialise (set->revision + 1));
+    Xapian::Query terms (Xapian::Query::OP_OR, set->terms.begin (),
+			 set->terms.end ());
+    std::vector<Xapian::docid> changed_ids, excluded_ids, kept, doc_ids;
+
+    changed_ids = _notmuch_exclude_set_match (notmuch, changed);
+    if (changed_ids.empty ())
+	return;
+
+    excluded_ids = _notmuch_exclude_set_match (
+	notmuch, Xapian::Query (Xapian::Query::OP_FILTER, terms, changed));
+
+    std::set_difference (set->doc_ids.begin (), set->doc_ids.end (),
+			 changed_ids.begin (), changed_ids.end (),
+			 std::back_inserter (kept));
+    std::merge (kept.begin (), kept.end (),
+		excluded_ids.begin (), excluded_ids.end (),
+		std::back_inserter (doc_ids));
+    set->doc_ids.swap (doc_ids);
+}
+
+static notmuch_bool_t
+_notmuch_exclude_set_decode (notmuch_exclude_set_t *set,
+			     const unsigned char *bytes, size_t length)
+{
+    Xapian::docid doc_id = 0, delta = 0;
+    unsigned int shift = 0;
+
+    for (size_t i = 0; i < length; i++) {
+	if (shift >= 32)
+	    return FALSE;
+	delta |= (Xapian::docid) (bytes[i] & 0x7f) << shift;
+	if (bytes[i] & 0x80) {
+	    shift += 7;
+	    continue;
+	}
+	if (delta == 0)
+	    return FALSE;
+	doc_id += delta;
+	set->doc_ids.push_back (doc_id);
+	delta = 0;
+	shift = 0;
+    }
+
+    return shift == 0;
+}
+
+static void
+_notmuch_exclude_set_encode (const notmuch_exclude_set_t *set,
+			     std::string &bytes)
+{
+    Xapian::docid last = 0;
+
+    for (size_t i = 0; i < set->doc_ids.size (); i++) {
+	Xapian::docid delta = set->doc_ids[i] - last;
+
+	while (delta >= 0x80) {
+	    bytes += (char) ((delta & 0x7f) | 0x80);
+	    delta >>= 7;
+	}
+	bytes += (char) delta;
+	last = set->doc_ids[i];
+    }
+}
+
+/* Split the (hex-encoded) terms of 'key' into set->terms. */
+static notmuch_bool_t
+_notmuch_exclude_set_parse_key (notmuch_exclude_set_t *set, const char *key)
+{
+    char *copy = talloc_strdup (NULL, key), *saveptr = NULL, *term;
+    notmuch_bool_t ret = TRUE;
+
+    for (term = strtok_r (copy, " ", &saveptr); term;
+	 term = strtok_r (NULL, " ", &saveptr)) {
+	if (hex_decode_inplace (term) != HEX_SUCCESS) {
+	    ret = FALSE;
+	    break;
+	}
+	set->terms.push_back (term);
+    }
+
+    talloc_free (copy);
+    return ret && ! set->terms.empty ();
+}
+
+static void
+_notmuch_exclude_cache_load (notmuch_exclude_cache_t *cache,
+			     notmuch_database_t *notmuch)
+{
+    char *path = _notmuch_exclude_cache_path (cache, notmuch);
+    char *line = NULL, *magic;
+    size_t line_size = 0;
+    std::vector<unsigned char> bytes;
+    FILE *file;
+
+    file = fopen (path, "r");
+    talloc_free (path);
+    if (file == NULL)
+	return;
+
+    magic = talloc_asprintf (cache, "%s %s\n", NOTMUCH_EXCLUDE_CACHE_MAGIC,
+			     cache->uuid);
+    if (getline (&line, &line_size, file) <= 0 ||
+	magic == NULL || strcmp (line, magic) != 0)
+	goto DONE;
+
+    while (cache->num_sets < NOTMUCH_EXCLUDE_CACHE_MAX_SETS &&
+	   getline (&line, &line_size, file) > 0) {
+	notmuch_exclude_set_t *set;
+	unsigned long revision, length;
+	char *key;
+	int consumed = 0;
+
+	if (sscanf (line, "%lu %lu %n", &revision, &length, &consumed) < 2 ||
+	    consumed == 0)
+	    break;
+	key = line + consumed;
+	key[strcspn (key, "\n")] = '\0';
+
+	bytes.resize (length);
+	if (length && fread (&bytes[0], 1, length, file) != length)
+	    break;
+
+	set = new notmuch_exclude_set_t;
+	set->refs = 1;
+	set->revision = revision;
+	set->used = 0;
+	set->key = key;
+	if (! _notmuch_exclude_set_parse_key (set, key) ||
+	    ! _notmuch_exclude_set_decode (set, length ? &bytes[0] : NULL,
+					   length)) {
+	    _notmuch_exclude_set_release (set);
+	    break;
+	}
+	cache->sets[cache->num_sets++] = set;
+    }
+
+  DONE:
+    talloc_free (magic);
+    free (line);
+    fclose (file);
+}
+
+/* Return the cache for 'notmuch', loading it on first use, or NULL if
+ * the cache is disabled or unusable for this database. */
+static notmuch_exclude_cache_t *
+_notmuch_exclude_cache_get (notmuch_database_t *notmuch)
+{
+    notmuch_exclude_cache_t *cache;
+
+    /* Writers keep changes that may yet be thrown away, and readers
+     * of journaled tag changes see tags that no term carries.  The
+     * posting source of the cache can be neither cloned for archive
+     * shards nor sent to a remote database. */
+    if (! notmuch->exclude_cache_enabled ||
+	! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD) ||
+	notmuch->mode != NOTMUCH_DATABASE_MODE_READ_ONLY ||
+	notmuch->num_archive_shards ||
+	notmuch->xapian_stub ||
+	_notmuch_database_has_tag_journal (notmuch))
+	return NULL;
+
+    cache = notmuch->exclude_cache;
+    if (cache && strcmp (cache->uuid, notmuch->uuid) == 0)
+	return cache;
+
+    /* The database was replaced, e.g. restored from a backup. */
+    talloc_free (cache);
+    notmuch->exclude_cache = NULL;
+
+    cache = talloc_zero (notmuch, notmuch_exclude_cache_t);
+    if (unlikely (cache == NULL))
+	return NULL;
+
+    cache->uuid = talloc_strdup (cache, notmuch->uuid);
+    if (unlikely (cache->uuid == NULL)) {
+	talloc_free (cache);
+	return NULL;
+    }
+    talloc_set_destructor (cache, _notmuch_exclude_cache_destructor);
+
+    _notmuch_exclude_cache_load (cache, notmuch);
+
+    notmuch->exclude_cache = cache;
+    return cache;
+}
+
+Xapian::PostingSource *
+_notmuch_exclude_cache_source (notmuch_database_t *notmuch,
+			       const std::vector<std::string> &terms)
+{
+    notmuch_exclude_cache_t *cache = _notmuch_exclude_cache_get (notmuch);
+    std::vector<std::string> sorted (terms);
+    notmuch_exclude_set_t *set = NULL;
+    std::string key;
+    unsigned int i;
+
+    if (cache == NULL || terms.empty ())
+	return NULL;
+
+    std::sort (sorted.begin (), sorted.end ());
+    sorted.erase (std::unique (sorted.begin (), sorted.end ()), sorted.end ());
+    key = _notmuch_exclude_cache_key (sorted);
+    if (key.empty ())
+	return NULL;
+
+    for (i = 0; i < cache->num_sets; i++) {
+	if (cache->sets[i]->key == key) {
+	    set = cache->sets[i];
+	    break;
+	}
+    }
+
+    try {
+	if (set && set->revision > notmuch->revision) {
+	    /* Computed against a later revision than the one we see,
+	     * so the changes in between cannot be undone. */
+	    _notmuch_exclude_set_compute (notmuch, set);
+	    set->revision = notmuch->revision;
+	    cache->dirty = TRUE;
+	} else if (set && set->revision < notmuch->revision) {
+	    _notmuch_exclude_set_update (notmuch, set);
+	    set->revision = notmuch->revision;
+	    cache->dirty = TRUE;
+	}
+
+	if (set == NULL) {
+	    set = new notmuch_exclude_set_t;
+	    set->refs = 1;
+	    set->key = key;
+	    set->terms = sorted;
+	    set->revision = notmuch->revision;
+	    try {
+		_notmuch_exclude_set_compute (notmuch, set);
+	    } catch (const Xapian::Error &error) {
+		_notmuch_exclude_set_release (set);
+		throw;
+	    }
+
+	    if (cache->num_sets == NOTMUCH_EXCLUDE_CACHE_MAX_SETS) {
+		unsigned int oldest = 0;
+
+		for (i = 1; i < cache->num_sets; i++) {
+		    if (cache->sets[i]->used < cache->sets[oldest]->used)
+			oldest = i;
+		}
+		_notmuch_exclude_set_release (cache->sets[oldest]);
+		cache->sets[oldest] = cache->sets[--cache->num_sets];
+	    }
+	    cache->sets[cache->num_sets++] = set;
+	    cache->dirty = TRUE;
+	}
+    } catch (const Xapian::Error &error) {
+	/* The caller evaluates the terms instead, and will report
+	 * the error if it persists. */
+	return NULL;
+    }
+
+    set->used = ++cache->uses;
+    return new ExcludedDocIdsPostingSource (set);
+}
+
+/* Write out the cache if any set changed.  Failing to write the cache
+ * is not an error; the sets will simply be computed again next
+ * time. */
+void
+_notmuch_exclude_cache_flush (notmuch_database_t *notmuch)
+{
+    notmuch_exclude_cache_t *cache = notmuch->exclude_cache;
+    void *local;
+    char *path, *tmp_path;
+    notmuch_bool_t failed;
+    FILE *file;
+
+    if (cache == NULL || ! cache->dirty)
+	return;
+
+    local = talloc_new (NULL);
+    path = _notmuch_exclude_cache_path (local, notmuch);
+    tmp_path = talloc_asprintf (local, "%s.%d", path, (int) getpid ());
+
+    file = fopen (tmp_path, "w");
+    if (file == NULL)
+	goto DONE;
+
+    fprintf (file, "%s %s\n", NOTMUCH_EXCLUDE_CACHE_MAGIC, cache->uuid);
+
+    for (unsigned int i = 0; i < cache->num_sets; i++) {
+	notmuch_exclude_set_t *set = cache->sets[i];
+	std::string bytes;
+
+	_notmuch_exclude_set_encode (set, bytes);
+	fprintf (file, "%lu %lu %s\n", set->revision,
+		 (unsigned long) bytes.size (), set->key.c_str ());
+	fwrite (bytes.data (), 1, bytes.size (), file);
+    }
+
+    failed = ferror (file);
+    if (fclose (file) != 0)
+	failed = TRUE;
+
+    if (failed || rename (tmp_path, path) != 0)
+	unlink (tmp_path);
+    else
+	cache->dirty = FALSE;
+
+  DONE:
+    talloc_free (local);
+}
+
+notmuch_status_t
+notmuch_database_set_exclude_cache (notmuch_database_t *notmuch,
+				    notmuch_bool_t enable)
+{
+    notmuch->exclude_cache_enabled = enable;
+    return NOTMUCH_STATUS_SUCCESS;
+}
@@ -22,6 +22,11 @@
 
 struct _notmuch_filenames {
     notmuch_string_node_t *iterator;
+    /* For a stream of file names, the function producing them, and
+     * the current one; NULL otherwise. */
+    const char *(*next) (void *closure);
+    void *closure;
+    const char *current;
 };
 
 /* The notmuch_filenames_t iterates over a notmuch_string_list_t of
@@ -37,24 +42,55 @@ _notmuch_filenames_create (const void *ctx,
 	return NULL;
 
     filenames->iterator = list->head;
+    filenames->next = NULL;
+    filenames->closure = NULL;
+    filenames->current = NULL;
     (void) talloc_reference (filenames, list);
 
     return filenames;
 }
 
+notmuch_filenames_t *
+_notmuch_filenames_create_stream (const void *ctx,
+				  const char *(*next) (void *closure),
+				  void *closure)
+{
+    notmuch_filenames_t *filenames;
+
+    filenames = talloc (ctx, notmuch_filenames_t);
+    if (unlikely (filenames == NULL))
+	return NULL;
+
+    filenames->iterator = NULL;
+    filenames->next = next;
+    filenames->closure = talloc_steal (filenames, closure);
+    filenames->current = next (closure);
+
+    return filenames;
+}
+
 notmuch_bool_t
 notmuch_filenames_valid (notmuch_filenames_t *filenames)
 {
     if (filenames == NULL)
 	return FALSE;
 
+    if (filenames->next)
+	return (filenames->current != NULL);
+
     return (filenames->iterator != NULL);
 }
 
 const char *
 notmuch_filenames_get (notmuch_filenames_t *filenames)
 {
-    if ((filenames == NULL) || (filenames->iterator == NULL))
+    if (filenames == NULL)
+	return NULL;
+
+    if (filenames->next)
+	return filenames->current;
+
+    if (filenames->iterator == NULL)
 	return NULL;
 
     return filenames->iterator->string;
@@ -63,7 +99,16 @@ notmuch_filenames_get (notmuch_filenames_t *filenames)
 void
 notmuch_filenames_move_to_next (notmuch_filenames_t *filenames)
 {
-    if ((filenames == NULL) || (filenames->iterator == NULL))
+    if (filenames == NULL)
+	return;
+
+    if (filenames->next) {
+	if (filenames->current)
+	    filenames->current = filenames->next (filenames->closure);
+	return;
+    }
+
+    if (filenames->iterator == NULL)
 	return;
 
     filenames->iterator = filenames->iterator->next;
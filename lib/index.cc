@@ -19,6 +19,10 @@
 
 #include "notmuch-private.h"
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include <gmime/gmime.h>
 #include <gmime/gmime-filter.h>
 
@@ -152,6 +156,28 @@ filter_filter (GMimeFilter *gmime_filter, char *inbuf, size_t inlen, size_t pres
     outptr = gmime_filter->outbuf;
 
     while (inptr < inend) {
+	/* Most text has no uuencoded portion at all, so outside of
+	 * one, copy everything up to the next possible "begin" in
+	 * bulk, and the rest of a "begin" line likewise; memchr is
+	 * much faster than stepping through the states.  Within one,
+	 * skip the rest of each "M" line at once. */
+	if (filter->state == 0 || filter->state == 10) {
+	    const char *stop = (const char *) memchr (
+		inptr, filter->state == 0 ? 'b' : '\n', inend - inptr);
+	    size_t run = (stop ? stop : inend) - inptr;
+
+	    memcpy (outptr, inptr, run);
+	    outptr += run;
+	    inptr += run;
+	    if (! stop)
+		break;
+	} else if (filter->state == 12) {
+	    while (inptr < inend && *inptr >= ' ' && *inptr <= '`')
+		inptr++;
+	    if (inptr == inend)
+		break;
+	}
+
 	if (*inptr >= states[filter->state].a &&
 	    *inptr <= states[filter->state].b)
 	{
@@ -198,10 +224,12 @@ filter_reset (GMimeFilter *gmime_filter)
 static GMimeFilter *
 notmuch_filter_discard_uuencode_new (void)
 {
-    static GType type = 0;
+    static gsize type = 0;
     NotmuchFilterDiscardUuencode *filter;
 
-    if (!type) {
+    /* Indexing threads may get here at once: the first registers the
+     * type while the others wait for it. */
+    if (g_once_init_enter (&type)) {
 	static const GTypeInfo info = {
 	    sizeof (NotmuchFilterDiscardUuencodeClass),
 	    NULL, /* base_class_init */
@@ -215,10 +243,10 @@ notmuch_filter_discard_uuencode_new (void)
 	    NULL  /* value_table */
 	};
 
-	type = g_type_register_static (GMIME_TYPE_FILTER, "NotmuchFilterDiscardUuencode", &info, (GTypeFlags) 0);
+	g_once_init_leave (&type, g_type_register_static (GMIME_TYPE_FILTER, "NotmuchFilterDiscardUuencode", &info, (GTypeFlags) 0));
     }
 
-    filter = (NotmuchFilterDiscardUuencode *) g_object_newv (type, 0, NULL);
+    filter = (NotmuchFilterDiscardUuencode *) g_object_newv ((GType) type, 0, NULL);
     filter->state = 0;
 
     return (GMimeFilter *) filter;
@@ -300,17 +328,378 @@ _index_address_list (notmuch_message_t *message,
     }
 }
 
+/* Body text is read and indexed in pieces of at most this size, so
+ * that indexing a large part takes no more memory than a small one. */
+#define NOTMUCH_INDEX_CHUNK_SIZE (64 * 1024)
+
+/* Converting text to UTF-8 makes it at most this many times longer,
+ * and the conversion flushed at the end of a part at most this much
+ * longer still. */
+#define NOTMUCH_INDEX_CHARSET_EXPANSION 4
+#define NOTMUCH_INDEX_CHARSET_SLACK 64
+
+/* How many charset filters each indexing thread keeps. */
+#define NOTMUCH_INDEX_CHARSET_CACHE_SIZE 8
+
+/* When text in a charset needs no conversion to UTF-8. */
+typedef enum {
+    /* Always convert. */
+    NOTMUCH_INDEX_CONVERT_ALWAYS,
+    /* A piece of text that is all ASCII is left as it is. */
+    NOTMUCH_INDEX_CONVERT_UNLESS_ASCII,
+    /* A piece of text that is valid UTF-8 is left as it is. */
+    NOTMUCH_INDEX_CONVERT_UNLESS_UTF8
+} notmuch_index_convert_t;
+
+typedef struct {
+    /* The canonical name of the charset, by malloc. */
+    char *name;
+    /* NULL if GMime cannot convert from the charset. */
+    GMimeFilter *filter;
+    notmuch_index_convert_t convert;
+    /* Whether the filter has been given text since it was reset,
+     * and so may hold part of a multi-byte sequence. */
+    notmuch_bool_t used;
+} notmuch_index_charset_t;
+
+/* The filters an indexing thread reuses from one part to the next,
+ * rather than open a new iconv converter for each part. */
+typedef struct {
+    GMimeFilter *discard_uuencode;
+    notmuch_index_charset_t charsets[NOTMUCH_INDEX_CHARSET_CACHE_SIZE];
+    unsigned int num_charsets;
+    /* The entry to replace next once the cache is full. */
+    unsigned int next_charset;
+} notmuch_index_filters_t;
+
+#if HAVE_PTHREAD
+static void
+_index_filters_destroy (void *closure)
+{
+    notmuch_index_filters_t *filters = (notmuch_index_filters_t *) closure;
+    unsigned int i;
+
+    for (i = 0; i < filters->num_charsets; i++) {
+	free (filters->charsets[i].name);
+	if (filters->charsets[i].filter)
+	    g_object_unref (filters->charsets[i].filter);
+    }
+    if (filters->discard_uuencode)
+	g_object_unref (filters->discard_uuencode);
+    free (filters);
+}
+
+static pthread_key_t index_filters_key;
+static pthread_once_t index_filters_once = PTHREAD_ONCE_INIT;
+
+static void
+_index_filters_make_key (void)
+{
+    pthread_key_create (&index_filters_key, _index_filters_destroy);
+}
+#else
+static notmuch_index_filters_t *index_filters = NULL;
+#endif
+
+/* Return the filters of the calling thread, or NULL if out of
+ * memory. */
+static notmuch_index_filters_t *
+_index_filters_get (void)
+{
+    notmuch_index_filters_t *filters;
+
+#if HAVE_PTHREAD
+    pthread_once (&index_filters_once, _index_filters_make_key);
+    filters = (notmuch_index_filters_t *) pthread_getspecific (index_filters_key);
+#else
+    filters = index_filters;
+#endif
+    if (filters)
+	return filters;
+
+    filters = (notmuch_index_filters_t *) calloc (1, sizeof (*filters));
+    if (unlikely (filters == NULL))
+	return NULL;
+    filters->discard_uuencode = notmuch_filter_discard_uuencode_new ();
+
+#if HAVE_PTHREAD
+    if (pthread_setspecific (index_filters_key, filters)) {
+	_index_filters_destroy (filters);
+	return NULL;
+    }
+#else
+    index_filters = filters;
+#endif
+    return filters;
+}
+
+/* Text in the single-byte charsets common in mail is left alone while
+ * it is ASCII, as the converter would not change it. */
+static notmuch_index_convert_t
+_charset_convert (const char *name)
+{
+    static const char *ascii_prefixes[] = {
+	"iso-8859-", "windows-125", "cp125", "koi8-",
+    };
+    unsigned int i;
+
+    if (strcasecmp (name, "utf-8") == 0 || strcasecmp (name, "utf8") == 0)
+	return NOTMUCH_INDEX_CONVERT_UNLESS_UTF8;
+
+    if (strcasecmp (name, "us-ascii") == 0 || strcasecmp (name, "ascii") == 0)
+	return NOTMUCH_INDEX_CONVERT_UNLESS_ASCII;
+
+    for (i = 0; i < ARRAY_SIZE (ascii_prefixes); i++)
+	if (strncasecmp (name, ascii_prefixes[i],
+			 strlen (ascii_prefixes[i])) == 0)
+	    return NOTMUCH_INDEX_CONVERT_UNLESS_ASCII;
+
+    return NOTMUCH_INDEX_CONVERT_ALWAYS;
+}
+
+/* Return the cached converter from 'charset' to UTF-8, reset for a
+ * new part, or NULL if out of memory. */
+static notmuch_index_charset_t *
+_index_filters_get_charset (notmuch_index_filters_t *filters,
+			    const char *charset)
+{
+    const char *name = g_mime_charset_canon_name (charset);
+    notmuch_index_charset_t *entry;
+    unsigned int i;
+
+    for (i = 0; i < filters->num_charsets; i++) {
+	entry = &filters->charsets[i];
+	if (strcmp (entry->name, name) == 0)
+	    goto FOUND;
+    }
+
+    if (filters->num_charsets < NOTMUCH_INDEX_CHARSET_CACHE_SIZE) {
+	entry = &filters->charsets[filters->num_charsets++];
+    } else {
+	entry = &filters->charsets[filters->next_charset];
+	filters->next_charset = (filters->next_charset + 1) %
+	    NOTMUCH_INDEX_CHARSET_CACHE_SIZE;
+	free (entry->name);
+	if (entry->filter)
+	    g_object_unref (entry->filter);
+    }
+
+    entry->name = strdup (name);
+    if (unlikely (entry->name == NULL)) {
+	/* Leave the cache without the entry. */
+	*entry = filters->charsets[--filters->num_charsets];
+	return NULL;
+    }
+    /* This result can be NULL for things like "unknown-8bit", which
+     * is remembered too. */
+    entry->filter = g_mime_filter_charset_new (charset, "UTF-8");
+    entry->convert = _charset_convert (name);
+    entry->used = FALSE;
+
+  FOUND:
+    if (entry->filter && entry->used) {
+	g_mime_filter_reset (entry->filter);
+	entry->used = FALSE;
+    }
+    return entry;
+}
+
+static notmuch_bool_t
+_is_ascii (const char *text, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+	if (text[i] & 0x80)
+	    return FALSE;
+
+    return TRUE;
+}
+
+/* Return the length of the start of the 'length' bytes of 'text' that
+ * is valid UTF-8, except for an incomplete sequence that may continue
+ * in the text to come at the end; or -1 if there is none. */
+static ssize_t
+_utf8_valid_prefix (const char *text, size_t length)
+{
+    const gchar *end;
+    size_t tail, needed;
+    unsigned char lead;
+
+    if (g_utf8_validate (text, length, &end))
+	return length;
+
+    tail = text + length - end;
+    lead = *end;
+    if (lead >= 0xc2 && lead <= 0xdf)
+	needed = 2;
+    else if (lead >= 0xe0 && lead <= 0xef)
+	needed = 3;
+    else if (lead >= 0xf0 && lead <= 0xf4)
+	needed = 4;
+    else
+	return -1;
+
+    if (tail >= needed)
+	return -1;
+    for (size_t i = 1; i < tail; i++)
+	if ((end[i] & 0xc0) != 0x80)
+	    return -1;
+
+    return end - text;
+}
+
+/* Convert the 'length' bytes read at 'text' to UTF-8 in place, unless
+ * they are already, and return the length of the result.  Set
+ * *pending to the length of an incomplete UTF-8 sequence left
+ * unconverted after it, to be converted with the text to come.  The
+ * buffer must have room for NOTMUCH_INDEX_CHARSET_EXPANSION times
+ * 'length' bytes. */
+static size_t
+_index_convert (notmuch_index_charset_t *charset, char *text, size_t length,
+		size_t *pending)
+{
+    char *out;
+    size_t outlen, outprespace;
+    ssize_t valid;
+
+    *pending = 0;
+
+    switch (charset->convert) {
+    case NOTMUCH_INDEX_CONVERT_UNLESS_ASCII:
+	valid = _is_ascii (text, length) ? (ssize_t) length : -1;
+	break;
+    case NOTMUCH_INDEX_CONVERT_UNLESS_UTF8:
+	valid = _utf8_valid_prefix (text, length);
+	break;
+    default:
+	valid = -1;
+	break;
+    }
+
+    if (valid >= 0) {
+	/* Drop what is left of an incomplete sequence the converter
+	 * was given, as it would. */
+	if (charset->used) {
+	    g_mime_filter_reset (charset->filter);
+	    charset->used = FALSE;
+	}
+	*pending = length - valid;
+	return valid;
+    }
+
+    g_mime_filter_filter (charset->filter, text, length, 0,
+			  &out, &outlen, &outprespace);
+    charset->used = TRUE;
+    memcpy (text, out, outlen);
+    return outlen;
+}
+
+static notmuch_bool_t
+_is_ascii_space (char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+	c == '\f' || c == '\v';
+}
+
+/* Return the length of the longest prefix of 'text' that ends between
+ * two words.  A chunk without any space is split anywhere outside a
+ * UTF-8 sequence instead; no term gets that long anyway. */
+static size_t
+_chunk_boundary (const char *text, size_t length)
+{
+    size_t i;
+
+    for (i = length; i > 0; i--)
+	if (_is_ascii_space (text[i - 1]))
+	    return i;
+
+    for (i = length - 1; i > 0; i--)
+	if ((text[i] & 0xc0) != 0x80)
+	    return i;
+
+    return length;
+}
+
+/* Generate terms for all of the text read from 'stream', converted
+ * to UTF-8 with 'charset' unless NULL, and with 'snippet', take the
+ * body snippet of 'message' from its start. */
+static void
+_index_stream (notmuch_message_t *message, GMimeStream *stream,
+	       notmuch_index_charset_t *charset, notmuch_bool_t snippet)
+{
+    char *buf;
+    /* The text in buf, followed by the 'pending' bytes of an
+     * incomplete UTF-8 sequence yet to be converted. */
+    size_t length = 0, pending = 0;
+    ssize_t nread;
+
+    buf = talloc_array (message, char,
+			NOTMUCH_INDEX_CHUNK_SIZE + NOTMUCH_INDEX_CHARSET_SLACK);
+    if (unlikely (buf == NULL))
+	return;
+
+    for (;;) {
+	size_t room = NOTMUCH_INDEX_CHUNK_SIZE - length - pending;
+	size_t boundary;
+
+	if (charset)
+	    room /= NOTMUCH_INDEX_CHARSET_EXPANSION;
+
+	if (room) {
+	    nread = g_mime_stream_read (stream, buf + length + pending, room);
+	    if (nread <= 0)
+		break;
+
+	    if (charset)
+		length += _index_convert (charset, buf + length,
+					  pending + nread, &pending);
+	    else
+		length += nread;
+	    continue;
+	}
+
+	boundary = _chunk_boundary (buf, length);
+	if (snippet) {
+	    _notmuch_message_set_snippet (message, buf, boundary);
+	    snippet = FALSE;
+	}
+	_notmuch_message_gen_terms_partial (message, buf, boundary, FALSE);
+	memmove (buf, buf + boundary, length + pending - boundary);
+	length -= boundary;
+    }
+
+    /* Flush the converter, with any incomplete sequence at the end. */
+    if (charset && (charset->used || pending)) {
+	char *out;
+	size_t outlen, outprespace;
+
+	g_mime_filter_complete (charset->filter, buf + length, pending, 0,
+				&out, &outlen, &outprespace);
+	charset->used = TRUE;
+	outlen = MIN (outlen,
+		      NOTMUCH_INDEX_CHUNK_SIZE + NOTMUCH_INDEX_CHARSET_SLACK - length);
+	memcpy (buf + length, out, outlen);
+	length += outlen;
+    }
+
+    if (snippet)
+	_notmuch_message_set_snippet (message, buf, length);
+    _notmuch_message_gen_terms_partial (message, buf, length, TRUE);
+
+    talloc_free (buf);
+}
+
 /* Callback to generate terms for each mime part of a message. */
 static void
 _index_mime_part (notmuch_message_t *message,
 		  GMimeObject *part)
 {
     GMimeStream *stream, *filter;
-    GMimeFilter *discard_uuencode_filter;
+    notmuch_index_filters_t *filters;
+    notmuch_index_charset_t *charset_filter = NULL;
     GMimeDataWrapper *wrapper;
-    GByteArray *byte_array;
     GMimeContentDisposition *disposition;
-    char *body;
     const char *charset;
 
     if (! part) {
@@ -385,65 +774,86 @@ _index_mime_part (notmuch_message_t *message,
 	_notmuch_message_add_term (message, "tag", "attachment");
 	_notmuch_message_gen_terms (message, "attachment", filename);
 
+	/* The text of the attachment is added later, if at all, by
+	 * notmuch_message_add_extracted_text. */
+	if (_notmuch_message_database (message)->extract_attachments)
+	    _notmuch_message_add_term (message, "pending", "extract");
+
 	/* XXX: Would be nice to call out to something here to parse
 	 * the attachment into text and then index that. */
 	return;
     }
 
-    byte_array = g_byte_array_new ();
+    wrapper = g_mime_part_get_content_object (GMIME_PART (part));
+    if (! wrapper)
+	return;
+
+    filters = _index_filters_get ();
+    if (unlikely (filters == NULL))
+	return;
 
-    stream = g_mime_stream_mem_new_with_byte_array (byte_array);
-    g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (stream), FALSE);
+    stream = g_mime_data_wrapper_get_stream (wrapper);
+    if (! stream || g_mime_stream_reset (stream) == -1)
+	return;
 
+    /* Rather than writing the decoded part out to memory, as
+     * g_mime_data_wrapper_write_to_stream would, read it through the
+     * same filters in bounded pieces. */
     filter = g_mime_stream_filter_new (stream);
-    discard_uuencode_filter = notmuch_filter_discard_uuencode_new ();
 
+    switch (g_mime_data_wrapper_get_encoding (wrapper)) {
+    case GMIME_CONTENT_ENCODING_BASE64:
+    case GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE:
+    case GMIME_CONTENT_ENCODING_UUENCODE:
+	{
+	    GMimeFilter *decode_filter;
+	    decode_filter = g_mime_filter_basic_new (
+		g_mime_data_wrapper_get_encoding (wrapper), FALSE);
+	    g_mime_stream_filter_add (GMIME_STREAM_FILTER (filter),
+				      decode_filter);
+	    g_object_unref (decode_filter);
+	}
+	break;
+    default:
+	break;
+    }
+
+    g_mime_filter_reset (filters->discard_uuencode);
     g_mime_stream_filter_add (GMIME_STREAM_FILTER (filter),
-			      discard_uuencode_filter);
+			      filters->discard_uuencode);
 
+    /* The text is converted to UTF-8 as it is indexed, by a filter
+     * kept for the charset, and only where it needs converting. */
     charset = g_mime_object_get_content_type_parameter (part, "charset");
     if (charset) {
-	GMimeFilter *charset_filter;
-	charset_filter = g_mime_filter_charset_new (charset, "UTF-8");
-	/* This result can be NULL for things like "unknown-8bit".
-	 * Don't set a NULL filter as that makes GMime print
-	 * annoying assertion-failure messages on stderr. */
-	if (charset_filter) {
-	    g_mime_stream_filter_add (GMIME_STREAM_FILTER (filter),
-				      charset_filter);
-	    g_object_unref (charset_filter);
-	}
+	charset_filter = _index_filters_get_charset (filters, charset);
+	/* Text in a charset GMime cannot convert from is indexed as
+	 * it is. */
+	if (charset_filter && ! charset_filter->filter)
+	    charset_filter = NULL;
     }
 
-    wrapper = g_mime_part_get_content_object (GMIME_PART (part));
-    if (wrapper)
-	g_mime_data_wrapper_write_to_stream (wrapper, filter);
+    /* Parts without a content type are text/plain too. */
+    _index_stream (message, filter, charset_filter,
+		   ! content_type ||
+		   g_mime_content_type_is_type (content_type, "text", "plain"));
 
-    g_object_unref (stream);
     g_object_unref (filter);
-    g_object_unref (discard_uuencode_filter);
-
-    g_byte_array_append (byte_array, (guint8 *) "\0", 1);
-    body = (char *) g_byte_array_free (byte_array, FALSE);
 
-    if (body) {
-	_notmuch_message_gen_terms (message, NULL, body);
-
-	free (body);
-    }
+    g_mime_stream_reset (stream);
 }
 
 notmuch_status_t
-_notmuch_message_index_file (notmuch_message_t *message,
-			     notmuch_message_file_t *message_file)
+_notmuch_message_index_headers (notmuch_message_t *message,
+				notmuch_message_file_t *message_file)
 {
     GMimeMessage *mime_message;
     InternetAddressList *addresses;
     const char *from, *subject;
     notmuch_status_t status;
 
-    status = _notmuch_message_file_get_mime_message (message_file,
-						     &mime_message);
+    status = _notmuch_message_file_get_header_message (message_file,
+						       &mime_message);
     if (status)
 	return status;
 
@@ -464,7 +874,35 @@ _notmuch_message_index_file (notmuch_message_t *message,
     subject = g_mime_message_get_subject (mime_message);
     _notmuch_message_gen_terms (message, "subject", subject);
 
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+_notmuch_message_index_body (notmuch_message_t *message,
+			     notmuch_message_file_t *message_file)
+{
+    GMimeMessage *mime_message;
+    notmuch_status_t status;
+
+    status = _notmuch_message_file_get_mime_message (message_file,
+						     &mime_message);
+    if (status)
+	return status;
+
     _index_mime_part (message, g_mime_message_get_mime_part (mime_message));
 
     return NOTMUCH_STATUS_SUCCESS;
 }
+
+notmuch_status_t
+_notmuch_message_index_file (notmuch_message_t *message,
+			     notmuch_message_file_t *message_file)
+{
+    notmuch_status_t status;
+
+    status = _notmuch_message_index_headers (message, message_file);
+    if (status)
+	return status;
+
+    return _notmuch_message_index_body (message, message_file);
+}
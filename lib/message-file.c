@@ -21,11 +21,17 @@
 #include <stdarg.h>
 
 #include "notmuch-private.h"
+#include "gmime-extra.h"
+#include "mbox-util.h"
 
 #include <gmime/gmime.h>
 
 #include <glib.h> /* GHashTable */
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 struct _notmuch_message_file {
     /* File object */
     FILE *file;
@@ -35,13 +41,96 @@ struct _notmuch_message_file {
     GHashTable *headers;
 
     GMimeMessage *message;
+    /* TRUE if 'message' was parsed from the header block alone (see
+     * _notmuch_message_file_parse_headers). */
+    notmuch_bool_t headers_only;
 };
 
+/* The objects parsing a message needs, which each thread parsing
+ * messages reuses from one message to the next rather than allocate
+ * new ones: the parser, re-initialized for each stream and left on an
+ * empty one in between so as not to hold on to the last file, the
+ * header cache of a closed message file, emptied, for the next one to
+ * open, and the line buffer for finding the end of the headers. */
+typedef struct {
+    GMimeParser *parser;
+    GMimeStream *empty;
+    GHashTable *headers;
+    char *line;
+    size_t line_size;
+} notmuch_parse_pool_t;
+
+#if HAVE_PTHREAD
+static void
+_parse_pool_destroy (void *closure)
+{
+    notmuch_parse_pool_t *pool = (notmuch_parse_pool_t *) closure;
+
+    if (pool->parser)
+	g_object_unref (pool->parser);
+    if (pool->empty)
+	g_object_unref (pool->empty);
+    if (pool->headers)
+	g_hash_table_destroy (pool->headers);
+    free (pool->line);
+    free (pool);
+}
+
+static pthread_key_t parse_pool_key;
+static pthread_once_t parse_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+_parse_pool_make_key (void)
+{
+    pthread_key_create (&parse_pool_key, _parse_pool_destroy);
+}
+#else
+static notmuch_parse_pool_t *parse_pool = NULL;
+#endif
+
+/* Return the pool of the calling thread, or NULL if out of memory. */
+static notmuch_parse_pool_t *
+_parse_pool_get (void)
+{
+    notmuch_parse_pool_t *pool;
+
+#if HAVE_PTHREAD
+    pthread_once (&parse_pool_once, _parse_pool_make_key);
+    pool = (notmuch_parse_pool_t *) pthread_getspecific (parse_pool_key);
+#else
+    pool = parse_pool;
+#endif
+    if (pool)
+	return pool;
+
+    pool = (notmuch_parse_pool_t *) calloc (1, sizeof (*pool));
+    if (unlikely (pool == NULL))
+	return NULL;
+
+#if HAVE_PTHREAD
+    if (pthread_setspecific (parse_pool_key, pool)) {
+	_parse_pool_destroy (pool);
+	return NULL;
+    }
+#else
+    parse_pool = pool;
+#endif
+    return pool;
+}
+
 static int
 _notmuch_message_file_destructor (notmuch_message_file_t *message)
 {
-    if (message->headers)
-	g_hash_table_destroy (message->headers);
+    if (message->headers) {
+	notmuch_parse_pool_t *pool = _parse_pool_get ();
+
+	if (pool && ! pool->headers) {
+	    g_hash_table_remove_all (message->headers);
+	    pool->headers = message->headers;
+	} else {
+	    g_hash_table_destroy (message->headers);
+	}
+    }
 
     if (message->message)
 	g_object_unref (message->message);
@@ -71,10 +160,12 @@ _notmuch_message_file_open_ctx (notmuch_database_t *notmuch,
 
     talloc_set_destructor (message, _notmuch_message_file_destructor);
 
-    message->file = fopen (filename, "r");
+    message->file = mbox_member_fopen (filename);
     if (message->file == NULL)
 	goto FAIL;
 
+    _notmuch_profile_count (notmuch, NOTMUCH_PROFILE_FILES_OPENED, 1);
+
     return message;
 
   FAIL:
@@ -114,36 +205,117 @@ _is_mbox (FILE *file)
     return ret;
 }
 
-notmuch_status_t
-_notmuch_message_file_parse (notmuch_message_file_t *message)
+/* Files may be parsed by several threads at once (see
+ * notmuch_database_index_file), so GMime must be initialized exactly
+ * once. */
+#if HAVE_PTHREAD
+static pthread_once_t _gmime_initialized = PTHREAD_ONCE_INIT;
+#else
+static int _gmime_initialized = 0;
+#endif
+
+static void
+_init_gmime (void)
+{
+    g_mime_init (GMIME_ENABLE_RFC2047_WORKAROUNDS);
+}
+
+/* Return the offset just past the blank line ending the header block
+ * of 'file' (or its size, if there is no body), or -1 on error. */
+static off_t
+_header_block_end (FILE *file)
 {
+    notmuch_parse_pool_t *pool = _parse_pool_get ();
+    char *line = NULL;
+    size_t line_size = 0;
+    off_t end;
+
+    if (pool) {
+	line = pool->line;
+	line_size = pool->line_size;
+    }
+
+    while (getline (&line, &line_size, file) != -1) {
+	if (strcmp (line, "\n") == 0 || strcmp (line, "\r\n") == 0)
+	    break;
+    }
+
+    end = ferror (file) ? -1 : ftello (file);
+    if (pool) {
+	pool->line = line;
+	pool->line_size = line_size;
+    } else {
+	free (line);
+    }
+    rewind (file);
+
+    return end;
+}
+
+/* Construct message->message from the first 'end' bytes of the file,
+ * or the whole file if 'end' is -1. */
+static notmuch_status_t
+_notmuch_message_file_construct (notmuch_message_file_t *message,
+				 notmuch_bool_t is_mbox, off_t end)
+{
+    notmuch_parse_pool_t *pool;
     GMimeStream *stream;
     GMimeParser *parser;
     notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
-    static int initialized = 0;
-    notmuch_bool_t is_mbox;
 
-    if (message->message)
-	return NOTMUCH_STATUS_SUCCESS;
+#if HAVE_PTHREAD
+    pthread_once (&_gmime_initialized, _init_gmime);
+#else
+    if (! _gmime_initialized) {
+	_init_gmime ();
+	_gmime_initialized = 1;
+    }
+#endif
 
-    is_mbox = _is_mbox (message->file);
+    pool = _parse_pool_get ();
+    if (! pool)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
 
-    if (! initialized) {
-	g_mime_init (GMIME_ENABLE_RFC2047_WORKAROUNDS);
-	initialized = 1;
+    if (! message->headers) {
+	if (pool->headers) {
+	    message->headers = pool->headers;
+	    pool->headers = NULL;
+	} else {
+	    message->headers = g_hash_table_new_full (strcase_hash,
+						      strcase_equal,
+						      free, g_free);
+	}
+	if (! message->headers)
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
     }
 
-    message->headers = g_hash_table_new_full (strcase_hash, strcase_equal,
-					      free, g_free);
-    if (! message->headers)
+    /* We'll own and fclose the FILE* ourselves. */
+    stream = gmime_stream_for_file (message->file);
+    if (! stream)
 	return NOTMUCH_STATUS_OUT_OF_MEMORY;
 
-    stream = g_mime_stream_file_new (message->file);
+    if (end != -1) {
+	GMimeStream *header_stream = g_mime_stream_substream (stream, 0, end);
 
-    /* We'll own and fclose the FILE* ourselves. */
-    g_mime_stream_file_set_owner (GMIME_STREAM_FILE (stream), FALSE);
+	g_object_unref (stream);
+	if (! header_stream)
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	stream = header_stream;
+    }
 
-    parser = g_mime_parser_new_with_stream (stream);
+    /* The pooled parser is only ever used within this function, so
+     * it cannot be in use by another message of this thread. */
+    if (pool->parser) {
+	parser = pool->parser;
+	g_mime_parser_init_with_stream (parser, stream);
+    } else {
+	parser = g_mime_parser_new_with_stream (stream);
+	if (! parser) {
+	    g_object_unref (stream);
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	}
+    }
+    pool->parser = NULL;
     g_mime_parser_set_scan_from (parser, is_mbox);
 
     message->message = g_mime_parser_construct_message (parser);
@@ -162,23 +334,70 @@ _notmuch_message_file_parse (notmuch_message_file_t *message)
 
   DONE:
     g_object_unref (stream);
-    g_object_unref (parser);
-
-    if (status) {
-	g_hash_table_destroy (message->headers);
-	message->headers = NULL;
 
-	if (message->message) {
-	    g_object_unref (message->message);
-	    message->message = NULL;
-	}
+    /* Leave the parser on an empty stream, so that it no longer
+     * references the file, for the next message to reuse. */
+    if (! pool->empty)
+	pool->empty = g_mime_stream_mem_new ();
+    if (pool->empty) {
+	g_mime_parser_init_with_stream (parser, pool->empty);
+	pool->parser = parser;
+    } else {
+	g_object_unref (parser);
+    }
 
-	rewind (message->file);
+    if (status && message->message) {
+	g_object_unref (message->message);
+	message->message = NULL;
     }
 
+    rewind (message->file);
+
     return status;
 }
 
+notmuch_status_t
+_notmuch_message_file_parse_headers (notmuch_message_file_t *message)
+{
+    notmuch_status_t status;
+    off_t end;
+
+    if (message->message)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    /* Telling a single-message mbox from a multi-message one takes
+     * a full parse. */
+    if (_is_mbox (message->file))
+	return _notmuch_message_file_parse (message);
+
+    end = _header_block_end (message->file);
+    if (end == -1)
+	return NOTMUCH_STATUS_FILE_ERROR;
+
+    status = _notmuch_message_file_construct (message, FALSE, end);
+    if (status == NOTMUCH_STATUS_SUCCESS)
+	message->headers_only = TRUE;
+
+    return status;
+}
+
+notmuch_status_t
+_notmuch_message_file_parse (notmuch_message_file_t *message)
+{
+    if (message->message) {
+	if (! message->headers_only)
+	    return NOTMUCH_STATUS_SUCCESS;
+
+	/* Headers already decoded are still valid, so keep them. */
+	g_object_unref (message->message);
+	message->message = NULL;
+	message->headers_only = FALSE;
+    }
+
+    return _notmuch_message_file_construct (message,
+					    _is_mbox (message->file), -1);
+}
+
 notmuch_status_t
 _notmuch_message_file_get_mime_message (notmuch_message_file_t *message,
 					GMimeMessage **mime_message)
@@ -194,6 +413,21 @@ _notmuch_message_file_get_mime_message (notmuch_message_file_t *message,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+notmuch_status_t
+_notmuch_message_file_get_header_message (notmuch_message_file_t *message,
+					  GMimeMessage **mime_message)
+{
+    notmuch_status_t status;
+
+    status = _notmuch_message_file_parse_headers (message);
+    if (status)
+	return status;
+
+    *mime_message = message->message;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 /*
  * Get all instances of a header decoded and concatenated.
  *
@@ -272,7 +506,7 @@ _notmuch_message_file_get_header (notmuch_message_file_t *message,
     const char *value;
     char *decoded;
 
-    if (_notmuch_message_file_parse (message))
+    if (_notmuch_message_file_parse_headers (message))
 	return NULL;
 
     /* If we have a cached decoded value, use it. */
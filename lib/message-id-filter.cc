@@ -0,0 +1,338 @@
+/* message-id-filter.cc - Bloom filter over the message IDs of a database
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <stdint.h>
+
+/* Most message IDs named in References headers belong to no message
+ * in the database, and proving that takes a B-tree probe.  Writers
+ * keep a Bloom filter of the IDs of all documents (messages and
+ * ghosts), so that most absent IDs are ruled out without one.  IDs
+ * are never taken out of the filter; a removed message just becomes
+ * a false positive until the filter is next rebuilt.
+ *
+ * The filter lives in .notmuch/message-id-filter:
+ *
+ *	notmuch-message-id-filter 1 <uuid> <last doc id> <doc count> <bits> <ids>
+ *
+ * followed by the <bits> bits of the filter.  The last document ID
+ * and document count tie the file to the database state it was
+ * written for: any document added without updating the filter (by a
+ * writer that crashed, or an older notmuch) changes them.  If they do
+ * not match the database as it was opened, the filter is rebuilt from
+ * the id: terms.
+ */
+
+#define NOTMUCH_MESSAGE_ID_FILTER_FILE "message-id-filter"
+#define NOTMUCH_MESSAGE_ID_FILTER_MAGIC "notmuch-message-id-filter 1"
+
+/* About 1% false positives with 7 probes and 10 bits per ID. */
+#define NOTMUCH_MESSAGE_ID_FILTER_PROBES 7
+#define NOTMUCH_MESSAGE_ID_FILTER_BITS_PER_ID 10
+#define NOTMUCH_MESSAGE_ID_FILTER_MIN_BITS (1 << 16)
+
+struct _notmuch_message_id_filter {
+    /* The state of the database when it was opened, or NULL if the
+     * filter cannot be used. */
+    char *open_state;
+    unsigned char *bits;
+    /* A power of two. */
+    size_t num_bits;
+    unsigned long num_ids;
+    notmuch_bool_t dirty;
+};
+
+/* 64-bit FNV-1a.  The hash is part of the file format, so it must not
+ * depend on the platform. */
+static uint64_t
+_message_id_hash (const char *message_id)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *s;
+
+    for (s = (const unsigned char *) message_id; *s; s++) {
+	hash ^= *s;
+	hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/* Set the bits of 'message_id' if 'set' is TRUE; otherwise return
+ * whether they are all set. */
+static notmuch_bool_t
+_message_id_filter_probe (notmuch_message_id_filter_t *filter,
+			  const char *message_id,
+			  notmuch_bool_t set)
+{
+    uint64_t hash = _message_id_hash (message_id);
+    /* Double hashing; an odd step visits distinct bits. */
+    size_t h1 = (size_t) hash, h2 = (size_t) (hash >> 32) | 1;
+    notmuch_bool_t present = TRUE;
+    int i;
+
+    for (i = 0; i < NOTMUCH_MESSAGE_ID_FILTER_PROBES; i++) {
+	size_t bit = (h1 + i * h2) & (filter->num_bits - 1);
+	unsigned char mask = 1 << (bit % 8);
+
+	if (set) {
+	    filter->bits[bit / 8] |= mask;
+	} else if (! (filter->bits[bit / 8] & mask)) {
+	    present = FALSE;
+	    break;
+	}
+    }
+
+    return present;
+}
+
+static void
+_message_id_filter_add (notmuch_message_id_filter_t *filter,
+			const char *message_id)
+{
+    _message_id_filter_probe (filter, message_id, TRUE);
+    filter->num_ids++;
+    filter->dirty = TRUE;
+}
+
+static char *
+_message_id_filter_path (void *ctx, notmuch_database_t *notmuch)
+{
+    return talloc_asprintf (ctx, "%s/.notmuch/%s", notmuch->path,
+			    NOTMUCH_MESSAGE_ID_FILTER_FILE);
+}
+
+/* Size the filter for 'capacity' IDs and clear it. */
+static notmuch_bool_t
+_message_id_filter_reset (notmuch_message_id_filter_t *filter,
+			  unsigned long capacity)
+{
+    talloc_free (filter->bits);
+
+    filter->num_bits = NOTMUCH_MESSAGE_ID_FILTER_MIN_BITS;
+    while (filter->num_bits / NOTMUCH_MESSAGE_ID_FILTER_BITS_PER_ID < capacity)
+	filter->num_bits *= 2;
+    filter->num_ids = 0;
+    filter->dirty = FALSE;
+
+    filter->bits = talloc_zero_array (filter, unsigned char,
+				      filter->num_bits / 8);
+    return filter->bits != NULL;
+}
+
+/* Return the current state of the database, or NULL on error. */
+static char *
+_message_id_filter_state (void *ctx, notmuch_database_t *notmuch)
+{
+    try {
+	return talloc_asprintf (ctx, "%s %s %u %u",
+				NOTMUCH_MESSAGE_ID_FILTER_MAGIC,
+				notmuch->uuid,
+				notmuch->xapian_db->get_lastdocid (),
+				notmuch->xapian_db->get_doccount ());
+    } catch (const Xapian::Error &error) {
+	return NULL;
+    }
+}
+
+static notmuch_bool_t
+_message_id_filter_load (notmuch_message_id_filter_t *filter,
+			 notmuch_database_t *notmuch)
+{
+    const char *state = filter->open_state;
+    char *path = _message_id_filter_path (filter, notmuch);
+    char *line = NULL;
+    size_t line_size = 0, num_bits;
+    unsigned long num_ids;
+    notmuch_bool_t loaded = FALSE;
+    char *rest;
+    FILE *file;
+
+    file = fopen (path, "r");
+    talloc_free (path);
+    if (file == NULL)
+	return FALSE;
+
+    if (getline (&line, &line_size, file) <= 0 ||
+	strncmp (line, state, strlen (state)) != 0 ||
+	line[strlen (state)] != ' ')
+	goto DONE;
+
+    num_bits = strtoul (line + strlen (state) + 1, &rest, 10);
+    num_ids = strtoul (rest, &rest, 10);
+    if (*rest != '\n' || num_bits < NOTMUCH_MESSAGE_ID_FILTER_MIN_BITS ||
+	(num_bits & (num_bits - 1)))
+	goto DONE;
+
+    /* A filter that has filled up is rebuilt larger. */
+    if (num_ids > num_bits / NOTMUCH_MESSAGE_ID_FILTER_BITS_PER_ID)
+	goto DONE;
+
+    if (! _message_id_filter_reset (
+	    filter, num_bits / NOTMUCH_MESSAGE_ID_FILTER_BITS_PER_ID) ||
+	filter->num_bits != num_bits ||
+	fread (filter->bits, 1, num_bits / 8, file) != num_bits / 8)
+	goto DONE;
+
+    filter->num_ids = num_ids;
+    loaded = TRUE;
+
+  DONE:
+    free (line);
+    fclose (file);
+    return loaded;
+}
+
+/* Build the filter from the id: terms of every document. */
+static notmuch_bool_t
+_message_id_filter_build (notmuch_message_id_filter_t *filter,
+			  notmuch_database_t *notmuch)
+{
+    const char *prefix = NOTMUCH_PREFIX_ID;
+    Xapian::TermIterator i, end;
+
+    try {
+	/* Leave room to grow to twice the size. */
+	if (! _message_id_filter_reset (
+		filter, 2 * (unsigned long) notmuch->xapian_db->get_doccount ()))
+	    return FALSE;
+
+	end = notmuch->xapian_db->allterms_end (prefix);
+	for (i = notmuch->xapian_db->allterms_begin (prefix); i != end; i++)
+	    _message_id_filter_add (filter, (*i).c_str () + strlen (prefix));
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred building the message ID filter: %s.\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+void
+_notmuch_database_open_message_id_filter (notmuch_database_t *notmuch)
+{
+    notmuch_message_id_filter_t *filter;
+
+    /* Readers would have to rebuild a stale filter on every open. */
+    if (notmuch->mode != NOTMUCH_DATABASE_MODE_READ_WRITE)
+	return;
+
+    filter = talloc_zero (notmuch, notmuch_message_id_filter_t);
+    if (unlikely (filter == NULL))
+	return;
+
+    filter->open_state = _message_id_filter_state (filter, notmuch);
+    notmuch->message_id_filter = filter;
+}
+
+/* Return the filter, loading or building it on first use, or NULL if
+ * there is none. */
+static notmuch_message_id_filter_t *
+_message_id_filter_get (notmuch_database_t *notmuch)
+{
+    notmuch_message_id_filter_t *filter = notmuch->message_id_filter;
+
+    if (filter == NULL || filter->open_state == NULL)
+	return NULL;
+
+    if (filter->bits == NULL &&
+	! _message_id_filter_load (filter, notmuch) &&
+	! _message_id_filter_build (filter, notmuch)) {
+	/* Never write out a partial filter. */
+	talloc_free (filter->bits);
+	filter->bits = NULL;
+	talloc_free (filter->open_state);
+	filter->open_state = NULL;
+	return NULL;
+    }
+
+    return filter;
+}
+
+notmuch_bool_t
+_notmuch_database_may_have_message_id (notmuch_database_t *notmuch,
+				       const char *message_id)
+{
+    notmuch_message_id_filter_t *filter = _message_id_filter_get (notmuch);
+
+    if (filter == NULL)
+	return TRUE;
+
+    return _message_id_filter_probe (filter, message_id, FALSE);
+}
+
+void
+_notmuch_database_add_message_id (notmuch_database_t *notmuch,
+				  const char *message_id)
+{
+    notmuch_message_id_filter_t *filter = _message_id_filter_get (notmuch);
+
+    if (filter)
+	_message_id_filter_add (filter, message_id);
+}
+
+/* Write out the filter if any ID was added to it.  This must be done
+ * while the database is still open, once no more documents will be
+ * added.  Failing to write the filter is not an error; it will be
+ * rebuilt next time. */
+void
+_notmuch_database_flush_message_id_filter (notmuch_database_t *notmuch)
+{
+    notmuch_message_id_filter_t *filter = notmuch->message_id_filter;
+    void *local;
+    char *path, *tmp_path, *state;
+    notmuch_bool_t failed;
+    FILE *file;
+
+    if (filter == NULL || filter->open_state == NULL ||
+	filter->bits == NULL || ! filter->dirty)
+	return;
+
+    local = talloc_new (NULL);
+    path = _message_id_filter_path (local, notmuch);
+    tmp_path = talloc_asprintf (local, "%s.%d", path, (int) getpid ());
+    state = _message_id_filter_state (local, notmuch);
+    if (state == NULL)
+	goto DONE;
+
+    file = fopen (tmp_path, "w");
+    if (file == NULL)
+	goto DONE;
+
+    fprintf (file, "%s %lu %lu\n", state, (unsigned long) filter->num_bits,
+	     filter->num_ids);
+    fwrite (filter->bits, 1, filter->num_bits / 8, file);
+
+    failed = ferror (file);
+    if (fclose (file) != 0)
+	failed = TRUE;
+
+    if (failed || rename (tmp_path, path) != 0)
+	unlink (tmp_path);
+    else
+	filter->dirty = FALSE;
+
+  DONE:
+    talloc_free (local);
+}
@@ -20,9 +20,14 @@
 
 #include "notmuch-private.h"
 #include "database-private.h"
+#include "zlib-extra.h"
 
 #include <stdint.h>
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include <gmime/gmime.h>
 
 struct visible _notmuch_message {
@@ -33,6 +38,9 @@ struct visible _notmuch_message {
     char *thread_id;
     char *in_reply_to;
     notmuch_string_list_t *tag_list;
+    /* The tags of tag_list as interned by the database, or NULL if
+     * not computed yet. */
+    notmuch_tag_set_t *tag_set;
     notmuch_string_list_t *filename_term_list;
     notmuch_string_list_t *filename_list;
     char *author;
@@ -43,13 +51,29 @@ struct visible _notmuch_message {
      * if each flag has been initialized. */
     unsigned long lazy_flags;
 
+    /* Fields to decode from the termlist alongside the one asked
+     * for; see _notmuch_message_ensure_metadata. */
+    unsigned int fields;
+
     /* Message document modified since last sync */
     notmuch_bool_t modified;
 
     Xapian::Document doc;
     Xapian::termcount termpos;
+
+    /* The estimated memory Xapian will need to hold the terms added
+     * to doc since the last sync; see _notmuch_database_add_pending. */
+    size_t pending_bytes;
 };
 
+/* For the estimate of pending_bytes: the cost of a term of the
+ * document beyond its characters, of one of its positions, and of
+ * each byte of text handed to the term generator, which makes terms,
+ * stems and positions of it. */
+#define NOTMUCH_PENDING_TERM_BYTES 40
+#define NOTMUCH_PENDING_POSITION_BYTES 4
+#define NOTMUCH_PENDING_TEXT_FACTOR 4
+
 #define ARRAY_SIZE(arr) (sizeof (arr) / sizeof (arr[0]))
 
 struct maildir_flag_tag {
@@ -81,7 +105,7 @@ _notmuch_message_destructor (notmuch_message_t *message)
     return 0;
 }
 
-static notmuch_message_t *
+notmuch_message_t *
 _notmuch_message_create_for_document (const void *talloc_owner,
 				      notmuch_database_t *notmuch,
 				      unsigned int doc_id,
@@ -106,23 +130,21 @@ _notmuch_message_create_for_document (const void *talloc_owner,
     message->frozen = 0;
     message->flags = 0;
     message->lazy_flags = 0;
+    message->fields = NOTMUCH_FIELD_ALL;
 
     /* Each of these will be lazily created as needed. */
     message->message_id = NULL;
     message->thread_id = NULL;
     message->in_reply_to = NULL;
     message->tag_list = NULL;
+    message->tag_set = NULL;
     message->filename_term_list = NULL;
     message->filename_list = NULL;
     message->message_file = NULL;
     message->author = NULL;
-
-    message->replies = _notmuch_message_list_create (message);
-    if (unlikely (message->replies == NULL)) {
-	if (status)
-	    *status = NOTMUCH_PRIVATE_STATUS_OUT_OF_MEMORY;
-	return NULL;
-    }
+    /* Only messages in threads have replies, so the list is only
+     * created when first needed. */
+    message->replies = NULL;
 
     /* This is C++'s creepy "placement new", which is really just an
      * ugly way to call a constructor for a pre-allocated object. So
@@ -136,6 +158,7 @@ _notmuch_message_create_for_document (const void *talloc_owner,
 
     message->doc = doc;
     message->termpos = 0;
+    message->pending_bytes = 0;
 
     return message;
 }
@@ -179,11 +202,27 @@ _notmuch_message_create (const void *talloc_owner,
 	    *status = NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND;
 	return NULL;
     }
+    _notmuch_profile_count (notmuch, NOTMUCH_PROFILE_DOCUMENTS, 1);
 
     return _notmuch_message_create_for_document (talloc_owner, notmuch,
 						 doc_id, doc, status);
 }
 
+/* Create a new notmuch_message_t object with an empty document that
+ * is not (and will never be) part of the database.  Terms generated
+ * for it can be added to a real message with
+ * _notmuch_message_merge_terms.
+ *
+ * Only 'notmuch's term generator and features are used, so 'notmuch'
+ * may be a private handle not backed by a Xapian database. */
+notmuch_message_t *
+_notmuch_message_create_detached (const void *talloc_owner,
+				  notmuch_database_t *notmuch)
+{
+    return _notmuch_message_create_for_document (talloc_owner, notmuch, 0,
+						 Xapian::Document (), NULL);
+}
+
 /* Create a new notmuch_message_t object for a specific message ID,
  * (which may or may not already exist in the database).
  *
@@ -238,7 +277,7 @@ _notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
 	message_id = _notmuch_message_id_compressed (message, message_id);
 
     term = talloc_asprintf (NULL, "%s%s",
-			    _find_prefix ("id"), message_id);
+			    NOTMUCH_PREFIX_ID, message_id);
     if (term == NULL) {
 	*status_ret = NOTMUCH_PRIVATE_STATUS_OUT_OF_MEMORY;
 	return NULL;
@@ -254,6 +293,7 @@ _notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
 	doc.add_value (NOTMUCH_VALUE_MESSAGE_ID, message_id);
 
 	doc_id = _notmuch_database_generate_doc_id (notmuch);
+	_notmuch_database_add_message_id (notmuch, message_id);
     } catch (const Xapian::Error &error) {
 	_notmuch_database_log(_notmuch_message_database (message), "A Xapian exception occurred creating message: %s\n",
 		 error.get_msg().c_str());
@@ -306,48 +346,98 @@ _notmuch_message_get_term (notmuch_message_t *message,
 }
 
 void
-_notmuch_message_ensure_metadata (notmuch_message_t *message)
+_notmuch_message_set_fields (notmuch_message_t *message,
+			     unsigned int fields)
+{
+    message->fields = fields;
+}
+
+/* Decode 'field', a notmuch_field_t value, from the termlist, along
+ * with any other fields in message->fields that are not loaded yet. */
+static void
+_notmuch_message_read_metadata (notmuch_message_t *message,
+				unsigned int field)
 {
     Xapian::TermIterator i, end;
-    const char *thread_prefix = _find_prefix ("thread"),
-	*tag_prefix = _find_prefix ("tag"),
-	*id_prefix = _find_prefix ("id"),
-	*type_prefix = _find_prefix ("type"),
-	*filename_prefix = _find_prefix ("file-direntry"),
-	*replyto_prefix = _find_prefix ("replyto");
+    const char *thread_prefix = NOTMUCH_PREFIX_THREAD,
+	*tag_prefix = NOTMUCH_PREFIX_TAG,
+	*id_prefix = NOTMUCH_PREFIX_ID,
+	*type_prefix = NOTMUCH_PREFIX_TYPE,
+	*filename_prefix = NOTMUCH_PREFIX_FILE_DIRENTRY,
+	*replyto_prefix = NOTMUCH_PREFIX_REPLYTO;
+    unsigned int needed = field | message->fields;
 
     /* We do this all in a single pass because Xapian decompresses the
      * term list every time you iterate over it.  Thus, while this is
      * slightly more costly than looking up individual fields if only
      * one field of the message object is actually used, it's a huge
-     * win as more fields are used. */
+     * win as more fields are used.  Callers that know they only need
+     * a few fields say so with message->fields; we skip over the
+     * terms of every other field, and stop as soon as the last
+     * needed field is loaded. */
+
+    if (message->thread_id)
+	needed &= ~NOTMUCH_FIELD_THREAD_ID;
+    if (message->tag_list)
+	needed &= ~NOTMUCH_FIELD_TAGS;
+    if (message->message_id)
+	needed &= ~NOTMUCH_FIELD_MESSAGE_ID;
+    if (NOTMUCH_TEST_BIT (message->lazy_flags, NOTMUCH_MESSAGE_FLAG_GHOST))
+	needed &= ~NOTMUCH_FIELD_TYPE;
+    if (message->filename_term_list || message->filename_list)
+	needed &= ~NOTMUCH_FIELD_FILENAMES;
+    if (message->in_reply_to)
+	needed &= ~NOTMUCH_FIELD_IN_REPLY_TO;
+
+    if (! needed)
+	return;
 
     i = message->doc.termlist_begin ();
     end = message->doc.termlist_end ();
 
     /* Get thread */
-    if (!message->thread_id)
+    if (needed & NOTMUCH_FIELD_THREAD_ID) {
 	message->thread_id =
 	    _notmuch_message_get_term (message, i, end, thread_prefix);
+	if (message->thread_id) {
+	    const char *resolved = _notmuch_database_resolve_thread_id (
+		message->notmuch, message->thread_id);
+
+	    if (resolved != message->thread_id) {
+		talloc_free (message->thread_id);
+		message->thread_id = talloc_strdup (message, resolved);
+	    }
+	}
+	needed &= ~NOTMUCH_FIELD_THREAD_ID;
+	if (! needed)
+	    return;
+    }
 
     /* Get tags */
     assert (strcmp (thread_prefix, tag_prefix) < 0);
-    if (!message->tag_list) {
+    if (needed & NOTMUCH_FIELD_TAGS) {
 	message->tag_list =
 	    _notmuch_database_get_terms_with_prefix (message, i, end,
 						     tag_prefix);
 	_notmuch_string_list_sort (message->tag_list);
+	needed &= ~NOTMUCH_FIELD_TAGS;
+	if (! needed)
+	    return;
     }
 
     /* Get id */
     assert (strcmp (tag_prefix, id_prefix) < 0);
-    if (!message->message_id)
+    if (needed & NOTMUCH_FIELD_MESSAGE_ID) {
 	message->message_id =
 	    _notmuch_message_get_term (message, i, end, id_prefix);
+	needed &= ~NOTMUCH_FIELD_MESSAGE_ID;
+	if (! needed)
+	    return;
+    }
 
     /* Get document type */
     assert (strcmp (id_prefix, type_prefix) < 0);
-    if (! NOTMUCH_TEST_BIT (message->lazy_flags, NOTMUCH_MESSAGE_FLAG_GHOST)) {
+    if (needed & NOTMUCH_FIELD_TYPE) {
 	i.skip_to (type_prefix);
 	/* "T" is the prefix "type" fields.  See
 	 * BOOLEAN_PREFIX_INTERNAL. */
@@ -358,26 +448,113 @@ _notmuch_message_ensure_metadata (notmuch_message_t *message)
 	else
 	    INTERNAL_ERROR ("Message without type term");
 	NOTMUCH_SET_BIT (&message->lazy_flags, NOTMUCH_MESSAGE_FLAG_GHOST);
+	needed &= ~NOTMUCH_FIELD_TYPE;
+	if (! needed)
+	    return;
     }
 
     /* Get filename list.  Here we get only the terms.  We lazily
      * expand them to full file names when needed in
      * _notmuch_message_ensure_filename_list. */
     assert (strcmp (type_prefix, filename_prefix) < 0);
-    if (!message->filename_term_list && !message->filename_list)
+    if (needed & NOTMUCH_FIELD_FILENAMES) {
 	message->filename_term_list =
 	    _notmuch_database_get_terms_with_prefix (message, i, end,
 						     filename_prefix);
+	needed &= ~NOTMUCH_FIELD_FILENAMES;
+	if (! needed)
+	    return;
+    }
 
     /* Get reply to */
     assert (strcmp (filename_prefix, replyto_prefix) < 0);
-    if (!message->in_reply_to)
+    if (needed & NOTMUCH_FIELD_IN_REPLY_TO) {
 	message->in_reply_to =
 	    _notmuch_message_get_term (message, i, end, replyto_prefix);
-    /* It's perfectly valid for a message to have no In-Reply-To
-     * header. For these cases, we return an empty string. */
-    if (!message->in_reply_to)
-	message->in_reply_to = talloc_strdup (message, "");
+	/* It's perfectly valid for a message to have no In-Reply-To
+	 * header. For these cases, we return an empty string. */
+	if (!message->in_reply_to)
+	    message->in_reply_to = talloc_strdup (message, "");
+    }
+}
+
+/* Called on a Xapian::DatabaseModifiedError reading the document of
+ * 'message': reopen the database and get the document again, at the
+ * latest revision.  Return FALSE if the read is not to be retried,
+ * such as when the message has since been removed. */
+static notmuch_bool_t
+_notmuch_message_reread_document (notmuch_message_t *message,
+				  unsigned int *attempts)
+{
+    while (_notmuch_database_reopen_modified (message->notmuch, attempts)) {
+	try {
+	    message->doc = message->notmuch->xapian_db->get_document (
+		message->doc_id);
+	    return TRUE;
+	} catch (const Xapian::DatabaseModifiedError &error) {
+	    continue;
+	} catch (const Xapian::Error &error) {
+	    return FALSE;
+	}
+    }
+
+    return FALSE;
+}
+
+/* Return the value in 'slot' of the document of 'message', read
+ * again from the latest revision if the database is modified under
+ * the read.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static std::string
+_notmuch_message_get_value (notmuch_message_t *message, Xapian::valueno slot)
+{
+    unsigned int attempts = 0;
+
+    for (;;) {
+	try {
+	    return message->doc.get_value (slot);
+	} catch (const Xapian::DatabaseModifiedError &error) {
+	    if (! _notmuch_message_reread_document (message, &attempts))
+		throw;
+	}
+    }
+}
+
+/* As _notmuch_message_read_metadata, with the tag changes journaled
+ * by readers applied to the tags read. */
+static void
+_notmuch_message_ensure_metadata (notmuch_message_t *message,
+				  unsigned int field)
+{
+    notmuch_string_list_t *tags;
+    notmuch_bool_t had_tags = message->tag_list != NULL;
+    const char *message_id;
+    unsigned int attempts = 0;
+
+    /* The fields read before the database changed are kept, so a
+     * retry reads only the rest. */
+    for (;;) {
+	try {
+	    _notmuch_message_read_metadata (message, field);
+	    break;
+	} catch (const Xapian::DatabaseModifiedError &error) {
+	    if (! _notmuch_message_reread_document (message, &attempts))
+		throw;
+	}
+    }
+
+    if (had_tags || message->tag_list == NULL ||
+	! _notmuch_database_has_tag_journal (message->notmuch))
+	return;
+
+    message_id = notmuch_message_get_message_id (message);
+    tags = _notmuch_database_apply_tag_journal (message->notmuch, message,
+						message_id, message->tag_list);
+    if (tags != message->tag_list) {
+	talloc_free (message->tag_list);
+	message->tag_list = tags;
+    }
 }
 
 static void
@@ -392,6 +569,8 @@ _notmuch_message_invalidate_metadata (notmuch_message_t *message,
     if (strcmp ("tag", prefix_name) == 0) {
 	talloc_unlink (message, message->tag_list);
 	message->tag_list = NULL;
+	talloc_free (message->tag_set);
+	message->tag_set = NULL;
     }
 
     if (strcmp ("type", prefix_name) == 0) {
@@ -417,11 +596,33 @@ _notmuch_message_get_doc_id (notmuch_message_t *message)
     return message->doc_id;
 }
 
+/* Return the revision of the last change to 'message', or 0 if the
+ * database does not record it. */
+unsigned long
+_notmuch_message_get_revision (notmuch_message_t *message)
+{
+    std::string last_mod;
+
+    try {
+	last_mod = _notmuch_message_get_value (message, NOTMUCH_VALUE_LAST_MOD);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (message->notmuch, "A Xapian exception occurred reading the revision of a message: %s.\n",
+			       error.get_msg().c_str());
+	message->notmuch->exception_reported = TRUE;
+	return 0;
+    }
+
+    if (last_mod.empty ())
+	return 0;
+
+    return Xapian::sortable_unserialise (last_mod);
+}
+
 const char *
 notmuch_message_get_message_id (notmuch_message_t *message)
 {
     if (!message->message_id)
-	_notmuch_message_ensure_metadata (message);
+	_notmuch_message_ensure_metadata (message, NOTMUCH_FIELD_MESSAGE_ID);
     if (!message->message_id)
 	INTERNAL_ERROR ("Message with document ID of %u has no message ID.\n",
 			message->doc_id);
@@ -448,6 +649,7 @@ const char *
 notmuch_message_get_header (notmuch_message_t *message, const char *header)
 {
     Xapian::valueno slot = Xapian::BAD_VALUENO;
+    _notmuch_features feature = NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES;
 
     /* Fetch header from the appropriate xapian value field if
      * available */
@@ -457,16 +659,49 @@ notmuch_message_get_header (notmuch_message_t *message, const char *header)
 	slot = NOTMUCH_VALUE_SUBJECT;
     else if (strcasecmp (header, "message-id") == 0)
 	slot = NOTMUCH_VALUE_MESSAGE_ID;
-
-    if (slot != Xapian::BAD_VALUENO) {
+    else if (strcasecmp (header, "to") == 0)
+	slot = NOTMUCH_VALUE_TO;
+    else if (strcasecmp (header, "cc") == 0)
+	slot = NOTMUCH_VALUE_CC;
+    else if (strcasecmp (header, "bcc") == 0)
+	slot = NOTMUCH_VALUE_BCC;
+
+    if (slot == NOTMUCH_VALUE_TO || slot == NOTMUCH_VALUE_CC ||
+	slot == NOTMUCH_VALUE_BCC)
+	feature = NOTMUCH_FEATURE_RECIPIENT_VALUES;
+
+    if (slot == Xapian::BAD_VALUENO) {
+	/* Look for the header in the record of recorded headers.  A
+	 * header in the record is authoritative. */
+	try {
+	    std::string record = _notmuch_message_get_value (
+		message, NOTMUCH_VALUE_HEADERS);
+	    const char *name = record.c_str ();
+	    const char *end = name + record.size ();
+
+	    while (name < end) {
+		const char *value = name + strlen (name) + 1;
+
+		if (value >= end)
+		    break;
+		if (strcasecmp (name, header) == 0)
+		    return talloc_strdup (message, value);
+		name = value + strlen (value) + 1;
+	    }
+	} catch (Xapian::Error &error) {
+	    _notmuch_database_log(_notmuch_message_database (message), "A Xapian exception occurred when reading header: %s\n",
+		     error.get_msg().c_str());
+	    message->notmuch->exception_reported = TRUE;
+	    return NULL;
+	}
+    } else {
 	try {
-	    std::string value = message->doc.get_value (slot);
+	    std::string value = _notmuch_message_get_value (message, slot);
 
-	    /* If we have NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES, then
+	    /* If we have the feature that records this header, then
 	     * empty values indicate empty headers.  If we don't, then
 	     * it could just mean we didn't record the header. */
-	    if ((message->notmuch->features &
-		 NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES) ||
+	    if ((message->notmuch->features & feature) ||
 		! value.empty())
 		return talloc_strdup (message, value.c_str ());
 
@@ -486,6 +721,23 @@ notmuch_message_get_header (notmuch_message_t *message, const char *header)
     return _notmuch_message_file_get_header (message->message_file, header);
 }
 
+const char *
+notmuch_message_get_snippet (notmuch_message_t *message)
+{
+    try {
+	std::string snippet = _notmuch_message_get_value (
+	    message, NOTMUCH_VALUE_SNIPPET);
+
+	return talloc_strdup (message, snippet.c_str ());
+    } catch (Xapian::Error &error) {
+	_notmuch_database_log (_notmuch_message_database (message),
+			       "A Xapian exception occurred when reading snippet: %s\n",
+			       error.get_msg().c_str());
+	message->notmuch->exception_reported = TRUE;
+	return NULL;
+    }
+}
+
 /* Return the message ID from the In-Reply-To header of 'message'.
  *
  * Returns an empty string ("") if 'message' has no In-Reply-To
@@ -497,15 +749,48 @@ const char *
 _notmuch_message_get_in_reply_to (notmuch_message_t *message)
 {
     if (!message->in_reply_to)
-	_notmuch_message_ensure_metadata (message);
+	_notmuch_message_ensure_metadata (message, NOTMUCH_FIELD_IN_REPLY_TO);
     return message->in_reply_to;
 }
 
+/* Return the document ID of the message (or ghost) that 'message'
+ * replies to, as recorded when it was added, or 0 if none was.  The
+ * ID is only a hint: the parent may have been removed or renumbered
+ * since, so callers check it against the in-reply-to message ID. */
+unsigned int
+_notmuch_message_get_parent_doc_id (notmuch_message_t *message)
+{
+    std::string parent;
+
+    try {
+	parent = message->doc.get_value (NOTMUCH_VALUE_PARENT);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (message->notmuch, "A Xapian exception occurred reading the parent of a message: %s.\n",
+			       error.get_msg().c_str());
+	message->notmuch->exception_reported = TRUE;
+	return 0;
+    }
+
+    if (parent.empty ())
+	return 0;
+
+    return Xapian::sortable_unserialise (parent);
+}
+
+void
+_notmuch_message_set_parent_doc_id (notmuch_message_t *message,
+				    unsigned int doc_id)
+{
+    message->doc.add_value (NOTMUCH_VALUE_PARENT,
+			    Xapian::sortable_serialise (doc_id));
+    message->modified = TRUE;
+}
+
 const char *
 notmuch_message_get_thread_id (notmuch_message_t *message)
 {
     if (!message->thread_id)
-	_notmuch_message_ensure_metadata (message);
+	_notmuch_message_ensure_metadata (message, NOTMUCH_FIELD_THREAD_ID);
     if (!message->thread_id)
 	INTERNAL_ERROR ("Message with document ID of %u has no thread ID.\n",
 			message->doc_id);
@@ -516,12 +801,21 @@ void
 _notmuch_message_add_reply (notmuch_message_t *message,
 			    notmuch_message_t *reply)
 {
+    if (! message->replies)
+	message->replies = _notmuch_message_list_create (message);
+    if (unlikely (message->replies == NULL))
+	return;
+
     _notmuch_message_list_add_message (message->replies, reply);
 }
 
 notmuch_messages_t *
 notmuch_message_get_replies (notmuch_message_t *message)
 {
+    /* As for an empty list, there is no iterator without replies. */
+    if (! message->replies)
+	return NULL;
+
     return _notmuch_messages_create (message->replies);
 }
 
@@ -601,7 +895,9 @@ _notmuch_message_add_folder_terms (notmuch_message_t *message,
 
 #define RECURSIVE_SUFFIX "/**"
 
-/* Add "path:" terms for directory. */
+/* Add "path:" terms for directory.  Without
+ * NOTMUCH_FEATURE_SUBTREE_PATHS, each ancestor of directory gets a
+ * recursive term as well. */
 static notmuch_status_t
 _notmuch_message_add_path_terms (notmuch_message_t *message,
 				 const char *directory)
@@ -609,7 +905,8 @@ _notmuch_message_add_path_terms (notmuch_message_t *message,
     /* Add exact "path:" term. */
     _notmuch_message_add_term (message, "path", directory);
 
-    if (strlen (directory)) {
+    if (strlen (directory) &&
+	! (message->notmuch->features & NOTMUCH_FEATURE_SUBTREE_PATHS)) {
 	char *path, *p;
 
 	path = talloc_asprintf (NULL, "%s%s", directory, RECURSIVE_SUFFIX);
@@ -637,7 +934,7 @@ _notmuch_message_add_path_terms (notmuch_message_t *message,
 static notmuch_status_t
 _notmuch_message_add_directory_terms (void *ctx, notmuch_message_t *message)
 {
-    const char *direntry_prefix = _find_prefix ("file-direntry");
+    const char *direntry_prefix = NOTMUCH_PREFIX_FILE_DIRENTRY;
     int direntry_prefix_len = strlen (direntry_prefix);
     Xapian::TermIterator i = message->doc.termlist_begin ();
     notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
@@ -758,10 +1055,10 @@ _notmuch_message_remove_filename (notmuch_message_t *message,
     /* Re-synchronize "folder:" and "path:" terms for this message. */
 
     /* Remove all "folder:" terms. */
-    _notmuch_message_remove_terms (message, _find_prefix ("folder"));
+    _notmuch_message_remove_terms (message, NOTMUCH_PREFIX_FOLDER);
 
     /* Remove all "path:" terms. */
-    _notmuch_message_remove_terms (message, _find_prefix ("path"));
+    _notmuch_message_remove_terms (message, NOTMUCH_PREFIX_PATH);
 
     /* Add back terms for all remaining filenames of the message. */
     status = _notmuch_message_add_directory_terms (local, message);
@@ -787,6 +1084,35 @@ _notmuch_message_upgrade_folder (notmuch_message_t *message)
     _notmuch_message_add_directory_terms (message, message);
 }
 
+/* Upgrade the "path:" terms to NOTMUCH_FEATURE_SUBTREE_PATHS by
+ * dropping the recursive terms for ancestor directories, all but
+ * path:** itself. */
+void
+_notmuch_message_upgrade_subtree_paths (notmuch_message_t *message)
+{
+    const char *prefix = NOTMUCH_PREFIX_PATH;
+    const char *all = NOTMUCH_PREFIX_PATH "**";
+    size_t suffix_len = strlen (RECURSIVE_SUFFIX);
+    std::vector<std::string> recursive;
+    Xapian::TermIterator i = message->doc.termlist_begin ();
+
+    for (i.skip_to (prefix); i != message->doc.termlist_end (); i++) {
+	const std::string &term = *i;
+
+	if (term.compare (0, strlen (prefix), prefix) != 0)
+	    break;
+	if (term != all && term.size () > suffix_len &&
+	    term.compare (term.size () - suffix_len, suffix_len,
+			  RECURSIVE_SUFFIX) == 0)
+	    recursive.push_back (term);
+    }
+
+    for (size_t j = 0; j < recursive.size (); j++)
+	message->doc.remove_term (recursive[j]);
+    if (! recursive.empty ())
+	message->modified = TRUE;
+}
+
 char *
 _notmuch_message_talloc_copy_data (notmuch_message_t *message)
 {
@@ -809,7 +1135,7 @@ _notmuch_message_ensure_filename_list (notmuch_message_t *message)
 	return;
 
     if (!message->filename_term_list)
-	_notmuch_message_ensure_metadata (message);
+	_notmuch_message_ensure_metadata (message, NOTMUCH_FIELD_FILENAMES);
 
     message->filename_list = _notmuch_string_list_create (message);
     node = message->filename_term_list->head;
@@ -903,7 +1229,7 @@ notmuch_message_get_flag (notmuch_message_t *message,
 {
     if (flag == NOTMUCH_MESSAGE_FLAG_GHOST &&
 	! NOTMUCH_TEST_BIT (message->lazy_flags, flag))
-	_notmuch_message_ensure_metadata (message);
+	_notmuch_message_ensure_metadata (message, NOTMUCH_FIELD_TYPE);
 
     return NOTMUCH_TEST_BIT (message->flags, flag);
 }
@@ -925,7 +1251,7 @@ notmuch_message_get_date (notmuch_message_t *message)
     std::string value;
 
     try {
-	value = message->doc.get_value (NOTMUCH_VALUE_TIMESTAMP);
+	value = _notmuch_message_get_value (message, NOTMUCH_VALUE_TIMESTAMP);
     } catch (Xapian::Error &error) {
 	_notmuch_database_log(_notmuch_message_database (message), "A Xapian exception occurred when reading date: %s\n",
 		 error.get_msg().c_str());
@@ -945,7 +1271,7 @@ notmuch_message_get_tags (notmuch_message_t *message)
     notmuch_tags_t *tags;
 
     if (!message->tag_list)
-	_notmuch_message_ensure_metadata (message);
+	_notmuch_message_ensure_metadata (message, NOTMUCH_FIELD_TAGS);
 
     tags = _notmuch_tags_create (message, message->tag_list);
     /* _notmuch_tags_create steals the reference to the tag_list, but
@@ -960,6 +1286,21 @@ notmuch_message_get_tags (notmuch_message_t *message)
     return tags;
 }
 
+const notmuch_tag_set_t *
+_notmuch_message_get_tag_set (notmuch_message_t *message)
+{
+    if (message->tag_set)
+	return message->tag_set;
+
+    if (!message->tag_list)
+	_notmuch_message_ensure_metadata (message, NOTMUCH_FIELD_TAGS);
+
+    message->tag_set = _notmuch_tag_set_create_for_tags (message,
+							 message->notmuch,
+							 message->tag_list, 0);
+    return message->tag_set;
+}
+
 const char *
 _notmuch_message_get_author (notmuch_message_t *message)
 {
@@ -998,6 +1339,120 @@ _notmuch_message_set_header_values (notmuch_message_t *message,
     message->modified = TRUE;
 }
 
+/* Store the recipient headers of 'message', any of which may be
+ * NULL. */
+void
+_notmuch_message_set_recipient_values (notmuch_message_t *message,
+				       const char *to,
+				       const char *cc,
+				       const char *bcc)
+{
+    message->doc.add_value (NOTMUCH_VALUE_TO, to ? to : "");
+    message->doc.add_value (NOTMUCH_VALUE_CC, cc ? cc : "");
+    message->doc.add_value (NOTMUCH_VALUE_BCC, bcc ? bcc : "");
+    message->modified = TRUE;
+}
+
+/* Store the header record of 'message', built when its file was
+ * read; see _notmuch_indexed_file_record_headers. */
+void
+_notmuch_message_set_header_record (notmuch_message_t *message,
+				    const char *record,
+				    size_t length)
+{
+    if (record == NULL || length == 0)
+	return;
+
+    message->doc.add_value (NOTMUCH_VALUE_HEADERS, std::string (record, length));
+    message->modified = TRUE;
+}
+
+/* The snippet leaves out quoted lines, i.e. those starting with '>'
+ * after any white space, and replaces each run of white space with a
+ * single space.  It is cut at snippet_length characters, never within
+ * one, so a snippet of the first piece of a long part is as good as
+ * one of the whole part. */
+void
+_notmuch_message_set_snippet (notmuch_message_t *message,
+			      const char *text,
+			      size_t length)
+{
+    unsigned int max = message->notmuch->snippet_length;
+    unsigned int chars = 0;
+    notmuch_bool_t line_start = TRUE, quoted = FALSE, space = FALSE;
+    std::string snippet;
+    size_t i;
+
+    if (max == 0 || ! message->doc.get_value (NOTMUCH_VALUE_SNIPPET).empty ())
+	return;
+
+    for (i = 0; i < length; i++) {
+	char c = text[i];
+
+	if (c == '\n') {
+	    line_start = TRUE;
+	    quoted = FALSE;
+	    space = ! snippet.empty ();
+	    continue;
+	}
+
+	if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+	    space = ! snippet.empty ();
+	    continue;
+	}
+
+	if (line_start) {
+	    line_start = FALSE;
+	    quoted = (c == '>');
+	}
+	if (quoted)
+	    continue;
+
+	/* Only the first byte of a UTF-8 sequence starts a character. */
+	if ((c & 0xc0) != 0x80) {
+	    if (chars + (space ? 1 : 0) >= max)
+		break;
+	    if (space) {
+		snippet.push_back (' ');
+		chars++;
+		space = FALSE;
+	    }
+	    chars++;
+	}
+	snippet.push_back (c);
+    }
+
+    if (snippet.empty ())
+	return;
+
+    message->doc.add_value (NOTMUCH_VALUE_SNIPPET, snippet);
+    message->modified = TRUE;
+}
+
+/* Upgrade a message to support NOTMUCH_FEATURE_RECIPIENT_VALUES by
+ * reading its headers from its file.  A message whose file cannot be
+ * read is left without them.  The caller must call
+ * _notmuch_message_sync. */
+void
+_notmuch_message_upgrade_recipients (notmuch_message_t *message)
+{
+    const char *to, *cc, *bcc;
+
+    _notmuch_message_ensure_message_file (message);
+    if (message->message_file == NULL)
+	return;
+
+    to = _notmuch_message_file_get_header (message->message_file, "to");
+    cc = _notmuch_message_file_get_header (message->message_file, "cc");
+    bcc = _notmuch_message_file_get_header (message->message_file, "bcc");
+
+    _notmuch_message_set_recipient_values (message, to, cc, bcc);
+
+    /* Upgrades touch every message; don't keep every file open. */
+    _notmuch_message_file_close (message->message_file);
+    message->message_file = NULL;
+}
+
 /* Upgrade a message to support NOTMUCH_FEATURE_LAST_MOD.  The caller
  * must call _notmuch_message_sync. */
 void
@@ -1020,84 +1475,142 @@ _notmuch_message_sync (notmuch_message_t *message)
     if (! message->modified)
 	return;
 
+    _notmuch_database_touch_document (message->notmuch, message->doc);
+
+    db = static_cast <Xapian::WritableDatabase *> (message->notmuch->xapian_db);
+    db->replace_document (message->doc_id, message->doc);
+    message->modified = FALSE;
+
+    _notmuch_database_add_pending (message->notmuch, message->pending_bytes);
+    message->pending_bytes = 0;
+}
+
+void
+_notmuch_database_touch_document (notmuch_database_t *notmuch,
+				  Xapian::Document &doc)
+{
+    /* Wildcards in queries parsed before may now expand to more
+     * terms. */
+    notmuch->parse_generation++;
+
     /* Update the last modification of this message. */
-    if (message->notmuch->features & NOTMUCH_FEATURE_LAST_MOD)
+    if (notmuch->features & NOTMUCH_FEATURE_LAST_MOD)
 	/* sortable_serialise gives a reasonably compact encoding,
 	 * which directly translates to reduced IO when scanning the
 	 * value stream.  Since it's built for doubles, we only get 53
 	 * effective bits, but that's still enough for the database to
 	 * last a few centuries at 1 million revisions per second. */
-	message->doc.add_value (NOTMUCH_VALUE_LAST_MOD,
-				Xapian::sortable_serialise (
-				    _notmuch_database_new_revision (
-					message->notmuch)));
+	doc.add_value (NOTMUCH_VALUE_LAST_MOD,
+		       Xapian::sortable_serialise (
+			   _notmuch_database_new_revision (notmuch)));
+
+    /* Whatever changed, the thread's summary record is now stale. */
+    if (notmuch->features & NOTMUCH_FEATURE_THREAD_SUMMARIES) {
+	const char *thread_prefix = NOTMUCH_PREFIX_THREAD;
+	Xapian::TermIterator i = doc.termlist_begin ();
+
+	i.skip_to (thread_prefix);
+	if (i != doc.termlist_end () &&
+	    strncmp ((*i).c_str (), thread_prefix, strlen (thread_prefix)) == 0)
+	    _notmuch_database_invalidate_thread_summary (
+		notmuch, (*i).c_str () + strlen (thread_prefix));
+    }
+}
 
-    db = static_cast <Xapian::WritableDatabase *> (message->notmuch->xapian_db);
-    db->replace_document (message->doc_id, message->doc);
-    message->modified = FALSE;
+notmuch_bool_t
+_notmuch_database_change_document_tags (notmuch_database_t *notmuch,
+					unsigned int doc_id,
+					const std::set<std::string> &add_terms,
+					const std::set<std::string> &remove_terms,
+					notmuch_bool_t remove_all)
+{
+    Xapian::WritableDatabase *db;
+    Xapian::Document doc;
+    Xapian::TermIterator i, end;
+    const char *tag_prefix = NOTMUCH_PREFIX_TAG;
+    std::set<std::string> old_terms, new_terms;
+    std::set<std::string>::const_iterator t;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    doc = db->get_document (doc_id);
+
+    i = doc.termlist_begin ();
+    end = doc.termlist_end ();
+    for (i.skip_to (tag_prefix);
+	 i != end && strncmp ((*i).c_str (), tag_prefix, strlen (tag_prefix)) == 0;
+	 i++)
+	old_terms.insert (*i);
+
+    if (! remove_all)
+	new_terms = old_terms;
+    for (t = remove_terms.begin (); t != remove_terms.end (); t++)
+	new_terms.erase (*t);
+    new_terms.insert (add_terms.begin (), add_terms.end ());
+
+    if (new_terms == old_terms)
+	return FALSE;
+
+    for (t = old_terms.begin (); t != old_terms.end (); t++)
+	if (new_terms.find (*t) == new_terms.end ())
+	    doc.remove_term (*t);
+    for (t = new_terms.begin (); t != new_terms.end (); t++)
+	if (old_terms.find (*t) == old_terms.end ())
+	    doc.add_term (*t, 0);
+
+    _notmuch_database_touch_document (notmuch, doc);
+    db->replace_document (doc_id, doc);
+
+    return TRUE;
 }
 
-/* Delete a message document from the database, leaving a ghost
- * message in its place */
+/* Bring the ghosts of thread 'thread_id' up to date after the
+ * removal of the messages 'message_ids': if messages remain in the
+ * thread, leave a ghost for each removed one, so that the thread
+ * still gathers the replies to it; otherwise drop all the ghosts of
+ * the thread.  Removed messages that were added back meanwhile are
+ * left alone. */
 notmuch_status_t
-_notmuch_message_delete (notmuch_message_t *message)
+_notmuch_thread_reconcile_ghosts (notmuch_database_t *notmuch,
+				  const char *thread_id,
+				  const char **message_ids,
+				  unsigned int count)
 {
     notmuch_status_t status;
-    Xapian::WritableDatabase *db;
-    const char *mid, *tid, *query_string;
-    notmuch_message_t *ghost;
     notmuch_private_status_t private_status;
-    notmuch_database_t *notmuch;
+    notmuch_message_t *ghost;
     notmuch_query_t *query;
-    unsigned int count = 0;
-    notmuch_bool_t is_ghost;
-
-    mid = notmuch_message_get_message_id (message);
-    tid = notmuch_message_get_thread_id (message);
-    notmuch = message->notmuch;
-
-    status = _notmuch_database_ensure_writable (message->notmuch);
-    if (status)
-	return status;
-
-    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
-    db->delete_document (message->doc_id);
+    const char *query_string;
+    unsigned int i, remaining = 0;
 
-    /* if this was a ghost to begin with, we are done */
-    private_status = _notmuch_message_has_term (message, "type", "ghost", &is_ghost);
-    if (private_status)
-	return COERCE_STATUS (private_status,
-			      "Error trying to determine whether message was a ghost");
-    if (is_ghost)
-	return NOTMUCH_STATUS_SUCCESS;
-
-    query_string = talloc_asprintf (message, "thread:%s", tid);
+    query_string = talloc_asprintf (notmuch, "thread:%s", thread_id);
+    if (query_string == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
     query = notmuch_query_create (notmuch, query_string);
+    talloc_free ((char *) query_string);
     if (query == NULL)
 	return NOTMUCH_STATUS_OUT_OF_MEMORY;
-    status = notmuch_query_count_messages_st (query, &count);
+    status = notmuch_query_count_messages_st (query, &remaining);
     if (status) {
 	notmuch_query_destroy (query);
 	return status;
     }
 
-    if (count > 0) {
-	/* reintroduce a ghost in its place because there are still
-	 * other active messages in this thread: */
-	ghost = _notmuch_message_create_for_message_id (notmuch, mid, &private_status);
-	if (private_status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND) {
-	    private_status = _notmuch_message_initialize_ghost (ghost, tid);
-	    if (! private_status)
-		_notmuch_message_sync (ghost);
-	} else if (private_status == NOTMUCH_PRIVATE_STATUS_SUCCESS) {
-	    /* this is deeply weird, and we should not have gotten
-	       into this state.  is there a better error message to
-	       return here? */
-	    status = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
-	}
+    if (remaining > 0) {
+	/* reintroduce a ghost in place of each removed message because
+	 * there are still other active messages in this thread: */
+	for (i = 0; i < count && ! status; i++) {
+	    ghost = _notmuch_message_create_for_message_id (notmuch,
+							    message_ids[i],
+							    &private_status);
+	    if (private_status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND) {
+		private_status = _notmuch_message_initialize_ghost (ghost, thread_id);
+		if (! private_status)
+		    _notmuch_message_sync (ghost);
+	    }
 
-	notmuch_message_destroy (ghost);
-	status = COERCE_STATUS (private_status, "Error converting to ghost message");
+	    notmuch_message_destroy (ghost);
+	    status = COERCE_STATUS (private_status, "Error converting to ghost message");
+	}
     } else {
 	/* the thread is empty; drop all ghost messages from it */
 	notmuch_messages_t *messages;
@@ -1107,7 +1620,7 @@ _notmuch_message_delete (notmuch_message_t *message)
 	if (status == NOTMUCH_STATUS_SUCCESS) {
 	    notmuch_status_t last_error = NOTMUCH_STATUS_SUCCESS;
 	    while (notmuch_messages_valid (messages)) {
-		message = notmuch_messages_get (messages);
+		notmuch_message_t *message = notmuch_messages_get (messages);
 		status = _notmuch_message_delete (message);
 		if (status) /* we'll report the last failure we see;
 			     * if there is more than one failure, we
@@ -1123,6 +1636,61 @@ _notmuch_message_delete (notmuch_message_t *message)
     return status;
 }
 
+/* Delete a message document from the database, leaving a ghost
+ * message in its place.  Between notmuch_database_begin_removals and
+ * _end_removals, the ghosts of its thread are only brought up to
+ * date at the end, once for each thread. */
+notmuch_status_t
+_notmuch_message_delete (notmuch_message_t *message)
+{
+    notmuch_status_t status;
+    Xapian::WritableDatabase *db;
+    const char *mid, *tid;
+    notmuch_private_status_t private_status;
+    notmuch_database_t *notmuch;
+    notmuch_bool_t is_ghost;
+
+    mid = notmuch_message_get_message_id (message);
+    tid = notmuch_message_get_thread_id (message);
+    notmuch = message->notmuch;
+
+    status = _notmuch_database_ensure_writable (message->notmuch);
+    if (status)
+	return status;
+
+    _notmuch_database_invalidate_thread_summary (notmuch, tid);
+    _notmuch_database_forget_message_id (notmuch, mid);
+
+    /* The headers are only in the document about to go. */
+    if (! notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_GHOST))
+	_notmuch_database_update_contacts (
+	    notmuch,
+	    message->doc.get_value (NOTMUCH_VALUE_FROM).c_str (),
+	    message->doc.get_value (NOTMUCH_VALUE_TO).c_str (),
+	    message->doc.get_value (NOTMUCH_VALUE_CC).c_str (),
+	    message->doc.get_value (NOTMUCH_VALUE_BCC).c_str (),
+	    notmuch_message_get_date (message), -1);
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    db->delete_document (message->doc_id);
+
+    /* if this was a ghost to begin with, we are done */
+    private_status = _notmuch_message_has_term (message, "type", "ghost", &is_ghost);
+    if (private_status)
+	return COERCE_STATUS (private_status,
+			      "Error trying to determine whether message was a ghost");
+    if (is_ghost)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    if (notmuch->features & NOTMUCH_FEATURE_LAST_MOD)
+	_notmuch_database_add_tombstone (notmuch, mid, tid);
+
+    if (notmuch->removal_nesting)
+	return _notmuch_database_defer_ghost (notmuch, tid, mid);
+
+    return _notmuch_thread_reconcile_ghosts (notmuch, tid, &mid, 1);
+}
+
 /* Transform a blank message into a ghost message.  The caller must
  * _notmuch_message_sync the message. */
 notmuch_private_status_t
@@ -1180,9 +1748,14 @@ _notmuch_message_add_term (notmuch_message_t *message,
 
     message->doc.add_term (term, 0);
     message->modified = TRUE;
+    message->pending_bytes += strlen (term) + NOTMUCH_PENDING_TERM_BYTES;
 
     talloc_free (term);
 
+    if ((message->notmuch->features & NOTMUCH_FEATURE_THREAD_ID_VALUES) &&
+	strcmp ("thread", prefix_name) == 0)
+	message->doc.add_value (NOTMUCH_VALUE_THREAD_ID, value);
+
     _notmuch_message_invalidate_metadata (message, prefix_name);
 
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
@@ -1190,39 +1763,166 @@ _notmuch_message_add_term (notmuch_message_t *message,
 
 /* Parse 'text' and add a term to 'message' for each parsed word. Each
  * term will be added both prefixed (if prefix_name is not NULL) and
- * also non-prefixed). */
+ * also non-prefixed).
+ *
+ * The text is only parsed once: the prefixed terms are generated into
+ * a scratch document, and each is then added to 'message' both as is
+ * and with the prefix taken off, at the positions a second parse of
+ * the text would have given it.  Stemmed terms are "Z" followed by
+ * the prefix and the stem, so they lose the prefix after the "Z". */
 notmuch_private_status_t
 _notmuch_message_gen_terms (notmuch_message_t *message,
 			    const char *prefix_name,
 			    const char *text)
 {
-    Xapian::TermGenerator *term_gen = message->notmuch->term_gen;
+    Xapian::TermGenerator *term_gen =
+	_notmuch_database_get_term_gen (message->notmuch);
 
     if (text == NULL)
 	return NOTMUCH_PRIVATE_STATUS_NULL_POINTER;
 
-    term_gen->set_document (message->doc);
-
     if (prefix_name) {
 	const char *prefix = _find_prefix (prefix_name);
+	size_t prefix_length = strlen (prefix);
+	Xapian::Document scratch;
+	Xapian::TermIterator i, end;
+	Xapian::termcount shift;
 
+	term_gen->set_document (scratch);
 	term_gen->set_termpos (message->termpos);
 	term_gen->index_text (text, 1, prefix);
+
 	/* Create a gap between this an the next terms so they don't
-	 * appear to be a phrase. */
-	message->termpos = term_gen->get_termpos () + 100;
+	 * appear to be a phrase.  The unprefixed terms come after the
+	 * gap. */
+	shift = term_gen->get_termpos () + 100 - message->termpos;
+
+	end = scratch.termlist_end ();
+	for (i = scratch.termlist_begin (); i != end; i++) {
+	    const std::string &term = *i;
+	    std::string bare;
+	    Xapian::PositionIterator pos, pos_end;
+
+	    if (term[0] == 'Z')
+		bare = "Z" + term.substr (1 + prefix_length);
+	    else
+		bare = term.substr (prefix_length);
+
+	    message->pending_bytes += term.size () + bare.size () +
+		2 * NOTMUCH_PENDING_TERM_BYTES;
+
+	    pos_end = i.positionlist_end ();
+	    if (i.positionlist_begin () == pos_end) {
+		message->doc.add_term (term, i.get_wdf ());
+		message->doc.add_term (bare, i.get_wdf ());
+		continue;
+	    }
+	    for (pos = i.positionlist_begin (); pos != pos_end; pos++) {
+		message->doc.add_posting (term, *pos);
+		message->doc.add_posting (bare, *pos + shift);
+		message->pending_bytes += 2 * NOTMUCH_PENDING_POSITION_BYTES;
+	    }
+	}
+
+	/* And another gap after the unprefixed terms. */
+	message->termpos += 2 * shift;
 
 	_notmuch_message_invalidate_metadata (message, prefix_name);
+
+	return NOTMUCH_PRIVATE_STATUS_SUCCESS;
     }
 
+    term_gen->set_document (message->doc);
     term_gen->set_termpos (message->termpos);
     term_gen->index_text (text);
-    /* Create a term gap, as above. */
+    /* Create a term gap, as in the prefixed case. */
     message->termpos = term_gen->get_termpos () + 100;
+    message->pending_bytes += strlen (text) * NOTMUCH_PENDING_TEXT_FACTOR;
 
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
 }
 
+/* Add every term of 'detached', with its positions and frequency, to
+ * 'message', as if the terms had been generated for 'message' at its
+ * current term position.
+ *
+ * This change will not be reflected in the database until the next
+ * call to _notmuch_message_sync. */
+void
+_notmuch_message_merge_terms (notmuch_message_t *message,
+			      notmuch_message_t *detached)
+{
+    Xapian::TermIterator i, end;
+    std::string snippet;
+
+    end = detached->doc.termlist_end ();
+    for (i = detached->doc.termlist_begin (); i != end; i++) {
+	Xapian::PositionIterator pos, pos_end;
+
+	pos_end = i.positionlist_end ();
+	for (pos = i.positionlist_begin (); pos != pos_end; pos++)
+	    message->doc.add_posting (*i, *pos + message->termpos, 0);
+
+	message->doc.add_term (*i, i.get_wdf ());
+    }
+
+    message->termpos += detached->termpos;
+    message->modified = TRUE;
+    message->pending_bytes += detached->pending_bytes;
+
+    snippet = detached->doc.get_value (NOTMUCH_VALUE_SNIPPET);
+    if (! snippet.empty ())
+	message->doc.add_value (NOTMUCH_VALUE_SNIPPET, snippet);
+
+    /* Indexing adds tags such as "attachment" and "signed". */
+    _notmuch_message_invalidate_metadata (message, "tag");
+}
+
+void
+_notmuch_message_gen_terms_partial (notmuch_message_t *message,
+				    const char *text, size_t length,
+				    notmuch_bool_t last)
+{
+    Xapian::TermGenerator *term_gen =
+	_notmuch_database_get_term_gen (message->notmuch);
+
+    term_gen->set_document (message->doc);
+    message->pending_bytes += length * NOTMUCH_PENDING_TEXT_FACTOR;
+    if (message->notmuch->features & NOTMUCH_FEATURE_BODY_NO_POSITIONS) {
+	term_gen->index_text_without_positions (
+	    Xapian::Utf8Iterator (text, length));
+	return;
+    }
+
+    term_gen->set_termpos (message->termpos);
+    term_gen->index_text (Xapian::Utf8Iterator (text, length));
+    message->termpos = term_gen->get_termpos ();
+
+    /* Create a term gap, as in _notmuch_message_gen_terms. */
+    if (last)
+	message->termpos += 100;
+}
+
+void
+_notmuch_message_resume_termpos (notmuch_message_t *message)
+{
+    Xapian::TermIterator i, end;
+    Xapian::termpos last = 0;
+
+    end = message->doc.termlist_end ();
+    for (i = message->doc.termlist_begin (); i != end; i++) {
+	Xapian::PositionIterator pos, pos_end;
+
+	pos_end = i.positionlist_end ();
+	for (pos = i.positionlist_begin (); pos != pos_end; pos++)
+	    if (*pos > last)
+		last = *pos;
+    }
+
+    /* Leave the usual gap after the last term. */
+    message->termpos = last + 100;
+}
+
 /* Remove a name:value term from 'message', (the actual term will be
  * encoded by prefixing the value with a short prefix). See
  * NORMAL_PREFIX and BOOLEAN_PREFIX arrays for the mapping of term
@@ -1258,6 +1958,15 @@ _notmuch_message_remove_term (notmuch_message_t *message,
 
     talloc_free (term);
 
+    if (strcmp ("thread", prefix_name) == 0) {
+	/* The message is leaving this thread; _notmuch_message_sync
+	 * will only see the thread it joins. */
+	_notmuch_database_invalidate_thread_summary (message->notmuch, value);
+
+	if (message->notmuch->features & NOTMUCH_FEATURE_THREAD_ID_VALUES)
+	    message->doc.remove_value (NOTMUCH_VALUE_THREAD_ID);
+    }
+
     _notmuch_message_invalidate_metadata (message, prefix_name);
 
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
@@ -1326,6 +2035,61 @@ notmuch_message_add_tag (notmuch_message_t *message, const char *tag)
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+notmuch_status_t
+notmuch_message_add_extracted_text (notmuch_message_t *message,
+				    const char *text, size_t length)
+{
+    notmuch_status_t status;
+
+    status = _notmuch_database_ensure_writable (message->notmuch);
+    if (status)
+	return status;
+
+    if (text == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    try {
+	/* The text goes after all that the message has been indexed
+	 * with, so that no phrase spans the two. */
+	_notmuch_message_resume_termpos (message);
+	_notmuch_message_gen_terms_partial (message, text, length, TRUE);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (message->notmuch, "A Xapian exception occurred indexing extracted text: %s.\n",
+			       error.get_msg().c_str());
+	message->notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+    message->modified = TRUE;
+
+    if (! message->frozen)
+	_notmuch_message_sync (message);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_message_set_extraction_done (notmuch_message_t *message)
+{
+    notmuch_private_status_t private_status;
+    notmuch_status_t status;
+
+    status = _notmuch_database_ensure_writable (message->notmuch);
+    if (status)
+	return status;
+
+    private_status = _notmuch_message_remove_term (message, "pending",
+						   "extract");
+    if (private_status) {
+	INTERNAL_ERROR ("_notmuch_message_remove_term return unexpected value: %d\n",
+			private_status);
+    }
+
+    if (! message->frozen)
+	_notmuch_message_sync (message);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 notmuch_status_t
 notmuch_message_remove_tag (notmuch_message_t *message, const char *tag)
 {
@@ -1354,6 +2118,32 @@ notmuch_message_remove_tag (notmuch_message_t *message, const char *tag)
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+notmuch_status_t
+notmuch_message_journal_tag (notmuch_message_t *message, const char *tag,
+			     notmuch_bool_t add)
+{
+    notmuch_status_t status;
+
+    if (message->notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
+	return add ? notmuch_message_add_tag (message, tag) :
+	    notmuch_message_remove_tag (message, tag);
+
+    if (tag == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    if (strlen (tag) > NOTMUCH_TAG_MAX)
+	return NOTMUCH_STATUS_TAG_TOO_LONG;
+
+    status = _notmuch_database_journal_tag (
+	message->notmuch, notmuch_message_get_message_id (message), tag, add);
+    if (status)
+	return status;
+
+    _notmuch_message_invalidate_metadata (message, "tag");
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 /* Is the given filename within a maildir directory?
  *
  * Specifically, is the final directory component of 'filename' either
@@ -1418,9 +2208,14 @@ notmuch_message_maildir_flags_to_tags (notmuch_message_t *message)
 
 	flags = strstr (filename, ":2,");
 	if (flags) {
+	    const char *suffix = gz_filename_suffix (filename);
+
 	    seen_maildir_info = 1;
 	    flags += 3;
-	    combined_flags = talloc_strdup_append (combined_flags, flags);
+	    /* The flags of a compressed file come before its suffix. */
+	    combined_flags = talloc_strndup_append (
+		combined_flags, flags,
+		suffix && suffix >= flags ? suffix - flags : strlen (flags));
 	} else if (STRNCMP_LITERAL (dir, "new/") == 0) {
 	    /* Messages are delivered to new/ with no "info" part, but
 	     * they effectively have default maildir flags.  According
@@ -1528,7 +2323,8 @@ _get_maildir_flag_actions (notmuch_message_t *message,
  * single-character flags will be added or removed according to the
  * characters in flags_to_set and flags_to_clear. Any existing flags
  * not mentioned in either string will remain. The final list of flags
- * will be in ASCII order.
+ * will be in ASCII order.  The suffix of a compressed file (see
+ * gz_filename_suffix) stays at the end, after the flags.
  *
  * If the original flags seem invalid, (repeated characters or
  * non-ASCII ordering of flags), this function will return NULL
@@ -1540,7 +2336,7 @@ _new_maildir_filename (void *ctx,
 		       const char *flags_to_set,
 		       const char *flags_to_clear)
 {
-    const char *info, *flags;
+    const char *info, *flags, *end;
     unsigned int flag, last_flag;
     char *filename_new, *dir;
     char flag_map[128];
@@ -1551,14 +2347,18 @@ _new_maildir_filename (void *ctx,
 
     memset (flag_map, 0, sizeof (flag_map));
 
+    end = gz_filename_suffix (filename);
+    if (end == NULL)
+	end = filename + strlen (filename);
+
     info = strstr (filename, ":2,");
 
-    if (info == NULL) {
-	info = filename + strlen(filename);
+    if (info == NULL || info > end) {
+	info = end;
     } else {
 	/* Loop through existing flags in filename. */
 	for (flags = info + 3, last_flag = 0;
-	     *flags;
+	     flags < end;
 	     last_flag = flag, flags++)
 	{
 	    flag = *flags;
@@ -1602,12 +2402,13 @@ _new_maildir_filename (void *ctx,
     /* Messages in new/ without maildir info can be kept in new/ if no
      * flags have changed. */
     dir = (char *) _filename_is_in_maildir (filename);
-    if (dir && STRNCMP_LITERAL (dir, "new/") == 0 && !*info && !flags_changed)
+    if (dir && STRNCMP_LITERAL (dir, "new/") == 0 && info == end && !flags_changed)
 	return talloc_strdup (ctx, filename);
 
     filename_new = (char *) talloc_size (ctx,
 					 info - filename +
-					 strlen (":2,") + flags_in_map + 1);
+					 strlen (":2,") + flags_in_map +
+					 strlen (end) + 1);
     if (unlikely (filename_new == NULL))
 	return NULL;
 
@@ -1624,7 +2425,7 @@ _new_maildir_filename (void *ctx,
 	    s++;
 	}
     }
-    *s = '\0';
+    strcpy (s, end);
 
     /* If message is in new/ move it under cur/. */
     dir = (char *) _filename_is_in_maildir (filename_new);
@@ -1696,6 +2497,296 @@ notmuch_message_tags_to_maildir_flags (notmuch_message_t *message)
     return status;
 }
 
+/* notmuch_query_tags_to_maildir_flags plans the renames for this many
+ * messages at a time, carries them out, and then records them. */
+#define NOTMUCH_MAILDIR_SYNC_BATCH 1000
+
+typedef struct _notmuch_maildir_rename {
+    unsigned int doc_id;
+    char *filename;
+    char *filename_new;
+    /* The errno of the rename, or 0 if it succeeded. */
+    int error;
+} notmuch_maildir_rename_t;
+
+/* The renames of one batch.  Threads take the next pending rename
+ * until there are none left; they only make system calls, and never
+ * allocate. */
+typedef struct _notmuch_maildir_renames {
+    /* Owns the strings of the current batch. */
+    void *ctx;
+    notmuch_maildir_rename_t *renames;
+    size_t num_renames;
+    size_t size;
+    size_t next;
+#if HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} notmuch_maildir_renames_t;
+
+static void *
+_notmuch_maildir_rename_worker (void *closure)
+{
+    notmuch_maildir_renames_t *batch = (notmuch_maildir_renames_t *) closure;
+
+    for (;;) {
+	notmuch_maildir_rename_t *rename_op;
+
+#if HAVE_PTHREAD
+	pthread_mutex_lock (&batch->lock);
+#endif
+	rename_op = batch->next < batch->num_renames ?
+	    &batch->renames[batch->next++] : NULL;
+#if HAVE_PTHREAD
+	pthread_mutex_unlock (&batch->lock);
+#endif
+
+	if (rename_op == NULL)
+	    break;
+
+	if (rename (rename_op->filename, rename_op->filename_new))
+	    rename_op->error = errno;
+	else
+	    rename_op->error = 0;
+    }
+
+    return NULL;
+}
+
+/* Carry out the renames of 'batch' with up to 'jobs' threads. */
+static void
+_notmuch_maildir_renames_run (notmuch_maildir_renames_t *batch,
+			      unsigned int jobs)
+{
+#if HAVE_PTHREAD
+    pthread_t *threads = NULL;
+    unsigned int i, num_threads = 0;
+
+    if (jobs > batch->num_renames)
+	jobs = batch->num_renames;
+
+    pthread_mutex_init (&batch->lock, NULL);
+
+    /* The calling thread is a worker too. */
+    if (jobs > 1)
+	threads = talloc_array (batch->ctx, pthread_t, jobs - 1);
+    for (i = 0; threads && i < jobs - 1; i++) {
+	if (pthread_create (&threads[num_threads], NULL,
+			    _notmuch_maildir_rename_worker, batch))
+	    break;
+	num_threads++;
+    }
+#endif
+
+    batch->next = 0;
+    _notmuch_maildir_rename_worker (batch);
+
+#if HAVE_PTHREAD
+    for (i = 0; i < num_threads; i++)
+	pthread_join (threads[i], NULL);
+    talloc_free (threads);
+
+    pthread_mutex_destroy (&batch->lock);
+#else
+    (void) jobs;
+#endif
+}
+
+/* Record the successful renames of 'batch' in the database, in one
+ * atomic section.  The renames are grouped by message. */
+static notmuch_status_t
+_notmuch_maildir_renames_record (notmuch_database_t *notmuch,
+				 notmuch_maildir_renames_t *batch)
+{
+    notmuch_message_t *message = NULL;
+    notmuch_private_status_t private_status;
+    notmuch_status_t status, new_status;
+    size_t i;
+
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status)
+	return status;
+
+    for (i = 0; i < batch->num_renames; i++) {
+	notmuch_maildir_rename_t *rename_op = &batch->renames[i];
+
+	if (rename_op->error)
+	    continue;
+
+	if (message == NULL || message->doc_id != rename_op->doc_id) {
+	    if (message) {
+		_notmuch_message_sync (message);
+		notmuch_message_destroy (message);
+	    }
+	    message = _notmuch_message_create (batch->ctx, notmuch,
+					       rename_op->doc_id,
+					       &private_status);
+	    if (message == NULL) {
+		if (! status)
+		    status = COERCE_STATUS (private_status,
+					    "Failed to find a renamed message");
+		continue;
+	    }
+	}
+
+	new_status = _notmuch_message_remove_filename (message,
+						       rename_op->filename);
+	/* Hold on to only the first error. */
+	if (! status && new_status
+	    && new_status != NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) {
+	    status = new_status;
+	    continue;
+	}
+
+	new_status = _notmuch_message_add_filename (message,
+						    rename_op->filename_new);
+	/* Hold on to only the first error. */
+	if (! status && new_status)
+	    status = new_status;
+    }
+
+    if (message) {
+	_notmuch_message_sync (message);
+	notmuch_message_destroy (message);
+    }
+
+    new_status = notmuch_database_end_atomic (notmuch);
+    return status ? status : new_status;
+}
+
+/* Add the renames 'message' needs to 'batch'. */
+static notmuch_status_t
+_notmuch_maildir_renames_plan (notmuch_maildir_renames_t *batch,
+			       notmuch_message_t *message)
+{
+    notmuch_filenames_t *filenames;
+    char *to_set, *to_clear;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+
+    _get_maildir_flag_actions (message, &to_set, &to_clear);
+
+    for (filenames = notmuch_message_get_filenames (message);
+	 notmuch_filenames_valid (filenames);
+	 notmuch_filenames_move_to_next (filenames))
+    {
+	const char *filename = notmuch_filenames_get (filenames);
+	notmuch_maildir_rename_t *rename_op;
+	char *filename_new;
+
+	if (! _filename_is_in_maildir (filename))
+	    continue;
+
+	filename_new = _new_maildir_filename (batch->ctx, filename,
+					      to_set, to_clear);
+	if (filename_new == NULL)
+	    continue;
+
+	if (strcmp (filename, filename_new) == 0) {
+	    talloc_free (filename_new);
+	    continue;
+	}
+
+	if (batch->num_renames == batch->size) {
+	    batch->size *= 2;
+	    batch->renames = talloc_realloc (NULL, batch->renames,
+					     notmuch_maildir_rename_t,
+					     batch->size);
+	    if (unlikely (batch->renames == NULL)) {
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		break;
+	    }
+	}
+
+	rename_op = &batch->renames[batch->num_renames++];
+	rename_op->doc_id = message->doc_id;
+	rename_op->filename = talloc_strdup (batch->ctx, filename);
+	rename_op->filename_new = filename_new;
+	rename_op->error = 0;
+	if (unlikely (rename_op->filename == NULL)) {
+	    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    break;
+	}
+    }
+
+    talloc_free (to_set);
+    talloc_free (to_clear);
+
+    return status;
+}
+
+static notmuch_status_t
+_notmuch_maildir_renames_flush (notmuch_database_t *notmuch,
+				notmuch_maildir_renames_t *batch,
+				unsigned int jobs)
+{
+    notmuch_status_t status;
+
+    if (batch->num_renames == 0)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    _notmuch_maildir_renames_run (batch, jobs);
+    status = _notmuch_maildir_renames_record (notmuch, batch);
+
+    talloc_free (batch->ctx);
+    batch->ctx = talloc_new (NULL);
+    batch->num_renames = 0;
+    if (unlikely (batch->ctx == NULL) && ! status)
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    return status;
+}
+
+notmuch_status_t
+notmuch_query_tags_to_maildir_flags (notmuch_query_t *query,
+				     unsigned int jobs)
+{
+    notmuch_database_t *notmuch = notmuch_query_get_database (query);
+    notmuch_maildir_renames_t batch;
+    notmuch_messages_t *messages;
+    notmuch_message_t *message;
+    notmuch_status_t status, new_status;
+    unsigned int num_messages = 0;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    status = notmuch_query_search_messages_st (query, &messages);
+    if (status)
+	return status;
+
+    batch.size = NOTMUCH_MAILDIR_SYNC_BATCH;
+    batch.num_renames = 0;
+    batch.ctx = talloc_new (NULL);
+    batch.renames = talloc_array (NULL, notmuch_maildir_rename_t, batch.size);
+    if (unlikely (batch.ctx == NULL || batch.renames == NULL)) {
+	talloc_free (batch.ctx);
+	talloc_free (batch.renames);
+	notmuch_messages_destroy (messages);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    for (;
+	 notmuch_messages_valid (messages) && ! status;
+	 notmuch_messages_move_to_next (messages)) {
+	message = notmuch_messages_get (messages);
+	status = _notmuch_maildir_renames_plan (&batch, message);
+	notmuch_message_destroy (message);
+
+	if (! status && ++num_messages % NOTMUCH_MAILDIR_SYNC_BATCH == 0)
+	    status = _notmuch_maildir_renames_flush (notmuch, &batch, jobs);
+    }
+
+    /* Files already renamed must be recorded, whatever else failed. */
+    new_status = _notmuch_maildir_renames_flush (notmuch, &batch, jobs);
+
+    notmuch_messages_destroy (messages);
+    talloc_free (batch.ctx);
+    talloc_free (batch.renames);
+
+    return status ? status : new_status;
+}
+
 notmuch_status_t
 notmuch_message_remove_all_tags (notmuch_message_t *message)
 {
@@ -20,8 +20,6 @@
 
 #include "notmuch-private.h"
 
-#include <glib.h>
-
 /* Create a new notmuch_message_list_t object, with 'ctx' as its
  * talloc owner.
  *
@@ -70,6 +68,7 @@ _notmuch_messages_create (notmuch_message_list_t *list)
 
     messages->is_of_list_type = TRUE;
     messages->iterator = list->head;
+    messages->columns_ctx = NULL;
 
     return messages;
 }
@@ -127,6 +126,90 @@ notmuch_messages_move_to_next (notmuch_messages_t *messages)
     messages->iterator = messages->iterator->next;
 }
 
+/* Fill in the columns of 'message' at 'i', with strings talloc'ed
+ * under 'ctx'. */
+static notmuch_status_t
+_notmuch_message_get_columns (void *ctx, notmuch_message_t *message,
+			      notmuch_message_columns_t *columns,
+			      unsigned int i)
+{
+    if (columns->message_ids) {
+	columns->message_ids[i] = talloc_strdup (
+	    ctx, notmuch_message_get_message_id (message));
+	if (unlikely (columns->message_ids[i] == NULL))
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    if (columns->thread_ids) {
+	columns->thread_ids[i] = talloc_strdup (
+	    ctx, notmuch_message_get_thread_id (message));
+	if (unlikely (columns->thread_ids[i] == NULL))
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    if (columns->dates)
+	columns->dates[i] = notmuch_message_get_date (message);
+
+    if (columns->tags) {
+	notmuch_tags_t *tags;
+	const char **array;
+	unsigned int n = 0;
+
+	array = talloc_array (ctx, const char *, 1);
+	for (tags = notmuch_message_get_tags (message);
+	     array && notmuch_tags_valid (tags);
+	     notmuch_tags_move_to_next (tags)) {
+	    array = talloc_realloc (ctx, array, const char *, n + 2);
+	    if (array)
+		array[n++] = talloc_strdup (array, notmuch_tags_get (tags));
+	}
+	notmuch_tags_destroy (tags);
+	if (unlikely (array == NULL))
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	array[n] = NULL;
+	columns->tags[i] = array;
+    }
+
+    if (columns->excluded)
+	columns->excluded[i] = notmuch_message_get_flag (
+	    message, NOTMUCH_MESSAGE_FLAG_EXCLUDED);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_messages_get_columns (notmuch_messages_t *messages,
+			      notmuch_message_columns_t *columns,
+			      unsigned int count,
+			      unsigned int *filled)
+{
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    unsigned int i;
+
+    *filled = 0;
+
+    talloc_free (messages->columns_ctx);
+    messages->columns_ctx = talloc_new (messages);
+    if (unlikely (messages->columns_ctx == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    if (! messages->is_of_list_type)
+	return _notmuch_mset_messages_get_columns (messages, columns,
+						   count, filled);
+
+    for (i = 0; i < count && messages->iterator; i++) {
+	status = _notmuch_message_get_columns (messages->columns_ctx,
+					       messages->iterator->message,
+					       columns, i);
+	if (status)
+	    break;
+	messages->iterator = messages->iterator->next;
+	(*filled)++;
+    }
+
+    return status;
+}
+
 void
 notmuch_messages_destroy (notmuch_messages_t *messages)
 {
@@ -138,36 +221,29 @@ notmuch_tags_t *
 notmuch_messages_collect_tags (notmuch_messages_t *messages)
 {
     notmuch_string_list_t *tags;
-    notmuch_tags_t *msg_tags;
+    notmuch_database_t *notmuch = NULL;
+    notmuch_tag_set_t *set;
+    const notmuch_tag_set_t *msg_tags;
     notmuch_message_t *msg;
-    GHashTable *htable;
-    GList *keys, *l;
-    const char *tag;
 
-    tags = _notmuch_string_list_create (messages);
-    if (tags == NULL) return NULL;
-
-    htable = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+    set = _notmuch_tag_set_create (messages);
+    if (set == NULL) return NULL;
 
     while ((msg = notmuch_messages_get (messages))) {
-	msg_tags = notmuch_message_get_tags (msg);
-	while ((tag = notmuch_tags_get (msg_tags))) {
-	    g_hash_table_insert (htable, xstrdup (tag), NULL);
-	    notmuch_tags_move_to_next (msg_tags);
-	}
-	notmuch_tags_destroy (msg_tags);
+	notmuch = _notmuch_message_database (msg);
+	msg_tags = _notmuch_message_get_tag_set (msg);
+	if (msg_tags)
+	    _notmuch_tag_set_union (set, msg_tags);
 	notmuch_message_destroy (msg);
 	notmuch_messages_move_to_next (messages);
     }
 
-    keys = g_hash_table_get_keys (htable);
-    for (l = keys; l; l = l->next) {
-	_notmuch_string_list_append (tags, (char *)l->data);
-    }
-
-    g_list_free (keys);
-    g_hash_table_destroy (htable);
+    if (notmuch)
+	tags = _notmuch_tag_set_to_string_list (messages, notmuch, set);
+    else
+	tags = _notmuch_string_list_create (messages);
+    talloc_free (set);
+    if (tags == NULL) return NULL;
 
-    _notmuch_string_list_sort (tags);
     return _notmuch_tags_create (messages, tags);
 }
@@ -42,6 +42,7 @@ NOTMUCH_BEGIN_DECLS
 #include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <time.h>
 #include <assert.h>
 
 #include <talloc.h>
@@ -51,6 +52,7 @@ NOTMUCH_BEGIN_DECLS
 #include "xutil.h"
 #include "error_util.h"
 #include "string-util.h"
+#include "hex-escape.h"
 
 #pragma GCC visibility push(hidden)
 
@@ -104,12 +106,56 @@ NOTMUCH_BEGIN_DECLS
 #endif
 #endif
 
+/* Static tracepoints, compiled in with ./configure --with-tracepoints
+ * and to nothing otherwise.  The probes are in the "notmuch" provider:
+ *
+ *   query_start (query string, document type)
+ *   query_done (query string, estimated matches, or -1 on error)
+ *   thread_start (seed document ID)
+ *   thread_done (thread ID or NULL on error, number of messages)
+ *   message_add_start (file name)
+ *   message_add_done (file name, notmuch_status_t)
+ *   message_remove_start (file name)
+ *   message_remove_done (file name, notmuch_status_t)
+ *   atomic_begin (nesting level before the call)
+ *   atomic_end (nesting level before the call)
+ *   flush_start ()
+ *   flush_done (notmuch_status_t)
+ *
+ * For example, a histogram of query latencies:
+ *
+ *   bpftrace -e 'usdt:lib/libnotmuch.so:notmuch:query_start
+ *                { @start[tid] = nsecs; }
+ *                usdt:lib/libnotmuch.so:notmuch:query_done /@start[tid]/
+ *                { @us = hist ((nsecs - @start[tid]) / 1000);
+ *                  delete (@start[tid]); }'
+ */
+#if HAVE_SDT
+#include <sys/sdt.h>
+#define NOTMUCH_TRACE(probe) DTRACE_PROBE (notmuch, probe)
+#define NOTMUCH_TRACE1(probe, a) DTRACE_PROBE1 (notmuch, probe, a)
+#define NOTMUCH_TRACE2(probe, a, b) DTRACE_PROBE2 (notmuch, probe, a, b)
+#else
+#define NOTMUCH_TRACE(probe) do { } while (0)
+#define NOTMUCH_TRACE1(probe, a) do { } while (0)
+#define NOTMUCH_TRACE2(probe, a, b) do { } while (0)
+#endif
+
 typedef enum {
     NOTMUCH_VALUE_TIMESTAMP = 0,
     NOTMUCH_VALUE_MESSAGE_ID,
     NOTMUCH_VALUE_FROM,
     NOTMUCH_VALUE_SUBJECT,
     NOTMUCH_VALUE_LAST_MOD,
+    NOTMUCH_VALUE_THREAD_ID,
+    NOTMUCH_VALUE_TO,
+    NOTMUCH_VALUE_CC,
+    NOTMUCH_VALUE_BCC,
+    NOTMUCH_VALUE_HEADERS,
+    NOTMUCH_VALUE_PARENT,
+    NOTMUCH_VALUE_SNIPPET,
+    NOTMUCH_VALUE_MTIME_NSEC,
+    NOTMUCH_VALUE_MANIFEST,
 } notmuch_value_t;
 
 /* Xapian (with flint backend) complains if we provide a term longer
@@ -119,6 +165,24 @@ typedef enum {
 
 #define NOTMUCH_METADATA_THREAD_ID_PREFIX "thread_id_"
 
+#define NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX "thread_summary_"
+
+#define NOTMUCH_METADATA_THREAD_ALIAS_PREFIX "thread_alias_"
+
+#define NOTMUCH_METADATA_TOMBSTONE_PREFIX "tombstone_"
+
+#define NOTMUCH_METADATA_CONTACT_PREFIX "contact_"
+
+#define NOTMUCH_METADATA_LAST_TOMBSTONE "last_tombstone"
+
+#define NOTMUCH_METADATA_UPGRADE_CURSOR "upgrade_cursor"
+
+#define NOTMUCH_METADATA_TAG_JOURNAL_SEQUENCE "tag_journal_sequence"
+
+/* Declared ahead of string-list.c below, for the many users of
+ * string lists. */
+typedef struct _notmuch_string_list notmuch_string_list_t;
+
 /* For message IDs we have to be even more restrictive. Beyond fitting
  * into the term limit, we also use message IDs to construct
  * metadata-key values. And the documentation says that these should
@@ -176,9 +240,33 @@ typedef enum _notmuch_find_flags {
 
 typedef struct _notmuch_doc_id_set notmuch_doc_id_set_t;
 
+typedef struct _notmuch_tag_set notmuch_tag_set_t;
+
 /* database.cc */
 
-/* Lookup a prefix value by name.
+/* The term prefixes, by name (see the prefix tables in database.cc).
+ * Code that knows the name of the prefix it needs uses these, so
+ * that no lookup is needed. */
+#define NOTMUCH_PREFIX_TYPE             "T"
+#define NOTMUCH_PREFIX_REFERENCE        "XREFERENCE"
+#define NOTMUCH_PREFIX_REPLYTO          "XREPLYTO"
+#define NOTMUCH_PREFIX_DIRECTORY        "XDIRECTORY"
+#define NOTMUCH_PREFIX_FILE_DIRENTRY    "XFDIRENTRY"
+#define NOTMUCH_PREFIX_DIRECTORY_DIRENTRY "XDDIRENTRY"
+#define NOTMUCH_PREFIX_PENDING          "XPENDING"
+#define NOTMUCH_PREFIX_THREAD           "G"
+#define NOTMUCH_PREFIX_TAG              "K"
+#define NOTMUCH_PREFIX_IS               "K"
+#define NOTMUCH_PREFIX_ID               "Q"
+#define NOTMUCH_PREFIX_PATH             "P"
+#define NOTMUCH_PREFIX_FOLDER           "XFOLDER:"
+#define NOTMUCH_PREFIX_FROM             "XFROM"
+#define NOTMUCH_PREFIX_TO               "XTO"
+#define NOTMUCH_PREFIX_ATTACHMENT       "XATTACHMENT"
+#define NOTMUCH_PREFIX_MIMETYPE         "XMIMETYPE"
+#define NOTMUCH_PREFIX_SUBJECT          "XSUBJECT"
+
+/* Lookup a prefix value by name, for callers given the name.
  *
  * XXX: This should really be static inside of message.cc, and we can
  * do that once we convert database.cc to use the
@@ -199,6 +287,41 @@ _notmuch_database_log (notmuch_database_t *notmuch,
 unsigned long
 _notmuch_database_new_revision (notmuch_database_t *notmuch);
 
+/* Called on a Xapian::DatabaseModifiedError: bring the read-only
+ * 'notmuch' up to the latest revision, so that the read can be tried
+ * again.  '*attempts' counts the retries of one read, starting from
+ * 0; return FALSE once it has been retried enough, for a writable
+ * database, or if the database cannot be reopened. */
+notmuch_bool_t
+_notmuch_database_reopen_modified (notmuch_database_t *notmuch,
+				   unsigned int *attempts);
+
+/* Discard the summary record of 'thread_id', which is about to
+ * change, and remember to write it again when the database is
+ * closed. */
+void
+_notmuch_database_invalidate_thread_summary (notmuch_database_t *notmuch,
+					     const char *thread_id);
+
+/* Set '*tags' to the sorted list of all tags in the database, which
+ * belongs to the database and is valid until it next changes. */
+notmuch_status_t
+_notmuch_database_get_tag_catalogue_list (notmuch_database_t *notmuch,
+					  notmuch_string_list_t **tags);
+
+/* Forget the cached document of 'message_id', which was removed. */
+void
+_notmuch_database_forget_message_id (notmuch_database_t *notmuch,
+				     const char *message_id);
+
+/* Remember that 'message_id' was removed from 'thread_id', to bring
+ * the ghosts of the thread up to date at the end of the removals (see
+ * notmuch_database_begin_removals). */
+notmuch_status_t
+_notmuch_database_defer_ghost (notmuch_database_t *notmuch,
+			       const char *thread_id,
+			       const char *message_id);
+
 const char *
 _notmuch_database_relative_path (notmuch_database_t *notmuch,
 				 const char *path);
@@ -232,6 +355,10 @@ _notmuch_database_get_directory_path (void *ctx,
 				      notmuch_database_t *notmuch,
 				      unsigned int doc_id);
 
+void
+_notmuch_database_forget_directory_path (notmuch_database_t *notmuch,
+					 unsigned int doc_id);
+
 notmuch_status_t
 _notmuch_database_filename_to_direntry (void *ctx,
 					notmuch_database_t *notmuch,
@@ -250,6 +377,16 @@ _notmuch_directory_create (notmuch_database_t *notmuch,
 unsigned int
 _notmuch_directory_get_document_id (notmuch_directory_t *directory);
 
+/* With NOTMUCH_FEATURE_SUBTREE_PATHS, return 'query_string' with
+ * each recursive path: term replaced by a disjunction of the path:
+ * terms of its directory and every directory below it.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+const char *
+_notmuch_database_expand_path_subtrees (notmuch_database_t *notmuch,
+					void *ctx,
+					const char *query_string);
+
 /* message.cc */
 
 notmuch_message_t *
@@ -266,9 +403,54 @@ _notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
 unsigned int
 _notmuch_message_get_doc_id (notmuch_message_t *message);
 
+unsigned long
+_notmuch_message_get_revision (notmuch_message_t *message);
+
 const char *
 _notmuch_message_get_in_reply_to (notmuch_message_t *message);
 
+unsigned int
+_notmuch_message_get_parent_doc_id (notmuch_message_t *message);
+
+/* Return the tags of 'message' as a set, or NULL on out-of-memory.
+ * The set belongs to the message, and is only valid until its tags
+ * change. */
+const notmuch_tag_set_t *
+_notmuch_message_get_tag_set (notmuch_message_t *message);
+
+void
+_notmuch_message_set_parent_doc_id (notmuch_message_t *message,
+				    unsigned int doc_id);
+
+/* Message fields with no public accessor, to go with the
+ * notmuch_field_t values. */
+#define NOTMUCH_FIELD_IN_REPLY_TO (1 << 16)
+#define NOTMUCH_FIELD_TYPE (1 << 17)
+
+/* Create a message that belongs to no database document, for
+ * _notmuch_message_index_file to generate terms into. */
+notmuch_message_t *
+_notmuch_message_create_detached (const void *talloc_owner,
+				  notmuch_database_t *notmuch);
+
+/* Add the terms generated into 'detached' (see
+ * _notmuch_message_create_detached) to 'message', along with its
+ * body snippet. */
+void
+_notmuch_message_merge_terms (notmuch_message_t *message,
+			      notmuch_message_t *detached);
+
+/* Set the term position from which terms are next generated for
+ * 'message' to just past every position its document already uses. */
+void
+_notmuch_message_resume_termpos (notmuch_message_t *message);
+
+/* Set the notmuch_field_t values decoded along with whichever field
+ * of 'message' is first accessed (see notmuch_query_set_fields). */
+void
+_notmuch_message_set_fields (notmuch_message_t *message,
+			     unsigned int fields);
+
 notmuch_private_status_t
 _notmuch_message_add_term (notmuch_message_t *message,
 			   const char *prefix_name,
@@ -290,6 +472,14 @@ _notmuch_message_gen_terms (notmuch_message_t *message,
 			    const char *prefix_name,
 			    const char *text);
 
+/* Like _notmuch_message_gen_terms with no prefix, for text supplied
+ * in pieces split between words.  Each piece continues the phrase of
+ * the previous one, and the piece with 'last' set ends it. */
+void
+_notmuch_message_gen_terms_partial (notmuch_message_t *message,
+				    const char *text, size_t length,
+				    notmuch_bool_t last);
+
 void
 _notmuch_message_upgrade_filename_storage (notmuch_message_t *message);
 
@@ -317,15 +507,46 @@ _notmuch_message_set_header_values (notmuch_message_t *message,
 				    const char *from,
 				    const char *subject);
 
+void
+_notmuch_message_set_recipient_values (notmuch_message_t *message,
+				       const char *to,
+				       const char *cc,
+				       const char *bcc);
+
+void
+_notmuch_message_set_header_record (notmuch_message_t *message,
+				    const char *record,
+				    size_t length);
+
+/* Store a snippet of the body text starting with the 'length' bytes
+ * of UTF-8 at 'text', unless the database stores no snippets or
+ * 'message' has one already. */
+void
+_notmuch_message_set_snippet (notmuch_message_t *message,
+			      const char *text,
+			      size_t length);
+
 void
 _notmuch_message_upgrade_last_mod (notmuch_message_t *message);
 
+void
+_notmuch_message_upgrade_recipients (notmuch_message_t *message);
+
+void
+_notmuch_message_upgrade_subtree_paths (notmuch_message_t *message);
+
 void
 _notmuch_message_sync (notmuch_message_t *message);
 
 notmuch_status_t
 _notmuch_message_delete (notmuch_message_t *message);
 
+notmuch_status_t
+_notmuch_thread_reconcile_ghosts (notmuch_database_t *notmuch,
+				  const char *thread_id,
+				  const char **message_ids,
+				  unsigned int count);
+
 notmuch_private_status_t
 _notmuch_message_initialize_ghost (notmuch_message_t *message,
 				   const char *thread_id);
@@ -393,6 +614,19 @@ _notmuch_message_file_close (notmuch_message_file_t *message);
 notmuch_status_t
 _notmuch_message_file_parse (notmuch_message_file_t *message);
 
+/* Parse just the header block of the message, which is all that
+ * _notmuch_message_file_get_header needs.  A later
+ * _notmuch_message_file_parse will parse the whole message. */
+notmuch_status_t
+_notmuch_message_file_parse_headers (notmuch_message_file_t *message);
+
+/* Like _notmuch_message_file_get_mime_message, but the message may
+ * have been parsed from the header block alone, and so have no
+ * body. */
+notmuch_status_t
+_notmuch_message_file_get_header_message (notmuch_message_file_t *message,
+					  GMimeMessage **mime_message);
+
 /* Get the gmime message of a message file.
  *
  * The message file is parsed as necessary.
@@ -432,6 +666,17 @@ notmuch_status_t
 _notmuch_message_index_file (notmuch_message_t *message,
 			     notmuch_message_file_t *message_file);
 
+/* The two halves of _notmuch_message_index_file: the sender,
+ * recipients and subject, which need only the header block, and the
+ * MIME structure and text of the body. */
+notmuch_status_t
+_notmuch_message_index_headers (notmuch_message_t *message,
+				notmuch_message_file_t *message_file);
+
+notmuch_status_t
+_notmuch_message_index_body (notmuch_message_t *message,
+			     notmuch_message_file_t *message_file);
+
 /* messages.c */
 
 typedef struct _notmuch_message_node {
@@ -450,8 +695,10 @@ typedef struct _notmuch_message_list {
  */
 struct visible _notmuch_messages {
     notmuch_bool_t is_of_list_type;
-    notmuch_doc_id_set_t *excluded_doc_ids;
     notmuch_message_node_t *iterator;
+    /* The strings of the last notmuch_messages_get_columns, or
+     * NULL. */
+    void *columns_ctx;
 };
 
 notmuch_message_list_t *
@@ -475,6 +722,12 @@ _notmuch_mset_messages_get (notmuch_messages_t *messages);
 void
 _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages);
 
+notmuch_status_t
+_notmuch_mset_messages_get_columns (notmuch_messages_t *messages,
+				    notmuch_message_columns_t *columns,
+				    unsigned int count,
+				    unsigned int *filled);
+
 notmuch_bool_t
 _notmuch_doc_id_set_contains (notmuch_doc_id_set_t *doc_ids,
                               unsigned int doc_id);
@@ -483,17 +736,230 @@ void
 _notmuch_doc_id_set_remove (notmuch_doc_id_set_t *doc_ids,
                             unsigned int doc_id);
 
+/* Return a copy of 'query' for 'notmuch', another handle on the same
+ * database, with its sort, excludes, window and deadline, but not its
+ * cancellation flag. */
+notmuch_query_t *
+_notmuch_query_copy (notmuch_database_t *notmuch, notmuch_query_t *query);
+
 /* querying xapian documents by type (e.g. "mail" or "ghost"): */
 notmuch_status_t
 _notmuch_query_search_documents (notmuch_query_t *query,
 				 const char *type,
 				 notmuch_messages_t **out);
 
+/* Like _notmuch_query_search_documents, but return only the results
+ * starting at 'offset', and at most 'limit' of them (no limit if
+ * 'limit' is negative). */
+notmuch_status_t
+_notmuch_query_search_documents_window (notmuch_query_t *query,
+					const char *type,
+					unsigned int offset,
+					int limit,
+					notmuch_messages_t **out);
+
 notmuch_status_t
 _notmuch_query_count_documents (notmuch_query_t *query,
 				const char *type,
 				unsigned *count_out);
 
+/* query-cache.cc */
+
+typedef struct _notmuch_query_cache notmuch_query_cache_t;
+
+/* exclude-cache.cc */
+
+typedef struct _notmuch_exclude_cache notmuch_exclude_cache_t;
+
+/* Look up the count cached under 'key'.  Returns FALSE if there is
+ * none, or if the cache is disabled. */
+notmuch_bool_t
+_notmuch_query_cache_lookup (notmuch_database_t *notmuch,
+			     const char *key,
+			     unsigned int *count_out);
+
+void
+_notmuch_query_cache_store (notmuch_database_t *notmuch,
+			    const char *key,
+			    unsigned int count);
+
+void
+_notmuch_query_cache_flush (notmuch_database_t *notmuch);
+
+/* message-id-filter.cc */
+
+typedef struct _notmuch_message_id_filter notmuch_message_id_filter_t;
+
+/* Note the state of the newly opened database, against which a
+ * saved filter is checked. */
+void
+_notmuch_database_open_message_id_filter (notmuch_database_t *notmuch);
+
+/* Return FALSE if no document has 'message_id'.  TRUE means only
+ * that one may. */
+notmuch_bool_t
+_notmuch_database_may_have_message_id (notmuch_database_t *notmuch,
+				       const char *message_id);
+
+/* Note that a document with 'message_id' is being created. */
+void
+_notmuch_database_add_message_id (notmuch_database_t *notmuch,
+				  const char *message_id);
+
+void
+_notmuch_database_flush_message_id_filter (notmuch_database_t *notmuch);
+
+/* Note that a document estimated to need 'bytes' of memory in Xapian
+ * has been written.  notmuch_database_end_atomic flushes the changes
+ * once the estimate for all of them reaches the budget set with
+ * notmuch_database_set_flush_budget. */
+void
+_notmuch_database_add_pending (notmuch_database_t *notmuch, size_t bytes);
+
+/* thread-alias.cc */
+
+notmuch_bool_t
+_notmuch_database_has_thread_aliases (notmuch_database_t *notmuch);
+
+/* Return the ID of the thread that 'thread_id' was merged into, or
+ * 'thread_id' itself.  The result is valid until the next merge. */
+const char *
+_notmuch_database_resolve_thread_id (notmuch_database_t *notmuch,
+				     const char *thread_id);
+
+/* Return the other IDs that resolve to 'thread_id', or NULL if there
+ * are none. */
+notmuch_string_list_t *
+_notmuch_database_get_thread_aliases (notmuch_database_t *notmuch,
+				      void *ctx,
+				      const char *thread_id);
+
+/* Merge the thread of 'loser_thread_id' into that of
+ * 'winner_thread_id' without touching their messages. */
+notmuch_status_t
+_notmuch_database_alias_thread (notmuch_database_t *notmuch,
+				const char *winner_thread_id,
+				const char *loser_thread_id);
+
+/* Drop the alias of 'loser_thread_id' once no message uses it. */
+void
+_notmuch_database_forget_thread_alias (notmuch_database_t *notmuch,
+				       const char *loser_thread_id);
+
+/* Return 'query_string' with each thread: term replaced by a
+ * disjunction of all the IDs of its thread. */
+const char *
+_notmuch_database_expand_thread_aliases (notmuch_database_t *notmuch,
+					 void *ctx,
+					 const char *query_string);
+
+/* replicate.cc */
+
+/* Is the Xapian database at 'xapian_path' a replica? */
+notmuch_bool_t
+_notmuch_xapian_path_is_replica (const char *xapian_path);
+
+/* tag-journal.cc */
+
+typedef struct _notmuch_tag_journal notmuch_tag_journal_t;
+
+/* Read the entries of the tag journal that the newly opened (or
+ * reopened) read-only database does not hold yet. */
+void
+_notmuch_database_load_tag_journal (notmuch_database_t *notmuch);
+
+/* Apply the tag journal to the newly opened writable database, and
+ * empty it. */
+notmuch_status_t
+_notmuch_database_fold_tag_journal (notmuch_database_t *notmuch);
+
+/* TRUE if the tag journal changes tags that the database does not
+ * have yet. */
+notmuch_bool_t
+_notmuch_database_has_tag_journal (notmuch_database_t *notmuch);
+
+/* Queue the change of 'tag' of 'message_id' for the tag journal; see
+ * notmuch_database_flush_tag_journal. */
+notmuch_status_t
+_notmuch_database_journal_tag (notmuch_database_t *notmuch,
+			       const char *message_id,
+			       const char *tag,
+			       notmuch_bool_t add);
+
+/* Return 'tags', the tags of 'message_id' in the database, with the
+ * changes of the tag journal, as a new list under 'ctx' if there are
+ * any. */
+notmuch_string_list_t *
+_notmuch_database_apply_tag_journal (notmuch_database_t *notmuch,
+				     void *ctx,
+				     const char *message_id,
+				     notmuch_string_list_t *tags);
+
+/* Return 'query_string' with each tag: and is: term changed by the
+ * tag journal replaced by a query for the messages that have the
+ * tag, counting the journal. */
+const char *
+_notmuch_database_expand_tag_journal (notmuch_database_t *notmuch,
+				      void *ctx,
+				      const char *query_string);
+
+/* changes.cc */
+
+/* Record that the message 'message_id' was removed from the database,
+ * under a new revision. */
+void
+_notmuch_database_add_tombstone (notmuch_database_t *notmuch,
+				 const char *message_id,
+				 const char *thread_id);
+
+/* Return the revision of the last tombstone, or 0 if there is none. */
+unsigned long
+_notmuch_database_get_last_tombstone (notmuch_database_t *notmuch);
+
+/* archive.cc */
+
+typedef struct _notmuch_archive notmuch_archive_t;
+typedef struct _notmuch_archive_route notmuch_archive_route_t;
+
+/* Open the archive shards not opened yet.  Returns TRUE if there were
+ * any. */
+notmuch_bool_t
+_notmuch_database_open_archive_shards (notmuch_database_t *notmuch);
+
+void
+_notmuch_database_close_archive_shards (notmuch_database_t *notmuch);
+
+/* Map the ID of a document in the combined database of a reader to
+ * its ID in the database itself, and back.  Only directory
+ * documents, which are never archived, may be mapped. */
+unsigned int
+_notmuch_database_primary_doc_id (notmuch_database_t *notmuch,
+				  unsigned int doc_id);
+
+unsigned int
+_notmuch_database_combined_doc_id (notmuch_database_t *notmuch,
+				   unsigned int primary_doc_id);
+
+/* For writers, return the thread ID of the archived message with
+ * 'message_id', or NULL if there is none. */
+const char *
+_notmuch_database_find_archived_thread_id (notmuch_database_t *notmuch,
+					   void *ctx,
+					   const char *message_id);
+
+/* For writers, return TRUE if any archived message is in the thread
+ * with ID 'thread_id' (not resolving aliases). */
+notmuch_bool_t
+_notmuch_database_has_archived_thread (notmuch_database_t *notmuch,
+				       const char *thread_id);
+
+/* For writers, append the terms starting with 'prefix' in the archive
+ * shards to 'list', with the prefix stripped, and keep it sorted. */
+void
+_notmuch_database_append_archived_terms (notmuch_database_t *notmuch,
+					 notmuch_string_list_t *list,
+					 const char *prefix);
+
 /* message.cc */
 
 void
@@ -517,11 +983,11 @@ typedef struct _notmuch_string_node {
     struct _notmuch_string_node *next;
 } notmuch_string_node_t;
 
-typedef struct visible _notmuch_string_list {
+struct visible _notmuch_string_list {
     int length;
     notmuch_string_node_t *head;
     notmuch_string_node_t **tail;
-} notmuch_string_list_t;
+};
 
 notmuch_string_list_t *
 _notmuch_string_list_create (const void *ctx);
@@ -542,6 +1008,128 @@ _notmuch_string_list_sort (notmuch_string_list_t *list);
 notmuch_tags_t *
 _notmuch_tags_create (const void *ctx, notmuch_string_list_t *list);
 
+notmuch_tags_t *
+_notmuch_tags_create_with_counts (const void *ctx, notmuch_string_list_t *list,
+				  unsigned int *counts);
+
+/* profile.cc */
+
+typedef enum {
+    NOTMUCH_PROFILE_PARSE,
+    NOTMUCH_PROFILE_EXCLUDE,
+    NOTMUCH_PROFILE_MATCH,
+    NOTMUCH_PROFILE_THREADS,
+    NOTMUCH_PROFILE_READ_HEADERS,
+    NOTMUCH_PROFILE_INDEX_TERMS,
+    NOTMUCH_PROFILE_LINK_THREADS,
+    NOTMUCH_PROFILE_WRITE_DOCUMENTS,
+    NOTMUCH_PROFILE_COMMIT
+} notmuch_profile_phase_id_t;
+
+typedef enum {
+    NOTMUCH_PROFILE_MATCHES,
+    NOTMUCH_PROFILE_DOCUMENTS,
+    NOTMUCH_PROFILE_THREADS_BUILT,
+    NOTMUCH_PROFILE_FILES_OPENED,
+    NOTMUCH_PROFILE_FLUSHES
+} notmuch_profile_counter_id_t;
+
+typedef struct {
+    struct timespec wall;
+    struct timespec cpu;
+} notmuch_profile_timer_t;
+
+/* Start timing a phase, if 'notmuch' has a profile. */
+void
+_notmuch_profile_start (notmuch_database_t *notmuch,
+			notmuch_profile_timer_t *timer);
+
+/* Add the time since the matching _notmuch_profile_start to 'phase'
+ * of the profile of 'notmuch', if it has one. */
+void
+_notmuch_profile_stop (notmuch_database_t *notmuch,
+		       notmuch_profile_timer_t *timer,
+		       notmuch_profile_phase_id_t phase);
+
+/* Add 'n' to 'counter' of the profile of 'notmuch', if it has one. */
+void
+_notmuch_profile_count (notmuch_database_t *notmuch,
+			notmuch_profile_counter_id_t counter,
+			unsigned long n);
+
+/* contacts.cc */
+
+/* Count the addresses in the headers of a message added ('delta' 1)
+ * to, or removed ('delta' -1) from, the contacts table, if the
+ * database has one.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+void
+_notmuch_database_update_contacts (notmuch_database_t *notmuch,
+				   const char *from,
+				   const char *to,
+				   const char *cc,
+				   const char *bcc,
+				   time_t date,
+				   int delta);
+
+/* Drop every record of the contacts table.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+void
+_notmuch_database_clear_contacts (notmuch_database_t *notmuch);
+
+/* tag-set.cc */
+
+typedef struct _notmuch_tag_dictionary notmuch_tag_dictionary_t;
+
+#define NOTMUCH_TAG_ID_NONE ((unsigned int) -1)
+
+/* Return the number of 'tag' in the tag dictionary of 'notmuch',
+ * adding it if need be, or NOTMUCH_TAG_ID_NONE on out-of-memory. */
+unsigned int
+_notmuch_database_intern_tag (notmuch_database_t *notmuch, const char *tag);
+
+/* Return the tag numbered 'id', or NULL if there is none. */
+const char *
+_notmuch_database_tag_name (notmuch_database_t *notmuch, unsigned int id);
+
+notmuch_tag_set_t *
+_notmuch_tag_set_create (const void *ctx);
+
+notmuch_tag_set_t *
+_notmuch_tag_set_copy (const void *ctx, const notmuch_tag_set_t *set);
+
+/* Returns FALSE on out-of-memory. */
+notmuch_bool_t
+_notmuch_tag_set_add (notmuch_tag_set_t *set, unsigned int id);
+
+notmuch_bool_t
+_notmuch_tag_set_contains (const notmuch_tag_set_t *set, unsigned int id);
+
+/* Add the tags of 'other' to 'set'.  Returns FALSE on out-of-memory. */
+notmuch_bool_t
+_notmuch_tag_set_union (notmuch_tag_set_t *set,
+			const notmuch_tag_set_t *other);
+
+notmuch_bool_t
+_notmuch_tag_set_intersects (const notmuch_tag_set_t *set,
+			     const notmuch_tag_set_t *other);
+
+/* Create a set of the strings of 'tags', each with its first 'skip'
+ * characters (e.g. a term prefix) dropped. */
+notmuch_tag_set_t *
+_notmuch_tag_set_create_for_tags (const void *ctx,
+				  notmuch_database_t *notmuch,
+				  notmuch_string_list_t *tags,
+				  size_t skip);
+
+/* Return the tags of 'set', in sorted order. */
+notmuch_string_list_t *
+_notmuch_tag_set_to_string_list (const void *ctx,
+				 notmuch_database_t *notmuch,
+				 const notmuch_tag_set_t *set);
+
 /* filenames.c */
 
 /* The notmuch_filenames_t iterates over a notmuch_string_list_t of
@@ -550,6 +1138,26 @@ notmuch_filenames_t *
 _notmuch_filenames_create (const void *ctx,
 			   notmuch_string_list_t *list);
 
+/* Create a notmuch_filenames_t producing its file names one at a time
+ * from next (closure), which returns NULL after the last one.  Each
+ * file name only has to stay valid until the following call.  The
+ * filenames object takes 'closure' over with talloc_steal. */
+notmuch_filenames_t *
+_notmuch_filenames_create_stream (const void *ctx,
+				  const char *(*next) (void *closure),
+				  void *closure);
+
+/* tag-rules.cc */
+
+typedef struct _notmuch_tag_rules notmuch_tag_rules_t;
+
+/* Apply the tagging rules of 'notmuch' to the new 'message', read
+ * from 'message_file', before it is first written. */
+void
+_notmuch_database_apply_tag_rules (notmuch_database_t *notmuch,
+				   notmuch_message_t *message,
+				   notmuch_message_file_t *message_file);
+
 /* thread.cc */
 
 notmuch_thread_t *
@@ -559,7 +1167,25 @@ _notmuch_thread_create (void *ctx,
 			notmuch_doc_id_set_t *match_set,
 			notmuch_string_list_t *excluded_terms,
 			notmuch_exclude_t omit_exclude,
-			notmuch_sort_t sort);
+			notmuch_sort_t sort,
+			notmuch_bool_t summary_only);
+
+notmuch_status_t
+_notmuch_thread_create_batch (void *ctx,
+			      notmuch_database_t *notmuch,
+			      unsigned int count,
+			      const char **thread_ids,
+			      notmuch_doc_id_set_t *match_set,
+			      notmuch_string_list_t *exclude_terms,
+			      notmuch_exclude_t omit_exclude,
+			      notmuch_sort_t sort,
+			      notmuch_bool_t summary_only,
+			      notmuch_thread_t **threads_out);
+
+/* (Re)write the summary record of 'thread_id' from its messages. */
+notmuch_status_t
+_notmuch_thread_write_summary (notmuch_database_t *notmuch,
+			       const char *thread_id);
 
 NOTMUCH_END_DECLS
 
@@ -56,7 +56,7 @@ NOTMUCH_BEGIN_DECLS
  * version in Makefile.local.
  */
 #define LIBNOTMUCH_MAJOR_VERSION	4
-#define LIBNOTMUCH_MINOR_VERSION	3
+#define LIBNOTMUCH_MINOR_VERSION	4
 #define LIBNOTMUCH_MICRO_VERSION	0
 
 
@@ -179,6 +179,16 @@ typedef enum _notmuch_status {
      * passed to a function expecting an absolute path.
      */
     NOTMUCH_STATUS_PATH_ERROR,
+    /**
+     * The query ran past its deadline or was cancelled, so its results
+     * are incomplete.  See notmuch_query_set_deadline.
+     */
+    NOTMUCH_STATUS_QUERY_INTERRUPTED,
+    /**
+     * An argument was not in the form the function expects, such as
+     * a tagging rule that does not parse.
+     */
+    NOTMUCH_STATUS_ILLEGAL_ARGUMENT,
     /**
      * Not an actual status value. Just a way to find out how many
      * valid status values there are.
@@ -206,6 +216,11 @@ typedef struct _notmuch_message notmuch_message_t;
 typedef struct _notmuch_tags notmuch_tags_t;
 typedef struct _notmuch_directory notmuch_directory_t;
 typedef struct _notmuch_filenames notmuch_filenames_t;
+typedef struct _notmuch_indexed_file notmuch_indexed_file_t;
+typedef struct _notmuch_changes notmuch_changes_t;
+typedef struct _notmuch_contacts notmuch_contacts_t;
+typedef struct _notmuch_async_search notmuch_async_search_t;
+typedef struct _notmuch_async_threads notmuch_async_threads_t;
 #endif /* __DOXYGEN__ */
 
 /**
@@ -281,6 +296,22 @@ typedef enum {
  * An existing notmuch database can be identified by the presence of a
  * directory named ".notmuch" below 'path'.
  *
+ * The Xapian database itself is .notmuch/xapian, or the database
+ * named by a Xapian stub file there.  A stub file lets several
+ * machines share one database served by another, without access to
+ * its files: a line "remote :HOST:PORT" names a database served by
+ * xapian-tcpsrv, and "remote PROGRAM ARGS..." one served by a
+ * program such as "ssh HOST xapian-progsrv DIRECTORY".  To write to
+ * the database, the server has to be started with --writable.  The
+ * mail files are still read below 'path', which should then be a
+ * network path to the same mail as the server's.  Such a database
+ * cannot be compacted through the stub.
+ *
+ * Only one process at a time can have the database open for writing.
+ * Opening it for writing while another process has it waits for up
+ * to ten seconds for that process to close it or to yield it (see
+ * notmuch_database_yield).
+ *
  * The caller should call notmuch_database_destroy when finished with
  * this database.
  *
@@ -354,6 +385,117 @@ notmuch_database_status_string (const notmuch_database_t *notmuch);
 notmuch_status_t
 notmuch_database_close (notmuch_database_t *database);
 
+/**
+ * Bring a read-only database up to date with the latest committed
+ * revision.
+ *
+ * This is much cheaper than closing and opening the database again,
+ * and lets a long-lived reader see changes made by writers since it
+ * opened the database.  Objects derived from the database before the
+ * call should be destroyed first; using them afterwards may give
+ * results from either revision.
+ *
+ * If 'changed' is not NULL, it is set to TRUE if the database was
+ * changed since it was opened or last reopened.  In a database not
+ * yet upgraded to track modifications (see
+ * notmuch_database_needs_upgrade), only changes that add or remove
+ * messages are noticed.  For a writable database this function does
+ * nothing, and '*changed' is set to FALSE.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Successfully reopened the database.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: The database now uses features not
+ *	supported by this version of notmuch; it should be closed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_reopen (notmuch_database_t *database,
+			 notmuch_bool_t *changed);
+
+/**
+ * Return TRUE if another writer is waiting for the write lock held
+ * by the given writable database.
+ *
+ * Only one writer at a time can have the database open; a writer
+ * being opened while another one has it waits for up to ten seconds
+ * for the lock, asking the other writer to yield it in the meantime
+ * (see notmuch_database_yield).  This function is cheap enough to be
+ * called after every change.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_bool_t
+notmuch_database_write_requested (notmuch_database_t *database);
+
+/**
+ * If another writer is waiting for the write lock, commit all
+ * changes, close the database to let the other writer in, and open
+ * it again once that writer is done.
+ *
+ * Long-running writers should call this function regularly, between
+ * atomic sections: within one it does nothing.  If 'yielded' is not
+ * NULL, it is set to TRUE if the database was closed and opened
+ * again.  In that case, as after notmuch_database_reopen, objects
+ * derived from the database before the call should be destroyed
+ * first, except directories, which remain usable.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: No writer was waiting, or the database was
+ *	yielded and is open again.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: The database now uses features not
+ *	supported by this version of notmuch; it should be closed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred, such
+ *	as the other writer keeping the lock for more than five
+ *	minutes.  The database is then closed, as by
+ *	notmuch_database_close.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_yield (notmuch_database_t *database,
+			notmuch_bool_t *yielded);
+
+/**
+ * Append the tag changes made with notmuch_message_journal_tag
+ * through the given read-only database to the tag journal, and sync
+ * it to disk.
+ *
+ * The tag journal (.notmuch/tag-journal) holds tag changes made
+ * without the write lock.  Databases opened read-only, including by
+ * other processes, see the changes in the tags of messages and in
+ * the tag: and is: terms of query strings, once the journal is
+ * flushed and they are opened or reopened.  The next writer to open
+ * the database writes them to it.  Until then, the changes are not
+ * seen by tag exclusion (notmuch_query_add_tag_exclude), nor in the
+ * list of all tags (notmuch_database_get_all_tags).
+ *
+ * notmuch_database_close flushes the journal too.  This function
+ * does nothing on a writable database.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The changes, if any, are on disk.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: The journal could not be written.  The
+ *	changes are then lost, except for this database.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_flush_tag_journal (notmuch_database_t *database);
+
 /**
  * A callback invoked by notmuch_database_compact to notify the user
  * of the progress of the compaction process.
@@ -377,6 +519,164 @@ notmuch_database_compact (const char* path,
 			  notmuch_compact_status_cb_t status_cb,
 			  void *closure);
 
+/**
+ * Compact a notmuch database as notmuch_database_compact does, but
+ * without keeping writers out while the database is compacted.
+ *
+ * The database is compacted as it is when the compaction starts.
+ * The changes committed in the meantime, found by the revision of
+ * each message, are then copied into the compacted database, which
+ * finally replaces the original one.  Only that last copy and the
+ * swap hold the database write lock; a writer busy at that point is
+ * waited for, for up to a minute.
+ *
+ * A writer that commits several times while Xapian reads the
+ * database may overwrite the part being read, in which case the
+ * compaction starts again, up to three times.
+ *
+ * Return value as for notmuch_database_compact, and additionally:
+ *
+ * NOTMUCH_STATUS_UPGRADE_REQUIRED: The database does not record the
+ *	revisions of messages (NOTMUCH_FEATURE_LAST_MOD).
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: Also returned if another compaction of
+ *	the database is in progress.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_compact_online (const char* path,
+				 const char* backup_path,
+				 notmuch_compact_status_cb_t status_cb,
+				 void *closure);
+
+/**
+ * How notmuch_database_compact_renumber numbers the documents of the
+ * compacted database.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+typedef enum {
+    /* Keep the document IDs, as notmuch_database_compact does. */
+    NOTMUCH_COMPACT_RENUMBER_NONE,
+    /* Give the messages of each thread consecutive IDs, the threads
+     * in the order of their first message and the messages of a
+     * thread by date, after all the directories. */
+    NOTMUCH_COMPACT_RENUMBER_THREAD
+} notmuch_compact_renumber_t;
+
+/**
+ * Compact a notmuch database as notmuch_database_compact does, but
+ * with new document IDs as given by 'renumber'.
+ *
+ * Xapian stores documents in the order of their IDs, which are
+ * otherwise given out as messages arrive, so that the messages of a
+ * thread end up far apart; renumbering them by thread puts them
+ * together, which makes reading threads, or messages by date, much
+ * faster when the database is not in the page cache.
+ *
+ * The database is first copied with the new IDs next to the original
+ * one, which needs as much space again, and the copy compacted. All
+ * references to document IDs within the database are rewritten. The
+ * renumbered database has a new UUID, so revisions from before (see
+ * notmuch_database_get_revision) no longer apply to it; the revisions
+ * of messages are kept.
+ *
+ * Return value as for notmuch_database_compact, and additionally:
+ *
+ * NOTMUCH_STATUS_UPGRADE_REQUIRED: The database does not record the
+ *	thread IDs of messages in values.
+ *
+ * NOTMUCH_STATUS_UNSUPPORTED_OPERATION: The database has archive
+ *	shards, which refer to its documents by ID.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_compact_renumber (const char* path,
+				   const char* backup_path,
+				   notmuch_compact_renumber_t renumber,
+				   notmuch_compact_status_cb_t status_cb,
+				   void *closure);
+
+/**
+ * Get the revision of the read-only replica of a database at 'path',
+ * for notmuch_database_write_changesets at the primary.
+ *
+ * A replica is a copy of a database kept up to date with Xapian's
+ * replication protocol, which carries the whole Xapian database,
+ * including the UUID, revision and metadata of notmuch, one commit
+ * at a time.  Writers of the primary only keep the changesets that
+ * bring replicas up to date when XAPIAN_MAX_CHANGESETS is set in
+ * their environment (to the number of changesets to keep); without
+ * them, replicas get a full copy every time.  A replica can only be
+ * opened read-only.  Archive shards and mail files are not
+ * replicated.
+ *
+ * On success, *revision is set to a string allocated by malloc, to
+ * be freed by the caller.  It is empty if there is no replica at
+ * 'path' yet.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: *revision is set.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'path' or 'revision' is NULL.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: The database at 'path' is not a replica.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * Errors are described in *status_string, if not NULL, allocated by
+ * malloc.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_get_replica_revision (const char *path,
+				       char **revision,
+				       char **status_string);
+
+/**
+ * Write to 'fd' the changes to the database at 'path' since
+ * 'revision', a revision returned by
+ * notmuch_database_get_replica_revision, for
+ * notmuch_database_apply_changesets at the replica.
+ *
+ * Return value as notmuch_database_get_replica_revision, with
+ * NOTMUCH_STATUS_FILE_ERROR for a malformed 'revision'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_write_changesets (const char *path,
+				   const char *revision,
+				   int fd,
+				   char **status_string);
+
+/**
+ * Apply the changes read from 'fd', as written by
+ * notmuch_database_write_changesets, to the replica at 'path',
+ * creating it if there is no database there yet.
+ *
+ * Each change is applied atomically, so readers see the replica as
+ * the primary was after some commit.  Readers see the changes after
+ * notmuch_database_reopen, except that after a full copy (ten
+ * seconds after, at the latest) they have to open the replica again.
+ * If 'changed' is not NULL, it is set to TRUE if anything changed.
+ *
+ * Return value as notmuch_database_get_replica_revision.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_apply_changesets (const char *path,
+				   int fd,
+				   notmuch_bool_t *changed,
+				   char **status_string);
+
 /**
  * Destroy the notmuch database, closing it if necessary and freeing
  * all associated resources.
@@ -431,6 +731,13 @@ notmuch_database_needs_upgrade (notmuch_database_t *database);
  * the range of [0.0 .. 1.0] indicating the progress made so far in
  * the upgrade process.  The argument 'closure' is passed verbatim to
  * any callback invoked.
+ *
+ * Upgrades of databases from before version 2 are made in a single
+ * transaction.  Later upgrades, which only add to the documents, are
+ * committed in batches: readers can use the database, with its old
+ * features, while the upgrade runs, and an upgrade that is
+ * interrupted carries on where it stopped the next time this function
+ * is called.  Progress is then reported for the remaining work only.
  */
 notmuch_status_t
 notmuch_database_upgrade (notmuch_database_t *database,
@@ -494,6 +801,314 @@ unsigned long
 notmuch_database_get_revision (notmuch_database_t *notmuch,
 				const char **uuid);
 
+/**
+ * Return the messages changed or removed after revision 'since'.
+ *
+ * Each change is a message with its current thread ID and tags, or a
+ * removed message ("deleted") with its message ID and the ID of the
+ * thread it was in.  The changes are in order of revision, and each
+ * message appears once, with the revision of its last change; a
+ * message that was removed and then added again appears as added.
+ * Passing the revision returned by notmuch_database_get_revision for
+ * the previous call gives the changes committed since, as long as
+ * the database UUID is the same.
+ *
+ * Typical usage might be:
+ *
+ *     notmuch_changes_t *changes;
+ *
+ *     if (notmuch_database_get_changes (database, since, &changes))
+ *         return EXIT_FAILURE;
+ *
+ *     for (; notmuch_changes_valid (changes);
+ *          notmuch_changes_move_to_next (changes))
+ *     {
+ *         if (notmuch_changes_get_deleted (changes))
+ *             ....
+ *         else
+ *             tags = notmuch_changes_get_tags (changes);
+ *     }
+ *
+ *     notmuch_changes_destroy (changes);
+ *
+ * Removals are only recorded in databases that support modification
+ * tracking.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Changes successfully returned in *changes.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ *
+ * NOTMUCH_STATUS_UPGRADE_REQUIRED: The database does not support
+ *	modification tracking; see notmuch_database_needs_upgrade.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_get_changes (notmuch_database_t *notmuch,
+			      unsigned long since,
+			      notmuch_changes_t **changes);
+
+/**
+ * Is the given 'changes' iterator pointing at a valid change.
+ *
+ * When this function returns TRUE, the notmuch_changes_get_* functions
+ * will return the current change.  Whereas when this function
+ * returns FALSE, they will return NULL or 0.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_bool_t
+notmuch_changes_valid (notmuch_changes_t *changes);
+
+/**
+ * Move the 'changes' iterator to the next change.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_changes_move_to_next (notmuch_changes_t *changes);
+
+/**
+ * Return the revision of the current change.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+unsigned long
+notmuch_changes_get_revision (notmuch_changes_t *changes);
+
+/**
+ * Return TRUE if the current change is the removal of a message.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_bool_t
+notmuch_changes_get_deleted (notmuch_changes_t *changes);
+
+/**
+ * Return the message ID of the current change.
+ *
+ * The returned string belongs to 'changes' and is only valid until
+ * the next call to notmuch_changes_move_to_next.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_changes_get_message_id (notmuch_changes_t *changes);
+
+/**
+ * Return the thread ID of the current change.
+ *
+ * The returned string belongs to 'changes' and is only valid until
+ * the next call to notmuch_changes_move_to_next.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_changes_get_thread_id (notmuch_changes_t *changes);
+
+/**
+ * Return the tags of the message of the current change, or NULL if
+ * the message was removed.
+ *
+ * The tags are only valid until the next call to
+ * notmuch_changes_move_to_next.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_tags_t *
+notmuch_changes_get_tags (notmuch_changes_t *changes);
+
+/**
+ * Destroy a notmuch_changes_t object.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_changes_destroy (notmuch_changes_t *changes);
+
+/**
+ * Return the contacts whose address starts with 'prefix' (compared
+ * without regard to case), or all of them for NULL or "", in order
+ * of address.
+ *
+ * The database keeps a record of every address in the From, To, Cc
+ * and Bcc headers of its messages, up to date as messages are added
+ * and removed, so that listing them (say, to complete an address)
+ * need not read any message.  Each contact has the most common
+ * display name given to it, the number of messages from it (sent)
+ * and to it (received), and the date of the newest of them.
+ *
+ * Typical usage might be:
+ *
+ *     notmuch_contacts_t *contacts;
+ *
+ *     if (notmuch_database_get_contacts (database, "jo", &contacts))
+ *         return EXIT_FAILURE;
+ *
+ *     for (; notmuch_contacts_valid (contacts);
+ *          notmuch_contacts_move_to_next (contacts))
+ *     {
+ *         address = notmuch_contacts_get_address (contacts);
+ *         ....
+ *     }
+ *
+ *     notmuch_contacts_destroy (contacts);
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Contacts successfully returned in *contacts.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'contacts' is NULL.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ *
+ * NOTMUCH_STATUS_UPGRADE_REQUIRED: The database has no contacts
+ *	table; see notmuch_database_needs_upgrade.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_get_contacts (notmuch_database_t *notmuch,
+			       const char *prefix,
+			       notmuch_contacts_t **contacts);
+
+/**
+ * Is the given 'contacts' iterator pointing at a valid contact.
+ *
+ * When this function returns TRUE, the notmuch_contacts_get_*
+ * functions will return the current contact.  Whereas when this
+ * function returns FALSE, they will return NULL or 0.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_bool_t
+notmuch_contacts_valid (notmuch_contacts_t *contacts);
+
+/**
+ * Move the 'contacts' iterator to the next contact.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_contacts_move_to_next (notmuch_contacts_t *contacts);
+
+/**
+ * Return the address of the current contact, in lower case.
+ *
+ * The returned string belongs to 'contacts'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_contacts_get_address (notmuch_contacts_t *contacts);
+
+/**
+ * Return the display name most messages give the current contact, or
+ * NULL if none gives it one.
+ *
+ * The returned string belongs to 'contacts'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_contacts_get_name (notmuch_contacts_t *contacts);
+
+/**
+ * Return the number of messages from the current contact.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+unsigned int
+notmuch_contacts_get_sent (notmuch_contacts_t *contacts);
+
+/**
+ * Return the number of messages to the current contact.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+unsigned int
+notmuch_contacts_get_received (notmuch_contacts_t *contacts);
+
+/**
+ * Return the date of the newest message from or to the current
+ * contact.  Removing that message does not make it older.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+time_t
+notmuch_contacts_get_last_seen (notmuch_contacts_t *contacts);
+
+/**
+ * Destroy a notmuch_contacts_t object.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_contacts_destroy (notmuch_contacts_t *contacts);
+
+/**
+ * Enable or disable the on-disk cache of query counts.
+ *
+ * When enabled, the results of notmuch_query_count_messages_st and
+ * notmuch_query_count_threads_st are stored in the .notmuch directory,
+ * keyed on the query string and exclude tags, together with the
+ * database UUID and revision.  Repeating a count against an unchanged
+ * database is then answered from the cache without running the
+ * query.  Any change to the database invalidates every cached count.
+ *
+ * The cache is only used for databases opened read-only that support
+ * modification tracking; otherwise enabling it has no effect.  It is
+ * disabled by default.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_query_cache (notmuch_database_t *notmuch,
+				  notmuch_bool_t enable);
+
+/**
+ * Enable or disable the on-disk cache of excluded messages.
+ *
+ * When enabled, the messages carrying the tags excluded from a query
+ * (see notmuch_query_add_tag_exclude) are looked up in a set kept in
+ * the .notmuch directory for those tags, rather than found again for
+ * every query.  The set is computed once, and afterwards brought up
+ * to date with the messages changed since the revision it was
+ * computed at.
+ *
+ * The cache is only used for databases opened read-only that support
+ * modification tracking and have no archive shards (see
+ * notmuch_database_roll_archive), and not for remote databases; otherwise
+ * enabling it has no effect.  It is disabled by default.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_exclude_cache (notmuch_database_t *notmuch,
+				    notmuch_bool_t enable);
+
+/**
+ * Set how many documents ahead of the one being read the messages
+ * of a query are fetched from 'notmuch', or 0 to read each as it is
+ * needed.
+ *
+ * Fetching ahead lets Xapian read the documents of several messages
+ * at once where its backend can, so that walking a large set of
+ * messages (as dump, address and thread construction do) does not
+ * wait for each read in turn.  The default is 64.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_prefetch (notmuch_database_t *notmuch,
+			       unsigned int documents);
+
 /**
  * Retrieve a directory object from the database for 'path'.
  *
@@ -580,6 +1195,456 @@ notmuch_database_add_message (notmuch_database_t *database,
 			      const char *filename,
 			      notmuch_message_t **message);
 
+/**
+ * Read, parse and index the mail message in 'filename' on behalf of
+ * 'database', without touching the database itself, for a later call
+ * to notmuch_database_add_indexed_file.
+ *
+ * Together, these two functions do the work of
+ * notmuch_database_add_message, split so that the expensive part can
+ * be done ahead of time.  Unlike any other function of this library,
+ * notmuch_database_index_file may be called from several threads at
+ * once for the same database, concurrently with any function called
+ * on 'database' by another thread.
+ *
+ * On success, '*indexed' is set to an object that must be destroyed
+ * with notmuch_indexed_file_destroy.  Errors reading or parsing the
+ * file are not reported here, but by
+ * notmuch_database_add_indexed_file.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: '*indexed' was created.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_index_file (notmuch_database_t *database,
+			     const char *filename,
+			     notmuch_indexed_file_t **indexed);
+
+/**
+ * Add the message indexed by notmuch_database_index_file to the
+ * database, exactly as notmuch_database_add_message would, and with
+ * the same return values.
+ *
+ * 'indexed' still belongs to the caller afterwards.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_add_indexed_file (notmuch_database_t *database,
+				   notmuch_indexed_file_t *indexed,
+				   notmuch_message_t **message);
+
+/**
+ * Destroy an object created by notmuch_database_index_file.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_indexed_file_destroy (notmuch_indexed_file_t *indexed);
+
+/**
+ * Choose whether messages added to 'database' from now on have their
+ * bodies indexed.
+ *
+ * When 'defer' is TRUE, notmuch_database_add_message and
+ * notmuch_database_add_indexed_file index only the headers of a new
+ * message (so it can be found by from:, to:, subject:, id: and
+ * thread:, and is threaded as usual), and mark it as pending.  The
+ * body, and the tags derived from its MIME structure ("attachment",
+ * "signed" and "encrypted"), are added by a later call to
+ * notmuch_database_index_pending.  This makes adding a message much
+ * cheaper.  The default is FALSE.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_defer_body (notmuch_database_t *database,
+				 notmuch_bool_t defer);
+
+/**
+ * Choose whether messages indexed through 'database' from now on are
+ * marked for the extraction of the text of their attachments.
+ *
+ * The library indexes only the file names of attachments.  When
+ * 'extract' is TRUE, a message with an attachment is also marked as
+ * pending extraction as its body is indexed, for the caller (or
+ * another process) to find later with
+ * notmuch_database_get_extraction_pending, extract the text with
+ * whatever tools it likes, and add it with
+ * notmuch_message_add_extracted_text.  The default is FALSE.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_extract_attachments (notmuch_database_t *database,
+					  notmuch_bool_t extract);
+
+/**
+ * Choose which headers messages added to 'database' from now on
+ * record in the database, so that notmuch_message_get_header returns
+ * them without reading the message file.
+ *
+ * 'headers' holds 'num_headers' header names, compared
+ * case-insensitively.  Passing NULL restores the default set: Date,
+ * Reply-To, In-Reply-To, References, Envelope-To, X-Original-To,
+ * Delivered-To and List-Id.  From, To, Cc, Bcc, Subject and
+ * Message-ID are always recorded.  A header is recorded as it was
+ * when the message was added, even if it was absent; messages added
+ * without it still read it from their file.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_recorded_headers (notmuch_database_t *database,
+				       const char **headers,
+				       size_t num_headers);
+
+/**
+ * Choose the length, in characters, of the body snippet that messages
+ * added to 'database' from now on store in the database, for
+ * notmuch_message_get_snippet and notmuch_thread_get_snippet.
+ *
+ * The snippet is the start of the first text/plain part of the
+ * message, leaving out quoted lines (those starting with '>') and
+ * with each run of white space replaced by a single space.  A
+ * 'length' of 0, the default, stores no snippets.  With deferred
+ * body indexing (see notmuch_database_set_defer_body) the snippet is
+ * stored when the body is indexed.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_snippet_length (notmuch_database_t *database,
+				     unsigned int length);
+
+/**
+ * Set the tagging rules applied to the messages added to 'database'
+ * from now on, replacing any set before.  A NULL or empty 'rules'
+ * sets none.
+ *
+ * 'rules' is a list of rules, one per line, each of tag operations
+ * as for "notmuch tag --batch" followed by an optional "--" and a
+ * predicate:
+ *
+ *	+list -inbox -- list-id:notmuch.notmuchmail.org
+ *	+me -- to:me@example.com or from:me@example.com
+ *
+ * A predicate combines, with "and", "or", "not" and parentheses,
+ * terms field:value.  The fields from, to (which also matches Cc),
+ * subject and list-id match if the header contains the value,
+ * ignoring case; folder, path and tag match if the message has
+ * exactly that term, as they do in searches.  A value with spaces is
+ * quoted with '"', doubling any '"' inside it.  "*", or no
+ * predicate, matches every message.  Blank lines and lines starting
+ * with '#' are ignored.
+ *
+ * The rules are compiled once, and applied in order to each new
+ * message, or ghost message being filled in, by
+ * notmuch_database_add_message and notmuch_database_add_indexed_file
+ * before the message is first written, so a rule sees the tags of
+ * the rules before it.  Messages already in the database, including
+ * those a file is added to, are not changed.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The rules were set.
+ *
+ * NOTMUCH_STATUS_ILLEGAL_ARGUMENT: A rule does not parse; the line
+ *	and what is wrong are logged, and the rules set before stay.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_tag_rules (notmuch_database_t *database,
+				const char *rules);
+
+/**
+ * Flush the changes made through 'database' to disk whenever the
+ * memory Xapian needs to hold them is estimated to have reached
+ * 'bytes', instead of only once every so many documents changed (see
+ * XAPIAN_FLUSH_THRESHOLD in the Xapian documentation).  The estimate
+ * counts the terms and positions of the documents written, so that
+ * large messages flush sooner than small ones.
+ *
+ * Changes are only flushed at the end of an outermost atomic section
+ * (see notmuch_database_begin_atomic), as notmuch new makes for each
+ * file or batch of files it adds.  A 'bytes' of 0, the default,
+ * leaves flushing to Xapian alone.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_flush_budget (notmuch_database_t *database,
+				   size_t bytes);
+
+/**
+ * Choose whether the body text of messages added to 'database' from
+ * now on is indexed with term positions, as it is by default.
+ *
+ * Without positions the database is much smaller and messages are
+ * added faster, but phrase searches cannot be answered exactly: while
+ * positions are off, every phrase in a query (including one for a
+ * prefixed field such as subject:) matches the messages containing
+ * all of its words.  Header text is always indexed with positions.
+ *
+ * The choice is recorded in the database, so it holds for every
+ * writer until changed, and needs a database opened read-write to
+ * change.  Changing it only affects messages added later: turning
+ * positions back on makes phrase searches exact again, but they do
+ * not find the bodies of messages added without positions.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_set_body_positions (notmuch_database_t *database,
+				     notmuch_bool_t positions);
+
+/**
+ * Time spent in one phase of queries, see notmuch_profile_t.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+typedef struct _notmuch_profile_phase {
+    /* Wall clock and process CPU time, in seconds. */
+    double wall;
+    double cpu;
+    /* How many times the phase ran. */
+    unsigned long calls;
+} notmuch_profile_phase_t;
+
+/**
+ * Where the queries and changes of a database handle spend their
+ * time.
+ *
+ * 'parse' is the parsing of query strings, 'exclude' the building of
+ * the exclude query, 'match' the running of the queries by Xapian
+ * (which is also where excluded messages are dropped), and 'threads'
+ * the building of threads by notmuch_threads_get.
+ *
+ * When adding messages, 'read_headers' is the opening of message
+ * files and the reading of their headers, 'index_terms' the parsing
+ * of new messages and the generation of their terms, 'link_threads'
+ * the finding of their threads, 'write_documents' the handing of the
+ * changed documents to Xapian, and 'commit' the writing of the
+ * changes to disk, at the end of each outermost atomic section and
+ * when the database is closed.
+ *
+ * 'matches' counts the matches returned by Xapian, 'documents' the
+ * message documents read from the database, 'threads_built' the
+ * threads built, 'files_opened' the message files opened and
+ * 'flushes' the flushes made to keep to the budget set with
+ * notmuch_database_set_flush_budget.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+typedef struct _notmuch_profile {
+    notmuch_profile_phase_t parse;
+    notmuch_profile_phase_t exclude;
+    notmuch_profile_phase_t match;
+    notmuch_profile_phase_t threads;
+    notmuch_profile_phase_t read_headers;
+    notmuch_profile_phase_t index_terms;
+    notmuch_profile_phase_t link_threads;
+    notmuch_profile_phase_t write_documents;
+    notmuch_profile_phase_t commit;
+    unsigned long matches;
+    unsigned long documents;
+    unsigned long threads_built;
+    unsigned long files_opened;
+    unsigned long flushes;
+} notmuch_profile_t;
+
+/**
+ * Record the work of the queries on 'database' in 'profile'.
+ *
+ * From now on, the library adds the time spent in each phase of the
+ * queries on 'database', and the counts of what they read, to the
+ * members of 'profile', which the caller should have zeroed.  The
+ * caller keeps ownership of 'profile' and can read it at any time.
+ * Passing NULL stops the recording.  The work of the handles opened
+ * by notmuch_threads_set_jobs is only seen as time spent building
+ * threads, and the work of notmuch_database_index_file is not
+ * recorded, since it may run in other threads.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_database_set_profile (notmuch_database_t *database,
+			      notmuch_profile_t *profile);
+
+/**
+ * Index the bodies of all messages added while body indexing was
+ * deferred (see notmuch_database_set_defer_body).
+ *
+ * Messages are indexed in batches of 'batch_size', each written to
+ * the database as a single atomic transaction; a 'batch_size' of 0
+ * indexes everything in one transaction.  A message whose file
+ * cannot be read stays pending.  If 'count' is not NULL, the
+ * number of messages indexed is stored there.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: All readable pending messages were indexed.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no message can be indexed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *	Batches already written are kept.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_index_pending (notmuch_database_t *database,
+				unsigned int batch_size,
+				unsigned int *count);
+
+/**
+ * Finish merging the threads joined by messages added to 'database'.
+ *
+ * When a new message joins two existing threads, the library only
+ * records that one thread was merged into the other; the messages
+ * of the merged thread keep their old thread ID internally until
+ * this function rewrites them.  Queries and
+ * notmuch_message_get_thread_id see the merged thread either way,
+ * but every pending merge makes thread: queries slightly more
+ * expensive.  Each merged thread is rewritten in its own atomic
+ * transaction.  If 'count' is not NULL, the number of merged threads
+ * rewritten is stored there.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: All pending merges were finished.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no thread can be rewritten.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *	Threads already rewritten are kept.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_merge_threads (notmuch_database_t *database,
+				unsigned int *count);
+
+/**
+ * List the messages marked as pending extraction (see
+ * notmuch_database_set_extract_attachments).
+ *
+ * On success, *messages is set to the messages, in no particular
+ * order, which the caller should destroy with
+ * notmuch_messages_destroy.  A message stays marked until
+ * notmuch_message_set_extraction_done is called for it.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The messages were listed.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'messages' is NULL.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_get_extraction_pending (notmuch_database_t *database,
+					 notmuch_messages_t **messages);
+
+/**
+ * Move the messages matching 'query_string' out of the database into
+ * a new read-only archive shard called 'name'.
+ *
+ * Archive shards are Xapian databases kept in .notmuch/archive.
+ * Databases opened in read-only mode search the shards along with
+ * the database itself, so archived messages are still found and
+ * shown as before.  Databases opened in read-write mode see only the
+ * messages not archived, so archived messages can no longer be
+ * changed, e.g. tagged; writes and compaction stay as cheap as the
+ * live part of the database.  New replies to archived messages still
+ * join their threads.
+ *
+ * The shard is written aside and put in place before the messages are
+ * removed from the database.  If that removal fails, read-only
+ * databases see the messages twice.
+ *
+ * If 'count' is not NULL, it is set to the number of messages
+ * archived.  No shard is created if no message matches.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The messages were archived.
+ *
+ * NOTMUCH_STATUS_PATH_ERROR: 'name' is empty, starts with '.' or
+ *	contains '/'.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: A shard called 'name' already exists, or
+ *	the shard could not be put in place.
+ *
+ * NOTMUCH_STATUS_UNBALANCED_ATOMIC: The database is in an atomic
+ *	section.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no message can be archived.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_roll_archive (notmuch_database_t *database,
+			       const char *name,
+			       const char *query_string,
+			       unsigned int *count);
+
+/**
+ * Add 'filename' to the database without reading it, if it is the
+ * new name of a file that was moved within its maildir.
+ *
+ * That is the case if 'filename' is in a "cur" or "new" directory,
+ * and the database has a file in the "cur" or "new" directory of the
+ * same maildir with the same unique name (the part of the file name
+ * before any ':' or ".gz" suffix), which no longer exists.  This is
+ * what MUAs do to a message when they move it from "new" to "cur" or
+ * change its maildir flags, and what compressing or decompressing a
+ * message file does.  'filename' is then added to that file's message,
+ * as notmuch_database_add_message would add it to an existing
+ * message, and the old filename is left for the caller to remove.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID: 'filename' was added to the
+ *	message of the old file.  If 'message' is not NULL, '*message'
+ *	is set to that message, which the caller must destroy.
+ *
+ * NOTMUCH_STATUS_SUCCESS: 'filename' is not such a file, and nothing
+ *	was done; the caller should add it with
+ *	notmuch_database_add_message.  '*message' is set to NULL.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no message can be added.
+ *
+ * NOTMUCH_STATUS_UPGRADE_REQUIRED: The caller must upgrade the
+ * 	database to use this function.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_add_moved_file (notmuch_database_t *database,
+				 const char *filename,
+				 notmuch_message_t **message);
+
 /**
  * Remove a message filename from the given notmuch database. If the
  * message has no more filenames, remove the message.
@@ -612,6 +1677,55 @@ notmuch_status_t
 notmuch_database_remove_message (notmuch_database_t *database,
 				 const char *filename);
 
+/**
+ * Begin removing many messages at once.
+ *
+ * Removing the last message of a thread drops the ghost messages that
+ * stood in the thread for messages not in the database, and removing
+ * any other message leaves a ghost in its place; finding out which
+ * takes a query of the thread for each message removed. Between
+ * notmuch_database_begin_removals and notmuch_database_end_removals,
+ * the removed messages are only noted, and the ghosts of each thread
+ * brought up to date once, at the end.
+ *
+ * Until then, queries may find threads whose removed messages have
+ * left no ghosts yet. Removals may be nested; only the outermost end
+ * brings the ghosts up to date. Closing the database, or yielding it
+ * (see notmuch_database_yield), also does so for removals not yet
+ * ended.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Removals begun.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no message can be removed.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_begin_removals (notmuch_database_t *database);
+
+/**
+ * End removing many messages at once, see
+ * notmuch_database_begin_removals.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The ghosts of the threads of the removed
+ *	messages are up to date (or the removals were nested).
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred while
+ *	updating the ghosts of some thread; the others are up to date.
+ *
+ * NOTMUCH_STATUS_UNBALANCED_ATOMIC: The database was not removing
+ *	messages.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_end_removals (notmuch_database_t *database);
+
 /**
  * Find a message with the given message_id.
  *
@@ -682,6 +1796,108 @@ notmuch_database_find_message_by_filename (notmuch_database_t *notmuch,
 notmuch_tags_t *
 notmuch_database_get_all_tags (notmuch_database_t *db);
 
+/**
+ * Return a list of all tags found in the database, with the number of
+ * messages that have each.
+ *
+ * The list is the one notmuch_database_get_all_tags returns, but
+ * notmuch_tags_get_count gives the number of messages with the
+ * current tag.  The library keeps the catalogue between calls, and
+ * reads it again only once the database has changed.
+ *
+ * On error this function returns NULL.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_tags_t *
+notmuch_database_get_tag_catalogue (notmuch_database_t *db);
+
+/**
+ * The shape of a database, see notmuch_database_get_stats.
+ *
+ * 'documents' counts every document, of which 'messages' are
+ * messages, 'ghosts' ghost messages (see
+ * NOTMUCH_MESSAGE_FLAG_GHOST) and 'directories' the records of
+ * directories.  'last_document_id' is the highest document ID used;
+ * the gap to 'documents' is that of the documents removed since the
+ * database was last compacted.  'average_length' is the average
+ * number of terms (with repeats) of a document.
+ *
+ * 'filenames' counts the file names of messages, 'threads' the
+ * threads (counting those of ghost messages), 'tags' the distinct
+ * tags and 'tag_terms' the tags of all messages together.
+ * 'pending_bodies' and 'pending_extractions' count the messages left
+ * for notmuch_database_index_pending and for attachment
+ * extraction respectively.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+typedef struct _notmuch_database_stats {
+    unsigned long documents;
+    unsigned long last_document_id;
+    double average_length;
+    unsigned long messages;
+    unsigned long ghosts;
+    unsigned long directories;
+    unsigned long filenames;
+    unsigned long threads;
+    unsigned long tags;
+    unsigned long tag_terms;
+    unsigned long pending_bodies;
+    unsigned long pending_extractions;
+} notmuch_database_stats_t;
+
+/**
+ * Fill in 'stats' with the shape of 'database'.
+ *
+ * The counts are read from the lists of terms of the database and
+ * the number of documents carrying each, without reading any
+ * document, so the cost grows with the number of threads, tags,
+ * directories and file names rather than with the size of the mail.
+ * A database opened read-only counts its archive shards as well; one
+ * opened read-write only the messages outside them.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: 'stats' was filled in.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'stats' is NULL.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: a Xapian exception occurred.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_get_stats (notmuch_database_t *database,
+			    notmuch_database_stats_t *stats);
+
+/**
+ * Return, in '*threads', the IDs of the (up to) 'n' threads of
+ * 'database' with the most messages, largest first.
+ *
+ * The IDs come as a list of strings of the kind tags are returned
+ * in, where notmuch_tags_get_count gives the number of messages of
+ * the current thread, ghost messages included.  Like
+ * notmuch_database_get_stats, this reads no documents.  The list
+ * belongs to 'database' until destroyed with notmuch_tags_destroy.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: '*threads' was set.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'threads' is NULL.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: a Xapian exception occurred.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_database_get_largest_threads (notmuch_database_t *database,
+				      unsigned int n,
+				      notmuch_tags_t **threads);
+
 /**
  * Create a new query for 'database'.
  *
@@ -778,37 +1994,421 @@ typedef enum {
  * number of non-excluded messages/matches. Otherwise, if set to
  * FALSE, then the exclude status is completely ignored.
  *
- * The performance difference when calling
- * notmuch_query_search_messages should be relatively small (and both
- * should be very fast).  However, in some cases,
- * notmuch_query_search_threads is very much faster when omitting
- * excluded messages as it does not need to construct the threads that
- * only match in excluded messages.
+ * The performance difference when calling
+ * notmuch_query_search_messages should be relatively small (and both
+ * should be very fast).  However, in some cases,
+ * notmuch_query_search_threads is very much faster when omitting
+ * excluded messages as it does not need to construct the threads that
+ * only match in excluded messages.
+ */
+void
+notmuch_query_set_omit_excluded (notmuch_query_t *query,
+				 notmuch_exclude_t omit_excluded);
+
+/**
+ * Specify the sorting desired for this query.
+ */
+void
+notmuch_query_set_sort (notmuch_query_t *query, notmuch_sort_t sort);
+
+/**
+ * Return the sort specified for this query. See
+ * notmuch_query_set_sort.
+ */
+notmuch_sort_t
+notmuch_query_get_sort (const notmuch_query_t *query);
+
+/**
+ * Skip the first 'offset' results of notmuch_query_search_messages
+ * or notmuch_query_search_threads.
+ *
+ * The offset is applied inside the database, so that skipped results
+ * are never materialized: skipped threads are only told apart by
+ * their thread IDs, and never created.  By default, the offset is 0.
+ *
+ * This setting does not affect counts.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_query_set_offset (notmuch_query_t *query, unsigned int offset);
+
+/**
+ * Return at most 'limit' results from notmuch_query_search_messages
+ * or notmuch_query_search_threads (after applying the offset set
+ * with notmuch_query_set_offset).
+ *
+ * Results are fetched from the database incrementally as the
+ * iterator advances, and a limit prevents any results beyond it from
+ * being fetched at all.  A negative limit, the default, means there
+ * is no limit.
+ *
+ * This setting does not affect counts.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_query_set_limit (notmuch_query_t *query, int limit);
+
+/**
+ * Message fields, for notmuch_query_set_fields.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+typedef enum {
+    /** notmuch_message_get_message_id */
+    NOTMUCH_FIELD_MESSAGE_ID = 1 << 0,
+    /** notmuch_message_get_thread_id */
+    NOTMUCH_FIELD_THREAD_ID = 1 << 1,
+    /** notmuch_message_get_tags */
+    NOTMUCH_FIELD_TAGS = 1 << 2,
+    /** notmuch_message_get_filename, notmuch_message_get_filenames */
+    NOTMUCH_FIELD_FILENAMES = 1 << 3,
+    /** Only the summaries of the threads of notmuch_query_search_threads */
+    NOTMUCH_FIELD_THREAD_SUMMARY = 1 << 4,
+    /** Every field, the default */
+    NOTMUCH_FIELD_ALL = ~0
+} notmuch_field_t;
+
+/**
+ * Tell the library which fields of the messages returned by
+ * notmuch_query_search_messages the caller is going to use, as a
+ * bitwise OR of notmuch_field_t values.
+ *
+ * By default, the first access to any of these fields decodes all of
+ * them at once, which is cheapest when several are used.  When only
+ * one or two are, restricting the set avoids decoding the others.
+ * This is only a hint: fields outside the set remain available, at
+ * the cost of decoding them separately.
+ *
+ * For notmuch_query_search_threads, NOTMUCH_FIELD_THREAD_SUMMARY on
+ * its own says that only the thread ID, subject, authors, tags, dates
+ * and message counts of the threads are going to be used.  Threads
+ * are then summarized from the values and tags stored for their
+ * messages, without creating the messages; notmuch_thread_get_messages
+ * and notmuch_thread_get_toplevel_messages still work, but run a
+ * query of their own.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_query_set_fields (notmuch_query_t *query, unsigned int fields);
+
+/**
+ * Add a tag that will be excluded from the query results by default.
+ * This exclusion will be overridden if this tag appears explicitly in
+ * the query.
+ */
+void
+notmuch_query_add_tag_exclude (notmuch_query_t *query, const char *tag);
+
+/**
+ * Give each search of 'query' at most 'seconds' (counted from the
+ * call to notmuch_query_search_messages_st or
+ * notmuch_query_search_threads_st) to produce its results.  Zero, the
+ * default, means there is no deadline.
+ *
+ * Once the deadline has passed, Xapian stops matching where it is,
+ * and the iterator ends after the results found so far (threads
+ * already created are still returned whole);
+ * notmuch_query_get_status then returns
+ * NOTMUCH_STATUS_QUERY_INTERRUPTED.  This keeps a query that matches
+ * most of a large database from holding a CPU for minutes.
+ *
+ * With Xapian before 1.3.5, a single matcher run cannot be stopped,
+ * so the deadline is only checked between the windows of results
+ * fetched and between batches of threads.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_query_set_deadline (notmuch_query_t *query, double seconds);
+
+/**
+ * Stop the searches of 'query' as if their deadline had passed as
+ * soon as '*cancel' is non-zero, or NULL to stop cancelling them.
+ *
+ * '*cancel' may be set from another thread or from a signal handler;
+ * it is checked before each window of results is fetched and each
+ * batch of threads is created, so a search stops within one of
+ * those.  A search started with '*cancel' already set fails with
+ * NOTMUCH_STATUS_QUERY_INTERRUPTED.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_query_set_cancel (notmuch_query_t *query, const volatile int *cancel);
+
+/**
+ * Tell whether the last search of 'query' returned all of its
+ * results.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The search has not been stopped (so far).
+ *
+ * NOTMUCH_STATUS_QUERY_INTERRUPTED: The search ran into its deadline
+ *	or was cancelled, and its iterator ended (or will end) early.
+ *
+ * Another status, such as NOTMUCH_STATUS_OUT_OF_MEMORY or
+ *	NOTMUCH_STATUS_XAPIAN_EXCEPTION: creating the threads of the
+ *	search failed, and its threads iterator ended early.  The error
+ *	has been logged.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_get_status (notmuch_query_t *query);
+
+/**
+ * Parse the query string of 'query' now rather than at its first
+ * search or count.
+ *
+ * The parse is kept with 'query' and reused by its later searches
+ * and counts, whatever their sort, offset or limit, for as long as
+ * the database the handle sees stays the same; once the handle has
+ * written to the database, or notmuch_database_reopen has found it
+ * changed, the next search parses the string again.  Preparing a
+ * query is never required, but lets a caller that runs one query
+ * many times (a saved search, say) report a malformed query string
+ * up front.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The query string was parsed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: Xapian could not parse the query
+ *	string.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_prepare (notmuch_query_t *query);
+
+/**
+ * Start searching for the threads matching 'query' on a thread of the
+ * library's own, and return at once, for callers that must not block
+ * (such as the main loop of a user interface).
+ *
+ * The search runs on a copy of 'query' taken now, with its sort,
+ * excludes, offset, limit and deadline, against a read-only handle on
+ * the database opened for it, which sees the database as last
+ * committed.  The threads found are handed back in batches of up to
+ * 'batch_size', in the order of the search, as copies that need
+ * nothing of the worker: see notmuch_async_search_next.
+ *
+ * Typical usage might be:
+ *
+ *     notmuch_async_search_t *search;
+ *     notmuch_async_threads_t *threads;
+ *
+ *     notmuch_query_search_threads_async (query, 100, &search);
+ *     watch notmuch_async_search_get_fd (search) for reading;
+ *
+ *     when it is readable:
+ *         while (notmuch_async_search_next (search, &threads) == 0 &&
+ *                threads) {
+ *             for (; notmuch_async_threads_valid (threads);
+ *                  notmuch_async_threads_move_to_next (threads))
+ *                 ....
+ *             notmuch_async_threads_destroy (threads);
+ *         }
+ *         if (notmuch_async_search_finished (search)) {
+ *             status = notmuch_async_search_get_status (search);
+ *             notmuch_async_search_destroy (search);
+ *         }
+ *
+ * The search belongs to 'query', and is destroyed with it, if it is
+ * not destroyed before.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The search was started.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'query' or 'search' is NULL.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory, or the system lacked
+ *	the resources to start the thread.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: The pipe to signal the caller could not
+ *	be made, or the thread could not be started for another reason.
+ *
+ * NOTMUCH_STATUS_UNSUPPORTED_OPERATION: notmuch was built without
+ *	threads.
+ *
+ * Other statuses are those of notmuch_database_open.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_search_threads_async (notmuch_query_t *query,
+				    unsigned int batch_size,
+				    notmuch_async_search_t **search);
+
+/**
+ * Return a file descriptor that polls readable whenever a batch of
+ * 'search' may be waiting, or it may have finished.
+ *
+ * It stays readable until notmuch_async_search_next is next called,
+ * which should then be called until it returns no batch.  The file
+ * descriptor belongs to 'search'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+int
+notmuch_async_search_get_fd (notmuch_async_search_t *search);
+
+/**
+ * Take the next batch of threads found by 'search', without waiting.
+ *
+ * Sets *threads to the oldest batch not yet taken, or to NULL if there
+ * is none for now.  The batch belongs to 'search'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_async_search_next (notmuch_async_search_t *search,
+			   notmuch_async_threads_t **threads);
+
+/**
+ * Has 'search' ended, with all of its batches taken?
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_bool_t
+notmuch_async_search_finished (notmuch_async_search_t *search);
+
+/**
+ * Return how 'search' ended, once notmuch_async_search_finished has
+ * returned TRUE: NOTMUCH_STATUS_SUCCESS if all threads were found,
+ * NOTMUCH_STATUS_QUERY_INTERRUPTED if it was cancelled or ran out of
+ * time (see notmuch_query_set_deadline), or the error that stopped
+ * it.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_async_search_get_status (notmuch_async_search_t *search);
+
+/**
+ * Ask 'search' to stop as soon as it can, even in the middle of a
+ * Xapian match.  The batches already found can still be taken.  This
+ * may be called from any thread, or a signal handler.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_async_search_cancel (notmuch_async_search_t *search);
+
+/**
+ * Destroy 'search', with the batches not yet destroyed, stopping it
+ * first and waiting for its thread to end if need be.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_async_search_destroy (notmuch_async_search_t *search);
+
+/**
+ * Is the given 'threads' batch pointing at a valid thread.
+ *
+ * When this function returns TRUE, the notmuch_async_threads_get_*
+ * functions return what the corresponding notmuch_thread_get_*
+ * functions returned for the current thread.  Whereas when it returns
+ * FALSE, they return NULL or 0.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_bool_t
+notmuch_async_threads_valid (notmuch_async_threads_t *threads);
+
+/**
+ * Move the 'threads' batch to the next thread.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_async_threads_move_to_next (notmuch_async_threads_t *threads);
+
+/**
+ * Get the thread ID of the current thread of 'threads'.
+ *
+ * The returned string belongs to 'threads'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_async_threads_get_thread_id (notmuch_async_threads_t *threads);
+
+/**
+ * Get the subject of the current thread of 'threads'; see
+ * notmuch_thread_get_subject.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_async_threads_get_subject (notmuch_async_threads_t *threads);
+
+/**
+ * Get the authors of the current thread of 'threads'; see
+ * notmuch_thread_get_authors.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_async_threads_get_authors (notmuch_async_threads_t *threads);
+
+/**
+ * Get the number of messages of the current thread of 'threads' that
+ * matched the search.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+int
+notmuch_async_threads_get_matched_messages (notmuch_async_threads_t *threads);
+
+/**
+ * Get the number of messages of the current thread of 'threads'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
  */
-void
-notmuch_query_set_omit_excluded (notmuch_query_t *query,
-				 notmuch_exclude_t omit_excluded);
+int
+notmuch_async_threads_get_total_messages (notmuch_async_threads_t *threads);
 
 /**
- * Specify the sorting desired for this query.
+ * Get the date of the oldest message of the current thread of
+ * 'threads'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
  */
-void
-notmuch_query_set_sort (notmuch_query_t *query, notmuch_sort_t sort);
+time_t
+notmuch_async_threads_get_oldest_date (notmuch_async_threads_t *threads);
 
 /**
- * Return the sort specified for this query. See
- * notmuch_query_set_sort.
+ * Get the date of the newest message of the current thread of
+ * 'threads'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
  */
-notmuch_sort_t
-notmuch_query_get_sort (const notmuch_query_t *query);
+time_t
+notmuch_async_threads_get_newest_date (notmuch_async_threads_t *threads);
 
 /**
- * Add a tag that will be excluded from the query results by default.
- * This exclusion will be overridden if this tag appears explicitly in
- * the query.
+ * Get the tags of the current thread of 'threads', as
+ * notmuch_thread_get_tags does.  The iterator belongs to 'threads'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_tags_t *
+notmuch_async_threads_get_tags (notmuch_async_threads_t *threads);
+
+/**
+ * Destroy a batch of threads.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
  */
 void
-notmuch_query_add_tag_exclude (notmuch_query_t *query, const char *tag);
+notmuch_async_threads_destroy (notmuch_async_threads_t *threads);
 
 /**
  * Execute a query for threads, returning a notmuch_threads_t object
@@ -903,6 +2503,12 @@ notmuch_query_search_threads (notmuch_query_t *query);
  * notmuch_messages_destroy function, but there's no good
  * reason to call it if the query is about to be destroyed).
  *
+ * With a read-only database, iterating over the results survives a
+ * writer committing enough changes meanwhile that the revision being
+ * read is gone: the database is reopened at the latest revision, and
+ * the iteration goes on with the results not yet returned.  Messages
+ * added since may or may not be among them.
+ *
  * If a Xapian exception occurs this function will return NULL.
  *
  * @since libnotmuch 4.2 (notmuch 0.20)
@@ -989,6 +2595,26 @@ notmuch_threads_move_to_next (notmuch_threads_t *threads);
 void
 notmuch_threads_destroy (notmuch_threads_t *threads);
 
+/**
+ * Create the threads of 'threads' with up to 'jobs' threads of
+ * execution, each extra one using its own read-only handle on the
+ * database.
+ *
+ * This must be called before the first call to notmuch_threads_valid
+ * or notmuch_threads_get.  The threads are returned in the same order
+ * and with the same contents as without this call.  Threads created
+ * on another handle belong to that handle's database, which stays
+ * open until the query is destroyed.
+ *
+ * Since such handles only see committed changes, threads from a
+ * database opened read-write are created one at a time, as they are
+ * when 'jobs' is 1 or POSIX threads are not available.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+void
+notmuch_threads_set_jobs (notmuch_threads_t *threads, unsigned int jobs);
+
 /**
  * Return the number of messages matching a search.
  *
@@ -1019,6 +2645,32 @@ NOTMUCH_DEPRECATED(4,3)
 unsigned int
 notmuch_query_count_messages (notmuch_query_t *query);
 
+/**
+ * Return an estimate of the number of messages matching a search.
+ *
+ * Unlike notmuch_query_count_messages_st, which checks every match,
+ * this only checks enough matches for a reasonable estimate, so it
+ * is much cheaper for broad queries.  The estimate is exact for small
+ * results.  If 'lower' and 'upper' are not NULL, they are set to
+ * bounds on the number of matches.
+ *
+ * The query cache (see notmuch_database_set_query_cache) is not used.
+ *
+ * @returns
+ *
+ * NOTMUCH_STATUS_SUCCESS: query completed successfully.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: a Xapian exception occured. The
+ *      values of *estimate, *lower and *upper are not defined.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_count_messages_estimate (notmuch_query_t *query,
+				       unsigned int *estimate,
+				       unsigned int *lower,
+				       unsigned int *upper);
+
 /**
  * Return the number of threads matching a search.
  *
@@ -1056,6 +2708,160 @@ NOTMUCH_DEPRECATED(4,3)
 unsigned int
 notmuch_query_count_threads (notmuch_query_t *query);
 
+/**
+ * Count the files of the messages matching a search, as would be
+ * listed by notmuch_message_get_filenames for each of the messages
+ * returned by notmuch_query_search_messages_st.
+ *
+ * The files are counted from the terms of each message, so this is
+ * much cheaper than listing them.
+ *
+ * @returns
+ *
+ * NOTMUCH_STATUS_SUCCESS: query completed successfully.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: a Xapian exception occured. The
+ *      value of *count is not defined.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_count_files (notmuch_query_t *query, unsigned int *count);
+
+/**
+ * Count the messages (or, if 'count_threads' is TRUE, the threads)
+ * matching each of 'num_queries' queries, storing the count for
+ * queries[i] in counts[i].
+ *
+ * All of the queries must belong to the same database.  Up to 'jobs'
+ * queries are evaluated at once, each extra thread using its own
+ * read-only handle on the database.  Since such handles only see
+ * committed changes, queries against a database opened read-write
+ * are evaluated one at a time, as they are when 'jobs' is 1 or POSIX
+ * threads are not available.
+ *
+ * Each count is the same as notmuch_query_count_messages_st (or
+ * notmuch_query_count_threads_st) would return, and goes through the
+ * cache of query counts if enabled.
+ *
+ * @returns
+ *
+ * NOTMUCH_STATUS_SUCCESS: all queries completed successfully.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: the queries do not all belong to the
+ *	same database.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: a Xapian exception occured.
+ *
+ * On error, the values in 'counts' are not defined.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_count_batch (notmuch_query_t **queries,
+			   unsigned int num_queries,
+			   notmuch_bool_t count_threads,
+			   unsigned int jobs,
+			   unsigned int *counts);
+
+/**
+ * Return the sorted list of tags of the messages matching 'query'.
+ *
+ * The result is the same as that of notmuch_messages_collect_tags
+ * over the results of notmuch_query_search_messages_st.  When the
+ * query matches many messages compared to the number of tags in the
+ * database, it is found by asking, for each tag, whether any match
+ * has it, without reading the matches themselves.
+ *
+ * The tags belong to 'query'.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: query completed successfully.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: a Xapian exception occured.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_collect_tags (notmuch_query_t *query, notmuch_tags_t **tags);
+
+/**
+ * Count, for each tag, the messages matching 'query' that have it.
+ *
+ * The counts are gathered in a single pass over the matches, reading
+ * only their tag terms; no notmuch_message_t is created.  '*tags' is
+ * set to the sorted list of the tags that occur among the matches,
+ * and notmuch_tags_get_count gives the number of matches with the
+ * current tag.  Excluded messages are left out as they are by
+ * notmuch_query_search_messages_st.
+ *
+ * The tags belong to 'query'.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: query completed successfully.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: a Xapian exception occured.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_count_tags (notmuch_query_t *query, notmuch_tags_t **tags);
+
+/**
+ * Change the tags of all messages matching 'query'.
+ *
+ * If 'remove_all' is TRUE, every tag of a message is removed first.
+ * Then the tags in 'remove_tags' are removed and those in 'add_tags'
+ * are added.  Both are NULL-terminated arrays, and either may be
+ * NULL.  A tag in both is added.
+ *
+ * This gives the same result as notmuch_message_remove_all_tags,
+ * notmuch_message_remove_tag and notmuch_message_add_tag on each
+ * match inside notmuch_message_freeze and notmuch_message_thaw, but
+ * is much faster for many messages: the tag terms of each document
+ * are changed directly, without a notmuch_message_t, and only
+ * documents whose tags change are rewritten.
+ * All of it is done in one atomic section.
+ *
+ * Maildir flags are not synchronized.  The changed messages are those
+ * with a revision (see notmuch_database_get_revision) after the one
+ * the database had before the call, so a caller can find them with a
+ * lastmod: query and call notmuch_message_tags_to_maildir_flags.
+ *
+ * If 'changed' is not NULL, it is set to the number of messages
+ * whose tags changed.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The tags were changed successfully.
+ *
+ * NOTMUCH_STATUS_TAG_TOO_LONG: The length of a tag is too long
+ *	(exceeds NOTMUCH_TAG_MAX)
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in
+ *	read-only mode so no message can be modified.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: a Xapian exception occured.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_change_tags (notmuch_query_t *query,
+			   const char **add_tags,
+			   const char **remove_tags,
+			   notmuch_bool_t remove_all,
+			   unsigned int *changed);
+
 /**
  * Get the thread ID of 'thread'.
  *
@@ -1098,6 +2904,28 @@ notmuch_thread_get_toplevel_messages (notmuch_thread_t *thread);
 notmuch_messages_t *
 notmuch_thread_get_messages (notmuch_thread_t *thread);
 
+/**
+ * Get a notmuch_messages_t iterator for a window of the messages in
+ * 'thread', in thread order: each top-level message, oldest first, is
+ * followed by its replies in the same order, each followed in turn by
+ * its own replies, as notmuch show prints them.
+ *
+ * The first 'offset' messages in that order are skipped, and at most
+ * 'limit' messages are returned, or all the rest if 'limit' is
+ * negative.  The window counts every message of the thread, matched
+ * or not.  Together with notmuch_message_get_replies, this lets a
+ * user interface open only the messages it is about to display.
+ *
+ * This returns NULL if the window holds no message.
+ *
+ * The returned list will be destroyed when the thread is destroyed.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_messages_t *
+notmuch_thread_get_messages_window (notmuch_thread_t *thread,
+				    unsigned int offset, int limit);
+
 /**
  * Get the number of messages in 'thread' that matched the search.
  *
@@ -1144,6 +2972,22 @@ notmuch_thread_get_authors (notmuch_thread_t *thread);
 const char *
 notmuch_thread_get_subject (notmuch_thread_t *thread);
 
+/**
+ * Get the body snippet of 'thread' as a UTF-8 string.
+ *
+ * The snippet is that of the first message (according to the query
+ * order---see notmuch_query_set_sort) in the query results that
+ * belongs to this thread; see notmuch_message_get_snippet.  It is
+ * read from the database when first asked for.
+ *
+ * The returned string belongs to 'thread', as for
+ * notmuch_thread_get_subject.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_thread_get_snippet (notmuch_thread_t *thread);
+
 /**
  * Get the date of the oldest message in 'thread' as a time_t value.
  */
@@ -1270,6 +3114,65 @@ notmuch_messages_destroy (notmuch_messages_t *messages);
 notmuch_tags_t *
 notmuch_messages_collect_tags (notmuch_messages_t *messages);
 
+/**
+ * Columns to fill in with notmuch_messages_get_columns.
+ *
+ * Each member is an array supplied by the caller, with room for as
+ * many results as asked for, or NULL if that column is not wanted.
+ * Only the wanted columns are read from the database.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+typedef struct {
+    /** As from notmuch_message_get_message_id */
+    const char **message_ids;
+    /** As from notmuch_message_get_thread_id */
+    const char **thread_ids;
+    /** As from notmuch_message_get_date */
+    time_t *dates;
+    /** The tags of each message, sorted, as a NULL-terminated array */
+    const char ***tags;
+    /** As from notmuch_message_get_flag with
+     * NOTMUCH_MESSAGE_FLAG_EXCLUDED */
+    notmuch_bool_t *excluded;
+} notmuch_message_columns_t;
+
+/**
+ * Fill in 'columns' for up to 'count' messages, starting at the
+ * current position of 'messages', and move 'messages' past them.
+ * '*filled' is set to the number of messages filled in, which is
+ * less than 'count' only at the end of 'messages'.
+ *
+ * This is equivalent to getting each message in turn and asking it
+ * for each wanted field, but for the results of
+ * notmuch_query_search_messages, no notmuch_message_t objects are
+ * created: the fields are read straight from the database, so a
+ * caller that wants only a few fields of many messages does much
+ * less work.  Message IDs, thread IDs and dates are kept in value
+ * slots, so when no other column is wanted the documents themselves
+ * are not fetched.
+ *
+ * The strings filled in belong to 'messages', and are valid until the
+ * next call of notmuch_messages_get_columns on it, or until it is
+ * destroyed.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Columns filled in.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred;
+ *	'*filled' messages were filled in before it.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_messages_get_columns (notmuch_messages_t *messages,
+			      notmuch_message_columns_t *columns,
+			      unsigned int count,
+			      unsigned int *filled);
+
 /**
  * Get the message ID of 'message'.
  *
@@ -1411,6 +3314,23 @@ notmuch_message_get_date  (notmuch_message_t *message);
 const char *
 notmuch_message_get_header (notmuch_message_t *message, const char *header);
 
+/**
+ * Get the body snippet of 'message', stored in the database when the
+ * message was added (see notmuch_database_set_snippet_length).  The
+ * message file is never read.
+ *
+ * The returned string belongs to the message so should not be
+ * modified or freed by the caller (nor should it be referenced after
+ * the message is destroyed).
+ *
+ * Returns an empty string ("") if the message has no snippet.
+ * Returns NULL if any error occurs.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_message_get_snippet (notmuch_message_t *message);
+
 /**
  * Get the tags for 'message', returning a notmuch_tags_t object which
  * can be used to iterate over all tags.
@@ -1498,6 +3418,75 @@ notmuch_message_remove_tag (notmuch_message_t *message, const char *tag);
 notmuch_status_t
 notmuch_message_remove_all_tags (notmuch_message_t *message);
 
+/**
+ * Add the given tag to the message if 'add' is TRUE, or remove it
+ * otherwise, without the write lock.
+ *
+ * On a writable database, this is notmuch_message_add_tag or
+ * notmuch_message_remove_tag.  On a read-only one, the change goes
+ * to the tag journal when the database is next flushed (see
+ * notmuch_database_flush_tag_journal), and is seen at once in the
+ * tags of messages from this database.  Maildir flags are not
+ * synchronized with journaled changes.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Tag successfully changed (or journaled)
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: The 'tag' argument is NULL
+ *
+ * NOTMUCH_STATUS_TAG_TOO_LONG: The length of 'tag' is too long
+ *	(exceeds NOTMUCH_TAG_MAX)
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_message_journal_tag (notmuch_message_t *message, const char *tag,
+			     notmuch_bool_t add);
+
+/**
+ * Index 'length' bytes of UTF-8 'text', extracted from an attachment
+ * of 'message', as part of its body.
+ *
+ * The text is found by searches for its words, as the body is, but
+ * not by phrases running into the rest of the message.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The text was indexed.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'text' is NULL.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so message cannot be modified.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_message_add_extracted_text (notmuch_message_t *message,
+				    const char *text, size_t length);
+
+/**
+ * Clear the mark of 'message' as pending extraction (see
+ * notmuch_database_set_extract_attachments), once the text of its
+ * attachments has been added, or found not to be worth adding.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The mark was cleared, or there was none.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so message cannot be modified.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_message_set_extraction_done (notmuch_message_t *message);
+
 /**
  * Add/remove tags according to maildir flags in the message filename(s).
  *
@@ -1570,6 +3559,37 @@ notmuch_message_maildir_flags_to_tags (notmuch_message_t *message);
 notmuch_status_t
 notmuch_message_tags_to_maildir_flags (notmuch_message_t *message);
 
+/**
+ * Rename the files of all messages matching 'query' to match their
+ * tags, like notmuch_message_tags_to_maildir_flags on each.
+ *
+ * The renames are worked out for a batch of messages at a time and
+ * carried out by up to 'jobs' threads at once.  Renames on network
+ * filesystems are bound by latency rather than by the processor, so
+ * more jobs than processors can help.  The new file names of each
+ * batch are then recorded in the database in one atomic section.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: All renames were recorded, or there were
+ *	none to do.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in
+ *	read-only mode so no message can be modified.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: a Xapian exception occured.
+ *
+ * As for notmuch_message_tags_to_maildir_flags, a file that cannot
+ * be renamed is left as it is, and is not an error.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_query_tags_to_maildir_flags (notmuch_query_t *query,
+				     unsigned int jobs);
+
 /**
  * Freeze the current state of 'message' within the database.
  *
@@ -1675,6 +3695,19 @@ notmuch_tags_valid (notmuch_tags_t *tags);
 const char *
 notmuch_tags_get (notmuch_tags_t *tags);
 
+/**
+ * Get the number of messages with the current tag of 'tags'.
+ *
+ * This is only known for tags from notmuch_database_get_tag_catalogue,
+ * notmuch_database_get_all_tags or notmuch_query_count_tags (where
+ * it counts the matches of the query); for others, and if 'tags' is
+ * not valid, this function returns 0.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+unsigned int
+notmuch_tags_get_count (notmuch_tags_t *tags);
+
 /**
  * Move the 'tags' iterator to the next tag.
  *
@@ -1750,6 +3783,70 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
 time_t
 notmuch_directory_get_mtime (notmuch_directory_t *directory);
 
+/**
+ * Store an mtime within the database for 'directory', like
+ * notmuch_directory_set_mtime, together with its nanoseconds, 'nsec'
+ * (as in the st_mtim of struct stat).  A negative 'nsec' stores the
+ * mtime to the second, as notmuch_directory_set_mtime does.
+ *
+ * Return value: as for notmuch_directory_set_mtime.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_directory_set_mtime_ns (notmuch_directory_t *directory,
+				time_t mtime, long nsec);
+
+/**
+ * Get the nanoseconds of the mtime of a directory, as stored with
+ * notmuch_directory_set_mtime_ns.
+ *
+ * Returns -1 if only seconds were stored, (by
+ * notmuch_directory_set_mtime, or an older notmuch), in which case
+ * the mtime can only be compared to the second.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+long
+notmuch_directory_get_mtime_nsec (notmuch_directory_t *directory);
+
+/**
+ * Store a manifest of the entries of 'directory', a string of the
+ * caller's choosing that changes whenever the entries do, such as
+ * their number and a hash of their names.  A NULL or empty string
+ * removes the manifest.
+ *
+ * This lets a caller recognise a directory whose mtime changed
+ * (or could not be trusted) but whose entries did not, and skip
+ * comparing them to the database.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: manifest successfully stored in database.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception
+ *	occurred, manifest not stored.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so the directory cannot be modified.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+notmuch_status_t
+notmuch_directory_set_manifest (notmuch_directory_t *directory,
+				const char *manifest);
+
+/**
+ * Get the manifest of a directory, as stored with
+ * notmuch_directory_set_manifest, or NULL if none was stored.
+ *
+ * The returned string belongs to 'directory'.
+ *
+ * @since libnotmuch 4.4 (notmuch 0.23)
+ */
+const char *
+notmuch_directory_get_manifest (notmuch_directory_t *directory);
+
 /**
  * Get a notmuch_filenames_t iterator listing all the filenames of
  * messages in the database within the given directory.
@@ -0,0 +1,134 @@
+/* profile.cc - Where the time of a query goes
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+/* The profile of a handle is only touched between a start and a stop
+ * on the thread using the handle, so, like the rest of the handle, it
+ * needs no locking.  Without a profile, the hooks cost a NULL
+ * check. */
+
+void
+notmuch_database_set_profile (notmuch_database_t *notmuch,
+			      notmuch_profile_t *profile)
+{
+    notmuch->profile = profile;
+}
+
+static double
+_timespec_seconds (const struct timespec *ts)
+{
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+void
+_notmuch_profile_start (notmuch_database_t *notmuch,
+			notmuch_profile_timer_t *timer)
+{
+    if (notmuch->profile == NULL)
+	return;
+
+    clock_gettime (CLOCK_MONOTONIC, &timer->wall);
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &timer->cpu);
+}
+
+void
+_notmuch_profile_stop (notmuch_database_t *notmuch,
+		       notmuch_profile_timer_t *timer,
+		       notmuch_profile_phase_id_t phase)
+{
+    notmuch_profile_t *profile = notmuch->profile;
+    notmuch_profile_phase_t *p;
+    struct timespec wall, cpu;
+
+    if (profile == NULL)
+	return;
+
+    clock_gettime (CLOCK_MONOTONIC, &wall);
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+    switch (phase) {
+    case NOTMUCH_PROFILE_PARSE:
+	p = &profile->parse;
+	break;
+    case NOTMUCH_PROFILE_EXCLUDE:
+	p = &profile->exclude;
+	break;
+    case NOTMUCH_PROFILE_MATCH:
+	p = &profile->match;
+	break;
+    case NOTMUCH_PROFILE_THREADS:
+	p = &profile->threads;
+	break;
+    case NOTMUCH_PROFILE_READ_HEADERS:
+	p = &profile->read_headers;
+	break;
+    case NOTMUCH_PROFILE_INDEX_TERMS:
+	p = &profile->index_terms;
+	break;
+    case NOTMUCH_PROFILE_LINK_THREADS:
+	p = &profile->link_threads;
+	break;
+    case NOTMUCH_PROFILE_WRITE_DOCUMENTS:
+	p = &profile->write_documents;
+	break;
+    case NOTMUCH_PROFILE_COMMIT:
+	p = &profile->commit;
+	break;
+    default:
+	INTERNAL_ERROR ("unknown profile phase %d", phase);
+    }
+
+    p->wall += _timespec_seconds (&wall) - _timespec_seconds (&timer->wall);
+    p->cpu += _timespec_seconds (&cpu) - _timespec_seconds (&timer->cpu);
+    p->calls++;
+}
+
+void
+_notmuch_profile_count (notmuch_database_t *notmuch,
+			notmuch_profile_counter_id_t counter,
+			unsigned long n)
+{
+    notmuch_profile_t *profile = notmuch->profile;
+
+    if (profile == NULL)
+	return;
+
+    switch (counter) {
+    case NOTMUCH_PROFILE_MATCHES:
+	profile->matches += n;
+	break;
+    case NOTMUCH_PROFILE_DOCUMENTS:
+	profile->documents += n;
+	break;
+    case NOTMUCH_PROFILE_THREADS_BUILT:
+	profile->threads_built += n;
+	break;
+    case NOTMUCH_PROFILE_FILES_OPENED:
+	profile->files_opened += n;
+	break;
+    case NOTMUCH_PROFILE_FLUSHES:
+	profile->flushes += n;
+	break;
+    default:
+	INTERNAL_ERROR ("unknown profile counter %d", counter);
+    }
+}
@@ -0,0 +1,270 @@
+/* query-cache.cc - On-disk cache of query counts
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <glib.h> /* GHashTable */
+
+/* The cache lives in a single text file, .notmuch/query-cache.  The
+ * first line identifies the database state the counts were computed
+ * against:
+ *
+ *	notmuch-query-cache 1 <uuid> <revision> <document count>
+ *
+ * and each following line holds one count:
+ *
+ *	<count> <hex-encoded key>
+ *
+ * The document count is part of the state because removing a message
+ * does not create a new revision.  If the state does not match the
+ * open database, the whole file is ignored, so invalidation costs
+ * nothing beyond reading the first line.
+ */
+
+#define NOTMUCH_QUERY_CACHE_FILE "query-cache"
+#define NOTMUCH_QUERY_CACHE_MAGIC "notmuch-query-cache 1"
+
+struct _notmuch_query_cache {
+    char *state;
+    /* Map from hex-encoded key to count; keys belong to the cache. */
+    GHashTable *counts;
+    notmuch_bool_t dirty;
+};
+
+static void
+_strip_newline (char *str)
+{
+    size_t len = strlen (str);
+
+    if (len && str[len - 1] == '\n')
+	str[len - 1] = '\0';
+}
+
+static int
+_notmuch_query_cache_destructor (notmuch_query_cache_t *cache)
+{
+    if (cache->counts)
+	g_hash_table_unref (cache->counts);
+
+    return 0;
+}
+
+static char *
+_notmuch_query_cache_path (void *ctx, notmuch_database_t *notmuch)
+{
+    return talloc_asprintf (ctx, "%s/.notmuch/%s", notmuch->path,
+			    NOTMUCH_QUERY_CACHE_FILE);
+}
+
+/* Return the state line for the database as currently open, or NULL
+ * if its results cannot be cached. */
+static char *
+_notmuch_query_cache_state (void *ctx, notmuch_database_t *notmuch)
+{
+    /* Without modification tracking, the revision never changes, and
+     * a writer may change the database under our feet.  Nor does it
+     * change with the tag journal. */
+    if (! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD) ||
+	notmuch->mode != NOTMUCH_DATABASE_MODE_READ_ONLY ||
+	_notmuch_database_has_tag_journal (notmuch))
+	return NULL;
+
+    try {
+	return talloc_asprintf (ctx, "%s %s %lu %u",
+				NOTMUCH_QUERY_CACHE_MAGIC,
+				notmuch->uuid, notmuch->revision,
+				notmuch->xapian_db->get_doccount ());
+    } catch (const Xapian::Error &error) {
+	return NULL;
+    }
+}
+
+static void
+_notmuch_query_cache_load (notmuch_query_cache_t *cache,
+			   notmuch_database_t *notmuch)
+{
+    char *path = _notmuch_query_cache_path (cache, notmuch);
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    FILE *file;
+
+    file = fopen (path, "r");
+    talloc_free (path);
+    if (file == NULL)
+	return;
+
+    line_len = getline (&line, &line_size, file);
+    if (line_len <= 0)
+	goto DONE;
+    _strip_newline (line);
+    if (strcmp (line, cache->state) != 0)
+	goto DONE;
+
+    while ((line_len = getline (&line, &line_size, file)) != -1) {
+	char *key;
+	unsigned long count;
+
+	_strip_newline (line);
+	count = strtoul (line, &key, 10);
+	if (*key != ' ' || *(key + 1) == '\0')
+	    continue;
+
+	g_hash_table_insert (cache->counts,
+			     talloc_strdup (cache, key + 1),
+			     GUINT_TO_POINTER (count));
+    }
+
+  DONE:
+    free (line);
+    fclose (file);
+}
+
+/* Return the cache for 'notmuch', loading it on first use, or NULL if
+ * the cache is disabled or unusable for this database. */
+static notmuch_query_cache_t *
+_notmuch_query_cache_get (notmuch_database_t *notmuch)
+{
+    notmuch_query_cache_t *cache;
+    char *state;
+
+    if (! notmuch->query_cache_enabled)
+	return NULL;
+
+    if (notmuch->query_cache)
+	return notmuch->query_cache;
+
+    state = _notmuch_query_cache_state (notmuch, notmuch);
+    if (state == NULL)
+	return NULL;
+
+    cache = talloc (notmuch, notmuch_query_cache_t);
+    if (unlikely (cache == NULL)) {
+	talloc_free (state);
+	return NULL;
+    }
+
+    cache->state = talloc_steal (cache, state);
+    cache->counts = g_hash_table_new (g_str_hash, g_str_equal);
+    cache->dirty = FALSE;
+    talloc_set_destructor (cache, _notmuch_query_cache_destructor);
+
+    _notmuch_query_cache_load (cache, notmuch);
+
+    notmuch->query_cache = cache;
+    return cache;
+}
+
+notmuch_bool_t
+_notmuch_query_cache_lookup (notmuch_database_t *notmuch,
+			     const char *key,
+			     unsigned int *count_out)
+{
+    notmuch_query_cache_t *cache = _notmuch_query_cache_get (notmuch);
+    gpointer count;
+
+    if (cache == NULL || key == NULL)
+	return FALSE;
+
+    if (! g_hash_table_lookup_extended (cache->counts, key, NULL, &count))
+	return FALSE;
+
+    *count_out = GPOINTER_TO_UINT (count);
+    return TRUE;
+}
+
+void
+_notmuch_query_cache_store (notmuch_database_t *notmuch,
+			    const char *key,
+			    unsigned int count)
+{
+    notmuch_query_cache_t *cache = _notmuch_query_cache_get (notmuch);
+    gpointer stored_key, stored_count;
+
+    if (cache == NULL || key == NULL)
+	return;
+
+    /* The keys belong to the cache until it is closed, so a key
+     * stored again keeps its first copy. */
+    if (g_hash_table_lookup_extended (cache->counts, key,
+				      &stored_key, &stored_count)) {
+	if (GPOINTER_TO_UINT (stored_count) == count)
+	    return;
+	g_hash_table_insert (cache->counts, stored_key,
+			     GUINT_TO_POINTER (count));
+    } else {
+	g_hash_table_insert (cache->counts, talloc_strdup (cache, key),
+			     GUINT_TO_POINTER (count));
+    }
+    cache->dirty = TRUE;
+}
+
+/* Write out the cache if anything was added to it.  Failing to write
+ * the cache is not an error; the counts will simply be recomputed
+ * next time. */
+void
+_notmuch_query_cache_flush (notmuch_database_t *notmuch)
+{
+    notmuch_query_cache_t *cache = notmuch->query_cache;
+    void *local;
+    char *path, *tmp_path;
+    GHashTableIter iter;
+    gpointer key, count;
+    notmuch_bool_t failed;
+    FILE *file;
+
+    if (cache == NULL || ! cache->dirty)
+	return;
+
+    local = talloc_new (NULL);
+    path = _notmuch_query_cache_path (local, notmuch);
+    tmp_path = talloc_asprintf (local, "%s.%d", path, (int) getpid ());
+
+    file = fopen (tmp_path, "w");
+    if (file == NULL)
+	goto DONE;
+
+    fprintf (file, "%s\n", cache->state);
+
+    g_hash_table_iter_init (&iter, cache->counts);
+    while (g_hash_table_iter_next (&iter, &key, &count))
+	fprintf (file, "%u %s\n", GPOINTER_TO_UINT (count), (char *) key);
+
+    failed = ferror (file);
+    if (fclose (file) != 0)
+	failed = TRUE;
+
+    if (failed || rename (tmp_path, path) != 0)
+	unlink (tmp_path);
+    else
+	cache->dirty = FALSE;
+
+  DONE:
+    talloc_free (local);
+}
+
+notmuch_status_t
+notmuch_database_set_query_cache (notmuch_database_t *notmuch,
+				  notmuch_bool_t enable)
+{
+    notmuch->query_cache_enabled = enable;
+    return NOTMUCH_STATUS_SUCCESS;
+}
@@ -20,44 +20,350 @@
 
 #include "notmuch-private.h"
 #include "database-private.h"
+#include "parse-time-string.h"
 
 #include <glib.h> /* GHashTable, GPtrArray */
 
+#include <algorithm>
+#include <map>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* A parse of the query string, which stays good for as long as the
+ * handle parses the same expanded string with the same flags, over
+ * the same view of the database: Xapian expands wildcards against
+ * the terms of the database as it parses. */
+typedef struct _notmuch_parsed_query {
+    Xapian::Query *xquery;
+    const char *expanded;
+    unsigned int flags;
+    unsigned int parse_generation;
+} notmuch_parsed_query_t;
+
 struct _notmuch_query {
     notmuch_database_t *notmuch;
     const char *query_string;
     notmuch_sort_t sort;
     notmuch_string_list_t *exclude_terms;
     notmuch_exclude_t omit_excluded;
+
+    /* Window of message results requested by the caller.  A negative
+     * limit means "no limit". */
+    unsigned int offset;
+    int limit;
+
+    /* notmuch_field_t values the caller will use from each message. */
+    unsigned int fields;
+
+    /* If not NULL, further restrict document searches to documents
+     * carrying any of these terms. */
+    notmuch_string_list_t *filter_terms;
+
+    /* If TRUE, document searches return only the first match of each
+     * thread; see _notmuch_query_can_collapse_threads. */
+    notmuch_bool_t collapse_threads;
+
+    /* The seconds each search may take (0 for no limit), the
+     * CLOCK_MONOTONIC time by which the current one has to finish (0
+     * for none), and the caller's cancellation flag, or NULL.  Only
+     * searches for the caller are bounded; counting and tagging
+     * always run to completion. */
+    double budget;
+    double deadline;
+    const volatile int *cancel;
+    notmuch_bool_t bounded;
+    /* TRUE once the current search has been stopped early. */
+    notmuch_bool_t interrupted;
+    /* The error that ended the iterator of the current search early,
+     * if any. */
+    notmuch_status_t status;
+
+    /* The query string as last parsed, or NULL; see
+     * _notmuch_query_string_query. */
+    notmuch_parsed_query_t *parsed;
 };
 
+/* Rather than asking Xapian for an MSet covering every match up
+ * front, we fetch results in windows, starting small so that the
+ * first results are available quickly, and doubling the window each
+ * time it is exhausted so that walking a large result set still only
+ * takes a logarithmic number of matcher runs. */
+#define NOTMUCH_MSET_WINDOW_MIN 1000
+#define NOTMUCH_MSET_WINDOW_MAX (1 << 17)
+
+/* The messages returned by an iterator are allocated from a talloc
+ * pool of this size.  A caller that destroys each message before
+ * getting the next one gives its memory straight back to the pool,
+ * so walking a large result set does not go through malloc for every
+ * message, nor for the strings it decodes.  A message kept beyond the
+ * iterator (as threads keep theirs) keeps the whole pool alive, so
+ * the pool is kept small. */
+#define NOTMUCH_MESSAGE_POOL_SIZE (16 * 1024)
+
 typedef struct _notmuch_mset_messages {
     notmuch_messages_t base;
     notmuch_database_t *notmuch;
+    /* The query whose deadline the windows are fetched against. */
+    notmuch_query_t *query;
+    /* The archive shards the query runs against, if not all of
+     * them. */
+    notmuch_archive_route_t *route;
+    Xapian::Enquire *enquire;
+    Xapian::MSet mset;
     Xapian::MSetIterator iterator;
     Xapian::MSetIterator iterator_end;
+    /* Position of the first entry of mset within the full result
+     * set. */
+    Xapian::doccount mset_offset;
+    /* Number of results requested for the next window. */
+    Xapian::doccount window;
+    /* Number of results still allowed by the caller's limit, or -1
+     * for no limit. */
+    long remaining;
+    /* TRUE once Xapian has returned fewer results than requested. */
+    notmuch_bool_t exhausted;
+    /* Field hint given to each message created. */
+    unsigned int fields;
+    /* For NOTMUCH_EXCLUDE_FLAG, the posting source that gives
+     * excluded messages a non-zero weight, or NULL. */
+    Xapian::PostingSource *exclude_source;
+    /* If not NULL, the results read straight off the posting list of
+     * the type term rather than through enquire, and the position of
+     * the current one. */
+    std::vector<Xapian::docid> *scan;
+    size_t scan_position;
+    /* Index in mset of the first entry whose document has not been
+     * asked to be fetched ahead. */
+    Xapian::doccount prefetched;
+    /* The talloc pool the messages are allocated from, created with
+     * the first of them. */
+    void *pool;
+    /* For a read-only database, what it takes to start again when
+     * the database is modified under the iterator (see
+     * _notmuch_mset_messages_restart): the offset and limit asked
+     * for, the number of results moved past, and either the doc id
+     * of the last of them, where the results are in doc id order, or
+     * else all of their doc ids.  Once restarted, those are skipped,
+     * and 'skip' holds the second kind. */
+    Xapian::doccount first_offset;
+    long limit;
+    unsigned long returned_count;
+    Xapian::docid last_returned;
+    GArray *returned;
+    notmuch_bool_t restarted;
+    notmuch_doc_id_set_t *skip;
+    /* Retries of the read under way (see
+     * _notmuch_database_reopen_modified), back to zero once a read
+     * succeeds, so that the budget is per read rather than for the
+     * life of the iterator. */
+    unsigned int modified_retries;
 } notmuch_mset_messages_t;
 
-struct _notmuch_doc_id_set {
+/* A posting source matching every document carrying any of a set of
+ * terms, with a weight of 1.
+ *
+ * Combined with the main query through OP_AND_MAYBE under
+ * BoolWeight, this makes the weight of each match tell whether it is
+ * excluded, so that NOTMUCH_EXCLUDE_FLAG queries can flag excluded
+ * messages in the same matcher run that produces them. */
+class ExcludedTermsPostingSource : public Xapian::PostingSource {
+    std::vector<std::string> terms;
+    std::vector<Xapian::PostingIterator> its, ends;
+    Xapian::Database db;
+    Xapian::docid current;
+    bool started;
+
+    void start () {
+	its.clear ();
+	ends.clear ();
+	for (size_t i = 0; i < terms.size (); i++) {
+	    its.push_back (db.postlist_begin (terms[i]));
+	    ends.push_back (db.postlist_end (terms[i]));
+	}
+	started = true;
+    }
+
+    void update_current () {
+	current = 0;
+	for (size_t i = 0; i < its.size (); i++) {
+	    if (its[i] != ends[i] && (current == 0 || *its[i] < current))
+		current = *its[i];
+	}
+    }
+
+  public:
+    ExcludedTermsPostingSource (const std::vector<std::string> &terms_)
+	: terms (terms_), current (0), started (false) { }
+
+    void init (const Xapian::Database &db_) {
+	db = db_;
+	current = 0;
+	started = false;
+	set_maxweight (1.0);
+    }
+
+    Xapian::doccount get_termfreq_min () const {
+	Xapian::doccount freq = 0;
+	for (size_t i = 0; i < terms.size (); i++)
+	    freq = std::max (freq, db.get_termfreq (terms[i]));
+	return freq;
+    }
+
+    Xapian::doccount get_termfreq_max () const {
+	Xapian::doccount freq = 0;
+	for (size_t i = 0; i < terms.size (); i++)
+	    freq += db.get_termfreq (terms[i]);
+	return std::min (freq, db.get_doccount ());
+    }
+
+    Xapian::doccount get_termfreq_est () const {
+	return get_termfreq_max ();
+    }
+
+    Xapian::weight get_weight () const {
+	return 1.0;
+    }
+
+    void next (Xapian::weight) {
+	if (! started) {
+	    start ();
+	} else {
+	    for (size_t i = 0; i < its.size (); i++) {
+		if (its[i] != ends[i] && *its[i] == current)
+		    ++its[i];
+	    }
+	}
+	update_current ();
+    }
+
+    void skip_to (Xapian::docid did, Xapian::weight) {
+	if (! started)
+	    start ();
+	for (size_t i = 0; i < its.size (); i++) {
+	    if (its[i] != ends[i] && *its[i] < did)
+		its[i].skip_to (did);
+	}
+	update_current ();
+    }
+
+    bool at_end () const {
+	return started && current == 0;
+    }
+
+    Xapian::docid get_docid () const {
+	return current;
+    }
+
+    /* Sub-databases combined with add_database, such as archive
+     * shards, each get a clone. */
+    Xapian::PostingSource *clone () const {
+	return new ExcludedTermsPostingSource (terms);
+    }
+
+    std::string get_description () const {
+	return "ExcludedTermsPostingSource";
+    }
+};
+
+/* A set of doc ids is split into blocks by the high bits of each doc
+ * id.  Each non-empty block is stored either as a sorted array of the
+ * low bits, while it is sparse, or as a bitmap, once the array would
+ * be larger than the bitmap.  This keeps a set small no matter how
+ * large the doc ids in it are, while dense blocks remain a single
+ * bit test to probe. */
+#define DOCIDSET_BLOCK_BITS 16
+#define DOCIDSET_BLOCK_SIZE (1u << DOCIDSET_BLOCK_BITS)
+#define DOCIDSET_BLOCK_MASK (DOCIDSET_BLOCK_SIZE - 1)
+#define DOCIDSET_ARRAY_MAX (DOCIDSET_BLOCK_SIZE / CHAR_BIT / sizeof (uint16_t))
+
+typedef struct _notmuch_doc_id_block {
+    /* The high bits shared by all doc ids in this block. */
+    unsigned int key;
+    /* For array blocks, the sorted low bits and their number;
+     * NULL for bitmap blocks. */
+    uint16_t *array;
+    unsigned int count;
+    /* For bitmap blocks, one bit per low value. */
     unsigned char *bitmap;
-    unsigned int bound;
+} notmuch_doc_id_block_t;
+
+struct _notmuch_doc_id_set {
+    /* Sorted by key. */
+    notmuch_doc_id_block_t *blocks;
+    unsigned int n_blocks;
+    /* The block found by the last lookup; callers tend to probe
+     * nearby doc ids in a row. */
+    unsigned int last_block;
 };
 
 #define DOCIDSET_WORD(bit) ((bit) / CHAR_BIT)
 #define DOCIDSET_BIT(bit) ((bit) % CHAR_BIT)
 
+/* A thread of execution creating part of a batch of threads on its
+ * own read-only handle on the database.  The threads it creates
+ * belong to that handle until they are returned. */
+typedef struct _notmuch_threads_worker {
+    notmuch_database_t *notmuch;
+    notmuch_query_t *query;
+    /* The part of the batch to create, and the query's matches, of
+     * which the worker removes those of its threads. */
+    const char **thread_ids;
+    notmuch_thread_t **threads_out;
+    unsigned int count;
+    notmuch_doc_id_set_t match_set;
+    notmuch_status_t status;
+#if HAVE_PTHREAD
+    pthread_t thread;
+#endif
+} notmuch_threads_worker_t;
+
 struct visible _notmuch_threads {
     notmuch_query_t *query;
 
-    /* The ordered list of doc ids matched by the query. */
-    GArray *doc_ids;
-    /* Our iterator's current position in doc_ids. */
-    unsigned int doc_id_pos;
-    /* The set of matched docid's that have not been assigned to a
-     * thread. Initially, this contains every docid in doc_ids. */
-    notmuch_doc_id_set_t match_set;
+    /* The messages matched by the query, in the query's order.  Each
+     * thread is seeded by the first of its messages in this stream,
+     * so the stream is only consumed as far as the threads returned
+     * so far require.  Where it can, Xapian leaves out all but that
+     * first message of each thread. */
+    notmuch_messages_t *messages;
+    /* Thread IDs of the threads already taken from the stream. */
+    GHashTable *seen;
+
+    /* Threads created ahead of time by a single batched query, in
+     * the order they will be returned, along with the doc id of the
+     * message that seeded each of them.  batch_match_set holds the
+     * messages of those threads that match the query and have not
+     * been assigned to a thread yet.  All of these belong to
+     * batch_ctx.  batch_pos is the next thread to return; the batch
+     * is pending while batch_pos < batch_len. */
+    void *batch_ctx;
+    notmuch_thread_t **batch;
+    unsigned int *batch_seed;
+    notmuch_doc_id_set_t batch_match_set;
+    unsigned int batch_len;
+    unsigned int batch_pos;
+
+    /* The number of threads of the query's offset still to skip, and
+     * of its limit still to create (negative for no limit). */
+    unsigned int skip;
+    int remaining;
+    /* TRUE once creating a batch failed, which ends the threads. */
+    notmuch_bool_t failed;
+
+    /* Set by notmuch_threads_set_jobs.  The workers are opened with
+     * the first batch and belong to the query, as the threads they
+     * create refer to their handles. */
+    unsigned int jobs;
+    notmuch_threads_worker_t *workers;
+    unsigned int num_workers;
 };
 
+/* The maximum number of threads taken from the message stream and
+ * materialized by a single query. */
+#define NOTMUCH_THREAD_BATCH_SIZE 32
+
 /* We need this in the message functions so forward declare. */
 static notmuch_bool_t
 _notmuch_doc_id_set_init (void *ctx,
@@ -94,6 +400,30 @@ notmuch_query_create (notmuch_database_t *notmuch,
 
     query->omit_excluded = NOTMUCH_EXCLUDE_TRUE;
 
+    query->offset = 0;
+
+    query->limit = -1;
+
+    query->fields = NOTMUCH_FIELD_ALL;
+
+    query->filter_terms = NULL;
+
+    query->collapse_threads = FALSE;
+
+    query->budget = 0;
+
+    query->deadline = 0;
+
+    query->cancel = NULL;
+
+    query->bounded = FALSE;
+
+    query->interrupted = FALSE;
+
+    query->status = NOTMUCH_STATUS_SUCCESS;
+
+    query->parsed = NULL;
+
     return query;
 }
 
@@ -122,13 +452,118 @@ notmuch_query_get_sort (const notmuch_query_t *query)
     return query->sort;
 }
 
+void
+notmuch_query_set_offset (notmuch_query_t *query, unsigned int offset)
+{
+    query->offset = offset;
+}
+
+void
+notmuch_query_set_limit (notmuch_query_t *query, int limit)
+{
+    query->limit = limit;
+}
+
+void
+notmuch_query_set_fields (notmuch_query_t *query, unsigned int fields)
+{
+    query->fields = fields;
+}
+
+/* TRUE if the caller of a thread search only needs the summaries of
+ * the threads, not their messages. */
+static notmuch_bool_t
+_notmuch_query_summary_only (notmuch_query_t *query)
+{
+    return (query->fields & ~NOTMUCH_FIELD_THREAD_SUMMARY) == 0;
+}
+
 void
 notmuch_query_add_tag_exclude (notmuch_query_t *query, const char *tag)
 {
-    char *term = talloc_asprintf (query, "%s%s", _find_prefix ("tag"), tag);
+    char *term = talloc_asprintf (query, "%s%s", NOTMUCH_PREFIX_TAG, tag);
     _notmuch_string_list_append (query->exclude_terms, term);
 }
 
+void
+notmuch_query_set_deadline (notmuch_query_t *query, double seconds)
+{
+    query->budget = seconds > 0 ? seconds : 0;
+}
+
+void
+notmuch_query_set_cancel (notmuch_query_t *query, const volatile int *cancel)
+{
+    query->cancel = cancel;
+}
+
+notmuch_status_t
+notmuch_query_get_status (notmuch_query_t *query)
+{
+    return query->interrupted ? NOTMUCH_STATUS_QUERY_INTERRUPTED :
+	query->status;
+}
+
+static double
+_notmuch_query_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Start the clock of a search of 'query' asked for by the caller.
+ * The searches the library runs on its own behalf while the caller
+ * walks the results count against the same deadline. */
+static notmuch_status_t
+_notmuch_query_start_search (notmuch_query_t *query)
+{
+    query->bounded = TRUE;
+    query->interrupted = FALSE;
+    query->status = NOTMUCH_STATUS_SUCCESS;
+    query->deadline = query->budget ? _notmuch_query_now () + query->budget : 0;
+
+    if (query->cancel && *query->cancel) {
+	query->interrupted = TRUE;
+	return NOTMUCH_STATUS_QUERY_INTERRUPTED;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Start a search of 'query' that has to see every match. */
+static void
+_notmuch_query_start_unbounded (notmuch_query_t *query)
+{
+    query->bounded = FALSE;
+    query->interrupted = FALSE;
+    query->status = NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Return the seconds left to the current search of 'query', or 0 for
+ * no deadline; once it has passed, or the search has been cancelled,
+ * mark the search interrupted and return a negative number. */
+static double
+_notmuch_query_time_left (notmuch_query_t *query)
+{
+    double left = 0;
+
+    if (! query->bounded)
+	return 0;
+
+    if (! query->interrupted && query->cancel && *query->cancel)
+	query->interrupted = TRUE;
+
+    if (! query->interrupted && query->deadline) {
+	left = query->deadline - _notmuch_query_now ();
+	if (left <= 0)
+	    query->interrupted = TRUE;
+    }
+
+    return query->interrupted ? -1 : left;
+}
+
 /* We end up having to call the destructors explicitly because we had
  * to use "placement new" in order to initialize C++ objects within a
  * block that we allocated with talloc. So C++ is making talloc
@@ -140,7 +575,201 @@ _notmuch_messages_destructor (notmuch_mset_messages_t *messages)
 {
     messages->iterator.~MSetIterator ();
     messages->iterator_end.~MSetIterator ();
+    messages->mset.~MSet ();
+    delete messages->scan;
+    delete messages->enquire;
+    delete messages->exclude_source;
+    _notmuch_archive_route_destroy (messages->route);
+    if (messages->returned)
+	g_array_free (messages->returned, TRUE);
+
+    return 0;
+}
+
+/* Fetch the window of results starting at messages->mset_offset and
+ * point the iterator at its first entry.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static void
+_notmuch_mset_messages_fetch_window (notmuch_mset_messages_t *messages)
+{
+    Xapian::doccount count = messages->window;
+
+    if (messages->remaining >= 0 &&
+	(unsigned long) messages->remaining < count)
+	count = messages->remaining;
+
+    if (count == 0 || _notmuch_query_time_left (messages->query) < 0) {
+	messages->mset = Xapian::MSet ();
+	messages->exhausted = TRUE;
+    } else {
+	notmuch_profile_timer_t timer;
+
+#if HAVE_XAPIAN_TIME_LIMIT
+	/* A non-zero limit cannot take effect before the deadline;
+	 * zero clears the limit of an earlier window. */
+	messages->enquire->set_time_limit (
+	    _notmuch_query_time_left (messages->query));
+#endif
+	_notmuch_profile_start (messages->notmuch, &timer);
+	messages->mset = messages->enquire->get_mset (messages->mset_offset,
+						      count);
+	_notmuch_profile_stop (messages->notmuch, &timer,
+			       NOTMUCH_PROFILE_MATCH);
+	_notmuch_profile_count (messages->notmuch, NOTMUCH_PROFILE_MATCHES,
+				messages->mset.size ());
+	/* Stopped by its time limit, Xapian returns what it had
+	 * found; nothing after it can be trusted to be in order. */
+	if (messages->mset.size () < count ||
+	    _notmuch_query_time_left (messages->query) < 0)
+	    messages->exhausted = TRUE;
+    }
+
+    if (messages->remaining >= 0)
+	messages->remaining -= messages->mset.size ();
+
+    messages->iterator = messages->mset.begin ();
+    messages->iterator_end = messages->mset.end ();
+    messages->prefetched = 0;
+}
 
+notmuch_status_t
+notmuch_database_set_prefetch (notmuch_database_t *notmuch,
+			       unsigned int documents)
+{
+    notmuch->prefetch = documents;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* The flags to parse query strings with.  Where message bodies are
+ * indexed without positions (NOTMUCH_FEATURE_BODY_NO_POSITIONS), a
+ * phrase could never match body text, so quoted phrases are parsed
+ * as their words instead, and match the messages with all of them. */
+static unsigned int
+_notmuch_query_parser_flags (notmuch_database_t *notmuch)
+{
+    unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
+			  Xapian::QueryParser::FLAG_PHRASE |
+			  Xapian::QueryParser::FLAG_LOVEHATE |
+			  Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
+			  Xapian::QueryParser::FLAG_WILDCARD |
+			  Xapian::QueryParser::FLAG_PURE_NOT);
+
+    if (notmuch->features & NOTMUCH_FEATURE_BODY_NO_POSITIONS)
+	flags &= ~Xapian::QueryParser::FLAG_PHRASE;
+
+    return flags;
+}
+
+/* The query string as Xapian is to parse it: with the thread aliases
+ * and the directories below recursive path: terms spelled out, and
+ * the tag changes journaled by readers applied. */
+static const char *
+_notmuch_query_expand_string (notmuch_database_t *notmuch,
+			      notmuch_query_t *query,
+			      const char *query_string)
+{
+    query_string = _notmuch_database_expand_thread_aliases (
+	notmuch, query, query_string);
+
+    query_string = _notmuch_database_expand_path_subtrees (
+	notmuch, query, query_string);
+
+    return _notmuch_database_expand_tag_journal (notmuch, query,
+						 query_string);
+}
+
+static int
+_notmuch_parsed_query_destructor (notmuch_parsed_query_t *parsed)
+{
+    delete parsed->xquery;
+    return 0;
+}
+
+/* Return the Xapian query for the query string of 'query', which the
+ * caller has checked is neither "" nor "*".
+ *
+ * The parse is kept with 'query', so that counting a query and
+ * searching it, or searching it again with another sort, offset or
+ * limit, parses the string only once.  Thread aliases and journaled
+ * tags are expanded each time, which is cheap, and a different
+ * expansion, other parser flags or any change to the database seen
+ * by the handle since (see notmuch->parse_generation) makes for a
+ * new parse.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static Xapian::Query
+_notmuch_query_string_query (notmuch_query_t *query)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    notmuch_parsed_query_t *parsed = query->parsed;
+    unsigned int flags = _notmuch_query_parser_flags (notmuch);
+    const char *expanded;
+    notmuch_profile_timer_t timer;
+    Xapian::Query xquery;
+
+    expanded = _notmuch_query_expand_string (notmuch, query,
+					     query->query_string);
+
+    if (parsed && parsed->flags == flags &&
+	parsed->parse_generation == notmuch->parse_generation &&
+	strcmp (parsed->expanded, expanded) == 0)
+	return *parsed->xquery;
+
+    _notmuch_profile_start (notmuch, &timer);
+    xquery = _notmuch_database_get_query_parser (notmuch)->parse_query (
+	expanded, flags);
+    _notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_PARSE);
+
+    talloc_free (query->parsed);
+    query->parsed = NULL;
+
+    /* Without memory for the cache, the next search parses again. */
+    parsed = talloc (query, notmuch_parsed_query_t);
+    if (unlikely (parsed == NULL))
+	return xquery;
+    parsed->expanded = talloc_strdup (parsed, expanded);
+    if (unlikely (parsed->expanded == NULL)) {
+	talloc_free (parsed);
+	return xquery;
+    }
+    parsed->xquery = new Xapian::Query (xquery);
+    parsed->flags = flags;
+    parsed->parse_generation = notmuch->parse_generation;
+    talloc_set_destructor (parsed, _notmuch_parsed_query_destructor);
+    query->parsed = parsed;
+
+    return xquery;
+}
+
+notmuch_status_t
+notmuch_query_prepare (notmuch_query_t *query)
+{
+    const char *query_string = query->query_string;
+
+    if (strcmp (query_string, "") == 0 ||
+	strcmp (query_string, "*") == 0)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    try {
+	_notmuch_query_string_query (query);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (query->notmuch,
+			       "A Xapian exception occurred parsing query: %s\n"
+			       "Query string was: %s\n",
+			       error.get_msg().c_str(),
+			       query_string);
+	query->notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+static int
+_notmuch_posting_source_destructor (Xapian::PostingSource **source)
+{
+    delete *source;
     return 0;
 }
 
@@ -148,11 +777,18 @@ _notmuch_messages_destructor (notmuch_mset_messages_t *messages)
  * registered with query.  Any tags that explicitly appear in xquery
  * will not be excluded, and will be removed from the list of exclude
  * tags.  The caller of this function has to combine the returned
- * query appropriately.*/
+ * query appropriately.
+ *
+ * Where the returned query runs against the whole of xapian_db
+ * ('route' is NULL), it may use the cached set of the excluded
+ * messages, which then lasts as long as 'query'. */
 static Xapian::Query
-_notmuch_exclude_tags (notmuch_query_t *query, Xapian::Query xquery)
+_notmuch_exclude_tags (notmuch_query_t *query, Xapian::Query xquery,
+		       notmuch_archive_route_t *route)
 {
     Xapian::Query exclude_query = Xapian::Query::MatchNothing;
+    std::vector<std::string> exclude_terms;
+    Xapian::PostingSource *source, **holder;
 
     for (notmuch_string_node_t *term = query->exclude_terms->head; term;
 	 term = term->next) {
@@ -162,13 +798,107 @@ _notmuch_exclude_tags (notmuch_query_t *query, Xapian::Query xquery)
 	    if ((*it).compare (term->string) == 0)
 		break;
 	}
-	if (it == end)
+	if (it == end) {
 	    exclude_query = Xapian::Query (Xapian::Query::OP_OR,
 				    exclude_query, Xapian::Query (term->string));
-	else
+	    exclude_terms.push_back (term->string);
+	} else {
 	    term->string = talloc_strdup (query, "");
+	}
+    }
+
+    if (route || exclude_terms.empty ())
+	return exclude_query;
+
+    source = _notmuch_exclude_cache_source (query->notmuch, exclude_terms);
+    if (source == NULL)
+	return exclude_query;
+
+    holder = talloc (query, Xapian::PostingSource *);
+    if (unlikely (holder == NULL)) {
+	delete source;
+	return exclude_query;
+    }
+    *holder = source;
+    talloc_set_destructor (holder, _notmuch_posting_source_destructor);
+
+    return Xapian::Query (source);
+}
+
+/* Return TRUE if the matches of 'query' can be collapsed on
+ * NOTMUCH_VALUE_THREAD_ID, keeping the first match of each thread in
+ * the query's order; with value sorting, that is the match Xapian
+ * keeps.  Requires NOTMUCH_FEATURE_THREAD_ID_VALUES, and that no
+ * threads have been merged, as messages of merged threads still
+ * carry the old thread ID, in their value as in their terms. */
+static notmuch_bool_t
+_notmuch_query_can_collapse_threads (notmuch_query_t *query)
+{
+    return ((query->notmuch->features & NOTMUCH_FEATURE_THREAD_ID_VALUES) &&
+	    ! _notmuch_database_has_thread_aliases (query->notmuch));
+}
+
+/* Return TRUE if 'query' matches every document of its type in
+ * document ID order, so that its results are exactly the posting list
+ * of the type term.  Walking that list directly saves the matcher and
+ * the MSet windows, which is most of the cost of a whole-database
+ * dump. */
+static notmuch_bool_t
+_notmuch_query_is_scan (notmuch_query_t *query)
+{
+    if (strcmp (query->query_string, "") != 0 &&
+	strcmp (query->query_string, "*") != 0)
+	return FALSE;
+
+    if (query->sort != NOTMUCH_SORT_UNSORTED || query->filter_terms ||
+	query->collapse_threads)
+	return FALSE;
+
+    return (query->omit_excluded == NOTMUCH_EXCLUDE_FALSE ||
+	    query->exclude_terms->head == NULL);
+}
+
+/* Read the posting list of 'type_term' for
+ * _notmuch_query_search_documents_window.  It is read in full before
+ * any result is returned, as the caller may change the documents on
+ * it as it goes; at four bytes a message, that is cheap.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static void
+_notmuch_mset_messages_start_scan (notmuch_mset_messages_t *messages,
+				   const std::string &type_term,
+				   unsigned int offset)
+{
+    Xapian::Database *db = messages->notmuch->xapian_db;
+    Xapian::PostingIterator i, end;
+
+    messages->scan = new std::vector<Xapian::docid>;
+    messages->scan->reserve (db->get_termfreq (type_term));
+
+    end = db->postlist_end (type_term);
+    for (i = db->postlist_begin (type_term); i != end; i++) {
+	if (offset > 0) {
+	    offset--;
+	    continue;
+	}
+	if (messages->remaining >= 0 &&
+	    messages->scan->size () >= (unsigned long) messages->remaining)
+	    break;
+	messages->scan->push_back (*i);
     }
-    return exclude_query;
+    messages->scan_position = 0;
+}
+
+/* Return TRUE if the results of 'messages' come in doc id order, so
+ * that those returned so far are the ones up to the last of them.
+ * Under BoolWeight, unsorted matches are in doc id order unless the
+ * exclude posting source gives some of them more weight, or they
+ * are numbered by the databases of an archive route. */
+static notmuch_bool_t
+_notmuch_mset_messages_in_doc_id_order (notmuch_mset_messages_t *messages)
+{
+    return (messages->query->sort == NOTMUCH_SORT_UNSORTED &&
+	    messages->exclude_source == NULL && messages->route == NULL);
 }
 
 notmuch_messages_t *
@@ -187,60 +917,159 @@ notmuch_status_t
 notmuch_query_search_messages_st (notmuch_query_t *query,
 				  notmuch_messages_t **out)
 {
-    return _notmuch_query_search_documents (query, "mail", out);
+    notmuch_status_t status;
+
+    status = _notmuch_query_start_search (query);
+    if (status)
+	return status;
+
+    return _notmuch_query_search_documents_window (query, "mail",
+						   query->offset,
+						   query->limit, out);
 }
 
 notmuch_status_t
 _notmuch_query_search_documents (notmuch_query_t *query,
 				 const char *type,
 				 notmuch_messages_t **out)
+{
+    return _notmuch_query_search_documents_window (query, type, 0, -1, out);
+}
+
+static notmuch_status_t
+_notmuch_query_search_documents_sized (notmuch_query_t *query,
+				       const char *type,
+				       unsigned int offset,
+				       int limit,
+				       Xapian::doccount first_window,
+				       notmuch_messages_t **out);
+
+notmuch_status_t
+_notmuch_query_search_documents_window (notmuch_query_t *query,
+					const char *type,
+					unsigned int offset,
+					int limit,
+					notmuch_messages_t **out)
+{
+    return _notmuch_query_search_documents_sized (query, type, offset, limit,
+						  NOTMUCH_MSET_WINDOW_MIN,
+						  out);
+}
+
+/* As _notmuch_query_search_documents_window, asking Xapian for
+ * 'first_window' results at first (rather than for
+ * NOTMUCH_MSET_WINDOW_MIN), for callers that know that the first few
+ * results may well be all they need.  A sorted match only keeps the
+ * best 'first_window' results as it goes, so a small one is cheaper
+ * to run, and copies less into the MSet. */
+static notmuch_status_t
+_notmuch_query_search_documents_sized (notmuch_query_t *query,
+				       const char *type,
+				       unsigned int offset,
+				       int limit,
+				       Xapian::doccount first_window,
+				       notmuch_messages_t **out)
 {
     notmuch_database_t *notmuch = query->notmuch;
     const char *query_string = query->query_string;
     notmuch_mset_messages_t *messages;
 
+    NOTMUCH_TRACE2 (query_start, query_string, type);
+
     messages = talloc (query, notmuch_mset_messages_t);
-    if (unlikely (messages == NULL))
+    if (unlikely (messages == NULL)) {
+	NOTMUCH_TRACE2 (query_done, query_string, -1L);
 	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
 
     try {
 
 	messages->base.is_of_list_type = FALSE;
 	messages->base.iterator = NULL;
+	messages->base.columns_ctx = NULL;
 	messages->notmuch = notmuch;
+	messages->query = query;
+	messages->fields = query->fields;
+	messages->route = NULL;
+	messages->enquire = NULL;
+	messages->exclude_source = NULL;
+	messages->scan = NULL;
+	messages->prefetched = 0;
+	messages->pool = NULL;
+	messages->first_offset = offset;
+	messages->limit = limit;
+	messages->returned_count = 0;
+	messages->last_returned = 0;
+	messages->returned = NULL;
+	messages->restarted = FALSE;
+	messages->skip = NULL;
+	messages->modified_retries = 0;
+	new (&messages->mset) Xapian::MSet ();
 	new (&messages->iterator) Xapian::MSetIterator ();
 	new (&messages->iterator_end) Xapian::MSetIterator ();
 
 	talloc_set_destructor (messages, _notmuch_messages_destructor);
 
-	Xapian::Enquire enquire (*notmuch->xapian_db);
+	messages->remaining = limit;
+	messages->exhausted = FALSE;
+
+	if (_notmuch_query_is_scan (query)) {
+	    for (;;) {
+		try {
+		    _notmuch_mset_messages_start_scan (
+			messages, std::string (NOTMUCH_PREFIX_TYPE) + type,
+			offset);
+		    messages->modified_retries = 0;
+		    break;
+		} catch (const Xapian::DatabaseModifiedError &error) {
+		    delete messages->scan;
+		    messages->scan = NULL;
+		    if (! _notmuch_database_reopen_modified (
+			    notmuch, &messages->modified_retries))
+			throw;
+		}
+	    }
+	    NOTMUCH_TRACE2 (query_done, query_string,
+			    (long) messages->scan->size ());
+	    *out = &messages->base;
+	    return NOTMUCH_STATUS_SUCCESS;
+	}
+
+	messages->route = _notmuch_database_route_query (notmuch, query_string);
+	messages->enquire = new Xapian::Enquire (
+	    _notmuch_archive_route_database (notmuch, messages->route));
+	Xapian::Enquire &enquire = *messages->enquire;
 	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
+						   NOTMUCH_PREFIX_TYPE,
 						   type));
 	Xapian::Query string_query, final_query, exclude_query;
-	Xapian::MSet mset;
-	Xapian::MSetIterator iterator;
-	unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
-			      Xapian::QueryParser::FLAG_PHRASE |
-			      Xapian::QueryParser::FLAG_LOVEHATE |
-			      Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
-			      Xapian::QueryParser::FLAG_WILDCARD |
-			      Xapian::QueryParser::FLAG_PURE_NOT);
+	notmuch_profile_timer_t timer;
 
 	if (strcmp (query_string, "") == 0 ||
 	    strcmp (query_string, "*") == 0)
 	{
 	    final_query = mail_query;
 	} else {
-	    string_query = notmuch->query_parser->
-		parse_query (query_string, flags);
+	    string_query = _notmuch_query_string_query (query);
 	    final_query = Xapian::Query (Xapian::Query::OP_AND,
 					 mail_query, string_query);
 	}
-	messages->base.excluded_doc_ids = NULL;
+	if (query->filter_terms) {
+	    std::vector<std::string> filter_terms;
 
+	    for (notmuch_string_node_t *term = query->filter_terms->head;
+		 term; term = term->next)
+		filter_terms.push_back (term->string);
+
+	    final_query = Xapian::Query (
+		Xapian::Query::OP_FILTER, final_query,
+		Xapian::Query (Xapian::Query::OP_OR,
+			       filter_terms.begin (), filter_terms.end ()));
+	}
 	if ((query->omit_excluded != NOTMUCH_EXCLUDE_FALSE) && (query->exclude_terms)) {
-	    exclude_query = _notmuch_exclude_tags (query, final_query);
+	    _notmuch_profile_start (notmuch, &timer);
+	    exclude_query = _notmuch_exclude_tags (query, final_query,
+						   messages->route);
 
 	    if (query->omit_excluded == NOTMUCH_EXCLUDE_TRUE ||
 		query->omit_excluded == NOTMUCH_EXCLUDE_ALL)
@@ -248,30 +1077,52 @@ _notmuch_query_search_documents (notmuch_query_t *query,
 		final_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
 					     final_query, exclude_query);
 	    } else { /* NOTMUCH_EXCLUDE_FLAG */
-		exclude_query = Xapian::Query (Xapian::Query::OP_AND,
-					   exclude_query, final_query);
-
-		enquire.set_weighting_scheme (Xapian::BoolWeight());
-		enquire.set_query (exclude_query);
-
-		mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
-
-		GArray *excluded_doc_ids = g_array_new (FALSE, FALSE, sizeof (unsigned int));
+		std::vector<std::string> exclude_terms;
+
+		/* _notmuch_exclude_tags has blanked out the tags that
+		 * appear in the query itself. */
+		for (notmuch_string_node_t *term = query->exclude_terms->head;
+		     term; term = term->next) {
+		    if (*term->string)
+			exclude_terms.push_back (term->string);
+		}
 
-		for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
-		    unsigned int doc_id = *iterator;
-		    g_array_append_val (excluded_doc_ids, doc_id);
+		/* Under BoolWeight only the posting source contributes
+		 * any weight, so excluded matches are exactly those
+		 * with a non-zero weight.  A remote database cannot be
+		 * sent our own posting source, so there the weight comes
+		 * from Xapian's own fixed weight source, filtered by the
+		 * excluded terms. */
+		if (! exclude_terms.empty () && notmuch->xapian_stub) {
+		    messages->exclude_source =
+			new Xapian::FixedWeightPostingSource (1.0);
+		    final_query = Xapian::Query (
+			Xapian::Query::OP_AND_MAYBE, final_query,
+			Xapian::Query (Xapian::Query::OP_FILTER,
+				       Xapian::Query (messages->exclude_source),
+				       exclude_query));
+		} else if (! exclude_terms.empty ()) {
+		    if (messages->route == NULL)
+			messages->exclude_source =
+			    _notmuch_exclude_cache_source (notmuch,
+							   exclude_terms);
+		    if (messages->exclude_source == NULL)
+			messages->exclude_source =
+			    new ExcludedTermsPostingSource (exclude_terms);
+		    final_query = Xapian::Query (
+			Xapian::Query::OP_AND_MAYBE, final_query,
+			Xapian::Query (messages->exclude_source));
 		}
-		messages->base.excluded_doc_ids = talloc (messages, _notmuch_doc_id_set);
-		_notmuch_doc_id_set_init (query, messages->base.excluded_doc_ids,
-					  excluded_doc_ids);
-		g_array_unref (excluded_doc_ids);
 	    }
+	    _notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_EXCLUDE);
 	}
 
 
 	enquire.set_weighting_scheme (Xapian::BoolWeight());
 
+	if (query->collapse_threads)
+	    enquire.set_collapse_key (NOTMUCH_VALUE_THREAD_ID);
+
 	switch (query->sort) {
 	case NOTMUCH_SORT_OLDEST_FIRST:
 	    enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
@@ -295,11 +1146,39 @@ _notmuch_query_search_documents (notmuch_query_t *query,
 
 	enquire.set_query (final_query);
 
-	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
-
-	messages->iterator = mset.begin ();
-	messages->iterator_end = mset.end ();
+	messages->mset_offset = offset;
+	/* A writer may change the matches as it walks them, which
+	 * would shift later windows, so it gets all of the results at
+	 * once. */
+	if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
+	    messages->window = first_window;
+	else
+	    messages->window = notmuch->xapian_db->get_doccount ();
+
+	/* Results not in doc id order can only be told apart from
+	 * those returned before a restart by their doc ids. */
+	if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY &&
+	    ! _notmuch_mset_messages_in_doc_id_order (messages))
+	    messages->returned = g_array_new (FALSE, FALSE,
+					      sizeof (unsigned int));
+
+	for (;;) {
+	    try {
+		_notmuch_mset_messages_fetch_window (messages);
+		messages->modified_retries = 0;
+		break;
+	    } catch (const Xapian::DatabaseModifiedError &error) {
+		if (! _notmuch_database_reopen_modified (
+			notmuch, &messages->modified_retries))
+		    throw;
+		if (messages->route)
+		    _notmuch_archive_route_database (notmuch,
+						     messages->route).reopen ();
+	    }
+	}
 
+	NOTMUCH_TRACE2 (query_done, query_string,
+			(long) messages->mset.get_matches_estimated ());
 	*out = &messages->base;
 	return NOTMUCH_STATUS_SUCCESS;
 
@@ -310,33 +1189,191 @@ _notmuch_query_search_documents (notmuch_query_t *query,
 			       error.get_msg().c_str(),
 			       query->query_string);
 
+	NOTMUCH_TRACE2 (query_done, query_string, -1L);
 	notmuch->exception_reported = TRUE;
 	talloc_free (messages);
 	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 }
 
-notmuch_bool_t
-_notmuch_mset_messages_valid (notmuch_messages_t *messages)
+/* Called on a Xapian::DatabaseModifiedError reading 'messages':
+ * reopen the database, and for matches, which Xapian can no longer
+ * read from the revision they came from, run the query again from
+ * the start, to skip the results already returned as they come
+ * again.  A scan keeps its doc ids, and reads their documents from
+ * the new revision, passing over those removed since.  Return FALSE
+ * if the read is not to be retried. */
+static notmuch_bool_t
+_notmuch_mset_messages_restart (notmuch_mset_messages_t *messages)
 {
-    notmuch_mset_messages_t *mset_messages;
+    notmuch_database_t *notmuch = messages->notmuch;
 
-    mset_messages = (notmuch_mset_messages_t *) messages;
+    if (! _notmuch_database_reopen_modified (notmuch,
+					     &messages->modified_retries))
+	return FALSE;
 
-    return (mset_messages->iterator != mset_messages->iterator_end);
-}
+    messages->restarted = TRUE;
+    if (messages->scan)
+	return TRUE;
 
-static Xapian::docid
-_notmuch_mset_messages_get_doc_id (notmuch_messages_t *messages)
-{
-    notmuch_mset_messages_t *mset_messages;
+    if (messages->route) {
+	try {
+	    _notmuch_archive_route_database (notmuch,
+					     messages->route).reopen ();
+	} catch (const Xapian::Error &error) {
+	    return FALSE;
+	}
+    }
+
+    if (messages->returned) {
+	if (messages->skip)
+	    talloc_free (messages->skip);
+	messages->skip = talloc (messages, notmuch_doc_id_set_t);
+	if (unlikely (messages->skip == NULL))
+	    return FALSE;
+	if (! _notmuch_doc_id_set_init (messages->skip, messages->skip,
+					messages->returned))
+	    return FALSE;
+    }
+
+    /* The next window fetched is the first one again.  The limit is
+     * now kept by returned_count, as skipped results are fetched as
+     * well. */
+    messages->mset = Xapian::MSet ();
+    messages->iterator = messages->mset.begin ();
+    messages->iterator_end = messages->mset.end ();
+    messages->mset_offset = messages->first_offset;
+    messages->window = NOTMUCH_MSET_WINDOW_MIN;
+    messages->remaining = -1;
+    messages->exhausted = FALSE;
+    messages->prefetched = 0;
+
+    return TRUE;
+}
+
+/* Return TRUE if the current match of a restarted 'messages' was
+ * returned before the restart. */
+static notmuch_bool_t
+_notmuch_mset_messages_was_returned (notmuch_mset_messages_t *messages)
+{
+    Xapian::docid doc_id = *messages->iterator;
+
+    if (messages->skip)
+	return _notmuch_doc_id_set_contains (messages->skip, doc_id);
+
+    return doc_id <= messages->last_returned;
+}
+
+notmuch_bool_t
+_notmuch_mset_messages_valid (notmuch_messages_t *messages)
+{
+    notmuch_mset_messages_t *mset_messages;
+
+    mset_messages = (notmuch_mset_messages_t *) messages;
+
+    if (mset_messages->scan)
+	return mset_messages->scan_position < mset_messages->scan->size ();
+
+    if (mset_messages->iterator != mset_messages->iterator_end &&
+	! mset_messages->restarted)
+	return TRUE;
+
+    if (mset_messages->restarted && mset_messages->limit >= 0 &&
+	mset_messages->returned_count >= (unsigned long) mset_messages->limit)
+	return FALSE;
+
+    try {
+	for (;;) {
+	    if (mset_messages->iterator != mset_messages->iterator_end) {
+		if (! mset_messages->restarted ||
+		    ! _notmuch_mset_messages_was_returned (mset_messages))
+		    return TRUE;
+		mset_messages->iterator++;
+		continue;
+	    }
+
+	    if (mset_messages->exhausted)
+		return FALSE;
+
+	    /* The current window is used up, but Xapian may have more
+	     * results for us. */
+	    try {
+		mset_messages->mset_offset += mset_messages->mset.size ();
+		if (mset_messages->window < NOTMUCH_MSET_WINDOW_MAX)
+		    mset_messages->window *= 2;
+		_notmuch_mset_messages_fetch_window (mset_messages);
+		mset_messages->modified_retries = 0;
+	    } catch (const Xapian::DatabaseModifiedError &error) {
+		if (! _notmuch_mset_messages_restart (mset_messages))
+		    throw;
+	    }
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (mset_messages->notmuch,
+			       "A Xapian exception occurred fetching query results: %s\n",
+			       error.get_msg().c_str());
+	mset_messages->notmuch->exception_reported = TRUE;
+	mset_messages->exhausted = TRUE;
+	mset_messages->iterator = mset_messages->iterator_end;
+    }
+
+    return FALSE;
+}
+
+static Xapian::docid
+_notmuch_mset_messages_get_doc_id (notmuch_messages_t *messages)
+{
+    notmuch_mset_messages_t *mset_messages;
 
     mset_messages = (notmuch_mset_messages_t *) messages;
 
     if (! _notmuch_mset_messages_valid (&mset_messages->base))
 	return 0;
 
-    return *mset_messages->iterator;
+    if (mset_messages->scan)
+	return (*mset_messages->scan)[mset_messages->scan_position];
+
+    return _notmuch_archive_route_doc_id (mset_messages->notmuch,
+					  mset_messages->route,
+					  *mset_messages->iterator);
+}
+
+/* Return the document of the current result.
+ *
+ * Documents are read through the MSet, which is asked to fetch those
+ * of the next notmuch->prefetch results at a time, so that a backend
+ * able to read several at once (such as a remote one) need not wait
+ * for each in turn.  Scans read the type term's posting list in
+ * document order, which is already the order of the B-tree, and
+ * results routed to archive shards are numbered apart from the MSet,
+ * so both read documents one at a time.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static Xapian::Document
+_notmuch_mset_messages_get_document (notmuch_mset_messages_t *messages,
+				     unsigned int doc_id)
+{
+    notmuch_database_t *notmuch = messages->notmuch;
+    Xapian::doccount index, end;
+
+    _notmuch_profile_count (notmuch, NOTMUCH_PROFILE_DOCUMENTS, 1);
+
+    if (messages->scan || messages->route || notmuch->prefetch == 0)
+	return notmuch->xapian_db->get_document (doc_id);
+
+    index = messages->iterator.get_rank () - messages->mset.get_firstitem ();
+    if (index >= messages->prefetched) {
+	end = index + notmuch->prefetch;
+	if (end >= messages->mset.size ()) {
+	    end = messages->mset.size ();
+	    messages->mset.fetch (messages->iterator, messages->iterator_end);
+	} else {
+	    messages->mset.fetch (messages->iterator, messages->mset[end]);
+	}
+	messages->prefetched = end;
+    }
+
+    return messages->iterator.get_document ();
 }
 
 notmuch_message_t *
@@ -344,28 +1381,53 @@ _notmuch_mset_messages_get (notmuch_messages_t *messages)
 {
     notmuch_message_t *message;
     Xapian::docid doc_id;
+    Xapian::Document doc;
     notmuch_private_status_t status;
     notmuch_mset_messages_t *mset_messages;
 
     mset_messages = (notmuch_mset_messages_t *) messages;
 
-    if (! _notmuch_mset_messages_valid (&mset_messages->base))
-	return NULL;
+    if (mset_messages->pool == NULL)
+	mset_messages->pool = talloc_pool (mset_messages,
+					   NOTMUCH_MESSAGE_POOL_SIZE);
 
-    doc_id = *mset_messages->iterator;
+    for (;;) {
+	if (! _notmuch_mset_messages_valid (&mset_messages->base))
+	    return NULL;
 
-    message = _notmuch_message_create (mset_messages,
-				       mset_messages->notmuch, doc_id,
-				       &status);
+	doc_id = _notmuch_mset_messages_get_doc_id (messages);
 
-    if (message == NULL &&
-       status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND)
-    {
-	INTERNAL_ERROR ("a messages iterator contains a non-existent document ID.\n");
+	try {
+	    doc = _notmuch_mset_messages_get_document (mset_messages, doc_id);
+	    mset_messages->modified_retries = 0;
+	    break;
+	} catch (const Xapian::DocNotFoundError &error) {
+	    /* A scan restarted on a later revision can come upon
+	     * messages removed since its doc ids were read. */
+	    if (! mset_messages->scan || ! mset_messages->restarted)
+		INTERNAL_ERROR ("a messages iterator contains a non-existent document ID.\n");
+	    mset_messages->scan_position++;
+	} catch (const Xapian::DatabaseModifiedError &error) {
+	    if (_notmuch_mset_messages_restart (mset_messages))
+		continue;
+	    _notmuch_database_log (mset_messages->notmuch,
+				   "A Xapian exception occurred reading a message: %s\n",
+				   error.get_msg().c_str());
+	    mset_messages->notmuch->exception_reported = TRUE;
+	    return NULL;
+	}
     }
 
-    if (messages->excluded_doc_ids &&
-	_notmuch_doc_id_set_contains (messages->excluded_doc_ids, doc_id))
+    message = _notmuch_message_create_for_document (mset_messages->pool ?
+						    mset_messages->pool :
+						    mset_messages,
+						    mset_messages->notmuch,
+						    doc_id, doc, &status);
+
+    _notmuch_message_set_fields (message, mset_messages->fields);
+
+    if (mset_messages->exclude_source &&
+	mset_messages->iterator.get_weight () > 0)
 	notmuch_message_set_flag (message, NOTMUCH_MESSAGE_FLAG_EXCLUDED, TRUE);
 
     return message;
@@ -378,7 +1440,226 @@ _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages)
 
     mset_messages = (notmuch_mset_messages_t *) messages;
 
-    mset_messages->iterator++;
+    if (mset_messages->scan) {
+	if (_notmuch_mset_messages_valid (messages))
+	    mset_messages->scan_position++;
+	return;
+    }
+
+    if (mset_messages->iterator != mset_messages->iterator_end) {
+	Xapian::docid doc_id = *mset_messages->iterator;
+
+	mset_messages->returned_count++;
+	mset_messages->last_returned = doc_id;
+	if (mset_messages->returned)
+	    g_array_append_val (mset_messages->returned, doc_id);
+	mset_messages->iterator++;
+    }
+}
+
+/* Return a copy of the first term of 'doc' with 'prefix', without
+ * the prefix, or NULL if there is none. */
+static const char *
+_notmuch_document_get_term (void *ctx, Xapian::Document &doc,
+			    const char *prefix)
+{
+    Xapian::TermIterator i = doc.termlist_begin ();
+    Xapian::TermIterator end = doc.termlist_end ();
+    size_t prefix_len = strlen (prefix);
+
+    i.skip_to (prefix);
+    if (i == end || strncmp ((*i).c_str (), prefix, prefix_len) != 0)
+	return NULL;
+
+    return talloc_strdup (ctx, (*i).c_str () + prefix_len);
+}
+
+/* Return the tags of 'doc', in term order (which is sorted order), as
+ * a NULL-terminated array. */
+static const char **
+_notmuch_document_get_tags (void *ctx, Xapian::Document &doc)
+{
+    const char *prefix = NOTMUCH_PREFIX_TAG;
+    size_t prefix_len = strlen (prefix);
+    Xapian::TermIterator i = doc.termlist_begin ();
+    Xapian::TermIterator end = doc.termlist_end ();
+    const char **tags;
+    unsigned int count = 0, size = 8;
+
+    tags = talloc_array (ctx, const char *, size);
+    if (unlikely (tags == NULL))
+	return NULL;
+
+    for (i.skip_to (prefix); i != end; i++) {
+	if (strncmp ((*i).c_str (), prefix, prefix_len) != 0)
+	    break;
+	if (count + 1 == size) {
+	    size *= 2;
+	    tags = talloc_realloc (ctx, tags, const char *, size);
+	    if (unlikely (tags == NULL))
+		return NULL;
+	}
+	tags[count] = talloc_strdup (tags, (*i).c_str () + prefix_len);
+	if (unlikely (tags[count] == NULL))
+	    return NULL;
+	count++;
+    }
+    tags[count] = NULL;
+
+    return tags;
+}
+
+/* Whether every wanted column of 'columns' is kept in a value slot,
+ * so that no term list or document data need be read. */
+static notmuch_bool_t
+_notmuch_columns_from_values (notmuch_database_t *notmuch,
+			      notmuch_message_columns_t *columns)
+{
+    if (columns->tags)
+	return FALSE;
+    if (columns->message_ids &&
+	! (notmuch->features & NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES))
+	return FALSE;
+    if (columns->thread_ids &&
+	! (notmuch->features & NOTMUCH_FEATURE_THREAD_ID_VALUES))
+	return FALSE;
+    return TRUE;
+}
+
+/* Return the document of the current result for reading values only.
+ *
+ * Prefetching through the MSet would read the document data, which
+ * values do not need.  Where Xapian allows, the document is not even
+ * checked to exist, so that reading a value reads the value slot and
+ * nothing else.  A restarted scan can come upon removed documents,
+ * so still checks.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static Xapian::Document
+_notmuch_mset_messages_get_values (notmuch_mset_messages_t *messages,
+				   unsigned int doc_id)
+{
+    Xapian::Database *db = messages->notmuch->xapian_db;
+
+    _notmuch_profile_count (messages->notmuch, NOTMUCH_PROFILE_DOCUMENTS, 1);
+
+#if HAVE_XAPIAN_DOC_ASSUME_VALID
+    if (! (messages->scan && messages->restarted))
+	return db->get_document (doc_id, Xapian::DOC_ASSUME_VALID);
+#endif
+    return db->get_document (doc_id);
+}
+
+/* notmuch_messages_get_columns, reading each wanted field straight
+ * from the document, without creating message objects.  Columns
+ * kept in value slots, such as the message IDs alone, are read from
+ * their slots without fetching the rest of the document. */
+notmuch_status_t
+_notmuch_mset_messages_get_columns (notmuch_messages_t *messages,
+				    notmuch_message_columns_t *columns,
+				    unsigned int count,
+				    unsigned int *filled)
+{
+    notmuch_mset_messages_t *mset_messages;
+    notmuch_database_t *notmuch;
+    notmuch_bool_t values_only;
+    void *ctx = messages->columns_ctx;
+    unsigned int i;
+
+    mset_messages = (notmuch_mset_messages_t *) messages;
+    notmuch = mset_messages->notmuch;
+    values_only = _notmuch_columns_from_values (notmuch, columns);
+
+    try {
+	i = 0;
+	while (i < count && _notmuch_mset_messages_valid (messages)) {
+	    try {
+		unsigned int doc_id = _notmuch_mset_messages_get_doc_id (messages);
+		Xapian::Document doc = values_only ?
+		    _notmuch_mset_messages_get_values (mset_messages, doc_id) :
+		    _notmuch_mset_messages_get_document (mset_messages, doc_id);
+
+		if (columns->message_ids) {
+		    if (notmuch->features & NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES)
+			columns->message_ids[i] = talloc_strdup (
+			    ctx, doc.get_value (NOTMUCH_VALUE_MESSAGE_ID).c_str ());
+		    else
+			columns->message_ids[i] = _notmuch_document_get_term (
+			    ctx, doc, NOTMUCH_PREFIX_ID);
+		    if (unlikely (columns->message_ids[i] == NULL))
+			return NOTMUCH_STATUS_OUT_OF_MEMORY;
+		}
+
+		if (columns->thread_ids) {
+		    const char *thread_id, *resolved;
+
+		    if (notmuch->features & NOTMUCH_FEATURE_THREAD_ID_VALUES)
+			thread_id = talloc_strdup (
+			    ctx, doc.get_value (NOTMUCH_VALUE_THREAD_ID).c_str ());
+		    else
+			thread_id = _notmuch_document_get_term (
+			    ctx, doc, NOTMUCH_PREFIX_THREAD);
+		    if (unlikely (thread_id == NULL))
+			return NOTMUCH_STATUS_OUT_OF_MEMORY;
+		    resolved = _notmuch_database_resolve_thread_id (notmuch,
+								     thread_id);
+		    if (resolved != thread_id)
+			thread_id = talloc_strdup (ctx, resolved);
+		    columns->thread_ids[i] = thread_id;
+		}
+
+		if (columns->dates) {
+		    std::string value = doc.get_value (NOTMUCH_VALUE_TIMESTAMP);
+
+		    columns->dates[i] = value.empty () ? 0 :
+			Xapian::sortable_unserialise (value);
+		}
+
+		if (columns->tags) {
+		    columns->tags[i] = _notmuch_document_get_tags (ctx, doc);
+		    if (unlikely (columns->tags[i] == NULL))
+			return NOTMUCH_STATUS_OUT_OF_MEMORY;
+		}
+
+		if (columns->excluded)
+		    columns->excluded[i] = (mset_messages->exclude_source &&
+					    mset_messages->iterator.get_weight () > 0);
+	    } catch (const Xapian::DocNotFoundError &error) {
+		/* Removed since the doc ids of a restarted scan were
+		 * read. */
+		if (! mset_messages->scan || ! mset_messages->restarted)
+		    throw;
+		mset_messages->scan_position++;
+		continue;
+	    } catch (const Xapian::DatabaseModifiedError &error) {
+		if (! _notmuch_mset_messages_restart (mset_messages))
+		    throw;
+		continue;
+	    }
+
+	    mset_messages->modified_retries = 0;
+	    _notmuch_mset_messages_move_to_next (messages);
+	    (*filled)++;
+	    i++;
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred reading query results: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+static int
+_compare_doc_ids (const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+
+    return x < y ? -1 : x > y;
 }
 
 static notmuch_bool_t
@@ -386,42 +1667,169 @@ _notmuch_doc_id_set_init (void *ctx,
 			  notmuch_doc_id_set_t *doc_ids,
 			  GArray *arr)
 {
-    unsigned int max = 0;
-    unsigned char *bitmap;
+    unsigned int *sorted;
+    unsigned int i, j, k, n_blocks = 0;
+
+    doc_ids->blocks = NULL;
+    doc_ids->n_blocks = 0;
+    doc_ids->last_block = 0;
 
-    for (unsigned int i = 0; i < arr->len; i++)
-	max = MAX(max, g_array_index (arr, unsigned int, i));
-    bitmap = talloc_zero_array (ctx, unsigned char, DOCIDSET_WORD(max) + 1);
+    if (arr->len == 0)
+	return TRUE;
 
-    if (bitmap == NULL)
+    sorted = (unsigned int *) talloc_memdup (ctx, arr->data,
+					     arr->len * sizeof (unsigned int));
+    if (sorted == NULL)
 	return FALSE;
+    qsort (sorted, arr->len, sizeof (unsigned int), _compare_doc_ids);
 
-    doc_ids->bitmap = bitmap;
-    doc_ids->bound = max + 1;
+    for (i = 0; i < arr->len; i++) {
+	if (i == 0 || (sorted[i] >> DOCIDSET_BLOCK_BITS) !=
+	    (sorted[i - 1] >> DOCIDSET_BLOCK_BITS))
+	    n_blocks++;
+    }
+
+    doc_ids->blocks = talloc_array (ctx, notmuch_doc_id_block_t, n_blocks);
+    if (doc_ids->blocks == NULL)
+	goto FAIL;
+
+    for (i = 0; i < arr->len; i = j) {
+	notmuch_doc_id_block_t *block = &doc_ids->blocks[doc_ids->n_blocks];
+	unsigned int distinct = 0;
+
+	block->key = sorted[i] >> DOCIDSET_BLOCK_BITS;
+	for (j = i; j < arr->len &&
+		 (sorted[j] >> DOCIDSET_BLOCK_BITS) == block->key; j++) {
+	    if (j == i || sorted[j] != sorted[j - 1])
+		distinct++;
+	}
+
+	if (distinct > DOCIDSET_ARRAY_MAX) {
+	    block->array = NULL;
+	    block->count = 0;
+	    block->bitmap = talloc_zero_array (doc_ids->blocks, unsigned char,
+					       DOCIDSET_BLOCK_SIZE / CHAR_BIT);
+	    if (block->bitmap == NULL)
+		goto FAIL;
+	    for (k = i; k < j; k++) {
+		unsigned int low = sorted[k] & DOCIDSET_BLOCK_MASK;
+		block->bitmap[DOCIDSET_WORD(low)] |= 1 << DOCIDSET_BIT(low);
+	    }
+	} else {
+	    block->bitmap = NULL;
+	    block->count = 0;
+	    block->array = talloc_array (doc_ids->blocks, uint16_t, distinct);
+	    if (block->array == NULL)
+		goto FAIL;
+	    for (k = i; k < j; k++) {
+		if (k == i || sorted[k] != sorted[k - 1])
+		    block->array[block->count++] = sorted[k] & DOCIDSET_BLOCK_MASK;
+	    }
+	}
 
-    for (unsigned int i = 0; i < arr->len; i++) {
-	unsigned int doc_id = g_array_index (arr, unsigned int, i);
-	bitmap[DOCIDSET_WORD(doc_id)] |= 1 << DOCIDSET_BIT(doc_id);
+	doc_ids->n_blocks++;
     }
 
+    talloc_free (sorted);
     return TRUE;
+
+  FAIL:
+    talloc_free (sorted);
+    talloc_free (doc_ids->blocks);
+    doc_ids->blocks = NULL;
+    doc_ids->n_blocks = 0;
+    return FALSE;
+}
+
+/* Return the block of 'doc_ids' that would hold 'doc_id', or NULL if
+ * there is none. */
+static notmuch_doc_id_block_t *
+_notmuch_doc_id_set_find_block (notmuch_doc_id_set_t *doc_ids,
+				unsigned int doc_id)
+{
+    unsigned int key = doc_id >> DOCIDSET_BLOCK_BITS;
+    unsigned int lo = 0, hi = doc_ids->n_blocks;
+
+    if (doc_ids->last_block < doc_ids->n_blocks &&
+	doc_ids->blocks[doc_ids->last_block].key == key)
+	return &doc_ids->blocks[doc_ids->last_block];
+
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+
+	if (doc_ids->blocks[mid].key < key) {
+	    lo = mid + 1;
+	} else if (doc_ids->blocks[mid].key > key) {
+	    hi = mid;
+	} else {
+	    doc_ids->last_block = mid;
+	    return &doc_ids->blocks[mid];
+	}
+    }
+
+    return NULL;
+}
+
+/* Return the index of 'low' in the array of 'block', or -1. */
+static int
+_notmuch_doc_id_block_find (notmuch_doc_id_block_t *block, unsigned int low)
+{
+    unsigned int lo = 0, hi = block->count;
+
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+
+	if (block->array[mid] < low)
+	    lo = mid + 1;
+	else if (block->array[mid] > low)
+	    hi = mid;
+	else
+	    return mid;
+    }
+
+    return -1;
 }
 
 notmuch_bool_t
 _notmuch_doc_id_set_contains (notmuch_doc_id_set_t *doc_ids,
 			      unsigned int doc_id)
 {
-    if (doc_id >= doc_ids->bound)
+    notmuch_doc_id_block_t *block;
+    unsigned int low = doc_id & DOCIDSET_BLOCK_MASK;
+
+    block = _notmuch_doc_id_set_find_block (doc_ids, doc_id);
+    if (block == NULL)
 	return FALSE;
-    return doc_ids->bitmap[DOCIDSET_WORD(doc_id)] & (1 << DOCIDSET_BIT(doc_id));
+
+    if (block->bitmap)
+	return block->bitmap[DOCIDSET_WORD(low)] & (1 << DOCIDSET_BIT(low));
+
+    return _notmuch_doc_id_block_find (block, low) >= 0;
 }
 
 void
 _notmuch_doc_id_set_remove (notmuch_doc_id_set_t *doc_ids,
                             unsigned int doc_id)
 {
-    if (doc_id < doc_ids->bound)
-	doc_ids->bitmap[DOCIDSET_WORD(doc_id)] &= ~(1 << DOCIDSET_BIT(doc_id));
+    notmuch_doc_id_block_t *block;
+    unsigned int low = doc_id & DOCIDSET_BLOCK_MASK;
+    int pos;
+
+    block = _notmuch_doc_id_set_find_block (doc_ids, doc_id);
+    if (block == NULL)
+	return;
+
+    if (block->bitmap) {
+	block->bitmap[DOCIDSET_WORD(low)] &= ~(1 << DOCIDSET_BIT(low));
+	return;
+    }
+
+    pos = _notmuch_doc_id_block_find (block, low);
+    if (pos >= 0) {
+	memmove (&block->array[pos], &block->array[pos + 1],
+		 (block->count - pos - 1) * sizeof (uint16_t));
+	block->count--;
+    }
 }
 
 /* Glib objects force use to use a talloc destructor as well, (but not
@@ -431,8 +1839,8 @@ _notmuch_doc_id_set_remove (notmuch_doc_id_set_t *doc_ids,
 static int
 _notmuch_threads_destructor (notmuch_threads_t *threads)
 {
-    if (threads->doc_ids)
-	g_array_unref (threads->doc_ids);
+    if (threads->seen)
+	g_hash_table_unref (threads->seen);
 
     return 0;
 }
@@ -455,38 +1863,70 @@ notmuch_query_search_threads_st (notmuch_query_t *query,
 				 notmuch_threads_t **out)
 {
     notmuch_threads_t *threads;
-    notmuch_messages_t *messages;
+    Xapian::doccount first_window;
+    unsigned int offset = 0;
+    int limit = -1;
     notmuch_status_t status;
 
+    status = _notmuch_query_start_search (query);
+    if (status)
+	return status;
+
     threads = talloc (query, notmuch_threads_t);
     if (threads == NULL)
 	return NOTMUCH_STATUS_OUT_OF_MEMORY;
-    threads->doc_ids = NULL;
+    threads->messages = NULL;
+    threads->seen = NULL;
+    threads->batch_ctx = NULL;
+    threads->batch = NULL;
+    threads->batch_seed = NULL;
+    threads->batch_len = 0;
+    threads->batch_pos = 0;
+    threads->skip = query->offset;
+    threads->remaining = query->limit;
+    threads->failed = FALSE;
+    threads->jobs = 1;
+    threads->workers = NULL;
+    threads->num_workers = 0;
     talloc_set_destructor (threads, _notmuch_threads_destructor);
 
     threads->query = query;
 
-    status = notmuch_query_search_messages_st (query, &messages);
+    /* Where the stream holds only the first match of each thread,
+     * it is exactly the seeds of the threads in order, so the offset
+     * and limit apply to it directly. */
+    query->collapse_threads = _notmuch_query_can_collapse_threads (query);
+    if (query->collapse_threads) {
+	offset = query->offset;
+	limit = query->limit;
+	threads->skip = 0;
+    }
+
+    /* Each thread returned takes at least one match, so with a limit
+     * the first window need be no larger than the threads asked for.
+     * A thread with several matches only makes the stream fetch a
+     * window twice the size next; without this, an inbox view asking
+     * for a page of threads would sort through a thousand matches
+     * first. */
+    first_window = NOTMUCH_MSET_WINDOW_MIN;
+    if (query->limit >= 0 &&
+	(unsigned long) threads->skip + query->limit < first_window)
+	first_window = MAX (threads->skip + query->limit,
+			    NOTMUCH_THREAD_BATCH_SIZE);
+
+    status = _notmuch_query_search_documents_sized (query, "mail",
+						    offset, limit,
+						    first_window,
+						    &threads->messages);
+    query->collapse_threads = FALSE;
     if (status) {
 	talloc_free (threads);
 	return status;
     }
+    talloc_steal (threads, threads->messages);
 
-    threads->doc_ids = g_array_new (FALSE, FALSE, sizeof (unsigned int));
-    while (notmuch_messages_valid (messages)) {
-	unsigned int doc_id = _notmuch_mset_messages_get_doc_id (messages);
-	g_array_append_val (threads->doc_ids, doc_id);
-	notmuch_messages_move_to_next (messages);
-    }
-    threads->doc_id_pos = 0;
-
-    talloc_free (messages);
-
-    if (! _notmuch_doc_id_set_init (threads, &threads->match_set,
-				    threads->doc_ids)) {
-	talloc_free (threads);
-	return NOTMUCH_STATUS_OUT_OF_MEMORY;
-    }
+    /* The keys belong to threads. */
+    threads->seen = g_hash_table_new (g_str_hash, g_str_equal);
 
     *out = threads;
     return NOTMUCH_STATUS_SUCCESS;
@@ -498,112 +1938,1056 @@ notmuch_query_destroy (notmuch_query_t *query)
     talloc_free (query);
 }
 
-notmuch_bool_t
-notmuch_threads_valid (notmuch_threads_t *threads)
+static void
+_notmuch_threads_clear_batch (notmuch_threads_t *threads)
 {
-    unsigned int doc_id;
-
-    if (! threads)
-	return FALSE;
-
-    while (threads->doc_id_pos < threads->doc_ids->len) {
-	doc_id = g_array_index (threads->doc_ids, unsigned int,
-				threads->doc_id_pos);
-	if (_notmuch_doc_id_set_contains (&threads->match_set, doc_id))
-	    break;
-
-	threads->doc_id_pos++;
-    }
+    unsigned int i;
+
+    /* Threads created by workers don't belong to batch_ctx. */
+    for (i = threads->batch_pos; i < threads->batch_len; i++)
+	talloc_free (threads->batch[i]);
+
+    talloc_free (threads->batch_ctx);
+    threads->batch_ctx = NULL;
+    threads->batch = NULL;
+    threads->batch_seed = NULL;
+    threads->batch_len = 0;
+    threads->batch_pos = 0;
+}
 
-    return threads->doc_id_pos < threads->doc_ids->len;
+void
+notmuch_threads_set_jobs (notmuch_threads_t *threads, unsigned int jobs)
+{
+    threads->jobs = jobs ? jobs : 1;
 }
 
-notmuch_thread_t *
-notmuch_threads_get (notmuch_threads_t *threads)
+#if HAVE_PTHREAD
+static int
+_notmuch_threads_workers_destructor (notmuch_threads_worker_t *workers)
 {
-    unsigned int doc_id;
+    size_t i;
 
-    if (! notmuch_threads_valid (threads))
-	return NULL;
+    for (i = 0; i < talloc_array_length (workers); i++) {
+	if (workers[i].notmuch)
+	    notmuch_database_destroy (workers[i].notmuch);
+    }
 
-    doc_id = g_array_index (threads->doc_ids, unsigned int,
-			    threads->doc_id_pos);
-    return _notmuch_thread_create (threads->query,
-				   threads->query->notmuch,
-				   doc_id,
-				   &threads->match_set,
-				   threads->query->exclude_terms,
-				   threads->query->omit_excluded,
-				   threads->query->sort);
+    return 0;
 }
 
-void
-notmuch_threads_move_to_next (notmuch_threads_t *threads)
+static void *
+_notmuch_threads_worker (void *closure)
 {
-    threads->doc_id_pos++;
+    notmuch_threads_worker_t *worker = (notmuch_threads_worker_t *) closure;
+    notmuch_query_t *query = worker->query;
+
+    worker->status = _notmuch_thread_create_batch (worker->notmuch,
+						   worker->notmuch,
+						   worker->count,
+						   worker->thread_ids,
+						   &worker->match_set,
+						   query->exclude_terms,
+						   query->omit_excluded,
+						   query->sort,
+						   _notmuch_query_summary_only (query),
+						   worker->threads_out);
+    return NULL;
 }
+#endif
 
-void
-notmuch_threads_destroy (notmuch_threads_t *threads)
+/* Open a handle for each worker asked for by notmuch_threads_set_jobs
+ * beyond the calling thread.  Failing to open one just leaves fewer
+ * workers. */
+static void
+_notmuch_threads_open_workers (notmuch_threads_t *threads)
 {
-    talloc_free (threads);
+#if HAVE_PTHREAD
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    unsigned int i;
+
+    if (threads->workers || threads->jobs < 2 ||
+	notmuch->mode != NOTMUCH_DATABASE_MODE_READ_ONLY)
+	return;
+
+    threads->workers = talloc_zero_array (threads->query,
+					  notmuch_threads_worker_t,
+					  threads->jobs - 1);
+    if (unlikely (threads->workers == NULL))
+	return;
+    talloc_set_destructor (threads->workers,
+			   _notmuch_threads_workers_destructor);
+
+    for (i = 0; i < threads->jobs - 1; i++) {
+	notmuch_threads_worker_t *worker = &threads->workers[i];
+	char *status_string = NULL;
+
+	if (notmuch_database_open_verbose (notmuch->path,
+					   NOTMUCH_DATABASE_MODE_READ_ONLY,
+					   &worker->notmuch,
+					   &status_string)) {
+	    free (status_string);
+	    worker->notmuch = NULL;
+	    break;
+	}
+	threads->num_workers++;
+    }
+#else
+    (void) threads;
+#endif
 }
 
-unsigned int
-notmuch_query_count_messages (notmuch_query_t *query)
+/* Create the 'count' threads of the batch, handing equal parts of it
+ * to the workers and creating the rest on the calling thread.  Each
+ * worker gets its own copy of the matches in 'match_ids', since
+ * creating threads removes their messages from the set.  A part that
+ * fails is left empty, for notmuch_threads_get to fill in. */
+static void
+_notmuch_threads_create_batch (notmuch_threads_t *threads,
+			       unsigned int count,
+			       const char **thread_ids,
+			       GArray *match_ids)
 {
+    notmuch_query_t *query = threads->query;
+    unsigned int first = 0;
     notmuch_status_t status;
-    unsigned int count;
+#if HAVE_PTHREAD
+    unsigned int part, num_started = 0, i;
+
+    part = (count + threads->num_workers) / (threads->num_workers + 1);
+    for (i = 0; i < threads->num_workers && count - first > part; i++) {
+	notmuch_threads_worker_t *worker = &threads->workers[i];
+
+	worker->query = query;
+	worker->thread_ids = thread_ids + first;
+	worker->threads_out = threads->batch + first;
+	worker->count = part;
+	if (! _notmuch_doc_id_set_init (threads->batch_ctx,
+					&worker->match_set, match_ids) ||
+	    pthread_create (&worker->thread, NULL,
+			    _notmuch_threads_worker, worker))
+	    break;
+	first += part;
+	num_started++;
+    }
+#else
+    (void) match_ids;
+#endif
+
+    status = _notmuch_thread_create_batch (threads->batch_ctx, query->notmuch,
+					   count - first, thread_ids + first,
+					   &threads->batch_match_set,
+					   query->exclude_terms,
+					   query->omit_excluded,
+					   query->sort,
+					   _notmuch_query_summary_only (query),
+					   threads->batch + first);
+    if (status)
+	memset (threads->batch + first, 0,
+		(count - first) * sizeof (notmuch_thread_t *));
 
-    status = notmuch_query_count_messages_st (query, &count);
-    return status ? 0 : count;
+#if HAVE_PTHREAD
+    for (i = 0; i < num_started; i++) {
+	notmuch_threads_worker_t *worker = &threads->workers[i];
+
+	pthread_join (worker->thread, NULL);
+	if (worker->status)
+	    memset (worker->threads_out, 0,
+		    worker->count * sizeof (notmuch_thread_t *));
+    }
+#endif
 }
 
-notmuch_status_t
-notmuch_query_count_messages_st (notmuch_query_t *query, unsigned *count_out)
+/* Take the seeds of the threads skipped by the query's offset from
+ * the message stream.  They are only marked as seen, so that none of
+ * their messages seeds a thread later; the threads are never
+ * created. */
+static void
+_notmuch_threads_skip (notmuch_threads_t *threads)
 {
-    return _notmuch_query_count_documents (query, "mail", count_out);
+    for (;
+	 threads->skip && notmuch_messages_valid (threads->messages);
+	 notmuch_messages_move_to_next (threads->messages))
+    {
+	notmuch_message_t *message;
+	const char *thread_id;
+
+	message = notmuch_messages_get (threads->messages);
+	_notmuch_message_set_fields (message, NOTMUCH_FIELD_THREAD_ID);
+	thread_id = notmuch_message_get_thread_id (message);
+
+	if (! g_hash_table_lookup_extended (threads->seen, thread_id,
+					    NULL, NULL)) {
+	    g_hash_table_insert (threads->seen,
+				 talloc_strdup (threads, thread_id), NULL);
+	    threads->skip--;
+	}
+
+	notmuch_message_destroy (message);
+    }
 }
 
-notmuch_status_t
-_notmuch_query_count_documents (notmuch_query_t *query, const char *type, unsigned *count_out)
+/* Take the seeds of up to NOTMUCH_THREAD_BATCH_SIZE threads per
+ * worker not seen yet from the message stream, find which of their
+ * messages match the query, and create all of them with a single
+ * query (per worker).
+ *
+ * Skipping any message whose thread has already been seen picks
+ * exactly the seeds that walking every match in order would have
+ * picked, so the order of the results does not depend on the batch
+ * size.  If only the thread creation fails, the batch is kept with
+ * no threads in it, and notmuch_threads_get creates them one at a
+ * time. */
+static notmuch_status_t
+_notmuch_threads_fill_batch (notmuch_threads_t *threads)
 {
-    notmuch_database_t *notmuch = query->notmuch;
-    const char *query_string = query->query_string;
-    Xapian::doccount count = 0;
+    notmuch_query_t *query = threads->query;
+    notmuch_messages_t *matches;
+    notmuch_string_list_t *thread_terms;
+    const char **thread_ids;
+    GArray *match_ids;
+    notmuch_sort_t sort;
+    unsigned int count = 0, size;
+    notmuch_status_t status;
+    notmuch_profile_timer_t timer;
+    void *ctx;
 
-    try {
-	Xapian::Enquire enquire (*notmuch->xapian_db);
-	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
-						   type));
-	Xapian::Query string_query, final_query, exclude_query;
-	Xapian::MSet mset;
-	unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
-			      Xapian::QueryParser::FLAG_PHRASE |
-			      Xapian::QueryParser::FLAG_LOVEHATE |
-			      Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
-			      Xapian::QueryParser::FLAG_WILDCARD |
-			      Xapian::QueryParser::FLAG_PURE_NOT);
+    _notmuch_threads_clear_batch (threads);
+    _notmuch_threads_skip (threads);
 
-	if (strcmp (query_string, "") == 0 ||
-	    strcmp (query_string, "*") == 0)
-	{
-	    final_query = mail_query;
-	} else {
-	    string_query = notmuch->query_parser->
-		parse_query (query_string, flags);
-	    final_query = Xapian::Query (Xapian::Query::OP_AND,
-					 mail_query, string_query);
-	}
+    if (threads->remaining == 0)
+	return NOTMUCH_STATUS_SUCCESS;
 
-	exclude_query = _notmuch_exclude_tags (query, final_query);
+    if (_notmuch_query_time_left (query) < 0)
+	return NOTMUCH_STATUS_QUERY_INTERRUPTED;
+
+    _notmuch_threads_open_workers (threads);
+
+    size = NOTMUCH_THREAD_BATCH_SIZE * (threads->num_workers + 1);
+    if (threads->remaining > 0 && size > (unsigned int) threads->remaining)
+	size = threads->remaining;
+    ctx = threads->batch_ctx = talloc_new (threads);
+    thread_ids = talloc_array (ctx, const char *, size);
+    threads->batch = talloc_zero_array (ctx, notmuch_thread_t *, size);
+    threads->batch_seed = talloc_array (ctx, unsigned int, size);
+    thread_terms = _notmuch_string_list_create (ctx);
+    if (unlikely (ctx == NULL || thread_ids == NULL ||
+		  threads->batch == NULL || threads->batch_seed == NULL ||
+		  thread_terms == NULL)) {
+	_notmuch_threads_clear_batch (threads);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
 
-	final_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
-					 final_query, exclude_query);
+    for (;
+	 notmuch_messages_valid (threads->messages) && count < size;
+	 notmuch_messages_move_to_next (threads->messages))
+    {
+	notmuch_message_t *message;
+	notmuch_string_list_t *aliases;
+	notmuch_string_node_t *node;
+	char *thread_id;
 
-	enquire.set_weighting_scheme(Xapian::BoolWeight());
-	enquire.set_docid_order(Xapian::Enquire::ASCENDING);
+	message = notmuch_messages_get (threads->messages);
+	_notmuch_message_set_fields (message, NOTMUCH_FIELD_THREAD_ID);
+
+	if (g_hash_table_lookup_extended (
+		threads->seen, notmuch_message_get_thread_id (message),
+		NULL, NULL)) {
+	    notmuch_message_destroy (message);
+	    continue;
+	}
+
+	thread_id = talloc_strdup (threads,
+				   notmuch_message_get_thread_id (message));
+	g_hash_table_insert (threads->seen, thread_id, NULL);
+
+	thread_ids[count] = thread_id;
+	threads->batch_seed[count] = _notmuch_message_get_doc_id (message);
+	_notmuch_string_list_append (thread_terms,
+				     talloc_asprintf (thread_terms, "%s%s",
+						      NOTMUCH_PREFIX_THREAD,
+						      thread_id));
+	aliases = _notmuch_database_get_thread_aliases (query->notmuch,
+							 thread_terms,
+							 thread_id);
+	for (node = aliases ? aliases->head : NULL; node; node = node->next)
+	    _notmuch_string_list_append (thread_terms,
+					 talloc_asprintf (thread_terms, "%s%s",
+							  NOTMUCH_PREFIX_THREAD,
+							  node->string));
+	count++;
+
+	notmuch_message_destroy (message);
+    }
+
+    if (count == 0)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    if (threads->remaining > 0)
+	threads->remaining -= count;
+
+    /* Only the matches within these threads are needed. */
+    sort = query->sort;
+    query->sort = NOTMUCH_SORT_UNSORTED;
+    query->filter_terms = thread_terms;
+    status = _notmuch_query_search_documents (query, "mail", &matches);
+    query->filter_terms = NULL;
+    query->sort = sort;
+    if (status) {
+	_notmuch_threads_clear_batch (threads);
+	return status;
+    }
+
+    match_ids = g_array_new (FALSE, FALSE, sizeof (unsigned int));
+    for (;
+	 notmuch_messages_valid (matches);
+	 notmuch_messages_move_to_next (matches))
+    {
+	unsigned int doc_id = _notmuch_mset_messages_get_doc_id (matches);
+	g_array_append_val (match_ids, doc_id);
+    }
+    talloc_free (matches);
+
+    /* Threads would be missing some of their matches. */
+    if (_notmuch_query_time_left (query) < 0) {
+	g_array_unref (match_ids);
+	_notmuch_threads_clear_batch (threads);
+	return NOTMUCH_STATUS_QUERY_INTERRUPTED;
+    }
+
+    if (! _notmuch_doc_id_set_init (ctx, &threads->batch_match_set,
+				    match_ids)) {
+	g_array_unref (match_ids);
+	_notmuch_threads_clear_batch (threads);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    _notmuch_profile_start (query->notmuch, &timer);
+    _notmuch_threads_create_batch (threads, count, thread_ids, match_ids);
+    _notmuch_profile_stop (query->notmuch, &timer, NOTMUCH_PROFILE_THREADS);
+    _notmuch_profile_count (query->notmuch, NOTMUCH_PROFILE_THREADS_BUILT,
+			    count);
+    g_array_unref (match_ids);
+
+    threads->batch_len = count;
+    threads->batch_pos = 0;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_bool_t
+notmuch_threads_valid (notmuch_threads_t *threads)
+{
+    notmuch_status_t status;
+
+    if (! threads)
+	return FALSE;
+
+    /* A thread the batch could not create would be created on its
+     * own, which an interrupted query no longer does. */
+    if (threads->batch_pos < threads->batch_len)
+	return threads->batch[threads->batch_pos] ||
+	    _notmuch_query_time_left (threads->query) >= 0;
+
+    if (threads->failed)
+	return FALSE;
+
+    status = _notmuch_threads_fill_batch (threads);
+    if (status) {
+	threads->failed = TRUE;
+	/* Xapian exceptions have been logged where they occurred, and
+	 * an interrupted query is reported as such. */
+	if (status != NOTMUCH_STATUS_QUERY_INTERRUPTED) {
+	    if (status != NOTMUCH_STATUS_XAPIAN_EXCEPTION)
+		_notmuch_database_log (threads->query->notmuch,
+				       "Error creating a batch of threads: %s\n",
+				       notmuch_status_to_string (status));
+	    threads->query->status = status;
+	}
+	return FALSE;
+    }
+
+    return threads->batch_pos < threads->batch_len;
+}
+
+notmuch_thread_t *
+notmuch_threads_get (notmuch_threads_t *threads)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    notmuch_profile_timer_t timer;
+    notmuch_thread_t *thread;
+
+    if (! notmuch_threads_valid (threads))
+	return NULL;
+
+    thread = threads->batch[threads->batch_pos];
+    if (thread) {
+	threads->batch[threads->batch_pos] = NULL;
+	return talloc_steal (threads->query, thread);
+    }
+
+    /* Either the batch could not be created or this thread has
+     * already been returned once; fall back to creating the thread on
+     * its own. */
+    _notmuch_profile_start (notmuch, &timer);
+    thread = _notmuch_thread_create (threads->query, notmuch,
+				     threads->batch_seed[threads->batch_pos],
+				     &threads->batch_match_set,
+				     threads->query->exclude_terms,
+				     threads->query->omit_excluded,
+				     threads->query->sort,
+				     _notmuch_query_summary_only (threads->query));
+    _notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_THREADS);
+    _notmuch_profile_count (notmuch, NOTMUCH_PROFILE_THREADS_BUILT, 1);
+
+    return thread;
+}
+
+void
+notmuch_threads_move_to_next (notmuch_threads_t *threads)
+{
+    if (threads->batch_pos < threads->batch_len)
+	threads->batch_pos++;
+}
+
+void
+notmuch_threads_destroy (notmuch_threads_t *threads)
+{
+    talloc_free (threads);
+}
+
+unsigned int
+notmuch_query_count_messages (notmuch_query_t *query)
+{
+    notmuch_status_t status;
+    unsigned int count;
+
+    status = notmuch_query_count_messages_st (query, &count);
+    return status ? 0 : count;
+}
+
+/* Whether 'date' means a different time depending on when it is
+ * read, like "today", "1w" or "monday": it is parsed as of now and as
+ * of more than a year ago, which tells apart anything relative to
+ * the day, the week or the year. */
+static notmuch_bool_t
+_notmuch_date_is_relative (const std::string &date, int round)
+{
+    time_t now, then, t_now, t_then;
+
+    if (date.empty ())
+	return FALSE;
+
+    if (time (&now) == (time_t) -1)
+	return TRUE;
+    then = now - 400 * 24 * 60 * 60;
+
+    if (parse_time_string (date.c_str (), &t_now, &now, round) ||
+	parse_time_string (date.c_str (), &t_then, &then, round))
+	return TRUE;
+
+    return t_now != t_then;
+}
+
+/* Whether 'query_string' has a date: range with an end relative to
+ * the present, whose matches change with time rather than with the
+ * database.  Quoted ranges are taken to be relative. */
+static notmuch_bool_t
+_notmuch_query_has_relative_date (const char *query_string)
+{
+    const char *prefix = "date:";
+    const char *s = query_string;
+
+    while ((s = strstr (s, prefix)) != NULL) {
+	size_t len;
+	std::string range, begin, end;
+	size_t dots;
+
+	s += strlen (prefix);
+	len = strcspn (s, " \t\n()");
+	range.assign (s, len);
+	s += len;
+
+	dots = range.find ("..");
+	if (dots == std::string::npos)
+	    continue;
+	if (range.find ('"') != std::string::npos)
+	    return TRUE;
+
+	begin = range.substr (0, dots);
+	end = range.substr (dots + 2);
+	if (end == "!")
+	    end = begin;
+
+	if (_notmuch_date_is_relative (begin, PARSE_TIME_ROUND_DOWN) ||
+	    _notmuch_date_is_relative (end, PARSE_TIME_ROUND_UP_INCLUSIVE))
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Return the key under which counts of 'kind' for 'query' are
+ * cached, or NULL on out-of-memory or if the counts of 'query' are
+ * not to be cached: with the cache disabled, or for relative date
+ * ranges, which the revision of the database does not date.  Runs of whitespace in the query
+ * string are collapsed, so trivially different spellings of a saved
+ * search share an entry. */
+static char *
+_notmuch_query_cache_key (void *ctx, notmuch_query_t *query, const char *kind)
+{
+    const char *s;
+    char *key, *collapsed, *c, *encoded = NULL;
+    size_t encoded_size = 0;
+    notmuch_bool_t space = FALSE;
+
+    if (! query->notmuch->query_cache_enabled ||
+	_notmuch_query_has_relative_date (query->query_string))
+	return NULL;
+
+    key = talloc_asprintf (ctx, "%s %d", kind, query->omit_excluded);
+
+    for (notmuch_string_node_t *term = query->exclude_terms->head;
+	 term && key; term = term->next)
+	key = talloc_asprintf_append_buffer (key, " -%s", term->string);
+
+    if (key)
+	key = talloc_strdup_append_buffer (key, " :");
+    if (key == NULL)
+	return NULL;
+
+    /* Collapsing never lengthens the query string. */
+    collapsed = c = talloc_array (key, char,
+				  strlen (query->query_string) + 1);
+    if (collapsed == NULL) {
+	talloc_free (key);
+	return NULL;
+    }
+    for (s = query->query_string; *s; s++) {
+	if (isspace ((unsigned char) *s)) {
+	    space = TRUE;
+	    continue;
+	}
+	if (space)
+	    *c++ = ' ';
+	space = FALSE;
+	*c++ = *s;
+    }
+    *c = '\0';
+
+    key = talloc_strdup_append_buffer (key, collapsed);
+    if (key == NULL)
+	return NULL;
+
+    if (hex_encode (ctx, key, &encoded, &encoded_size) != HEX_SUCCESS)
+	encoded = NULL;
+
+    talloc_free (key);
+    return encoded;
+}
+
+notmuch_status_t
+notmuch_query_count_messages_st (notmuch_query_t *query, unsigned *count_out)
+{
+    notmuch_status_t status;
+    char *key;
+
+    key = _notmuch_query_cache_key (query, query, "messages");
+    if (_notmuch_query_cache_lookup (query->notmuch, key, count_out)) {
+	talloc_free (key);
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    status = _notmuch_query_count_documents (query, "mail", count_out);
+    if (! status)
+	_notmuch_query_cache_store (query->notmuch, key, *count_out);
+
+    talloc_free (key);
+    return status;
+}
+
+/* With more matches than this many per tag in the database, asking
+ * which tags occur among the matches beats reading every match. */
+#define NOTMUCH_TAG_FACET_RATIO 8
+
+/* Return the Xapian query for the messages matching 'query', without
+ * the excluded ones where a message search would omit them. */
+static Xapian::Query
+_notmuch_query_message_query (notmuch_query_t *query)
+{
+    const char *query_string = query->query_string;
+    Xapian::Query final_query (talloc_asprintf (query, "%s%s",
+						NOTMUCH_PREFIX_TYPE,
+						"mail"));
+
+    if (strcmp (query_string, "") != 0 &&
+	strcmp (query_string, "*") != 0)
+	final_query = Xapian::Query (
+	    Xapian::Query::OP_AND, final_query,
+	    _notmuch_query_string_query (query));
+
+    if (query->omit_excluded == NOTMUCH_EXCLUDE_TRUE ||
+	query->omit_excluded == NOTMUCH_EXCLUDE_ALL)
+	final_query = Xapian::Query (Xapian::Query::OP_AND_NOT, final_query,
+				     _notmuch_exclude_tags (query,
+							    final_query,
+							    NULL));
+
+    return final_query;
+}
+
+/* Count the tags of each match, straight from its term list. */
+class TagCountMatchSpy : public Xapian::MatchSpy {
+    std::string prefix;
+
+  public:
+    std::map<std::string, unsigned int> counts;
+
+    TagCountMatchSpy (const char *prefix_) : prefix (prefix_) { }
+
+    void operator() (const Xapian::Document &doc, double wt)
+    {
+	Xapian::TermIterator i = doc.termlist_begin ();
+	Xapian::TermIterator end = doc.termlist_end ();
+
+	(void) wt;
+	for (i.skip_to (prefix); i != end; i++) {
+	    const std::string &term = *i;
+
+	    if (term.compare (0, prefix.size (), prefix) != 0)
+		break;
+	    counts[term.substr (prefix.size ())]++;
+	}
+    }
+
+    /* Each sub-database of a combined database gets its own. */
+    Xapian::MatchSpy *clone () const {
+	return new TagCountMatchSpy (prefix.c_str ());
+    }
+};
+
+notmuch_status_t
+notmuch_query_collect_tags (notmuch_query_t *query, notmuch_tags_t **tags_out)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    const char *tag_prefix = NOTMUCH_PREFIX_TAG;
+    notmuch_string_list_t *catalogue, *tags;
+    notmuch_string_node_t *node;
+    notmuch_messages_t *messages;
+    notmuch_status_t status;
+    unsigned int fields;
+
+    *tags_out = NULL;
+
+    status = _notmuch_database_get_tag_catalogue_list (notmuch, &catalogue);
+    if (status)
+	return status;
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::Query final_query = _notmuch_query_message_query (query);
+	Xapian::MSet mset;
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	enquire.set_query (final_query);
+	mset = enquire.get_mset (0, 0);
+
+	if (mset.get_matches_estimated () >
+	    NOTMUCH_TAG_FACET_RATIO * (Xapian::doccount) catalogue->length) {
+	    tags = _notmuch_string_list_create (query);
+	    if (unlikely (tags == NULL))
+		return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+	    /* The catalogue is sorted, so the result is as well. */
+	    for (node = catalogue->head; node; node = node->next) {
+		std::string term = std::string (tag_prefix) + node->string;
+
+		enquire.set_query (Xapian::Query (Xapian::Query::OP_FILTER,
+						  final_query,
+						  Xapian::Query (term)));
+		if (enquire.get_mset (0, 1).size ())
+		    _notmuch_string_list_append (tags, node->string);
+	    }
+
+	    *tags_out = _notmuch_tags_create (query, tags);
+	    return *tags_out ? NOTMUCH_STATUS_SUCCESS :
+		NOTMUCH_STATUS_OUT_OF_MEMORY;
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred collecting tags: %s\n",
+			       error.get_msg ().c_str ());
+	_notmuch_database_log_append (notmuch,
+				      "Query string was: %s\n",
+				      query->query_string);
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    fields = query->fields;
+    notmuch_query_set_fields (query, NOTMUCH_FIELD_TAGS);
+    status = notmuch_query_search_messages_st (query, &messages);
+    notmuch_query_set_fields (query, fields);
+    if (status)
+	return status;
+
+    *tags_out = notmuch_messages_collect_tags (messages);
+    if (*tags_out)
+	talloc_steal (query, *tags_out);
+    notmuch_messages_destroy (messages);
+
+    return *tags_out ? NOTMUCH_STATUS_SUCCESS : NOTMUCH_STATUS_OUT_OF_MEMORY;
+}
+
+/* Count the files of each match, from its file-direntry terms.  A
+ * message from before rename support keeps its one filename in the
+ * data of its document instead. */
+class FileCountMatchSpy : public Xapian::MatchSpy {
+    std::string prefix;
+
+  public:
+    Xapian::doccount count;
+
+    FileCountMatchSpy (const char *prefix_) : prefix (prefix_), count (0) { }
+
+    void operator() (const Xapian::Document &doc, double wt)
+    {
+	Xapian::TermIterator i = doc.termlist_begin ();
+	Xapian::TermIterator end = doc.termlist_end ();
+	Xapian::doccount files = 0;
+
+	(void) wt;
+	for (i.skip_to (prefix); i != end; i++) {
+	    if ((*i).compare (0, prefix.size (), prefix) != 0)
+		break;
+	    files++;
+	}
+	count += files ? files : 1;
+    }
+
+    /* Each sub-database of a combined database gets its own. */
+    Xapian::MatchSpy *clone () const {
+	return new FileCountMatchSpy (prefix.c_str ());
+    }
+};
+
+/* Count the files of the matches of 'query' by listing the files of
+ * each, for a remote database, which cannot be sent a match spy of
+ * our own. */
+static notmuch_status_t
+_notmuch_query_count_files_walk (notmuch_query_t *query,
+				 unsigned int *count_out)
+{
+    notmuch_messages_t *messages;
+    notmuch_filenames_t *filenames;
+    notmuch_status_t status;
+    unsigned int fields, count = 0;
+
+    fields = query->fields;
+    notmuch_query_set_fields (query, NOTMUCH_FIELD_FILENAMES);
+    status = notmuch_query_search_messages_st (query, &messages);
+    notmuch_query_set_fields (query, fields);
+    if (status)
+	return status;
+
+    for (; notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages)) {
+	notmuch_message_t *message = notmuch_messages_get (messages);
+
+	for (filenames = notmuch_message_get_filenames (message);
+	     notmuch_filenames_valid (filenames);
+	     notmuch_filenames_move_to_next (filenames))
+	    count++;
+	notmuch_filenames_destroy (filenames);
+	notmuch_message_destroy (message);
+    }
+    notmuch_messages_destroy (messages);
+
+    *count_out = count;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_query_count_files (notmuch_query_t *query, unsigned int *count_out)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    FileCountMatchSpy spy (NOTMUCH_PREFIX_FILE_DIRENTRY);
+    notmuch_status_t status;
+    char *key;
+
+    key = _notmuch_query_cache_key (query, query, "files");
+    if (_notmuch_query_cache_lookup (notmuch, key, count_out)) {
+	talloc_free (key);
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    if (notmuch->xapian_stub) {
+	status = _notmuch_query_count_files_walk (query, count_out);
+	if (status == NOTMUCH_STATUS_SUCCESS)
+	    _notmuch_query_cache_store (notmuch, key, *count_out);
+	talloc_free (key);
+	return status;
+    }
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	enquire.set_query (_notmuch_query_message_query (query));
+	enquire.add_matchspy (&spy);
+
+	/* The spy sees every match that is counted, so ask for an
+	 * exact count. */
+	enquire.get_mset (0, 0, notmuch->xapian_db->get_doccount ());
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred counting files: %s\n",
+			       error.get_msg ().c_str ());
+	_notmuch_database_log_append (notmuch,
+				      "Query string was: %s\n",
+				      query->query_string);
+	notmuch->exception_reported = TRUE;
+	talloc_free (key);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    *count_out = spy.count;
+    _notmuch_query_cache_store (notmuch, key, *count_out);
+
+    talloc_free (key);
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Count the matches of 'query' carrying each tag of the catalogue
+ * with a query for each, for a remote database, which cannot be sent
+ * a match spy of our own.  The caller catches Xapian exceptions. */
+static notmuch_status_t
+_notmuch_query_count_tags_each (notmuch_query_t *query,
+				std::map<std::string, unsigned int> &counts)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    const char *tag_prefix = NOTMUCH_PREFIX_TAG;
+    Xapian::Enquire enquire (*notmuch->xapian_db);
+    Xapian::Query final_query = _notmuch_query_message_query (query);
+    Xapian::doccount doccount = notmuch->xapian_db->get_doccount ();
+    notmuch_string_list_t *catalogue;
+    notmuch_string_node_t *node;
+    notmuch_status_t status;
+
+    status = _notmuch_database_get_tag_catalogue_list (notmuch, &catalogue);
+    if (status)
+	return status;
+
+    enquire.set_weighting_scheme (Xapian::BoolWeight ());
+    for (node = catalogue->head; node; node = node->next) {
+	Xapian::MSet mset;
+
+	enquire.set_query (Xapian::Query (
+	    Xapian::Query::OP_FILTER, final_query,
+	    Xapian::Query (std::string (tag_prefix) + node->string)));
+	mset = enquire.get_mset (0, 0, doccount);
+	if (mset.get_matches_estimated ())
+	    counts[node->string] = mset.get_matches_estimated ();
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_query_count_tags (notmuch_query_t *query, notmuch_tags_t **tags_out)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    TagCountMatchSpy spy (NOTMUCH_PREFIX_TAG);
+    std::map<std::string, unsigned int>::iterator i;
+    notmuch_string_list_t *tags;
+    notmuch_status_t status;
+    unsigned int *counts;
+    size_t n = 0;
+
+    *tags_out = NULL;
+
+    try {
+	if (notmuch->xapian_stub) {
+	    status = _notmuch_query_count_tags_each (query, spy.counts);
+	    if (status)
+		return status;
+	} else {
+	    Xapian::Enquire enquire (*notmuch->xapian_db);
+
+	    enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	    enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	    enquire.set_query (_notmuch_query_message_query (query));
+	    enquire.add_matchspy (&spy);
+
+	    /* The spy sees every match that is counted, so ask for an
+	     * exact count. */
+	    enquire.get_mset (0, 0, notmuch->xapian_db->get_doccount ());
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred counting tags: %s\n",
+			       error.get_msg ().c_str ());
+	_notmuch_database_log_append (notmuch,
+				      "Query string was: %s\n",
+				      query->query_string);
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    tags = _notmuch_string_list_create (query);
+    if (unlikely (tags == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    counts = talloc_array (tags, unsigned int, spy.counts.size () + 1);
+    if (unlikely (counts == NULL)) {
+	talloc_free (tags);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    /* The map is sorted the way the catalogue is. */
+    for (i = spy.counts.begin (); i != spy.counts.end (); i++) {
+	_notmuch_string_list_append (tags, i->first.c_str ());
+	counts[n++] = i->second;
+    }
+
+    *tags_out = _notmuch_tags_create_with_counts (query, tags, counts);
+    return *tags_out ? NOTMUCH_STATUS_SUCCESS : NOTMUCH_STATUS_OUT_OF_MEMORY;
+}
+
+/* Add the tag terms for the NULL-terminated array 'tags' to
+ * 'terms'. */
+static notmuch_status_t
+_notmuch_tag_terms (const char **tags, std::set<std::string> &terms)
+{
+    const char *tag_prefix = NOTMUCH_PREFIX_TAG;
+
+    for (; tags && *tags; tags++) {
+	if (strlen (*tags) > NOTMUCH_TAG_MAX)
+	    return NOTMUCH_STATUS_TAG_TOO_LONG;
+	terms.insert (tag_prefix + std::string (*tags));
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_query_change_tags (notmuch_query_t *query,
+			   const char **add_tags,
+			   const char **remove_tags,
+			   notmuch_bool_t remove_all,
+			   unsigned int *changed_out)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    std::set<std::string> add_terms, remove_terms;
+    std::vector<unsigned int> doc_ids;
+    notmuch_messages_t *messages;
+    notmuch_status_t status;
+    unsigned int changed = 0;
+    size_t i;
+
+    if (changed_out)
+	*changed_out = 0;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    status = _notmuch_tag_terms (add_tags, add_terms);
+    if (! status)
+	status = _notmuch_tag_terms (remove_tags, remove_terms);
+    if (status)
+	return status;
+
+    /* The matches are all found before any is changed, since that
+     * may change what the query matches. */
+    _notmuch_query_start_unbounded (query);
+    status = _notmuch_query_search_documents (query, "mail", &messages);
+    if (status)
+	return status;
+
+    for (;
+	 _notmuch_mset_messages_valid (messages);
+	 _notmuch_mset_messages_move_to_next (messages))
+	doc_ids.push_back (_notmuch_mset_messages_get_doc_id (messages));
+
+    talloc_free (messages);
+
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status)
+	return status;
+
+    try {
+	for (i = 0; i < doc_ids.size (); i++) {
+	    if (_notmuch_database_change_document_tags (notmuch, doc_ids[i],
+							add_terms,
+							remove_terms,
+							remove_all))
+		changed++;
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred changing tags: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    if (changed_out)
+	*changed_out = changed;
+
+    notmuch_status_t end_status = notmuch_database_end_atomic (notmuch);
+    return status ? status : end_status;
+}
+
+/* Count the documents of 'type' matching 'query', checking at least
+ * 'check_at_least' matches, all of them if it is 0.  The count is
+ * exact when all matches are checked; otherwise it is Xapian's
+ * estimate, and '*lower_out' and '*upper_out' (if not NULL) are set
+ * to the bounds Xapian gives for it. */
+static notmuch_status_t
+_notmuch_query_count_documents_checked (notmuch_query_t *query,
+					const char *type,
+					unsigned int check_at_least,
+					unsigned *count_out,
+					unsigned *lower_out,
+					unsigned *upper_out)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    const char *query_string = query->query_string;
+    Xapian::doccount count = 0, lower = 0, upper = 0;
+    notmuch_archive_route_t *route;
+
+    route = _notmuch_database_route_query (notmuch, query_string);
+
+    try {
+	Xapian::Enquire enquire (_notmuch_archive_route_database (notmuch,
+								  route));
+	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
+						   NOTMUCH_PREFIX_TYPE,
+						   type));
+	Xapian::Query string_query, final_query, exclude_query;
+	Xapian::MSet mset;
+	notmuch_profile_timer_t timer;
+
+	if (strcmp (query_string, "") == 0 ||
+	    strcmp (query_string, "*") == 0)
+	{
+	    final_query = mail_query;
+	} else {
+	    string_query = _notmuch_query_string_query (query);
+	    final_query = Xapian::Query (Xapian::Query::OP_AND,
+					 mail_query, string_query);
+	}
+
+	_notmuch_profile_start (notmuch, &timer);
+	exclude_query = _notmuch_exclude_tags (query, final_query, route);
+
+	final_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
+					 final_query, exclude_query);
+	_notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_EXCLUDE);
+
+	enquire.set_weighting_scheme(Xapian::BoolWeight());
+	enquire.set_docid_order(Xapian::Enquire::ASCENDING);
 
 	if (_debug_query ()) {
 	    fprintf (stderr, "Exclude query is:\n%s\n",
@@ -618,10 +3002,17 @@ _notmuch_query_count_documents (notmuch_query_t *query, const char *type, unsign
 	 * Set the checkatleast parameter to the number of documents
 	 * in the database to make get_matches_estimated() exact.
 	 */
-	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount (),
-				 notmuch->xapian_db->get_doccount ());
+	_notmuch_profile_start (notmuch, &timer);
+	if (check_at_least == 0)
+	    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount (),
+				     notmuch->xapian_db->get_doccount ());
+	else
+	    mset = enquire.get_mset (0, 0, check_at_least);
+	_notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_MATCH);
 
 	count = mset.get_matches_estimated();
+	lower = mset.get_matches_lower_bound ();
+	upper = mset.get_matches_upper_bound ();
 
     } catch (const Xapian::Error &error) {
 	_notmuch_database_log (notmuch,
@@ -629,13 +3020,42 @@ _notmuch_query_count_documents (notmuch_query_t *query, const char *type, unsign
 			       "Query string was: %s\n",
 			       error.get_msg().c_str(),
 			       query->query_string);
+	_notmuch_archive_route_destroy (route);
 	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 
+    _notmuch_archive_route_destroy (route);
     *count_out = count;
+    if (lower_out)
+	*lower_out = lower;
+    if (upper_out)
+	*upper_out = upper;
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+notmuch_status_t
+_notmuch_query_count_documents (notmuch_query_t *query, const char *type, unsigned *count_out)
+{
+    return _notmuch_query_count_documents_checked (query, type, 0, count_out,
+						   NULL, NULL);
+}
+
+/* How many matches an estimated count checks.  Enough for the
+ * estimate of a small result to be exact, while broad queries stop
+ * well short of their full posting lists. */
+#define NOTMUCH_COUNT_ESTIMATE_CHECK_AT_LEAST 1000
+
+notmuch_status_t
+notmuch_query_count_messages_estimate (notmuch_query_t *query,
+				       unsigned int *estimate,
+				       unsigned int *lower,
+				       unsigned int *upper)
+{
+    return _notmuch_query_count_documents_checked (
+	query, "mail", NOTMUCH_COUNT_ESTIMATE_CHECK_AT_LEAST,
+	estimate, lower, upper);
+}
+
 unsigned
 notmuch_query_count_threads (notmuch_query_t *query)
 {
@@ -646,20 +3066,113 @@ notmuch_query_count_threads (notmuch_query_t *query)
     return status ? 0 : count;
 }
 
-notmuch_status_t
-notmuch_query_count_threads_st (notmuch_query_t *query, unsigned *count)
+/* Count the threads matched by 'query' by collapsing the matches on
+ * NOTMUCH_VALUE_THREAD_ID, so that Xapian does the counting without
+ * any message objects being created.  Requires
+ * NOTMUCH_FEATURE_THREAD_ID_VALUES. */
+static notmuch_status_t
+_notmuch_query_count_threads_collapsed (notmuch_query_t *query,
+					unsigned *count_out)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    const char *query_string = query->query_string;
+    Xapian::doccount count = 0;
+    notmuch_archive_route_t *route;
+
+    route = _notmuch_database_route_query (notmuch, query_string);
+
+    try {
+	Xapian::Enquire enquire (_notmuch_archive_route_database (notmuch,
+								  route));
+	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
+						   NOTMUCH_PREFIX_TYPE,
+						   "mail"));
+	Xapian::Query string_query, final_query, exclude_query;
+	Xapian::MSet mset;
+	notmuch_profile_timer_t timer;
+
+	if (strcmp (query_string, "") == 0 ||
+	    strcmp (query_string, "*") == 0)
+	{
+	    final_query = mail_query;
+	} else {
+	    string_query = _notmuch_query_string_query (query);
+	    final_query = Xapian::Query (Xapian::Query::OP_AND,
+					 mail_query, string_query);
+	}
+
+	/* Excluded messages are only dropped from the count when they
+	 * would be dropped from the search results, as for
+	 * notmuch_query_search_threads. */
+	if ((query->omit_excluded == NOTMUCH_EXCLUDE_TRUE ||
+	     query->omit_excluded == NOTMUCH_EXCLUDE_ALL) &&
+	    query->exclude_terms) {
+	    _notmuch_profile_start (notmuch, &timer);
+	    exclude_query = _notmuch_exclude_tags (query, final_query, route);
+
+	    final_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
+					 final_query, exclude_query);
+	    _notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_EXCLUDE);
+	}
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight());
+	enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	enquire.set_collapse_key (NOTMUCH_VALUE_THREAD_ID);
+
+	if (_debug_query ()) {
+	    fprintf (stderr, "Exclude query is:\n%s\n",
+		     exclude_query.get_description ().c_str ());
+	    fprintf (stderr, "Final query is:\n%s\n",
+		     final_query.get_description ().c_str ());
+	}
+
+	enquire.set_query (final_query);
+
+	/* With collapsing, the MSet holds one document per thread, so
+	 * asking for every document gives the exact thread count. */
+	_notmuch_profile_start (notmuch, &timer);
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+	_notmuch_profile_stop (notmuch, &timer, NOTMUCH_PROFILE_MATCH);
+
+	count = mset.size ();
+
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred performing query: %s\n"
+			       "Query string was: %s\n",
+			       error.get_msg().c_str(),
+			       query->query_string);
+	_notmuch_archive_route_destroy (route);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    _notmuch_archive_route_destroy (route);
+    *count_out = count;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+static notmuch_status_t
+_notmuch_query_count_threads (notmuch_query_t *query, unsigned *count)
 {
     notmuch_messages_t *messages;
     GHashTable *hash;
     notmuch_sort_t sort;
+    unsigned int fields;
     notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
 
+    if (_notmuch_query_can_collapse_threads (query))
+	return _notmuch_query_count_threads_collapsed (query, count);
+
+    _notmuch_query_start_unbounded (query);
     sort = query->sort;
     query->sort = NOTMUCH_SORT_UNSORTED;
-    ret = notmuch_query_search_messages_st (query, &messages);
+    fields = query->fields;
+    query->fields = NOTMUCH_FIELD_THREAD_ID;
+    ret = _notmuch_query_search_documents (query, "mail", &messages);
+    query->sort = sort;
+    query->fields = fields;
     if (ret)
 	return ret;
-    query->sort = sort;
     if (messages == NULL)
 	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
 
@@ -692,6 +3205,256 @@ notmuch_query_count_threads_st (notmuch_query_t *query, unsigned *count)
     return ret;
 }
 
+notmuch_status_t
+notmuch_query_count_threads_st (notmuch_query_t *query, unsigned *count)
+{
+    notmuch_status_t status;
+    char *key;
+
+    key = _notmuch_query_cache_key (query, query, "threads");
+    if (_notmuch_query_cache_lookup (query->notmuch, key, count)) {
+	talloc_free (key);
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    status = _notmuch_query_count_threads (query, count);
+    if (! status)
+	_notmuch_query_cache_store (query->notmuch, key, *count);
+
+    talloc_free (key);
+    return status;
+}
+
+/* State shared by the threads evaluating a notmuch_query_count_batch
+ * call.  Each thread takes the next pending query until there are
+ * none left or one of them fails. */
+typedef struct _notmuch_count_batch {
+    notmuch_query_t **queries;
+    notmuch_bool_t count_threads;
+    unsigned int *counts;
+    /* Indices into queries of those not answered by the cache. */
+    unsigned int *pending;
+    unsigned int num_pending;
+    unsigned int next;
+    notmuch_status_t status;
+#if HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} notmuch_count_batch_t;
+
+typedef struct _notmuch_count_worker {
+    notmuch_count_batch_t *batch;
+    /* The handle this worker evaluates queries against. */
+    notmuch_database_t *notmuch;
+#if HAVE_PTHREAD
+    pthread_t thread;
+#endif
+} notmuch_count_worker_t;
+
+static void
+_notmuch_count_batch_lock (unused (notmuch_count_batch_t *batch))
+{
+#if HAVE_PTHREAD
+    pthread_mutex_lock (&batch->lock);
+#endif
+}
+
+static void
+_notmuch_count_batch_unlock (unused (notmuch_count_batch_t *batch))
+{
+#if HAVE_PTHREAD
+    pthread_mutex_unlock (&batch->lock);
+#endif
+}
+
+notmuch_query_t *
+_notmuch_query_copy (notmuch_database_t *notmuch, notmuch_query_t *query)
+{
+    notmuch_query_t *copy;
+
+    copy = notmuch_query_create (notmuch, query->query_string);
+    if (unlikely (copy == NULL))
+	return NULL;
+
+    copy->sort = query->sort;
+    copy->omit_excluded = query->omit_excluded;
+    copy->offset = query->offset;
+    copy->limit = query->limit;
+    copy->budget = query->budget;
+
+    for (notmuch_string_node_t *term = query->exclude_terms->head; term;
+	 term = term->next) {
+	/* Skip exclude tags already found in the query string. */
+	if (*term->string == '\0')
+	    continue;
+	_notmuch_string_list_append (copy->exclude_terms,
+				     talloc_strdup (copy, term->string));
+    }
+
+    return copy;
+}
+
+static void *
+_notmuch_count_worker (void *closure)
+{
+    notmuch_count_worker_t *worker = (notmuch_count_worker_t *) closure;
+    notmuch_count_batch_t *batch = worker->batch;
+
+    for (;;) {
+	notmuch_query_t *query, *copy = NULL;
+	notmuch_status_t status;
+	unsigned int n;
+
+	_notmuch_count_batch_lock (batch);
+	if (batch->status || batch->next == batch->num_pending) {
+	    _notmuch_count_batch_unlock (batch);
+	    break;
+	}
+	n = batch->pending[batch->next++];
+	_notmuch_count_batch_unlock (batch);
+
+	query = batch->queries[n];
+	if (worker->notmuch != query->notmuch) {
+	    query = copy = _notmuch_query_copy (worker->notmuch, query);
+	    if (unlikely (query == NULL)) {
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		goto FAIL;
+	    }
+	}
+
+	if (batch->count_threads)
+	    status = _notmuch_query_count_threads (query, &batch->counts[n]);
+	else
+	    status = _notmuch_query_count_documents (query, "mail",
+						     &batch->counts[n]);
+
+	if (copy)
+	    notmuch_query_destroy (copy);
+
+	if (status == NOTMUCH_STATUS_SUCCESS)
+	    continue;
+
+      FAIL:
+	_notmuch_count_batch_lock (batch);
+	if (! batch->status)
+	    batch->status = status;
+	_notmuch_count_batch_unlock (batch);
+	break;
+    }
+
+    return NULL;
+}
+
+notmuch_status_t
+notmuch_query_count_batch (notmuch_query_t **queries,
+			   unsigned int num_queries,
+			   notmuch_bool_t count_threads,
+			   unsigned int jobs,
+			   unsigned int *counts)
+{
+    const char *kind = count_threads ? "threads" : "messages";
+    notmuch_database_t *notmuch;
+    notmuch_count_batch_t batch;
+    notmuch_count_worker_t self;
+    unsigned int i;
+    char **keys;
+    void *local;
+#if HAVE_PTHREAD
+    notmuch_count_worker_t *workers = NULL;
+    unsigned int num_workers = 0;
+#endif
+
+    if (num_queries == 0)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    notmuch = queries[0]->notmuch;
+    for (i = 1; i < num_queries; i++) {
+	if (queries[i]->notmuch != notmuch)
+	    return NOTMUCH_STATUS_NULL_POINTER;
+    }
+
+    local = talloc_new (NULL);
+    keys = talloc_zero_array (local, char *, num_queries);
+    batch.pending = talloc_array (local, unsigned int, num_queries);
+    if (unlikely (keys == NULL || batch.pending == NULL)) {
+	talloc_free (local);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    batch.queries = queries;
+    batch.count_threads = count_threads;
+    batch.counts = counts;
+    batch.num_pending = 0;
+    batch.next = 0;
+    batch.status = NOTMUCH_STATUS_SUCCESS;
+
+    /* Answer what we can from the cache before starting any
+     * threads. */
+    for (i = 0; i < num_queries; i++) {
+	keys[i] = _notmuch_query_cache_key (keys, queries[i], kind);
+	if (! _notmuch_query_cache_lookup (notmuch, keys[i], &counts[i]))
+	    batch.pending[batch.num_pending++] = i;
+    }
+
+    if (jobs > batch.num_pending)
+	jobs = batch.num_pending;
+
+#if HAVE_PTHREAD
+    /* The calling thread is a worker too, on its own handle; the
+     * others each open another.  Failing to open one just leaves
+     * fewer workers. */
+    if (jobs > 1 && notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY) {
+	pthread_mutex_init (&batch.lock, NULL);
+
+	workers = talloc_zero_array (local, notmuch_count_worker_t, jobs - 1);
+	for (i = 0; workers && i < jobs - 1; i++) {
+	    notmuch_count_worker_t *worker = &workers[num_workers];
+	    char *status_string = NULL;
+
+	    if (notmuch_database_open_verbose (notmuch->path,
+					       NOTMUCH_DATABASE_MODE_READ_ONLY,
+					       &worker->notmuch,
+					       &status_string)) {
+		free (status_string);
+		break;
+	    }
+
+	    worker->batch = &batch;
+	    if (pthread_create (&worker->thread, NULL,
+				_notmuch_count_worker, worker)) {
+		notmuch_database_destroy (worker->notmuch);
+		break;
+	    }
+	    num_workers++;
+	}
+    }
+#endif
+
+    self.batch = &batch;
+    self.notmuch = notmuch;
+    _notmuch_count_worker (&self);
+
+#if HAVE_PTHREAD
+    for (i = 0; i < num_workers; i++) {
+	pthread_join (workers[i].thread, NULL);
+	notmuch_database_destroy (workers[i].notmuch);
+    }
+
+    if (jobs > 1 && notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
+	pthread_mutex_destroy (&batch.lock);
+#endif
+
+    if (batch.status == NOTMUCH_STATUS_SUCCESS) {
+	for (i = 0; i < batch.num_pending; i++) {
+	    unsigned int n = batch.pending[i];
+	    _notmuch_query_cache_store (notmuch, keys[n], counts[n]);
+	}
+    }
+
+    talloc_free (local);
+    return batch.status;
+}
+
 notmuch_database_t *
 notmuch_query_get_database (const notmuch_query_t *query)
 {
@@ -0,0 +1,275 @@
+/* replicate.cc - Read-only replicas of a database
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* A replica is a read-only copy of a database kept up to date with
+ * Xapian's replication protocol.  The primary writes out the
+ * changesets committed since the revision of the replica (which its
+ * writers only keep with XAPIAN_MAX_CHANGESETS in their environment),
+ * or a full copy when it no longer has them all, and the replica
+ * applies them, one commit at a time.
+ *
+ * Everything notmuch keeps in the Xapian database comes along: the
+ * documents, the metadata (features, last_thread_id, tombstones and
+ * the rest) and the UUID, so a replica reports the same revision and
+ * UUID as the primary did at that commit, and lastmod: queries mean
+ * the same on both.  Nothing else below .notmuch is replicated; in
+ * particular archive shards, which never change, are to be copied
+ * once.
+ *
+ * At the replica, .notmuch/xapian is the directory Xapian keeps the
+ * replica in, where a stub file, XAPIANDB, names the current copy.
+ * Xapian opens the directory through the stub like a database. */
+
+#define NOTMUCH_REPLICA_STUB "XAPIANDB"
+
+/* After a full copy, how long readers have to move to the new copy
+ * before the old one is removed. */
+#define NOTMUCH_REPLICA_READER_CLOSE_SECONDS 10
+
+static char *
+_xapian_path (void *ctx, const char *path)
+{
+    return talloc_asprintf (ctx, "%s/.notmuch/xapian", path);
+}
+
+notmuch_bool_t
+_notmuch_xapian_path_is_replica (const char *xapian_path)
+{
+    char *stub = talloc_asprintf (NULL, "%s/%s", xapian_path,
+				  NOTMUCH_REPLICA_STUB);
+    struct stat st;
+    notmuch_bool_t ret;
+
+    ret = stub && stat (stub, &st) == 0;
+    talloc_free (stub);
+    return ret;
+}
+
+/* Revisions of replicas are binary, so they travel hex-encoded. */
+static char *
+_revision_encode (const std::string &revision)
+{
+    char *encoded = (char *) malloc (2 * revision.size () + 1);
+    size_t i;
+
+    if (encoded == NULL)
+	return NULL;
+
+    for (i = 0; i < revision.size (); i++)
+	sprintf (encoded + 2 * i, "%02x", (unsigned char) revision[i]);
+    encoded[2 * i] = '\0';
+
+    return encoded;
+}
+
+static notmuch_bool_t
+_revision_decode (const char *encoded, std::string &revision)
+{
+    size_t i, length = strlen (encoded);
+    unsigned int byte;
+
+    if (length % 2)
+	return FALSE;
+
+    revision.clear ();
+    for (i = 0; i < length; i += 2) {
+	if (! isxdigit (encoded[i]) || ! isxdigit (encoded[i + 1]) ||
+	    sscanf (encoded + i, "%2x", &byte) != 1)
+	    return FALSE;
+	revision += (char) byte;
+    }
+
+    return TRUE;
+}
+
+/* Set *status_string, if not NULL, to a message formatted by malloc. */
+static void
+_replica_error (char **status_string, const char *format, ...)
+{
+    va_list va_args;
+    char *message = NULL;
+
+    va_start (va_args, format);
+    IGNORE_RESULT (vasprintf (&message, format, va_args));
+    va_end (va_args);
+
+    if (status_string)
+	*status_string = message;
+    else
+	free (message);
+}
+
+notmuch_status_t
+notmuch_database_get_replica_revision (const char *path,
+				       char **revision,
+				       char **status_string)
+{
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    char *xapian_path;
+    struct stat st;
+
+    if (path == NULL || revision == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    xapian_path = _xapian_path (NULL, path);
+    if (xapian_path == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    *revision = NULL;
+
+    /* A new replica starts with a full copy. */
+    if (stat (xapian_path, &st) != 0) {
+	*revision = strdup ("");
+	goto DONE;
+    }
+
+    if (! _notmuch_xapian_path_is_replica (xapian_path)) {
+	_replica_error (status_string, "Error: %s is not a replica.\n",
+			xapian_path);
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    try {
+	Xapian::DatabaseReplica replica (xapian_path);
+
+	*revision = _revision_encode (replica.get_revision_info ());
+	replica.close ();
+    } catch (const Xapian::Error &error) {
+	_replica_error (status_string, "A Xapian exception occurred reading the revision of a replica: %s\n",
+			error.get_msg ().c_str ());
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	goto DONE;
+    }
+
+  DONE:
+    if (status == NOTMUCH_STATUS_SUCCESS && *revision == NULL)
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+    talloc_free (xapian_path);
+    return status;
+}
+
+notmuch_status_t
+notmuch_database_write_changesets (const char *path,
+				   const char *revision,
+				   int fd,
+				   char **status_string)
+{
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    std::string start;
+    char *xapian_path;
+
+    if (path == NULL || revision == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    if (! _revision_decode (revision, start)) {
+	_replica_error (status_string, "Error: malformed replica revision: %s\n",
+			revision);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    xapian_path = _xapian_path (NULL, path);
+    if (xapian_path == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    try {
+	Xapian::DatabaseMaster master (xapian_path);
+	Xapian::ReplicationInfo info;
+
+	master.write_changesets_to_fd (fd, start, &info);
+    } catch (const Xapian::Error &error) {
+	_replica_error (status_string, "A Xapian exception occurred writing changesets: %s\n",
+			error.get_msg ().c_str ());
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    talloc_free (xapian_path);
+    return status;
+}
+
+notmuch_status_t
+notmuch_database_apply_changesets (const char *path,
+				   int fd,
+				   notmuch_bool_t *changed,
+				   char **status_string)
+{
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    char *notmuch_path, *xapian_path;
+    struct stat st;
+
+    if (path == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    if (changed)
+	*changed = FALSE;
+
+    notmuch_path = talloc_asprintf (NULL, "%s/.notmuch", path);
+    xapian_path = _xapian_path (notmuch_path, path);
+    if (xapian_path == NULL) {
+	talloc_free (notmuch_path);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    if (mkdir (notmuch_path, 0755) && errno != EEXIST) {
+	_replica_error (status_string, "Error creating %s: %s\n",
+			notmuch_path, strerror (errno));
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    /* Never turn a database of its own into a replica. */
+    if (stat (xapian_path, &st) == 0 &&
+	! _notmuch_xapian_path_is_replica (xapian_path)) {
+	_replica_error (status_string, "Error: %s is not a replica.\n",
+			xapian_path);
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    try {
+	Xapian::DatabaseReplica replica (xapian_path);
+	Xapian::ReplicationInfo info;
+	bool more;
+
+	replica.set_read_fd (fd);
+	do {
+	    info.clear ();
+	    more = replica.apply_next_changeset (
+		&info, NOTMUCH_REPLICA_READER_CLOSE_SECONDS);
+	    if (info.changed && changed)
+		*changed = TRUE;
+	} while (more);
+	replica.close ();
+    } catch (const Xapian::Error &error) {
+	_replica_error (status_string, "A Xapian exception occurred applying changesets: %s\n",
+			error.get_msg ().c_str ());
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    talloc_free (notmuch_path);
+    return status;
+}
@@ -21,6 +21,7 @@
 #include "notmuch-private.h"
 
 #include "libsha1.h"
+#include "mbox-util.h"
 
 /* Just some simple interfaces on top of libsha1 so that we can leave
  * libsha1 as untouched as possible. */
@@ -84,7 +85,7 @@ _notmuch_sha1_of_file (const char *filename)
     unsigned char digest[SHA1_DIGEST_SIZE];
     char *result;
 
-    file = fopen (filename, "r");
+    file = mbox_member_fopen (filename);
     if (file == NULL)
 	return NULL;
 
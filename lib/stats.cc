@@ -0,0 +1,171 @@
+/* stats.cc - The shape of a database
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <algorithm>
+#include <vector>
+
+/* Everything here is read off the term lists of the database, with
+ * the frequency Xapian keeps for each term, so no document is read:
+ * counting the messages of each thread is a walk over the thread
+ * terms, counting the files one over the file-direntry terms. */
+
+static unsigned long
+_count_terms (Xapian::Database &db, const char *prefix)
+{
+    Xapian::TermIterator i, end = db.allterms_end (prefix);
+    unsigned long count = 0;
+
+    for (i = db.allterms_begin (prefix); i != end; i++)
+	count++;
+
+    return count;
+}
+
+static unsigned long
+_type_count (Xapian::Database &db, const char *type)
+{
+    return db.get_termfreq (std::string (NOTMUCH_PREFIX_TYPE) + type);
+}
+
+notmuch_status_t
+notmuch_database_get_stats (notmuch_database_t *notmuch,
+			    notmuch_database_stats_t *stats)
+{
+    if (stats == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    memset (stats, 0, sizeof (*stats));
+
+    try {
+	Xapian::Database &db = *notmuch->xapian_db;
+	const char *tag_prefix = NOTMUCH_PREFIX_TAG;
+	Xapian::TermIterator i, end;
+
+	stats->documents = db.get_doccount ();
+	stats->last_document_id = db.get_lastdocid ();
+	stats->average_length = db.get_avlength ();
+
+	stats->messages = _type_count (db, "mail");
+	stats->ghosts = _type_count (db, "ghost");
+	stats->directories = _count_terms (db, NOTMUCH_PREFIX_DIRECTORY);
+	stats->filenames = _count_terms (db, NOTMUCH_PREFIX_FILE_DIRENTRY);
+	stats->threads = _count_terms (db, NOTMUCH_PREFIX_THREAD);
+
+	end = db.allterms_end (tag_prefix);
+	for (i = db.allterms_begin (tag_prefix); i != end; i++) {
+	    stats->tags++;
+	    stats->tag_terms += i.get_termfreq ();
+	}
+
+	stats->pending_bodies = db.get_termfreq (
+	    std::string (NOTMUCH_PREFIX_PENDING) + "body");
+	stats->pending_extractions = db.get_termfreq (
+	    std::string (NOTMUCH_PREFIX_PENDING) + "extract");
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred reading database statistics: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+typedef std::pair<Xapian::doccount, std::string> _thread_size_t;
+
+/* Largest first, and in thread ID order among equals. */
+static bool
+_thread_size_larger (const _thread_size_t &a, const _thread_size_t &b)
+{
+    if (a.first != b.first)
+	return a.first > b.first;
+    return a.second < b.second;
+}
+
+notmuch_status_t
+notmuch_database_get_largest_threads (notmuch_database_t *notmuch,
+				      unsigned int n,
+				      notmuch_tags_t **threads)
+{
+    const char *prefix = NOTMUCH_PREFIX_THREAD;
+    size_t prefix_len = strlen (prefix);
+    std::vector<_thread_size_t> largest;
+    notmuch_string_list_t *list;
+    unsigned int *counts;
+
+    if (threads == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    *threads = NULL;
+
+    /* Keep the n largest as a heap whose top is the smallest of
+     * them, so the walk costs O(threads log n). */
+    try {
+	Xapian::Database &db = *notmuch->xapian_db;
+	Xapian::TermIterator i, end = db.allterms_end (prefix);
+
+	for (i = db.allterms_begin (prefix); n && i != end; i++) {
+	    Xapian::doccount freq = i.get_termfreq ();
+
+	    if (largest.size () == n) {
+		if (freq <= largest.front ().first)
+		    continue;
+		std::pop_heap (largest.begin (), largest.end (),
+			       _thread_size_larger);
+		largest.pop_back ();
+	    }
+	    largest.push_back (_thread_size_t (freq, (*i).substr (prefix_len)));
+	    std::push_heap (largest.begin (), largest.end (),
+			    _thread_size_larger);
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred reading thread sizes: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    std::sort_heap (largest.begin (), largest.end (), _thread_size_larger);
+
+    list = _notmuch_string_list_create (notmuch);
+    if (unlikely (list == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    counts = talloc_array (list, unsigned int, largest.size () + 1);
+    if (unlikely (counts == NULL)) {
+	talloc_free (list);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    for (size_t j = 0; j < largest.size (); j++) {
+	_notmuch_string_list_append (list, largest[j].second.c_str ());
+	counts[j] = largest[j].first;
+    }
+
+    *threads = _notmuch_tags_create_with_counts (notmuch, list, counts);
+    if (unlikely (*threads == NULL)) {
+	talloc_free (list);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
@@ -0,0 +1,674 @@
+/* tag-journal.cc - Tag changes not yet written to the database
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+#include "string-util.h"
+
+#include <sys/file.h> /* flock */
+#include <glib.h> /* GHashTable */
+
+/* Changing a few tags through a writable database costs taking the
+ * write lock and a commit.  Instead, a read-only database can append
+ * the changes to a journal, .notmuch/tag-journal:
+ *
+ *	notmuch-tag-journal 1 <sequence>
+ *	<sequence> <message ID> <+|-><tag> ...
+ *
+ * with the message IDs and tags hex-encoded.  Each entry has the next
+ * sequence number after those before it, or after the one on the
+ * first line once the file has been emptied.
+ *
+ * The database records, under the metadata key
+ * "tag_journal_sequence", the last entry it holds the changes of.
+ * The next writer to open the database applies the later entries in
+ * one transaction, which also records the new last sequence number,
+ * and then empties the file; a writer that dies in between leaves
+ * entries that are already applied, and so ignored.  Readers apply
+ * the entries that are not yet in the database on top of it: to the
+ * tags of messages, and to the tag: and is: terms of queries.
+ *
+ * Writers of the file hold an exclusive flock on it, and readers a
+ * shared one. */
+
+#define NOTMUCH_TAG_JOURNAL_FILE "tag-journal"
+#define NOTMUCH_TAG_JOURNAL_MAGIC "notmuch-tag-journal 1"
+
+struct _notmuch_tag_journal {
+    /* Map from message ID to a map from tag to TRUE if the tag is
+     * added, or FALSE if it is removed: the net effect of the entries
+     * not yet in the database. */
+    GHashTable *messages;
+
+    /* Entries queued by _notmuch_database_journal_tag, one per line
+     * and without sequence numbers, and the message ID of the last
+     * one. */
+    char *queued;
+    char *queued_id;
+};
+
+static int
+_notmuch_tag_journal_destructor (notmuch_tag_journal_t *journal)
+{
+    if (journal->messages)
+	g_hash_table_unref (journal->messages);
+
+    return 0;
+}
+
+static char *
+_tag_journal_path (void *ctx, notmuch_database_t *notmuch)
+{
+    return talloc_asprintf (ctx, "%s/.notmuch/%s", notmuch->path,
+			    NOTMUCH_TAG_JOURNAL_FILE);
+}
+
+static notmuch_tag_journal_t *
+_tag_journal_create (void *ctx)
+{
+    notmuch_tag_journal_t *journal;
+
+    journal = talloc_zero (ctx, notmuch_tag_journal_t);
+    if (unlikely (journal == NULL))
+	return NULL;
+
+    journal->messages = g_hash_table_new_full (
+	g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_hash_table_unref);
+    journal->queued = talloc_strdup (journal, "");
+    talloc_set_destructor (journal, _notmuch_tag_journal_destructor);
+
+    return journal;
+}
+
+/* Note that 'tag' is added to (or removed from) 'message_id'. */
+static void
+_tag_journal_note (notmuch_tag_journal_t *journal, const char *message_id,
+		   const char *tag, notmuch_bool_t add)
+{
+    GHashTable *tags;
+
+    tags = (GHashTable *) g_hash_table_lookup (journal->messages, message_id);
+    if (tags == NULL) {
+	tags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	g_hash_table_insert (journal->messages, g_strdup (message_id), tags);
+    }
+
+    g_hash_table_insert (tags, g_strdup (tag), GINT_TO_POINTER (add));
+}
+
+/* Read the journal from 'file', noting in 'journal', if it is not
+ * NULL, the changes of the entries after 'after'.  Sets *last to the
+ * last sequence number used.  Returns FALSE if the file is not a
+ * journal. */
+static notmuch_bool_t
+_tag_journal_read (FILE *file, notmuch_tag_journal_t *journal,
+		   unsigned long after, unsigned long *last)
+{
+    char *line = NULL, *end;
+    size_t line_size = 0;
+    ssize_t line_len;
+    notmuch_bool_t ret = FALSE;
+
+    *last = 0;
+
+    line_len = getline (&line, &line_size, file);
+    if (line_len <= 0 ||
+	strncmp (line, NOTMUCH_TAG_JOURNAL_MAGIC " ",
+		 strlen (NOTMUCH_TAG_JOURNAL_MAGIC " ")) != 0)
+	goto DONE;
+    *last = strtoul (line + strlen (NOTMUCH_TAG_JOURNAL_MAGIC " "), NULL, 10);
+
+    while ((line_len = getline (&line, &line_size, file)) != -1) {
+	unsigned long sequence;
+	char *message_id, *op, *save;
+
+	sequence = strtoul (line, &end, 10);
+	if (end == line || *end != ' ')
+	    continue;
+	if (sequence > *last)
+	    *last = sequence;
+	if (journal == NULL || sequence <= after)
+	    continue;
+
+	message_id = strtok_r (end, " \n", &save);
+	if (message_id == NULL || hex_decode_inplace (message_id) != HEX_SUCCESS)
+	    continue;
+
+	while ((op = strtok_r (NULL, " \n", &save)) != NULL) {
+	    if ((*op != '+' && *op != '-') || op[1] == '\0' ||
+		hex_decode_inplace (op + 1) != HEX_SUCCESS)
+		continue;
+	    _tag_journal_note (journal, message_id, op + 1, *op == '+');
+	}
+    }
+
+    ret = TRUE;
+
+  DONE:
+    free (line);
+    return ret;
+}
+
+/* The last entry the database holds the changes of.
+ *
+ * The caller is responsible for catching Xapian exceptions. */
+static unsigned long
+_tag_journal_applied (notmuch_database_t *notmuch)
+{
+    std::string sequence;
+
+    sequence = notmuch->xapian_db->get_metadata (
+	NOTMUCH_METADATA_TAG_JOURNAL_SEQUENCE);
+    if (sequence.empty ())
+	return 0;
+
+    return strtoul (sequence.c_str (), NULL, 10);
+}
+
+void
+_notmuch_database_load_tag_journal (notmuch_database_t *notmuch)
+{
+    notmuch_tag_journal_t *journal;
+    unsigned long applied, last;
+    char *path;
+    FILE *file;
+
+    /* Keep what this handle journaled. */
+    if (notmuch->tag_journal) {
+	(void) notmuch_database_flush_tag_journal (notmuch);
+	talloc_free (notmuch->tag_journal);
+	notmuch->tag_journal = NULL;
+    }
+
+    path = _tag_journal_path (notmuch, notmuch);
+    file = path ? fopen (path, "r") : NULL;
+    talloc_free (path);
+    if (file == NULL)
+	return;
+
+    journal = _tag_journal_create (notmuch);
+    if (unlikely (journal == NULL))
+	goto DONE;
+
+    try {
+	applied = _tag_journal_applied (notmuch);
+    } catch (const Xapian::Error &error) {
+	talloc_free (journal);
+	goto DONE;
+    }
+
+    flock (fileno (file), LOCK_SH);
+    _tag_journal_read (file, journal, applied, &last);
+
+    if (g_hash_table_size (journal->messages))
+	notmuch->tag_journal = journal;
+    else
+	talloc_free (journal);
+
+  DONE:
+    fclose (file);
+}
+
+/* Apply the changes noted in 'journal' to the database, and record
+ * 'last' as the last entry applied, in one transaction. */
+static notmuch_status_t
+_tag_journal_apply (notmuch_database_t *notmuch,
+		    notmuch_tag_journal_t *journal, unsigned long last)
+{
+    GHashTableIter messages, tags;
+    gpointer message_id, changes, tag, add;
+    notmuch_message_t *message;
+    notmuch_status_t status, end_status;
+    Xapian::WritableDatabase *db;
+
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status)
+	return status;
+
+    g_hash_table_iter_init (&messages, journal->messages);
+    while (g_hash_table_iter_next (&messages, &message_id, &changes)) {
+	status = notmuch_database_find_message (notmuch,
+						(const char *) message_id,
+						&message);
+	if (status)
+	    goto DONE;
+	/* The message has been removed since. */
+	if (message == NULL)
+	    continue;
+
+	notmuch_message_freeze (message);
+	g_hash_table_iter_init (&tags, (GHashTable *) changes);
+	while (g_hash_table_iter_next (&tags, &tag, &add) && ! status) {
+	    if (GPOINTER_TO_INT (add))
+		status = notmuch_message_add_tag (message, (const char *) tag);
+	    else
+		status = notmuch_message_remove_tag (message, (const char *) tag);
+	}
+	notmuch_message_thaw (message);
+	notmuch_message_destroy (message);
+	if (status)
+	    goto DONE;
+    }
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    try {
+	char *sequence = talloc_asprintf (journal, "%lu", last);
+
+	db->set_metadata (NOTMUCH_METADATA_TAG_JOURNAL_SEQUENCE, sequence);
+	talloc_free (sequence);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred applying the tag journal: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    /* Whatever was applied is applied again next time, to no
+     * effect. */
+    end_status = notmuch_database_end_atomic (notmuch);
+    return status ? status : end_status;
+}
+
+notmuch_status_t
+_notmuch_database_fold_tag_journal (notmuch_database_t *notmuch)
+{
+    notmuch_tag_journal_t *journal;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    unsigned long applied, last;
+    char *path;
+    FILE *file;
+    int fd;
+
+    /* The upgrade is to come first. */
+    if (notmuch_database_needs_upgrade (notmuch))
+	return NOTMUCH_STATUS_SUCCESS;
+
+    path = _tag_journal_path (notmuch, notmuch);
+    if (path == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    fd = open (path, O_RDWR);
+    talloc_free (path);
+    if (fd < 0)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    file = fdopen (fd, "r+");
+    if (file == NULL) {
+	close (fd);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    journal = _tag_journal_create (notmuch);
+    if (unlikely (journal == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    try {
+	applied = _tag_journal_applied (notmuch);
+    } catch (const Xapian::Error &error) {
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	goto DONE;
+    }
+
+    /* Hold off journal writers until the file is emptied. */
+    flock (fd, LOCK_EX);
+    if (! _tag_journal_read (file, journal, applied, &last))
+	goto DONE;
+
+    if (g_hash_table_size (journal->messages)) {
+	status = _tag_journal_apply (notmuch, journal, last);
+	if (status)
+	    goto DONE;
+    }
+
+    if (last > 0 && ftruncate (fd, 0) == 0) {
+	rewind (file);
+	fprintf (file, "%s %lu\n", NOTMUCH_TAG_JOURNAL_MAGIC, last);
+    }
+
+  DONE:
+    talloc_free (journal);
+    fclose (file);
+
+    return status;
+}
+
+notmuch_bool_t
+_notmuch_database_has_tag_journal (notmuch_database_t *notmuch)
+{
+    return notmuch->tag_journal &&
+	g_hash_table_size (notmuch->tag_journal->messages);
+}
+
+static notmuch_bool_t
+_string_list_has (notmuch_string_list_t *list, const char *string)
+{
+    for (notmuch_string_node_t *node = list->head; node; node = node->next)
+	if (strcmp (node->string, string) == 0)
+	    return TRUE;
+
+    return FALSE;
+}
+
+notmuch_string_list_t *
+_notmuch_database_apply_tag_journal (notmuch_database_t *notmuch,
+				     void *ctx,
+				     const char *message_id,
+				     notmuch_string_list_t *tags)
+{
+    GHashTable *changes;
+    GHashTableIter iter;
+    gpointer tag, add;
+    notmuch_string_list_t *journaled;
+
+    if (notmuch->tag_journal == NULL || message_id == NULL)
+	return tags;
+
+    changes = (GHashTable *) g_hash_table_lookup (
+	notmuch->tag_journal->messages, message_id);
+    if (changes == NULL)
+	return tags;
+
+    journaled = _notmuch_string_list_create (ctx);
+    if (unlikely (journaled == NULL))
+	return tags;
+
+    for (notmuch_string_node_t *node = tags->head; node; node = node->next) {
+	if (g_hash_table_lookup_extended (changes, node->string, NULL, &add) &&
+	    ! GPOINTER_TO_INT (add))
+	    continue;
+	_notmuch_string_list_append (journaled,
+				     talloc_strdup (journaled, node->string));
+    }
+
+    g_hash_table_iter_init (&iter, changes);
+    while (g_hash_table_iter_next (&iter, &tag, &add)) {
+	if (GPOINTER_TO_INT (add) && ! _string_list_has (tags, (const char *) tag))
+	    _notmuch_string_list_append (journaled,
+					 talloc_strdup (journaled,
+							(const char *) tag));
+    }
+
+    _notmuch_string_list_sort (journaled);
+    return journaled;
+}
+
+notmuch_status_t
+_notmuch_database_journal_tag (notmuch_database_t *notmuch,
+			       const char *message_id,
+			       const char *tag,
+			       notmuch_bool_t add)
+{
+    notmuch_tag_journal_t *journal = notmuch->tag_journal;
+    char *encoded = NULL;
+    size_t encoded_size = 0;
+
+    if (journal == NULL) {
+	journal = notmuch->tag_journal = _tag_journal_create (notmuch);
+	if (unlikely (journal == NULL))
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+	/* The cached counts are those without the journal. */
+	_notmuch_query_cache_flush (notmuch);
+	talloc_free (notmuch->query_cache);
+	notmuch->query_cache = NULL;
+    }
+
+    if (journal->queued_id == NULL ||
+	strcmp (journal->queued_id, message_id) != 0) {
+	if (hex_encode (journal, message_id, &encoded,
+			&encoded_size) != HEX_SUCCESS)
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	journal->queued = talloc_asprintf_append_buffer (
+	    journal->queued, "%s%s", *journal->queued ? "\n" : "", encoded);
+	talloc_free (journal->queued_id);
+	journal->queued_id = talloc_strdup (journal, message_id);
+    }
+
+    if (hex_encode (journal, tag, &encoded, &encoded_size) != HEX_SUCCESS)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    journal->queued = talloc_asprintf_append_buffer (
+	journal->queued, " %c%s", add ? '+' : '-', encoded);
+    talloc_free (encoded);
+
+    if (unlikely (journal->queued == NULL || journal->queued_id == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    _tag_journal_note (journal, message_id, tag, add);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_flush_tag_journal (notmuch_database_t *notmuch)
+{
+    notmuch_tag_journal_t *journal = notmuch->tag_journal;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    unsigned long last;
+    char *path, *line, *save;
+    FILE *file;
+    int fd;
+
+    if (journal == NULL || *journal->queued == '\0')
+	return NOTMUCH_STATUS_SUCCESS;
+
+    path = _tag_journal_path (journal, notmuch);
+    if (path == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    fd = open (path, O_RDWR | O_CREAT, 0666);
+    file = fd < 0 ? NULL : fdopen (fd, "r+");
+    if (file == NULL) {
+	_notmuch_database_log (notmuch, "Error opening %s: %s\n",
+			       path, strerror (errno));
+	if (fd >= 0)
+	    close (fd);
+	talloc_free (path);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    flock (fd, LOCK_EX);
+
+    /* A new or foreign file starts again, after the entries the
+     * database already holds. */
+    if (! _tag_journal_read (file, NULL, 0, &last)) {
+	try {
+	    last = _tag_journal_applied (notmuch);
+	} catch (const Xapian::Error &error) {
+	    last = 0;
+	}
+	if (ftruncate (fd, 0) != 0 || fseek (file, 0, SEEK_SET) != 0 ||
+	    fprintf (file, "%s %lu\n", NOTMUCH_TAG_JOURNAL_MAGIC, last) < 0)
+	    goto FAIL;
+    }
+
+    if (fseek (file, 0, SEEK_END) != 0)
+	goto FAIL;
+
+    for (line = strtok_r (journal->queued, "\n", &save); line;
+	 line = strtok_r (NULL, "\n", &save)) {
+	if (fprintf (file, "%lu %s\n", ++last, line) < 0)
+	    goto FAIL;
+    }
+
+    if (fflush (file) != 0 || fsync (fd) != 0)
+	goto FAIL;
+
+    goto DONE;
+
+  FAIL:
+    _notmuch_database_log (notmuch, "Error writing %s: %s\n",
+			   path, strerror (errno));
+    status = NOTMUCH_STATUS_FILE_ERROR;
+
+  DONE:
+    /* The changes stay noted for this handle either way. */
+    talloc_free (journal->queued);
+    journal->queued = talloc_strdup (journal, "");
+    talloc_free (journal->queued_id);
+    journal->queued_id = NULL;
+
+    fclose (file);
+    talloc_free (path);
+    return status;
+}
+
+/* Find the change, if any, noted for 'tag' in 'changes'. */
+static notmuch_bool_t
+_tag_journal_change (GHashTable *changes, const char *tag,
+		     notmuch_bool_t *add)
+{
+    gpointer value;
+
+    if (! g_hash_table_lookup_extended (changes, tag, NULL, &value))
+	return FALSE;
+
+    *add = GPOINTER_TO_INT (value);
+    return TRUE;
+}
+
+static notmuch_bool_t
+_is_value_end (char c)
+{
+    return c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == ')';
+}
+
+/* Return the expansion of the term for 'tag' (written as 'term'),
+ * or NULL if no entry changes it. */
+static char *
+_tag_journal_expand_term (notmuch_tag_journal_t *journal, void *ctx,
+			  const char *term, const char *tag)
+{
+    GHashTableIter iter;
+    gpointer message_id, changes;
+    char *added, *removed, *id_term = NULL, *expanded;
+    size_t id_term_size = 0;
+    notmuch_bool_t add;
+
+    added = talloc_strdup (ctx, "");
+    removed = talloc_strdup (ctx, "");
+
+    g_hash_table_iter_init (&iter, journal->messages);
+    while (g_hash_table_iter_next (&iter, &message_id, &changes) &&
+	   added && removed) {
+	if (! _tag_journal_change ((GHashTable *) changes, tag, &add))
+	    continue;
+	if (make_boolean_term (ctx, "id", (const char *) message_id,
+			       &id_term, &id_term_size))
+	    return NULL;
+	if (add)
+	    added = talloc_asprintf_append_buffer (added, " OR %s", id_term);
+	else
+	    removed = talloc_asprintf_append_buffer (removed, "%s%s",
+						     *removed ? " OR " : "",
+						     id_term);
+    }
+
+    if (added == NULL || removed == NULL ||
+	(*added == '\0' && *removed == '\0'))
+	return NULL;
+
+    expanded = talloc_asprintf (ctx, "((%s%s)", term, added);
+    if (expanded && *removed)
+	expanded = talloc_asprintf_append_buffer (expanded, " AND NOT (%s)",
+						  removed);
+    if (expanded)
+	expanded = talloc_strdup_append_buffer (expanded, ")");
+
+    return expanded;
+}
+
+const char *
+_notmuch_database_expand_tag_journal (notmuch_database_t *notmuch,
+				      void *ctx,
+				      const char *query_string)
+{
+    static const char *prefixes[] = { "tag:", "is:" };
+    const char *s = query_string, *p;
+    char *expanded;
+    void *local;
+
+    if (! _notmuch_database_has_tag_journal (notmuch) ||
+	(strstr (query_string, "tag:") == NULL &&
+	 strstr (query_string, "is:") == NULL))
+	return query_string;
+
+    local = talloc_new (NULL);
+    expanded = talloc_strdup (ctx, "");
+
+    for (p = query_string; *p && expanded; p++) {
+	const char *prefix = NULL, *end;
+	char *tag, *term, *replacement;
+	size_t i;
+
+	if (p > query_string && ! strchr (" \t\n(+-", p[-1]))
+	    continue;
+	for (i = 0; i < ARRAY_SIZE (prefixes); i++)
+	    if (strncmp (p, prefixes[i], strlen (prefixes[i])) == 0)
+		prefix = prefixes[i];
+	if (prefix == NULL)
+	    continue;
+
+	end = p + strlen (prefix);
+	if (*end == '"') {
+	    /* Quotes within a quoted term are doubled. */
+	    tag = talloc_strdup (local, "");
+	    for (end++; *end && tag; end++) {
+		if (*end == '"' && end[1] != '"')
+		    break;
+		if (*end == '"')
+		    end++;
+		tag = talloc_strndup_append_buffer (tag, end, 1);
+	    }
+	    if (*end == '"')
+		end++;
+	} else {
+	    const char *value = end;
+
+	    while (! _is_value_end (*end))
+		end++;
+	    tag = talloc_strndup (local, value, end - value);
+	}
+
+	term = talloc_strndup (local, p, end - p);
+	replacement = (tag && term) ?
+	    _tag_journal_expand_term (notmuch->tag_journal, local,
+				      term, tag) : NULL;
+	if (replacement == NULL)
+	    continue;
+
+	expanded = talloc_strndup_append_buffer (expanded, s, p - s);
+	expanded = talloc_strdup_append_buffer (expanded, replacement);
+	s = end;
+	p = end - 1;
+    }
+
+    if (expanded)
+	expanded = talloc_strdup_append_buffer (expanded, s);
+
+    talloc_free (local);
+
+    if (unlikely (expanded == NULL))
+	return query_string;
+
+    return expanded;
+}
@@ -0,0 +1,462 @@
+/* tag-rules.cc - Tags applied to new messages as they are added
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+/* Tagging rules are the usual follow-up to adding messages: a list
+ * of "tag these if they match that", which would otherwise be run as
+ * one query per rule over the new messages, each rewriting the
+ * documents it matches.  Here each rule is compiled once, and
+ * evaluated against each new message from its headers and terms
+ * before the message is first written, so that it is written once,
+ * with its final tags.
+ *
+ * A rule is a line of tag operations, as for "notmuch tag --batch",
+ * followed by a predicate:
+ *
+ *	+list -inbox -- list-id:notmuch.notmuchmail.org
+ *
+ * The predicate combines, with and, or, not and parentheses, terms
+ * field:value where the field is one of from, to (which also looks
+ * at Cc), subject and list-id, matching if the header contains the
+ * value, case-insensitively, or one of folder, path and tag,
+ * matching if the message has exactly that term, as the search
+ * prefixes do.  Values with spaces are quoted with '"', doubling any
+ * '"' inside.  "*", or no predicate, matches every message.  Rules
+ * are applied in order, so a rule sees the tags of those before.
+ * Blank lines and lines starting with '#' are ignored. */
+
+typedef enum {
+    RULE_ALL,
+    RULE_HEADER,
+    RULE_TERM,
+    RULE_NOT,
+    RULE_AND,
+    RULE_OR
+} _rule_node_type_t;
+
+typedef struct _rule_node {
+    _rule_node_type_t type;
+    /* For RULE_HEADER the header, for RULE_TERM the prefix name. */
+    const char *name;
+    char *value;
+    struct _rule_node *left, *right;
+} _rule_node_t;
+
+typedef struct _tag_rule {
+    /* The tag operations, each a tag after '+' or '-'. */
+    notmuch_string_list_t *ops;
+    _rule_node_t *predicate;
+    struct _tag_rule *next;
+} _tag_rule_t;
+
+struct _notmuch_tag_rules {
+    _tag_rule_t *head;
+};
+
+static const struct {
+    const char *field;
+    _rule_node_type_t type;
+    const char *name;
+} rule_fields[] = {
+    { "from",		RULE_HEADER,	"from" },
+    { "to",		RULE_HEADER,	"to" },
+    { "subject",	RULE_HEADER,	"subject" },
+    { "list-id",	RULE_HEADER,	"list-id" },
+    { "folder",		RULE_TERM,	"folder" },
+    { "path",		RULE_TERM,	"path" },
+    { "tag",		RULE_TERM,	"tag" },
+};
+
+typedef struct {
+    void *ctx;
+    const char *s;
+    const char *error;
+} _rule_parser_t;
+
+static _rule_node_t *
+_parse_or (_rule_parser_t *parser);
+
+static void
+_skip_space (_rule_parser_t *parser)
+{
+    while (*parser->s == ' ' || *parser->s == '\t')
+	parser->s++;
+}
+
+static notmuch_bool_t
+_is_boundary (char c)
+{
+    return c == '\0' || c == ' ' || c == '\t' || c == '(' || c == ')';
+}
+
+/* The "--" between the tag operations and the predicate. */
+static notmuch_bool_t
+_is_separator (const char *s)
+{
+    return s[0] == '-' && s[1] == '-' && _is_boundary (s[2]);
+}
+
+/* Return TRUE if the next token is the operator 'word'. */
+static notmuch_bool_t
+_at_word (_rule_parser_t *parser, const char *word)
+{
+    size_t len = strlen (word);
+
+    _skip_space (parser);
+    return strncasecmp (parser->s, word, len) == 0 &&
+	_is_boundary (parser->s[len]);
+}
+
+/* If the next token is the operator 'word', skip it and return
+ * TRUE. */
+static notmuch_bool_t
+_accept_word (_rule_parser_t *parser, const char *word)
+{
+    if (! _at_word (parser, word))
+	return FALSE;
+
+    parser->s += strlen (word);
+    return TRUE;
+}
+
+static _rule_node_t *
+_rule_node (_rule_parser_t *parser, _rule_node_type_t type,
+	    _rule_node_t *left, _rule_node_t *right)
+{
+    _rule_node_t *node = talloc_zero (parser->ctx, _rule_node_t);
+
+    if (unlikely (node == NULL)) {
+	parser->error = "out of memory";
+	return NULL;
+    }
+
+    node->type = type;
+    node->left = left;
+    node->right = right;
+
+    return node;
+}
+
+static _rule_node_t *
+_parse_term (_rule_parser_t *parser)
+{
+    const char *field = parser->s, *colon;
+    _rule_node_t *node;
+    std::string value;
+    size_t i;
+
+    if (*parser->s == '*' && _is_boundary (parser->s[1])) {
+	parser->s++;
+	return _rule_node (parser, RULE_ALL, NULL, NULL);
+    }
+
+    colon = strchr (field, ':');
+    for (i = 0; colon && i < ARRAY_SIZE (rule_fields); i++) {
+	if (strlen (rule_fields[i].field) == (size_t) (colon - field) &&
+	    strncasecmp (field, rule_fields[i].field, colon - field) == 0)
+	    break;
+    }
+    if (colon == NULL || i == ARRAY_SIZE (rule_fields)) {
+	parser->error = "expected a term such as from:value";
+	return NULL;
+    }
+
+    parser->s = colon + 1;
+    if (*parser->s == '"') {
+	for (parser->s++; *parser->s; parser->s++) {
+	    if (*parser->s == '"' && parser->s[1] != '"')
+		break;
+	    if (*parser->s == '"')
+		parser->s++;
+	    value += *parser->s;
+	}
+	if (*parser->s != '"') {
+	    parser->error = "unterminated quoted value";
+	    return NULL;
+	}
+	parser->s++;
+    } else {
+	while (! _is_boundary (*parser->s))
+	    value += *parser->s++;
+    }
+
+    node = _rule_node (parser, rule_fields[i].type, NULL, NULL);
+    if (node == NULL)
+	return NULL;
+    node->name = rule_fields[i].name;
+    node->value = talloc_strdup (node, value.c_str ());
+    if (unlikely (node->value == NULL)) {
+	parser->error = "out of memory";
+	return NULL;
+    }
+
+    return node;
+}
+
+static _rule_node_t *
+_parse_not (_rule_parser_t *parser)
+{
+    _rule_node_t *node;
+
+    if (_accept_word (parser, "not")) {
+	node = _parse_not (parser);
+	return node ? _rule_node (parser, RULE_NOT, node, NULL) : NULL;
+    }
+
+    _skip_space (parser);
+    if (*parser->s == '(') {
+	parser->s++;
+	node = _parse_or (parser);
+	if (node == NULL)
+	    return NULL;
+	_skip_space (parser);
+	if (*parser->s != ')') {
+	    parser->error = "expected ')'";
+	    return NULL;
+	}
+	parser->s++;
+	return node;
+    }
+
+    return _parse_term (parser);
+}
+
+/* As in searches, terms side by side are implicitly and'ed. */
+static _rule_node_t *
+_parse_and (_rule_parser_t *parser)
+{
+    _rule_node_t *node, *right;
+
+    node = _parse_not (parser);
+    while (node) {
+	if (! _accept_word (parser, "and") &&
+	    (*parser->s == '\0' || *parser->s == ')' ||
+	     _at_word (parser, "or")))
+	    break;
+	right = _parse_not (parser);
+	node = right ? _rule_node (parser, RULE_AND, node, right) : NULL;
+    }
+
+    return node;
+}
+
+static _rule_node_t *
+_parse_or (_rule_parser_t *parser)
+{
+    _rule_node_t *node, *right;
+
+    node = _parse_and (parser);
+    while (node && _accept_word (parser, "or")) {
+	right = _parse_and (parser);
+	node = right ? _rule_node (parser, RULE_OR, node, right) : NULL;
+    }
+
+    return node;
+}
+
+/* Parse the rule 'line' into a new rule talloc'ed under 'ctx', or
+ * return NULL, with a description of what is wrong in *error. */
+static _tag_rule_t *
+_parse_rule (void *ctx, char *line, const char **error)
+{
+    _rule_parser_t parser;
+    _tag_rule_t *rule;
+    char *tok, *end;
+
+    rule = talloc_zero (ctx, _tag_rule_t);
+    if (unlikely (rule == NULL)) {
+	*error = "out of memory";
+	return NULL;
+    }
+    rule->ops = _notmuch_string_list_create (rule);
+    if (unlikely (rule->ops == NULL)) {
+	*error = "out of memory";
+	return NULL;
+    }
+
+    for (tok = line; (*tok == '+' || *tok == '-') && ! _is_separator (tok);
+	 tok = end) {
+	end = tok + strcspn (tok, " \t");
+	if (*end)
+	    *end++ = '\0';
+	if (tok[1] == '\0' || hex_decode_inplace (tok + 1) != HEX_SUCCESS) {
+	    *error = "malformed tag";
+	    return NULL;
+	}
+	if (strlen (tok + 1) > NOTMUCH_TAG_MAX) {
+	    *error = "tag too long";
+	    return NULL;
+	}
+	_notmuch_string_list_append (rule->ops, talloc_strdup (rule, tok));
+	end += strspn (end, " \t");
+    }
+
+    if (rule->ops->length == 0) {
+	*error = "expected a tag operation such as +tag";
+	return NULL;
+    }
+
+    if (_is_separator (tok))
+	tok += 2;
+
+    parser.ctx = rule;
+    parser.s = tok;
+    parser.error = NULL;
+
+    _skip_space (&parser);
+    if (*parser.s == '\0') {
+	rule->predicate = _rule_node (&parser, RULE_ALL, NULL, NULL);
+    } else {
+	rule->predicate = _parse_or (&parser);
+	_skip_space (&parser);
+	if (rule->predicate && *parser.s != '\0') {
+	    parser.error = *parser.s == ')' ? "unbalanced ')'" :
+		"unexpected text";
+	    rule->predicate = NULL;
+	}
+    }
+
+    if (rule->predicate == NULL) {
+	*error = parser.error;
+	return NULL;
+    }
+
+    return rule;
+}
+
+notmuch_status_t
+notmuch_database_set_tag_rules (notmuch_database_t *notmuch,
+				const char *rules)
+{
+    notmuch_tag_rules_t *compiled;
+    _tag_rule_t **tail;
+    char *text, *line, *next;
+    unsigned int line_number = 0;
+
+    if (rules == NULL || *rules == '\0') {
+	talloc_free (notmuch->tag_rules);
+	notmuch->tag_rules = NULL;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    compiled = talloc_zero (notmuch, notmuch_tag_rules_t);
+    text = talloc_strdup (compiled, rules);
+    if (unlikely (compiled == NULL || text == NULL)) {
+	talloc_free (compiled);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    tail = &compiled->head;
+    for (line = text; line; line = next) {
+	const char *error = NULL;
+
+	next = strchr (line, '\n');
+	if (next)
+	    *next++ = '\0';
+	line_number++;
+
+	line += strspn (line, " \t");
+	line[strcspn (line, "\r")] = '\0';
+	if (*line == '\0' || *line == '#')
+	    continue;
+
+	*tail = _parse_rule (compiled, line, &error);
+	if (*tail == NULL) {
+	    _notmuch_database_log (notmuch, "Error in tag rule %u: %s\n",
+				   line_number, error);
+	    talloc_free (compiled);
+	    return NOTMUCH_STATUS_ILLEGAL_ARGUMENT;
+	}
+	tail = &(*tail)->next;
+    }
+
+    talloc_free (text);
+    talloc_free (notmuch->tag_rules);
+    notmuch->tag_rules = compiled;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+static notmuch_bool_t
+_header_contains (notmuch_message_file_t *message_file, const char *header,
+		  const char *value)
+{
+    const char *contents = _notmuch_message_file_get_header (message_file,
+							     header);
+
+    return contents && strcasestr (contents, value) != NULL;
+}
+
+static notmuch_bool_t
+_rule_matches (const _rule_node_t *node, notmuch_message_t *message,
+	       notmuch_message_file_t *message_file)
+{
+    notmuch_bool_t result = FALSE;
+
+    switch (node->type) {
+    case RULE_ALL:
+	return TRUE;
+    case RULE_HEADER:
+	if (strcmp (node->name, "to") == 0 &&
+	    _header_contains (message_file, "cc", node->value))
+	    return TRUE;
+	return _header_contains (message_file, node->name, node->value);
+    case RULE_TERM:
+	if (_notmuch_message_has_term (message, node->name, node->value,
+				       &result))
+	    return FALSE;
+	return result;
+    case RULE_NOT:
+	return ! _rule_matches (node->left, message, message_file);
+    case RULE_AND:
+	return _rule_matches (node->left, message, message_file) &&
+	    _rule_matches (node->right, message, message_file);
+    case RULE_OR:
+	return _rule_matches (node->left, message, message_file) ||
+	    _rule_matches (node->right, message, message_file);
+    }
+
+    return FALSE;
+}
+
+void
+_notmuch_database_apply_tag_rules (notmuch_database_t *notmuch,
+				   notmuch_message_t *message,
+				   notmuch_message_file_t *message_file)
+{
+    _tag_rule_t *rule;
+
+    if (notmuch->tag_rules == NULL)
+	return;
+
+    for (rule = notmuch->tag_rules->head; rule; rule = rule->next) {
+	if (! _rule_matches (rule->predicate, message, message_file))
+	    continue;
+
+	for (notmuch_string_node_t *op = rule->ops->head; op; op = op->next) {
+	    if (op->string[0] == '+')
+		_notmuch_message_add_term (message, "tag", op->string + 1);
+	    else
+		_notmuch_message_remove_term (message, "tag", op->string + 1);
+	}
+    }
+}
@@ -0,0 +1,324 @@
+/* tag-set.cc - Interned tags and sets of them
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <glib.h> /* GHashTable */
+
+/* Each database handle numbers the tags it sees with small integers,
+ * so that the library can work with sets of tags as bitsets rather
+ * than as lists of strings.  The numbers are only meaningful to the
+ * handle that gave them out, and only while it is open: they are
+ * never stored.
+ *
+ * The dictionary starts out as the tag vocabulary of the database,
+ * in order, so that the tags of a set usually come out sorted without
+ * any sorting.  Tags first seen later, e.g. just added to a message,
+ * are numbered after those.  A tag keeps its number for the life of
+ * the handle, even once no message has it any more, so numbers held
+ * by messages and threads stay valid as the database changes. */
+
+struct _notmuch_tag_dictionary {
+    /* Map from tag to 1 + its number. */
+    GHashTable *ids;
+    /* The tags, by number, talloc'ed under the dictionary. */
+    char **names;
+    unsigned int count;
+    /* The tags numbered while reading the vocabulary, which are in
+     * sorted order. */
+    unsigned int num_sorted;
+};
+
+struct _notmuch_tag_set {
+    unsigned long *words;
+    unsigned int num_words;
+};
+
+#define TAG_SET_WORD_BITS (8 * sizeof (unsigned long))
+
+static int
+_notmuch_tag_dictionary_destructor (notmuch_tag_dictionary_t *dictionary)
+{
+    g_hash_table_destroy (dictionary->ids);
+
+    return 0;
+}
+
+static notmuch_bool_t
+_tag_dictionary_add (notmuch_tag_dictionary_t *dictionary, const char *tag)
+{
+    char *name;
+
+    if ((dictionary->count & (dictionary->count - 1)) == 0) {
+	char **names = talloc_realloc (dictionary, dictionary->names, char *,
+				       dictionary->count ?
+				       2 * dictionary->count : 64);
+	if (unlikely (names == NULL))
+	    return FALSE;
+	dictionary->names = names;
+    }
+
+    name = talloc_strdup (dictionary, tag);
+    if (unlikely (name == NULL))
+	return FALSE;
+
+    dictionary->names[dictionary->count++] = name;
+    g_hash_table_insert (dictionary->ids, name,
+			 GUINT_TO_POINTER (dictionary->count));
+
+    return TRUE;
+}
+
+/* Return the tag dictionary of 'notmuch', reading the tag vocabulary
+ * on first use.  Returns NULL on out-of-memory. */
+static notmuch_tag_dictionary_t *
+_notmuch_database_get_tag_dictionary (notmuch_database_t *notmuch)
+{
+    notmuch_tag_dictionary_t *dictionary;
+    const char *prefix = NOTMUCH_PREFIX_TAG;
+    size_t prefix_len = strlen (prefix);
+
+    if (notmuch->tag_dictionary)
+	return notmuch->tag_dictionary;
+
+    dictionary = talloc_zero (notmuch, notmuch_tag_dictionary_t);
+    if (unlikely (dictionary == NULL))
+	return NULL;
+
+    dictionary->ids = g_hash_table_new (g_str_hash, g_str_equal);
+    talloc_set_destructor (dictionary, _notmuch_tag_dictionary_destructor);
+
+    if (notmuch->xapian_db) {
+	try {
+	    Xapian::TermIterator i, end;
+
+	    end = notmuch->xapian_db->allterms_end (prefix);
+	    for (i = notmuch->xapian_db->allterms_begin (prefix); i != end; i++) {
+		if (! _tag_dictionary_add (dictionary,
+					   (*i).c_str () + prefix_len))
+		    break;
+	    }
+	} catch (const Xapian::Error &error) {
+	    /* Tags not read now are numbered as they are seen. */
+	    _notmuch_database_log (notmuch,
+				   "A Xapian exception occurred reading tags: %s\n",
+				   error.get_msg ().c_str ());
+	    notmuch->exception_reported = TRUE;
+	}
+    }
+    dictionary->num_sorted = dictionary->count;
+
+    notmuch->tag_dictionary = dictionary;
+    return dictionary;
+}
+
+unsigned int
+_notmuch_database_intern_tag (notmuch_database_t *notmuch, const char *tag)
+{
+    notmuch_tag_dictionary_t *dictionary;
+    unsigned int id;
+
+    dictionary = _notmuch_database_get_tag_dictionary (notmuch);
+    if (unlikely (dictionary == NULL))
+	return NOTMUCH_TAG_ID_NONE;
+
+    id = GPOINTER_TO_UINT (g_hash_table_lookup (dictionary->ids, tag));
+    if (id)
+	return id - 1;
+
+    if (! _tag_dictionary_add (dictionary, tag))
+	return NOTMUCH_TAG_ID_NONE;
+
+    return dictionary->count - 1;
+}
+
+const char *
+_notmuch_database_tag_name (notmuch_database_t *notmuch, unsigned int id)
+{
+    notmuch_tag_dictionary_t *dictionary = notmuch->tag_dictionary;
+
+    if (dictionary == NULL || id >= dictionary->count)
+	return NULL;
+
+    return dictionary->names[id];
+}
+
+notmuch_tag_set_t *
+_notmuch_tag_set_create (const void *ctx)
+{
+    return talloc_zero (ctx, notmuch_tag_set_t);
+}
+
+notmuch_tag_set_t *
+_notmuch_tag_set_copy (const void *ctx, const notmuch_tag_set_t *set)
+{
+    notmuch_tag_set_t *copy;
+
+    copy = _notmuch_tag_set_create (ctx);
+    if (unlikely (copy == NULL))
+	return NULL;
+
+    if (set->num_words) {
+	copy->words = (unsigned long *) talloc_memdup (
+	    copy, set->words, set->num_words * sizeof (unsigned long));
+	if (unlikely (copy->words == NULL)) {
+	    talloc_free (copy);
+	    return NULL;
+	}
+	copy->num_words = set->num_words;
+    }
+
+    return copy;
+}
+
+/* Make room in 'set' for the tags numbered below 'num_words' words'
+ * worth of bits. */
+static notmuch_bool_t
+_tag_set_grow (notmuch_tag_set_t *set, unsigned int num_words)
+{
+    unsigned long *words;
+
+    if (num_words <= set->num_words)
+	return TRUE;
+
+    words = talloc_realloc (set, set->words, unsigned long, num_words);
+    if (unlikely (words == NULL))
+	return FALSE;
+
+    memset (words + set->num_words, 0,
+	    (num_words - set->num_words) * sizeof (unsigned long));
+    set->words = words;
+    set->num_words = num_words;
+
+    return TRUE;
+}
+
+notmuch_bool_t
+_notmuch_tag_set_add (notmuch_tag_set_t *set, unsigned int id)
+{
+    if (id == NOTMUCH_TAG_ID_NONE)
+	return FALSE;
+
+    if (! _tag_set_grow (set, id / TAG_SET_WORD_BITS + 1))
+	return FALSE;
+
+    set->words[id / TAG_SET_WORD_BITS] |= 1UL << (id % TAG_SET_WORD_BITS);
+
+    return TRUE;
+}
+
+notmuch_bool_t
+_notmuch_tag_set_contains (const notmuch_tag_set_t *set, unsigned int id)
+{
+    if (id == NOTMUCH_TAG_ID_NONE || id / TAG_SET_WORD_BITS >= set->num_words)
+	return FALSE;
+
+    return (set->words[id / TAG_SET_WORD_BITS] >>
+	    (id % TAG_SET_WORD_BITS)) & 1;
+}
+
+notmuch_bool_t
+_notmuch_tag_set_union (notmuch_tag_set_t *set,
+			const notmuch_tag_set_t *other)
+{
+    unsigned int i;
+
+    if (! _tag_set_grow (set, other->num_words))
+	return FALSE;
+
+    for (i = 0; i < other->num_words; i++)
+	set->words[i] |= other->words[i];
+
+    return TRUE;
+}
+
+notmuch_bool_t
+_notmuch_tag_set_intersects (const notmuch_tag_set_t *set,
+			     const notmuch_tag_set_t *other)
+{
+    unsigned int i;
+
+    for (i = 0; i < set->num_words && i < other->num_words; i++) {
+	if (set->words[i] & other->words[i])
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+notmuch_tag_set_t *
+_notmuch_tag_set_create_for_tags (const void *ctx,
+				  notmuch_database_t *notmuch,
+				  notmuch_string_list_t *tags,
+				  size_t skip)
+{
+    notmuch_tag_set_t *set;
+
+    set = _notmuch_tag_set_create (ctx);
+    if (unlikely (set == NULL))
+	return NULL;
+
+    for (notmuch_string_node_t *node = tags->head; node; node = node->next) {
+	if (strlen (node->string) < skip)
+	    continue;
+	_notmuch_tag_set_add (set, _notmuch_database_intern_tag (
+				  notmuch, node->string + skip));
+    }
+
+    return set;
+}
+
+notmuch_string_list_t *
+_notmuch_tag_set_to_string_list (const void *ctx,
+				 notmuch_database_t *notmuch,
+				 const notmuch_tag_set_t *set)
+{
+    notmuch_string_list_t *list;
+    notmuch_bool_t sorted = TRUE;
+    unsigned int i, bit;
+
+    list = _notmuch_string_list_create (ctx);
+    if (unlikely (list == NULL))
+	return NULL;
+
+    for (i = 0; i < set->num_words; i++) {
+	for (bit = 0; bit < TAG_SET_WORD_BITS; bit++) {
+	    unsigned int id = i * TAG_SET_WORD_BITS + bit;
+	    const char *name;
+
+	    if (! ((set->words[i] >> bit) & 1))
+		continue;
+
+	    name = _notmuch_database_tag_name (notmuch, id);
+	    if (unlikely (name == NULL))
+		continue;
+
+	    _notmuch_string_list_append (list, name);
+	    if (id >= notmuch->tag_dictionary->num_sorted)
+		sorted = FALSE;
+	}
+    }
+
+    if (! sorted)
+	_notmuch_string_list_sort (list);
+
+    return list;
+}
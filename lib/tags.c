@@ -22,6 +22,10 @@
 
 struct _notmuch_tags {
     notmuch_string_node_t *iterator;
+    /* Message counts in list order, or NULL; see
+     * notmuch_database_get_tag_catalogue. */
+    unsigned int *counts;
+    unsigned int position;
 };
 
 /* Create a new notmuch_tags_t object, with 'ctx' as its talloc owner.
@@ -40,11 +44,30 @@ _notmuch_tags_create (const void *ctx, notmuch_string_list_t *list)
 	return NULL;
 
     tags->iterator = list->head;
+    tags->counts = NULL;
+    tags->position = 0;
     (void) talloc_steal (tags, list);
 
     return tags;
 }
 
+/* As _notmuch_tags_create, with 'counts' (stolen as well) giving the
+ * number of messages with each tag of 'list'. */
+notmuch_tags_t *
+_notmuch_tags_create_with_counts (const void *ctx, notmuch_string_list_t *list,
+				  unsigned int *counts)
+{
+    notmuch_tags_t *tags;
+
+    tags = _notmuch_tags_create (ctx, list);
+    if (unlikely (tags == NULL))
+	return NULL;
+
+    tags->counts = talloc_steal (tags, counts);
+
+    return tags;
+}
+
 notmuch_bool_t
 notmuch_tags_valid (notmuch_tags_t *tags)
 {
@@ -60,6 +83,15 @@ notmuch_tags_get (notmuch_tags_t *tags)
     return (char *) tags->iterator->string;
 }
 
+unsigned int
+notmuch_tags_get_count (notmuch_tags_t *tags)
+{
+    if (tags->iterator == NULL || tags->counts == NULL)
+	return 0;
+
+    return tags->counts[tags->position];
+}
+
 void
 notmuch_tags_move_to_next (notmuch_tags_t *tags)
 {
@@ -67,6 +99,7 @@ notmuch_tags_move_to_next (notmuch_tags_t *tags)
 	return;
 
     tags->iterator = tags->iterator->next;
+    tags->position++;
 }
 
 void
@@ -0,0 +1,217 @@
+/* thread-alias.cc - Threads merged without rewriting their messages
+ *
+ * This file is part of notmuch.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <glib.h> /* GHashTable */
+
+/* When a new message joins two existing threads, the messages of the
+ * losing thread keep their thread term for now.  Instead, the
+ * database records an alias in its metadata:
+ *
+ *	thread_alias_<loser>	<winner>
+ *
+ * Aliases form chains (a winner may lose a later merge), so a thread
+ * ID is resolved by following them to the end.  Readers resolve the
+ * thread ID of every message, and expand each thread: term of a query
+ * to all of the IDs that resolve to the same thread.
+ * notmuch_database_merge_threads rewrites the thread terms of aliased
+ * messages later and drops the aliases.
+ */
+
+static GHashTable *
+_notmuch_thread_aliases (notmuch_database_t *notmuch)
+{
+    const std::string prefix = NOTMUCH_METADATA_THREAD_ALIAS_PREFIX;
+    Xapian::TermIterator i, end;
+
+    if (notmuch->thread_aliases)
+	return notmuch->thread_aliases;
+
+    /* Loser and winner are both owned by the table. */
+    notmuch->thread_aliases = g_hash_table_new_full (g_str_hash, g_str_equal,
+						     g_free, g_free);
+
+    try {
+	end = notmuch->xapian_db->metadata_keys_end (prefix);
+	for (i = notmuch->xapian_db->metadata_keys_begin (prefix);
+	     i != end; i++) {
+	    std::string winner = notmuch->xapian_db->get_metadata (*i);
+
+	    if (winner.empty ())
+		continue;
+
+	    g_hash_table_insert (notmuch->thread_aliases,
+				 g_strdup ((*i).c_str () + prefix.size ()),
+				 g_strdup (winner.c_str ()));
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred reading thread aliases: %s.\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+    }
+
+    return notmuch->thread_aliases;
+}
+
+notmuch_bool_t
+_notmuch_database_has_thread_aliases (notmuch_database_t *notmuch)
+{
+    return g_hash_table_size (_notmuch_thread_aliases (notmuch)) > 0;
+}
+
+const char *
+_notmuch_database_resolve_thread_id (notmuch_database_t *notmuch,
+				     const char *thread_id)
+{
+    GHashTable *aliases = _notmuch_thread_aliases (notmuch);
+    gpointer winner;
+
+    while (g_hash_table_lookup_extended (aliases, thread_id, NULL, &winner))
+	thread_id = (const char *) winner;
+
+    return thread_id;
+}
+
+notmuch_string_list_t *
+_notmuch_database_get_thread_aliases (notmuch_database_t *notmuch,
+				      void *ctx,
+				      const char *thread_id)
+{
+    GHashTable *aliases = _notmuch_thread_aliases (notmuch);
+    notmuch_string_list_t *list = NULL;
+    GHashTableIter iter;
+    gpointer loser;
+
+    g_hash_table_iter_init (&iter, aliases);
+    while (g_hash_table_iter_next (&iter, &loser, NULL)) {
+	if (strcmp (_notmuch_database_resolve_thread_id (
+			notmuch, (const char *) loser), thread_id) != 0)
+	    continue;
+
+	if (list == NULL)
+	    list = _notmuch_string_list_create (ctx);
+	_notmuch_string_list_append (list, talloc_strdup (list,
+							  (char *) loser));
+    }
+
+    return list;
+}
+
+notmuch_status_t
+_notmuch_database_alias_thread (notmuch_database_t *notmuch,
+				const char *winner_thread_id,
+				const char *loser_thread_id)
+{
+    GHashTable *aliases = _notmuch_thread_aliases (notmuch);
+    Xapian::WritableDatabase *db;
+    std::string winner, loser;
+
+    winner = _notmuch_database_resolve_thread_id (notmuch, winner_thread_id);
+    loser = _notmuch_database_resolve_thread_id (notmuch, loser_thread_id);
+    if (winner == loser)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    /* Callers are already inside Xapian try blocks of their own. */
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    db->set_metadata (NOTMUCH_METADATA_THREAD_ALIAS_PREFIX + loser, winner);
+    g_hash_table_insert (aliases, g_strdup (loser.c_str ()),
+			 g_strdup (winner.c_str ()));
+
+    /* Nothing will look up the loser's summary record again. */
+    if (notmuch->features & NOTMUCH_FEATURE_THREAD_SUMMARIES)
+	db->set_metadata (NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX + loser, "");
+    _notmuch_database_invalidate_thread_summary (notmuch, winner.c_str ());
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+void
+_notmuch_database_forget_thread_alias (notmuch_database_t *notmuch,
+				       const char *loser_thread_id)
+{
+    Xapian::WritableDatabase *db;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    db->set_metadata (std::string (NOTMUCH_METADATA_THREAD_ALIAS_PREFIX) +
+		      loser_thread_id, "");
+}
+
+static notmuch_bool_t
+_is_term_boundary (char c)
+{
+    return c == '\0' || c == ' ' || c == '\t' || c == '\n' ||
+	c == '(' || c == ')' || c == '+' || c == '-';
+}
+
+const char *
+_notmuch_database_expand_thread_aliases (notmuch_database_t *notmuch,
+					 void *ctx,
+					 const char *query_string)
+{
+    const char *prefix = "thread:";
+    const char *s = query_string, *p;
+    char *expanded;
+
+    if (! _notmuch_database_has_thread_aliases (notmuch) ||
+	strstr (query_string, prefix) == NULL)
+	return query_string;
+
+    expanded = talloc_strdup (ctx, "");
+
+    while (expanded && (p = strstr (s, prefix))) {
+	const char *id = p + strlen (prefix);
+	size_t len = strspn (id, "0123456789abcdef");
+	notmuch_string_list_t *list;
+	notmuch_string_node_t *node;
+	const char *root;
+	char *thread_id;
+
+	if (len == 0 || ! _is_term_boundary (id[len]) ||
+	    (p > query_string && ! _is_term_boundary (p[-1]))) {
+	    expanded = talloc_strndup_append_buffer (expanded, s, id - s);
+	    s = id;
+	    continue;
+	}
+
+	thread_id = talloc_strndup (expanded, id, len);
+	root = _notmuch_database_resolve_thread_id (notmuch, thread_id);
+	list = _notmuch_database_get_thread_aliases (notmuch, expanded, root);
+
+	expanded = talloc_strndup_append_buffer (expanded, s, p - s);
+	expanded = talloc_asprintf_append_buffer (expanded, "(%s%s",
+						  prefix, root);
+	for (node = list ? list->head : NULL; node && expanded;
+	     node = node->next)
+	    expanded = talloc_asprintf_append_buffer (expanded, " OR %s%s",
+						      prefix, node->string);
+	expanded = talloc_strdup_append_buffer (expanded, ")");
+
+	s = id + len;
+    }
+
+    if (expanded)
+	expanded = talloc_strdup_append_buffer (expanded, s);
+    if (unlikely (expanded == NULL))
+	return query_string;
+
+    return expanded;
+}
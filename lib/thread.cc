@@ -26,139 +26,226 @@
 
 #define EMPTY_STRING(s) ((s)[0] == '\0')
 
+/* A table of strings (each with a value) with open addressing, which
+ * remembers the order its entries were added in.  Its arrays are
+ * talloc'ed under the thread, so that a thread costs a handful of
+ * allocations however many messages and authors it has, and
+ * goes with the thread.  Keys are not copied. */
+typedef struct {
+    const char *key;
+    void *value;
+} thread_table_entry_t;
+
+typedef struct {
+    /* The entries, in the order they were added. */
+    thread_table_entry_t *entries;
+    unsigned int count;
+    /* Each slot is 0 if free, or 1 + the index of an entry.  The
+     * number of slots is a power of two, and at least twice count. */
+    unsigned int *slots;
+    unsigned int num_slots;
+} thread_table_t;
+
 struct visible _notmuch_thread {
     notmuch_database_t *notmuch;
     char *thread_id;
     char *subject;
-    GHashTable *authors_hash;
-    GPtrArray *authors_array;
-    GHashTable *matched_authors_hash;
-    GPtrArray *matched_authors_array;
-    char *authors;
-    GHashTable *tags;
+    /* Authors and matched authors, in date order. */
+    thread_table_t authors;
+    thread_table_t matched_authors;
+    const char *authors_string;
+    notmuch_tag_set_t *tags;
 
     /* All messages, oldest first. */
     notmuch_message_list_t *message_list;
     /* Top-level messages, oldest first. */
     notmuch_message_list_t *toplevel_list;
 
-    GHashTable *message_hash;
+    /* Messages by message id, only filled in if some message's
+     * parent has to be looked up by its message id. */
+    thread_table_t messages;
     int total_messages;
     int matched_messages;
     time_t oldest;
     time_t newest;
+
+    /* The document ID of the first matched message in the order of
+     * the search, whose snippet is the thread's, and that snippet
+     * once read by notmuch_thread_get_snippet. */
+    unsigned int snippet_doc_id;
+    char *snippet;
+
+    /* If TRUE, the fields above were filled in from the thread's
+     * summary record, and message_list, toplevel_list and
+     * messages are only filled in when first needed.  The
+     * remaining fields are what is needed to do so. */
+    notmuch_bool_t messages_pending;
+    notmuch_tag_set_t *exclude_tags;
+    notmuch_exclude_t omit_excluded;
+    /* Doc ids of the matched messages, only set for threads built
+     * from a summary record. */
+    GHashTable *matched_doc_ids;
 };
 
-static int
-_notmuch_thread_destructor (notmuch_thread_t *thread)
+/* Return the slot of 'table' that holds 'key', or the free slot
+ * where it would go. */
+static unsigned int *
+_thread_table_slot (const thread_table_t *table, const char *key)
 {
-    g_hash_table_unref (thread->authors_hash);
-    g_hash_table_unref (thread->matched_authors_hash);
-    g_hash_table_unref (thread->tags);
-    g_hash_table_unref (thread->message_hash);
+    unsigned int mask = table->num_slots - 1;
+    unsigned int i = g_str_hash (key) & mask;
 
-    if (thread->authors_array) {
-	g_ptr_array_free (thread->authors_array, TRUE);
-	thread->authors_array = NULL;
-    }
+    while (table->slots[i] &&
+	   strcmp (table->entries[table->slots[i] - 1].key, key) != 0)
+	i = (i + 1) & mask;
+
+    return &table->slots[i];
+}
+
+/* Return TRUE, and its value in *value unless that is NULL, if 'key'
+ * is in 'table'. */
+static notmuch_bool_t
+_thread_table_lookup (const thread_table_t *table, const char *key,
+		      void **value)
+{
+    unsigned int slot;
+
+    if (table->count == 0)
+	return FALSE;
+
+    slot = *_thread_table_slot (table, key);
+    if (! slot)
+	return FALSE;
+
+    if (value)
+	*value = table->entries[slot - 1].value;
+    return TRUE;
+}
 
-    if (thread->matched_authors_array) {
-	g_ptr_array_free (thread->matched_authors_array, TRUE);
-	thread->matched_authors_array = NULL;
+/* Add 'key', which is not in 'table' yet and must live as long as
+ * it, with 'value'.  Returns FALSE on out-of-memory. */
+static notmuch_bool_t
+_thread_table_add (void *ctx, thread_table_t *table,
+		   const char *key, void *value)
+{
+    unsigned int *slot;
+
+    if (2 * (table->count + 1) > table->num_slots) {
+	unsigned int num_slots = table->num_slots ? 2 * table->num_slots : 16;
+	thread_table_entry_t *entries;
+	unsigned int *slots;
+
+	entries = talloc_realloc (ctx, table->entries, thread_table_entry_t,
+				  num_slots / 2);
+	if (unlikely (entries == NULL))
+	    return FALSE;
+	table->entries = entries;
+
+	slots = talloc_zero_array (ctx, unsigned int, num_slots);
+	if (unlikely (slots == NULL))
+	    return FALSE;
+	talloc_free (table->slots);
+	table->slots = slots;
+	table->num_slots = num_slots;
+
+	for (unsigned int i = 0; i < table->count; i++)
+	    *_thread_table_slot (table, entries[i].key) = i + 1;
     }
 
+    slot = _thread_table_slot (table, key);
+    table->entries[table->count].key = key;
+    table->entries[table->count].value = value;
+    *slot = ++table->count;
+
+    return TRUE;
+}
+
+static int
+_notmuch_thread_destructor (notmuch_thread_t *thread)
+{
+    if (thread->matched_doc_ids)
+	g_hash_table_unref (thread->matched_doc_ids);
+
     return 0;
 }
 
-/* Add each author of the thread to the thread's authors_hash and to
- * the thread's authors_array. */
+/* Add a copy of 'author', unless it is already there, to 'authors'. */
 static void
-_thread_add_author (notmuch_thread_t *thread,
-		    const char *author)
+_thread_add_author_to (notmuch_thread_t *thread, thread_table_t *authors,
+		       const char *author)
 {
     char *author_copy;
 
     if (author == NULL)
 	return;
 
-    if (g_hash_table_lookup_extended (thread->authors_hash,
-				      author, NULL, NULL))
+    if (_thread_table_lookup (authors, author, NULL))
 	return;
 
     author_copy = talloc_strdup (thread, author);
+    if (unlikely (author_copy == NULL))
+	return;
 
-    g_hash_table_insert (thread->authors_hash, author_copy, NULL);
+    _thread_table_add (thread, authors, author_copy, NULL);
+}
 
-    g_ptr_array_add (thread->authors_array, author_copy);
+/* Add each author of the thread to the thread's authors, in date
+ * order. */
+static void
+_thread_add_author (notmuch_thread_t *thread,
+		    const char *author)
+{
+    _thread_add_author_to (thread, &thread->authors, author);
 }
 
-/* Add each matched author of the thread to the thread's
- * matched_authors_hash and to the thread's matched_authors_array. */
+/* Add each matched author of the thread to the thread's matched
+ * authors, in date order. */
 static void
 _thread_add_matched_author (notmuch_thread_t *thread,
 			    const char *author)
 {
-    char *author_copy;
-
-    if (author == NULL)
-	return;
-
-    if (g_hash_table_lookup_extended (thread->matched_authors_hash,
-				      author, NULL, NULL))
-	return;
-
-    author_copy = talloc_strdup (thread, author);
-
-    g_hash_table_insert (thread->matched_authors_hash, author_copy, NULL);
-
-    g_ptr_array_add (thread->matched_authors_array, author_copy);
+    _thread_add_author_to (thread, &thread->matched_authors, author);
 }
 
-/* Construct an authors string from matched_authors_array and
- * authors_array. The string contains matched authors first, then
+/* Construct an authors string from the matched authors and the
+ * authors. The string contains matched authors first, then
  * non-matched authors (with the two groups separated by '|'). Within
  * each group, authors are listed in date order. */
 static void
 _resolve_thread_authors_string (notmuch_thread_t *thread)
 {
     unsigned int i;
-    char *author;
+    const char *author;
     int first_non_matched_author = 1;
 
     /* First, list all matched authors in date order. */
-    for (i = 0; i < thread->matched_authors_array->len; i++) {
-	author = (char *) g_ptr_array_index (thread->matched_authors_array, i);
-	if (thread->authors)
-	    thread->authors = talloc_asprintf (thread, "%s, %s",
-					       thread->authors,
-					       author);
+    for (i = 0; i < thread->matched_authors.count; i++) {
+	author = thread->matched_authors.entries[i].key;
+	if (thread->authors_string)
+	    thread->authors_string = talloc_asprintf (thread, "%s, %s",
+						      thread->authors_string,
+						      author);
 	else
-	    thread->authors = author;
+	    thread->authors_string = author;
     }
 
     /* Next, append any non-matched authors that haven't already appeared. */
-    for (i = 0; i < thread->authors_array->len; i++) {
-	author = (char *) g_ptr_array_index (thread->authors_array, i);
-	if (g_hash_table_lookup_extended (thread->matched_authors_hash,
-					  author, NULL, NULL))
+    for (i = 0; i < thread->authors.count; i++) {
+	author = thread->authors.entries[i].key;
+	if (_thread_table_lookup (&thread->matched_authors, author, NULL))
 	    continue;
 	if (first_non_matched_author) {
-	    thread->authors = talloc_asprintf (thread, "%s| %s",
-					       thread->authors,
-					       author);
+	    thread->authors_string = talloc_asprintf (thread, "%s| %s",
+						      thread->authors_string,
+						      author);
 	} else {
-	    thread->authors = talloc_asprintf (thread, "%s, %s",
-					       thread->authors,
-					       author);
+	    thread->authors_string = talloc_asprintf (thread, "%s, %s",
+						      thread->authors_string,
+						      author);
 	}
 
 	first_non_matched_author = 0;
     }
-
-    g_ptr_array_free (thread->authors_array, TRUE);
-    thread->authors_array = NULL;
-    g_ptr_array_free (thread->matched_authors_array, TRUE);
-    thread->matched_authors_array = NULL;
 }
 
 /* clean up the ugly "Lastname, Firstname" format that some mail systems
@@ -169,7 +256,7 @@ _resolve_thread_authors_string (notmuch_thread_t *thread)
  * "Last, First MI" <first.mi.last@company.com>
  */
 static char *
-_thread_cleanup_author (notmuch_thread_t *thread,
+_thread_cleanup_author (const void *ctx,
 			const char *author, const char *from)
 {
     char *clean_author,*test_author;
@@ -179,7 +266,7 @@ _thread_cleanup_author (notmuch_thread_t *thread,
 
     if (author == NULL)
 	return NULL;
-    clean_author = talloc_strdup(thread, author);
+    clean_author = talloc_strdup(ctx, author);
     if (clean_author == NULL)
 	return NULL;
     /* check if there's a comma in the name and that there's a
@@ -206,7 +293,7 @@ _thread_cleanup_author (notmuch_thread_t *thread,
 	strncpy(clean_author + fname + 1, author, lname);
 	*(clean_author+fname+1+lname) = '\0';
 	/* make a temporary copy and see if it matches the email */
-	test_author = talloc_strdup(thread,clean_author);
+	test_author = talloc_strdup(ctx,clean_author);
 
 	blank=strchr(test_author,' ');
 	while (blank != NULL) {
@@ -221,6 +308,71 @@ _thread_cleanup_author (notmuch_thread_t *thread,
     return clean_author;
 }
 
+/* Return the cleaned-up name (or, failing that, address) of the first
+ * author in the From header 'from', talloc'ed under 'ctx', or NULL if
+ * there is none. */
+static char *
+_from_author (const void *ctx, const char *from)
+{
+    InternetAddressList *list = NULL;
+    InternetAddress *address;
+    const char *author;
+    char *clean_author = NULL;
+
+    if (from)
+	list = internet_address_list_parse_string (from);
+
+    if (list) {
+	address = internet_address_list_get_address (list, 0);
+	if (address) {
+	    author = internet_address_get_name (address);
+	    /* We treat quoted empty names as if they were empty. */
+	    if (author == NULL || author[0] == '\0') {
+		InternetAddressMailbox *mailbox;
+		mailbox = INTERNET_ADDRESS_MAILBOX (address);
+		author = internet_address_mailbox_get_addr (mailbox);
+	    }
+	    clean_author = _thread_cleanup_author (ctx, author, from);
+	}
+	g_object_unref (G_OBJECT (list));
+    }
+
+    return clean_author;
+}
+
+/* Return the cleaned-up name (or, failing that, address) of the first
+ * author of 'message', talloc'ed under 'ctx', or NULL if the message
+ * has no parsable From header. */
+static char *
+_message_author (const void *ctx, notmuch_message_t *message)
+{
+    return _from_author (ctx, notmuch_message_get_header (message, "from"));
+}
+
+/* Return the set of the tags of the (K-prefixed) 'exclude_terms'. */
+static notmuch_tag_set_t *
+_exclude_tag_set (const void *ctx, notmuch_database_t *notmuch,
+		  notmuch_string_list_t *exclude_terms)
+{
+    return _notmuch_tag_set_create_for_tags (ctx, notmuch, exclude_terms, 1);
+}
+
+/* Return TRUE if 'message' should be treated as excluded. */
+static notmuch_bool_t
+_message_is_excluded (notmuch_message_t *message,
+		      const notmuch_tag_set_t *exclude_tags,
+		      notmuch_exclude_t omit_exclude)
+{
+    const notmuch_tag_set_t *tags;
+
+    if (omit_exclude == NOTMUCH_EXCLUDE_FALSE)
+	return FALSE;
+
+    tags = _notmuch_message_get_tag_set (message);
+
+    return tags && _notmuch_tag_set_intersects (tags, exclude_tags);
+}
+
 /* Add 'message' as a message that belongs to 'thread'.
  *
  * The 'thread' will talloc_steal the 'message' and hold onto a
@@ -229,36 +381,15 @@ _thread_cleanup_author (notmuch_thread_t *thread,
 static void
 _thread_add_message (notmuch_thread_t *thread,
 		     notmuch_message_t *message,
-		     notmuch_string_list_t *exclude_terms,
+		     const notmuch_tag_set_t *exclude_tags,
 		     notmuch_exclude_t omit_exclude)
 {
-    notmuch_tags_t *tags;
-    const char *tag;
-    InternetAddressList *list = NULL;
-    InternetAddress *address;
-    const char *from, *author;
+    const notmuch_tag_set_t *tags;
     char *clean_author;
-    notmuch_bool_t message_excluded = FALSE;
+    notmuch_bool_t message_excluded;
 
-    if (omit_exclude != NOTMUCH_EXCLUDE_FALSE) {
-	for (tags = notmuch_message_get_tags (message);
-	     notmuch_tags_valid (tags);
-	     notmuch_tags_move_to_next (tags))
-	{
-	    tag = notmuch_tags_get (tags);
-	    /* Is message excluded? */
-	    for (notmuch_string_node_t *term = exclude_terms->head;
-		 term != NULL;
-		 term = term->next)
-	    {
-		/* Check for an empty string, and then ignore initial 'K'. */
-		if (*(term->string) && strcmp(tag, (term->string + 1)) == 0) {
-		    message_excluded = TRUE;
-		    break;
-		}
-	    }
-	}
-    }
+    message_excluded = _message_is_excluded (message, exclude_tags,
+					     omit_exclude);
 
     if (message_excluded && omit_exclude == NOTMUCH_EXCLUDE_ALL)
 	return;
@@ -267,29 +398,10 @@ _thread_add_message (notmuch_thread_t *thread,
 				       talloc_steal (thread, message));
     thread->total_messages++;
 
-    g_hash_table_insert (thread->message_hash,
-			 xstrdup (notmuch_message_get_message_id (message)),
-			 message);
-
-    from = notmuch_message_get_header (message, "from");
-    if (from)
-	list = internet_address_list_parse_string (from);
-
-    if (list) {
-	address = internet_address_list_get_address (list, 0);
-	if (address) {
-	    author = internet_address_get_name (address);
-	    /* We treat quoted empty names as if they were empty. */
-	    if (author == NULL || author[0] == '\0') {
-		InternetAddressMailbox *mailbox;
-		mailbox = INTERNET_ADDRESS_MAILBOX (address);
-		author = internet_address_mailbox_get_addr (mailbox);
-	    }
-	    clean_author = _thread_cleanup_author (thread, author, from);
-	    _thread_add_author (thread, clean_author);
-	    _notmuch_message_set_author (message, clean_author);
-	}
-	g_object_unref (G_OBJECT (list));
+    clean_author = _message_author (thread, message);
+    if (clean_author) {
+	_thread_add_author (thread, clean_author);
+	_notmuch_message_set_author (message, clean_author);
     }
 
     if (! thread->subject) {
@@ -298,13 +410,9 @@ _thread_add_message (notmuch_thread_t *thread,
 	thread->subject = talloc_strdup (thread, subject ? subject : "");
     }
 
-    for (tags = notmuch_message_get_tags (message);
-	 notmuch_tags_valid (tags);
-	 notmuch_tags_move_to_next (tags))
-    {
-	tag = notmuch_tags_get (tags);
-	g_hash_table_insert (thread->tags, xstrdup (tag), NULL);
-    }
+    tags = _notmuch_message_get_tag_set (message);
+    if (tags)
+	_notmuch_tag_set_union (thread->tags, tags);
 
     /* Mark excluded messages. */
     if (message_excluded)
@@ -312,13 +420,10 @@ _thread_add_message (notmuch_thread_t *thread,
 }
 
 static void
-_thread_set_subject_from_message (notmuch_thread_t *thread,
-				  notmuch_message_t *message)
+_thread_set_subject (notmuch_thread_t *thread, const char *subject)
 {
-    const char *subject;
     const char *cleaned_subject;
 
-    subject = notmuch_message_get_header (message, "subject");
     if (! subject)
 	return;
 
@@ -342,6 +447,14 @@ _thread_set_subject_from_message (notmuch_thread_t *thread,
     }
 }
 
+static void
+_thread_set_subject_from_message (notmuch_thread_t *thread,
+				  notmuch_message_t *message)
+{
+    _thread_set_subject (thread,
+			 notmuch_message_get_header (message, "subject"));
+}
+
 /* Add a message to this thread which is known to match the original
  * search specification. The 'sort' parameter controls whether the
  * oldest or newest matching subject is applied to the thread as a
@@ -352,14 +465,15 @@ _thread_add_matched_message (notmuch_thread_t *thread,
 			     notmuch_sort_t sort)
 {
     time_t date;
-    notmuch_message_t *hashed_message;
 
     date = notmuch_message_get_date (message);
 
     if (date < thread->oldest || ! thread->matched_messages) {
 	thread->oldest = date;
-	if (sort == NOTMUCH_SORT_OLDEST_FIRST)
+	if (sort == NOTMUCH_SORT_OLDEST_FIRST) {
 	    _thread_set_subject_from_message (thread, message);
+	    thread->snippet_doc_id = _notmuch_message_get_doc_id (message);
+	}
     }
 
     if (date > thread->newest || ! thread->matched_messages) {
@@ -367,19 +481,77 @@ _thread_add_matched_message (notmuch_thread_t *thread,
 	const char *cur_subject = notmuch_thread_get_subject(thread);
 	if (sort != NOTMUCH_SORT_OLDEST_FIRST || EMPTY_STRING(cur_subject))
 	    _thread_set_subject_from_message (thread, message);
+	if (sort != NOTMUCH_SORT_OLDEST_FIRST)
+	    thread->snippet_doc_id = _notmuch_message_get_doc_id (message);
     }
 
     if (!notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_EXCLUDED))
 	thread->matched_messages++;
 
-    if (g_hash_table_lookup_extended (thread->message_hash,
-			    notmuch_message_get_message_id (message), NULL,
-			    (void **) &hashed_message)) {
-	notmuch_message_set_flag (hashed_message,
-				  NOTMUCH_MESSAGE_FLAG_MATCH, 1);
+    notmuch_message_set_flag (message, NOTMUCH_MESSAGE_FLAG_MATCH, 1);
+
+    _thread_add_matched_author (thread, _notmuch_message_get_author (message));
+}
+
+typedef struct {
+    unsigned int doc_id;
+    notmuch_message_t *message;
+} thread_doc_id_entry_t;
+
+static int
+_compare_doc_id_entries (const void *a, const void *b)
+{
+    const thread_doc_id_entry_t *x = (const thread_doc_id_entry_t *) a;
+    const thread_doc_id_entry_t *y = (const thread_doc_id_entry_t *) b;
+
+    if (x->doc_id != y->doc_id)
+	return x->doc_id < y->doc_id ? -1 : 1;
+    return 0;
+}
+
+/* Return the message of 'thread' that 'message' replies to, or NULL.
+ * 'by_doc_id' holds the 'count' messages of the thread sorted by doc
+ * id. */
+static notmuch_message_t *
+_thread_find_parent (notmuch_thread_t *thread,
+		     notmuch_message_t *message,
+		     const char *in_reply_to,
+		     const thread_doc_id_entry_t *by_doc_id,
+		     size_t count)
+{
+    thread_doc_id_entry_t key, *found = NULL;
+    notmuch_message_node_t *node;
+    void *parent;
+
+    /* Messages record the doc id of their parent when they are
+     * added.  That document may since have been replaced (e.g. a
+     * removed message by a ghost), archived or renumbered by
+     * compaction, so it only counts if it has the right message
+     * id. */
+    key.doc_id = _notmuch_message_get_parent_doc_id (message);
+    if (key.doc_id && by_doc_id) {
+	key.doc_id = _notmuch_database_combined_doc_id (thread->notmuch,
+						       key.doc_id);
+	found = (thread_doc_id_entry_t *) bsearch (
+	    &key, by_doc_id, count, sizeof (thread_doc_id_entry_t),
+	    _compare_doc_id_entries);
     }
+    if (found && strcmp (notmuch_message_get_message_id (found->message),
+			 in_reply_to) == 0)
+	return found->message;
+
+    /* Otherwise fall back to looking the parent up by message id. */
+    if (thread->messages.count == 0) {
+	for (node = thread->message_list->head; node; node = node->next)
+	    _thread_table_add (thread, &thread->messages,
+			       notmuch_message_get_message_id (node->message),
+			       node->message);
+    }
+
+    if (_thread_table_lookup (&thread->messages, in_reply_to, &parent))
+	return (notmuch_message_t *) parent;
 
-    _thread_add_matched_author (thread, _notmuch_message_get_author (hashed_message));
+    return NULL;
 }
 
 static void
@@ -387,20 +559,40 @@ _resolve_thread_relationships (notmuch_thread_t *thread)
 {
     notmuch_message_node_t *node;
     notmuch_message_t *message, *parent;
+    thread_doc_id_entry_t *by_doc_id;
     const char *in_reply_to;
+    size_t count = 0;
+
+    for (node = thread->message_list->head; node; node = node->next)
+	count++;
+
+    by_doc_id = talloc_array (thread, thread_doc_id_entry_t, count);
+    if (by_doc_id) {
+	count = 0;
+	for (node = thread->message_list->head; node; node = node->next) {
+	    by_doc_id[count].doc_id = _notmuch_message_get_doc_id (node->message);
+	    by_doc_id[count].message = node->message;
+	    count++;
+	}
+	qsort (by_doc_id, count,
+	       sizeof (thread_doc_id_entry_t), _compare_doc_id_entries);
+    }
 
     for (node = thread->message_list->head; node; node = node->next) {
 	message = node->message;
 	in_reply_to = _notmuch_message_get_in_reply_to (message);
-	if (in_reply_to && strlen (in_reply_to) &&
-	    g_hash_table_lookup_extended (thread->message_hash,
-					  in_reply_to, NULL,
-					  (void **) &parent))
+	parent = NULL;
+	if (in_reply_to && strlen (in_reply_to))
+	    parent = _thread_find_parent (thread, message, in_reply_to,
+					  by_doc_id, count);
+	if (parent)
 	    _notmuch_message_add_reply (parent, message);
 	else
 	    _notmuch_message_list_add_message (thread->toplevel_list, message);
     }
 
+    talloc_free (by_doc_id);
+
     /* XXX: After scanning through the entire list looking for parents
      * via "In-Reply-To", we should do a second pass that looks at the
      * list of messages IDs in the "References" header instead. (And
@@ -413,169 +605,1077 @@ _resolve_thread_relationships (notmuch_thread_t *thread)
      */
 }
 
-/* Create a new notmuch_thread_t object by finding the thread
- * containing the message with the given doc ID, treating any messages
- * contained in match_set as "matched".  Remove all messages in the
- * thread from match_set.
- *
- * Creating the thread will perform a database search to get all
- * messages belonging to the thread and will get the first subject
- * line, the total count of messages, and all authors in the thread.
- * Each message in the thread is checked against match_set to allow
- * for a separate count of matched messages, and to allow a viewer to
- * display these messages differently.
- *
- * Here, 'ctx' is talloc context for the resulting thread object.
+/* Allocate and initialize an empty notmuch_thread_t object for
+ * 'thread_id', with 'ctx' as its talloc owner.
  *
- * This function returns NULL in the case of any error.
- */
-notmuch_thread_t *
-_notmuch_thread_create (void *ctx,
-			notmuch_database_t *notmuch,
-			unsigned int seed_doc_id,
-			notmuch_doc_id_set_t *match_set,
-			notmuch_string_list_t *exclude_terms,
-			notmuch_exclude_t omit_excluded,
-			notmuch_sort_t sort)
+ * Returns NULL on out-of-memory. */
+static notmuch_thread_t *
+_notmuch_thread_alloc (void *ctx,
+		       notmuch_database_t *notmuch,
+		       const char *thread_id)
 {
-    void *local = talloc_new (ctx);
-    notmuch_thread_t *thread = NULL;
-    notmuch_message_t *seed_message;
-    const char *thread_id;
-    char *thread_id_query_string;
-    notmuch_query_t *thread_id_query;
-
-    notmuch_messages_t *messages;
-    notmuch_message_t *message;
-    notmuch_status_t status;
-
-    seed_message = _notmuch_message_create (local, notmuch, seed_doc_id, NULL);
-    if (! seed_message)
-	INTERNAL_ERROR ("Thread seed message %u does not exist", seed_doc_id);
-
-    thread_id = notmuch_message_get_thread_id (seed_message);
-    thread_id_query_string = talloc_asprintf (local, "thread:%s", thread_id);
-    if (unlikely (thread_id_query_string == NULL))
-	goto DONE;
-
-    thread_id_query = talloc_steal (
-	local, notmuch_query_create (notmuch, thread_id_query_string));
-    if (unlikely (thread_id_query == NULL))
-	goto DONE;
+    notmuch_thread_t *thread;
 
-    thread = talloc (local, notmuch_thread_t);
+    thread = talloc (ctx, notmuch_thread_t);
     if (unlikely (thread == NULL))
-	goto DONE;
+	return NULL;
 
     talloc_set_destructor (thread, _notmuch_thread_destructor);
 
     thread->notmuch = notmuch;
     thread->thread_id = talloc_strdup (thread, thread_id);
     thread->subject = NULL;
-    thread->authors_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-						  NULL, NULL);
-    thread->authors_array = g_ptr_array_new ();
-    thread->matched_authors_hash = g_hash_table_new_full (g_str_hash,
-							  g_str_equal,
-							  NULL, NULL);
-    thread->matched_authors_array = g_ptr_array_new ();
-    thread->authors = NULL;
-    thread->tags = g_hash_table_new_full (g_str_hash, g_str_equal,
-					  free, NULL);
+    memset (&thread->authors, 0, sizeof (thread->authors));
+    memset (&thread->matched_authors, 0, sizeof (thread->matched_authors));
+    thread->authors_string = NULL;
+    memset (&thread->messages, 0, sizeof (thread->messages));
 
+    thread->tags = _notmuch_tag_set_create (thread);
     thread->message_list = _notmuch_message_list_create (thread);
     thread->toplevel_list = _notmuch_message_list_create (thread);
-    if (unlikely (thread->message_list == NULL ||
+    if (unlikely (thread->tags == NULL ||
+		  thread->message_list == NULL ||
 		  thread->toplevel_list == NULL)) {
-	thread = NULL;
-	goto DONE;
+	talloc_free (thread);
+	return NULL;
     }
 
-    thread->message_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-						  free, NULL);
-
     thread->total_messages = 0;
     thread->matched_messages = 0;
     thread->oldest = 0;
     thread->newest = 0;
+    thread->snippet_doc_id = 0;
+    thread->snippet = NULL;
 
-    /* We use oldest-first order unconditionally here to obtain the
-     * proper author ordering for the thread. The 'sort' parameter
-     * passed to this function is used only to indicate whether the
-     * oldest or newest subject is desired. */
-    notmuch_query_set_sort (thread_id_query, NOTMUCH_SORT_OLDEST_FIRST);
-
-    status = notmuch_query_search_messages_st (thread_id_query, &messages);
-    if (status)
-	goto DONE;
-
-    for (;
-	 notmuch_messages_valid (messages);
-	 notmuch_messages_move_to_next (messages))
-    {
-	unsigned int doc_id;
+    thread->messages_pending = FALSE;
+    thread->exclude_tags = NULL;
+    thread->omit_excluded = NOTMUCH_EXCLUDE_FALSE;
+    thread->matched_doc_ids = NULL;
 
-	message = notmuch_messages_get (messages);
-	doc_id = _notmuch_message_get_doc_id (message);
-	if (doc_id == seed_doc_id)
-	    message = seed_message;
+    return thread;
+}
 
-	_thread_add_message (thread, message, exclude_terms, omit_excluded);
+/* Add 'message', as returned by a thread query, to 'thread', treating
+ * it as matched (and removing it from match_set) if it is contained
+ * in 'match_set'. */
+static void
+_thread_add_query_message (notmuch_thread_t *thread,
+			   notmuch_message_t *message,
+			   notmuch_doc_id_set_t *match_set,
+			   const notmuch_tag_set_t *exclude_tags,
+			   notmuch_exclude_t omit_excluded,
+			   notmuch_sort_t sort)
+{
+    unsigned int doc_id = _notmuch_message_get_doc_id (message);
 
-	if ( _notmuch_doc_id_set_contains (match_set, doc_id)) {
-	    _notmuch_doc_id_set_remove (match_set, doc_id);
-	    _thread_add_matched_message (thread, message, sort);
-	}
+    _thread_add_message (thread, message, exclude_tags, omit_excluded);
 
-	_notmuch_message_close (message);
+    if ( _notmuch_doc_id_set_contains (match_set, doc_id)) {
+	_notmuch_doc_id_set_remove (match_set, doc_id);
+	_thread_add_matched_message (thread, message, sort);
     }
 
+    _notmuch_message_close (message);
+}
+
+/* Once every message has been added, compute the derived fields of
+ * 'thread'. */
+static void
+_notmuch_thread_finish (notmuch_thread_t *thread)
+{
     _resolve_thread_authors_string (thread);
 
     _resolve_thread_relationships (thread);
+}
 
-    /* Commit to returning thread. */
-    (void) talloc_steal (ctx, thread);
+/* Thread summary records.
+ *
+ * When the database has NOTMUCH_FEATURE_THREAD_SUMMARIES, each thread
+ * has a summary record in the database metadata, under
+ * NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX followed by the thread ID.
+ * It holds everything _thread_add_message and
+ * _thread_add_matched_message need from each message of the thread,
+ * so that a thread can be summarized by reading that one record, and
+ * its messages are only loaded if the caller asks for them.
+ *
+ * The record is a version line followed by one line per message,
+ * oldest first, each made of the space-separated fields
+ *
+ *	<doc id> <date> <message id> <author> <subject> <tags>
+ *
+ * The text fields are hex-encoded, the tags are joined with '/'
+ * after encoding, and an empty author means the message has none.
+ *
+ * Writing any message of a thread removes the thread's record (see
+ * _notmuch_database_invalidate_thread_summary) and the record is
+ * written again when the database is closed, so a record is either
+ * current or absent.
+ */
+#define NOTMUCH_THREAD_SUMMARY_VERSION "1"
+#define NOTMUCH_THREAD_SUMMARY_FIELDS 6
 
-  DONE:
-    talloc_free (local);
-    return thread;
-}
+/* What a thread summary needs of one message, whether it comes from
+ * a summary record or from the value streams. */
+typedef struct {
+    unsigned int doc_id;
+    time_t date;
+    const char *author;
+    const char *subject;
+    /* Interned tags (see _notmuch_database_intern_tag). */
+    unsigned int *tags;
+    unsigned int num_tags;
+} notmuch_summary_entry_t;
 
-notmuch_messages_t *
-notmuch_thread_get_toplevel_messages (notmuch_thread_t *thread)
+/* Return the summary record of 'thread_id', talloc'ed under 'ctx', or
+ * NULL if there is none. */
+static char *
+_notmuch_thread_get_summary (void *ctx,
+			     notmuch_database_t *notmuch,
+			     const char *thread_id)
 {
-    return _notmuch_messages_create (thread->toplevel_list);
-}
+    std::string record;
 
-notmuch_messages_t *
-notmuch_thread_get_messages (notmuch_thread_t *thread)
-{
-    return _notmuch_messages_create (thread->message_list);
-}
+    /* The tags of a summary do not have the journaled changes. */
+    if (! (notmuch->features & NOTMUCH_FEATURE_THREAD_SUMMARIES) ||
+	_notmuch_database_has_tag_journal (notmuch))
+	return NULL;
 
-const char *
-notmuch_thread_get_thread_id (notmuch_thread_t *thread)
-{
-    return thread->thread_id;
-}
+    try {
+	record = notmuch->xapian_db->get_metadata (
+	    std::string (NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX) + thread_id);
+    } catch (const Xapian::Error &error) {
+	return NULL;
+    }
 
-int
-notmuch_thread_get_total_messages (notmuch_thread_t *thread)
-{
-    return thread->total_messages;
+    if (record.empty ())
+	return NULL;
+
+    return talloc_strdup (ctx, record.c_str ());
 }
 
-int
-notmuch_thread_get_matched_messages (notmuch_thread_t *thread)
+/* Split one record line in place into its fields and decode them,
+ * with the array of tags talloc'ed under 'ctx'.  Returns FALSE if the
+ * line is malformed. */
+static notmuch_bool_t
+_summary_parse_line (void *ctx, notmuch_database_t *notmuch,
+		     char *line, notmuch_summary_entry_t *entry)
 {
-    return thread->matched_messages;
-}
+    char *fields[NOTMUCH_THREAD_SUMMARY_FIELDS];
+    char *end, *tag, *tag_end;
+    unsigned int num_tags = 0;
+    int i;
+
+    for (i = 0; i < NOTMUCH_THREAD_SUMMARY_FIELDS; i++) {
+	if (line == NULL)
+	    return FALSE;
+	fields[i] = line;
+	line = strchr (line, ' ');
+	if (line)
+	    *line++ = '\0';
+    }
+    if (line)
+	return FALSE;
+
+    for (i = 2; i < 5; i++) {
+	if (hex_decode_inplace (fields[i]) != HEX_SUCCESS)
+	    return FALSE;
+    }
+
+    entry->doc_id = strtoul (fields[0], &end, 10);
+    if (*end)
+	return FALSE;
+    entry->date = strtoll (fields[1], &end, 10);
+    if (*end)
+	return FALSE;
+    entry->author = *fields[3] ? fields[3] : NULL;
+    entry->subject = fields[4];
+
+    for (tag = fields[5]; *tag; tag++)
+	if (*tag == '/')
+	    num_tags++;
+    entry->tags = talloc_array (ctx, unsigned int, num_tags + 1);
+    if (unlikely (entry->tags == NULL))
+	return FALSE;
+
+    entry->num_tags = 0;
+    for (tag = fields[5]; *tag; tag = tag_end) {
+	tag_end = strchr (tag, '/');
+	if (tag_end)
+	    *tag_end++ = '\0';
+	else
+	    tag_end = tag + strlen (tag);
+	/* A malformed tag stays encoded rather than failing the
+	 * whole record. */
+	hex_decode_inplace (tag);
+	entry->tags[entry->num_tags++] =
+	    _notmuch_database_intern_tag (notmuch, tag);
+    }
+
+    return TRUE;
+}
+
+/* Create a thread from the 'count' entries of its messages, oldest
+ * first, as _notmuch_thread_create would from the messages
+ * themselves.  The messages are loaded by _thread_ensure_messages
+ * when first needed.
+ *
+ * Returns NULL, leaving match_set untouched, on out-of-memory. */
+static notmuch_thread_t *
+_notmuch_thread_create_from_entries (void *ctx,
+				     notmuch_database_t *notmuch,
+				     const char *thread_id,
+				     const notmuch_summary_entry_t *entries,
+				     unsigned int count,
+				     notmuch_doc_id_set_t *match_set,
+				     const notmuch_tag_set_t *exclude_tags,
+				     notmuch_exclude_t omit_excluded,
+				     notmuch_sort_t sort)
+{
+    notmuch_thread_t *thread;
+    unsigned int i, j;
+
+    thread = _notmuch_thread_alloc (ctx, notmuch, thread_id);
+    if (unlikely (thread == NULL))
+	return NULL;
+
+    thread->messages_pending = TRUE;
+    thread->exclude_tags = _notmuch_tag_set_copy (thread, exclude_tags);
+    thread->omit_excluded = omit_excluded;
+    thread->matched_doc_ids = g_hash_table_new (NULL, NULL);
+    if (unlikely (thread->exclude_tags == NULL)) {
+	talloc_free (thread);
+	return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+	const notmuch_summary_entry_t *entry = &entries[i];
+	notmuch_bool_t excluded = FALSE;
+
+	if (omit_excluded != NOTMUCH_EXCLUDE_FALSE) {
+	    for (j = 0; j < entry->num_tags && ! excluded; j++)
+		excluded = _notmuch_tag_set_contains (exclude_tags,
+						      entry->tags[j]);
+	}
+
+	if (excluded && omit_excluded == NOTMUCH_EXCLUDE_ALL)
+	    continue;
+
+	/* As in _thread_add_message. */
+	thread->total_messages++;
+	_thread_add_author (thread, entry->author);
+
+	if (! thread->subject)
+	    thread->subject = talloc_strdup (thread, entry->subject);
+
+	for (j = 0; j < entry->num_tags; j++)
+	    _notmuch_tag_set_add (thread->tags, entry->tags[j]);
+
+	if (! _notmuch_doc_id_set_contains (match_set, entry->doc_id))
+	    continue;
+
+	_notmuch_doc_id_set_remove (match_set, entry->doc_id);
+	g_hash_table_insert (thread->matched_doc_ids,
+			     GUINT_TO_POINTER (entry->doc_id), NULL);
+
+	/* As in _thread_add_matched_message. */
+	if (entry->date < thread->oldest || ! thread->matched_messages) {
+	    thread->oldest = entry->date;
+	    if (sort == NOTMUCH_SORT_OLDEST_FIRST) {
+		_thread_set_subject (thread, entry->subject);
+		thread->snippet_doc_id = entry->doc_id;
+	    }
+	}
+
+	if (entry->date > thread->newest || ! thread->matched_messages) {
+	    thread->newest = entry->date;
+	    const char *cur_subject = notmuch_thread_get_subject(thread);
+	    if (sort != NOTMUCH_SORT_OLDEST_FIRST || EMPTY_STRING(cur_subject))
+		_thread_set_subject (thread, entry->subject);
+	    if (sort != NOTMUCH_SORT_OLDEST_FIRST)
+		thread->snippet_doc_id = entry->doc_id;
+	}
+
+	if (! excluded)
+	    thread->matched_messages++;
+
+	_thread_add_matched_author (thread, entry->author);
+    }
+
+    _resolve_thread_authors_string (thread);
+
+    return thread;
+}
+
+/* Create a thread from its summary record, as _notmuch_thread_create
+ * would from its messages.
+ *
+ * Returns NULL, leaving match_set untouched, if the record cannot be
+ * parsed. */
+static notmuch_thread_t *
+_notmuch_thread_create_from_summary (void *ctx,
+				     notmuch_database_t *notmuch,
+				     const char *thread_id,
+				     char *record,
+				     notmuch_doc_id_set_t *match_set,
+				     const notmuch_tag_set_t *exclude_tags,
+				     notmuch_exclude_t omit_excluded,
+				     notmuch_sort_t sort)
+{
+    notmuch_thread_t *thread;
+    notmuch_summary_entry_t *entries;
+    unsigned int count = 0, lines = 0;
+    char *line, *next;
+
+    line = strchr (record, '\n');
+    if (line == NULL)
+	return NULL;
+    *line++ = '\0';
+    if (strcmp (record, NOTMUCH_THREAD_SUMMARY_VERSION) != 0)
+	return NULL;
+
+    for (next = line; *next; next++)
+	if (*next == '\n')
+	    lines++;
+
+    entries = talloc_array (ctx, notmuch_summary_entry_t, lines + 1);
+    if (unlikely (entries == NULL))
+	return NULL;
+
+    /* Parse everything before touching match_set, so that a bad
+     * record can still fall back to loading the messages. */
+    for (; *line; line = next) {
+	next = strchr (line, '\n');
+	if (next)
+	    *next++ = '\0';
+	else
+	    next = line + strlen (line);
+
+	if (! _summary_parse_line (entries, notmuch, line, &entries[count])) {
+	    talloc_free (entries);
+	    return NULL;
+	}
+	count++;
+    }
+
+    thread = _notmuch_thread_create_from_entries (ctx, notmuch, thread_id,
+						  entries, count, match_set,
+						  exclude_tags, omit_excluded,
+						  sort);
+    talloc_free (entries);
+
+    return thread;
+}
+
+/* Return the value of 'i', a value stream, for 'doc_id', or an empty
+ * string if that document has none.  Successive calls must be in
+ * increasing doc id order. */
+static std::string
+_stream_value (Xapian::ValueIterator &i, const Xapian::ValueIterator &end,
+	       Xapian::docid doc_id)
+{
+    if (i != end)
+	i.skip_to (doc_id);
+    if (i == end || i.get_docid () != doc_id)
+	return std::string ();
+
+    return *i;
+}
+
+static int
+_compare_summary_entries (const void *a, const void *b)
+{
+    const notmuch_summary_entry_t *x = (const notmuch_summary_entry_t *) a;
+    const notmuch_summary_entry_t *y = (const notmuch_summary_entry_t *) b;
+
+    if (x->date != y->date)
+	return x->date < y->date ? -1 : 1;
+    if (x->doc_id != y->doc_id)
+	return x->doc_id < y->doc_id ? -1 : 1;
+    return 0;
+}
+
+/* Create a thread for a caller that only needs its summary, as
+ * _notmuch_thread_create would from its messages, without creating
+ * them: the posting list of the thread term gives its doc ids in
+ * order, the value streams of the date, From and Subject give their
+ * values in one pass each, and the tags are read by skipping each
+ * term list straight to the tag terms.
+ *
+ * Returns NULL, leaving match_set untouched, if the thread has to be
+ * built from its messages instead: when the database does not record
+ * these values, when tags have journaled changes, or when the thread
+ * has been merged with others (see thread-alias.cc). */
+static notmuch_thread_t *
+_notmuch_thread_create_from_values (void *ctx,
+				    notmuch_database_t *notmuch,
+				    const char *thread_id,
+				    notmuch_doc_id_set_t *match_set,
+				    const notmuch_tag_set_t *exclude_tags,
+				    notmuch_exclude_t omit_excluded,
+				    notmuch_sort_t sort)
+{
+    void *local;
+    notmuch_thread_t *thread = NULL;
+    notmuch_summary_entry_t *entries = NULL;
+    const char *tag_prefix = _find_prefix ("tag");
+    size_t tag_prefix_len = strlen (tag_prefix);
+    unsigned int count = 0, size = 0;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES) ||
+	_notmuch_database_has_tag_journal (notmuch))
+	return NULL;
+
+    local = talloc_new (ctx);
+    if (_notmuch_database_get_thread_aliases (notmuch, local, thread_id))
+	goto DONE;
+
+    try {
+	Xapian::Database &db = *notmuch->xapian_db;
+	std::string term = std::string (_find_prefix ("thread")) + thread_id;
+	std::string mail_term = std::string (_find_prefix ("type")) + "mail";
+	Xapian::PostingIterator i, end = db.postlist_end (term);
+	Xapian::PostingIterator mail = db.postlist_begin (mail_term);
+	Xapian::PostingIterator mail_end = db.postlist_end (mail_term);
+	Xapian::ValueIterator dates, froms, subjects;
+	Xapian::ValueIterator dates_end, froms_end, subjects_end;
+
+	dates = db.valuestream_begin (NOTMUCH_VALUE_TIMESTAMP);
+	dates_end = db.valuestream_end (NOTMUCH_VALUE_TIMESTAMP);
+	froms = db.valuestream_begin (NOTMUCH_VALUE_FROM);
+	froms_end = db.valuestream_end (NOTMUCH_VALUE_FROM);
+	subjects = db.valuestream_begin (NOTMUCH_VALUE_SUBJECT);
+	subjects_end = db.valuestream_end (NOTMUCH_VALUE_SUBJECT);
+
+	for (i = db.postlist_begin (term); i != end; i++) {
+	    Xapian::docid doc_id = *i;
+	    notmuch_summary_entry_t *entry;
+	    Xapian::TermIterator t, t_end;
+	    std::string value;
+
+	    /* Ghost messages have the thread term too. */
+	    mail.skip_to (doc_id);
+	    if (mail == mail_end)
+		break;
+	    if (*mail != doc_id)
+		continue;
+
+	    if (count == size) {
+		size = size ? 2 * size : 16;
+		entries = talloc_realloc (local, entries,
+					  notmuch_summary_entry_t, size);
+		if (unlikely (entries == NULL))
+		    goto DONE;
+	    }
+	    entry = &entries[count++];
+	    entry->doc_id = doc_id;
+
+	    value = _stream_value (dates, dates_end, doc_id);
+	    entry->date = value.empty () ? 0 :
+		(time_t) Xapian::sortable_unserialise (value);
+
+	    value = _stream_value (froms, froms_end, doc_id);
+	    entry->author = _from_author (entries, value.c_str ());
+
+	    value = _stream_value (subjects, subjects_end, doc_id);
+	    entry->subject = talloc_strdup (entries, value.c_str ());
+
+	    entry->tags = NULL;
+	    entry->num_tags = 0;
+	    t_end = db.termlist_end (doc_id);
+	    t = db.termlist_begin (doc_id);
+	    for (t.skip_to (tag_prefix); t != t_end; t++) {
+		const std::string &tag = *t;
+
+		if (tag.compare (0, tag_prefix_len, tag_prefix) != 0)
+		    break;
+		entry->tags = talloc_realloc (entries, entry->tags,
+					      unsigned int,
+					      entry->num_tags + 1);
+		if (unlikely (entry->tags == NULL))
+		    goto DONE;
+		entry->tags[entry->num_tags++] = _notmuch_database_intern_tag (
+		    notmuch, tag.c_str () + tag_prefix_len);
+	    }
+	}
+    } catch (const Xapian::Error &error) {
+	goto DONE;
+    }
+
+    if (count == 0)
+	goto DONE;
+
+    /* The oldest-first order _notmuch_thread_create searches in. */
+    qsort (entries, count, sizeof (notmuch_summary_entry_t),
+	   _compare_summary_entries);
+
+    thread = _notmuch_thread_create_from_entries (ctx, notmuch, thread_id,
+						  entries, count, match_set,
+						  exclude_tags, omit_excluded,
+						  sort);
+
+  DONE:
+    talloc_free (local);
+    return thread;
+}
+
+/* Load the messages of a thread created from its summary record. */
+static void
+_thread_ensure_messages (notmuch_thread_t *thread)
+{
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+    notmuch_message_t *message;
+    char *query_string;
+
+    if (! thread->messages_pending)
+	return;
+    thread->messages_pending = FALSE;
+
+    query_string = talloc_asprintf (thread, "thread:%s", thread->thread_id);
+    if (unlikely (query_string == NULL))
+	return;
+
+    query = notmuch_query_create (thread->notmuch, query_string);
+    talloc_free (query_string);
+    if (unlikely (query == NULL))
+	return;
+
+    notmuch_query_set_sort (query, NOTMUCH_SORT_OLDEST_FIRST);
+
+    if (notmuch_query_search_messages_st (query, &messages)) {
+	notmuch_query_destroy (query);
+	return;
+    }
+
+    for (;
+	 notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
+    {
+	notmuch_bool_t excluded;
+	char *author;
+
+	message = notmuch_messages_get (messages);
+
+	excluded = _message_is_excluded (message, thread->exclude_tags,
+					 thread->omit_excluded);
+	if (excluded && thread->omit_excluded == NOTMUCH_EXCLUDE_ALL) {
+	    notmuch_message_destroy (message);
+	    continue;
+	}
+
+	_notmuch_message_list_add_message (thread->message_list,
+					   talloc_steal (thread, message));
+
+	author = _message_author (message, message);
+	if (author)
+	    _notmuch_message_set_author (message, author);
+
+	if (excluded)
+	    notmuch_message_set_flag (message,
+				      NOTMUCH_MESSAGE_FLAG_EXCLUDED, TRUE);
+
+	if (g_hash_table_lookup_extended (
+		thread->matched_doc_ids,
+		GUINT_TO_POINTER (_notmuch_message_get_doc_id (message)),
+		NULL, NULL))
+	    notmuch_message_set_flag (message, NOTMUCH_MESSAGE_FLAG_MATCH, 1);
+
+	_notmuch_message_close (message);
+    }
+
+    notmuch_query_destroy (query);
+
+    _resolve_thread_relationships (thread);
+}
+
+/* Append 'sep' and the hex encoding of 'field' to 'record'.  Returns
+ * the new record, or NULL (freeing nothing) on out-of-memory. */
+static char *
+_summary_append_field (void *ctx, char *record, const char *sep,
+		       const char *field, char **buf, size_t *buf_size)
+{
+    if (record == NULL ||
+	hex_encode (ctx, field ? field : "", buf, buf_size) != HEX_SUCCESS)
+	return NULL;
+
+    return talloc_asprintf_append_buffer (record, "%s%s", sep, *buf);
+}
+
+notmuch_status_t
+_notmuch_thread_write_summary (notmuch_database_t *notmuch,
+			       const char *thread_id)
+{
+    void *local = talloc_new (NULL);
+    Xapian::WritableDatabase *db;
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+    notmuch_message_t *message;
+    notmuch_status_t status;
+    char *record, *encoded = NULL;
+    size_t encoded_size = 0;
+    unsigned int count = 0;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	goto DONE;
+
+    query = talloc_steal (local, notmuch_query_create (
+			      notmuch,
+			      talloc_asprintf (local, "thread:%s", thread_id)));
+    if (unlikely (query == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+    notmuch_query_set_sort (query, NOTMUCH_SORT_OLDEST_FIRST);
+
+    status = notmuch_query_search_messages_st (query, &messages);
+    if (status)
+	goto DONE;
+
+    record = talloc_strdup (local, NOTMUCH_THREAD_SUMMARY_VERSION "\n");
+
+    for (;
+	 notmuch_messages_valid (messages) && record;
+	 notmuch_messages_move_to_next (messages))
+    {
+	const char *subject;
+	char *author;
+	notmuch_tags_t *tags;
+	notmuch_bool_t first_tag = TRUE;
+
+	message = notmuch_messages_get (messages);
+
+	if (record)
+	    record = talloc_asprintf_append_buffer (
+		record, "%u %ld", _notmuch_message_get_doc_id (message),
+		(long) notmuch_message_get_date (message));
+
+	record = _summary_append_field (local, record, " ",
+					notmuch_message_get_message_id (message),
+					&encoded, &encoded_size);
+
+	author = _message_author (local, message);
+	record = _summary_append_field (local, record, " ", author,
+					&encoded, &encoded_size);
+	talloc_free (author);
+
+	subject = notmuch_message_get_header (message, "subject");
+	record = _summary_append_field (local, record, " ", subject,
+					&encoded, &encoded_size);
+
+	if (record)
+	    record = talloc_strdup_append_buffer (record, " ");
+
+	for (tags = notmuch_message_get_tags (message);
+	     notmuch_tags_valid (tags);
+	     notmuch_tags_move_to_next (tags))
+	{
+	    record = _summary_append_field (local, record,
+					    first_tag ? "" : "/",
+					    notmuch_tags_get (tags),
+					    &encoded, &encoded_size);
+	    first_tag = FALSE;
+	}
+
+	if (record)
+	    record = talloc_strdup_append_buffer (record, "\n");
+
+	notmuch_message_destroy (message);
+	count++;
+    }
+
+    if (unlikely (record == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    try {
+	db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+	db->set_metadata (
+	    std::string (NOTMUCH_METADATA_THREAD_SUMMARY_PREFIX) + thread_id,
+	    count ? record : "");
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred writing a thread summary: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    talloc_free (local);
+    return status;
+}
+
+/* Create a new notmuch_thread_t object by finding the thread
+ * containing the message with the given doc ID, treating any messages
+ * contained in match_set as "matched".  Remove all messages in the
+ * thread from match_set.
+ *
+ * Creating the thread will perform a database search to get all
+ * messages belonging to the thread and will get the first subject
+ * line, the total count of messages, and all authors in the thread.
+ * Each message in the thread is checked against match_set to allow
+ * for a separate count of matched messages, and to allow a viewer to
+ * display these messages differently.
+ *
+ * If 'summary_only' is TRUE, the caller only needs the summary of the
+ * thread, so it is built without creating the messages when its
+ * summary record is missing (see _notmuch_thread_create_from_values).
+ *
+ * Here, 'ctx' is talloc context for the resulting thread object.
+ *
+ * This function returns NULL in the case of any error.
+ */
+notmuch_thread_t *
+_notmuch_thread_create (void *ctx,
+			notmuch_database_t *notmuch,
+			unsigned int seed_doc_id,
+			notmuch_doc_id_set_t *match_set,
+			notmuch_string_list_t *exclude_terms,
+			notmuch_exclude_t omit_excluded,
+			notmuch_sort_t sort,
+			notmuch_bool_t summary_only)
+{
+    void *local = talloc_new (ctx);
+    notmuch_thread_t *thread = NULL;
+    notmuch_message_t *seed_message;
+    const char *thread_id;
+    char *record, *thread_id_query_string;
+    notmuch_query_t *thread_id_query;
+    notmuch_tag_set_t *exclude_tags;
+
+    notmuch_messages_t *messages;
+    notmuch_message_t *message;
+    notmuch_status_t status;
+
+    NOTMUCH_TRACE1 (thread_start, seed_doc_id);
+
+    exclude_tags = _exclude_tag_set (local, notmuch, exclude_terms);
+    if (unlikely (exclude_tags == NULL))
+	goto DONE;
+
+    seed_message = _notmuch_message_create (local, notmuch, seed_doc_id, NULL);
+    if (! seed_message)
+	INTERNAL_ERROR ("Thread seed message %u does not exist", seed_doc_id);
+
+    thread_id = notmuch_message_get_thread_id (seed_message);
+
+    record = _notmuch_thread_get_summary (local, notmuch, thread_id);
+    if (record) {
+	thread = _notmuch_thread_create_from_summary (local, notmuch,
+						      thread_id, record,
+						      match_set,
+						      exclude_tags,
+						      omit_excluded, sort);
+	if (thread)
+	    goto COMMIT;
+    }
+
+    if (summary_only) {
+	thread = _notmuch_thread_create_from_values (local, notmuch,
+						     thread_id, match_set,
+						     exclude_tags,
+						     omit_excluded, sort);
+	if (thread)
+	    goto COMMIT;
+    }
+
+    thread_id_query_string = talloc_asprintf (local, "thread:%s", thread_id);
+    if (unlikely (thread_id_query_string == NULL))
+	goto DONE;
+
+    thread_id_query = talloc_steal (
+	local, notmuch_query_create (notmuch, thread_id_query_string));
+    if (unlikely (thread_id_query == NULL))
+	goto DONE;
+
+    thread = _notmuch_thread_alloc (local, notmuch, thread_id);
+    if (unlikely (thread == NULL))
+	goto DONE;
+
+    /* We use oldest-first order unconditionally here to obtain the
+     * proper author ordering for the thread. The 'sort' parameter
+     * passed to this function is used only to indicate whether the
+     * oldest or newest subject is desired. */
+    notmuch_query_set_sort (thread_id_query, NOTMUCH_SORT_OLDEST_FIRST);
+
+    status = notmuch_query_search_messages_st (thread_id_query, &messages);
+    if (status) {
+	thread = NULL;
+	goto DONE;
+    }
+
+    for (;
+	 notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
+    {
+	message = notmuch_messages_get (messages);
+	if (_notmuch_message_get_doc_id (message) == seed_doc_id)
+	    message = seed_message;
+
+	_thread_add_query_message (thread, message, match_set,
+				   exclude_tags, omit_excluded, sort);
+    }
+
+    _notmuch_thread_finish (thread);
+
+  COMMIT:
+    /* Commit to returning thread. */
+    (void) talloc_steal (ctx, thread);
+
+  DONE:
+    talloc_free (local);
+    NOTMUCH_TRACE2 (thread_done, thread ? thread->thread_id : NULL,
+		    thread ? thread->total_messages : 0);
+    return thread;
+}
+
+/* Create 'count' notmuch_thread_t objects at once, one for each of
+ * the distinct thread IDs in 'thread_ids', storing them in the same
+ * order in 'threads_out'.
+ *
+ * This is equivalent to calling _notmuch_thread_create for each
+ * thread in turn, but uses a single database query for all of the
+ * threads, so that the cost is dominated by one posting list merge
+ * rather than by setting up one query per thread.  'summary_only'
+ * is as for _notmuch_thread_create.
+ *
+ * Here, 'ctx' is talloc context for the resulting thread objects.
+ *
+ * Returns NOTMUCH_STATUS_SUCCESS, or an error status in which case
+ * no threads are returned.
+ */
+notmuch_status_t
+_notmuch_thread_create_batch (void *ctx,
+			      notmuch_database_t *notmuch,
+			      unsigned int count,
+			      const char **thread_ids,
+			      notmuch_doc_id_set_t *match_set,
+			      notmuch_string_list_t *exclude_terms,
+			      notmuch_exclude_t omit_excluded,
+			      notmuch_sort_t sort,
+			      notmuch_bool_t summary_only,
+			      notmuch_thread_t **threads_out)
+{
+    void *local = talloc_new (ctx);
+    GHashTable *by_id = NULL;
+    char *query_string;
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+    notmuch_message_t *message;
+    notmuch_thread_t *thread;
+    notmuch_tag_set_t *exclude_tags;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+	threads_out[i] = NULL;
+
+    exclude_tags = _exclude_tag_set (local, notmuch, exclude_terms);
+    if (unlikely (exclude_tags == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    by_id = g_hash_table_new (g_str_hash, g_str_equal);
+
+    /* "thread" is a boolean prefix, so the query parser ORs these
+     * terms together.  Threads with a summary record, or built from
+     * the value streams, don't need to be part of the query at all. */
+    query_string = talloc_strdup (local, "");
+    for (i = 0; i < count && query_string; i++) {
+	char *record = _notmuch_thread_get_summary (local, notmuch,
+						    thread_ids[i]);
+	if (record) {
+	    threads_out[i] = _notmuch_thread_create_from_summary (
+		local, notmuch, thread_ids[i], record, match_set,
+		exclude_tags, omit_excluded, sort);
+	    if (threads_out[i])
+		continue;
+	}
+
+	if (summary_only) {
+	    threads_out[i] = _notmuch_thread_create_from_values (
+		local, notmuch, thread_ids[i], match_set,
+		exclude_tags, omit_excluded, sort);
+	    if (threads_out[i])
+		continue;
+	}
+
+	threads_out[i] = _notmuch_thread_alloc (local, notmuch, thread_ids[i]);
+	if (unlikely (threads_out[i] == NULL)) {
+	    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    goto DONE;
+	}
+	g_hash_table_insert (by_id, threads_out[i]->thread_id, threads_out[i]);
+
+	query_string = talloc_asprintf_append_buffer (
+	    query_string, "%sthread:%s", *query_string ? " " : "",
+	    thread_ids[i]);
+    }
+    if (unlikely (query_string == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    if (g_hash_table_size (by_id) == 0)
+	goto COMMIT;
+
+    query = talloc_steal (local, notmuch_query_create (notmuch, query_string));
+    if (unlikely (query == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    /* As in _notmuch_thread_create, oldest-first order gives the
+     * proper author ordering within each thread. */
+    notmuch_query_set_sort (query, NOTMUCH_SORT_OLDEST_FIRST);
+
+    status = notmuch_query_search_messages_st (query, &messages);
+    if (status)
+	goto DONE;
+
+    for (;
+	 notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
+    {
+	message = notmuch_messages_get (messages);
+
+	thread = (notmuch_thread_t *) g_hash_table_lookup (
+	    by_id, notmuch_message_get_thread_id (message));
+	if (unlikely (thread == NULL)) {
+	    notmuch_message_destroy (message);
+	    continue;
+	}
+
+	_thread_add_query_message (thread, message, match_set,
+				   exclude_tags, omit_excluded, sort);
+    }
+
+    for (i = 0; i < count; i++) {
+	if (! threads_out[i]->messages_pending)
+	    _notmuch_thread_finish (threads_out[i]);
+    }
+
+  COMMIT:
+    for (i = 0; i < count; i++)
+	(void) talloc_steal (ctx, threads_out[i]);
+
+  DONE:
+    if (status) {
+	for (i = 0; i < count; i++)
+	    threads_out[i] = NULL;
+    }
+
+    if (by_id)
+	g_hash_table_unref (by_id);
+    talloc_free (local);
+    return status;
+}
+
+notmuch_messages_t *
+notmuch_thread_get_toplevel_messages (notmuch_thread_t *thread)
+{
+    _thread_ensure_messages (thread);
+
+    return _notmuch_messages_create (thread->toplevel_list);
+}
+
+notmuch_messages_t *
+notmuch_thread_get_messages (notmuch_thread_t *thread)
+{
+    _thread_ensure_messages (thread);
+
+    return _notmuch_messages_create (thread->message_list);
+}
+
+notmuch_messages_t *
+notmuch_thread_get_messages_window (notmuch_thread_t *thread,
+				    unsigned int offset, int limit)
+{
+    notmuch_message_list_t *window;
+    notmuch_messages_t **stack;
+    unsigned int depth = 0, size = 16, position = 0;
+
+    _thread_ensure_messages (thread);
+
+    window = _notmuch_message_list_create (thread);
+    stack = talloc_array (thread, notmuch_messages_t *, size);
+    if (unlikely (window == NULL || stack == NULL))
+	goto DONE;
+
+    /* Walk the tree depth first, as notmuch show does, with a stack
+     * of the replies still to visit at each level rather than by
+     * recursion, since a thread can be a chain of thousands. */
+    stack[depth++] = _notmuch_messages_create (thread->toplevel_list);
+
+    while (depth && (limit < 0 || position < offset + limit)) {
+	notmuch_messages_t *level = stack[depth - 1];
+	notmuch_message_t *message;
+	notmuch_messages_t *replies;
+
+	if (! notmuch_messages_valid (level)) {
+	    notmuch_messages_destroy (level);
+	    depth--;
+	    continue;
+	}
+
+	message = notmuch_messages_get (level);
+	notmuch_messages_move_to_next (level);
+
+	if (position++ >= offset)
+	    _notmuch_message_list_add_message (window, message);
+
+	replies = notmuch_message_get_replies (message);
+	if (replies == NULL)
+	    continue;
+
+	if (depth == size) {
+	    notmuch_messages_t **grown;
+
+	    grown = talloc_realloc (thread, stack, notmuch_messages_t *,
+				    2 * size);
+	    if (unlikely (grown == NULL)) {
+		notmuch_messages_destroy (replies);
+		break;
+	    }
+	    stack = grown;
+	    size *= 2;
+	}
+	stack[depth++] = replies;
+    }
+
+    while (depth)
+	notmuch_messages_destroy (stack[--depth]);
+
+  DONE:
+    talloc_free (stack);
+    return window ? _notmuch_messages_create (window) : NULL;
+}
+
+const char *
+notmuch_thread_get_thread_id (notmuch_thread_t *thread)
+{
+    return thread->thread_id;
+}
+
+int
+notmuch_thread_get_total_messages (notmuch_thread_t *thread)
+{
+    return thread->total_messages;
+}
+
+int
+notmuch_thread_get_matched_messages (notmuch_thread_t *thread)
+{
+    return thread->matched_messages;
+}
 
 const char *
 notmuch_thread_get_authors (notmuch_thread_t *thread)
 {
-    return thread->authors;
+    return thread->authors_string;
 }
 
 const char *
@@ -584,6 +1684,32 @@ notmuch_thread_get_subject (notmuch_thread_t *thread)
     return thread->subject;
 }
 
+/* The snippet is read from the document on first use, so that
+ * threads whose snippet nobody asks for cost nothing more. */
+const char *
+notmuch_thread_get_snippet (notmuch_thread_t *thread)
+{
+    if (thread->snippet)
+	return thread->snippet;
+
+    if (thread->snippet_doc_id) {
+	try {
+	    Xapian::Document doc =
+		thread->notmuch->xapian_db->get_document (thread->snippet_doc_id);
+
+	    thread->snippet = talloc_strdup (
+		thread, doc.get_value (NOTMUCH_VALUE_SNIPPET).c_str ());
+	} catch (const Xapian::Error &error) {
+	    /* Like a message without a snippet. */
+	}
+    }
+
+    if (thread->snippet == NULL)
+	thread->snippet = talloc_strdup (thread, "");
+
+    return thread->snippet;
+}
+
 time_t
 notmuch_thread_get_oldest_date (notmuch_thread_t *thread)
 {
@@ -600,21 +1726,12 @@ notmuch_tags_t *
 notmuch_thread_get_tags (notmuch_thread_t *thread)
 {
     notmuch_string_list_t *tags;
-    GList *keys, *l;
 
-    tags = _notmuch_string_list_create (thread);
+    tags = _notmuch_tag_set_to_string_list (thread, thread->notmuch,
+					    thread->tags);
     if (unlikely (tags == NULL))
 	return NULL;
 
-    keys = g_hash_table_get_keys (thread->tags);
-
-    for (l = keys; l; l = l->next)
-	_notmuch_string_list_append (tags, (char *) l->data);
-
-    g_list_free (keys);
-
-    _notmuch_string_list_sort (tags);
-
     return _notmuch_tags_create (thread, tags);
 }
 
@@ -0,0 +1,195 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+/* Where the memory of a notmuch process goes, reported on stderr with
+ * --memstats or NOTMUCH_MEMSTATS: at exit, and on SIGUSR1 when a long
+ * running command next calls notmuch_memstats_poll.
+ *
+ * talloc memory is attributed to the nearest enclosing object of the
+ * kinds below, so that e.g. the strings of a message count towards
+ * the messages, and a message of a thread towards the messages rather
+ * than the threads.  What the heap holds besides that is Xapian's,
+ * GMime's and GLib's. */
+
+#include "notmuch-client.h"
+
+#include <sys/resource.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static const struct {
+    const char *type;
+    const char *name;
+} memstats_kinds[] = {
+    { "notmuch_database_t", "database" },
+    { "notmuch_query_t", "queries" },
+    { "notmuch_thread_t", "threads" },
+    { "notmuch_message_t", "messages" },
+    { "mime_node_t", "MIME parts" },
+    { "notmuch_config_t", "configuration" },
+};
+
+/* The last entry is for memory outside all of the kinds. */
+#define MEMSTATS_OTHER ARRAY_SIZE (memstats_kinds)
+
+typedef struct {
+    size_t bytes[MEMSTATS_OTHER + 1];
+    size_t objects[MEMSTATS_OTHER + 1];
+    size_t blocks;
+
+    /* The kind of each enclosing block, by depth.  Allocated with
+     * malloc, so as not to change what is being counted. */
+    unsigned int *kind_at_depth;
+    int max_depth;
+} memstats_totals_t;
+
+static notmuch_bool_t memstats_enabled = FALSE;
+static volatile sig_atomic_t memstats_requested = 0;
+
+static void
+handle_sigusr1 (unused (int signal))
+{
+    memstats_requested = 1;
+}
+
+static void
+_memstats_count (const void *ptr, int depth, unused (int max_depth),
+		 int is_ref, void *closure)
+{
+    memstats_totals_t *totals = closure;
+    const char *type;
+    unsigned int kind, i;
+
+    if (is_ref)
+	return;
+
+    if (depth >= totals->max_depth) {
+	int max_depth = totals->max_depth ? 2 * totals->max_depth : 64;
+	unsigned int *kinds = realloc (totals->kind_at_depth,
+				       max_depth * sizeof (unsigned int));
+
+	if (kinds == NULL)
+	    return;
+	totals->kind_at_depth = kinds;
+	totals->max_depth = max_depth;
+    }
+
+    kind = depth ? totals->kind_at_depth[depth - 1] : MEMSTATS_OTHER;
+    type = talloc_get_name (ptr);
+    for (i = 0; i < ARRAY_SIZE (memstats_kinds); i++) {
+	if (strcmp (type, memstats_kinds[i].type) == 0) {
+	    kind = i;
+	    totals->objects[kind]++;
+	    break;
+	}
+    }
+    totals->kind_at_depth[depth] = kind;
+
+    totals->bytes[kind] += talloc_get_size (ptr);
+    totals->blocks++;
+}
+
+void
+notmuch_memstats_print (FILE *stream)
+{
+    memstats_totals_t totals;
+    struct rusage usage;
+    const char *threshold;
+    unsigned int i;
+
+    memset (&totals, 0, sizeof (totals));
+
+    if (getrusage (RUSAGE_SELF, &usage) == 0)
+	fprintf (stream, "memstats: peak RSS %ld kB\n", usage.ru_maxrss);
+
+#ifdef __GLIBC__
+    {
+#if __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 info = mallinfo2 ();
+#else
+	struct mallinfo info = mallinfo ();
+#endif
+	fprintf (stream, "memstats: malloc heap %lu kB in use, %lu kB mapped\n",
+		 (unsigned long) (info.uordblks + info.hblkhd) / 1024,
+		 (unsigned long) (info.arena + info.hblkhd) / 1024);
+    }
+#endif
+
+    /* Walking the talloc tree needs its null context, which is gone
+     * once a command has disabled null tracking to use threads. */
+    if (talloc_total_blocks (NULL) <= 1) {
+	fprintf (stream, "memstats: talloc not tracked\n");
+    } else {
+	talloc_report_depth_cb (NULL, 0, -1, _memstats_count, &totals);
+	free (totals.kind_at_depth);
+
+	fprintf (stream, "memstats: talloc %lu kB in %lu blocks\n",
+		 (unsigned long) talloc_total_size (NULL) / 1024,
+		 (unsigned long) totals.blocks);
+	for (i = 0; i < ARRAY_SIZE (memstats_kinds); i++) {
+	    if (totals.objects[i] == 0)
+		continue;
+	    fprintf (stream, "memstats:   %-14s %lu kB in %lu objects\n",
+		     memstats_kinds[i].name,
+		     (unsigned long) totals.bytes[i] / 1024,
+		     (unsigned long) totals.objects[i]);
+	}
+	fprintf (stream, "memstats:   %-14s %lu kB\n", "other",
+		 (unsigned long) totals.bytes[MEMSTATS_OTHER] / 1024);
+    }
+
+    /* Xapian holds this many changed documents in memory before
+     * writing them out, unless the change is committed first. */
+    threshold = getenv ("XAPIAN_FLUSH_THRESHOLD");
+    fprintf (stream, "memstats: Xapian flush threshold %s documents%s\n",
+	     threshold && *threshold ? threshold : "10000",
+	     threshold && *threshold ? " (from XAPIAN_FLUSH_THRESHOLD)" : "");
+}
+
+void
+notmuch_memstats_enable (void)
+{
+    struct sigaction action;
+
+    if (memstats_enabled)
+	return;
+    memstats_enabled = TRUE;
+
+    memset (&action, 0, sizeof (struct sigaction));
+    action.sa_handler = handle_sigusr1;
+    sigemptyset (&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction (SIGUSR1, &action, NULL);
+}
+
+notmuch_bool_t
+notmuch_memstats_is_enabled (void)
+{
+    return memstats_enabled;
+}
+
+void
+notmuch_memstats_poll (void)
+{
+    if (! memstats_requested)
+	return;
+
+    memstats_requested = 0;
+    notmuch_memstats_print (stderr);
+}
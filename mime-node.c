@@ -22,6 +22,19 @@
  */
 
 #include "notmuch-client.h"
+#include "gmime-extra.h"
+#include "mbox-util.h"
+
+/* The outcome of verifying or decrypting one part, kept by
+ * mime_node_prepare_crypto. */
+typedef struct mime_node_crypto_result {
+    GMimeObject *part;
+    notmuch_bool_t decrypt_attempted;
+    notmuch_bool_t decrypt_success;
+    notmuch_bool_t verify_attempted;
+    GMimeSignatureList *sig_list;
+    GMimeObject *decrypted_child;
+} mime_node_crypto_result_t;
 
 /* Context that gets inherited from the root node. */
 typedef struct mime_node_context {
@@ -34,11 +47,26 @@ typedef struct mime_node_context {
 
     /* Context provided by the caller. */
     notmuch_crypto_t *crypto;
+
+    /* The results of mime_node_prepare_crypto, and whether it is
+     * running. */
+    mime_node_crypto_result_t *crypto_results;
+    size_t num_crypto_results;
+    notmuch_bool_t preparing;
 } mime_node_context_t;
 
 static int
 _mime_node_context_free (mime_node_context_t *res)
 {
+    size_t i;
+
+    for (i = 0; i < res->num_crypto_results; i++) {
+	if (res->crypto_results[i].sig_list)
+	    g_object_unref (res->crypto_results[i].sig_list);
+	if (res->crypto_results[i].decrypted_child)
+	    g_object_unref (res->crypto_results[i].decrypted_child);
+    }
+
     if (res->mime_message)
 	g_object_unref (res->mime_message);
 
@@ -79,20 +107,19 @@ mime_node_open (const void *ctx, notmuch_message_t *message,
     }
     talloc_set_destructor (mctx, _mime_node_context_free);
 
-    mctx->file = fopen (filename, "r");
+    mctx->file = mbox_member_fopen (filename);
     if (! mctx->file) {
 	fprintf (stderr, "Error opening %s: %s\n", filename, strerror (errno));
 	status = NOTMUCH_STATUS_FILE_ERROR;
 	goto DONE;
     }
 
-    mctx->stream = g_mime_stream_file_new (mctx->file);
+    mctx->stream = gmime_stream_for_file (mctx->file);
     if (!mctx->stream) {
 	fprintf (stderr, "Out of memory.\n");
 	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
 	goto DONE;
     }
-    g_mime_stream_file_set_owner (GMIME_STREAM_FILE (mctx->stream), FALSE);
 
     mctx->parser = g_mime_parser_new_with_stream (mctx->stream);
     if (!mctx->parser) {
@@ -154,17 +181,28 @@ node_verify (mime_node_t *node, GMimeObject *part,
 	     notmuch_crypto_context_t *cryptoctx)
 {
     GError *err = NULL;
+    char *key;
 
     node->verify_attempted = TRUE;
+    node->sig_list = notmuch_crypto_lookup_signatures (node->ctx->crypto,
+						       part, &key);
+    if (node->sig_list) {
+	set_signature_list_destructor (node);
+	return;
+    }
+
     node->sig_list = g_mime_multipart_signed_verify
 	(GMIME_MULTIPART_SIGNED (part), cryptoctx, &err);
 
-    if (node->sig_list)
+    if (node->sig_list) {
 	set_signature_list_destructor (node);
-    else
+	notmuch_crypto_save_signatures (node->ctx->crypto, key, node->sig_list);
+    } else {
 	fprintf (stderr, "Failed to verify signed part: %s\n",
 		 err ? err->message : "no error explanation given");
+    }
 
+    g_free (key);
     if (err)
 	g_error_free (err);
 }
@@ -203,6 +241,60 @@ node_decrypt_and_verify (mime_node_t *node, GMimeObject *part,
 	g_error_free (err);
 }
 
+/* If mime_node_prepare_crypto already verified or decrypted 'part',
+ * give 'node' the results and return TRUE. */
+static notmuch_bool_t
+_mime_node_restore_crypto (mime_node_t *node, GMimeObject *part)
+{
+    mime_node_context_t *mctx = node->ctx;
+    mime_node_crypto_result_t *result;
+    size_t i;
+
+    for (i = 0; i < mctx->num_crypto_results; i++) {
+	result = &mctx->crypto_results[i];
+	if (result->part != part)
+	    continue;
+
+	node->decrypt_attempted = result->decrypt_attempted;
+	node->decrypt_success = result->decrypt_success;
+	node->verify_attempted = result->verify_attempted;
+	/* The context keeps the decrypted part alive. */
+	node->decrypted_child = result->decrypted_child;
+	if (result->sig_list) {
+	    node->sig_list = g_object_ref (result->sig_list);
+	    set_signature_list_destructor (node);
+	}
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Keep the results of verifying or decrypting the part of 'node' in
+ * its context, for _mime_node_restore_crypto. */
+static void
+_mime_node_save_crypto (mime_node_t *node)
+{
+    mime_node_context_t *mctx = node->ctx;
+    mime_node_crypto_result_t *results, *result;
+
+    results = talloc_realloc (mctx, mctx->crypto_results,
+			      mime_node_crypto_result_t,
+			      mctx->num_crypto_results + 1);
+    if (results == NULL)
+	return;
+    mctx->crypto_results = results;
+
+    result = &results[mctx->num_crypto_results++];
+    result->part = node->part;
+    result->decrypt_attempted = node->decrypt_attempted;
+    result->decrypt_success = node->decrypt_success;
+    result->verify_attempted = node->verify_attempted;
+    result->sig_list = node->sig_list ? g_object_ref (node->sig_list) : NULL;
+    /* Take over the reference node_decrypt_and_verify got. */
+    result->decrypted_child = node->decrypted_child;
+}
+
 static mime_node_t *
 _mime_node_create (mime_node_t *parent, GMimeObject *part)
 {
@@ -240,6 +332,9 @@ _mime_node_create (mime_node_t *parent, GMimeObject *part)
 	return NULL;
     }
 
+    if (_mime_node_restore_crypto (node, part))
+	return node;
+
     if ((GMIME_IS_MULTIPART_ENCRYPTED (part) && node->ctx->crypto->decrypt)
 	|| (GMIME_IS_MULTIPART_SIGNED (part) && node->ctx->crypto->verify)) {
 	GMimeContentType *content_type = g_mime_object_get_content_type (part);
@@ -268,6 +363,10 @@ _mime_node_create (mime_node_t *parent, GMimeObject *part)
 	}
     }
 
+    if (node->ctx->preparing &&
+	(node->decrypt_attempted || node->verify_attempted))
+	_mime_node_save_crypto (node);
+
     return node;
 }
 
@@ -345,3 +444,37 @@ mime_node_seek_dfs (mime_node_t *node, int n)
 	return NULL;
     return _mime_node_seek_dfs_walk (node, &n);
 }
+
+static void
+_mime_node_prepare_walk (mime_node_t *node)
+{
+    int i;
+
+    for (i = 0; i < node->nchildren; i++) {
+	mime_node_t *child = mime_node_child (node, i);
+
+	if (child) {
+	    _mime_node_prepare_walk (child);
+	    talloc_free (child);
+	}
+    }
+}
+
+void
+mime_node_prepare_crypto (mime_node_t *root, notmuch_crypto_t *crypto)
+{
+    mime_node_context_t *mctx = root->ctx;
+    notmuch_crypto_t *tree_crypto = mctx->crypto;
+    int next_child = root->next_child;
+    int next_part_num = root->next_part_num;
+
+    mctx->crypto = crypto;
+    mctx->preparing = TRUE;
+    _mime_node_prepare_walk (root);
+    mctx->preparing = FALSE;
+    mctx->crypto = tree_crypto;
+
+    /* Leave the depth-first numbering for the real traversal. */
+    root->next_child = next_child;
+    root->next_part_num = next_part_num;
+}
@@ -70,12 +70,16 @@ typedef struct notmuch_show_format {
 			      const struct notmuch_show_params *params);
 } notmuch_show_format_t;
 
+typedef struct notmuch_signature_cache notmuch_signature_cache_t;
+
 typedef struct notmuch_crypto {
     notmuch_crypto_context_t* gpgctx;
     notmuch_crypto_context_t* pkcs7ctx;
     notmuch_bool_t verify;
     notmuch_bool_t decrypt;
     const char *gpgpath;
+    /* Good signature verifications from earlier runs, or NULL. */
+    notmuch_signature_cache_t *sigcache;
 } notmuch_crypto_t;
 
 typedef struct notmuch_show_params {
@@ -86,6 +90,19 @@ typedef struct notmuch_show_params {
     int part;
     notmuch_crypto_t crypto;
     notmuch_bool_t include_html;
+    /* The number of threads verifying and decrypting the messages of
+     * a thread at once. */
+    int jobs;
+    /* The window of each thread's messages, in thread order, to show:
+     * others are printed as if they did not match.  A negative limit
+     * shows all the rest. */
+    int message_offset;
+    int message_limit;
+    /* Internal: the position in thread order of the next message. */
+    int message_position;
+    /* Internal: the MIME trees of the thread being shown, if they
+     * were opened ahead of time, or NULL. */
+    struct show_prepared_thread *prepared;
 } notmuch_show_params_t;
 
 /* There's no point in continuing when we've detected that we've done
@@ -173,6 +190,25 @@ notmuch_crypto_get_context (notmuch_crypto_t *crypto, const char *protocol);
 int
 notmuch_crypto_cleanup (notmuch_crypto_t *crypto);
 
+/* Load the cache of signature verifications kept in the file 'path',
+ * which need not exist yet. */
+notmuch_signature_cache_t *
+notmuch_signature_cache_open (const void *ctx, const char *path);
+
+/* Return a new reference to the cached signatures of the
+ * multipart/signed 'part', or NULL if they have to be verified.  In
+ * that case *key is set to the key to save the outcome under, to be
+ * freed with g_free, or NULL if there is no cache. */
+GMimeSignatureList *
+notmuch_crypto_lookup_signatures (notmuch_crypto_t *crypto,
+				  GMimeObject *part, char **key);
+
+/* Remember 'list' as the signatures of the part with 'key', if they
+ * are all good. */
+void
+notmuch_crypto_save_signatures (notmuch_crypto_t *crypto, const char *key,
+				GMimeSignatureList *list);
+
 int
 notmuch_count_command (notmuch_config_t *config, int argc, char *argv[]);
 
@@ -185,6 +221,9 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[]);
 int
 notmuch_insert_command (notmuch_config_t *config, int argc, char *argv[]);
 
+int
+notmuch_watch_command (notmuch_config_t *config, int argc, char *argv[]);
+
 int
 notmuch_reply_command (notmuch_config_t *config, int argc, char *argv[]);
 
@@ -212,6 +251,42 @@ notmuch_config_command (notmuch_config_t *config, int argc, char *argv[]);
 int
 notmuch_compact_command (notmuch_config_t *config, int argc, char *argv[]);
 
+int
+notmuch_index_pending_command (notmuch_config_t *config, int argc, char *argv[]);
+
+int
+notmuch_index_attachments_command (notmuch_config_t *config, int argc, char *argv[]);
+
+int
+notmuch_roll_archive_command (notmuch_config_t *config, int argc, char *argv[]);
+
+int
+notmuch_server_command (notmuch_config_t *config, int argc, char *argv[]);
+
+int
+notmuch_replicate_command (notmuch_config_t *config, int argc, char *argv[]);
+
+int
+notmuch_stats_command (notmuch_config_t *config, int argc, char *argv[]);
+
+/* notmuch-server.c */
+
+/* If a notmuch server is running for the database of 'config' and
+ * serves the command in 'argv', run it there and return its exit
+ * status.  Otherwise return -1. */
+int
+notmuch_server_forward (notmuch_config_t *config, int argc, char *argv[]);
+
+/* Open the database at 'path' for a command, as
+ * notmuch_database_open_verbose does (or notmuch_database_open, if
+ * 'status_string' is NULL).  In a command run by notmuch server, a
+ * read-only database is the server's, which is already open. */
+notmuch_status_t
+notmuch_cli_database_open (const char *path,
+			   notmuch_database_mode_t mode,
+			   notmuch_database_t **notmuch,
+			   char **status_string);
+
 const char *
 notmuch_time_relative_date (const void *ctx, time_t then);
 
@@ -221,6 +296,13 @@ notmuch_time_print_formatted_seconds (double seconds);
 double
 notmuch_time_elapsed (struct timeval start, struct timeval end);
 
+double
+notmuch_time_clock (clockid_t clock);
+
+void
+notmuch_time_print_phase (FILE *stream, const char *name,
+			  const notmuch_profile_phase_t *phase);
+
 char *
 query_string_from_args (void *ctx, int argc, char *argv[]);
 
@@ -320,6 +402,28 @@ notmuch_config_set_new_ignore (notmuch_config_t *config,
 			       const char *new_ignore[],
 			       size_t length);
 
+int
+notmuch_config_get_new_batch_size (notmuch_config_t *config);
+
+int
+notmuch_config_get_new_snippet_length (notmuch_config_t *config);
+
+int
+notmuch_config_get_new_flush_budget (notmuch_config_t *config);
+
+notmuch_bool_t
+notmuch_config_get_new_manifests (notmuch_config_t *config);
+
+notmuch_bool_t
+notmuch_config_get_new_mbox (notmuch_config_t *config);
+
+const char **
+notmuch_config_get_new_headers (notmuch_config_t *config,
+				size_t *length);
+
+const char *
+notmuch_config_get_new_rules (notmuch_config_t *config);
+
 notmuch_bool_t
 notmuch_config_get_maildir_synchronize_flags (notmuch_config_t *config);
 
@@ -330,6 +434,34 @@ notmuch_config_set_maildir_synchronize_flags (notmuch_config_t *config,
 const char **
 notmuch_config_get_search_exclude_tags (notmuch_config_t *config, size_t *length);
 
+notmuch_bool_t
+notmuch_config_get_search_cache_counts (notmuch_config_t *config);
+
+notmuch_bool_t
+notmuch_config_get_search_cache_excludes (notmuch_config_t *config);
+
+notmuch_bool_t
+notmuch_config_get_crypto_cache_signatures (notmuch_config_t *config);
+
+notmuch_bool_t
+notmuch_config_get_index_body_positions (notmuch_config_t *config);
+
+const char *
+notmuch_config_get_index_extractor (notmuch_config_t *config);
+
+const char **
+notmuch_config_get_index_extract_types (notmuch_config_t *config,
+					size_t *length);
+
+int
+notmuch_config_get_index_extract_timeout (notmuch_config_t *config);
+
+notmuch_bool_t
+notmuch_config_get_tag_journal (notmuch_config_t *config);
+
+int
+notmuch_config_get_replicate_changesets (notmuch_config_t *config);
+
 void
 notmuch_config_set_search_exclude_tags (notmuch_config_t *config,
 				      const char *list[],
@@ -338,9 +470,33 @@ notmuch_config_set_search_exclude_tags (notmuch_config_t *config,
 int
 notmuch_run_hook (const char *db_path, const char *hook);
 
+/* As notmuch_run_hook, with the NAME=value strings of the
+ * NULL-terminated 'env' added to the environment of the hook. */
+int
+notmuch_run_hook_env (const char *db_path, const char *hook,
+		      const char **env);
+
 notmuch_bool_t
 debugger_is_active (void);
 
+/* memstats.c */
+
+void
+notmuch_memstats_enable (void);
+
+notmuch_bool_t
+notmuch_memstats_is_enabled (void);
+
+/* Print where the memory of the process goes to 'stream'. */
+void
+notmuch_memstats_print (FILE *stream);
+
+/* Print the memory statistics to stderr if SIGUSR1 arrived since the
+ * last call.  Long running loops call this at points where the data
+ * structures are consistent. */
+void
+notmuch_memstats_poll (void);
+
 /* mime-node.c */
 
 /* mime_node_t represents a single node in a MIME tree.  A MIME tree
@@ -440,19 +596,47 @@ mime_node_child (mime_node_t *parent, int child);
 mime_node_t *
 mime_node_seek_dfs (mime_node_t *node, int n);
 
+/* Verify and decrypt, with the contexts of crypto rather than those
+ * the tree was opened with, every part of the tree below root that
+ * later traversals would, and keep the results in the tree.  Nodes
+ * created afterwards reuse them instead of calling into GPG again.
+ *
+ * Only the tree of root is touched, so different trees can be
+ * prepared by different threads at once, given that each uses crypto
+ * contexts of its own and root has no talloc parent. */
+void
+mime_node_prepare_crypto (mime_node_t *root, notmuch_crypto_t *crypto);
+
 typedef enum dump_formats {
     DUMP_FORMAT_AUTO,
     DUMP_FORMAT_BATCH_TAG,
-    DUMP_FORMAT_SUP
+    DUMP_FORMAT_SUP,
+    DUMP_FORMAT_BINARY
 } dump_format_t;
 
+/* The first line of a binary dump, which is followed by records made
+ * of varints and strings; see notmuch-dump(1). */
+#define DUMP_BINARY_HEADER "#notmuch-dump-binary 1\n"
+
+enum {
+    DUMP_BINARY_END = 0,	/* end of the dump */
+    DUMP_BINARY_TAG = 1,	/* string: the next tag number */
+    DUMP_BINARY_MESSAGE = 2	/* string, count, count tag numbers */
+};
+
 int
 notmuch_database_dump (notmuch_database_t *notmuch,
 		       const char *output_file_name,
 		       const char *query_str,
 		       dump_format_t output_format,
+		       int since,
 		       notmuch_bool_t gzip_output);
 
+/* The first line of a dump of the changes since a revision, followed
+ * by the database UUID, that revision and the revision dumped up
+ * to. */
+#define DUMP_CHANGES_HEADER "#notmuch-dump-changes"
+
 /* If status is non-zero (i.e. error) print appropriate
    messages to stderr.
 */
@@ -32,12 +32,18 @@ notmuch_compact_command (notmuch_config_t *config, int argc, char *argv[])
     const char *path = notmuch_config_get_database_path (config);
     const char *backup_path = NULL;
     notmuch_status_t ret;
-    notmuch_bool_t quiet = FALSE;
+    notmuch_bool_t quiet = FALSE, online = FALSE;
+    int renumber = NOTMUCH_COMPACT_RENUMBER_NONE;
     int opt_index;
 
     notmuch_opt_desc_t options[] = {
 	{ NOTMUCH_OPT_STRING, &backup_path, "backup", 0, 0 },
 	{ NOTMUCH_OPT_BOOLEAN,  &quiet, "quiet", 'q', 0 },
+	{ NOTMUCH_OPT_BOOLEAN,  &online, "online", 0, 0 },
+	{ NOTMUCH_OPT_KEYWORD, &renumber, "renumber", 0,
+	  (notmuch_keyword_t []){ { "none", NOTMUCH_COMPACT_RENUMBER_NONE },
+				  { "thread", NOTMUCH_COMPACT_RENUMBER_THREAD },
+				  { 0, 0 } } },
 	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
 	{ 0, 0, 0, 0, 0}
     };
@@ -53,10 +59,25 @@ notmuch_compact_command (notmuch_config_t *config, int argc, char *argv[])
 
     notmuch_process_shared_options (argv[0]);
 
+    if (online && renumber != NOTMUCH_COMPACT_RENUMBER_NONE) {
+	fprintf (stderr, "Error: --online and --renumber cannot be combined.\n");
+	return EXIT_FAILURE;
+    }
+
     if (! quiet)
 	printf ("Compacting database...\n");
-    ret = notmuch_database_compact (path, backup_path,
-				    quiet ? NULL : status_update_cb, NULL);
+    if (online)
+	ret = notmuch_database_compact_online (path, backup_path,
+					       quiet ? NULL : status_update_cb,
+					       NULL);
+    else if (renumber != NOTMUCH_COMPACT_RENUMBER_NONE)
+	ret = notmuch_database_compact_renumber (path, backup_path,
+						 (notmuch_compact_renumber_t) renumber,
+						 quiet ? NULL : status_update_cb,
+						 NULL);
+    else
+	ret = notmuch_database_compact (path, backup_path,
+					quiet ? NULL : status_update_cb, NULL);
     if (ret) {
 	fprintf (stderr, "Compaction failed: %s\n", notmuch_status_to_string (ret));
 	return EXIT_FAILURE;
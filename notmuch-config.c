@@ -51,7 +51,30 @@ static const char new_config_comment[] =
     "\n"
     "\t	NOTE: *Every* file/directory that goes by one of those\n"
     "\t	names will be ignored, independent of its depth/location\n"
-    "\t	in the mail store.\n";
+    "\t	in the mail store.\n"
+    "\n"
+    "\tbatch_size	The number of files \"notmuch new\" adds or removes\n"
+    "\t	before committing its changes to the database (default 1).\n"
+    "\n"
+    "\theaders	A list (separated by ';') of headers to record in the\n"
+    "\t	database for new messages, so that they can be shown\n"
+    "\t	without reading the message files.\n"
+    "\n"
+    "\tsnippet_length	The number of characters from the start of the\n"
+    "\t	body to record in the database for new messages, as\n"
+    "\t	a preview for \"notmuch search\" (default 0, none).\n"
+    "\n"
+    "\tflush_budget	The memory in megabytes that \"notmuch new\" lets\n"
+    "\t	unflushed changes take before writing them to disk\n"
+    "\t	(default 0, flush after every 10000 messages).\n"
+    "\n"
+    "\trules	A file of tagging rules, one per line, for the messages\n"
+    "\t	\"notmuch new\" adds, such as\n"
+    "\t		+list -inbox -- list-id:notmuch.notmuchmail.org\n"
+    "\t	A relative path is taken from the database path.\n"
+    "\n"
+    "\tmbox	If true, index the messages of mbox files in place\n"
+    "\t	(default false).\n";
 
 static const char user_config_comment[] =
     " User configuration\n"
@@ -104,10 +127,15 @@ static const char search_config_comment[] =
 static const char crypto_config_comment[] =
     " Cryptography related configuration\n"
     "\n"
-    " The following option is supported here:\n"
+    " The following options are supported here:\n"
     "\n"
     "\tgpg_path\n"
-    "\t\tbinary name or full path to invoke gpg.\n";
+    "\t\tbinary name or full path to invoke gpg.\n"
+    "\n"
+    "\tcache_signatures\n"
+    "\t\tIf true, notmuch show remembers good signature\n"
+    "\t\tverifications, and does not verify the same signed\n"
+    "\t\tpart again.  Valid values are true and false.\n";
 
 struct _notmuch_config {
     char *filename;
@@ -124,9 +152,27 @@ struct _notmuch_config {
     size_t new_tags_length;
     const char **new_ignore;
     size_t new_ignore_length;
+    int new_batch_size;
+    int new_snippet_length;
+    int new_flush_budget;
+    notmuch_bool_t new_manifests;
+    notmuch_bool_t new_mbox;
+    const char **new_headers;
+    size_t new_headers_length;
+    char *new_rules;
     notmuch_bool_t maildir_synchronize_flags;
     const char **search_exclude_tags;
     size_t search_exclude_tags_length;
+    notmuch_bool_t search_cache_counts;
+    notmuch_bool_t search_cache_excludes;
+    notmuch_bool_t crypto_cache_signatures;
+    notmuch_bool_t index_body_positions;
+    char *index_extractor;
+    const char **index_extract_types;
+    size_t index_extract_types_length;
+    int index_extract_timeout;
+    notmuch_bool_t tag_journal;
+    int replicate_changesets;
 };
 
 static int
@@ -284,10 +330,28 @@ notmuch_config_open (void *ctx,
     config->new_tags_length = 0;
     config->new_ignore = NULL;
     config->new_ignore_length = 0;
+    config->new_batch_size = 1;
+    config->new_snippet_length = 0;
+    config->new_flush_budget = 0;
+    config->new_manifests = FALSE;
+    config->new_mbox = FALSE;
+    config->new_headers = NULL;
+    config->new_headers_length = 0;
+    config->new_rules = NULL;
     config->maildir_synchronize_flags = TRUE;
     config->search_exclude_tags = NULL;
     config->search_exclude_tags_length = 0;
+    config->search_cache_counts = FALSE;
+    config->search_cache_excludes = FALSE;
     config->crypto_gpg_path = NULL;
+    config->crypto_cache_signatures = FALSE;
+    config->index_body_positions = TRUE;
+    config->index_extractor = NULL;
+    config->index_extract_types = NULL;
+    config->index_extract_types_length = 0;
+    config->index_extract_timeout = 60;
+    config->tag_journal = FALSE;
+    config->replicate_changesets = 0;
 
     if (! g_key_file_load_from_file (config->key_file,
 				     config->filename,
@@ -399,6 +463,59 @@ notmuch_config_open (void *ctx,
 	notmuch_config_set_new_ignore (config, NULL, 0);
     }
 
+    /* Like search.cache_counts below, batching is opt-in, so no
+     * default is written out. */
+    error = NULL;
+    config->new_batch_size =
+	g_key_file_get_integer (config->key_file,
+				"new", "batch_size", &error);
+    if (error) {
+	config->new_batch_size = 1;
+	g_error_free (error);
+    } else if (config->new_batch_size < 1) {
+	config->new_batch_size = 1;
+    }
+
+    error = NULL;
+    config->new_snippet_length =
+	g_key_file_get_integer (config->key_file,
+				"new", "snippet_length", &error);
+    if (error) {
+	config->new_snippet_length = 0;
+	g_error_free (error);
+    } else if (config->new_snippet_length < 0) {
+	config->new_snippet_length = 0;
+    }
+
+    error = NULL;
+    config->new_flush_budget =
+	g_key_file_get_integer (config->key_file,
+				"new", "flush_budget", &error);
+    if (error) {
+	config->new_flush_budget = 0;
+	g_error_free (error);
+    } else if (config->new_flush_budget < 0) {
+	config->new_flush_budget = 0;
+    }
+
+    error = NULL;
+    config->new_manifests =
+	g_key_file_get_boolean (config->key_file,
+				"new", "manifests", &error);
+    if (error) {
+	config->new_manifests = FALSE;
+	g_error_free (error);
+    }
+
+    error = NULL;
+    config->new_mbox =
+	g_key_file_get_boolean (config->key_file,
+				"new", "mbox", &error);
+    if (error) {
+	config->new_mbox = FALSE;
+	g_error_free (error);
+    }
+
     if (notmuch_config_get_search_exclude_tags (config, &tmp) == NULL) {
 	if (config->is_new) {
 	    const char *tags[] = { "deleted", "spam" };
@@ -417,9 +534,83 @@ notmuch_config_open (void *ctx,
 	g_error_free (error);
     }
 
+    /* Unlike the options above, don't write out a default, since the
+     * count cache is an opt-in optimization. */
+    error = NULL;
+    config->search_cache_counts =
+	g_key_file_get_boolean (config->key_file,
+				"search", "cache_counts", &error);
+    if (error) {
+	config->search_cache_counts = FALSE;
+	g_error_free (error);
+    }
+
+    error = NULL;
+    config->search_cache_excludes =
+	g_key_file_get_boolean (config->key_file,
+				"search", "cache_excludes", &error);
+    if (error) {
+	config->search_cache_excludes = FALSE;
+	g_error_free (error);
+    }
+
     if (notmuch_config_get_crypto_gpg_path (config) == NULL) {
 	notmuch_config_set_crypto_gpg_path (config, "gpg");
     }
+
+    /* The signature cache is opt-in too. */
+    error = NULL;
+    config->crypto_cache_signatures =
+	g_key_file_get_boolean (config->key_file,
+				"crypto", "cache_signatures", &error);
+    if (error) {
+	config->crypto_cache_signatures = FALSE;
+	g_error_free (error);
+    }
+
+    /* Nor a default for body positions, which is a choice recorded
+     * in the database rather than here. */
+    error = NULL;
+    config->index_body_positions =
+	g_key_file_get_boolean (config->key_file,
+				"index", "body_positions", &error);
+    if (error) {
+	config->index_body_positions = TRUE;
+	g_error_free (error);
+    }
+
+    error = NULL;
+    config->index_extract_timeout =
+	g_key_file_get_integer (config->key_file,
+				"index", "extract_timeout", &error);
+    if (error) {
+	config->index_extract_timeout = 60;
+	g_error_free (error);
+    } else if (config->index_extract_timeout < 0) {
+	config->index_extract_timeout = 0;
+    }
+
+    /* The tag journal is opt-in as well. */
+    error = NULL;
+    config->tag_journal =
+	g_key_file_get_boolean (config->key_file,
+				"tag", "journal", &error);
+    if (error) {
+	config->tag_journal = FALSE;
+	g_error_free (error);
+    }
+
+    /* Replication is opt-in too. */
+    error = NULL;
+    config->replicate_changesets =
+	g_key_file_get_integer (config->key_file,
+				"replicate", "changesets", &error);
+    if (error) {
+	config->replicate_changesets = 0;
+	g_error_free (error);
+    } else if (config->replicate_changesets < 0) {
+	config->replicate_changesets = 0;
+    }
     
     /* Whenever we know of configuration sections that don't appear in
      * the configuration file, we add some comments to help the user
@@ -665,6 +856,50 @@ notmuch_config_get_new_ignore (notmuch_config_t *config, size_t *length)
 			     &(config->new_ignore_length), length);
 }
 
+int
+notmuch_config_get_new_batch_size (notmuch_config_t *config)
+{
+    return config->new_batch_size;
+}
+
+int
+notmuch_config_get_new_snippet_length (notmuch_config_t *config)
+{
+    return config->new_snippet_length;
+}
+
+int
+notmuch_config_get_new_flush_budget (notmuch_config_t *config)
+{
+    return config->new_flush_budget;
+}
+
+notmuch_bool_t
+notmuch_config_get_new_manifests (notmuch_config_t *config)
+{
+    return config->new_manifests;
+}
+
+notmuch_bool_t
+notmuch_config_get_new_mbox (notmuch_config_t *config)
+{
+    return config->new_mbox;
+}
+
+const char **
+notmuch_config_get_new_headers (notmuch_config_t *config, size_t *length)
+{
+    return _config_get_list (config, "new", "headers",
+			     &(config->new_headers),
+			     &(config->new_headers_length), length);
+}
+
+const char *
+notmuch_config_get_new_rules (notmuch_config_t *config)
+{
+    return _config_get (config, &config->new_rules, "new", "rules");
+}
+
 void
 notmuch_config_set_user_other_email (notmuch_config_t *config,
 				     const char *list[],
@@ -917,6 +1152,64 @@ notmuch_config_command (notmuch_config_t *config, int argc, char *argv[])
 
 }
 
+notmuch_bool_t
+notmuch_config_get_search_cache_counts (notmuch_config_t *config)
+{
+    return config->search_cache_counts;
+}
+
+notmuch_bool_t
+notmuch_config_get_search_cache_excludes (notmuch_config_t *config)
+{
+    return config->search_cache_excludes;
+}
+
+notmuch_bool_t
+notmuch_config_get_crypto_cache_signatures (notmuch_config_t *config)
+{
+    return config->crypto_cache_signatures;
+}
+
+notmuch_bool_t
+notmuch_config_get_index_body_positions (notmuch_config_t *config)
+{
+    return config->index_body_positions;
+}
+
+const char *
+notmuch_config_get_index_extractor (notmuch_config_t *config)
+{
+    return _config_get (config, &config->index_extractor,
+			"index", "extractor");
+}
+
+const char **
+notmuch_config_get_index_extract_types (notmuch_config_t *config,
+					size_t *length)
+{
+    return _config_get_list (config, "index", "extract_types",
+			     &(config->index_extract_types),
+			     &(config->index_extract_types_length), length);
+}
+
+int
+notmuch_config_get_index_extract_timeout (notmuch_config_t *config)
+{
+    return config->index_extract_timeout;
+}
+
+notmuch_bool_t
+notmuch_config_get_tag_journal (notmuch_config_t *config)
+{
+    return config->tag_journal;
+}
+
+int
+notmuch_config_get_replicate_changesets (notmuch_config_t *config)
+{
+    return config->replicate_changesets;
+}
+
 notmuch_bool_t
 notmuch_config_get_maildir_synchronize_flags (notmuch_config_t *config)
 {
@@ -33,48 +33,19 @@ enum {
     EXCLUDE_FALSE,
 };
 
-/* Return the number of files matching the query, or -1 for an error */
-static int
-count_files (notmuch_query_t *query)
-{
-    notmuch_messages_t *messages;
-    notmuch_message_t *message;
-    notmuch_filenames_t *filenames;
-    notmuch_status_t status;
-    int count = 0;
-
-    status = notmuch_query_search_messages_st (query, &messages);
-    if (print_status_query ("notmuch count", query, status))
-	return -1;
-
-    for (;
-	 notmuch_messages_valid (messages);
-	 notmuch_messages_move_to_next (messages)) {
-	message = notmuch_messages_get (messages);
-	filenames = notmuch_message_get_filenames (message);
-
-	for (;
-	     notmuch_filenames_valid (filenames);
-	     notmuch_filenames_move_to_next (filenames))
-	    count++;
-
-	notmuch_filenames_destroy (filenames);
-	notmuch_message_destroy (message);
-    }
-
-    notmuch_messages_destroy (messages);
-
-    return count;
-}
+enum {
+    FACET_NONE,
+    FACET_TAG,
+};
 
 /* return 0 on success, -1 on failure */
 static int
 print_count (notmuch_database_t *notmuch, const char *query_str,
-	     const char **exclude_tags, size_t exclude_tags_length, int output, int print_lastmod)
+	     const char **exclude_tags, size_t exclude_tags_length, int output,
+	     int print_lastmod, notmuch_bool_t estimate)
 {
     notmuch_query_t *query;
     size_t i;
-    int count;
     unsigned int ucount;
     unsigned long revision;
     const char *uuid;
@@ -92,7 +63,11 @@ print_count (notmuch_database_t *notmuch, const char *query_str,
 
     switch (output) {
     case OUTPUT_MESSAGES:
-	status = notmuch_query_count_messages_st (query, &ucount);
+	if (estimate)
+	    status = notmuch_query_count_messages_estimate (query, &ucount,
+							    NULL, NULL);
+	else
+	    status = notmuch_query_count_messages_st (query, &ucount);
 	if (print_status_query ("notmuch count", query, status))
 	    return -1;
 	printf ("%u", ucount);
@@ -104,13 +79,12 @@ print_count (notmuch_database_t *notmuch, const char *query_str,
 	printf ("%u", ucount);
 	break;
     case OUTPUT_FILES:
-	count = count_files (query);
-	if (count >= 0) {
-	    printf ("%u", count);
-	} else {
+	status = notmuch_query_count_files (query, &ucount);
+	if (print_status_query ("notmuch count", query, status)) {
 	    ret = -1;
 	    goto DONE;
 	}
+	printf ("%u", ucount);
 	break;
     }
 
@@ -127,9 +101,47 @@ print_count (notmuch_database_t *notmuch, const char *query_str,
     return ret;
 }
 
+/* Print the number of messages matching the query with each tag.
+ * Return 0 on success, -1 on failure. */
+static int
+print_tag_facets (notmuch_database_t *notmuch, const char *query_str,
+		  const char **exclude_tags, size_t exclude_tags_length)
+{
+    notmuch_query_t *query;
+    notmuch_tags_t *tags;
+    notmuch_status_t status;
+    size_t i;
+
+    query = notmuch_query_create (notmuch, query_str);
+    if (query == NULL) {
+	fprintf (stderr, "Out of memory\n");
+	return -1;
+    }
+
+    for (i = 0; i < exclude_tags_length; i++)
+	notmuch_query_add_tag_exclude (query, exclude_tags[i]);
+
+    status = notmuch_query_count_tags (query, &tags);
+    if (print_status_query ("notmuch count", query, status)) {
+	notmuch_query_destroy (query);
+	return -1;
+    }
+
+    for (;
+	 notmuch_tags_valid (tags);
+	 notmuch_tags_move_to_next (tags))
+	printf ("%u\t%s\n", notmuch_tags_get_count (tags),
+		notmuch_tags_get (tags));
+
+    notmuch_query_destroy (query);
+
+    return 0;
+}
+
 static int
 count_file (notmuch_database_t *notmuch, FILE *input, const char **exclude_tags,
-	    size_t exclude_tags_length, int output, int print_lastmod)
+	    size_t exclude_tags_length, int output, int print_lastmod,
+	    notmuch_bool_t estimate)
 {
     char *line = NULL;
     ssize_t line_len;
@@ -139,11 +151,90 @@ count_file (notmuch_database_t *notmuch, FILE *input, const char **exclude_tags,
     while (! ret && (line_len = getline (&line, &line_size, input)) != -1) {
 	chomp_newline (line);
 	ret = print_count (notmuch, line, exclude_tags, exclude_tags_length,
-			   output, print_lastmod);
+			   output, print_lastmod, estimate);
+    }
+
+    if (line)
+	free (line);
+
+    return ret;
+}
+
+/* Like count_file, but read all of the queries up front and let the
+ * library evaluate up to 'jobs' of them at once. */
+static int
+count_file_parallel (notmuch_database_t *notmuch, FILE *input,
+		     const char **exclude_tags, size_t exclude_tags_length,
+		     int output, int print_lastmod, int jobs)
+{
+    void *local = talloc_new (NULL);
+    notmuch_query_t **queries = NULL;
+    unsigned int *counts;
+    unsigned int num_queries = 0, i;
+    unsigned long revision;
+    const char *uuid;
+    char *line = NULL;
+    ssize_t line_len;
+    size_t line_size;
+    size_t j;
+    notmuch_status_t status;
+    int ret = 0;
+
+    while ((line_len = getline (&line, &line_size, input)) != -1) {
+	notmuch_query_t *query;
+
+	chomp_newline (line);
+	queries = talloc_realloc (local, queries, notmuch_query_t *,
+				  num_queries + 1);
+	query = notmuch_query_create (notmuch, line);
+	if (queries == NULL || query == NULL) {
+	    fprintf (stderr, "Out of memory\n");
+	    ret = -1;
+	    goto DONE;
+	}
+
+	for (j = 0; j < exclude_tags_length; j++)
+	    notmuch_query_add_tag_exclude (query, exclude_tags[j]);
+
+	queries[num_queries++] = query;
+    }
+
+    if (num_queries == 0)
+	goto DONE;
+
+    counts = talloc_array (local, unsigned int, num_queries);
+    if (counts == NULL) {
+	fprintf (stderr, "Out of memory\n");
+	ret = -1;
+	goto DONE;
+    }
+
+    /* As in notmuch new, the threads allocate into talloc hierarchies
+     * of their own. */
+    talloc_disable_null_tracking ();
+
+    status = notmuch_query_count_batch (queries, num_queries,
+					output == OUTPUT_THREADS, jobs, counts);
+    if (print_status_database ("notmuch count", notmuch, status)) {
+	ret = -1;
+	goto DONE;
+    }
+
+    revision = notmuch_database_get_revision (notmuch, &uuid);
+    for (i = 0; i < num_queries; i++) {
+	printf ("%u", counts[i]);
+	if (print_lastmod)
+	    printf ("\t%s\t%lu\n", uuid, revision);
+	else
+	    fputs ("\n", stdout);
     }
 
+  DONE:
+    for (i = 0; i < num_queries; i++)
+	notmuch_query_destroy (queries[i]);
     if (line)
 	free (line);
+    talloc_free (local);
 
     return ret;
 }
@@ -156,10 +247,13 @@ notmuch_count_command (notmuch_config_t *config, int argc, char *argv[])
     int opt_index;
     int output = OUTPUT_MESSAGES;
     int exclude = EXCLUDE_TRUE;
+    int facet = FACET_NONE;
     const char **search_exclude_tags = NULL;
     size_t search_exclude_tags_length = 0;
     notmuch_bool_t batch = FALSE;
     notmuch_bool_t print_lastmod = FALSE;
+    notmuch_bool_t estimate = FALSE;
+    int jobs = 1;
     FILE *input = stdin;
     char *input_file_name = NULL;
     int ret;
@@ -174,8 +268,13 @@ notmuch_count_command (notmuch_config_t *config, int argc, char *argv[])
 	  (notmuch_keyword_t []){ { "true", EXCLUDE_TRUE },
 				  { "false", EXCLUDE_FALSE },
 				  { 0, 0 } } },
+	{ NOTMUCH_OPT_KEYWORD, &facet, "facet", 0,
+	  (notmuch_keyword_t []){ { "tag", FACET_TAG },
+				  { 0, 0 } } },
 	{ NOTMUCH_OPT_BOOLEAN, &print_lastmod, "lastmod", 'l', 0 },
+	{ NOTMUCH_OPT_BOOLEAN, &estimate, "estimate", 0, 0 },
 	{ NOTMUCH_OPT_BOOLEAN, &batch, "batch", 0, 0 },
+	{ NOTMUCH_OPT_INT, &jobs, "jobs", 'j', 0 },
 	{ NOTMUCH_OPT_STRING, &input_file_name, "input", 'i', 0 },
 	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
 	{ 0, 0, 0, 0, 0 }
@@ -202,12 +301,30 @@ notmuch_count_command (notmuch_config_t *config, int argc, char *argv[])
 	return EXIT_FAILURE;
     }
 
-    if (notmuch_database_open (notmuch_config_get_database_path (config),
-			       NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
+    if (facet != FACET_NONE &&
+	(batch || print_lastmod || output != OUTPUT_MESSAGES)) {
+	fprintf (stderr, "--facet counts messages for a single query; it is not compatible with --batch, --lastmod or --output\n");
+	return EXIT_FAILURE;
+    }
+
+    if (estimate && (facet != FACET_NONE || output != OUTPUT_MESSAGES)) {
+	fprintf (stderr, "--estimate only counts messages; it is not compatible with --facet, --output=threads or --output=files\n");
+	return EXIT_FAILURE;
+    }
+
+    if (notmuch_cli_database_open (notmuch_config_get_database_path (config),
+				   NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch,
+				   NULL))
 	return EXIT_FAILURE;
 
     notmuch_exit_if_unmatched_db_uuid (notmuch);
 
+    if (notmuch_config_get_search_cache_counts (config))
+	notmuch_database_set_query_cache (notmuch, TRUE);
+
+    if (notmuch_config_get_search_cache_excludes (config))
+	notmuch_database_set_exclude_cache (notmuch, TRUE);
+
     query_str = query_string_from_args (config, argc - opt_index, argv + opt_index);
     if (query_str == NULL) {
 	fprintf (stderr, "Out of memory.\n");
@@ -219,12 +336,24 @@ notmuch_count_command (notmuch_config_t *config, int argc, char *argv[])
 	    (config, &search_exclude_tags_length);
     }
 
-    if (batch)
+    /* Files are counted by walking the messages, so there is nothing
+     * to evaluate in parallel; estimates are cheap enough not to
+     * bother. */
+    if (facet == FACET_TAG)
+	ret = print_tag_facets (notmuch, query_str, search_exclude_tags,
+				search_exclude_tags_length);
+    else if (batch && jobs > 1 && output != OUTPUT_FILES && ! estimate)
+	ret = count_file_parallel (notmuch, input, search_exclude_tags,
+				   search_exclude_tags_length, output,
+				   print_lastmod, jobs);
+    else if (batch)
 	ret = count_file (notmuch, input, search_exclude_tags,
-			  search_exclude_tags_length, output, print_lastmod);
+			  search_exclude_tags_length, output, print_lastmod,
+			  estimate);
     else
 	ret = print_count (notmuch, query_str, search_exclude_tags,
-			   search_exclude_tags_length, output, print_lastmod);
+			   search_exclude_tags_length, output, print_lastmod,
+			   estimate);
 
     notmuch_database_destroy (notmuch);
 
@@ -23,10 +23,114 @@
 #include "string-util.h"
 #include <zlib.h>
 
+/* Size of the zlib buffer for dump output.  Dumps are written a few
+ * bytes at a time, so the default of 8kB costs a deflate call for
+ * every couple of hundred messages. */
+#define DUMP_BUFFER_SIZE (1 << 18)
+
+/* Write 'value' seven bits at a time, low bits first, setting the top
+ * bit of every byte but the last. */
+static void
+gz_put_varint (gzFile output, unsigned long value)
+{
+    unsigned char bytes[(sizeof (value) * 8 + 6) / 7];
+    size_t len = 0;
+
+    do {
+	bytes[len] = value & 0x7f;
+	value >>= 7;
+	if (value)
+	    bytes[len] |= 0x80;
+	len++;
+    } while (value);
+
+    gzwrite (output, bytes, len);
+}
+
+static void
+gz_put_string (gzFile output, const char *str)
+{
+    size_t len = strlen (str);
+
+    gz_put_varint (output, len);
+    gzwrite (output, str, len);
+}
+
+/* Write 'messages' in the binary format.  Each tag is written once,
+ * before the first message that carries it, and is referred to by
+ * number after that. */
+static int
+dump_binary_messages (notmuch_messages_t *messages, gzFile output)
+{
+    GHashTable *tag_numbers;
+    unsigned long *numbers = NULL;
+    size_t numbers_size = 0;
+    int ret = EXIT_SUCCESS;
+
+    tag_numbers = g_hash_table_new_full (g_str_hash, g_str_equal,
+					 g_free, NULL);
+
+    gzputs (output, DUMP_BINARY_HEADER);
+
+    for (;
+	 notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages)) {
+	notmuch_message_t *message = notmuch_messages_get (messages);
+	notmuch_tags_t *tags;
+	size_t i, count = 0;
+
+	for (tags = notmuch_message_get_tags (message);
+	     notmuch_tags_valid (tags);
+	     notmuch_tags_move_to_next (tags)) {
+	    const char *tag_str = notmuch_tags_get (tags);
+	    gpointer number;
+
+	    if (! g_hash_table_lookup_extended (tag_numbers, tag_str,
+						NULL, &number)) {
+		number = GUINT_TO_POINTER (g_hash_table_size (tag_numbers));
+		g_hash_table_insert (tag_numbers, g_strdup (tag_str), number);
+		gz_put_varint (output, DUMP_BINARY_TAG);
+		gz_put_string (output, tag_str);
+	    }
+
+	    if (count == numbers_size) {
+		numbers_size = numbers_size ? 2 * numbers_size : 16;
+		numbers = talloc_realloc (messages, numbers, unsigned long,
+					  numbers_size);
+		if (numbers == NULL) {
+		    fprintf (stderr, "Out of memory\n");
+		    ret = EXIT_FAILURE;
+		    break;
+		}
+	    }
+	    numbers[count++] = GPOINTER_TO_UINT (number);
+	}
+
+	if (ret == EXIT_SUCCESS) {
+	    gz_put_varint (output, DUMP_BINARY_MESSAGE);
+	    gz_put_string (output, notmuch_message_get_message_id (message));
+	    gz_put_varint (output, count);
+	    for (i = 0; i < count; i++)
+		gz_put_varint (output, numbers[i]);
+	}
+
+	notmuch_message_destroy (message);
+
+	if (ret)
+	    break;
+    }
+
+    gz_put_varint (output, DUMP_BINARY_END);
+
+    talloc_free (numbers);
+    g_hash_table_destroy (tag_numbers);
+
+    return ret;
+}
 
 static int
 database_dump_file (notmuch_database_t *notmuch, gzFile output,
-		    const char *query_str, int output_format)
+		    const char *query_str, int output_format, int since)
 {
     notmuch_query_t *query;
     notmuch_messages_t *messages;
@@ -36,6 +140,28 @@ database_dump_file (notmuch_database_t *notmuch, gzFile output,
     if (! query_str)
 	query_str = "";
 
+    /* Only messages changed after 'since' and up to the revision
+     * recorded in the header.  Nothing else can change the database
+     * while we hold it open for writing. */
+    if (since >= 0) {
+	const char *uuid;
+	unsigned long revision = notmuch_database_get_revision (notmuch, &uuid);
+
+	gzprintf (output, "%s %s %d %lu\n", DUMP_CHANGES_HEADER,
+		  uuid, since, revision);
+
+	if (*query_str)
+	    query_str = talloc_asprintf (notmuch, "lastmod:%d..%lu and (%s)",
+					 since + 1, revision, query_str);
+	else
+	    query_str = talloc_asprintf (notmuch, "lastmod:%d..%lu",
+					 since + 1, revision);
+	if (query_str == NULL) {
+	    fprintf (stderr, "Out of memory\n");
+	    return EXIT_FAILURE;
+	}
+    }
+
     query = notmuch_query_create (notmuch, query_str);
     if (query == NULL) {
 	fprintf (stderr, "Out of memory\n");
@@ -45,6 +171,8 @@ database_dump_file (notmuch_database_t *notmuch, gzFile output,
      * first results quickly at the expense of total time.
      */
     notmuch_query_set_sort (query, NOTMUCH_SORT_UNSORTED);
+    notmuch_query_set_fields (query, NOTMUCH_FIELD_MESSAGE_ID |
+			      NOTMUCH_FIELD_TAGS);
 
     char *buffer = NULL;
     size_t buffer_size = 0;
@@ -54,6 +182,13 @@ database_dump_file (notmuch_database_t *notmuch, gzFile output,
     if (print_status_query ("notmuch dump", query, status))
 	return EXIT_FAILURE;
 
+    if (output_format == DUMP_FORMAT_BINARY) {
+	int ret = dump_binary_messages (messages, output);
+
+	notmuch_query_destroy (query);
+	return ret;
+    }
+
     for (;
 	 notmuch_messages_valid (messages);
 	 notmuch_messages_move_to_next (messages)) {
@@ -130,6 +265,7 @@ notmuch_database_dump (notmuch_database_t *notmuch,
 		       const char *output_file_name,
 		       const char *query_str,
 		       dump_format_t output_format,
+		       int since,
 		       notmuch_bool_t gzip_output)
 {
     gzFile output = NULL;
@@ -164,7 +300,11 @@ notmuch_database_dump (notmuch_database_t *notmuch,
 	goto DONE;
     }
 
-    ret = database_dump_file (notmuch, output, query_str, output_format);
+    /* Must come before the first write; failing is harmless. */
+    gzbuffer (output, DUMP_BUFFER_SIZE);
+
+    ret = database_dump_file (notmuch, output, query_str, output_format,
+			      since);
     if (ret) goto DONE;
 
     ret = gzflush (output, Z_FINISH);
@@ -227,14 +367,17 @@ notmuch_dump_command (notmuch_config_t *config, int argc, char *argv[])
 
     int output_format = DUMP_FORMAT_BATCH_TAG;
     notmuch_bool_t gzip_output = 0;
+    int since = -1;
 
     notmuch_opt_desc_t options[] = {
 	{ NOTMUCH_OPT_KEYWORD, &output_format, "format", 'f',
 	  (notmuch_keyword_t []){ { "sup", DUMP_FORMAT_SUP },
 				  { "batch-tag", DUMP_FORMAT_BATCH_TAG },
+				  { "binary", DUMP_FORMAT_BINARY },
 				  { 0, 0 } } },
 	{ NOTMUCH_OPT_STRING, &output_file_name, "output", 'o', 0  },
 	{ NOTMUCH_OPT_BOOLEAN, &gzip_output, "gzip", 'z', 0 },
+	{ NOTMUCH_OPT_INT, &since, "since", 's', 0 },
 	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
 	{ 0, 0, 0, 0, 0 }
     };
@@ -245,6 +388,11 @@ notmuch_dump_command (notmuch_config_t *config, int argc, char *argv[])
 
     notmuch_process_shared_options (argv[0]);
 
+    if (since < -1) {
+	fprintf (stderr, "Error: --since takes a database revision.\n");
+	return EXIT_FAILURE;
+    }
+
     if (opt_index < argc) {
 	query_str = query_string_from_args (notmuch, argc - opt_index, argv + opt_index);
 	if (query_str == NULL) {
@@ -254,7 +402,7 @@ notmuch_dump_command (notmuch_config_t *config, int argc, char *argv[])
     }
 
     ret = notmuch_database_dump (notmuch, output_file_name, query_str,
-				 output_format, gzip_output);
+				 output_format, since, gzip_output);
 
     notmuch_database_destroy (notmuch);
 
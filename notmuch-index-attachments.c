@@ -0,0 +1,539 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+/* The text of attachments is extracted in three steps, so that the
+ * database is only locked for writing at the end, and briefly: the
+ * attachments of the messages marked by notmuch new are read with the
+ * database open read-only, each attachment is run through the
+ * extractor (several at once) in a process of its own, and the text
+ * is then added to the messages in batches.
+ *
+ * The text is kept in .notmuch/extracted below the database path, in
+ * a file named by the SHA-256 of the attachment, so an attachment
+ * sent with many messages is extracted only once, whether in this
+ * run or a later one. */
+
+#include "notmuch-client.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Larger attachments are not extracted. */
+#define EXTRACT_MAX_INPUT (64 * 1024 * 1024)
+
+/* Limits on each extractor process, besides index.extract_timeout. */
+#define EXTRACT_MAX_MEMORY (1024L * 1024 * 1024)
+#define EXTRACT_MAX_OUTPUT (16 * 1024 * 1024)
+
+/* The types extracted without index.extract_types. */
+static const char *default_extract_types[] = {
+    "application/pdf",
+    "application/msword",
+    "application/rtf",
+    "application/vnd.oasis.opendocument.text",
+    "application/vnd.openxmlformats-officedocument.wordprocessingml.document",
+};
+
+typedef struct {
+    char *message_id;
+    /* The hashes of the attachments to add the text of. */
+    GPtrArray *hashes;
+} extract_message_t;
+
+typedef struct {
+    char *hash;
+    char *content_type;
+    pid_t pid;
+} extract_job_t;
+
+typedef struct {
+    /* Owns the messages and jobs. */
+    void *ctx;
+    const char *cache_dir;
+    char **extractor;
+    int timeout;
+    const char **types;
+    size_t num_types;
+
+    /* Of extract_message_t. */
+    GPtrArray *messages;
+    /* Of extract_job_t, in the order queued. */
+    GPtrArray *jobs;
+    /* The hashes of the attachments queued. */
+    GHashTable *queued;
+
+    unsigned int extracted;
+    /* Set when the extractor cannot be run at all. */
+    notmuch_bool_t failed;
+} extract_state_t;
+
+static notmuch_bool_t
+extract_type_wanted (extract_state_t *state, const char *type)
+{
+    size_t i;
+
+    for (i = 0; i < state->num_types; i++)
+	if (strcasecmp (state->types[i], type) == 0)
+	    return TRUE;
+
+    return FALSE;
+}
+
+static char *
+cache_path (const void *ctx, extract_state_t *state, const char *hash,
+	    const char *suffix)
+{
+    return talloc_asprintf (ctx, "%s/%s%s", state->cache_dir, hash, suffix);
+}
+
+/* Queue the extraction of 'part' of 'pending' unless its text is
+ * cached or already queued. */
+static void
+collect_attachment (extract_state_t *state, extract_message_t *pending,
+		    GMimePart *part, const char *content_type)
+{
+    GMimeDataWrapper *wrapper;
+    GMimeStream *stream;
+    GByteArray *content;
+    extract_job_t *job;
+    char *hash, *path;
+    notmuch_bool_t cached;
+
+    wrapper = g_mime_part_get_content_object (part);
+    if (wrapper == NULL)
+	return;
+
+    stream = g_mime_stream_mem_new ();
+    g_mime_data_wrapper_write_to_stream (wrapper, stream);
+    content = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (stream));
+    if (content->len == 0 || content->len > EXTRACT_MAX_INPUT)
+	goto DONE;
+
+    hash = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+					content->data, content->len);
+    g_ptr_array_add (pending->hashes, talloc_strdup (pending, hash));
+
+    path = cache_path (NULL, state, hash, "");
+    cached = access (path, F_OK) == 0;
+    talloc_free (path);
+
+    if (! cached && ! g_hash_table_lookup (state->queued, hash)) {
+	path = cache_path (NULL, state, hash, ".in");
+	if (g_file_set_contents (path, (const char *) content->data,
+				 content->len, NULL)) {
+	    job = talloc_zero (state->ctx, extract_job_t);
+	    job->hash = talloc_strdup (job, hash);
+	    job->content_type = talloc_strdup (job, content_type);
+	    g_ptr_array_add (state->jobs, job);
+	    g_hash_table_insert (state->queued, job->hash, job->hash);
+	} else {
+	    fprintf (stderr, "Error writing %s.\n", path);
+	}
+	talloc_free (path);
+    }
+
+    g_free (hash);
+
+  DONE:
+    g_object_unref (stream);
+}
+
+/* Queue the extraction of the attachments of 'message'.  A message
+ * whose file cannot be read stays marked for a later run. */
+static void
+collect_message (extract_state_t *state, notmuch_message_t *message)
+{
+    notmuch_crypto_t crypto;
+    extract_message_t *pending;
+    mime_node_t *root, *node;
+    int i;
+
+    memset (&crypto, 0, sizeof (crypto));
+    if (mime_node_open (state->ctx, message, &crypto, &root))
+	return;
+
+    pending = talloc_zero (state->ctx, extract_message_t);
+    pending->message_id = talloc_strdup (pending,
+					 notmuch_message_get_message_id (message));
+    pending->hashes = g_ptr_array_new ();
+    g_ptr_array_add (state->messages, pending);
+
+    for (i = 1; (node = mime_node_seek_dfs (root, i)) != NULL; i++) {
+	GMimeContentDisposition *disposition;
+	char *content_type;
+
+	if (! GMIME_IS_PART (node->part))
+	    continue;
+
+	disposition = g_mime_object_get_content_disposition (node->part);
+	if (! disposition ||
+	    strcasecmp (g_mime_content_disposition_get_disposition (disposition),
+			GMIME_DISPOSITION_ATTACHMENT) != 0)
+	    continue;
+
+	content_type = g_mime_content_type_to_string (
+	    g_mime_object_get_content_type (node->part));
+	if (content_type && extract_type_wanted (state, content_type))
+	    collect_attachment (state, pending, GMIME_PART (node->part),
+				content_type);
+	g_free (content_type);
+    }
+
+    talloc_free (root);
+}
+
+/* In a child process: run the extractor on the attachment of 'job'
+ * alone, confined as far as an unprivileged process can be. */
+static void
+exec_extractor (extract_state_t *state, extract_job_t *job)
+{
+    char *input = cache_path (NULL, state, job->hash, ".in");
+    char *output = cache_path (NULL, state, job->hash, ".out");
+    struct rlimit limit;
+    char **argv;
+    int fd, in, out, argc;
+
+    in = open (input, O_RDONLY);
+    out = open (output, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (in < 0 || out < 0 ||
+	dup2 (in, STDIN_FILENO) < 0 || dup2 (out, STDOUT_FILENO) < 0)
+	_exit (127);
+
+    /* Leave the extractor nothing of notmuch's open, and nowhere near
+     * the mail. */
+    if (getrlimit (RLIMIT_NOFILE, &limit) || limit.rlim_cur > 65536)
+	limit.rlim_cur = 65536;
+    for (fd = STDERR_FILENO + 1; fd < (int) limit.rlim_cur; fd++)
+	close (fd);
+    if (chdir ("/"))
+	_exit (127);
+
+    if (state->timeout) {
+	limit.rlim_cur = limit.rlim_max = state->timeout;
+	setrlimit (RLIMIT_CPU, &limit);
+	/* The alarm outlives the exec, and bounds the wall clock time
+	 * of an extractor that hangs without using the CPU. */
+	alarm (state->timeout);
+    }
+    limit.rlim_cur = limit.rlim_max = EXTRACT_MAX_MEMORY;
+    setrlimit (RLIMIT_AS, &limit);
+    limit.rlim_cur = limit.rlim_max = EXTRACT_MAX_OUTPUT;
+    setrlimit (RLIMIT_FSIZE, &limit);
+    limit.rlim_cur = limit.rlim_max = 0;
+    setrlimit (RLIMIT_CORE, &limit);
+
+    /* Leave the CPU to indexing and reading mail. */
+    IGNORE_RESULT (nice (10));
+
+    for (argc = 0; state->extractor[argc]; argc++)
+	;
+    argv = talloc_array (NULL, char *, argc + 2);
+    memcpy (argv, state->extractor, argc * sizeof (char *));
+    argv[argc] = job->content_type;
+    argv[argc + 1] = NULL;
+
+    execvp (argv[0], argv);
+    fprintf (stderr, "Error running %s: %s\n", argv[0], strerror (errno));
+    _exit (127);
+}
+
+/* Keep the text of the finished 'job', or an empty file if the
+ * extractor failed on it, so that it is not tried again. */
+static void
+finish_job (extract_state_t *state, extract_job_t *job, int status)
+{
+    char *input = cache_path (NULL, state, job->hash, ".in");
+    char *output = cache_path (input, state, job->hash, ".out");
+    char *path = cache_path (input, state, job->hash, "");
+
+    if (WIFEXITED (status) && WEXITSTATUS (status) == 0) {
+	if (rename (output, path) == 0)
+	    state->extracted++;
+	else
+	    fprintf (stderr, "Error renaming %s: %s\n", output, strerror (errno));
+    } else if (WIFEXITED (status) && WEXITSTATUS (status) == 127) {
+	/* Not run at all; the messages stay marked. */
+	state->failed = TRUE;
+	unlink (output);
+    } else {
+	if (WIFSIGNALED (status))
+	    fprintf (stderr, "Warning: extractor killed by signal %d on a %s attachment.\n",
+		     WTERMSIG (status), job->content_type);
+	else
+	    fprintf (stderr, "Warning: extractor failed with status %d on a %s attachment.\n",
+		     WEXITSTATUS (status), job->content_type);
+	if (! g_file_set_contents (path, "", 0, NULL))
+	    fprintf (stderr, "Error writing %s.\n", path);
+	unlink (output);
+    }
+
+    unlink (input);
+    talloc_free (input);
+}
+
+/* Run the queued jobs, up to 'jobs' at a time. */
+static void
+run_jobs (extract_state_t *state, int jobs)
+{
+    unsigned int next = 0, running = 0, i;
+
+    while (next < state->jobs->len || running) {
+	extract_job_t *job;
+	int status;
+	pid_t pid;
+
+	while (running < (unsigned int) jobs && next < state->jobs->len &&
+	       ! state->failed) {
+	    job = g_ptr_array_index (state->jobs, next++);
+	    fflush (stdout);
+	    job->pid = fork ();
+	    if (job->pid == 0)
+		exec_extractor (state, job);
+	    if (job->pid < 0) {
+		fprintf (stderr, "Error starting extractor: %s\n", strerror (errno));
+		state->failed = TRUE;
+		break;
+	    }
+	    running++;
+	}
+
+	if (running == 0)
+	    break;
+
+	pid = waitpid (-1, &status, 0);
+	if (pid < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf (stderr, "Error waiting for extractor: %s\n", strerror (errno));
+	    break;
+	}
+
+	for (i = 0; i < next; i++) {
+	    job = g_ptr_array_index (state->jobs, i);
+	    if (job->pid == pid) {
+		finish_job (state, job, status);
+		job->pid = 0;
+		running--;
+		break;
+	    }
+	}
+    }
+
+    /* Clean up after the jobs never started. */
+    for (i = next; i < state->jobs->len; i++) {
+	extract_job_t *job = g_ptr_array_index (state->jobs, i);
+	char *input = cache_path (NULL, state, job->hash, ".in");
+
+	unlink (input);
+	talloc_free (input);
+    }
+}
+
+/* Add the extracted text to the message 'pending', and unless some of
+ * it is missing, clear its mark. */
+static notmuch_status_t
+add_text (notmuch_database_t *notmuch, extract_state_t *state,
+	  extract_message_t *pending)
+{
+    notmuch_message_t *message;
+    notmuch_status_t status;
+    notmuch_bool_t complete = TRUE;
+    unsigned int i;
+
+    status = notmuch_database_find_message (notmuch, pending->message_id,
+					    &message);
+    if (status || message == NULL)
+	return status;
+
+    notmuch_message_freeze (message);
+
+    for (i = 0; i < pending->hashes->len; i++) {
+	char *path = cache_path (NULL, state,
+				 g_ptr_array_index (pending->hashes, i), "");
+	char *text;
+	gsize length;
+
+	if (! g_file_get_contents (path, &text, &length, NULL)) {
+	    complete = FALSE;
+	} else {
+	    if (length)
+		status = notmuch_message_add_extracted_text (message, text,
+							     length);
+	    g_free (text);
+	}
+	talloc_free (path);
+	if (status)
+	    goto DONE;
+    }
+
+    if (complete)
+	status = notmuch_message_set_extraction_done (message);
+
+  DONE:
+    notmuch_message_thaw (message);
+    notmuch_message_destroy (message);
+    return status;
+}
+
+int
+notmuch_index_attachments_command (notmuch_config_t *config, int argc, char *argv[])
+{
+    const char *db_path = notmuch_config_get_database_path (config);
+    const char *extractor = notmuch_config_get_index_extractor (config);
+    extract_state_t state;
+    notmuch_database_t *notmuch;
+    notmuch_messages_t *messages;
+    notmuch_status_t status;
+    notmuch_bool_t quiet = FALSE;
+    GError *error = NULL;
+    int batch_size = 1000;
+    int jobs = sysconf (_SC_NPROCESSORS_ONLN);
+    int opt_index, ret = EXIT_FAILURE;
+    unsigned int i;
+
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_INT, &batch_size, "batch-size", 'b', 0 },
+	{ NOTMUCH_OPT_INT, &jobs, "jobs", 'j', 0 },
+	{ NOTMUCH_OPT_BOOLEAN,  &quiet, "quiet", 'q', 0 },
+	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
+
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return EXIT_FAILURE;
+
+    notmuch_process_shared_options (argv[0]);
+
+    if (opt_index < argc) {
+	fprintf (stderr, "Error: unexpected argument: %s\n", argv[opt_index]);
+	return EXIT_FAILURE;
+    }
+
+    if (batch_size < 1) {
+	fprintf (stderr, "Error: --batch-size must be at least 1\n");
+	return EXIT_FAILURE;
+    }
+
+    if (jobs < 1)
+	jobs = 1;
+
+    if (extractor == NULL) {
+	fprintf (stderr, "Error: index.extractor is not set (see notmuch-config(1)).\n");
+	return EXIT_FAILURE;
+    }
+
+    memset (&state, 0, sizeof (state));
+    if (! g_shell_parse_argv (extractor, NULL, &state.extractor, &error)) {
+	fprintf (stderr, "Error: cannot parse index.extractor: %s\n",
+		 error->message);
+	g_error_free (error);
+	return EXIT_FAILURE;
+    }
+    state.timeout = notmuch_config_get_index_extract_timeout (config);
+    state.types = notmuch_config_get_index_extract_types (config,
+							   &state.num_types);
+    if (state.num_types == 0) {
+	state.types = default_extract_types;
+	state.num_types = ARRAY_SIZE (default_extract_types);
+    }
+    state.ctx = talloc_new (config);
+    state.messages = g_ptr_array_new ();
+    state.jobs = g_ptr_array_new ();
+    state.queued = g_hash_table_new (g_str_hash, g_str_equal);
+
+    state.cache_dir = talloc_asprintf (state.ctx, "%s/.notmuch/extracted",
+				       db_path);
+    if (mkdir (state.cache_dir, 0700) && errno != EEXIST) {
+	fprintf (stderr, "Error creating %s: %s\n", state.cache_dir,
+		 strerror (errno));
+	goto DONE;
+    }
+
+    /* Find what to extract without holding the write lock. */
+    if (notmuch_database_open (db_path, NOTMUCH_DATABASE_MODE_READ_ONLY,
+			       &notmuch))
+	goto DONE;
+
+    notmuch_exit_if_unmatched_db_uuid (notmuch);
+
+    status = notmuch_database_get_extraction_pending (notmuch, &messages);
+    if (print_status_database ("notmuch index-attachments", notmuch, status)) {
+	notmuch_database_destroy (notmuch);
+	goto DONE;
+    }
+    for (; notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
+	collect_message (&state, notmuch_messages_get (messages));
+    notmuch_messages_destroy (messages);
+    notmuch_database_destroy (notmuch);
+
+    run_jobs (&state, jobs);
+
+    if (notmuch_database_open (db_path, NOTMUCH_DATABASE_MODE_READ_WRITE,
+			       &notmuch))
+	goto DONE;
+
+    status = NOTMUCH_STATUS_SUCCESS;
+    for (i = 0; i < state.messages->len && ! status; i++) {
+	/* Each batch is written out as a single transaction. */
+	if (i % batch_size == 0) {
+	    if (i)
+		status = notmuch_database_end_atomic (notmuch);
+	    if (! status)
+		status = notmuch_database_begin_atomic (notmuch);
+	    if (status)
+		break;
+	}
+	status = add_text (notmuch, &state,
+			   g_ptr_array_index (state.messages, i));
+    }
+    if (state.messages->len && ! status)
+	status = notmuch_database_end_atomic (notmuch);
+
+    if (print_status_database ("notmuch index-attachments", notmuch, status)) {
+	notmuch_database_destroy (notmuch);
+	goto DONE;
+    }
+
+    if (notmuch_database_destroy (notmuch))
+	goto DONE;
+
+    if (! quiet)
+	printf ("Extracted the text of %u attachment%s.\n", state.extracted,
+		state.extracted == 1 ? "" : "s");
+
+    if (state.failed)
+	fprintf (stderr, "Error: could not run %s; messages left for a later run.\n",
+		 state.extractor[0]);
+    else
+	ret = EXIT_SUCCESS;
+
+  DONE:
+    for (i = 0; i < state.messages->len; i++) {
+	extract_message_t *pending = g_ptr_array_index (state.messages, i);
+	g_ptr_array_free (pending->hashes, TRUE);
+    }
+    g_ptr_array_free (state.messages, TRUE);
+    g_hash_table_destroy (state.queued);
+    g_ptr_array_free (state.jobs, TRUE);
+    g_strfreev (state.extractor);
+    talloc_free (state.ctx);
+    return ret;
+}
@@ -0,0 +1,86 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-client.h"
+
+int
+notmuch_index_pending_command (notmuch_config_t *config, int argc, char *argv[])
+{
+    notmuch_database_t *notmuch;
+    notmuch_status_t status;
+    notmuch_bool_t quiet = FALSE;
+    int batch_size = 1000;
+    unsigned int count, merged;
+    int opt_index;
+
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_INT, &batch_size, "batch-size", 'b', 0 },
+	{ NOTMUCH_OPT_BOOLEAN,  &quiet, "quiet", 'q', 0 },
+	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
+
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return EXIT_FAILURE;
+
+    notmuch_process_shared_options (argv[0]);
+
+    if (opt_index < argc) {
+	fprintf (stderr, "Error: unexpected argument: %s\n", argv[opt_index]);
+	return EXIT_FAILURE;
+    }
+
+    if (batch_size < 1) {
+	fprintf (stderr, "Error: --batch-size must be at least 1\n");
+	return EXIT_FAILURE;
+    }
+
+    if (notmuch_database_open (notmuch_config_get_database_path (config),
+			       NOTMUCH_DATABASE_MODE_READ_WRITE, &notmuch))
+	return EXIT_FAILURE;
+
+    notmuch_exit_if_unmatched_db_uuid (notmuch);
+
+    notmuch_database_set_snippet_length (
+	notmuch, notmuch_config_get_new_snippet_length (config));
+    notmuch_database_set_extract_attachments (
+	notmuch, notmuch_config_get_index_extractor (config) != NULL);
+
+    status = notmuch_database_index_pending (notmuch, batch_size, &count);
+    if (print_status_database ("notmuch index-pending", notmuch, status)) {
+	notmuch_database_destroy (notmuch);
+	return EXIT_FAILURE;
+    }
+
+    if (! quiet)
+	printf ("Indexed the bodies of %u message%s.\n", count,
+		count == 1 ? "" : "s");
+
+    status = notmuch_database_merge_threads (notmuch, &merged);
+    if (print_status_database ("notmuch index-pending", notmuch, status)) {
+	notmuch_database_destroy (notmuch);
+	return EXIT_FAILURE;
+    }
+
+    if (! quiet && merged)
+	printf ("Finished merging %u thread%s.\n", merged,
+		merged == 1 ? "" : "s");
+
+    return notmuch_database_destroy (notmuch) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -317,24 +317,20 @@ FAIL:
 }
 
 /*
- * Write fdin to a new file in maildir/new, using an intermediate temp
- * file in maildir/tmp, return full path to the new file, or NULL on
- * errors.
+ * Move the temp file tmppath in maildir/tmp to maildir/new, without
+ * syncing the directory, return full path to the new file, or NULL on
+ * errors (in which case the temp file is removed).
  */
 static char *
-maildir_write_new (const void *ctx, int fdin, const char *maildir)
+maildir_move_new (const void *ctx, const char *tmppath, const char *maildir)
 {
-    char *cleanpath, *tmppath, *newpath, *newdir;
-
-    tmppath = maildir_write_tmp (ctx, fdin, maildir);
-    if (! tmppath)
-	return NULL;
-    cleanpath = tmppath;
+    char *newpath;
 
     newpath = talloc_strdup (ctx, tmppath);
     if (! newpath) {
 	fprintf (stderr, "Error: %s\n", strerror (ENOMEM));
-	goto FAIL;
+	unlink (tmppath);
+	return NULL;
     }
 
     /* sanity checks needed? */
@@ -343,27 +339,249 @@ maildir_write_new (const void *ctx, int fdin, const char *maildir)
     if (rename (tmppath, newpath)) {
 	fprintf (stderr, "Error: rename '%s' '%s': %s\n",
 		 tmppath, newpath, strerror (errno));
-	goto FAIL;
+	unlink (tmppath);
+	return NULL;
     }
-    cleanpath = newpath;
+
+    return newpath;
+}
+
+/* Call sync_dir() on maildir/new. */
+static notmuch_bool_t
+maildir_sync_new (const void *ctx, const char *maildir)
+{
+    char *newdir;
 
     newdir = talloc_asprintf (ctx, "%s/%s", maildir, "new");
     if (! newdir) {
 	fprintf (stderr, "Error: %s\n", strerror (ENOMEM));
+	return FALSE;
+    }
+
+    return sync_dir (newdir);
+}
+
+/*
+ * Write fdin to a new file in maildir/new, using an intermediate temp
+ * file in maildir/tmp, return full path to the new file, or NULL on
+ * errors.
+ */
+static char *
+maildir_write_new (const void *ctx, int fdin, const char *maildir)
+{
+    char *tmppath, *newpath;
+
+    tmppath = maildir_write_tmp (ctx, fdin, maildir);
+    if (! tmppath)
+	return NULL;
+
+    newpath = maildir_move_new (ctx, tmppath, maildir);
+    if (! newpath)
+	return NULL;
+
+    if (! maildir_sync_new (ctx, maildir)) {
+	unlink (newpath);
+	return NULL;
+    }
+
+    return newpath;
+}
+
+/* Return TRUE if 'line' separates two messages of an mbox. */
+static notmuch_bool_t
+is_mbox_from_line (const char *line)
+{
+    return STRNCMP_LITERAL (line, "From ") == 0;
+}
+
+/*
+ * Write the next message of the mbox read from 'in' to a new temp
+ * file in maildir/tmp, return full path to the file, or NULL on
+ * errors.  The message ends at a "From " line following an empty
+ * line, which is left in *line, or at the end of the input, where
+ * *more is set to FALSE.  Body lines quoted as ">From " (or with more
+ * '>'s, as in mboxrd) lose one '>'.
+ */
+static char *
+mbox_write_tmp (const void *ctx, FILE *in, const char *maildir,
+		char **line, size_t *line_size, notmuch_bool_t *more)
+{
+    notmuch_bool_t blank = FALSE, empty = TRUE;
+    ssize_t length;
+    char *path;
+    FILE *out;
+    int fdout;
+
+    fdout = maildir_mktemp (ctx, maildir, &path);
+    if (fdout < 0)
+	return NULL;
+
+    out = fdopen (fdout, "w");
+    if (! out) {
+	fprintf (stderr, "Error: fdopen '%s': %s\n", path, strerror (errno));
+	close (fdout);
+	unlink (path);
+	return NULL;
+    }
+
+    *more = FALSE;
+    while (! interrupted &&
+	   (length = getline (line, line_size, in)) != -1) {
+	const char *p = *line;
+
+	if (blank && is_mbox_from_line (p)) {
+	    *more = TRUE;
+	    break;
+	}
+
+	/* The empty line before a "From " line belongs to the mbox,
+	 * not to the message, so hold each one back until the next
+	 * line is known. */
+	if (blank)
+	    fputc ('\n', out);
+	blank = (strcmp (p, "\n") == 0);
+	if (blank)
+	    continue;
+
+	if (*p == '>') {
+	    const char *q = p;
+
+	    while (*q == '>')
+		q++;
+	    if (is_mbox_from_line (q)) {
+		p++;
+		length--;
+	    }
+	}
+
+	fwrite (p, 1, length, out);
+	empty = FALSE;
+    }
+
+    if (ferror (in)) {
+	fprintf (stderr, "Error: reading from standard input: %s\n",
+		 strerror (errno));
+	goto FAIL;
+    }
+    if (interrupted)
+	goto FAIL;
+    if (empty) {
+	fprintf (stderr, "Error: empty message in mbox\n");
 	goto FAIL;
     }
 
-    if (! sync_dir (newdir))
+    if (fflush (out) || ferror (out)) {
+	fprintf (stderr, "Error: writing to temporary file: %s\n",
+		 strerror (errno));
 	goto FAIL;
+    }
+    if (fsync (fdout)) {
+	fprintf (stderr, "Error: fsync '%s': %s\n", path, strerror (errno));
+	goto FAIL;
+    }
 
-    return newpath;
+    fclose (out);
+
+    return path;
 
 FAIL:
-    unlink (cleanpath);
+    fclose (out);
+    unlink (path);
 
     return NULL;
 }
 
+/* How notmuch insert --batch reads its messages. */
+enum {
+    BATCH_NONE,
+    BATCH_MBOX,
+    BATCH_FILES,
+};
+
+/*
+ * Write the messages of a batch read from standard input, as an mbox
+ * or as a list of file names (one per line), to new temp files in
+ * maildir/tmp, return the number of messages and their full paths in
+ * *paths_out, or -1 on errors (in which case no temp file is left).
+ */
+static int
+batch_write_tmp (const void *ctx, int batch, const char *maildir,
+		 char ***paths_out)
+{
+    char **paths = NULL;
+    char *line = NULL, *path;
+    size_t line_size = 0;
+    ssize_t length;
+    notmuch_bool_t more = TRUE;
+    int count = 0, allocated = 0, i;
+
+    if (batch == BATCH_MBOX) {
+	length = getline (&line, &line_size, stdin);
+	if (length == -1) {
+	    more = FALSE;
+	} else if (! is_mbox_from_line (line)) {
+	    fprintf (stderr, "Error: standard input is not an mbox\n");
+	    goto FAIL;
+	}
+    }
+
+    while (more && ! interrupted) {
+	if (batch == BATCH_MBOX) {
+	    path = mbox_write_tmp (ctx, stdin, maildir, &line, &line_size,
+				   &more);
+	} else {
+	    int fdin;
+
+	    length = getline (&line, &line_size, stdin);
+	    if (length == -1)
+		break;
+	    if (length > 0 && line[length - 1] == '\n')
+		line[--length] = '\0';
+	    if (length == 0)
+		continue;
+
+	    fdin = open (line, O_RDONLY);
+	    if (fdin == -1) {
+		fprintf (stderr, "Error: open '%s': %s\n", line,
+			 strerror (errno));
+		goto FAIL;
+	    }
+	    path = maildir_write_tmp (ctx, fdin, maildir);
+	    close (fdin);
+	}
+	if (! path)
+	    goto FAIL;
+
+	if (count == allocated) {
+	    char **grown;
+
+	    allocated = allocated ? 2 * allocated : 64;
+	    grown = talloc_realloc (ctx, paths, char *, allocated);
+	    if (! grown) {
+		fprintf (stderr, "Error: %s\n", strerror (ENOMEM));
+		unlink (path);
+		goto FAIL;
+	    }
+	    paths = grown;
+	}
+	paths[count++] = path;
+    }
+
+    if (interrupted)
+	goto FAIL;
+
+    free (line);
+    *paths_out = paths;
+    return count;
+
+FAIL:
+    free (line);
+    for (i = 0; i < count; i++)
+	unlink (paths[i]);
+
+    return -1;
+}
+
 /*
  * Add the specified message file to the notmuch database, applying
  * tags in tag_ops. If synchronize_flags is TRUE, the tags are
@@ -440,6 +658,103 @@ add_file (notmuch_database_t *notmuch, const char *path, tag_op_list_t *tag_ops,
     return status;
 }
 
+/*
+ * Deliver and index a batch of messages read from standard input:
+ * write all of them to maildir/tmp, move them to maildir/new and sync
+ * that directory once, and add them to the database in one atomic
+ * section.  Messages are handled as by a single insert, so without
+ * keep, a message that fails to index is removed again while the
+ * others are kept.  Return the number of messages delivered in
+ * *delivered.
+ */
+static notmuch_status_t
+insert_batch (const void *ctx, notmuch_database_t *notmuch, int batch,
+	      const char *maildir, tag_op_list_t *tag_ops,
+	      notmuch_bool_t synchronize_flags, notmuch_bool_t keep,
+	      unsigned int *delivered)
+{
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+    char **paths;
+    int count, i;
+
+    *delivered = 0;
+
+    count = batch_write_tmp (ctx, batch, maildir, &paths);
+    if (count < 0) {
+	notmuch_database_destroy (notmuch);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    for (i = 0; i < count; i++) {
+	paths[i] = maildir_move_new (ctx, paths[i], maildir);
+	if (! paths[i])
+	    ret = NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    if (count && ! maildir_sync_new (ctx, maildir)) {
+	for (i = 0; i < count; i++)
+	    if (paths[i])
+		unlink (paths[i]);
+	notmuch_database_destroy (notmuch);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status) {
+	fprintf (stderr, "Error: failed to start a database transaction: %s\n",
+		 notmuch_status_to_string (status));
+	goto DONE;
+    }
+
+    for (i = 0; i < count; i++) {
+	if (! paths[i])
+	    continue;
+
+	status = add_file (notmuch, paths[i], tag_ops, synchronize_flags,
+			   keep);
+	if (status && ! keep) {
+	    if (! ret)
+		ret = status;
+	    /* If maildir flag sync failed, this might fail. */
+	    if (unlink (paths[i])) {
+		fprintf (stderr, "Warning: failed to remove '%s' from maildir "
+			 "after errors: %s. Please run 'notmuch new' to fix.\n",
+			 paths[i], strerror (errno));
+	    }
+	    paths[i] = NULL;
+	}
+    }
+
+    status = notmuch_database_end_atomic (notmuch);
+
+  DONE:
+    if (! status)
+	status = notmuch_database_destroy (notmuch);
+    else
+	notmuch_database_destroy (notmuch);
+    if (status) {
+	fprintf (stderr, "%s: failed to commit database changes: %s\n",
+		 keep ? "Warning" : "Error",
+		 notmuch_status_to_string (status));
+	if (! keep && ! ret)
+	    ret = status;
+    }
+
+    for (i = 0; i < count; i++) {
+	if (! paths[i])
+	    continue;
+	if (! status || keep) {
+	    (*delivered)++;
+	} else if (unlink (paths[i])) {
+	    fprintf (stderr, "Warning: failed to remove '%s' from maildir "
+		     "after errors: %s. Please run 'notmuch new' to fix.\n",
+		     paths[i], strerror (errno));
+	}
+    }
+
+    return ret;
+}
+
 int
 notmuch_insert_command (notmuch_config_t *config, int argc, char *argv[])
 {
@@ -449,13 +764,18 @@ notmuch_insert_command (notmuch_config_t *config, int argc, char *argv[])
     const char *db_path;
     const char **new_tags;
     size_t new_tags_length;
+    const char **recorded_headers;
+    size_t recorded_headers_length;
     tag_op_list_t *tag_ops;
     char *query_string = NULL;
     const char *folder = NULL;
     notmuch_bool_t create_folder = FALSE;
     notmuch_bool_t keep = FALSE;
     notmuch_bool_t no_hooks = FALSE;
+    notmuch_bool_t defer_body = FALSE;
     notmuch_bool_t synchronize_flags;
+    int batch = BATCH_NONE;
+    unsigned int delivered;
     const char *maildir;
     char *newpath;
     int opt_index;
@@ -466,6 +786,11 @@ notmuch_insert_command (notmuch_config_t *config, int argc, char *argv[])
 	{ NOTMUCH_OPT_BOOLEAN, &create_folder, "create-folder", 0, 0 },
 	{ NOTMUCH_OPT_BOOLEAN, &keep, "keep", 0, 0 },
 	{ NOTMUCH_OPT_BOOLEAN,  &no_hooks, "no-hooks", 'n', 0 },
+	{ NOTMUCH_OPT_BOOLEAN, &defer_body, "defer-body", 0, 0 },
+	{ NOTMUCH_OPT_KEYWORD, &batch, "batch", 0,
+	  (notmuch_keyword_t []){ { "mbox", BATCH_MBOX },
+				  { "files", BATCH_FILES },
+				  { 0, 0 } } },
 	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
 	{ NOTMUCH_OPT_END, 0, 0, 0, 0 }
     };
@@ -538,6 +863,37 @@ notmuch_insert_command (notmuch_config_t *config, int argc, char *argv[])
 
     notmuch_exit_if_unmatched_db_uuid (notmuch);
 
+    notmuch_database_set_defer_body (notmuch, defer_body);
+    notmuch_database_set_extract_attachments (
+	notmuch, notmuch_config_get_index_extractor (config) != NULL);
+
+    /* Without new.headers, the library records its default set. */
+    recorded_headers = notmuch_config_get_new_headers (config,
+						       &recorded_headers_length);
+    if (recorded_headers)
+	notmuch_database_set_recorded_headers (notmuch, recorded_headers,
+					       recorded_headers_length);
+    notmuch_database_set_snippet_length (
+	notmuch, notmuch_config_get_new_snippet_length (config));
+
+    status = notmuch_database_set_body_positions (
+	notmuch, notmuch_config_get_index_body_positions (config));
+    if (print_status_database ("notmuch insert", notmuch, status)) {
+	notmuch_database_destroy (notmuch);
+	return EXIT_FAILURE;
+    }
+
+    if (batch != BATCH_NONE) {
+	status = insert_batch (config, notmuch, batch, maildir, tag_ops,
+			       synchronize_flags, keep, &delivered);
+
+	/* One hook run for the whole batch. */
+	if (! no_hooks && delivered)
+	    notmuch_run_hook (db_path, "post-insert");
+
+	return status ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     /* Write the message to the Maildir new directory. */
     newpath = maildir_write_new (config, STDIN_FILENO, maildir);
     if (! newpath) {
@@ -20,12 +20,31 @@
 
 #include "notmuch-client.h"
 #include "tag-util.h"
+#include "hex-escape.h"
+#include "mbox-util.h"
 
+#include <fcntl.h>
+#include <inttypes.h>
 #include <unistd.h>
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if HAVE_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
 typedef struct _filename_node {
     char *filename;
+    /* For directory_mtimes: the mtime to record, if has_mtime, with
+     * mtime_nsec nanoseconds (or -1 if unknown), and the manifest to
+     * record, if not NULL. */
+    notmuch_bool_t has_mtime;
     time_t mtime;
+    long mtime_nsec;
+    char *manifest;
     struct _filename_node *next;
 } _filename_node_t;
 
@@ -41,6 +60,16 @@ enum verbosity {
     VERBOSITY_VERBOSE,
 };
 
+typedef struct {
+    double wall;
+    double cpu;
+} stats_timer_t;
+
+typedef enum {
+    STATS_NONE,
+    STATS_JSON
+} stats_format_t;
+
 typedef struct {
     int output_is_a_tty;
     enum verbosity verbosity;
@@ -60,6 +89,55 @@ typedef struct {
     _filename_list_t *directory_mtimes;
 
     notmuch_bool_t synchronize_flags;
+
+    /* With a batch_size above 1, changes are committed in batches of
+     * up to batch_size files, rather than one file at a time. */
+    int batch_size;
+    int batch_changes;
+    notmuch_bool_t in_batch;
+    struct timeval batch_start;
+
+    /* Whether to record a manifest of each directory scanned (see
+     * directory_manifest). */
+    notmuch_bool_t manifests;
+
+    /* Whether to index the messages of mbox files in place (see
+     * add_mbox_file). */
+    notmuch_bool_t mbox;
+
+    /* With --stats, where the time goes; the library phases are
+     * recorded in 'profile' (see notmuch_database_set_profile). */
+    notmuch_bool_t stats;
+    stats_timer_t run_timer;
+    notmuch_profile_t profile;
+    notmuch_profile_phase_t stat_phase, scan_phase, add_phase, remove_phase;
+    int directories, skipped_directories;
+
+#if HAVE_PTHREAD
+    /* If not NULL, new files are handed to this for indexing, rather
+     * than added one at a time. */
+    struct _index_pipeline *pipeline;
+
+    /* If not NULL, directories are read ahead of add_files by this. */
+    struct _scan_ahead *scan_ahead;
+#endif
+
+#if HAVE_INOTIFY
+    /* If not NULL, add_files also watches every directory it visits
+     * for changes (see notmuch watch). */
+    struct _watch *watch;
+#endif
+
+    /* If not NULL, the message ids of the messages added, one per
+     * line, for the post-new hook (see run_post_new_hook), and the
+     * revision of the database before they were. */
+    FILE *new_ids;
+    char *new_ids_path;
+    unsigned long start_revision;
+
+    /* If not NULL, the tagging rules given to the library for the
+     * messages added (see load_tag_rules). */
+    char *tag_rules;
 } add_files_state_t;
 
 static volatile sig_atomic_t do_print_progress = 0;
@@ -110,6 +188,10 @@ _filename_list_add (_filename_list_t *list,
     list->count++;
 
     node->filename = talloc_strdup (list, filename);
+    node->has_mtime = FALSE;
+    node->mtime = 0;
+    node->mtime_nsec = -1;
+    node->manifest = NULL;
     node->next = NULL;
 
     *(list->tail) = node;
@@ -150,6 +232,28 @@ generic_print_progress (const char *action, const char *object,
     fflush (stdout);
 }
 
+static void
+stats_start (const add_files_state_t *state, stats_timer_t *timer)
+{
+    if (! state->stats)
+	return;
+
+    timer->wall = notmuch_time_clock (CLOCK_MONOTONIC);
+    timer->cpu = notmuch_time_clock (CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void
+stats_stop (const add_files_state_t *state, const stats_timer_t *timer,
+	    notmuch_profile_phase_t *phase)
+{
+    if (! state->stats)
+	return;
+
+    phase->wall += notmuch_time_clock (CLOCK_MONOTONIC) - timer->wall;
+    phase->cpu += notmuch_time_clock (CLOCK_PROCESS_CPUTIME_ID) - timer->cpu;
+    phase->calls++;
+}
+
 static int
 dirent_sort_inode (const struct dirent **a, const struct dirent **b)
 {
@@ -162,6 +266,19 @@ dirent_sort_strcmp_name (const struct dirent **a, const struct dirent **b)
     return strcmp ((*a)->d_name, (*b)->d_name);
 }
 
+/* The same, for sorting with qsort. */
+static int
+_qsort_dirent_inode (const void *a, const void *b)
+{
+    return dirent_sort_inode (a, b);
+}
+
+static int
+_qsort_dirent_strcmp_name (const void *a, const void *b)
+{
+    return dirent_sort_strcmp_name (a, b);
+}
+
 /* Return the type of a directory entry relative to path as a stat(2)
  * mode.  Like stat, this follows symlinks.  Returns -1 and sets errno
  * if the file's type cannot be determined (which includes dangling
@@ -247,10 +364,76 @@ _entry_in_ignore_list (const char *entry, add_files_state_t *state)
     return FALSE;
 }
 
-/* Add a single file to the database. */
+/* Commit the open batch at the latest this many seconds after it was
+ * started, so that a crash loses a bounded amount of work. */
+#define NEW_BATCH_SECONDS 10
+
+/* Start a batch of changes to commit together.  The atomic sections
+ * of the individual changes nest within it. */
+static notmuch_status_t
+batch_begin (notmuch_database_t *notmuch, add_files_state_t *state)
+{
+    notmuch_status_t status;
+
+    if (state->batch_size <= 1)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status)
+	return status;
+
+    state->in_batch = TRUE;
+    state->batch_changes = 0;
+    gettimeofday (&state->batch_start, NULL);
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Commit the open batch, if any. */
+static notmuch_status_t
+batch_end (notmuch_database_t *notmuch, add_files_state_t *state)
+{
+    if (! state->in_batch)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    state->in_batch = FALSE;
+    return notmuch_database_end_atomic (notmuch);
+}
+
+/* Count one completed change against the open batch, and commit the
+ * batch once it is full or old enough, or another writer (such as
+ * "notmuch tag") is waiting for the database.  Such a writer is let
+ * in between batches. */
+static notmuch_status_t
+batch_step (notmuch_database_t *notmuch, add_files_state_t *state)
+{
+    struct timeval tv_now;
+    notmuch_status_t status;
+
+    if (! state->in_batch)
+	return notmuch_database_yield (notmuch, NULL);
+
+    gettimeofday (&tv_now, NULL);
+    if (++state->batch_changes < state->batch_size &&
+	notmuch_time_elapsed (state->batch_start, tv_now) < NEW_BATCH_SECONDS &&
+	! notmuch_database_write_requested (notmuch))
+	return NOTMUCH_STATUS_SUCCESS;
+
+    status = batch_end (notmuch, state);
+    if (status)
+	return status;
+
+    status = notmuch_database_yield (notmuch, NULL);
+    if (status)
+	return status;
+
+    return batch_begin (notmuch, state);
+}
+
+/* Add a single file to the database.  If 'indexed' is not NULL, it is
+ * the result of notmuch_database_index_file for 'filename'. */
 static notmuch_status_t
 add_file (notmuch_database_t *notmuch, const char *filename,
-	  add_files_state_t *state)
+	  notmuch_indexed_file_t *indexed, add_files_state_t *state)
 {
     notmuch_message_t *message = NULL;
     const char **tag;
@@ -260,11 +443,17 @@ add_file (notmuch_database_t *notmuch, const char *filename,
     if (status)
 	goto DONE;
 
-    status = notmuch_database_add_message (notmuch, filename, &message);
+    if (indexed)
+	status = notmuch_database_add_indexed_file (notmuch, indexed, &message);
+    else
+	status = notmuch_database_add_message (notmuch, filename, &message);
     switch (status) {
     /* Success. */
     case NOTMUCH_STATUS_SUCCESS:
 	state->added_messages++;
+	if (state->new_ids)
+	    fprintf (state->new_ids, "%s\n",
+		     notmuch_message_get_message_id (message));
 	notmuch_message_freeze (message);
 	for (tag = state->new_tags; *tag != NULL; tag++)
 	    notmuch_message_add_tag (message, *tag);
@@ -298,6 +487,15 @@ add_file (notmuch_database_t *notmuch, const char *filename,
 
     status = notmuch_database_end_atomic (notmuch);
 
+    /* The message must not outlive the database being yielded. */
+    if (message) {
+	notmuch_message_destroy (message);
+	message = NULL;
+    }
+
+    if (status == NOTMUCH_STATUS_SUCCESS)
+	status = batch_step (notmuch, state);
+
   DONE:
     if (message)
 	notmuch_message_destroy (message);
@@ -305,203 +503,1344 @@ add_file (notmuch_database_t *notmuch, const char *filename,
     return status;
 }
 
-/* Examine 'path' recursively as follows:
- *
- *   o Ask the filesystem for the mtime of 'path' (fs_mtime)
- *   o Ask the database for its timestamp of 'path' (db_mtime)
- *
- *   o Ask the filesystem for files and directories within 'path'
- *     (via scandir and stored in fs_entries)
- *
- *   o Pass 1: For each directory in fs_entries, recursively call into
- *     this same function.
- *
- *   o Compare fs_mtime to db_mtime. If they are equivalent, terminate
- *     the algorithm at this point, (this directory has not been
- *     updated in the filesystem since the last database scan of PASS
- *     2).
- *
- *   o Ask the database for files and directories within 'path'
- *     (db_files and db_subdirs)
- *
- *   o Pass 2: Walk fs_entries simultaneously with db_files and
- *     db_subdirs. Look for one of three interesting cases:
- *
- *	   1. Regular file in fs_entries and not in db_files
- *            This is a new file to add_message into the database.
- *
- *         2. Filename in db_files not in fs_entries.
- *            This is a file that has been removed from the mail store.
- *
- *         3. Directory in db_subdirs not in fs_entries
- *            This is a directory that has been removed from the mail store.
- *
- *     Note that the addition of a directory is not interesting here,
- *     since that will have been taken care of in pass 1. Also, we
- *     don't immediately act on file/directory removal since we must
- *     ensure that in the case of a rename that the new filename is
- *     added before the old filename is removed, (so that no
- *     information is lost from the database).
- *
- *   o Tell the database to update its time of 'path' to 'fs_mtime'
- *     if fs_mtime isn't the current wall-clock time.
- */
+/* Add 'filename' without reading it if it is the new name of a file
+ * that was moved within its maildir (see
+ * notmuch_database_add_moved_file), and set *moved accordingly. */
 static notmuch_status_t
-add_files (notmuch_database_t *notmuch,
-	   const char *path,
-	   add_files_state_t *state)
+add_moved_file (notmuch_database_t *notmuch, const char *filename,
+		add_files_state_t *state, notmuch_bool_t *moved)
 {
-    struct dirent *entry = NULL;
-    char *next = NULL;
-    time_t fs_mtime, db_mtime;
-    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
-    struct dirent **fs_entries = NULL;
-    int i, num_fs_entries = 0, entry_type;
-    notmuch_directory_t *directory;
-    notmuch_filenames_t *db_files = NULL;
-    notmuch_filenames_t *db_subdirs = NULL;
-    time_t stat_time;
-    struct stat st;
-    notmuch_bool_t is_maildir;
+    notmuch_message_t *message;
+    notmuch_status_t status;
 
-    if (stat (path, &st)) {
-	fprintf (stderr, "Error reading directory %s: %s\n",
-		 path, strerror (errno));
-	return NOTMUCH_STATUS_FILE_ERROR;
-    }
-    stat_time = time (NULL);
+    *moved = FALSE;
 
-    if (! S_ISDIR (st.st_mode)) {
-	fprintf (stderr, "Error: %s is not a directory.\n", path);
-	return NOTMUCH_STATUS_FILE_ERROR;
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status)
+	return status;
+
+    status = notmuch_database_add_moved_file (notmuch, filename, &message);
+    if (status == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) {
+	*moved = TRUE;
+	if (state->synchronize_flags)
+	    notmuch_message_maildir_flags_to_tags (message);
+	notmuch_message_destroy (message);
+    } else if (status) {
+	fprintf (stderr, "Error: %s. Halting processing.\n",
+		 notmuch_status_to_string (status));
+	return status;
     }
 
-    fs_mtime = st.st_mtime;
+    status = notmuch_database_end_atomic (notmuch);
+    if (status == NOTMUCH_STATUS_SUCCESS && *moved)
+	status = batch_step (notmuch, state);
 
-    status = notmuch_database_get_directory (notmuch, path, &directory);
-    if (status) {
-	ret = status;
-	goto DONE;
-    }
-    db_mtime = directory ? notmuch_directory_get_mtime (directory) : 0;
+    return status;
+}
 
-    /* If the directory is unchanged from our last scan and has no
-     * sub-directories, then return without scanning it at all.  In
-     * some situations, skipping the scan can substantially reduce the
-     * cost of notmuch new, especially since the huge numbers of files
-     * in Maildirs make scans expensive, but all files live in leaf
-     * directories.
-     *
-     * To check for sub-directories, we borrow a trick from find,
-     * kpathsea, and many other UNIX tools: since a directory's link
-     * count is the number of sub-directories (specifically, their
-     * '..' entries) plus 2 (the link from the parent and the link for
-     * '.').  This check is safe even on weird file systems, since
-     * file systems that can't compute this will return 0 or 1.  This
-     * is safe even on *really* weird file systems like HFS+ that
-     * mistakenly return the total number of directory entries, since
-     * that only inflates the count beyond 2.
-     */
-    if (directory && fs_mtime == db_mtime && st.st_nlink == 2) {
-	/* There's one catch: pass 1 below considers symlinks to
-	 * directories to be directories, but these don't increase the
-	 * file system link count.  So, only bail early if the
-	 * database agrees that there are no sub-directories. */
-	db_subdirs = notmuch_directory_get_child_directories (directory);
-	if (!notmuch_filenames_valid (db_subdirs))
-	    goto DONE;
-	notmuch_filenames_destroy (db_subdirs);
-	db_subdirs = NULL;
-    }
+#if HAVE_PTHREAD
+/* With --jobs, files are read, parsed and indexed by worker threads
+ * (see notmuch_database_index_file), while this thread adds the
+ * results to the database with add_file, in the order the files were
+ * found.  At most 'size' files are in flight at once. */
+typedef struct {
+    char *filename;
+    notmuch_indexed_file_t *indexed;
+    notmuch_status_t status;
+    notmuch_bool_t done;
+} index_job_t;
 
-    /* If the database knows about this directory, then we sort based
-     * on strcmp to match the database sorting. Otherwise, we can do
-     * inode-based sorting for faster filesystem operation. */
-    num_fs_entries = scandir (path, &fs_entries, 0,
-			      directory ?
-			      dirent_sort_strcmp_name : dirent_sort_inode);
+typedef struct _index_pipeline {
+    notmuch_database_t *notmuch;
 
-    if (num_fs_entries == -1) {
-	fprintf (stderr, "Error opening directory %s: %s\n",
-		 path, strerror (errno));
-	/* We consider this a fatal error because, if a user moved a
-	 * message from another directory that we were able to scan
-	 * into this directory, skipping this directory will cause
-	 * that message to be lost. */
-	ret = NOTMUCH_STATUS_FILE_ERROR;
-	goto DONE;
-    }
+    /* Job i is jobs[i % size].  Jobs [tail, head) have been submitted
+     * and not yet added; of these, jobs [claim, head) have not yet
+     * been taken by a worker.  Only this thread changes head and
+     * tail, and always with 'lock' held. */
+    index_job_t *jobs;
+    unsigned int size;
+    unsigned int head, claim, tail;
+    notmuch_bool_t stopping;
+
+    pthread_mutex_t lock;
+    /* Signalled when a job is submitted, or the workers should stop. */
+    pthread_cond_t submitted;
+    /* Signalled when a worker has finished a job. */
+    pthread_cond_t finished;
+
+    pthread_t *threads;
+    unsigned int num_threads;
+} index_pipeline_t;
+
+static void *
+index_worker (void *closure)
+{
+    index_pipeline_t *pipeline = closure;
 
-    /* Pass 1: Recurse into all sub-directories. */
-    is_maildir = _entries_resemble_maildir (path, fs_entries, num_fs_entries);
+    pthread_mutex_lock (&pipeline->lock);
+    for (;;) {
+	notmuch_indexed_file_t *indexed;
+	notmuch_status_t status;
+	index_job_t *job;
 
-    for (i = 0; i < num_fs_entries; i++) {
-	if (interrupted)
+	while (pipeline->claim == pipeline->head && ! pipeline->stopping)
+	    pthread_cond_wait (&pipeline->submitted, &pipeline->lock);
+	if (pipeline->claim == pipeline->head)
 	    break;
 
-	entry = fs_entries[i];
+	job = &pipeline->jobs[pipeline->claim++ % pipeline->size];
+	pthread_mutex_unlock (&pipeline->lock);
 
-	/* Ignore any files/directories the user has configured to
-	 * ignore.  We do this before dirent_type both for performance
-	 * and because we don't care if dirent_type fails on entries
-	 * that are explicitly ignored.
-	 */
-	if (_entry_in_ignore_list (entry->d_name, state)) {
-	    if (state->debug)
-		printf ("(D) add_files, pass 1: explicitly ignoring %s/%s\n",
-			path, entry->d_name);
-	    continue;
-	}
+	status = notmuch_database_index_file (pipeline->notmuch,
+					      job->filename, &indexed);
 
-	/* We only want to descend into directories (and symlinks to
-	 * directories). */
-	entry_type = dirent_type (path, entry);
-	if (entry_type == -1) {
-	    /* Be pessimistic, e.g. so we don't lose lots of mail just
-	     * because a user broke a symlink. */
-	    fprintf (stderr, "Error reading file %s/%s: %s\n",
-		     path, entry->d_name, strerror (errno));
-	    return NOTMUCH_STATUS_FILE_ERROR;
-	} else if (entry_type != S_IFDIR) {
-	    continue;
-	}
+	pthread_mutex_lock (&pipeline->lock);
+	job->indexed = indexed;
+	job->status = status;
+	job->done = TRUE;
+	pthread_cond_signal (&pipeline->finished);
+    }
+    pthread_mutex_unlock (&pipeline->lock);
 
-	/* Ignore special directories to avoid infinite recursion.
-	 * Also ignore the .notmuch directory and any "tmp" directory
-	 * that appears within a maildir.
-	 */
-	if (strcmp (entry->d_name, ".") == 0 ||
-	    strcmp (entry->d_name, "..") == 0 ||
-	    (is_maildir && strcmp (entry->d_name, "tmp") == 0) ||
-	    strcmp (entry->d_name, ".notmuch") == 0)
-	    continue;
+    return NULL;
+}
 
-	next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
-	status = add_files (notmuch, next, state);
-	if (status) {
-	    ret = status;
-	    goto DONE;
-	}
-	talloc_free (next);
-	next = NULL;
-    }
+/* Stop the workers, and throw away any files not yet added. */
+static int
+index_pipeline_destroy (index_pipeline_t *pipeline)
+{
+    unsigned int i;
 
-    /* If the directory's modification time in the filesystem is the
-     * same as what we recorded in the database the last time we
-     * scanned it, then we can skip the second pass entirely.
-     *
-     * We test for strict equality here to avoid a bug that can happen
-     * if the system clock jumps backward, (preventing new mail from
-     * being discovered until the clock catches up and the directory
-     * is modified again).
-     */
-    if (directory && fs_mtime == db_mtime)
-	goto DONE;
+    pthread_mutex_lock (&pipeline->lock);
+    pipeline->stopping = TRUE;
+    pipeline->claim = pipeline->head;
+    pthread_cond_broadcast (&pipeline->submitted);
+    pthread_mutex_unlock (&pipeline->lock);
 
-    /* If the database has never seen this directory before, we can
-     * simply leave db_files and db_subdirs NULL. */
-    if (directory) {
-	db_files = notmuch_directory_get_child_files (directory);
+    for (i = 0; i < pipeline->num_threads; i++)
+	pthread_join (pipeline->threads[i], NULL);
+
+    for (i = pipeline->tail; i != pipeline->head; i++)
+	notmuch_indexed_file_destroy (pipeline->jobs[i % pipeline->size].indexed);
+
+    pthread_cond_destroy (&pipeline->finished);
+    pthread_cond_destroy (&pipeline->submitted);
+    pthread_mutex_destroy (&pipeline->lock);
+
+    return 0;
+}
+
+/* Start 'jobs' worker threads indexing files for 'notmuch'.  Returns
+ * NULL if not a single thread could be started. */
+static index_pipeline_t *
+index_pipeline_create (const void *ctx, notmuch_database_t *notmuch,
+		       unsigned int jobs)
+{
+    index_pipeline_t *pipeline;
+
+    pipeline = talloc_zero (ctx, index_pipeline_t);
+    if (pipeline == NULL)
+	return NULL;
+
+    pipeline->notmuch = notmuch;
+    pipeline->size = jobs * 16;
+    pipeline->jobs = talloc_zero_array (pipeline, index_job_t,
+					pipeline->size);
+    pipeline->threads = talloc_array (pipeline, pthread_t, jobs);
+    if (pipeline->jobs == NULL || pipeline->threads == NULL) {
+	talloc_free (pipeline);
+	return NULL;
+    }
+
+    pthread_mutex_init (&pipeline->lock, NULL);
+    pthread_cond_init (&pipeline->submitted, NULL);
+    pthread_cond_init (&pipeline->finished, NULL);
+    talloc_set_destructor (pipeline, index_pipeline_destroy);
+
+    /* Each worker allocates into its own talloc hierarchy, which is
+     * only safe without the (unlocked) tracking of top-level
+     * allocations enabled in main. */
+    talloc_disable_null_tracking ();
+
+    while (pipeline->num_threads < jobs &&
+	   pthread_create (&pipeline->threads[pipeline->num_threads], NULL,
+			   index_worker, pipeline) == 0)
+	pipeline->num_threads++;
+
+    if (pipeline->num_threads == 0) {
+	talloc_free (pipeline);
+	return NULL;
+    }
+
+    return pipeline;
+}
+
+/* Wait for the oldest submitted file to be indexed, and add it to the
+ * database. */
+static notmuch_status_t
+index_pipeline_add_oldest (index_pipeline_t *pipeline,
+			   add_files_state_t *state)
+{
+    index_job_t *job = &pipeline->jobs[pipeline->tail % pipeline->size];
+    notmuch_status_t status;
+
+    pthread_mutex_lock (&pipeline->lock);
+    while (! job->done)
+	pthread_cond_wait (&pipeline->finished, &pipeline->lock);
+    pthread_mutex_unlock (&pipeline->lock);
+
+    status = job->status;
+    if (status)
+	fprintf (stderr, "Error: %s. Halting processing.\n",
+		 notmuch_status_to_string (status));
+    else
+	status = add_file (pipeline->notmuch, job->filename, job->indexed,
+			   state);
+
+    notmuch_indexed_file_destroy (job->indexed);
+    talloc_free (job->filename);
+
+    pthread_mutex_lock (&pipeline->lock);
+    job->filename = NULL;
+    job->indexed = NULL;
+    job->done = FALSE;
+    pipeline->tail++;
+    pthread_mutex_unlock (&pipeline->lock);
+
+    return status;
+}
+
+/* Queue 'filename' to be indexed and added, first adding the oldest
+ * queued file if the queue is full. */
+static notmuch_status_t
+index_pipeline_submit (index_pipeline_t *pipeline, const char *filename,
+		       add_files_state_t *state)
+{
+    notmuch_status_t status;
+    index_job_t *job;
+
+    if (pipeline->head - pipeline->tail == pipeline->size) {
+	status = index_pipeline_add_oldest (pipeline, state);
+	if (status)
+	    return status;
+    }
+
+    job = &pipeline->jobs[pipeline->head % pipeline->size];
+    job->filename = talloc_strdup (pipeline, filename);
+    if (job->filename == NULL) {
+	fprintf (stderr, "Error: %s. Halting processing.\n",
+		 notmuch_status_to_string (NOTMUCH_STATUS_OUT_OF_MEMORY));
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    pthread_mutex_lock (&pipeline->lock);
+    pipeline->head++;
+    pthread_cond_signal (&pipeline->submitted);
+    pthread_mutex_unlock (&pipeline->lock);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Add every file still queued. */
+static notmuch_status_t
+index_pipeline_flush (index_pipeline_t *pipeline, add_files_state_t *state)
+{
+    notmuch_status_t status;
+
+    while (pipeline->tail != pipeline->head && ! interrupted) {
+	status = index_pipeline_add_oldest (pipeline, state);
+	if (status)
+	    return status;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+#endif
+
+#if HAVE_PTHREAD
+/* With --jobs, worker threads also walk the mail store ahead of
+ * add_files, so that the file system has many directories to work
+ * on at once rather than one.  Each directory is stat'ed, and read
+ * only if it has sub-directories, since an unchanged leaf directory
+ * is never read by add_files; the types of its entries are resolved
+ * where d_type does not give them, and its sub-directories are queued
+ * in turn.  add_files takes the results in its own order, waiting for
+ * the directory it needs next and doing the work itself for anything
+ * the workers did not queue.
+ *
+ * The workers only use malloc and glib, never talloc. */
+typedef struct {
+    struct stat st;
+    /* NULL if the directory was not read. */
+    struct dirent **entries;
+    int num_entries;
+} scanned_dir_t;
+
+typedef struct _scan_ahead {
+    add_files_state_t *state;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t scanned;
+
+    /* Paths of directories to scan, the next one last.  Entries whose
+     * state is no longer SCAN_QUEUED are skipped. */
+    GPtrArray *todo;
+
+    /* Map from the path of every queued directory to SCAN_QUEUED,
+     * SCAN_BUSY, or the scanned_dir_t, or NULL if it failed.
+     * add_files removes directories as it takes them. */
+    GHashTable *dirs;
+
+    /* The directory add_files is waiting for, if any. */
+    const char *wanted;
+
+    notmuch_bool_t stopping;
+    pthread_t *threads;
+    int num_threads;
+} scan_ahead_t;
+
+static char scan_queued, scan_busy;
+#define SCAN_QUEUED ((gpointer) &scan_queued)
+#define SCAN_BUSY ((gpointer) &scan_busy)
+
+static void
+_scanned_dir_free (scanned_dir_t *dir)
+{
+    int i;
+
+    if (dir == NULL)
+	return;
+
+    if (dir->entries) {
+	for (i = 0; i < dir->num_entries; i++)
+	    free (dir->entries[i]);
+	free (dir->entries);
+    }
+    free (dir);
+}
+
+/* Return TRUE if 'entry' of the open directory 'fd' is a directory,
+ * recording its type in the entry if d_type did not give it. */
+static notmuch_bool_t
+_scan_entry_is_directory (int fd, struct dirent *entry)
+{
+    struct stat st;
+
+#if HAVE_D_TYPE
+    if (entry->d_type == DT_DIR)
+	return TRUE;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK)
+	return FALSE;
+#endif
+
+    /* Like dirent_type, follow symlinks; if this fails, leave it to
+     * add_files to report. */
+    if (fstatat (fd, entry->d_name, &st, 0))
+	return FALSE;
+
+#if HAVE_D_TYPE
+    if (S_ISDIR (st.st_mode))
+	entry->d_type = DT_DIR;
+    else if (S_ISREG (st.st_mode))
+	entry->d_type = DT_REG;
+#endif
+
+    return S_ISDIR (st.st_mode);
+}
+
+/* Scan the directory 'path', appending the paths of the
+ * sub-directories that add_files will visit to 'subdirs'.  Returns
+ * NULL on any error, leaving add_files to report it. */
+static scanned_dir_t *
+_scan_directory (scan_ahead_t *scan, const char *path, GPtrArray *subdirs)
+{
+    scanned_dir_t *dir;
+    struct dirent *entry, *copy;
+    notmuch_bool_t *is_dir = NULL;
+    notmuch_bool_t failed = FALSE;
+    size_t size, allocated = 0;
+    DIR *dirp = NULL;
+    int fd, i, maildir_subdirs = 0;
+
+    dir = calloc (1, sizeof (scanned_dir_t));
+    if (dir == NULL)
+	return NULL;
+
+    fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+	goto FAIL;
+
+    if (fstat (fd, &dir->st)) {
+	close (fd);
+	goto FAIL;
+    }
+
+    /* As in add_files, a link count of two means that there are no
+     * sub-directories, so the directory is only read if it changed. */
+    if (dir->st.st_nlink == 2) {
+	close (fd);
+	return dir;
+    }
+
+    dirp = fdopendir (fd);
+    if (dirp == NULL) {
+	close (fd);
+	goto FAIL;
+    }
+
+    while (! failed && (errno = 0, entry = readdir (dirp)) != NULL) {
+	if (dir->num_entries == (int) allocated) {
+	    struct dirent **entries;
+
+	    allocated = allocated ? 2 * allocated : 64;
+	    entries = realloc (dir->entries, allocated * sizeof (*entries));
+	    if (entries == NULL) {
+		failed = TRUE;
+		break;
+	    }
+	    dir->entries = entries;
+	}
+
+	/* Copy only as much of the entry as is used, like scandir. */
+	size = offsetof (struct dirent, d_name) + strlen (entry->d_name) + 1;
+	copy = malloc (size);
+	if (copy == NULL) {
+	    failed = TRUE;
+	    break;
+	}
+	memcpy (copy, entry, size);
+	dir->entries[dir->num_entries++] = copy;
+    }
+    if (failed || errno)
+	goto FAIL;
+
+    /* Sort as add_files will for a directory it has scanned before,
+     * which is the common case. */
+    qsort (dir->entries, dir->num_entries, sizeof (*dir->entries),
+	   _qsort_dirent_strcmp_name);
+
+    is_dir = calloc (dir->num_entries + 1, sizeof (notmuch_bool_t));
+    if (is_dir == NULL)
+	goto FAIL;
+
+    for (i = 0; i < dir->num_entries; i++) {
+	entry = dir->entries[i];
+	if (strcmp (entry->d_name, ".") == 0 ||
+	    strcmp (entry->d_name, "..") == 0 ||
+	    strcmp (entry->d_name, ".notmuch") == 0 ||
+	    _entry_in_ignore_list (entry->d_name, scan->state))
+	    continue;
+	is_dir[i] = _scan_entry_is_directory (dirfd (dirp), entry);
+	if (is_dir[i] && (strcmp (entry->d_name, "cur") == 0 ||
+			  strcmp (entry->d_name, "new") == 0 ||
+			  strcmp (entry->d_name, "tmp") == 0))
+	    maildir_subdirs++;
+    }
+
+    /* Queue the sub-directories in reverse order, so that they come
+     * off the end of the queue in the order add_files visits them.
+     * Skip "tmp" in a maildir, as add_files does. */
+    for (i = dir->num_entries - 1; i >= 0; i--) {
+	if (! is_dir[i] ||
+	    (maildir_subdirs == 3 &&
+	     strcmp (dir->entries[i]->d_name, "tmp") == 0))
+	    continue;
+	g_ptr_array_add (subdirs, g_strdup_printf ("%s/%s", path,
+						   dir->entries[i]->d_name));
+    }
+
+    free (is_dir);
+    closedir (dirp);
+    return dir;
+
+  FAIL:
+    free (is_dir);
+    if (dirp)
+	closedir (dirp);
+    _scanned_dir_free (dir);
+    return NULL;
+}
+
+/* Queue 'path' (which becomes owned by the queue) unless it is
+ * already known.  Call with the lock held. */
+static void
+_scan_ahead_queue (scan_ahead_t *scan, char *path)
+{
+    if (g_hash_table_lookup_extended (scan->dirs, path, NULL, NULL)) {
+	g_free (path);
+	return;
+    }
+
+    g_hash_table_insert (scan->dirs, g_strdup (path), SCAN_QUEUED);
+    g_ptr_array_add (scan->todo, path);
+}
+
+static void *
+scan_ahead_worker (void *closure)
+{
+    scan_ahead_t *scan = closure;
+    GPtrArray *subdirs = g_ptr_array_new ();
+    scanned_dir_t *dir;
+    char *path;
+    guint i;
+
+    pthread_mutex_lock (&scan->lock);
+    for (;;) {
+	path = NULL;
+
+	/* Prefer the directory add_files is waiting for. */
+	if (scan->wanted &&
+	    g_hash_table_lookup (scan->dirs, scan->wanted) == SCAN_QUEUED) {
+	    path = g_strdup (scan->wanted);
+	} else {
+	    while (scan->todo->len && path == NULL) {
+		path = g_ptr_array_remove_index (scan->todo,
+						 scan->todo->len - 1);
+		if (g_hash_table_lookup (scan->dirs, path) != SCAN_QUEUED) {
+		    g_free (path);
+		    path = NULL;
+		}
+	    }
+	}
+
+	if (path == NULL) {
+	    if (scan->stopping)
+		break;
+	    pthread_cond_wait (&scan->queued, &scan->lock);
+	    continue;
+	}
+
+	g_hash_table_insert (scan->dirs, g_strdup (path), SCAN_BUSY);
+	pthread_mutex_unlock (&scan->lock);
+
+	dir = _scan_directory (scan, path, subdirs);
+
+	pthread_mutex_lock (&scan->lock);
+	g_hash_table_insert (scan->dirs, path, dir);
+	for (i = 0; i < subdirs->len; i++)
+	    _scan_ahead_queue (scan, g_ptr_array_index (subdirs, i));
+	g_ptr_array_set_size (subdirs, 0);
+	pthread_cond_broadcast (&scan->queued);
+	pthread_cond_broadcast (&scan->scanned);
+    }
+    pthread_mutex_unlock (&scan->lock);
+
+    g_ptr_array_free (subdirs, TRUE);
+    return NULL;
+}
+
+static int
+scan_ahead_destroy (scan_ahead_t *scan)
+{
+    GHashTableIter iter;
+    gpointer value;
+    int i;
+
+    pthread_mutex_lock (&scan->lock);
+    scan->stopping = TRUE;
+    g_ptr_array_set_size (scan->todo, 0);
+    pthread_cond_broadcast (&scan->queued);
+    pthread_mutex_unlock (&scan->lock);
+
+    for (i = 0; i < scan->num_threads; i++)
+	pthread_join (scan->threads[i], NULL);
+
+    g_hash_table_iter_init (&iter, scan->dirs);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+	if (value != SCAN_QUEUED && value != SCAN_BUSY)
+	    _scanned_dir_free (value);
+    g_hash_table_destroy (scan->dirs);
+    g_ptr_array_free (scan->todo, TRUE);
+
+    pthread_cond_destroy (&scan->scanned);
+    pthread_cond_destroy (&scan->queued);
+    pthread_mutex_destroy (&scan->lock);
+
+    return 0;
+}
+
+/* Start 'jobs' threads walking the mail store below 'path'. */
+static scan_ahead_t *
+scan_ahead_create (const void *ctx, add_files_state_t *state,
+		   const char *path, int jobs)
+{
+    scan_ahead_t *scan;
+
+    scan = talloc_zero (ctx, scan_ahead_t);
+    if (scan == NULL)
+	return NULL;
+
+    scan->state = state;
+    scan->threads = talloc_array (scan, pthread_t, jobs);
+    if (scan->threads == NULL) {
+	talloc_free (scan);
+	return NULL;
+    }
+
+    pthread_mutex_init (&scan->lock, NULL);
+    pthread_cond_init (&scan->queued, NULL);
+    pthread_cond_init (&scan->scanned, NULL);
+    scan->todo = g_ptr_array_new_with_free_func (g_free);
+    scan->dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+					g_free, NULL);
+    talloc_set_destructor (scan, scan_ahead_destroy);
+
+    _scan_ahead_queue (scan, g_strdup (path));
+
+    while (scan->num_threads < jobs &&
+	   pthread_create (&scan->threads[scan->num_threads], NULL,
+			   scan_ahead_worker, scan) == 0)
+	scan->num_threads++;
+
+    if (scan->num_threads == 0) {
+	talloc_free (scan);
+	return NULL;
+    }
+
+    return scan;
+}
+#endif
+
+/* If the directory 'path' has been scanned ahead (see scan_ahead_t),
+ * fill in 'st', and the entries of the directory if it was read
+ * (otherwise NULL), and return TRUE. */
+static notmuch_bool_t
+scan_ahead_take (add_files_state_t *state, const char *path,
+		 struct stat *st, struct dirent ***entries, int *num_entries)
+{
+#if HAVE_PTHREAD
+    scan_ahead_t *scan = state->scan_ahead;
+    scanned_dir_t *dir;
+    gpointer value;
+
+    if (scan == NULL)
+	return FALSE;
+
+    pthread_mutex_lock (&scan->lock);
+    if (! g_hash_table_lookup_extended (scan->dirs, path, NULL, &value)) {
+	pthread_mutex_unlock (&scan->lock);
+	return FALSE;
+    }
+
+    while (value == SCAN_QUEUED || value == SCAN_BUSY) {
+	if (value == SCAN_QUEUED) {
+	    scan->wanted = path;
+	    pthread_cond_signal (&scan->queued);
+	}
+	pthread_cond_wait (&scan->scanned, &scan->lock);
+	value = g_hash_table_lookup (scan->dirs, path);
+    }
+    scan->wanted = NULL;
+    g_hash_table_remove (scan->dirs, path);
+    pthread_mutex_unlock (&scan->lock);
+
+    dir = value;
+    if (dir == NULL)
+	return FALSE;
+
+    *st = dir->st;
+    *entries = dir->entries;
+    *num_entries = dir->num_entries;
+    dir->entries = NULL;
+    _scanned_dir_free (dir);
+
+    return TRUE;
+#else
+    (void) state;
+    (void) path;
+    (void) st;
+    (void) entries;
+    (void) num_entries;
+    return FALSE;
+#endif
+}
+
+#if HAVE_INOTIFY
+/* The events notmuch watch asks for on each directory.  Files are
+ * picked up once they have been written (IN_CLOSE_WRITE), linked
+ * (IN_CREATE) or renamed (IN_MOVED_TO) into place. */
+#define WATCH_EVENTS (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | \
+		      IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct _watch {
+    int fd;
+
+    /* Map from watch descriptor to the path of its directory. */
+    GHashTable *directories;
+
+    /* The changes seen since the database was last updated, in the
+     * order they were seen, allocated from 'changes'. */
+    void *changes;
+    _filename_list_t *added_files;
+    _filename_list_t *removed_files;
+    _filename_list_t *added_directories;
+    _filename_list_t *removed_directories;
+
+    /* Files that have been modified but not yet closed, which are
+     * left alone until they are complete. */
+    GHashTable *writing;
+
+    /* TRUE if events were lost, so that only a full scan will do. */
+    notmuch_bool_t rescan;
+
+    /* TRUE if there are changes to apply, since 'pending_since'. */
+    notmuch_bool_t pending;
+    struct timeval pending_since;
+} watch_t;
+
+/* Start watching the directory 'path' for changes. */
+static notmuch_status_t
+watch_directory (watch_t *watch, const char *path)
+{
+    int wd;
+
+    wd = inotify_add_watch (watch->fd, path, WATCH_EVENTS);
+    if (wd < 0) {
+	fprintf (stderr, "Error watching directory %s: %s\n",
+		 path, strerror (errno));
+	if (errno == ENOSPC)
+	    fprintf (stderr, "Note: Raising fs.inotify.max_user_watches may help.\n");
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    /* Watching a directory again, e.g. after it was moved, reuses
+     * its watch descriptor. */
+    g_hash_table_insert (watch->directories, GINT_TO_POINTER (wd),
+			 g_strdup (path));
+    return NOTMUCH_STATUS_SUCCESS;
+}
+#endif
+
+/* A manifest of the entries of a directory: their number and the sum
+ * of a hash of the name and inode of each, so that it does not depend
+ * on the order scandir returned them in.  Ignored entries are left
+ * out, so that changing new.ignore changes the manifest. */
+static char *
+directory_manifest (const void *ctx, struct dirent **fs_entries,
+		    int num_fs_entries, add_files_state_t *state)
+{
+    uint64_t sum = 0, hash;
+    int i, count = 0;
+    const unsigned char *p;
+    size_t j;
+
+    for (i = 0; i < num_fs_entries; i++) {
+	struct dirent *entry = fs_entries[i];
+	uint64_t ino = entry->d_ino;
+
+	if (_entry_in_ignore_list (entry->d_name, state))
+	    continue;
+
+	/* FNV-1a */
+	hash = 14695981039346656037ULL;
+	for (p = (const unsigned char *) entry->d_name; *p; p++)
+	    hash = (hash ^ *p) * 1099511628211ULL;
+	for (j = 0; j < sizeof (ino); j++, ino >>= 8)
+	    hash = (hash ^ (ino & 0xff)) * 1099511628211ULL;
+
+	sum += hash;
+	count++;
+    }
+
+    return talloc_asprintf (ctx, "%d:%016" PRIx64, count, sum);
+}
+
+/* Queue up what to record of the directory 'path' once add_files is
+ * done, see remove_missing. */
+static void
+queue_directory_mtime (add_files_state_t *state, const char *path,
+		       time_t fs_mtime, long fs_mtime_nsec, time_t stat_time,
+		       const char *manifest)
+{
+    _filename_node_t *node;
+
+    /* If the directory's mtime is the same as the wall-clock time
+     * when we stat'ed the directory, we skip updating the mtime in
+     * the database because a message could be delivered later in this
+     * same second.  This may lead to unnecessary re-scans, but it
+     * avoids overlooking messages; the manifest, if any, spares
+     * those re-scans that find nothing new. */
+    if (fs_mtime == stat_time && manifest == NULL)
+	return;
+
+    node = _filename_list_add (state->directory_mtimes, path);
+    if (fs_mtime != stat_time) {
+	node->has_mtime = TRUE;
+	node->mtime = fs_mtime;
+	node->mtime_nsec = fs_mtime_nsec;
+    }
+    if (manifest)
+	node->manifest = talloc_strdup (state->directory_mtimes, manifest);
+}
+
+/* Return TRUE if 'path' starts with a From_ line, as an mbox does. */
+static notmuch_bool_t
+file_is_mbox (const char *path)
+{
+    char from_buf[5];
+    notmuch_bool_t ret = FALSE;
+    FILE *file;
+
+    file = fopen (path, "r");
+    if (file == NULL)
+	return FALSE;
+
+    if (fread (from_buf, sizeof (from_buf), 1, file) == 1 &&
+	strncmp (from_buf, "From ", 5) == 0)
+	ret = TRUE;
+
+    fclose (file);
+
+    return ret;
+}
+
+/* Return TRUE if 'path' is an mbox whose messages are indexed in
+ * place: one indexed so before, or one not yet indexed at all (where
+ * a single-message mbox indexed as a file stays a file). */
+static notmuch_bool_t
+is_mbox_in_place (notmuch_database_t *notmuch, const char *path)
+{
+    notmuch_directory_t *directory;
+    notmuch_message_t *message;
+
+    if (notmuch_database_get_directory (notmuch, path, &directory) ==
+	NOTMUCH_STATUS_SUCCESS && directory) {
+	notmuch_directory_destroy (directory);
+	return TRUE;
+    }
+
+    if (! file_is_mbox (path) ||
+	notmuch_database_find_message_by_filename (notmuch, path, &message))
+	return FALSE;
+
+    if (message) {
+	notmuch_message_destroy (message);
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Return TRUE if a message of 'file' starts at 'offset', that is,
+ * there is a From_ line there, after an empty line. */
+static notmuch_bool_t
+mbox_message_starts_at (FILE *file, off_t offset)
+{
+    char buf[8];
+
+    if (offset < 3 || fseeko (file, offset - 3, SEEK_SET) ||
+	fread (buf, sizeof (buf), 1, file) != 1)
+	return FALSE;
+
+    return strncmp (buf + 3, "From ", 5) == 0 && buf[2] == '\n' &&
+	(buf[1] == '\n' || (buf[1] == '\r' && buf[0] == '\n'));
+}
+
+/* Add the message of 'length' bytes at 'offset' of the mbox 'path',
+ * and if 'names' is not NULL, record its name there. */
+static notmuch_status_t
+add_mbox_message (notmuch_database_t *notmuch, const char *path,
+		  off_t offset, off_t length, GHashTable *names,
+		  add_files_state_t *state)
+{
+    notmuch_status_t status;
+    char *filename;
+
+    if (length <= 0)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    filename = mbox_member_name (notmuch, path, offset, length);
+    if (filename == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    state->processed_files++;
+
+    if (state->verbosity >= VERBOSITY_VERBOSE) {
+	if (state->output_is_a_tty)
+	    printf("\r\033[K");
+
+	printf ("%i/%i: %s", state->processed_files, state->total_files,
+		filename);
+
+	putchar((state->output_is_a_tty) ? '\r' : '\n');
+	fflush (stdout);
+    }
+
+#if HAVE_PTHREAD
+    if (state->pipeline)
+	status = index_pipeline_submit (state->pipeline, filename, state);
+    else
+#endif
+	status = add_file (notmuch, filename, NULL, state);
+
+    if (names)
+	g_hash_table_insert (names, g_strdup (filename + strlen (path) + 1),
+			     NULL);
+    talloc_free (filename);
+
+    return status;
+}
+
+/* Index the messages of the mbox 'path' in place, each named by its
+ * place in the mbox (see mbox-util.h).
+ *
+ * The directory document of 'path' records the mtime of the mbox
+ * and, as its manifest, the size that was indexed.  If neither has
+ * changed, the mbox is not read.  If it has only grown, so that a
+ * message starts where it used to end, just the messages appended
+ * are read.  Otherwise it was rewritten, and is read again from the
+ * start; the names of messages that are no longer where they were
+ * are queued for removal like those of removed files, once the
+ * messages have been added under their new names. */
+static notmuch_status_t
+add_mbox_file (notmuch_database_t *notmuch, const char *path,
+	       add_files_state_t *state)
+{
+    notmuch_directory_t *directory = NULL;
+    notmuch_filenames_t *files;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    GHashTable *names = NULL;
+    const char *db_manifest;
+    char *line = NULL, *manifest;
+    size_t line_size = 0;
+    ssize_t line_len;
+    off_t start = 0, pos, message = -1, blank_len = 0;
+    long long db_size = -1;
+    long mtime_nsec;
+    notmuch_bool_t blank = TRUE;
+    time_t stat_time;
+    struct stat st;
+    FILE *file = NULL;
+
+    if (stat (path, &st)) {
+	fprintf (stderr, "Error reading mbox %s: %s\n",
+		 path, strerror (errno));
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+    stat_time = time (NULL);
+#if HAVE_ST_MTIM
+    mtime_nsec = st.st_mtim.tv_nsec;
+#else
+    mtime_nsec = -1;
+#endif
+
+    status = notmuch_database_get_directory (notmuch, path, &directory);
+    if (status)
+	return status;
+
+    db_manifest = directory ? notmuch_directory_get_manifest (directory) : NULL;
+    if (db_manifest == NULL || sscanf (db_manifest, "mbox:%lld", &db_size) != 1)
+	db_size = -1;
+
+    if (db_size == st.st_size &&
+	st.st_mtime == notmuch_directory_get_mtime (directory) &&
+	(mtime_nsec < 0 ||
+	 notmuch_directory_get_mtime_nsec (directory) < 0 ||
+	 mtime_nsec == notmuch_directory_get_mtime_nsec (directory))) {
+	if (state->debug)
+	    printf ("(D) add_mbox_file: %s unchanged\n", path);
+	goto DONE;
+    }
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+	fprintf (stderr, "Error reading mbox %s: %s\n",
+		 path, strerror (errno));
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    if (db_size > 0 && db_size < st.st_size &&
+	mbox_message_starts_at (file, db_size)) {
+	start = db_size;
+    } else if (directory) {
+	/* The names of the messages found, to tell which of those in
+	 * the database are gone. */
+	names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    if (state->debug)
+	printf ("(D) add_mbox_file: reading %s from byte %lld\n",
+		path, (long long) start);
+
+    if (fseeko (file, start, SEEK_SET)) {
+	fprintf (stderr, "Error reading mbox %s: %s\n",
+		 path, strerror (errno));
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    /* As for notmuch insert --batch=mbox, a message ends at a From_
+     * line following an empty line, which belongs to neither. */
+    pos = start;
+    while ((line_len = getline (&line, &line_size, file)) != -1) {
+	if (interrupted)
+	    goto DONE;
+
+	if (blank && STRNCMP_LITERAL (line, "From ") == 0) {
+	    if (message >= 0) {
+		status = add_mbox_message (notmuch, path, message,
+					   pos - blank_len - message,
+					   names, state);
+		if (status)
+		    goto DONE;
+	    }
+	    message = pos + line_len;
+	}
+
+	blank = strcmp (line, "\n") == 0 || strcmp (line, "\r\n") == 0;
+	blank_len = blank ? line_len : 0;
+	pos += line_len;
+    }
+
+    if (ferror (file)) {
+	fprintf (stderr, "Error reading mbox %s: %s\n",
+		 path, strerror (errno));
+	status = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    if (message >= 0) {
+	status = add_mbox_message (notmuch, path, message,
+				   pos - blank_len - message, names, state);
+	if (status)
+	    goto DONE;
+    }
+
+    if (names) {
+	for (files = notmuch_directory_get_child_files (directory);
+	     notmuch_filenames_valid (files);
+	     notmuch_filenames_move_to_next (files))
+	{
+	    const char *name = notmuch_filenames_get (files);
+
+	    if (! g_hash_table_lookup_extended (names, name, NULL, NULL)) {
+		char *absolute = talloc_asprintf (state->removed_files,
+						  "%s/%s", path, name);
+		if (state->debug)
+		    printf ("(D) add_mbox_file: queuing moved message %s for deletion from database\n",
+			    absolute);
+
+		_filename_list_add (state->removed_files, absolute);
+	    }
+	}
+	notmuch_filenames_destroy (files);
+    }
+
+    /* Record how much was read, which is more than st.st_size if
+     * the mbox grew meanwhile; its mtime then tells to look again. */
+    manifest = talloc_asprintf (notmuch, "mbox:%lld", (long long) pos);
+    queue_directory_mtime (state, path, st.st_mtime, mtime_nsec, stat_time,
+			   manifest);
+    talloc_free (manifest);
+
+  DONE:
+    free (line);
+    if (file)
+	fclose (file);
+    if (names)
+	g_hash_table_destroy (names);
+    if (directory)
+	notmuch_directory_destroy (directory);
+
+    return status;
+}
+
+/* Examine 'path' recursively as follows:
+ *
+ *   o Ask the filesystem for the mtime of 'path' (fs_mtime)
+ *   o Ask the database for its timestamp of 'path' (db_mtime)
+ *
+ *   o Ask the filesystem for files and directories within 'path'
+ *     (via scandir and stored in fs_entries)
+ *
+ *   o Pass 1: For each directory in fs_entries, recursively call into
+ *     this same function.  With new.mbox, also look for changes in
+ *     each mbox indexed before, (such mboxes are directories to the
+ *     database, but appending to one leaves the mtime of 'path'
+ *     alone).
+ *
+ *   o Compare fs_mtime to db_mtime, to the nanosecond where both
+ *     are known. If they are equivalent, terminate the algorithm at
+ *     this point, (this directory has not been updated in the
+ *     filesystem since the last database scan of PASS 2).
+ *
+ *   o With new.manifests, compare a manifest of fs_entries to the
+ *     one recorded at the last scan. If they are equal, the entries
+ *     have not changed (though the mtime did, or was too recent to be
+ *     recorded), so terminate the algorithm here too, recording the
+ *     new mtime.
+ *
+ *   o Ask the database for files and directories within 'path'
+ *     (db_files and db_subdirs)
+ *
+ *   o Pass 2: Walk fs_entries simultaneously with db_files and
+ *     db_subdirs. Look for one of three interesting cases:
+ *
+ *	   1. Regular file in fs_entries and not in db_files
+ *            This is a new file to add_message into the database,
+ *            or with new.mbox, a new mbox to add_mbox_file.
+ *
+ *         2. Filename in db_files not in fs_entries.
+ *            This is a file that has been removed from the mail store.
+ *
+ *         3. Directory in db_subdirs not in fs_entries
+ *            This is a directory that has been removed from the mail store.
+ *
+ *     Note that the addition of a directory is not interesting here,
+ *     since that will have been taken care of in pass 1. Also, we
+ *     don't immediately act on file/directory removal since we must
+ *     ensure that in the case of a rename that the new filename is
+ *     added before the old filename is removed, (so that no
+ *     information is lost from the database).
+ *
+ *   o Tell the database to update its time of 'path' to 'fs_mtime'
+ *     if fs_mtime isn't the current wall-clock time, and, with
+ *     new.manifests, its manifest.
+ */
+static notmuch_status_t
+add_files (notmuch_database_t *notmuch,
+	   const char *path,
+	   add_files_state_t *state)
+{
+    struct dirent *entry = NULL;
+    char *next = NULL, *manifest = NULL;
+    time_t fs_mtime, db_mtime;
+    long fs_mtime_nsec, db_mtime_nsec;
+    notmuch_bool_t mtime_unchanged;
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+    struct dirent **fs_entries = NULL;
+    int i, num_fs_entries = 0, entry_type;
+    notmuch_directory_t *directory;
+    notmuch_filenames_t *db_files = NULL;
+    notmuch_filenames_t *db_subdirs = NULL;
+    notmuch_filenames_t *db_mboxes = NULL;
+    time_t stat_time;
+    struct stat st;
+    notmuch_bool_t is_maildir, scanned, moved, is_db_subdir;
+    stats_timer_t timer;
+
+    state->directories++;
+
+    scanned = scan_ahead_take (state, path, &st,
+			       &fs_entries, &num_fs_entries);
+    if (! scanned) {
+	stats_start (state, &timer);
+	if (stat (path, &st)) {
+	    fprintf (stderr, "Error reading directory %s: %s\n",
+		     path, strerror (errno));
+	    return NOTMUCH_STATUS_FILE_ERROR;
+	}
+	stats_stop (state, &timer, &state->stat_phase);
+    }
+    stat_time = time (NULL);
+
+    if (! S_ISDIR (st.st_mode)) {
+	fprintf (stderr, "Error: %s is not a directory.\n", path);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    fs_mtime = st.st_mtime;
+#if HAVE_ST_MTIM
+    fs_mtime_nsec = st.st_mtim.tv_nsec;
+#else
+    fs_mtime_nsec = -1;
+#endif
+
+    status = notmuch_database_get_directory (notmuch, path, &directory);
+    if (status) {
+	ret = status;
+	goto DONE;
+    }
+    db_mtime = directory ? notmuch_directory_get_mtime (directory) : 0;
+    db_mtime_nsec = directory ? notmuch_directory_get_mtime_nsec (directory) : -1;
+
+    /* Databases written by older versions only have seconds. */
+    mtime_unchanged = directory && fs_mtime == db_mtime &&
+	(fs_mtime_nsec < 0 || db_mtime_nsec < 0 ||
+	 fs_mtime_nsec == db_mtime_nsec);
+
+#if HAVE_INOTIFY
+    if (state->watch) {
+	status = watch_directory (state->watch, path);
+	if (status) {
+	    ret = status;
+	    goto DONE;
+	}
+    }
+#endif
+
+    /* If the directory is unchanged from our last scan and has no
+     * sub-directories, then return without scanning it at all.  In
+     * some situations, skipping the scan can substantially reduce the
+     * cost of notmuch new, especially since the huge numbers of files
+     * in Maildirs make scans expensive, but all files live in leaf
+     * directories.
+     *
+     * To check for sub-directories, we borrow a trick from find,
+     * kpathsea, and many other UNIX tools: since a directory's link
+     * count is the number of sub-directories (specifically, their
+     * '..' entries) plus 2 (the link from the parent and the link for
+     * '.').  This check is safe even on weird file systems, since
+     * file systems that can't compute this will return 0 or 1.  This
+     * is safe even on *really* weird file systems like HFS+ that
+     * mistakenly return the total number of directory entries, since
+     * that only inflates the count beyond 2.
+     */
+    if (mtime_unchanged && st.st_nlink == 2) {
+	/* There's one catch: pass 1 below considers symlinks to
+	 * directories to be directories, but these don't increase the
+	 * file system link count.  So, only bail early if the
+	 * database agrees that there are no sub-directories. */
+	db_subdirs = notmuch_directory_get_child_directories (directory);
+	if (!notmuch_filenames_valid (db_subdirs)) {
+	    state->skipped_directories++;
+	    goto DONE;
+	}
+	notmuch_filenames_destroy (db_subdirs);
+	db_subdirs = NULL;
+    }
+
+    /* If the database knows about this directory, then we sort based
+     * on strcmp to match the database sorting. Otherwise, we can do
+     * inode-based sorting for faster filesystem operation. */
+    stats_start (state, &timer);
+    if (fs_entries) {
+	/* Read ahead, but still to be sorted. */
+	qsort (fs_entries, num_fs_entries, sizeof (*fs_entries),
+	       directory ?
+	       _qsort_dirent_strcmp_name : _qsort_dirent_inode);
+    } else {
+	num_fs_entries = scandir (path, &fs_entries, 0,
+				  directory ?
+				  dirent_sort_strcmp_name : dirent_sort_inode);
+    }
+    stats_stop (state, &timer, &state->scan_phase);
+
+    if (num_fs_entries == -1) {
+	fprintf (stderr, "Error opening directory %s: %s\n",
+		 path, strerror (errno));
+	/* We consider this a fatal error because, if a user moved a
+	 * message from another directory that we were able to scan
+	 * into this directory, skipping this directory will cause
+	 * that message to be lost. */
+	ret = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    /* Pass 1: Recurse into all sub-directories. */
+    is_maildir = _entries_resemble_maildir (path, fs_entries, num_fs_entries);
+
+    if (state->mbox && directory)
+	db_mboxes = notmuch_directory_get_child_directories (directory);
+
+    for (i = 0; i < num_fs_entries; i++) {
+	if (interrupted)
+	    break;
+
+	entry = fs_entries[i];
+
+	/* Ignore any files/directories the user has configured to
+	 * ignore.  We do this before dirent_type both for performance
+	 * and because we don't care if dirent_type fails on entries
+	 * that are explicitly ignored.
+	 */
+	if (_entry_in_ignore_list (entry->d_name, state)) {
+	    if (state->debug)
+		printf ("(D) add_files, pass 1: explicitly ignoring %s/%s\n",
+			path, entry->d_name);
+	    continue;
+	}
+
+	/* We only want to descend into directories (and symlinks to
+	 * directories). */
+	stats_start (state, &timer);
+	entry_type = dirent_type (path, entry);
+	stats_stop (state, &timer, &state->stat_phase);
+	if (entry_type == -1) {
+	    /* Be pessimistic, e.g. so we don't lose lots of mail just
+	     * because a user broke a symlink. */
+	    fprintf (stderr, "Error reading file %s/%s: %s\n",
+		     path, entry->d_name, strerror (errno));
+	    return NOTMUCH_STATUS_FILE_ERROR;
+	} else if (entry_type != S_IFDIR) {
+	    /* A regular file that the database has as a directory is
+	     * an mbox indexed before. */
+	    while (entry_type == S_IFREG &&
+		   notmuch_filenames_valid (db_mboxes) &&
+		   strcmp (notmuch_filenames_get (db_mboxes), entry->d_name) <= 0)
+	    {
+		if (strcmp (notmuch_filenames_get (db_mboxes), entry->d_name) == 0) {
+		    next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
+		    status = add_mbox_file (notmuch, next, state);
+		    if (status) {
+			ret = status;
+			goto DONE;
+		    }
+		    talloc_free (next);
+		    next = NULL;
+		}
+		notmuch_filenames_move_to_next (db_mboxes);
+	    }
+	    continue;
+	}
+
+	/* Ignore special directories to avoid infinite recursion.
+	 * Also ignore the .notmuch directory and any "tmp" directory
+	 * that appears within a maildir.
+	 */
+	if (strcmp (entry->d_name, ".") == 0 ||
+	    strcmp (entry->d_name, "..") == 0 ||
+	    (is_maildir && strcmp (entry->d_name, "tmp") == 0) ||
+	    strcmp (entry->d_name, ".notmuch") == 0)
+	    continue;
+
+	next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
+	status = add_files (notmuch, next, state);
+	if (status) {
+	    ret = status;
+	    goto DONE;
+	}
+	talloc_free (next);
+	next = NULL;
+    }
+
+    /* If the directory's modification time in the filesystem is the
+     * same as what we recorded in the database the last time we
+     * scanned it, then we can skip the second pass entirely.
+     *
+     * We test for strict equality here to avoid a bug that can happen
+     * if the system clock jumps backward, (preventing new mail from
+     * being discovered until the clock catches up and the directory
+     * is modified again).
+     */
+    if (mtime_unchanged) {
+	state->skipped_directories++;
+	goto DONE;
+    }
+
+    if (state->manifests) {
+	const char *db_manifest;
+
+	manifest = directory_manifest (notmuch, fs_entries, num_fs_entries,
+				       state);
+	db_manifest = directory ? notmuch_directory_get_manifest (directory) : NULL;
+	if (db_manifest && strcmp (manifest, db_manifest) == 0) {
+	    if (state->debug)
+		printf ("(D) add_files, pass 2: manifest of %s unchanged\n",
+			path);
+	    queue_directory_mtime (state, path, fs_mtime, fs_mtime_nsec,
+				   stat_time, NULL);
+	    state->skipped_directories++;
+	    goto DONE;
+	}
+    }
+
+    /* If the database has never seen this directory before, we can
+     * simply leave db_files and db_subdirs NULL. */
+    if (directory) {
+	db_files = notmuch_directory_get_child_files (directory);
 	db_subdirs = notmuch_directory_get_child_directories (directory);
     }
 
@@ -539,12 +1878,17 @@ add_files (notmuch_database_t *notmuch,
 	    notmuch_filenames_move_to_next (db_files);
 	}
 
+	is_db_subdir = FALSE;
 	while (notmuch_filenames_valid (db_subdirs) &&
 	       strcmp (notmuch_filenames_get (db_subdirs), entry->d_name) <= 0)
 	{
 	    const char *filename = notmuch_filenames_get (db_subdirs);
 
-	    if (strcmp (filename, entry->d_name) < 0)
+	    if (strcmp (filename, entry->d_name) == 0)
+	    {
+		is_db_subdir = TRUE;
+	    }
+	    else
 	    {
 		char *absolute = talloc_asprintf (state->removed_directories,
 						  "%s/%s", path, filename);
@@ -559,7 +1903,9 @@ add_files (notmuch_database_t *notmuch,
 	}
 
 	/* Only add regular files (and symlinks to regular files). */
+	stats_start (state, &timer);
 	entry_type = dirent_type (path, entry);
+	stats_stop (state, &timer, &state->stat_phase);
 	if (entry_type == -1) {
 	    fprintf (stderr, "Error reading file %s/%s: %s\n",
 		     path, entry->d_name, strerror (errno));
@@ -580,6 +1926,22 @@ add_files (notmuch_database_t *notmuch,
 	 * in the database, so add it. */
 	next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
 
+	/* An mbox, unless pass 1 has seen to it already. */
+	if (state->mbox && (is_db_subdir || file_is_mbox (next))) {
+	    if (! is_db_subdir) {
+		stats_start (state, &timer);
+		status = add_mbox_file (notmuch, next, state);
+		stats_stop (state, &timer, &state->add_phase);
+		if (status) {
+		    ret = status;
+		    goto DONE;
+		}
+	    }
+	    talloc_free (next);
+	    next = NULL;
+	    continue;
+	}
+
 	state->processed_files++;
 
 	if (state->verbosity >= VERBOSITY_VERBOSE) {
@@ -593,7 +1955,17 @@ add_files (notmuch_database_t *notmuch,
 	    fflush (stdout);
 	}
 
-	status = add_file (notmuch, next, state);
+	stats_start (state, &timer);
+	status = add_moved_file (notmuch, next, state, &moved);
+	if (status == NOTMUCH_STATUS_SUCCESS && ! moved) {
+#if HAVE_PTHREAD
+	    if (state->pipeline)
+		status = index_pipeline_submit (state->pipeline, next, state);
+	    else
+#endif
+		status = add_file (notmuch, next, NULL, state);
+	}
+	stats_stop (state, &timer, &state->add_phase);
 	if (status) {
 	    ret = status;
 	    goto DONE;
@@ -604,6 +1976,7 @@ add_files (notmuch_database_t *notmuch,
 	    generic_print_progress ("Processed", "files", state->tv_start,
 				    state->processed_files, state->total_files);
 	}
+	notmuch_memstats_poll ();
 
 	talloc_free (next);
 	next = NULL;
@@ -643,23 +2016,22 @@ add_files (notmuch_database_t *notmuch,
 	notmuch_filenames_move_to_next (db_subdirs);
     }
 
-    /* If the directory's mtime is the same as the wall-clock time
-     * when we stat'ed the directory, we skip updating the mtime in
-     * the database because a message could be delivered later in this
-     * same second.  This may lead to unnecessary re-scans, but it
-     * avoids overlooking messages. */
-    if (fs_mtime != stat_time)
-	_filename_list_add (state->directory_mtimes, path)->mtime = fs_mtime;
+    queue_directory_mtime (state, path, fs_mtime, fs_mtime_nsec, stat_time,
+			   manifest);
 
   DONE:
     if (next)
 	talloc_free (next);
+    if (manifest)
+	talloc_free (manifest);
     if (fs_entries) {
 	for (i = 0; i < num_fs_entries; i++)
 	    free (fs_entries[i]);
 
 	free (fs_entries);
     }
+    if (db_mboxes)
+	notmuch_filenames_destroy (db_mboxes);
     if (db_subdirs)
 	notmuch_filenames_destroy (db_subdirs);
     if (db_files)
@@ -834,6 +2206,8 @@ remove_filename (notmuch_database_t *notmuch,
 
   DONE:
     notmuch_database_end_atomic (notmuch);
+    if (status == NOTMUCH_STATUS_SUCCESS)
+	status = batch_step (notmuch, add_files_state);
     return status;
 }
 
@@ -886,6 +2260,76 @@ _remove_directory (void *ctx,
     return status;
 }
 
+/* Act on what add_files queued up: remove the files and directories
+ * that have disappeared from the mail store, now that any renamed
+ * files have been added under their new names, and then record the
+ * mtimes of the directories that were scanned. */
+static notmuch_status_t
+remove_missing (void *ctx, notmuch_database_t *notmuch,
+		add_files_state_t *state)
+{
+    struct timeval tv_start;
+    _filename_node_t *f;
+    unsigned int i;
+    notmuch_status_t status, end_status;
+
+    /* Bring the ghosts of the threads losing messages up to date once
+     * for each thread, rather than once for each message, which adds
+     * up for a removed folder. */
+    status = notmuch_database_begin_removals (notmuch);
+    if (status)
+	return status;
+
+    gettimeofday (&tv_start, NULL);
+    for (f = state->removed_files->head; f && !interrupted; f = f->next) {
+	status = remove_filename (notmuch, f->filename, state);
+	if (status)
+	    goto DONE;
+	if (do_print_progress) {
+	    do_print_progress = 0;
+	    generic_print_progress ("Cleaned up", "messages",
+		tv_start, state->removed_messages + state->renamed_messages,
+		state->removed_files->count);
+	}
+	notmuch_memstats_poll ();
+    }
+
+    gettimeofday (&tv_start, NULL);
+    for (f = state->removed_directories->head, i = 0; f && !interrupted; f = f->next, i++) {
+	status = _remove_directory (ctx, notmuch, f->filename, state);
+	if (status)
+	    goto DONE;
+	if (do_print_progress) {
+	    do_print_progress = 0;
+	    generic_print_progress ("Cleaned up", "directories",
+		tv_start, i,
+		state->removed_directories->count);
+	}
+    }
+
+  DONE:
+    end_status = notmuch_database_end_removals (notmuch);
+    if (status)
+	return status;
+    if (end_status)
+	return end_status;
+
+    for (f = state->directory_mtimes->head; f && !interrupted; f = f->next) {
+	notmuch_directory_t *directory;
+	status = notmuch_database_get_directory (notmuch, f->filename, &directory);
+	if (status == NOTMUCH_STATUS_SUCCESS && directory) {
+	    if (f->has_mtime)
+		notmuch_directory_set_mtime_ns (directory, f->mtime,
+						f->mtime_nsec);
+	    if (f->manifest)
+		notmuch_directory_set_manifest (directory, f->manifest);
+	    notmuch_directory_destroy (directory);
+	}
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 static void
 print_results (const add_files_state_t *state)
 {
@@ -912,15 +2356,222 @@ print_results (const add_files_state_t *state)
     else
 	printf ("No new mail.");
 
-    if (state->removed_messages)
-	printf (" Removed %d %s.", state->removed_messages,
-		state->removed_messages == 1 ? "message" : "messages");
+    if (state->removed_messages)
+	printf (" Removed %d %s.", state->removed_messages,
+		state->removed_messages == 1 ? "message" : "messages");
+
+    if (state->renamed_messages)
+	printf (" Detected %d file %s.", state->renamed_messages,
+		state->renamed_messages == 1 ? "rename" : "renames");
+
+    printf ("\n");
+}
+
+/* Print what --stats=json gathered as a JSON object on stdout.  The
+ * "add" phase includes the library phases that follow it, and
+ * "commit" includes the closing of the database. */
+static void
+print_stats (const add_files_state_t *state)
+{
+    const notmuch_profile_t *profile = &state->profile;
+    notmuch_profile_phase_t total = { 0, 0, 1 };
+    const struct {
+	const char *name;
+	const notmuch_profile_phase_t *phase;
+    } phases[] = {
+	{ "stat", &state->stat_phase },
+	{ "scan", &state->scan_phase },
+	{ "add", &state->add_phase },
+	{ "read_headers", &profile->read_headers },
+	{ "index_terms", &profile->index_terms },
+	{ "link_threads", &profile->link_threads },
+	{ "write_documents", &profile->write_documents },
+	{ "commit", &profile->commit },
+	{ "remove", &state->remove_phase },
+    };
+    size_t i;
+
+    stats_stop (state, &state->run_timer, &total);
+    total.calls = 1;
+
+    printf ("{\"files\": %d, \"added\": %d, \"removed\": %d, \"renamed\": %d, "
+	    "\"directories\": %d, \"skipped_directories\": %d, "
+	    "\"files_opened\": %lu, \"documents\": %lu, \"flushes\": %lu, "
+	    "\"phases\": {",
+	    state->processed_files, state->added_messages,
+	    state->removed_messages, state->renamed_messages,
+	    state->directories, state->skipped_directories,
+	    profile->files_opened, profile->documents, profile->flushes);
+    for (i = 0; i < ARRAY_SIZE (phases); i++) {
+	notmuch_time_print_phase (stdout, phases[i].name, phases[i].phase);
+	fputs (", ", stdout);
+    }
+    notmuch_time_print_phase (stdout, "total", &total);
+    printf ("}}\n");
+}
+
+/* Check that the tags from new.tags can be added to messages. */
+static notmuch_bool_t
+check_new_tags (const add_files_state_t *state)
+{
+    size_t i;
+
+    for (i = 0; i < state->new_tags_length; i++) {
+	const char *error_msg;
+
+	error_msg = illegal_tag (state->new_tags[i], FALSE);
+	if (error_msg) {
+	    fprintf (stderr, "Error: tag '%s' in new.tags: %s\n",
+		     state->new_tags[i], error_msg);
+	    return FALSE;
+	}
+    }
+
+    return TRUE;
+}
+
+/* Read the tagging rules of new.rules, if set, for the library to
+ * apply to the messages added.  The tags of new.tags become the
+ * first rule, for every message, so that later rules can take them
+ * away again, and add_file then adds no tags of its own. */
+static notmuch_bool_t
+load_tag_rules (notmuch_config_t *config, add_files_state_t *state)
+{
+    static const char *no_tags[] = { NULL };
+    const char *path = notmuch_config_get_new_rules (config);
+    GError *error = NULL;
+    char *contents, *rules;
+    size_t i;
+
+    if (path == NULL || *path == '\0')
+	return TRUE;
+
+    if (*path != '/')
+	path = talloc_asprintf (config, "%s/%s",
+				notmuch_config_get_database_path (config),
+				path);
+
+    if (! g_file_get_contents (path, &contents, NULL, &error)) {
+	fprintf (stderr, "Error: cannot read new.rules: %s\n",
+		 error->message);
+	g_error_free (error);
+	return FALSE;
+    }
+
+    rules = talloc_strdup (config, "");
+    for (i = 0; i < state->new_tags_length && rules; i++) {
+	char *encoded = NULL;
+	size_t size = 0;
+
+	if (hex_encode (config, state->new_tags[i], &encoded, &size)
+	    != HEX_SUCCESS) {
+	    rules = NULL;
+	    break;
+	}
+	rules = talloc_asprintf_append (rules, "+%s ", encoded);
+	talloc_free (encoded);
+    }
+    if (rules && state->new_tags_length)
+	rules = talloc_strdup_append (rules, "--\n");
+    if (rules)
+	rules = talloc_strdup_append (rules, contents);
+    g_free (contents);
+
+    if (rules == NULL) {
+	fprintf (stderr, "Error: out of memory reading new.rules\n");
+	return FALSE;
+    }
+
+    state->tag_rules = rules;
+    state->new_tags = no_tags;
+    state->new_tags_length = 0;
+
+    return TRUE;
+}
+
+/* Start recording the messages added for the post-new hook, from
+ * the current revision of 'notmuch' on, forgetting any recorded
+ * before.  Failing to do so only leaves the hook without them. */
+static void
+new_ids_begin (void *ctx, notmuch_database_t *notmuch,
+	       add_files_state_t *state)
+{
+    const char *tmpdir = getenv ("TMPDIR");
+    int fd;
+
+    state->start_revision = notmuch_database_get_revision (notmuch, NULL);
+
+    if (state->new_ids) {
+	rewind (state->new_ids);
+	if (ftruncate (fileno (state->new_ids), 0) == 0)
+	    return;
+	fclose (state->new_ids);
+	state->new_ids = NULL;
+    } else {
+	state->new_ids_path = talloc_asprintf (ctx, "%s/notmuch-new.XXXXXX",
+					       tmpdir ? tmpdir : "/tmp");
+	if (state->new_ids_path == NULL)
+	    return;
+
+	fd = mkstemp (state->new_ids_path);
+	if (fd >= 0) {
+	    state->new_ids = fdopen (fd, "w");
+	    if (state->new_ids)
+		return;
+	    close (fd);
+	}
+    }
+
+    fprintf (stderr, "Warning: cannot record new messages for the post-new hook: %s\n",
+	     strerror (errno));
+    if (state->new_ids_path)
+	unlink (state->new_ids_path);
+    talloc_free (state->new_ids_path);
+    state->new_ids_path = NULL;
+}
+
+static void
+new_ids_end (add_files_state_t *state)
+{
+    if (state->new_ids == NULL)
+	return;
+
+    fclose (state->new_ids);
+    state->new_ids = NULL;
+    unlink (state->new_ids_path);
+    talloc_free (state->new_ids_path);
+    state->new_ids_path = NULL;
+}
+
+/* Run the post-new hook, telling it in NOTMUCH_NEW_MESSAGE_IDS the
+ * file listing the message ids of the messages added, and in
+ * NOTMUCH_NEW_REVISION the revision of the database before they
+ * were, so that it can restrict its work to them rather than search
+ * the whole database for them. */
+static int
+run_post_new_hook (const char *db_path, add_files_state_t *state)
+{
+    const char *env[3] = { NULL, NULL, NULL };
+    int ret;
+
+    if (state->new_ids) {
+	if (fflush (state->new_ids))
+	    fprintf (stderr, "Warning: cannot record new messages for the post-new hook: %s\n",
+		     strerror (errno));
+	env[0] = talloc_asprintf (state->new_ids_path,
+				  "NOTMUCH_NEW_MESSAGE_IDS=%s",
+				  state->new_ids_path);
+	env[1] = talloc_asprintf (state->new_ids_path,
+				  "NOTMUCH_NEW_REVISION=%lu",
+				  state->start_revision);
+    }
+
+    ret = notmuch_run_hook_env (db_path, "post-new", env);
 
-    if (state->renamed_messages)
-	printf (" Detected %d file %s.", state->renamed_messages,
-		state->renamed_messages == 1 ? "rename" : "renames");
+    talloc_free ((char *) env[0]);
+    talloc_free ((char *) env[1]);
 
-    printf ("\n");
+    return ret;
 }
 
 int
@@ -932,18 +2583,21 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 	.debug = FALSE,
 	.output_is_a_tty = isatty (fileno (stdout)),
     };
-    struct timeval tv_start;
     int ret = 0;
     struct stat st;
     const char *db_path;
     char *dot_notmuch_path;
     struct sigaction action;
-    _filename_node_t *f;
     int opt_index;
-    unsigned int i;
     notmuch_bool_t timer_is_active = FALSE;
     notmuch_bool_t no_hooks = FALSE;
     notmuch_bool_t quiet = FALSE, verbose = FALSE;
+    notmuch_bool_t defer_body = FALSE;
+    const char **recorded_headers;
+    size_t recorded_headers_length;
+    int jobs = 1;
+    stats_format_t stats = STATS_NONE;
+    stats_timer_t timer;
     notmuch_status_t status;
 
     notmuch_opt_desc_t options[] = {
@@ -951,6 +2605,12 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 	{ NOTMUCH_OPT_BOOLEAN,  &verbose, "verbose", 'v', 0 },
 	{ NOTMUCH_OPT_BOOLEAN,  &add_files_state.debug, "debug", 'd', 0 },
 	{ NOTMUCH_OPT_BOOLEAN,  &no_hooks, "no-hooks", 'n', 0 },
+	{ NOTMUCH_OPT_INT, &jobs, "jobs", 'j', 0 },
+	{ NOTMUCH_OPT_BOOLEAN, &defer_body, "defer-body", 0, 0 },
+	{ NOTMUCH_OPT_KEYWORD, &stats, "stats", 0,
+	  (notmuch_keyword_t []){ { "none", STATS_NONE },
+				  { "json", STATS_JSON },
+				  { 0, 0 } } },
 	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
 	{ 0, 0, 0, 0, 0 }
     };
@@ -967,21 +2627,20 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
     else if (verbose)
 	add_files_state.verbosity = VERBOSITY_VERBOSE;
 
+    add_files_state.stats = (stats == STATS_JSON);
+    stats_start (&add_files_state, &add_files_state.run_timer);
+
     add_files_state.new_tags = notmuch_config_get_new_tags (config, &add_files_state.new_tags_length);
     add_files_state.new_ignore = notmuch_config_get_new_ignore (config, &add_files_state.new_ignore_length);
     add_files_state.synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
+    add_files_state.batch_size = notmuch_config_get_new_batch_size (config);
+    add_files_state.manifests = notmuch_config_get_new_manifests (config);
+    add_files_state.mbox = notmuch_config_get_new_mbox (config);
     db_path = notmuch_config_get_database_path (config);
 
-    for (i = 0; i < add_files_state.new_tags_length; i++) {
-	const char *error_msg;
-
-	error_msg = illegal_tag (add_files_state.new_tags[i], FALSE);
-	if (error_msg) {
-	    fprintf (stderr, "Error: tag '%s' in new.tags: %s\n",
-		     add_files_state.new_tags[i], error_msg);
-	    return EXIT_FAILURE;
-	}
-    }
+    if (! check_new_tags (&add_files_state) ||
+	! load_tag_rules (config, &add_files_state))
+	return EXIT_FAILURE;
 
     if (!no_hooks) {
 	ret = notmuch_run_hook (db_path, "pre-new");
@@ -991,6 +2650,12 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 
     dot_notmuch_path = talloc_asprintf (config, "%s/%s", db_path, ".notmuch");
 
+    /* With a memory budget, it alone decides when to flush, unless
+     * the user says otherwise.  Xapian reads this when the database
+     * is opened. */
+    if (notmuch_config_get_new_flush_budget (config) > 0)
+	setenv ("XAPIAN_FLUSH_THRESHOLD", "1000000", 0);
+
     if (stat (dot_notmuch_path, &st)) {
 	int count;
 
@@ -1042,7 +2707,7 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 	    }
 
 	    if (notmuch_database_dump (notmuch, backup_name, "",
-				       DUMP_FORMAT_BATCH_TAG, TRUE)) {
+				       DUMP_FORMAT_BATCH_TAG, -1, TRUE)) {
 		fprintf (stderr, "Backup failed. Aborting upgrade.");
 		return EXIT_FAILURE;
 	    }
@@ -1068,6 +2733,34 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
     if (notmuch == NULL)
 	return EXIT_FAILURE;
 
+    if (add_files_state.stats)
+	notmuch_database_set_profile (notmuch, &add_files_state.profile);
+
+    notmuch_database_set_defer_body (notmuch, defer_body);
+    notmuch_database_set_extract_attachments (
+	notmuch, notmuch_config_get_index_extractor (config) != NULL);
+
+    /* Without new.headers, the library records its default set. */
+    recorded_headers = notmuch_config_get_new_headers (config,
+						       &recorded_headers_length);
+    if (recorded_headers)
+	notmuch_database_set_recorded_headers (notmuch, recorded_headers,
+					       recorded_headers_length);
+    notmuch_database_set_snippet_length (
+	notmuch, notmuch_config_get_new_snippet_length (config));
+    notmuch_database_set_flush_budget (
+	notmuch, (size_t) notmuch_config_get_new_flush_budget (config) << 20);
+
+    status = notmuch_database_set_body_positions (
+	notmuch, notmuch_config_get_index_body_positions (config));
+    if (! status)
+	status = notmuch_database_set_tag_rules (notmuch,
+						 add_files_state.tag_rules);
+    if (print_status_database ("notmuch new", notmuch, status)) {
+	notmuch_database_destroy (notmuch);
+	return EXIT_FAILURE;
+    }
+
     /* Set up our handler for SIGINT. We do this after having
      * potentially done a database upgrade we this interrupt handler
      * won't support. */
@@ -1086,52 +2779,64 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
     add_files_state.removed_directories = _filename_list_create (config);
     add_files_state.directory_mtimes = _filename_list_create (config);
 
+    if (! no_hooks)
+	new_ids_begin (config, notmuch, &add_files_state);
+
     if (add_files_state.verbosity == VERBOSITY_NORMAL &&
 	add_files_state.output_is_a_tty && ! debugger_is_active ()) {
 	setup_progress_printing_timer ();
 	timer_is_active = TRUE;
     }
 
-    ret = add_files (notmuch, db_path, &add_files_state);
+#if HAVE_PTHREAD
+    if (jobs > 1) {
+	add_files_state.pipeline = index_pipeline_create (config, notmuch,
+							  jobs);
+	add_files_state.scan_ahead = scan_ahead_create (config,
+							&add_files_state,
+							db_path, jobs);
+    }
+#endif
+
+    /* A batch that is cut short by a crash is rolled back as a whole.
+     * That is safe because the directory mtimes are only recorded at
+     * the very end: the next run rescans every directory and skips
+     * the files whose filenames did make it into the database. */
+    ret = batch_begin (notmuch, &add_files_state);
     if (ret)
 	goto DONE;
 
-    gettimeofday (&tv_start, NULL);
-    for (f = add_files_state.removed_files->head; f && !interrupted; f = f->next) {
-	ret = remove_filename (notmuch, f->filename, &add_files_state);
-	if (ret)
-	    goto DONE;
-	if (do_print_progress) {
-	    do_print_progress = 0;
-	    generic_print_progress ("Cleaned up", "messages",
-		tv_start, add_files_state.removed_messages + add_files_state.renamed_messages,
-		add_files_state.removed_files->count);
-	}
-    }
+    ret = add_files (notmuch, db_path, &add_files_state);
 
-    gettimeofday (&tv_start, NULL);
-    for (f = add_files_state.removed_directories->head, i = 0; f && !interrupted; f = f->next, i++) {
-	ret = _remove_directory (config, notmuch, f->filename, &add_files_state);
-	if (ret)
-	    goto DONE;
-	if (do_print_progress) {
-	    do_print_progress = 0;
-	    generic_print_progress ("Cleaned up", "directories",
-		tv_start, i,
-		add_files_state.removed_directories->count);
-	}
+#if HAVE_PTHREAD
+    talloc_free (add_files_state.scan_ahead);
+    add_files_state.scan_ahead = NULL;
+
+    if (add_files_state.pipeline) {
+	stats_start (&add_files_state, &timer);
+	if (! ret)
+	    ret = index_pipeline_flush (add_files_state.pipeline,
+					&add_files_state);
+	stats_stop (&add_files_state, &timer, &add_files_state.add_phase);
+	talloc_free (add_files_state.pipeline);
+	add_files_state.pipeline = NULL;
     }
+#endif
 
-    for (f = add_files_state.directory_mtimes->head; f && !interrupted; f = f->next) {
-	notmuch_directory_t *directory;
-	status = notmuch_database_get_directory (notmuch, f->filename, &directory);
-	if (status == NOTMUCH_STATUS_SUCCESS && directory) {
-	    notmuch_directory_set_mtime (directory, f->mtime);
-	    notmuch_directory_destroy (directory);
-	}
-    }
+    if (ret)
+	goto DONE;
+
+    stats_start (&add_files_state, &timer);
+    ret = remove_missing (config, notmuch, &add_files_state);
+    stats_stop (&add_files_state, &timer, &add_files_state.remove_phase);
 
   DONE:
+    /* Commit what was done before an interruption, but leave a batch
+     * cut short by a fatal error for notmuch_database_destroy to
+     * discard. */
+    if (! ret)
+	ret = batch_end (notmuch, &add_files_state);
+
     talloc_free (add_files_state.removed_files);
     talloc_free (add_files_state.removed_directories);
     talloc_free (add_files_state.directory_mtimes);
@@ -1139,7 +2844,8 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
     if (timer_is_active)
 	stop_progress_printing_timer ();
 
-    if (add_files_state.verbosity >= VERBOSITY_NORMAL)
+    if (add_files_state.verbosity >= VERBOSITY_NORMAL &&
+	! add_files_state.stats)
 	print_results (&add_files_state);
 
     if (ret)
@@ -1148,8 +2854,486 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 
     notmuch_database_destroy (notmuch);
 
+    if (add_files_state.stats)
+	print_stats (&add_files_state);
+
     if (!no_hooks && !ret && !interrupted)
-	ret = notmuch_run_hook (db_path, "post-new");
+	ret = run_post_new_hook (db_path, &add_files_state);
+
+    new_ids_end (&add_files_state);
 
     return ret || interrupted ? EXIT_FAILURE : EXIT_SUCCESS;
 }
+
+#if HAVE_INOTIFY
+/* Wait until no events have arrived for WATCH_SETTLE_MS before
+ * updating the database, so that a burst of changes is applied in
+ * one go, but never hold back an update for more than
+ * WATCH_MAX_DELAY_MS. */
+#define WATCH_SETTLE_MS 100
+#define WATCH_MAX_DELAY_MS 1000
+
+/* How long to wait before trying again if the database cannot be
+ * opened, e.g. because another process is writing to it. */
+#define WATCH_RETRY_MS 5000
+
+static void
+watch_reset_changes (watch_t *watch)
+{
+    talloc_free (watch->changes);
+    watch->changes = talloc_new (watch);
+    watch->added_files = _filename_list_create (watch->changes);
+    watch->removed_files = _filename_list_create (watch->changes);
+    watch->added_directories = _filename_list_create (watch->changes);
+    watch->removed_directories = _filename_list_create (watch->changes);
+    watch->pending = FALSE;
+}
+
+static void
+watch_set_pending (watch_t *watch)
+{
+    if (! watch->pending) {
+	watch->pending = TRUE;
+	gettimeofday (&watch->pending_since, NULL);
+    }
+}
+
+static int
+_watch_destructor (watch_t *watch)
+{
+    g_hash_table_destroy (watch->directories);
+    g_hash_table_destroy (watch->writing);
+    close (watch->fd);
+
+    return 0;
+}
+
+static watch_t *
+watch_create (const void *ctx)
+{
+    watch_t *watch;
+
+    watch = talloc_zero (ctx, watch_t);
+    if (watch == NULL)
+	return NULL;
+
+    watch->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) {
+	fprintf (stderr, "Error: Cannot watch for changes: %s\n",
+		 strerror (errno));
+	talloc_free (watch);
+	return NULL;
+    }
+
+    watch->directories = g_hash_table_new_full (g_direct_hash,
+						g_direct_equal,
+						NULL, g_free);
+    watch->writing = g_hash_table_new_full (g_str_hash, g_str_equal,
+					    g_free, NULL);
+    talloc_set_destructor (watch, _watch_destructor);
+
+    watch_reset_changes (watch);
+
+    /* Start with a full scan, which also sets up the watches. */
+    watch->rescan = TRUE;
+    watch_set_pending (watch);
+
+    return watch;
+}
+
+/* Stop watching 'path' and everything below it. */
+static void
+watch_forget_directory (watch_t *watch, const char *path)
+{
+    GHashTableIter iter;
+    gpointer wd, directory;
+    size_t len = strlen (path);
+
+    g_hash_table_iter_init (&iter, watch->directories);
+    while (g_hash_table_iter_next (&iter, &wd, &directory)) {
+	const char *dir = directory;
+
+	if (strncmp (dir, path, len) == 0 &&
+	    (dir[len] == '\0' || dir[len] == '/')) {
+	    inotify_rm_watch (watch->fd, GPOINTER_TO_INT (wd));
+	    g_hash_table_iter_remove (&iter);
+	}
+    }
+}
+
+/* Like _entries_resemble_maildir, for a directory we have not read. */
+static notmuch_bool_t
+_directory_resembles_maildir (const char *path)
+{
+    const char *subdirs[] = { "cur", "new", "tmp" };
+    struct stat st;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE (subdirs); i++) {
+	char *subdir = talloc_asprintf (NULL, "%s/%s", path, subdirs[i]);
+	int err = stat (subdir, &st);
+
+	talloc_free (subdir);
+	if (err || ! S_ISDIR (st.st_mode))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Record the change described by 'event', skipping the same files and
+ * directories that add_files would. */
+static void
+watch_add_event (watch_t *watch, const struct inotify_event *event,
+		 add_files_state_t *state)
+{
+    const char *directory;
+    _filename_list_t *list = NULL;
+    char *path;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+	if (state->verbosity >= VERBOSITY_VERBOSE)
+	    printf ("Missed some changes; rescanning everything.\n");
+	watch->rescan = TRUE;
+	watch_set_pending (watch);
+	return;
+    }
+
+    if (event->mask & IN_IGNORED) {
+	g_hash_table_remove (watch->directories, GINT_TO_POINTER (event->wd));
+	return;
+    }
+
+    directory = g_hash_table_lookup (watch->directories,
+				     GINT_TO_POINTER (event->wd));
+    if (directory == NULL || event->len == 0 ||
+	_entry_in_ignore_list (event->name, state))
+	return;
+
+    path = talloc_asprintf (watch->changes, "%s/%s", directory, event->name);
+
+    if (event->mask & IN_ISDIR) {
+	if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+	    /* If the directory was moved elsewhere in the mail store,
+	     * we will see it arrive there and watch it again. */
+	    watch_forget_directory (watch, path);
+	    list = watch->removed_directories;
+	} else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+	    if (strcmp (event->name, ".notmuch") != 0 &&
+		! (strcmp (event->name, "tmp") == 0 &&
+		   _directory_resembles_maildir (directory)))
+		list = watch->added_directories;
+	}
+    } else if (event->mask & IN_MODIFY) {
+	g_hash_table_insert (watch->writing, g_strdup (path), NULL);
+    } else if (event->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO)) {
+	if (event->mask & IN_CLOSE_WRITE)
+	    g_hash_table_remove (watch->writing, path);
+	list = watch->added_files;
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+	g_hash_table_remove (watch->writing, path);
+	list = watch->removed_files;
+    }
+
+    if (list == NULL) {
+	talloc_free (path);
+	return;
+    }
+
+    if (state->debug)
+	printf ("(D) watch: event 0x%x for %s\n", event->mask, path);
+
+    /* A rescan will find this change anyway. */
+    if (! watch->rescan)
+	_filename_list_add (list, path);
+    talloc_free (path);
+
+    watch_set_pending (watch);
+}
+
+/* Read and record all events that are ready. */
+static notmuch_status_t
+watch_read_events (watch_t *watch, add_files_state_t *state)
+{
+    char buf[4096]
+	__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *ptr;
+
+    while ((len = read (watch->fd, buf, sizeof (buf))) > 0) {
+	ptr = buf;
+	while (ptr < buf + len) {
+	    event = (const struct inotify_event *) ptr;
+	    watch_add_event (watch, event, state);
+	    ptr += sizeof (struct inotify_event) + event->len;
+	}
+    }
+
+    if (len < 0 && errno != EAGAIN && errno != EINTR) {
+	fprintf (stderr, "Error reading file system events: %s\n",
+		 strerror (errno));
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Apply the recorded changes to the database, in the same way as
+ * notmuch new would: new files and directories are added before
+ * anything is removed, so that renames are recognized as such.
+ *
+ * Changes found this way leave the mtimes of their directories in
+ * the database alone, so that the next full scan revisits them. */
+static notmuch_status_t
+watch_update (notmuch_database_t *notmuch, const char *db_path,
+	      watch_t *watch, add_files_state_t *state)
+{
+    _filename_node_t *f;
+    struct stat st;
+    notmuch_bool_t moved;
+    notmuch_status_t status;
+
+    status = batch_begin (notmuch, state);
+    if (status)
+	return status;
+
+    if (watch->rescan) {
+	status = add_files (notmuch, db_path, state);
+	if (status)
+	    return status;
+	watch->rescan = FALSE;
+    }
+
+    for (f = watch->added_directories->head; f && ! interrupted; f = f->next) {
+	if (stat (f->filename, &st) || ! S_ISDIR (st.st_mode))
+	    continue;
+	status = add_files (notmuch, f->filename, state);
+	if (status)
+	    return status;
+    }
+
+    for (f = watch->added_files->head; f && ! interrupted; f = f->next) {
+	/* Wait for the writer to finish; we will hear when it does. */
+	if (g_hash_table_lookup_extended (watch->writing, f->filename,
+					  NULL, NULL))
+	    continue;
+	if (stat (f->filename, &st) || ! S_ISREG (st.st_mode))
+	    continue;
+
+	if (state->mbox && is_mbox_in_place (notmuch, f->filename)) {
+	    status = add_mbox_file (notmuch, f->filename, state);
+	    if (status)
+		return status;
+	    continue;
+	}
+
+	state->processed_files++;
+	if (state->verbosity >= VERBOSITY_VERBOSE)
+	    printf ("%s\n", f->filename);
+
+	status = add_moved_file (notmuch, f->filename, state, &moved);
+	if (status == NOTMUCH_STATUS_SUCCESS && ! moved)
+	    status = add_file (notmuch, f->filename, NULL, state);
+	if (status)
+	    return status;
+    }
+
+    /* Only remove what is really gone, rather than, say, deleted and
+     * then written again. */
+    for (f = watch->removed_files->head; f; f = f->next)
+	if (access (f->filename, F_OK) != 0)
+	    _filename_list_add (state->removed_files, f->filename);
+
+    for (f = watch->removed_directories->head; f; f = f->next)
+	if (access (f->filename, F_OK) != 0)
+	    _filename_list_add (state->removed_directories, f->filename);
+
+    status = remove_missing (state->removed_files, notmuch, state);
+    if (status)
+	return status;
+
+    return batch_end (notmuch, state);
+}
+
+int
+notmuch_watch_command (notmuch_config_t *config, int argc, char *argv[])
+{
+    notmuch_database_t *notmuch;
+    add_files_state_t add_files_state = {
+	.verbosity = VERBOSITY_NORMAL,
+	.debug = FALSE,
+	.output_is_a_tty = FALSE,
+    };
+    watch_t *watch;
+    const char *db_path;
+    struct sigaction action;
+    struct pollfd pfd;
+    struct timeval tv_now;
+    void *local;
+    int opt_index, ready, timeout;
+    notmuch_bool_t no_hooks = FALSE;
+    notmuch_bool_t quiet = FALSE, verbose = FALSE;
+    notmuch_bool_t watching = FALSE, changed;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_BOOLEAN,  &quiet, "quiet", 'q', 0 },
+	{ NOTMUCH_OPT_BOOLEAN,  &verbose, "verbose", 'v', 0 },
+	{ NOTMUCH_OPT_BOOLEAN,  &add_files_state.debug, "debug", 'd', 0 },
+	{ NOTMUCH_OPT_BOOLEAN,  &no_hooks, "no-hooks", 'n', 0 },
+	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
+
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return EXIT_FAILURE;
+
+    notmuch_process_shared_options (argv[0]);
+
+    /* quiet trumps verbose */
+    if (quiet)
+	add_files_state.verbosity = VERBOSITY_QUIET;
+    else if (verbose)
+	add_files_state.verbosity = VERBOSITY_VERBOSE;
+
+    add_files_state.new_tags = notmuch_config_get_new_tags (config, &add_files_state.new_tags_length);
+    add_files_state.new_ignore = notmuch_config_get_new_ignore (config, &add_files_state.new_ignore_length);
+    add_files_state.synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
+    add_files_state.batch_size = notmuch_config_get_new_batch_size (config);
+    add_files_state.manifests = notmuch_config_get_new_manifests (config);
+    add_files_state.mbox = notmuch_config_get_new_mbox (config);
+    db_path = notmuch_config_get_database_path (config);
+
+    if (! check_new_tags (&add_files_state) ||
+	! load_tag_rules (config, &add_files_state))
+	return EXIT_FAILURE;
+
+    watch = watch_create (config);
+    if (watch == NULL)
+	return EXIT_FAILURE;
+    add_files_state.watch = watch;
+
+    memset (&action, 0, sizeof (struct sigaction));
+    action.sa_handler = handle_sigint;
+    sigemptyset (&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction (SIGINT, &action, NULL);
+    sigaction (SIGTERM, &action, NULL);
+
+    timeout = 0;
+    while (! interrupted) {
+	pfd.fd = watch->fd;
+	pfd.events = POLLIN;
+	ready = poll (&pfd, 1, timeout);
+	if (ready < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf (stderr, "Error waiting for changes: %s\n",
+		     strerror (errno));
+	    status = NOTMUCH_STATUS_FILE_ERROR;
+	    break;
+	}
+
+	if (ready > 0) {
+	    status = watch_read_events (watch, &add_files_state);
+	    if (status)
+		break;
+	    if (! watch->pending) {
+		timeout = -1;
+		continue;
+	    }
+	    gettimeofday (&tv_now, NULL);
+	    if (notmuch_time_elapsed (watch->pending_since, tv_now) * 1000 <
+		WATCH_MAX_DELAY_MS) {
+		timeout = WATCH_SETTLE_MS;
+		continue;
+	    }
+	} else if (! watch->pending) {
+	    timeout = -1;
+	    continue;
+	}
+
+	/* Open the database only for as long as it takes to apply
+	 * the changes, so that other writers are not locked out. */
+	if (notmuch_database_open (db_path, NOTMUCH_DATABASE_MODE_READ_WRITE,
+				   &notmuch)) {
+	    timeout = WATCH_RETRY_MS;
+	    continue;
+	}
+
+	notmuch_exit_if_unmatched_db_uuid (notmuch);
+
+	if (notmuch_database_needs_upgrade (notmuch)) {
+	    fprintf (stderr, "Error: The database needs to be upgraded. Run \"notmuch new\" first.\n");
+	    notmuch_database_destroy (notmuch);
+	    status = NOTMUCH_STATUS_UPGRADE_REQUIRED;
+	    break;
+	}
+
+	status = notmuch_database_set_tag_rules (notmuch,
+						 add_files_state.tag_rules);
+	if (print_status_database ("notmuch watch", notmuch, status)) {
+	    notmuch_database_destroy (notmuch);
+	    break;
+	}
+
+	local = talloc_new (config);
+	add_files_state.removed_files = _filename_list_create (local);
+	add_files_state.removed_directories = _filename_list_create (local);
+	add_files_state.directory_mtimes = _filename_list_create (local);
+	add_files_state.processed_files = 0;
+	add_files_state.added_messages = 0;
+	add_files_state.removed_messages = 0;
+	add_files_state.renamed_messages = 0;
+	gettimeofday (&add_files_state.tv_start, NULL);
+
+	if (! no_hooks)
+	    new_ids_begin (config, notmuch, &add_files_state);
+
+	status = watch_update (notmuch, db_path, watch, &add_files_state);
+	notmuch_database_destroy (notmuch);
+	talloc_free (local);
+	if (status)
+	    break;
+
+	watch_reset_changes (watch);
+
+	changed = (add_files_state.added_messages ||
+		   add_files_state.removed_messages ||
+		   add_files_state.renamed_messages);
+
+	if (add_files_state.verbosity >= VERBOSITY_NORMAL) {
+	    if (changed)
+		print_results (&add_files_state);
+	    if (! watching)
+		printf ("Watching %s for changes.\n", db_path);
+	    fflush (stdout);
+	}
+	watching = TRUE;
+
+	if (changed && ! no_hooks && ! interrupted)
+	    run_post_new_hook (db_path, &add_files_state);
+
+	timeout = -1;
+    }
+
+    talloc_free (watch);
+    new_ids_end (&add_files_state);
+
+    if (status)
+	fprintf (stderr, "Note: A fatal error was encountered: %s\n",
+		 notmuch_status_to_string (status));
+
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#else
+int
+notmuch_watch_command (unused (notmuch_config_t *config),
+		       unused (int argc), unused (char *argv[]))
+{
+    fprintf (stderr, "notmuch was compiled without inotify support; notmuch watch is unavailable.\n");
+    return EXIT_FAILURE;
+}
+#endif
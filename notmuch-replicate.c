@@ -0,0 +1,192 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+/* A replica pulls changes by running a command, typically ssh to the
+ * primary, that runs "notmuch replicate serve" there with the
+ * revision of the replica as its argument, and reads the changesets
+ * from the command's output. */
+
+#include "notmuch-client.h"
+
+static volatile sig_atomic_t interrupted;
+
+static void
+handle_sigint (unused (int sig))
+{
+    interrupted = 1;
+}
+
+static void
+print_replicate_error (notmuch_status_t status, char *message)
+{
+    if (message) {
+	fputs (message, stderr);
+	free (message);
+    } else {
+	fprintf (stderr, "Error: %s\n", notmuch_status_to_string (status));
+    }
+}
+
+static int
+replicate_serve (notmuch_config_t *config, int argc, char *argv[])
+{
+    notmuch_status_t status;
+    char *message = NULL;
+
+    if (argc > 1) {
+	fprintf (stderr, "Error: replicate serve takes at most one revision.\n");
+	return EXIT_FAILURE;
+    }
+
+    status = notmuch_database_write_changesets (
+	notmuch_config_get_database_path (config), argc ? argv[0] : "",
+	STDOUT_FILENO, &message);
+    if (status) {
+	print_replicate_error (status, message);
+	return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* Bring the replica at 'path' up to date once, with the changesets
+ * written by 'command'. */
+static int
+replicate_pull_once (const char *path, const char *command)
+{
+    notmuch_status_t status;
+    char *revision = NULL, *message = NULL, *command_line;
+    FILE *changesets;
+    int exit_status;
+
+    status = notmuch_database_get_replica_revision (path, &revision, &message);
+    if (status) {
+	print_replicate_error (status, message);
+	return 1;
+    }
+
+    /* Revisions are hex-encoded, so safe to pass to the shell. */
+    command_line = talloc_asprintf (NULL, "%s %s", command, revision);
+    free (revision);
+    if (command_line == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return 1;
+    }
+
+    changesets = popen (command_line, "r");
+    talloc_free (command_line);
+    if (changesets == NULL) {
+	fprintf (stderr, "Error running %s: %s\n", command, strerror (errno));
+	return 1;
+    }
+
+    status = notmuch_database_apply_changesets (path, fileno (changesets),
+						NULL, &message);
+    exit_status = pclose (changesets);
+
+    if (status) {
+	print_replicate_error (status, message);
+	return 1;
+    }
+
+    if (exit_status) {
+	fprintf (stderr, "Error: %s failed.\n", command);
+	return 1;
+    }
+
+    return 0;
+}
+
+static int
+replicate_pull (notmuch_config_t *config, int argc, char *argv[])
+{
+    const char *path = notmuch_config_get_database_path (config);
+    struct sigaction action;
+    int interval = 0;
+    int opt_index, ret;
+
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_INT, &interval, "interval", 0, 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
+
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return EXIT_FAILURE;
+
+    if (argc - opt_index != 1) {
+	fprintf (stderr, "Error: replicate pull requires one command to run.\n");
+	return EXIT_FAILURE;
+    }
+
+    if (interval < 0) {
+	fprintf (stderr, "Error: --interval must not be negative.\n");
+	return EXIT_FAILURE;
+    }
+
+    memset (&action, 0, sizeof (struct sigaction));
+    action.sa_handler = handle_sigint;
+    sigemptyset (&action.sa_mask);
+    sigaction (SIGINT, &action, NULL);
+    sigaction (SIGTERM, &action, NULL);
+
+    ret = replicate_pull_once (path, argv[opt_index]);
+
+    /* Keep pulling, through failures of the connection to the
+     * primary, until interrupted. */
+    while (interval && ! interrupted) {
+	sleep (interval);
+	if (! interrupted)
+	    ret = replicate_pull_once (path, argv[opt_index]);
+    }
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int
+notmuch_replicate_command (notmuch_config_t *config, int argc, char *argv[])
+{
+    int opt_index;
+
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
+
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return EXIT_FAILURE;
+
+    notmuch_process_shared_options (argv[0]);
+
+    if (opt_index == argc) {
+	fprintf (stderr, "Error: replicate requires serve or pull.\n");
+	return EXIT_FAILURE;
+    }
+
+    if (strcmp (argv[opt_index], "serve") == 0)
+	return replicate_serve (config, argc - opt_index - 1,
+				argv + opt_index + 1);
+
+    if (strcmp (argv[opt_index], "pull") == 0)
+	return replicate_pull (config, argc - opt_index, argv + opt_index);
+
+    fprintf (stderr, "Error: unknown replicate command: %s\n",
+	     argv[opt_index]);
+    return EXIT_FAILURE;
+}
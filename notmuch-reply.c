@@ -847,8 +847,9 @@ notmuch_reply_command (notmuch_config_t *config, int argc, char *argv[])
 
     params.crypto.gpgpath = notmuch_config_get_crypto_gpg_path (config);
 
-    if (notmuch_database_open (notmuch_config_get_database_path (config),
-			       NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
+    if (notmuch_cli_database_open (notmuch_config_get_database_path (config),
+				   NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch,
+				   NULL))
 	return EXIT_FAILURE;
 
     notmuch_exit_if_unmatched_db_uuid (notmuch);
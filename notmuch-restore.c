@@ -24,28 +24,46 @@
 #include "string-util.h"
 #include "zlib-extra.h"
 
+#include <limits.h>
+
 static regex_t regex;
 
+/* Input lines are restored in batches of this many, each in one
+ * atomic section. */
+#define RESTORE_BATCH_SIZE 1000
+
 /* Non-zero return indicates an error in retrieving the message,
  * or in applying the tags.  Missing messages are reported, but not
  * considered errors.
+ *
+ * Messages already looked up by prefetch_messages are taken from
+ * 'messages', if not NULL.
  */
 static int
 tag_message (unused (void *ctx),
 	     notmuch_database_t *notmuch,
+	     GHashTable *messages,
 	     const char *message_id,
 	     tag_op_list_t *tag_ops,
 	     tag_op_flag_t flags)
 {
     notmuch_status_t status;
     notmuch_message_t *message = NULL;
+    notmuch_bool_t prefetched;
+    gpointer value;
     int ret = 0;
 
-    status = notmuch_database_find_message (notmuch, message_id, &message);
-    if (status) {
-	fprintf (stderr, "Error applying tags to message %s: %s\n",
-		 message_id, notmuch_status_to_string (status));
-	return 1;
+    prefetched = messages &&
+	g_hash_table_lookup_extended (messages, message_id, NULL, &value);
+    if (prefetched) {
+	message = (notmuch_message_t *) value;
+    } else {
+	status = notmuch_database_find_message (notmuch, message_id, &message);
+	if (status) {
+	    fprintf (stderr, "Error applying tags to message %s: %s\n",
+		     message_id, notmuch_status_to_string (status));
+	    return 1;
+	}
     }
     if (message == NULL) {
 	fprintf (stderr, "Warning: cannot apply tags to missing message: %s\n",
@@ -59,7 +77,327 @@ tag_message (unused (void *ctx),
     if ((flags & TAG_FLAG_REMOVE_ALL) || tag_op_list_size (tag_ops))
 	ret = tag_op_list_apply (message, tag_ops, flags);
 
-    notmuch_message_destroy (message);
+    if (! prefetched)
+	notmuch_message_destroy (message);
+
+    return ret;
+}
+
+/* Return the message ID named by 'line', or NULL if it cannot be
+ * told without the full parse, which reports any problem with the
+ * line.  Nothing is printed. */
+static char *
+peek_message_id (void *ctx, const char *line, int input_format)
+{
+    char *prefix, *term;
+    const char *query;
+    size_t len;
+
+    if (input_format == DUMP_FORMAT_SUP) {
+	len = strcspn (line, " ");
+	if (len == 0 || line[len] != ' ')
+	    return NULL;
+	return talloc_strndup (ctx, line, len);
+    }
+
+    query = strstr (line, " -- ");
+    if (query == NULL)
+	return NULL;
+
+    if (parse_boolean_term (ctx, query + 4, &prefix, &term) ||
+	strcmp (prefix, "id") != 0)
+	return NULL;
+
+    return term;
+}
+
+static int
+compare_strings (const void *a, const void *b)
+{
+    return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+/* Look up the messages named by 'lines' in sorted order, which keeps
+ * the lookups close together in the database, and add them to
+ * 'messages' (NULL for those missing).  Lookup errors are left to be
+ * reported by tag_message. */
+static void
+prefetch_messages (void *ctx, notmuch_database_t *notmuch,
+		   char **lines, size_t num_lines, int input_format,
+		   GHashTable *messages)
+{
+    notmuch_message_t *message;
+    char **ids;
+    size_t i, num_ids = 0;
+
+    ids = talloc_array (ctx, char *, num_lines);
+    if (ids == NULL)
+	return;
+
+    for (i = 0; i < num_lines; i++) {
+	char *id = peek_message_id (ctx, lines[i], input_format);
+
+	if (id)
+	    ids[num_ids++] = id;
+    }
+
+    qsort (ids, num_ids, sizeof (char *), compare_strings);
+
+    for (i = 0; i < num_ids; i++) {
+	if (i > 0 && strcmp (ids[i], ids[i - 1]) == 0)
+	    continue;
+
+	if (notmuch_database_find_message (notmuch, ids[i], &message))
+	    continue;
+
+	if (message)
+	    talloc_steal (ctx, message);
+	g_hash_table_insert (messages, ids[i], message);
+    }
+}
+
+/* Dumps of changes restored so far from the input: the UUID of the
+ * database they were made from, and the revision they reach. */
+typedef struct {
+    char *uuid;
+    unsigned long revision;
+} changes_chain_t;
+
+/* If 'line' is the header of a dump of the changes since a revision,
+ * warn if it does not carry on from the dumps before it in the
+ * input, and return TRUE. */
+static notmuch_bool_t
+check_changes_header (void *ctx, const char *line, changes_chain_t *chain)
+{
+    const char *s = line + strlen (DUMP_CHANGES_HEADER);
+    unsigned long since, revision;
+    char *uuid, *end;
+    size_t len;
+
+    if (strncmp (line, DUMP_CHANGES_HEADER, strlen (DUMP_CHANGES_HEADER)) != 0 ||
+	*s != ' ')
+	return FALSE;
+
+    s++;
+    len = strcspn (s, " ");
+    uuid = talloc_strndup (ctx, s, len);
+    since = strtoul (s + len, &end, 10);
+    revision = strtoul (end, &end, 10);
+    if (uuid == NULL || len == 0 || strspn (end, " \t\n") != strlen (end)) {
+	fprintf (stderr, "Warning: cannot parse dump header\n");
+	return TRUE;
+    }
+
+    if (chain->uuid && strcmp (chain->uuid, uuid) != 0)
+	fprintf (stderr, "Warning: changes dumped from a different database (%s, not %s)\n",
+		 uuid, chain->uuid);
+    else if (chain->uuid && since > chain->revision)
+	fprintf (stderr, "Warning: changes between revisions %lu and %lu are missing\n",
+		 chain->revision, since);
+
+    talloc_free (chain->uuid);
+    chain->uuid = uuid;
+    chain->revision = revision;
+
+    return TRUE;
+}
+
+/* Read a varint written by notmuch dump.  Returns FALSE at the end of
+ * input or on a value too large for 'value'. */
+static notmuch_bool_t
+gz_get_varint (gzFile input, unsigned long *value)
+{
+    unsigned int shift = 0;
+    int c;
+
+    *value = 0;
+    do {
+	c = gzgetc (input);
+	if (c < 0 || shift >= sizeof (*value) * 8)
+	    return FALSE;
+	*value |= (unsigned long) (c & 0x7f) << shift;
+	shift += 7;
+    } while (c & 0x80);
+
+    return TRUE;
+}
+
+/* Read a length-prefixed string.  Returns NULL at the end of input,
+ * or if the string contains a null byte. */
+static char *
+gz_get_string (void *ctx, gzFile input)
+{
+    unsigned long len;
+    char *str;
+
+    if (! gz_get_varint (input, &len) || len >= INT_MAX)
+	return NULL;
+
+    str = talloc_array (ctx, char, len + 1);
+    if (str == NULL || gzread (input, str, len) != (int) len)
+	return NULL;
+    str[len] = '\0';
+
+    if (strlen (str) != len)
+	return NULL;
+
+    return str;
+}
+
+/* Restore the tags of a binary dump, read from just after its header
+ * up to its end record.  Messages are restored in atomic sections of
+ * RESTORE_BATCH_SIZE.  Returns non-zero on a fatal error. */
+static int
+restore_binary (void *ctx, notmuch_database_t *notmuch, gzFile input,
+		tag_op_list_t *tag_ops, tag_op_flag_t flags)
+{
+    void *local = talloc_new (ctx);
+    char **tags = NULL;
+    size_t num_tags = 0, tags_size = 0, num_messages = 0;
+    notmuch_bool_t malformed = FALSE;
+    unsigned long type, count, number, i;
+    int ret = 0;
+
+    if (notmuch_database_begin_atomic (notmuch)) {
+	talloc_free (local);
+	return 1;
+    }
+
+    while (ret == 0 && ! malformed) {
+	if (! gz_get_varint (input, &type)) {
+	    malformed = TRUE;
+	} else if (type == DUMP_BINARY_END) {
+	    break;
+	} else if (type == DUMP_BINARY_TAG) {
+	    if (num_tags == tags_size) {
+		tags_size = tags_size ? 2 * tags_size : 64;
+		tags = talloc_realloc (local, tags, char *, tags_size);
+		if (tags == NULL) {
+		    fprintf (stderr, "Out of memory.\n");
+		    ret = 1;
+		    break;
+		}
+	    }
+	    tags[num_tags] = gz_get_string (tags, input);
+	    if (tags[num_tags] == NULL)
+		malformed = TRUE;
+	    num_tags++;
+	} else if (type == DUMP_BINARY_MESSAGE) {
+	    void *message_ctx = talloc_new (local);
+	    char *message_id = gz_get_string (message_ctx, input);
+
+	    tag_op_list_reset (tag_ops);
+	    if (message_id == NULL || ! gz_get_varint (input, &count))
+		malformed = TRUE;
+
+	    for (i = 0; ! malformed && i < count; i++) {
+		if (! gz_get_varint (input, &number) || number >= num_tags)
+		    malformed = TRUE;
+		else if (tag_op_list_append (tag_ops, tags[number], FALSE))
+		    ret = 1;
+	    }
+
+	    if (! malformed && ret == 0)
+		ret = tag_message (message_ctx, notmuch, NULL, message_id,
+				   tag_ops, flags);
+	    talloc_free (message_ctx);
+
+	    if (++num_messages % RESTORE_BATCH_SIZE == 0 && ret == 0 &&
+		(notmuch_database_end_atomic (notmuch) ||
+		 notmuch_database_begin_atomic (notmuch))) {
+		talloc_free (local);
+		return 1;
+	    }
+	} else {
+	    malformed = TRUE;
+	}
+    }
+
+    if (malformed) {
+	fprintf (stderr, "Error: malformed binary dump.\n");
+	ret = 1;
+    }
+
+    talloc_free (local);
+
+    if (notmuch_database_end_atomic (notmuch))
+	ret = 1;
+
+    return ret;
+}
+
+/* Restore the tags of 'lines' as one atomic section.  Returns
+ * non-zero on a fatal error. */
+static int
+restore_batch (void *ctx, notmuch_database_t *notmuch,
+	       char **lines, size_t num_lines, int input_format,
+	       tag_op_list_t *tag_ops, tag_op_flag_t flags)
+{
+    GHashTable *messages;
+    void *line_ctx = NULL;
+    size_t i;
+    int ret = 0;
+
+    if (notmuch_database_begin_atomic (notmuch))
+	return 1;
+
+    messages = g_hash_table_new (g_str_hash, g_str_equal);
+    prefetch_messages (ctx, notmuch, lines, num_lines, input_format,
+		       messages);
+
+    for (i = 0; i < num_lines && ret == 0; i++) {
+	char *line = lines[i];
+	char *query_string, *prefix, *term;
+
+	if (line_ctx != NULL)
+	    talloc_free (line_ctx);
+
+	line_ctx = talloc_new (ctx);
+	if (input_format == DUMP_FORMAT_SUP) {
+	    ret = parse_sup_line (line_ctx, line, &query_string, tag_ops);
+	} else {
+	    ret = parse_tag_line (line_ctx, line, TAG_FLAG_BE_GENEROUS,
+				  &query_string, tag_ops);
+
+	    if (ret == 0) {
+		ret = parse_boolean_term (line_ctx, query_string,
+					  &prefix, &term);
+		if (ret && errno == EINVAL) {
+		    fprintf (stderr, "Warning: cannot parse query: %s (skipping)\n", query_string);
+		    ret = 0;
+		    continue;
+		} else if (ret) {
+		    /* This is more fatal (e.g., out of memory) */
+		    fprintf (stderr, "Error parsing query: %s\n",
+			     strerror (errno));
+		    ret = 1;
+		    break;
+		} else if (strcmp ("id", prefix) != 0) {
+		    fprintf (stderr, "Warning: not an id query: %s (skipping)\n", query_string);
+		    continue;
+		}
+		query_string = term;
+	    }
+	}
+
+	if (ret > 0) {
+	    ret = 0;
+	    continue;
+	}
+
+	if (ret < 0)
+	    break;
+
+	ret = tag_message (line_ctx, notmuch, messages, query_string,
+			   tag_ops, flags);
+    }
+
+    if (line_ctx != NULL)
+	talloc_free (line_ctx);
+    g_hash_table_destroy (messages);
+
+    if (notmuch_database_end_atomic (notmuch))
+	ret = 1;
 
     return ret;
 }
@@ -133,6 +471,10 @@ notmuch_restore_command (notmuch_config_t *config, int argc, char *argv[])
     gzFile input = NULL;
     char *line = NULL;
     void *line_ctx = NULL;
+    void *batch_ctx = NULL;
+    char **batch = NULL;
+    size_t num_lines = 0;
+    changes_chain_t chain = { NULL, 0 };
     ssize_t line_len;
 
     int ret = 0;
@@ -225,8 +567,11 @@ notmuch_restore_command (notmuch_config_t *config, int argc, char *argv[])
 	    ret = EXIT_FAILURE;
 	    goto DONE;
 	}
+
+	if (line_len > 0 && line[0] == '#')
+	    check_changes_header (config, line, &chain);
     } while ((line_len == 0) ||
-	     (line[0] == '#') ||
+	     (line[0] == '#' && strcmp (line, DUMP_BINARY_HEADER) != 0) ||
 	     /* the cast is safe because we checked about for line_len < 0 */
 	     (strspn (line, " \t\n") == (unsigned)line_len));
 
@@ -245,62 +590,69 @@ notmuch_restore_command (notmuch_config_t *config, int argc, char *argv[])
 		       REG_EXTENDED) )
 	    INTERNAL_ERROR ("compile time constant regex failed.");
 
+    batch_ctx = talloc_new (config);
+    batch = talloc_array (batch_ctx, char *, RESTORE_BATCH_SIZE);
+    if (batch == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	ret = EXIT_FAILURE;
+	goto DONE;
+    }
+
     do {
-	char *query_string, *prefix, *term;
+	util_status_t status;
 
-	if (line_ctx != NULL)
-	    talloc_free (line_ctx);
+	/* Dumps of changes may follow one another in the input, and
+	 * binary dumps carry on to their end record. */
+	if (strcmp (line, DUMP_BINARY_HEADER) == 0) {
+	    if ((num_lines > 0 &&
+		 restore_batch (batch_ctx, notmuch, batch, num_lines,
+				input_format, tag_ops, flags)) ||
+		restore_binary (config, notmuch, input, tag_ops, flags)) {
+		ret = EXIT_FAILURE;
+		break;
+	    }
+	    num_lines = 0;
+	} else if (! check_changes_header (config, line, &chain)) {
+	    batch[num_lines] = talloc_strdup (batch_ctx, line);
+	    if (batch[num_lines] == NULL) {
+		fprintf (stderr, "Out of memory.\n");
+		ret = EXIT_FAILURE;
+		break;
+	    }
+	    num_lines++;
+	}
 
-	line_ctx = talloc_new (config);
-	if (input_format == DUMP_FORMAT_SUP) {
-	    ret = parse_sup_line (line_ctx, line, &query_string, tag_ops);
-	} else {
-	    ret = parse_tag_line (line_ctx, line, TAG_FLAG_BE_GENEROUS,
-				  &query_string, tag_ops);
+	status = gz_getline (line_ctx, &line, &line_len, input);
 
-	    if (ret == 0) {
-		ret = parse_boolean_term (line_ctx, query_string,
-					  &prefix, &term);
-		if (ret && errno == EINVAL) {
-		    fprintf (stderr, "Warning: cannot parse query: %s (skipping)\n", query_string);
-		    continue;
-		} else if (ret) {
-		    /* This is more fatal (e.g., out of memory) */
-		    fprintf (stderr, "Error parsing query: %s\n",
-			     strerror (errno));
-		    ret = 1;
-		    break;
-		} else if (strcmp ("id", prefix) != 0) {
-		    fprintf (stderr, "Warning: not an id query: %s (skipping)\n", query_string);
-		    continue;
-		}
-		query_string = term;
+	if (num_lines == RESTORE_BATCH_SIZE || (status && num_lines > 0)) {
+	    if (restore_batch (batch_ctx, notmuch, batch, num_lines,
+			       input_format, tag_ops, flags)) {
+		ret = EXIT_FAILURE;
+		break;
+	    }
+	    talloc_free (batch_ctx);
+	    batch_ctx = talloc_new (config);
+	    batch = talloc_array (batch_ctx, char *, RESTORE_BATCH_SIZE);
+	    num_lines = 0;
+	    if (batch == NULL) {
+		fprintf (stderr, "Out of memory.\n");
+		ret = EXIT_FAILURE;
+		break;
 	    }
 	}
 
-	if (ret > 0)
-	    continue;
-
-	if (ret < 0)
+	/* EOF is normal loop termination condition, UTIL_SUCCESS is
+	 * impossible here */
+	if (status == UTIL_EOF) {
+	    ret = EXIT_SUCCESS;
 	    break;
-
-	ret = tag_message (line_ctx, notmuch, query_string,
-			   tag_ops, flags);
-	if (ret)
+	} else if (status) {
+	    fprintf (stderr, "Error reading (gzipped) input: %s\n",
+		     gz_error_string (status, input));
+	    ret = EXIT_FAILURE;
 	    break;
-
-    }  while (! (ret = gz_getline (line_ctx, &line, &line_len, input)));
-    
-
-    /* EOF is normal loop termination condition, UTIL_SUCCESS is
-     * impossible here */
-    if (ret == UTIL_EOF) {
-	ret = EXIT_SUCCESS;
-    } else {
-	fprintf (stderr, "Error reading (gzipped) input: %s\n",
-		 gz_error_string (ret, input));
-	ret = EXIT_FAILURE;
-    }
+	}
+    } while (1);
 
     /* currently this should not be after DONE: since we don't 
      * know if the xregcomp was reached
@@ -310,6 +662,9 @@ notmuch_restore_command (notmuch_config_t *config, int argc, char *argv[])
 	regfree (&regex);
 
  DONE:
+    if (batch_ctx != NULL)
+	talloc_free (batch_ctx);
+
     if (line_ctx != NULL)
 	talloc_free (line_ctx);
 
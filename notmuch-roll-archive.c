@@ -0,0 +1,74 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-client.h"
+
+int
+notmuch_roll_archive_command (notmuch_config_t *config, int argc, char *argv[])
+{
+    notmuch_database_t *notmuch;
+    notmuch_status_t status;
+    notmuch_bool_t quiet = FALSE;
+    const char *name;
+    char *query_str;
+    unsigned int count;
+    int opt_index;
+
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_BOOLEAN,  &quiet, "quiet", 'q', 0 },
+	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
+
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return EXIT_FAILURE;
+
+    notmuch_process_shared_options (argv[0]);
+
+    if (argc - opt_index < 2) {
+	fprintf (stderr, "Error: roll-archive requires a shard name and search terms\n");
+	return EXIT_FAILURE;
+    }
+
+    name = argv[opt_index++];
+
+    query_str = query_string_from_args (config, argc - opt_index, argv + opt_index);
+    if (query_str == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return EXIT_FAILURE;
+    }
+
+    if (notmuch_database_open (notmuch_config_get_database_path (config),
+			       NOTMUCH_DATABASE_MODE_READ_WRITE, &notmuch))
+	return EXIT_FAILURE;
+
+    notmuch_exit_if_unmatched_db_uuid (notmuch);
+
+    status = notmuch_database_roll_archive (notmuch, name, query_str, &count);
+    if (print_status_database ("notmuch roll-archive", notmuch, status)) {
+	notmuch_database_destroy (notmuch);
+	return EXIT_FAILURE;
+    }
+
+    if (! quiet)
+	printf ("Archived %u message%s into %s.\n", count,
+		count == 1 ? "" : "s", name);
+
+    return notmuch_database_destroy (notmuch) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -62,6 +62,8 @@ typedef struct {
     int dupe;
     GHashTable *addresses;
     dedup_t dedup;
+    int jobs;
+    notmuch_bool_t profile;
 } search_context_t;
 
 typedef struct {
@@ -70,19 +72,52 @@ typedef struct {
     int count;
 } mailbox_t;
 
-/* Return two stable query strings that identify exactly the matched
- * and unmatched messages currently in thread.  If there are no
- * matched or unmatched messages, the returned buffers will be
- * NULL. */
+/* Threads with more messages than this in a query string are
+ * described relative to the thread instead of by their message ids,
+ * to keep query strings short. */
+#define THREAD_QUERY_MAX_IDS 32
+
+typedef struct {
+    char *str;
+    size_t length;
+    size_t size;
+} query_buffer_t;
+
 static int
-get_thread_query (notmuch_thread_t *thread,
-		  char **matched_out, char **unmatched_out)
+query_buffer_append (void *ctx, query_buffer_t *buf, const char *str)
+{
+    size_t length = strlen (str);
+
+    if (buf->length + length + 1 > buf->size) {
+	size_t size = buf->size ? buf->size : 64;
+	char *grown;
+
+	while (size < buf->length + length + 1)
+	    size *= 2;
+	grown = talloc_realloc (ctx, buf->str, char, size);
+	if (! grown)
+	    return -1;
+	buf->str = grown;
+	buf->size = size;
+    }
+
+    memcpy (buf->str + buf->length, str, length + 1);
+    buf->length += length;
+    return 0;
+}
+
+/* Append the id: queries of the matched (or unmatched) messages in
+ * thread to buf.  Since "id" is an exclusive prefix, they are
+ * implicitly 'or'd together, so we only need to join them with a
+ * space. */
+static int
+append_thread_ids (notmuch_thread_t *thread, notmuch_bool_t matched,
+		   query_buffer_t *buf)
 {
     notmuch_messages_t *messages;
     char *escaped = NULL;
     size_t escaped_len = 0;
-
-    *matched_out = *unmatched_out = NULL;
+    notmuch_bool_t first = TRUE;
 
     for (messages = notmuch_thread_get_messages (thread);
 	 notmuch_messages_valid (messages);
@@ -90,25 +125,110 @@ get_thread_query (notmuch_thread_t *thread,
     {
 	notmuch_message_t *message = notmuch_messages_get (messages);
 	const char *mid = notmuch_message_get_message_id (message);
-	/* Determine which query buffer to extend */
-	char **buf = notmuch_message_get_flag (
-	    message, NOTMUCH_MESSAGE_FLAG_MATCH) ? matched_out : unmatched_out;
-	/* Add this message's id: query.  Since "id" is an exclusive
-	 * prefix, it is implicitly 'or'd together, so we only need to
-	 * join queries with a space. */
+
+	if (notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_MATCH)
+	    != matched)
+	    continue;
 	if (make_boolean_term (thread, "id", mid, &escaped, &escaped_len) < 0)
 	    return -1;
-	if (*buf)
-	    *buf = talloc_asprintf_append_buffer (*buf, " %s", escaped);
-	else
-	    *buf = talloc_strdup (thread, escaped);
-	if (!*buf)
+	if ((! first && query_buffer_append (thread, buf, " ") < 0) ||
+	    query_buffer_append (thread, buf, escaped) < 0)
 	    return -1;
+	first = FALSE;
     }
     talloc_free (escaped);
     return 0;
 }
 
+/* Return two query strings that identify exactly the matched and
+ * unmatched messages currently in thread.  If there are no matched
+ * or unmatched messages, the returned buffers will be NULL.
+ *
+ * Up to THREAD_QUERY_MAX_IDS messages are listed by message id, so
+ * the query stays stable as more messages arrive.  Larger sets are
+ * the thread (up to its newest message) less the other set, when
+ * that is small, or else the thread and (or and not) the search
+ * terms, when excludes made no difference to the thread. */
+static int
+get_thread_query (search_context_t *ctx, notmuch_thread_t *thread,
+		  char **matched_out, char **unmatched_out)
+{
+    notmuch_messages_t *messages;
+    const char *query_string = notmuch_query_get_query_string (ctx->query);
+    unsigned int count[2] = { 0, 0 };
+    notmuch_bool_t excluded = FALSE, by_query;
+    time_t newest = 0;
+    char *scope;
+    int matched;
+
+    *matched_out = *unmatched_out = NULL;
+
+    for (messages = notmuch_thread_get_messages (thread);
+	 notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
+    {
+	notmuch_message_t *message = notmuch_messages_get (messages);
+
+	count[notmuch_message_get_flag (message,
+					NOTMUCH_MESSAGE_FLAG_MATCH) ? 1 : 0]++;
+	if (notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_EXCLUDED))
+	    excluded = TRUE;
+	if (notmuch_message_get_date (message) > newest)
+	    newest = notmuch_message_get_date (message);
+    }
+
+    by_query = strcmp (query_string, "*") != 0 &&
+	(ctx->exclude == NOTMUCH_EXCLUDE_FALSE ||
+	 ctx->exclude == NOTMUCH_EXCLUDE_FLAG ||
+	 (ctx->exclude == NOTMUCH_EXCLUDE_TRUE && ! excluded));
+
+    scope = talloc_asprintf (thread, "thread:%s and date:..@%ld",
+			     notmuch_thread_get_thread_id (thread),
+			     (long) newest);
+    if (! scope)
+	return -1;
+
+    for (matched = 0; matched < 2; matched++) {
+	query_buffer_t buf = { NULL, 0, 0 };
+	int ret;
+
+	if (count[matched] == 0)
+	    continue;
+
+	if (count[matched] <= THREAD_QUERY_MAX_IDS) {
+	    ret = append_thread_ids (thread, matched, &buf);
+	} else if (ctx->exclude != NOTMUCH_EXCLUDE_ALL &&
+		   count[! matched] <= THREAD_QUERY_MAX_IDS) {
+	    /* Messages hidden by NOTMUCH_EXCLUDE_ALL are in neither
+	     * set, so only otherwise is one set the complement of the
+	     * other. */
+	    ret = query_buffer_append (thread, &buf, scope);
+	    if (ret == 0 && count[! matched])
+		ret = (query_buffer_append (thread, &buf, " and not (") < 0 ||
+		       append_thread_ids (thread, ! matched, &buf) < 0 ||
+		       query_buffer_append (thread, &buf, ")") < 0) ? -1 : 0;
+	} else if (by_query) {
+	    ret = (query_buffer_append (thread, &buf, scope) < 0 ||
+		   query_buffer_append (thread, &buf,
+					matched ? " and (" : " and not (") < 0 ||
+		   query_buffer_append (thread, &buf, query_string) < 0 ||
+		   query_buffer_append (thread, &buf, ")") < 0) ? -1 : 0;
+	} else {
+	    ret = append_thread_ids (thread, matched, &buf);
+	}
+
+	if (ret < 0)
+	    return -1;
+	if (matched)
+	    *matched_out = buf.str;
+	else
+	    *unmatched_out = buf.str;
+    }
+
+    talloc_free (scope);
+    return 0;
+}
+
 static int
 do_search_threads (search_context_t *ctx)
 {
@@ -117,7 +237,6 @@ do_search_threads (search_context_t *ctx)
     notmuch_tags_t *tags;
     sprinter_t *format = ctx->format;
     time_t date;
-    int i;
     notmuch_status_t status;
 
     if (ctx->offset < 0) {
@@ -132,23 +251,36 @@ do_search_threads (search_context_t *ctx)
 	    ctx->offset = 0;
     }
 
+    /* Skipped threads are never created, and none are created past
+     * the limit. */
+    notmuch_query_set_offset (ctx->query, ctx->offset);
+    notmuch_query_set_limit (ctx->query, ctx->limit);
+
+    /* Only the structured output of format version 2 onwards looks at
+     * the messages of each thread, for the queries. */
+    if (ctx->output == OUTPUT_THREADS || format->is_text_printer ||
+	notmuch_format_version < 2)
+	notmuch_query_set_fields (ctx->query, NOTMUCH_FIELD_THREAD_SUMMARY);
+
     status = notmuch_query_search_threads_st (ctx->query, &threads);
     if (print_status_query("notmuch search", ctx->query, status))
 	return 1;
 
+    if (ctx->jobs > 1) {
+	/* As in notmuch new, the threads allocate into talloc
+	 * hierarchies of their own. */
+	talloc_disable_null_tracking ();
+	notmuch_threads_set_jobs (threads, ctx->jobs);
+    }
+
     format->begin_list (format);
 
-    for (i = 0;
-	 notmuch_threads_valid (threads) && (ctx->limit < 0 || i < ctx->offset + ctx->limit);
-	 notmuch_threads_move_to_next (threads), i++)
+    for (;
+	 notmuch_threads_valid (threads);
+	 notmuch_threads_move_to_next (threads))
     {
 	thread = notmuch_threads_get (threads);
 
-	if (i < ctx->offset) {
-	    notmuch_thread_destroy (thread);
-	    continue;
-	}
-
 	if (ctx->output == OUTPUT_THREADS) {
 	    format->set_prefix (format, "thread");
 	    format->string (format,
@@ -162,6 +294,7 @@ do_search_threads (search_context_t *ctx)
 	    int matched = notmuch_thread_get_matched_messages (thread);
 	    int total = notmuch_thread_get_total_messages (thread);
 	    const char *relative_date = NULL;
+	    const char *snippet;
 	    notmuch_bool_t first_tag = TRUE;
 
 	    format->begin_map (format);
@@ -197,9 +330,14 @@ do_search_threads (search_context_t *ctx)
 		format->string (format, authors);
 		format->map_key (format, "subject");
 		format->string (format, subject);
+		snippet = notmuch_thread_get_snippet (thread);
+		if (! EMPTY_STRING (snippet)) {
+		    format->map_key (format, "snippet");
+		    format->string (format, snippet);
+		}
 		if (notmuch_format_version >= 2) {
 		    char *matched_query, *unmatched_query;
-		    if (get_thread_query (thread, &matched_query,
+		    if (get_thread_query (ctx, thread, &matched_query,
 					  &unmatched_query) < 0) {
 			fprintf (stderr, "Out of memory\n");
 			return 1;
@@ -249,11 +387,17 @@ do_search_threads (search_context_t *ctx)
 	    format->separator (format);
 	}
 
+	notmuch_memstats_poll ();
 	notmuch_thread_destroy (thread);
     }
 
     format->end (format);
 
+    /* The library has logged why the threads ended early. */
+    status = notmuch_query_get_status (ctx->query);
+    if (status && status != NOTMUCH_STATUS_QUERY_INTERRUPTED)
+	return 1;
+
     return 0;
 }
 
@@ -516,6 +660,39 @@ _count_filenames (notmuch_message_t *message)
     return i;
 }
 
+/* The message IDs of 'messages', read a window at a time from their
+ * value slot, so that no message object is created and no term list
+ * is decoded for each result. */
+static int
+do_search_message_ids (search_context_t *ctx, notmuch_messages_t *messages)
+{
+    const char *message_ids[256];
+    notmuch_message_columns_t columns = { message_ids, NULL, NULL, NULL, NULL };
+    sprinter_t *format = ctx->format;
+    notmuch_status_t status;
+    unsigned int filled, i;
+
+    format->begin_list (format);
+
+    do {
+	status = notmuch_messages_get_columns (messages, &columns,
+					       ARRAY_SIZE (message_ids),
+					       &filled);
+	for (i = 0; i < filled; i++) {
+	    format->set_prefix (format, "id");
+	    format->string (format, message_ids[i]);
+	    format->separator (format);
+	}
+	notmuch_memstats_poll ();
+    } while (! status && filled == ARRAY_SIZE (message_ids));
+
+    notmuch_messages_destroy (messages);
+
+    format->end (format);
+
+    return print_status_query ("notmuch search", ctx->query, status);
+}
+
 static int
 do_search_messages (search_context_t *ctx)
 {
@@ -523,7 +700,6 @@ do_search_messages (search_context_t *ctx)
     notmuch_messages_t *messages;
     notmuch_filenames_t *filenames;
     sprinter_t *format = ctx->format;
-    int i;
     notmuch_status_t status;
 
     if (ctx->offset < 0) {
@@ -538,19 +714,31 @@ do_search_messages (search_context_t *ctx)
 	    ctx->offset = 0;
     }
 
+    /* Let the library skip the offset and stop at the limit, so
+     * that results outside the requested window are never fetched. */
+    notmuch_query_set_offset (ctx->query, ctx->offset);
+    notmuch_query_set_limit (ctx->query, ctx->limit);
+
+    if (ctx->output == OUTPUT_FILES)
+	notmuch_query_set_fields (ctx->query, NOTMUCH_FIELD_FILENAMES);
+    else if (ctx->output == OUTPUT_MESSAGES)
+	notmuch_query_set_fields (ctx->query, NOTMUCH_FIELD_MESSAGE_ID);
+
     status = notmuch_query_search_messages_st (ctx->query, &messages);
     if (print_status_query ("notmuch search", ctx->query, status))
 	return 1;
 
+    /* Every message has at least one file, so only --duplicate=2 and
+     * above need more than the message IDs. */
+    if (ctx->output == OUTPUT_MESSAGES && ctx->dupe <= 1)
+	return do_search_message_ids (ctx, messages);
+
     format->begin_list (format);
 
-    for (i = 0;
-	 notmuch_messages_valid (messages) && (ctx->limit < 0 || i < ctx->offset + ctx->limit);
-	 notmuch_messages_move_to_next (messages), i++)
+    for (;
+	 notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
     {
-	if (i < ctx->offset)
-	    continue;
-
 	message = notmuch_messages_get (messages);
 
 	if (ctx->output == OUTPUT_FILES) {
@@ -570,8 +758,7 @@ do_search_messages (search_context_t *ctx)
 	    notmuch_filenames_destroy( filenames );
 
 	} else if (ctx->output == OUTPUT_MESSAGES) {
-            /* special case 1 for speed */
-            if (ctx->dupe <= 1 || ctx->dupe <= _count_filenames (message)) {
+            if (ctx->dupe <= _count_filenames (message)) {
                 format->set_prefix (format, "id");
                 format->string (format,
                                 notmuch_message_get_message_id (message));
@@ -597,6 +784,7 @@ do_search_messages (search_context_t *ctx)
 	    }
 	}
 
+	notmuch_memstats_poll ();
 	notmuch_message_destroy (message);
     }
 
@@ -614,7 +802,6 @@ do_search_messages (search_context_t *ctx)
 static int
 do_search_tags (const search_context_t *ctx)
 {
-    notmuch_messages_t *messages = NULL;
     notmuch_tags_t *tags;
     const char *tag;
     sprinter_t *format = ctx->format;
@@ -629,11 +816,9 @@ do_search_tags (const search_context_t *ctx)
 	tags = notmuch_database_get_all_tags (notmuch);
     } else {
 	notmuch_status_t status;
-	status = notmuch_query_search_messages_st (query, &messages);
+	status = notmuch_query_collect_tags (query, &tags);
 	if (print_status_query ("notmuch search", query, status))
 	    return 1;
-
-	tags = notmuch_messages_collect_tags (messages);
     }
     if (tags == NULL)
 	return 1;
@@ -653,19 +838,50 @@ do_search_tags (const search_context_t *ctx)
 
     notmuch_tags_destroy (tags);
 
-    if (messages)
-	notmuch_messages_destroy (messages);
-
     format->end (format);
 
     return 0;
 }
 
+/* Print where the search spent its time as a JSON object on stderr.
+ * "other" is the time spent outside the library phases, which is
+ * mostly the formatting of the output and the reading of message
+ * properties. */
+static void
+print_profile (const notmuch_profile_t *profile, double wall, double cpu)
+{
+    notmuch_profile_phase_t other = { wall, cpu, 1 }, total = other;
+    const struct {
+	const char *name;
+	const notmuch_profile_phase_t *phase;
+    } phases[] = {
+	{ "parse", &profile->parse },
+	{ "exclude", &profile->exclude },
+	{ "match", &profile->match },
+	{ "threads", &profile->threads },
+    };
+    size_t i;
+
+    fputs ("{\"phases\": {", stderr);
+    for (i = 0; i < ARRAY_SIZE (phases); i++) {
+	notmuch_time_print_phase (stderr, phases[i].name, phases[i].phase);
+	fputs (", ", stderr);
+	other.wall -= phases[i].phase->wall;
+	other.cpu -= phases[i].phase->cpu;
+    }
+    notmuch_time_print_phase (stderr, "other", &other);
+    fputs (", ", stderr);
+    notmuch_time_print_phase (stderr, "total", &total);
+    fputs ("}, ", stderr);
+    fprintf (stderr, "\"matches\": %lu, \"documents\": %lu, "
+	     "\"threads\": %lu, \"files\": %lu}\n",
+	     profile->matches, profile->documents,
+	     profile->threads_built, profile->files_opened);
+}
+
 static int
-_notmuch_search_prepare (search_context_t *ctx, notmuch_config_t *config, int argc, char *argv[])
+_notmuch_search_open (search_context_t *ctx, notmuch_config_t *config)
 {
-    char *query_str;
-    unsigned int i;
     char *status_string = NULL;
 
     switch (ctx->format_sel) {
@@ -692,7 +908,7 @@ _notmuch_search_prepare (search_context_t *ctx, notmuch_config_t *config, int ar
 
     notmuch_exit_if_unsupported_format ();
 
-    if (notmuch_database_open_verbose (
+    if (notmuch_cli_database_open (
 	    notmuch_config_get_database_path (config),
 	    NOTMUCH_DATABASE_MODE_READ_ONLY, &ctx->notmuch, &status_string)) {
 
@@ -706,6 +922,21 @@ _notmuch_search_prepare (search_context_t *ctx, notmuch_config_t *config, int ar
 
     notmuch_exit_if_unmatched_db_uuid (ctx->notmuch);
 
+    return 0;
+}
+
+static int
+_notmuch_search_prepare (search_context_t *ctx, notmuch_config_t *config, int argc, char *argv[])
+{
+    char *query_str;
+    unsigned int i;
+
+    if (_notmuch_search_open (ctx, config))
+	return EXIT_FAILURE;
+
+    if (notmuch_config_get_search_cache_excludes (config))
+	notmuch_database_set_exclude_cache (ctx->notmuch, TRUE);
+
     query_str = query_string_from_args (ctx->notmuch, argc, argv);
     if (query_str == NULL) {
 	fprintf (stderr, "Out of memory.\n");
@@ -746,6 +977,50 @@ _notmuch_search_prepare (search_context_t *ctx, notmuch_config_t *config, int ar
     return 0;
 }
 
+/* List the addresses starting with prefix from the contacts table of
+ * the database, rather than from the messages matching a query. */
+static int
+do_address_from_index (search_context_t *ctx, const char *prefix)
+{
+    notmuch_contacts_t *contacts;
+    notmuch_status_t status;
+    sprinter_t *format = ctx->format;
+
+    status = notmuch_database_get_contacts (ctx->notmuch, prefix, &contacts);
+    if (status == NOTMUCH_STATUS_UPGRADE_REQUIRED) {
+	fprintf (stderr, "Error: this database has no contacts table.\n"
+		 "Run 'notmuch new' to upgrade it.\n");
+	return 1;
+    }
+    if (print_status_database ("notmuch address", ctx->notmuch, status))
+	return 1;
+
+    format->begin_list (format);
+
+    for (; notmuch_contacts_valid (contacts);
+	 notmuch_contacts_move_to_next (contacts)) {
+	mailbox_t mbx = {
+	    .name = notmuch_contacts_get_name (contacts),
+	    .addr = notmuch_contacts_get_address (contacts),
+	    .count = 0,
+	};
+
+	if (ctx->output & OUTPUT_SENDER)
+	    mbx.count += notmuch_contacts_get_sent (contacts);
+	if (ctx->output & OUTPUT_RECIPIENTS)
+	    mbx.count += notmuch_contacts_get_received (contacts);
+
+	if (mbx.count)
+	    print_mailbox (ctx, &mbx);
+    }
+
+    format->end (format);
+
+    notmuch_contacts_destroy (contacts);
+
+    return 0;
+}
+
 static void
 _notmuch_search_cleanup (search_context_t *ctx)
 {
@@ -764,6 +1039,7 @@ static search_context_t search_context = {
     .limit = -1, /* unlimited */
     .dupe = -1,
     .dedup = DEDUP_MAILBOX,
+    .jobs = 1,
 };
 
 static const notmuch_opt_desc_t common_options[] = {
@@ -785,6 +1061,8 @@ int
 notmuch_search_command (notmuch_config_t *config, int argc, char *argv[])
 {
     search_context_t *ctx = &search_context;
+    notmuch_profile_t profile = { { 0 } };
+    double wall = 0, cpu = 0;
     int opt_index, ret;
 
     notmuch_opt_desc_t options[] = {
@@ -804,6 +1082,8 @@ notmuch_search_command (notmuch_config_t *config, int argc, char *argv[])
 	{ NOTMUCH_OPT_INT, &ctx->offset, "offset", 'O', 0 },
 	{ NOTMUCH_OPT_INT, &ctx->limit, "limit", 'L', 0  },
 	{ NOTMUCH_OPT_INT, &ctx->dupe, "duplicate", 'D', 0  },
+	{ NOTMUCH_OPT_INT, &ctx->jobs, "jobs", 'j', 0 },
+	{ NOTMUCH_OPT_BOOLEAN, &ctx->profile, "profile", 0, 0 },
 	{ NOTMUCH_OPT_INHERIT, (void *) &common_options, NULL, 0, 0 },
 	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
 	{ 0, 0, 0, 0, 0 }
@@ -826,6 +1106,12 @@ notmuch_search_command (notmuch_config_t *config, int argc, char *argv[])
 				 argc - opt_index, argv + opt_index))
 	return EXIT_FAILURE;
 
+    if (ctx->profile) {
+	notmuch_database_set_profile (ctx->notmuch, &profile);
+	wall = notmuch_time_clock (CLOCK_MONOTONIC);
+	cpu = notmuch_time_clock (CLOCK_PROCESS_CPUTIME_ID);
+    }
+
     switch (ctx->output) {
     case OUTPUT_SUMMARY:
     case OUTPUT_THREADS:
@@ -842,6 +1128,12 @@ notmuch_search_command (notmuch_config_t *config, int argc, char *argv[])
 	INTERNAL_ERROR ("Unexpected output");
     }
 
+    if (ctx->profile) {
+	fflush (stdout);
+	print_profile (&profile, notmuch_time_clock (CLOCK_MONOTONIC) - wall,
+		       notmuch_time_clock (CLOCK_PROCESS_CPUTIME_ID) - cpu);
+    }
+
     _notmuch_search_cleanup (ctx);
 
     return ret ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -851,6 +1143,7 @@ int
 notmuch_address_command (notmuch_config_t *config, int argc, char *argv[])
 {
     search_context_t *ctx = &search_context;
+    notmuch_bool_t from_index = FALSE;
     int opt_index, ret;
 
     notmuch_opt_desc_t options[] = {
@@ -868,6 +1161,7 @@ notmuch_address_command (notmuch_config_t *config, int argc, char *argv[])
 				  { "mailbox", DEDUP_MAILBOX },
 				  { "address", DEDUP_ADDRESS },
 				  { 0, 0 } } },
+	{ NOTMUCH_OPT_BOOLEAN, &from_index, "from-index", 0, 0 },
 	{ NOTMUCH_OPT_INHERIT, (void *) &common_options, NULL, 0, 0 },
 	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
 	{ 0, 0, 0, 0, 0 }
@@ -887,6 +1181,22 @@ notmuch_address_command (notmuch_config_t *config, int argc, char *argv[])
 	return EXIT_FAILURE;
     }
 
+    if (from_index) {
+	if (argc - opt_index > 1) {
+	    fprintf (stderr, "Error: --from-index takes at most one address prefix.\n");
+	    return EXIT_FAILURE;
+	}
+
+	if (_notmuch_search_open (ctx, config))
+	    return EXIT_FAILURE;
+
+	ret = do_address_from_index (ctx, argc > opt_index ? argv[opt_index] : NULL);
+
+	_notmuch_search_cleanup (ctx);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     if (_notmuch_search_prepare (ctx, config,
 				 argc - opt_index, argv + opt_index))
 	return EXIT_FAILURE;
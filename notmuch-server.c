@@ -0,0 +1,530 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-client.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <stdint.h>
+
+/* notmuch server keeps the configuration and a read-only database
+ * open, and serves commands on a Unix socket in the .notmuch
+ * directory.  A notmuch invocation that finds the socket forwards its
+ * command there instead of running it:
+ *
+ *	client -> server: a 32 bit length with, as SCM_RIGHTS, the
+ *			  client's standard input, output and error;
+ *			  then that many bytes: the working directory
+ *			  and each argument, each terminated by '\0'.
+ *	server -> client: the 32 bit exit status of the command.
+ *
+ * The server forks a child for each request, which reads it, takes
+ * over the client's file descriptors and runs the command, opening
+ * the database with notmuch_cli_database_open.  So the output is the
+ * same as if the command had been run by the client, in any format.
+ * Before each fork the server reopens its database, which is cheap
+ * unless the database has changed.
+ */
+
+#define NOTMUCH_SERVER_SOCKET "server.sock"
+
+/* Requests larger than this are refused. */
+#define NOTMUCH_SERVER_MAX_REQUEST (1 << 20)
+
+/* How often to look for finished children if a SIGCHLD is missed. */
+#define NOTMUCH_SERVER_REAP_MS 1000
+
+typedef struct served_command {
+    const char *name;
+    int (*function) (notmuch_config_t *config, int argc, char *argv[]);
+} served_command_t;
+
+static const served_command_t served_commands[] = {
+    { "search", notmuch_search_command },
+    { "address", notmuch_address_command },
+    { "show", notmuch_show_command },
+    { "count", notmuch_count_command },
+    { "reply", notmuch_reply_command },
+    { "tag", notmuch_tag_command },
+    { "dump", notmuch_dump_command },
+};
+
+typedef struct server_child {
+    pid_t pid;
+    int fd;
+} server_child_t;
+
+/* In the child serving a request, the server's database. */
+static notmuch_database_t *server_database = NULL;
+
+static volatile sig_atomic_t interrupted;
+
+static void
+handle_sigint (unused (int sig))
+{
+    interrupted = 1;
+}
+
+static void
+handle_sigchld (unused (int sig))
+{
+}
+
+static const served_command_t *
+find_served_command (const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE (served_commands); i++)
+	if (strcmp (name, served_commands[i].name) == 0)
+	    return &served_commands[i];
+
+    return NULL;
+}
+
+static notmuch_bool_t
+socket_address (notmuch_config_t *config, struct sockaddr_un *addr)
+{
+    int len;
+
+    memset (addr, 0, sizeof (*addr));
+    addr->sun_family = AF_UNIX;
+    len = snprintf (addr->sun_path, sizeof (addr->sun_path), "%s/.notmuch/%s",
+		    notmuch_config_get_database_path (config),
+		    NOTMUCH_SERVER_SOCKET);
+
+    return len > 0 && (size_t) len < sizeof (addr->sun_path);
+}
+
+static notmuch_bool_t
+write_all (int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len) {
+	ssize_t written = send (fd, p, len, MSG_NOSIGNAL);
+
+	if (written < 0 && errno == EINTR)
+	    continue;
+	if (written <= 0)
+	    return FALSE;
+	p += written;
+	len -= written;
+    }
+
+    return TRUE;
+}
+
+static notmuch_bool_t
+read_all (int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len) {
+	ssize_t got = read (fd, p, len);
+
+	if (got < 0 && errno == EINTR)
+	    continue;
+	if (got <= 0)
+	    return FALSE;
+	p += got;
+	len -= got;
+    }
+
+    return TRUE;
+}
+
+notmuch_status_t
+notmuch_cli_database_open (const char *path,
+			   notmuch_database_mode_t mode,
+			   notmuch_database_t **notmuch,
+			   char **status_string)
+{
+    if (server_database && mode == NOTMUCH_DATABASE_MODE_READ_ONLY &&
+	strcmp (path, notmuch_database_get_path (server_database)) == 0) {
+	*notmuch = server_database;
+	if (status_string)
+	    *status_string = NULL;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    if (status_string)
+	return notmuch_database_open_verbose (path, mode, notmuch,
+					      status_string);
+
+    return notmuch_database_open (path, mode, notmuch);
+}
+
+int
+notmuch_server_forward (notmuch_config_t *config, int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char control[CMSG_SPACE (3 * sizeof (int))];
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    uint32_t length;
+    int32_t exit_status;
+    char *request, *cwd;
+    int fd, i;
+
+    if (argc < 1 || ! find_served_command (argv[0]))
+	return -1;
+
+    if (! socket_address (config, &addr))
+	return -1;
+
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+	return -1;
+
+    /* No server is running; run the command here. */
+    if (connect (fd, (struct sockaddr *) &addr, sizeof (addr))) {
+	close (fd);
+	return -1;
+    }
+
+    cwd = getcwd (NULL, 0);
+    request = talloc_strdup (config, cwd ? cwd : "/");
+    free (cwd);
+    length = strlen (request) + 1;
+    for (i = 0; i < argc && request; i++) {
+	request = talloc_realloc (config, request, char,
+				  length + strlen (argv[i]) + 1);
+	if (request) {
+	    strcpy (request + length, argv[i]);
+	    length += strlen (argv[i]) + 1;
+	}
+    }
+    if (request == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	close (fd);
+	return EXIT_FAILURE;
+    }
+
+    memset (&msg, 0, sizeof (msg));
+    memset (control, 0, sizeof (control));
+    iov.iov_base = &length;
+    iov.iov_len = sizeof (length);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+    memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+    /* Everything written before the command's output must come
+     * first. */
+    fflush (stdout);
+    fflush (stderr);
+
+    if (sendmsg (fd, &msg, MSG_NOSIGNAL) != sizeof (length) ||
+	! write_all (fd, request, length) ||
+	! read_all (fd, &exit_status, sizeof (exit_status))) {
+	fprintf (stderr, "Error: lost the connection to notmuch server.\n");
+	exit_status = EXIT_FAILURE;
+    }
+
+    talloc_free (request);
+    close (fd);
+
+    return exit_status;
+}
+
+/* Serve the request on 'fd'.  Runs in the child and does not
+ * return. */
+static void
+serve_request (notmuch_config_t *config, int fd)
+{
+    const served_command_t *command = NULL;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char control[CMSG_SPACE (3 * sizeof (int))];
+    int fds[3] = { -1, -1, -1 };
+    uint32_t length;
+    int32_t exit_status = EXIT_FAILURE;
+    char *request, *p, **argv;
+    int argc = 0, i;
+
+    memset (&msg, 0, sizeof (msg));
+    iov.iov_base = &length;
+    iov.iov_len = sizeof (length);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+
+    if (recvmsg (fd, &msg, 0) != sizeof (length) ||
+	length == 0 || length > NOTMUCH_SERVER_MAX_REQUEST)
+	_exit (EXIT_FAILURE);
+
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN (sizeof (fds)))
+	    memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+    }
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0)
+	_exit (EXIT_FAILURE);
+
+    request = talloc_size (config, length + 1);
+    if (request == NULL || ! read_all (fd, request, length))
+	_exit (EXIT_FAILURE);
+    request[length] = '\0';
+
+    for (i = 0; i < 3; i++) {
+	dup2 (fds[i], i);
+	close (fds[i]);
+    }
+
+    /* The working directory, then the arguments. */
+    for (p = request + strlen (request) + 1; p < request + length;
+	 p += strlen (p) + 1)
+	argc++;
+    argv = talloc_zero_array (config, char *, argc + 1);
+    if (argv == NULL)
+	_exit (EXIT_FAILURE);
+    i = 0;
+    for (p = request + strlen (request) + 1; p < request + length;
+	 p += strlen (p) + 1)
+	argv[i++] = p;
+
+    if (argc > 0)
+	command = find_served_command (argv[0]);
+
+    if (chdir (request)) {
+	fprintf (stderr, "Error: cannot change to directory %s: %s\n",
+		 request, strerror (errno));
+    } else if (command == NULL) {
+	fprintf (stderr, "Error: notmuch server does not run '%s'\n",
+		 argc > 0 ? argv[0] : "");
+    } else {
+	notmuch_format_version = NOTMUCH_FORMAT_CUR;
+	exit_status = (command->function) (config, argc, argv);
+    }
+
+    fflush (stdout);
+    fflush (stderr);
+
+    IGNORE_RESULT (write_all (fd, &exit_status, sizeof (exit_status)));
+    _exit (exit_status);
+}
+
+/* Report the exit status of each finished child to its client.
+ * 'options' are those of waitpid. */
+static void
+reap_children (server_child_t *children, size_t *num_children, int options)
+{
+    int32_t exit_status;
+    size_t i;
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid (-1, &status, options)) > 0) {
+	for (i = 0; i < *num_children; i++) {
+	    if (children[i].pid == pid)
+		break;
+	}
+	if (i == *num_children)
+	    continue;
+
+	/* A child that exited normally has reported its own
+	 * status, unless the command called exit (). */
+	exit_status = WIFEXITED (status) ? WEXITSTATUS (status) : EXIT_FAILURE;
+	IGNORE_RESULT (send (children[i].fd, &exit_status,
+			     sizeof (exit_status), MSG_NOSIGNAL));
+	close (children[i].fd);
+	children[i] = children[--*num_children];
+    }
+}
+
+int
+notmuch_server_command (notmuch_config_t *config, int argc, char *argv[])
+{
+    notmuch_database_t *notmuch;
+    const char *db_path;
+    struct sockaddr_un addr;
+    struct sigaction action;
+    struct pollfd pfd;
+    server_child_t *children = NULL;
+    size_t num_children = 0, size = 0;
+    notmuch_bool_t quiet = FALSE;
+    int opt_index, listen_fd, fd, ready;
+    pid_t pid;
+    int ret = EXIT_SUCCESS;
+
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_BOOLEAN,  &quiet, "quiet", 'q', 0 },
+	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
+
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return EXIT_FAILURE;
+
+    notmuch_process_shared_options (argv[0]);
+
+    db_path = notmuch_config_get_database_path (config);
+    if (! socket_address (config, &addr)) {
+	fprintf (stderr, "Error: the path of the database is too long for a socket.\n");
+	return EXIT_FAILURE;
+    }
+
+    if (notmuch_database_open (db_path, NOTMUCH_DATABASE_MODE_READ_ONLY,
+			       &notmuch))
+	return EXIT_FAILURE;
+
+    notmuch_exit_if_unmatched_db_uuid (notmuch);
+
+    listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+	fprintf (stderr, "Error creating socket: %s\n", strerror (errno));
+	notmuch_database_destroy (notmuch);
+	return EXIT_FAILURE;
+    }
+
+    /* A socket nobody is listening on is left over from a server that
+     * did not exit cleanly. */
+    if (connect (listen_fd, (struct sockaddr *) &addr, sizeof (addr)) == 0) {
+	fprintf (stderr, "Error: notmuch server is already running for %s.\n",
+		 db_path);
+	close (listen_fd);
+	notmuch_database_destroy (notmuch);
+	return EXIT_FAILURE;
+    }
+    unlink (addr.sun_path);
+
+    if (bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr)) ||
+	listen (listen_fd, SOMAXCONN)) {
+	fprintf (stderr, "Error listening on %s: %s\n", addr.sun_path,
+		 strerror (errno));
+	close (listen_fd);
+	notmuch_database_destroy (notmuch);
+	return EXIT_FAILURE;
+    }
+
+    memset (&action, 0, sizeof (struct sigaction));
+    action.sa_handler = handle_sigint;
+    sigemptyset (&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction (SIGINT, &action, NULL);
+    sigaction (SIGTERM, &action, NULL);
+
+    /* Without SA_RESTART, so that a finished child interrupts
+     * poll. */
+    action.sa_handler = handle_sigchld;
+    action.sa_flags = 0;
+    sigaction (SIGCHLD, &action, NULL);
+
+    if (! quiet) {
+	printf ("Serving %s on %s.\n", db_path, addr.sun_path);
+	fflush (stdout);
+    }
+
+    while (! interrupted) {
+	reap_children (children, &num_children, WNOHANG);
+
+	pfd.fd = listen_fd;
+	pfd.events = POLLIN;
+	ready = poll (&pfd, 1, num_children ? NOTMUCH_SERVER_REAP_MS : -1);
+	if (ready < 0 && errno == EINTR)
+	    continue;
+	if (ready < 0) {
+	    fprintf (stderr, "Error waiting for requests: %s\n",
+		     strerror (errno));
+	    ret = EXIT_FAILURE;
+	    break;
+	}
+	if (ready == 0)
+	    continue;
+
+	fd = accept (listen_fd, NULL, NULL);
+	if (fd < 0)
+	    continue;
+
+	if (num_children == size) {
+	    size = size ? 2 * size : 16;
+	    children = talloc_realloc (config, children, server_child_t, size);
+	    if (children == NULL) {
+		fprintf (stderr, "Out of memory.\n");
+		close (fd);
+		ret = EXIT_FAILURE;
+		break;
+	    }
+	}
+
+	/* Serve each request from the latest revision. */
+	if (notmuch_database_reopen (notmuch, NULL)) {
+	    notmuch_database_destroy (notmuch);
+	    if (notmuch_database_open (db_path, NOTMUCH_DATABASE_MODE_READ_ONLY,
+				       &notmuch)) {
+		close (fd);
+		ret = EXIT_FAILURE;
+		break;
+	    }
+	}
+
+	fflush (stdout);
+	fflush (stderr);
+
+	pid = fork ();
+	if (pid == 0) {
+	    size_t i;
+
+	    close (listen_fd);
+	    for (i = 0; i < num_children; i++)
+		close (children[i].fd);
+	    action.sa_handler = SIG_DFL;
+	    sigaction (SIGCHLD, &action, NULL);
+	    sigaction (SIGINT, &action, NULL);
+	    sigaction (SIGTERM, &action, NULL);
+	    server_database = notmuch;
+	    serve_request (config, fd);
+	}
+
+	if (pid < 0) {
+	    fprintf (stderr, "Error forking: %s\n", strerror (errno));
+	    close (fd);
+	    continue;
+	}
+
+	children[num_children].pid = pid;
+	children[num_children].fd = fd;
+	num_children++;
+    }
+
+    close (listen_fd);
+    unlink (addr.sun_path);
+
+    /* Let the requests being served finish. */
+    action.sa_handler = SIG_DFL;
+    sigaction (SIGCHLD, &action, NULL);
+    reap_children (children, &num_children, 0);
+
+    talloc_free (children);
+    notmuch_database_destroy (notmuch);
+
+    return ret;
+}
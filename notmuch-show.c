@@ -21,6 +21,18 @@
 #include "notmuch-client.h"
 #include "gmime-filter-reply.h"
 #include "sprinter.h"
+#include "mbox-util.h"
+#include "zlib-extra.h"
+
+#include <fcntl.h>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 static notmuch_status_t
 format_part_text (const void *ctx, sprinter_t *sp, mime_node_t *node,
@@ -700,7 +712,7 @@ format_part_mbox (const void *ctx, unused (sprinter_t *sp), mime_node_t *node,
 	INTERNAL_ERROR ("format_part_mbox requires a root part");
 
     filename = notmuch_message_get_filename (message);
-    file = fopen (filename, "r");
+    file = mbox_member_fopen (filename);
     if (file == NULL) {
 	fprintf (stderr, "Failed to open %s: %s\n",
 		 filename, strerror (errno));
@@ -729,49 +741,146 @@ format_part_mbox (const void *ctx, unused (sprinter_t *sp), mime_node_t *node,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+/* Copy the contents of the compressed message file 'filename' to
+ * standard output. */
 static notmuch_status_t
-format_part_raw (unused (const void *ctx), unused (sprinter_t *sp),
-		 mime_node_t *node, unused (int indent),
-		 unused (const notmuch_show_params_t *params))
+show_raw_message_stream (const char *filename)
 {
-    if (node->envelope_file) {
-	/* Special case the entire message to avoid MIME parsing. */
-	const char *filename;
-	FILE *file;
-	size_t size;
-	char buf[4096];
-
-	filename = notmuch_message_get_filename (node->envelope_file);
-	if (filename == NULL) {
-	    fprintf (stderr, "Error: Cannot get message filename.\n");
+    char buf[65536];
+    size_t size;
+    FILE *file;
+
+    file = mbox_member_fopen (filename);
+    if (file == NULL) {
+	fprintf (stderr, "Error: Cannot open file %s: %s\n", filename, strerror (errno));
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    while ((size = fread (buf, 1, sizeof (buf), file)) > 0) {
+	if (fwrite (buf, 1, size, stdout) != size) {
+	    fprintf (stderr, "Error: Write failed\n");
+	    fclose (file);
 	    return NOTMUCH_STATUS_FILE_ERROR;
 	}
+    }
 
-	file = fopen (filename, "r");
-	if (file == NULL) {
-	    fprintf (stderr, "Error: Cannot open file %s: %s\n", filename, strerror (errno));
-	    return NOTMUCH_STATUS_FILE_ERROR;
+    if (ferror (file)) {
+	fprintf (stderr, "Error: Read failed from %s\n", filename);
+	fclose (file);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    fclose (file);
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Copy the file of 'message' to standard output unchanged.
+ *
+ * Where the kernel can, the file is handed to standard output with
+ * sendfile, so the message never passes through user space;
+ * otherwise it is copied through a buffer.  A message of an mbox is
+ * copied straight from its place in the mbox, and a compressed one
+ * is decompressed on the way. */
+static notmuch_status_t
+show_raw_message_file (notmuch_message_t *message)
+{
+    const char *filename;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    off_t offset, length, end;
+    ssize_t size;
+    int fd;
+    char buf[65536];
+
+    filename = notmuch_message_get_filename (message);
+    if (filename == NULL) {
+	fprintf (stderr, "Error: Cannot get message filename.\n");
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    if (gz_filename_suffix (filename))
+	return show_raw_message_stream (filename);
+
+    fd = mbox_member_open (filename, &offset, &length);
+    if (fd < 0) {
+	fprintf (stderr, "Error: Cannot open file %s: %s\n", filename, strerror (errno));
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+    end = length < 0 ? -1 : offset + length;
+
+    /* Anything already written through stdio must come first. */
+    if (fflush (stdout)) {
+	fprintf (stderr, "Error: Write failed\n");
+	close (fd);
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+#if HAVE_SENDFILE
+    {
+	struct stat st;
+	off_t stop = end;
+
+	if (stop < 0 && fstat (fd, &st) == 0)
+	    stop = st.st_size;
+
+	while (offset < stop) {
+	    size = sendfile (STDOUT_FILENO, fd, &offset, stop - offset);
+	    if (size <= 0)
+		break;
+	}
+    }
+#endif
+
+    /* Copy whatever sendfile did not, if standard output is something
+     * sendfile cannot write to, or the file grew. */
+    for (;;) {
+	char *out = buf;
+	size_t want = sizeof (buf);
+
+	if (end >= 0 && end - offset < (off_t) want)
+	    want = end - offset;
+	if (want == 0)
+	    break;
+
+	size = pread (fd, buf, want, offset);
+	if (size < 0 && errno == EINTR)
+	    continue;
+	if (size < 0) {
+	    fprintf (stderr, "Error: Read failed from %s\n", filename);
+	    status = NOTMUCH_STATUS_FILE_ERROR;
+	    break;
 	}
+	if (size == 0)
+	    break;
+	offset += size;
 
-	while (!feof (file)) {
-	    size = fread (buf, 1, sizeof (buf), file);
-	    if (ferror (file)) {
-		fprintf (stderr, "Error: Read failed from %s\n", filename);
-		fclose (file);
-		return NOTMUCH_STATUS_FILE_ERROR;
-	    }
+	while (size > 0) {
+	    ssize_t written = write (STDOUT_FILENO, out, size);
 
-	    if (fwrite (buf, size, 1, stdout) != 1) {
+	    if (written < 0 && errno == EINTR)
+		continue;
+	    if (written < 0) {
 		fprintf (stderr, "Error: Write failed\n");
-		fclose (file);
+		close (fd);
 		return NOTMUCH_STATUS_FILE_ERROR;
 	    }
+	    out += written;
+	    size -= written;
 	}
-
-	fclose (file);
-	return NOTMUCH_STATUS_SUCCESS;
     }
 
+    close (fd);
+    return status;
+}
+
+static notmuch_status_t
+format_part_raw (unused (const void *ctx), unused (sprinter_t *sp),
+		 mime_node_t *node, unused (int indent),
+		 unused (const notmuch_show_params_t *params))
+{
+    if (node->envelope_file)
+	/* Special case the entire message to avoid MIME parsing. */
+	return show_raw_message_file (node->envelope_file);
+
     GMimeStream *stream_stdout;
     GMimeStream *stream_filter = NULL;
 
@@ -807,6 +916,190 @@ format_part_raw (unused (const void *ctx), unused (sprinter_t *sp),
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+/* With --jobs and --verify or --decrypt, the MIME trees of the
+ * messages of a thread are all opened before the thread is shown, and
+ * their signatures verified and encrypted parts decrypted by several
+ * threads at once, each with crypto contexts of its own.  show_message
+ * then formats the prepared trees in order, and mime-node.c reuses
+ * the results instead of calling into GPG one part at a time. */
+typedef struct show_prepared_thread {
+    notmuch_message_t **messages;
+    mime_node_t **roots;
+    notmuch_status_t *status;
+    unsigned int count;
+#if HAVE_PTHREAD
+    unsigned int next;
+    notmuch_crypto_t *crypto;
+    pthread_mutex_t lock;
+#endif
+} show_prepared_thread_t;
+
+/* If the tree of 'message' was prepared, move it to 'ctx' and return
+ * it (or the error opening it) and TRUE. */
+static notmuch_bool_t
+take_prepared_root (show_prepared_thread_t *prepared,
+		    notmuch_message_t *message, const void *ctx,
+		    mime_node_t **root, notmuch_status_t *status)
+{
+    unsigned int i;
+
+    if (prepared == NULL)
+	return FALSE;
+
+    for (i = 0; i < prepared->count; i++) {
+	if (prepared->messages[i] != message)
+	    continue;
+
+	*root = talloc_steal (ctx, prepared->roots[i]);
+	*status = prepared->status[i];
+	/* The message is destroyed once it has been shown. */
+	prepared->messages[i] = NULL;
+	prepared->roots[i] = NULL;
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int
+_show_prepared_thread_destroy (show_prepared_thread_t *prepared)
+{
+    unsigned int i;
+
+    for (i = 0; i < prepared->count; i++)
+	talloc_free (prepared->roots[i]);
+
+#if HAVE_PTHREAD
+    pthread_mutex_destroy (&prepared->lock);
+#endif
+
+    return 0;
+}
+
+#if HAVE_PTHREAD
+static void *
+prepare_worker (void *closure)
+{
+    show_prepared_thread_t *prepared = closure;
+    notmuch_crypto_t crypto = *prepared->crypto;
+
+    /* GMime crypto contexts are not shared between threads. */
+    crypto.gpgctx = NULL;
+    crypto.pkcs7ctx = NULL;
+
+    for (;;) {
+	mime_node_t *root;
+
+	pthread_mutex_lock (&prepared->lock);
+	if (prepared->next == prepared->count) {
+	    pthread_mutex_unlock (&prepared->lock);
+	    break;
+	}
+	root = prepared->roots[prepared->next++];
+	pthread_mutex_unlock (&prepared->lock);
+
+	if (root)
+	    mime_node_prepare_crypto (root, &crypto);
+    }
+
+    notmuch_crypto_cleanup (&crypto);
+
+    return NULL;
+}
+#endif
+
+/* Open the MIME trees of the messages of 'thread' that will be shown,
+ * and verify and decrypt them with params->jobs threads.  Returns
+ * NULL if there is nothing to gain, or on failure, in which case the
+ * messages are simply opened as they are shown. */
+static show_prepared_thread_t *
+prepare_thread (const void *ctx, notmuch_thread_t *thread,
+		notmuch_show_params_t *params)
+{
+#if HAVE_PTHREAD
+    show_prepared_thread_t *prepared;
+    notmuch_messages_t *messages;
+    pthread_t *threads;
+    int total, num_threads = 0, i;
+
+    if (params->jobs < 2 ||
+	! (params->crypto.verify || params->crypto.decrypt))
+	return NULL;
+
+    total = notmuch_thread_get_total_messages (thread);
+    if (total < 2)
+	return NULL;
+
+    prepared = talloc_zero (ctx, show_prepared_thread_t);
+    if (prepared == NULL)
+	return NULL;
+
+    prepared->messages = talloc_array (prepared, notmuch_message_t *, total);
+    prepared->roots = talloc_zero_array (prepared, mime_node_t *, total);
+    prepared->status = talloc_array (prepared, notmuch_status_t, total);
+    threads = talloc_array (prepared, pthread_t, params->jobs - 1);
+    if (prepared->messages == NULL || prepared->roots == NULL ||
+	prepared->status == NULL || threads == NULL) {
+	talloc_free (prepared);
+	return NULL;
+    }
+
+    pthread_mutex_init (&prepared->lock, NULL);
+    prepared->crypto = &params->crypto;
+    talloc_set_destructor (prepared, _show_prepared_thread_destroy);
+
+    /* As in notmuch new, the threads allocate into talloc
+     * hierarchies of their own. */
+    talloc_disable_null_tracking ();
+
+    for (messages = notmuch_thread_get_messages_window (
+	     thread, params->message_offset, params->message_limit);
+	 notmuch_messages_valid (messages) && prepared->count < (unsigned) total;
+	 notmuch_messages_move_to_next (messages))
+    {
+	notmuch_message_t *message = notmuch_messages_get (messages);
+	notmuch_bool_t match, excluded;
+	unsigned int n = prepared->count;
+
+	match = notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_MATCH);
+	excluded = notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_EXCLUDED);
+	if (! ((match && (!excluded || !params->omit_excluded)) ||
+	       params->entire_thread))
+	    continue;
+
+	/* Each tree is a talloc hierarchy of its own, so that it can
+	 * be prepared by any thread. */
+	prepared->messages[n] = message;
+	prepared->status[n] = mime_node_open (NULL, message, &params->crypto,
+					      &prepared->roots[n]);
+	if (prepared->status[n])
+	    prepared->roots[n] = NULL;
+	prepared->count++;
+    }
+    notmuch_messages_destroy (messages);
+
+    while (num_threads < params->jobs - 1 &&
+	   pthread_create (&threads[num_threads], NULL,
+			   prepare_worker, prepared) == 0)
+	num_threads++;
+
+    prepare_worker (prepared);
+
+    for (i = 0; i < num_threads; i++)
+	pthread_join (threads[i], NULL);
+
+    talloc_free (threads);
+
+    return prepared;
+#else
+    (void) ctx;
+    (void) thread;
+    (void) params;
+
+    return NULL;
+#endif
+}
+
 static notmuch_status_t
 show_message (void *ctx,
 	      const notmuch_show_format_t *format,
@@ -818,8 +1111,18 @@ show_message (void *ctx,
     void *local = talloc_new (ctx);
     mime_node_t *root, *part;
     notmuch_status_t status;
+    notmuch_bool_t prepared;
 
-    status = mime_node_open (local, message, &(params->crypto), &root);
+    /* The whole raw message is its file, so don't parse it at all. */
+    if (format->part == format_part_raw && params->part <= 0) {
+	status = show_raw_message_file (message);
+	goto DONE;
+    }
+
+    prepared = take_prepared_root (params->prepared, message, local,
+				   &root, &status);
+    if (! prepared)
+	status = mime_node_open (local, message, &(params->crypto), &root);
     if (status)
 	goto DONE;
     part = mime_node_seek_dfs (root, (params->part < 0 ? 0 : params->part));
@@ -830,6 +1133,15 @@ show_message (void *ctx,
     return status;
 }
 
+/* Is the next message in thread order past the window to show? */
+static notmuch_bool_t
+past_message_window (const notmuch_show_params_t *params)
+{
+    return params->message_limit >= 0 &&
+	params->message_position >=
+	params->message_offset + params->message_limit;
+}
+
 static notmuch_status_t
 show_messages (void *ctx,
 	       const notmuch_show_format_t *format,
@@ -841,13 +1153,17 @@ show_messages (void *ctx,
     notmuch_message_t *message;
     notmuch_bool_t match;
     notmuch_bool_t excluded;
+    notmuch_bool_t in_window;
     int next_indent;
     notmuch_status_t status, res = NOTMUCH_STATUS_SUCCESS;
 
     sp->begin_list (sp);
 
+    /* The messages after the window are left out, while those before
+     * it keep their places as null, so that the structure of the
+     * thread shown stays that of the whole. */
     for (;
-	 notmuch_messages_valid (messages);
+	 notmuch_messages_valid (messages) && ! past_message_window (params);
 	 notmuch_messages_move_to_next (messages))
     {
 	sp->begin_list (sp);
@@ -856,10 +1172,12 @@ show_messages (void *ctx,
 
 	match = notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_MATCH);
 	excluded = notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_EXCLUDED);
+	in_window = params->message_position++ >= params->message_offset;
 
 	next_indent = indent;
 
-	if ((match && (!excluded || !params->omit_excluded)) || params->entire_thread) {
+	if (in_window &&
+	    ((match && (!excluded || !params->omit_excluded)) || params->entire_thread)) {
 	    status = show_message (ctx, format, sp, message, indent, params);
 	    if (status && !res)
 		res = status;
@@ -925,6 +1243,48 @@ do_show_single (void *ctx,
 	!= NOTMUCH_STATUS_SUCCESS;
 }
 
+/* Ask the kernel to start reading the files of all of the messages
+ * of 'thread', so that on a cold cache they are fetched in whatever
+ * order suits the disk while the first messages are being formatted,
+ * rather than with one seek after each message shown. */
+static void
+prefetch_thread_files (notmuch_thread_t *thread,
+		       const notmuch_show_params_t *params)
+{
+#if HAVE_POSIX_FADVISE
+    notmuch_messages_t *messages;
+
+    /* A single message gains nothing over opening it right away. */
+    if (notmuch_thread_get_total_messages (thread) < 2)
+	return;
+
+    for (messages = notmuch_thread_get_messages_window (
+	     thread, params->message_offset, params->message_limit);
+	 notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
+    {
+	notmuch_message_t *message = notmuch_messages_get (messages);
+	const char *filename = notmuch_message_get_filename (message);
+	off_t offset, length;
+	int fd;
+
+	if (filename) {
+	    fd = mbox_member_open (filename, &offset, &length);
+	    if (fd >= 0) {
+		(void) posix_fadvise (fd, offset, length < 0 ? 0 : length,
+				      POSIX_FADV_WILLNEED);
+		close (fd);
+	    }
+	}
+    }
+
+    notmuch_messages_destroy (messages);
+#else
+    (void) thread;
+    (void) params;
+#endif
+}
+
 /* Formatted output of threads */
 static int
 do_show (void *ctx,
@@ -956,10 +1316,18 @@ do_show (void *ctx,
 	    INTERNAL_ERROR ("Thread %s has no toplevel messages.\n",
 			    notmuch_thread_get_thread_id (thread));
 
+	prefetch_thread_files (thread, params);
+	params->prepared = prepare_thread (ctx, thread, params);
+	params->message_position = 0;
+
 	status = show_messages (ctx, format, sp, messages, 0, params);
 	if (status && !res)
 	    res = status;
 
+	talloc_free (params->prepared);
+	params->prepared = NULL;
+
+	notmuch_memstats_poll ();
 	notmuch_thread_destroy (thread);
 
     }
@@ -1008,7 +1376,10 @@ notmuch_show_command (notmuch_config_t *config, int argc, char *argv[])
 	    .decrypt = FALSE,
 	    .gpgpath = NULL
 	},
-	.include_html = FALSE
+	.include_html = FALSE,
+	.jobs = 1,
+	.message_offset = 0,
+	.message_limit = -1
     };
     int format_sel = NOTMUCH_FORMAT_NOT_SPECIFIED;
     int exclude = EXCLUDE_TRUE;
@@ -1037,6 +1408,9 @@ notmuch_show_command (notmuch_config_t *config, int argc, char *argv[])
 	{ NOTMUCH_OPT_BOOLEAN, &params.crypto.verify, "verify", 'v', 0 },
 	{ NOTMUCH_OPT_BOOLEAN, &params.output_body, "body", 'b', 0 },
 	{ NOTMUCH_OPT_BOOLEAN, &params.include_html, "include-html", 0, 0 },
+	{ NOTMUCH_OPT_INT, &params.jobs, "jobs", 'j', 0 },
+	{ NOTMUCH_OPT_INT, &params.message_offset, "message-offset", 0, 0 },
+	{ NOTMUCH_OPT_INT, &params.message_limit, "message-limit", 0, 0 },
 	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
 	{ 0, 0, 0, 0, 0 }
     };
@@ -1047,6 +1421,11 @@ notmuch_show_command (notmuch_config_t *config, int argc, char *argv[])
 
     notmuch_process_shared_options (argv[0]);
 
+    if (params.message_offset < 0) {
+	fprintf (stderr, "Error: --message-offset must not be negative.\n");
+	return EXIT_FAILURE;
+    }
+
     /* decryption implies verification */
     if (params.crypto.decrypt)
 	params.crypto.verify = TRUE;
@@ -1132,12 +1511,24 @@ notmuch_show_command (notmuch_config_t *config, int argc, char *argv[])
 
     params.crypto.gpgpath = notmuch_config_get_crypto_gpg_path (config);
 
-    if (notmuch_database_open (notmuch_config_get_database_path (config),
-			       NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
+    if (notmuch_cli_database_open (notmuch_config_get_database_path (config),
+				   NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch,
+				   NULL))
 	return EXIT_FAILURE;
 
     notmuch_exit_if_unmatched_db_uuid (notmuch);
 
+    if (notmuch_config_get_search_cache_excludes (config))
+	notmuch_database_set_exclude_cache (notmuch, TRUE);
+
+    if (params.crypto.verify &&
+	notmuch_config_get_crypto_cache_signatures (config)) {
+	const char *path = talloc_asprintf (config, "%s/.notmuch/signatures",
+					    notmuch_database_get_path (notmuch));
+
+	params.crypto.sigcache = notmuch_signature_cache_open (config, path);
+    }
+
     query = notmuch_query_create (notmuch, query_string);
     if (query == NULL) {
 	fprintf (stderr, "Out of memory\n");
@@ -0,0 +1,282 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+/* Report the shape of the database, to find what makes it slow: ghost
+ * messages piling up, huge threads, messages with many files, tags
+ * on most messages.  Everything is counted from term frequencies and
+ * the sizes of the files of the Xapian database, so this is cheap to
+ * run on a database of any size. */
+
+#include "notmuch-client.h"
+#include "sprinter.h"
+
+#include <dirent.h>
+
+enum {
+    NOTMUCH_FORMAT_JSON,
+    NOTMUCH_FORMAT_TEXT,
+    NOTMUCH_FORMAT_SEXP
+};
+
+typedef struct {
+    const char *name;
+    unsigned long value;
+} stats_field_t;
+
+typedef struct {
+    char *name;
+    unsigned long kib;
+} stats_table_t;
+
+static int
+compare_tag_counts (const void *a, const void *b)
+{
+    const stats_field_t *ta = a, *tb = b;
+
+    if (ta->value != tb->value)
+	return ta->value < tb->value ? 1 : -1;
+    return strcmp (ta->name, tb->name);
+}
+
+/* The tags of the most messages, at most 'top' of them. */
+static stats_field_t *
+top_tags (void *ctx, notmuch_database_t *notmuch, unsigned int top,
+	  unsigned int *num_tags)
+{
+    notmuch_tags_t *tags;
+    stats_field_t *fields = NULL;
+    unsigned int n = 0;
+
+    *num_tags = 0;
+
+    tags = notmuch_database_get_tag_catalogue (notmuch);
+    if (tags == NULL)
+	return NULL;
+
+    for (; notmuch_tags_valid (tags); notmuch_tags_move_to_next (tags)) {
+	fields = talloc_realloc (ctx, fields, stats_field_t, n + 1);
+	fields[n].name = talloc_strdup (fields, notmuch_tags_get (tags));
+	fields[n].value = notmuch_tags_get_count (tags);
+	n++;
+    }
+    notmuch_tags_destroy (tags);
+
+    if (n)
+	qsort (fields, n, sizeof (*fields), compare_tag_counts);
+    *num_tags = n < top ? n : top;
+
+    return fields;
+}
+
+static int
+compare_tables (const void *a, const void *b)
+{
+    const stats_table_t *ta = a, *tb = b;
+
+    return strcmp (ta->name, tb->name);
+}
+
+/* The files of the Xapian database, with their sizes in KiB. */
+static stats_table_t *
+database_tables (void *ctx, const char *db_path, unsigned int *num_tables)
+{
+    char *xapian_path = talloc_asprintf (ctx, "%s/.notmuch/xapian", db_path);
+    stats_table_t *tables = NULL;
+    struct dirent *entry;
+    unsigned int n = 0;
+    DIR *dir;
+
+    *num_tables = 0;
+
+    dir = opendir (xapian_path);
+    if (dir == NULL)
+	return NULL;
+
+    while ((entry = readdir (dir)) != NULL) {
+	char *path = talloc_asprintf (ctx, "%s/%s", xapian_path,
+				      entry->d_name);
+	struct stat st;
+
+	if (stat (path, &st) == 0 && S_ISREG (st.st_mode)) {
+	    tables = talloc_realloc (ctx, tables, stats_table_t, n + 1);
+	    tables[n].name = talloc_strdup (tables, entry->d_name);
+	    tables[n].kib = (st.st_size + 1023) / 1024;
+	    n++;
+	}
+	talloc_free (path);
+    }
+    closedir (dir);
+
+    if (n)
+	qsort (tables, n, sizeof (*tables), compare_tables);
+    *num_tables = n;
+
+    return tables;
+}
+
+int
+notmuch_stats_command (notmuch_config_t *config, int argc, char *argv[])
+{
+    const char *db_path = notmuch_config_get_database_path (config);
+    notmuch_database_t *notmuch;
+    notmuch_database_stats_t stats;
+    notmuch_status_t status;
+    notmuch_tags_t *threads;
+    stats_field_t *tags;
+    stats_table_t *tables;
+    sprinter_t *format = NULL;
+    unsigned int num_tags, num_tables, i;
+    int format_sel = NOTMUCH_FORMAT_TEXT;
+    int top = 10;
+    int opt_index;
+
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_KEYWORD, &format_sel, "format", 'f',
+	  (notmuch_keyword_t []){ { "json", NOTMUCH_FORMAT_JSON },
+				  { "sexp", NOTMUCH_FORMAT_SEXP },
+				  { "text", NOTMUCH_FORMAT_TEXT },
+				  { 0, 0 } } },
+	{ NOTMUCH_OPT_INT, &top, "top", 't', 0 },
+	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
+
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return EXIT_FAILURE;
+
+    notmuch_process_shared_options (argv[0]);
+
+    if (opt_index < argc) {
+	fprintf (stderr, "Error: unexpected argument: %s\n", argv[opt_index]);
+	return EXIT_FAILURE;
+    }
+
+    if (top < 0) {
+	fprintf (stderr, "Error: --top must not be negative\n");
+	return EXIT_FAILURE;
+    }
+
+    if (notmuch_database_open (db_path, NOTMUCH_DATABASE_MODE_READ_ONLY,
+			       &notmuch))
+	return EXIT_FAILURE;
+
+    notmuch_exit_if_unmatched_db_uuid (notmuch);
+
+    status = notmuch_database_get_stats (notmuch, &stats);
+    if (! status)
+	status = notmuch_database_get_largest_threads (notmuch, top, &threads);
+    if (print_status_database ("notmuch stats", notmuch, status)) {
+	notmuch_database_destroy (notmuch);
+	return EXIT_FAILURE;
+    }
+
+    tags = top_tags (config, notmuch, top, &num_tags);
+    tables = database_tables (config, db_path, &num_tables);
+
+    {
+	stats_field_t fields[] = {
+	    { "documents", stats.documents },
+	    { "last_document_id", stats.last_document_id },
+	    { "average_length", (unsigned long) (stats.average_length + 0.5) },
+	    { "messages", stats.messages },
+	    { "ghosts", stats.ghosts },
+	    { "directories", stats.directories },
+	    { "filenames", stats.filenames },
+	    { "threads", stats.threads },
+	    { "tags", stats.tags },
+	    { "tag_terms", stats.tag_terms },
+	    { "pending_bodies", stats.pending_bodies },
+	    { "pending_extractions", stats.pending_extractions },
+	};
+
+	switch (format_sel) {
+	case NOTMUCH_FORMAT_JSON:
+	    format = sprinter_json_create (config, stdout);
+	    break;
+	case NOTMUCH_FORMAT_SEXP:
+	    format = sprinter_sexp_create (config, stdout);
+	    break;
+	}
+
+	if (format == NULL) {
+	    for (i = 0; i < ARRAY_SIZE (fields); i++)
+		printf ("%s\t%lu\n", fields[i].name, fields[i].value);
+	    for (; notmuch_tags_valid (threads);
+		 notmuch_tags_move_to_next (threads))
+		printf ("thread:%s\t%u\n", notmuch_tags_get (threads),
+			notmuch_tags_get_count (threads));
+	    for (i = 0; i < num_tags; i++)
+		printf ("tag:%s\t%lu\n", tags[i].name, tags[i].value);
+	    for (i = 0; i < num_tables; i++)
+		printf ("table:%s\t%lu\n", tables[i].name, tables[i].kib);
+	} else {
+	    format->begin_map (format);
+	    for (i = 0; i < ARRAY_SIZE (fields); i++) {
+		format->map_key (format, fields[i].name);
+		format->integer (format, fields[i].value);
+	    }
+
+	    format->map_key (format, "largest_threads");
+	    format->begin_list (format);
+	    for (; notmuch_tags_valid (threads);
+		 notmuch_tags_move_to_next (threads)) {
+		format->begin_map (format);
+		format->map_key (format, "thread");
+		format->string (format, notmuch_tags_get (threads));
+		format->map_key (format, "messages");
+		format->integer (format, notmuch_tags_get_count (threads));
+		format->end (format);
+	    }
+	    format->end (format);
+
+	    format->map_key (format, "top_tags");
+	    format->begin_list (format);
+	    for (i = 0; i < num_tags; i++) {
+		format->begin_map (format);
+		format->map_key (format, "tag");
+		format->string (format, tags[i].name);
+		format->map_key (format, "messages");
+		format->integer (format, tags[i].value);
+		format->end (format);
+	    }
+	    format->end (format);
+
+	    format->map_key (format, "tables");
+	    format->begin_list (format);
+	    for (i = 0; i < num_tables; i++) {
+		format->begin_map (format);
+		format->map_key (format, "name");
+		format->string (format, tables[i].name);
+		format->map_key (format, "kib");
+		format->integer (format, tables[i].kib);
+		format->end (format);
+	    }
+	    format->end (format);
+
+	    format->end (format);
+	}
+    }
+
+    notmuch_tags_destroy (threads);
+    talloc_free (tags);
+    talloc_free (tables);
+    notmuch_database_destroy (notmuch);
+
+    return EXIT_SUCCESS;
+}
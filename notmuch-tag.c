@@ -88,6 +88,146 @@ _optimize_tag_query (void *ctx, const char *orig_query_string,
     return query_string;
 }
 
+/* Renames of maildir files in flight at once.  They wait on the
+ * filesystem, not on the processor. */
+#define MAILDIR_SYNC_JOBS 8
+
+/* Synchronize the maildir flags of the messages changed after
+ * 'revision'. */
+static int
+sync_changed_maildir_flags (void *ctx, notmuch_database_t *notmuch,
+			    unsigned long revision)
+{
+    notmuch_query_t *query;
+    notmuch_status_t status;
+    const char *uuid;
+    char *query_string;
+
+    query_string = talloc_asprintf (ctx, "lastmod:%lu..%lu", revision + 1,
+				    notmuch_database_get_revision (notmuch,
+								   &uuid));
+    if (query_string == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return 1;
+    }
+
+    query = notmuch_query_create (notmuch, query_string);
+    if (query == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return 1;
+    }
+
+    notmuch_query_set_sort (query, NOTMUCH_SORT_UNSORTED);
+
+    status = notmuch_query_tags_to_maildir_flags (query, MAILDIR_SYNC_JOBS);
+    if (status)
+	fprintf (stderr, "Error: failed to sync tags to maildir flags: %s\n",
+		 notmuch_status_to_string (status));
+
+    notmuch_query_destroy (query);
+
+    return status;
+}
+
+/* Tag all messages matching 'query' according to 'tag_ops' with
+ * notmuch_query_change_tags, then synchronize the maildir flags of
+ * those that changed. */
+static int
+tag_query_bulk (void *ctx, notmuch_database_t *notmuch, notmuch_query_t *query,
+		tag_op_list_t *tag_ops, tag_op_flag_t flags)
+{
+    size_t i, j, num_ops = tag_op_list_size (tag_ops);
+    size_t num_add = 0, num_remove = 0;
+    const char **add_tags, **remove_tags;
+    notmuch_status_t status;
+    unsigned long revision;
+    const char *uuid;
+
+    add_tags = talloc_zero_array (ctx, const char *, num_ops + 1);
+    remove_tags = talloc_zero_array (ctx, const char *, num_ops + 1);
+    if (add_tags == NULL || remove_tags == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return 1;
+    }
+
+    /* Operations are applied in order, so only the last one on each
+     * tag counts. */
+    for (i = 0; i < num_ops; i++) {
+	const char *tag = tag_op_list_tag (tag_ops, i);
+
+	for (j = i + 1; j < num_ops; j++) {
+	    if (strcmp (tag, tag_op_list_tag (tag_ops, j)) == 0)
+		break;
+	}
+	if (j < num_ops)
+	    continue;
+
+	if (tag_op_list_isremove (tag_ops, i))
+	    remove_tags[num_remove++] = tag;
+	else
+	    add_tags[num_add++] = tag;
+    }
+
+    revision = notmuch_database_get_revision (notmuch, &uuid);
+
+    status = notmuch_query_change_tags (query, add_tags, remove_tags,
+					flags & TAG_FLAG_REMOVE_ALL, NULL);
+    if (print_status_query ("notmuch tag", query, status))
+	return status;
+
+    if (flags & TAG_FLAG_MAILDIR_SYNC)
+	return sync_changed_maildir_flags (ctx, notmuch, revision);
+
+    return 0;
+}
+
+/* Journal the changes of 'tag_ops' to all messages matching 'query',
+ * through a read-only database.  See notmuch_message_journal_tag. */
+static int
+tag_query_journal (notmuch_query_t *query, tag_op_list_t *tag_ops,
+		   tag_op_flag_t flags)
+{
+    notmuch_messages_t *messages;
+    notmuch_message_t *message;
+    notmuch_tags_t *tags;
+    notmuch_status_t status;
+    size_t i;
+
+    status = notmuch_query_search_messages_st (query, &messages);
+    if (print_status_query ("notmuch tag", query, status))
+	return status;
+
+    for (;
+	 notmuch_messages_valid (messages) && ! interrupted && ! status;
+	 notmuch_messages_move_to_next (messages)) {
+	message = notmuch_messages_get (messages);
+
+	/* Changes are noted in order, so a tag removed here and added
+	 * back below stays. */
+	if (flags & TAG_FLAG_REMOVE_ALL) {
+	    for (tags = notmuch_message_get_tags (message);
+		 notmuch_tags_valid (tags) && ! status;
+		 notmuch_tags_move_to_next (tags))
+		status = notmuch_message_journal_tag (
+		    message, notmuch_tags_get (tags), FALSE);
+	}
+
+	for (i = 0; i < tag_op_list_size (tag_ops) && ! status; i++)
+	    status = notmuch_message_journal_tag (
+		message, tag_op_list_tag (tag_ops, i),
+		! tag_op_list_isremove (tag_ops, i));
+
+	if (status)
+	    fprintf (stderr, "Error: cannot journal tags of message %s: %s\n",
+		     notmuch_message_get_message_id (message),
+		     notmuch_status_to_string (status));
+
+	notmuch_message_destroy (message);
+    }
+
+    return status;
+}
+
 /* Tag messages matching 'query_string' according to 'tag_ops'
  */
 static int
@@ -121,6 +261,20 @@ tag_query (void *ctx, notmuch_database_t *notmuch, const char *query_string,
     /* tagging is not interested in any special sort order */
     notmuch_query_set_sort (query, NOTMUCH_SORT_UNSORTED);
 
+    if (flags & TAG_FLAG_JOURNAL) {
+	ret = tag_query_journal (query, tag_ops, flags);
+	notmuch_query_destroy (query);
+	return ret || interrupted;
+    }
+
+    /* The changed messages are found again by their revisions, which
+     * older databases do not record. */
+    if (! notmuch_database_needs_upgrade (notmuch)) {
+	ret = tag_query_bulk (ctx, notmuch, query, tag_ops, flags);
+	notmuch_query_destroy (query);
+	return ret || interrupted;
+    }
+
     status = notmuch_query_search_messages_st (query, &messages);
     if (print_status_query ("notmuch tag", query, status))
 	return status;
@@ -140,9 +294,14 @@ tag_query (void *ctx, notmuch_database_t *notmuch, const char *query_string,
     return ret || interrupted;
 }
 
+/* Lines of a batch are applied in atomic sections, each ending after
+ * 'group_lines' lines or 'group_seconds' seconds, whichever comes
+ * first.  A section is committed as a whole, which saves a flush for
+ * every line. */
 static int
 tag_file (void *ctx, notmuch_database_t *notmuch, tag_op_flag_t flags,
-	  FILE *input)
+	  FILE *input, int group_lines, int group_seconds,
+	  notmuch_bool_t verbose)
 {
     char *line = NULL;
     char *query_string = NULL;
@@ -150,6 +309,9 @@ tag_file (void *ctx, notmuch_database_t *notmuch, tag_op_flag_t flags,
     ssize_t line_len;
     int ret = 0;
     int warn = 0;
+    int lines = 0, group = 0;
+    struct timeval tv_start, tv_group, tv_now;
+    double elapsed;
     tag_op_list_t *tag_ops;
 
     tag_ops = tag_op_list_create (ctx);
@@ -158,9 +320,32 @@ tag_file (void *ctx, notmuch_database_t *notmuch, tag_op_flag_t flags,
 	return 1;
     }
 
+    gettimeofday (&tv_start, NULL);
+    tv_group = tv_start;
+
+    if (notmuch_database_begin_atomic (notmuch)) {
+	fprintf (stderr, "Error: cannot start an atomic section.\n");
+	return 1;
+    }
+
     while ((line_len = getline (&line, &line_size, input)) != -1 &&
 	   ! interrupted) {
 
+	lines++;
+	if (++group > group_lines ||
+	    (gettimeofday (&tv_now, NULL) == 0 &&
+	     notmuch_time_elapsed (tv_group, tv_now) >= group_seconds)) {
+	    if (notmuch_database_end_atomic (notmuch) ||
+		notmuch_database_flush_tag_journal (notmuch) ||
+		notmuch_database_begin_atomic (notmuch)) {
+		fprintf (stderr, "Error: cannot commit tag changes.\n");
+		ret = 1;
+		break;
+	    }
+	    group = 1;
+	    gettimeofday (&tv_group, NULL);
+	}
+
 	ret = parse_tag_line (ctx, line, TAG_FLAG_NONE,
 			      &query_string, tag_ops);
 
@@ -183,6 +368,23 @@ tag_file (void *ctx, notmuch_database_t *notmuch, tag_op_flag_t flags,
     if (line)
 	free (line);
 
+    if (notmuch_database_end_atomic (notmuch) ||
+	notmuch_database_flush_tag_journal (notmuch)) {
+	fprintf (stderr, "Error: cannot commit tag changes.\n");
+	ret = 1;
+    }
+
+    if (verbose) {
+	gettimeofday (&tv_now, NULL);
+	elapsed = notmuch_time_elapsed (tv_start, tv_now);
+	printf ("Processed %d %s in ", lines,
+		lines == 1 ? "line" : "lines");
+	notmuch_time_print_formatted_seconds (elapsed);
+	if (elapsed > 1)
+	    printf (" (%d lines/sec.)", (int) (lines / elapsed));
+	printf (".\n");
+    }
+
     return ret || warn;
 }
 
@@ -196,6 +398,9 @@ notmuch_tag_command (notmuch_config_t *config, int argc, char *argv[])
     tag_op_flag_t tag_flags = TAG_FLAG_NONE;
     notmuch_bool_t batch = FALSE;
     notmuch_bool_t remove_all = FALSE;
+    notmuch_bool_t verbose = FALSE;
+    int group_lines = 1000;
+    int group_seconds = 10;
     FILE *input = stdin;
     char *input_file_name = NULL;
     int opt_index;
@@ -212,6 +417,9 @@ notmuch_tag_command (notmuch_config_t *config, int argc, char *argv[])
 	{ NOTMUCH_OPT_BOOLEAN, &batch, "batch", 0, 0 },
 	{ NOTMUCH_OPT_STRING, &input_file_name, "input", 'i', 0 },
 	{ NOTMUCH_OPT_BOOLEAN, &remove_all, "remove-all", 0, 0 },
+	{ NOTMUCH_OPT_INT, &group_lines, "group-lines", 0, 0 },
+	{ NOTMUCH_OPT_INT, &group_seconds, "group-seconds", 0, 0 },
+	{ NOTMUCH_OPT_BOOLEAN, &verbose, "verbose", 'v', 0 },
 	{ NOTMUCH_OPT_INHERIT, (void *) &notmuch_shared_options, NULL, 0, 0 },
 	{ 0, 0, 0, 0, 0 }
     };
@@ -232,6 +440,11 @@ notmuch_tag_command (notmuch_config_t *config, int argc, char *argv[])
 	}
     }
 
+    if (group_lines < 1 || group_seconds < 0) {
+	fprintf (stderr, "Error: --group-lines must be positive and --group-seconds not negative.\n");
+	return EXIT_FAILURE;
+    }
+
     if (batch) {
 	if (opt_index != argc) {
 	    fprintf (stderr, "Can't specify both cmdline and stdin!\n");
@@ -259,23 +472,36 @@ notmuch_tag_command (notmuch_config_t *config, int argc, char *argv[])
 	}
     }
 
+    /* Journaled changes cannot rename the message files, so journal
+     * only without maildir synchronization. */
+    if (notmuch_config_get_maildir_synchronize_flags (config))
+	tag_flags |= TAG_FLAG_MAILDIR_SYNC;
+    else if (notmuch_config_get_tag_journal (config))
+	tag_flags |= TAG_FLAG_JOURNAL;
+
     if (notmuch_database_open (notmuch_config_get_database_path (config),
-			       NOTMUCH_DATABASE_MODE_READ_WRITE, &notmuch))
+			       (tag_flags & TAG_FLAG_JOURNAL) ?
+			       NOTMUCH_DATABASE_MODE_READ_ONLY :
+			       NOTMUCH_DATABASE_MODE_READ_WRITE,
+			       &notmuch))
 	return EXIT_FAILURE;
 
     notmuch_exit_if_unmatched_db_uuid (notmuch);
 
-    if (notmuch_config_get_maildir_synchronize_flags (config))
-	tag_flags |= TAG_FLAG_MAILDIR_SYNC;
-
     if (remove_all)
 	tag_flags |= TAG_FLAG_REMOVE_ALL;
 
     if (batch)
-	ret = tag_file (config, notmuch, tag_flags, input);
+	ret = tag_file (config, notmuch, tag_flags, input,
+			group_lines, group_seconds, verbose);
     else
 	ret = tag_query (config, notmuch, query_string, tag_ops, tag_flags);
 
+    if (notmuch_database_flush_tag_journal (notmuch)) {
+	fprintf (stderr, "Error: cannot write the tag journal.\n");
+	ret = 1;
+    }
+
     notmuch_database_destroy (notmuch);
 
     if (input != stdin)
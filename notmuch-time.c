@@ -135,3 +135,22 @@ notmuch_time_elapsed (struct timeval start, struct timeval end)
     return ((end.tv_sec - start.tv_sec) +
 	    (end.tv_usec - start.tv_usec) / 1e6);
 }
+
+/* Return the current time of 'clock', in seconds. */
+double
+notmuch_time_clock (clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime (clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print 'phase' to 'stream' as the JSON object member 'name'. */
+void
+notmuch_time_print_phase (FILE *stream, const char *name,
+			  const notmuch_profile_phase_t *phase)
+{
+    fprintf (stream, "\"%s\": {\"wall\": %.6f, \"cpu\": %.6f, \"calls\": %lu}",
+	     name, phase->wall, phase->cpu, phase->calls);
+}
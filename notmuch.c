@@ -47,12 +47,14 @@ static int
 _help_for (const char *topic);
 
 static notmuch_bool_t print_version = FALSE, print_help = FALSE;
+static notmuch_bool_t print_memstats = FALSE;
 char *notmuch_requested_db_uuid = NULL;
 
 const notmuch_opt_desc_t notmuch_shared_options [] = {
     { NOTMUCH_OPT_BOOLEAN, &print_version, "version", 'v', 0 },
     { NOTMUCH_OPT_BOOLEAN, &print_help, "help", 'h', 0 },
     { NOTMUCH_OPT_STRING, &notmuch_requested_db_uuid, "uuid", 'u', 0 },
+    { NOTMUCH_OPT_BOOLEAN, &print_memstats, "memstats", 0, 0 },
     {0, 0, 0, 0, 0}
 };
 
@@ -71,6 +73,9 @@ notmuch_process_shared_options (const char *subcommand_name) {
 	int ret = _help_for (subcommand_name);
 	exit (ret);
     }
+
+    if (print_memstats)
+	notmuch_memstats_enable ();
 }
 
 /* This is suitable for subcommands that do not actually open the
@@ -105,6 +110,12 @@ static command_t commands[] = {
       "Find and import new messages to the notmuch database." },
     { "insert", notmuch_insert_command, FALSE,
       "Add a new message into the maildir and notmuch database." },
+    { "index-pending", notmuch_index_pending_command, FALSE,
+      "Index the bodies of messages added with --defer-body." },
+    { "index-attachments", notmuch_index_attachments_command, FALSE,
+      "Extract and index the text of attachments." },
+    { "watch", notmuch_watch_command, FALSE,
+      "Keep the database up to date as mail arrives." },
     { "search", notmuch_search_command, FALSE,
       "Search for messages matching the given search terms." },
     { "address", notmuch_address_command, FALSE,
@@ -113,10 +124,18 @@ static command_t commands[] = {
       "Show all messages matching the search terms." },
     { "count", notmuch_count_command, FALSE,
       "Count messages matching the search terms." },
+    { "stats", notmuch_stats_command, FALSE,
+      "Report the shape of the database, to find what slows it down." },
     { "reply", notmuch_reply_command, FALSE,
       "Construct a reply template for a set of messages." },
     { "tag", notmuch_tag_command, FALSE,
       "Add/remove tags for all messages matching the search terms." },
+    { "roll-archive", notmuch_roll_archive_command, FALSE,
+      "Move old messages into a read-only archive shard." },
+    { "server", notmuch_server_command, FALSE,
+      "Keep the database open and serve commands on a socket." },
+    { "replicate", notmuch_replicate_command, FALSE,
+      "Serve or pull changes to read-only replicas of the database." },
     { "dump", notmuch_dump_command, FALSE,
       "Create a plain-text dump of the tags for each message." },
     { "restore", notmuch_restore_command, FALSE,
@@ -367,7 +386,7 @@ int
 main (int argc, char *argv[])
 {
     void *local;
-    char *talloc_report;
+    char *talloc_report, *memstats;
     const char *command_name = NULL;
     command_t *command;
     char *config_file_name = NULL;
@@ -393,6 +412,10 @@ main (int argc, char *argv[])
     /* Globally default to the current output format version. */
     notmuch_format_version = NOTMUCH_FORMAT_CUR;
 
+    memstats = getenv ("NOTMUCH_MEMSTATS");
+    if (memstats && strcmp (memstats, "") != 0)
+	notmuch_memstats_enable ();
+
     opt_index = parse_arguments (argc, argv, options, 1);
     if (opt_index < 0) {
 	ret = EXIT_FAILURE;
@@ -418,7 +441,26 @@ main (int argc, char *argv[])
 	goto DONE;
     }
 
-    ret = (command->function)(config, argc - opt_index, argv + opt_index);
+    /* Xapian has writers keep the changesets that replicas pull
+     * when this is set as they open the database. */
+    if (notmuch_config_get_replicate_changesets (config) &&
+	getenv ("XAPIAN_MAX_CHANGESETS") == NULL)
+	setenv ("XAPIAN_MAX_CHANGESETS",
+		talloc_asprintf (local, "%d",
+				 notmuch_config_get_replicate_changesets (config)),
+		1);
+
+    /* Commands given no options of the main command may be run by a
+     * notmuch server, if one is running. */
+    ret = -1;
+    if (opt_index == 1 && command_name)
+	ret = notmuch_server_forward (config, argc - opt_index,
+				      argv + opt_index);
+    if (ret < 0)
+	ret = (command->function)(config, argc - opt_index, argv + opt_index);
+
+    if (notmuch_memstats_is_enabled ())
+	notmuch_memstats_print (stderr);
 
   DONE:
     if (config)
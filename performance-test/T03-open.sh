@@ -0,0 +1,13 @@
+#!/bin/bash
+
+test_description='short commands'
+
+. ./perf-test-lib.sh || exit 1
+
+time_start
+
+time_run 'open 100 times' 'for i in $(seq 100); do notmuch config get user.name > /dev/null; notmuch dump id:nonexistent > /dev/null; done'
+time_run 'count 100 times' 'for i in $(seq 100); do notmuch count tag:inbox > /dev/null; done'
+time_run 'search 100 times' 'for i in $(seq 100); do notmuch search --limit=10 tag:inbox > /dev/null; done'
+
+time_done
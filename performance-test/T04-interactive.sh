@@ -0,0 +1,11 @@
+#!/bin/bash
+
+test_description='interactive latency'
+
+. ./perf-test-lib.sh || exit 1
+
+time_start
+
+latency_run 'emacs session' emacs-session.trace
+
+time_done
@@ -0,0 +1,290 @@
+#!/usr/bin/env python
+"""Generate a synthetic mail corpus for the performance tests.
+
+The corpus is a maildir tree of messages with a controlled number of
+messages, thread sizes and shapes, attachment sizes, duplicate rate
+and tag distribution, plus a dump of the tags in the format read by
+"notmuch restore".  The same options and seed always give the same
+corpus, byte for byte, so timings taken on it are comparable.
+
+Thread sizes follow a Zipf-like distribution capped at
+--max-thread-size; --giant-threads adds threads of exactly
+--giant-thread-size messages on top.  Each reply answers a random
+earlier message of its thread, except that with probability
+--chain-rate it answers the latest one, which builds deep reply
+chains.  As mail clients do, References headers keep the root and the
+latest ancestors, up to --max-references of them.
+
+Usage: gen-corpus.py [options] <output-directory>
+"""
+
+from __future__ import print_function
+
+import argparse
+import base64
+import binascii
+import os
+import random
+import sys
+import time
+
+WORDS = ('the of and to in is you that it he was for on are as with his '
+         'they at be this have from or one had by word but not what all '
+         'were we when your can said there use an each which she do how '
+         'their if will up other about out many then them these so some '
+         'her would make like him into time has look two more write go see '
+         'number no way could people my than first water been call who oil '
+         'its now find long down day did get come made may part notmuch '
+         'xapian thread index query tag mail message search database').split()
+
+DOMAINS = ('example.com', 'example.org', 'example.net', 'lists.example.com')
+
+FOLDERS = ('INBOX', 'lists', 'archive', 'sent')
+
+# The first day of the corpus, and how many seconds each message is
+# later than the previous one on average.
+EPOCH = 1230768000  # 2009-01-01
+MESSAGE_INTERVAL = 600
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description='Generate a deterministic synthetic mail corpus.')
+    parser.add_argument('output', help='directory to create the corpus in')
+    parser.add_argument('--messages', type=int, default=10000,
+                        help='number of distinct messages (default: 10000)')
+    parser.add_argument('--seed', type=int, default=1,
+                        help='random seed (default: 1)')
+    parser.add_argument('--max-thread-size', type=int, default=200,
+                        help='largest ordinary thread (default: 200)')
+    parser.add_argument('--thread-exponent', type=float, default=1.8,
+                        help='Zipf exponent of the thread sizes; larger '
+                        'means more small threads (default: 1.8)')
+    parser.add_argument('--giant-threads', type=int, default=0,
+                        help='number of additional giant threads (default: 0)')
+    parser.add_argument('--giant-thread-size', type=int, default=10000,
+                        help='messages per giant thread (default: 10000)')
+    parser.add_argument('--chain-rate', type=float, default=0.3,
+                        help='probability that a reply answers the latest '
+                        'message of its thread (default: 0.3)')
+    parser.add_argument('--max-references', type=int, default=50,
+                        help='longest References header (default: 50)')
+    parser.add_argument('--attachment-rate', type=float, default=0.05,
+                        help='fraction of messages with an attachment '
+                        '(default: 0.05)')
+    parser.add_argument('--attachment-size', type=int, default=64 * 1024,
+                        help='mean attachment size in bytes (default: 65536)')
+    parser.add_argument('--huge-attachment-rate', type=float, default=0.001,
+                        help='fraction of attachments that are huge '
+                        '(default: 0.001)')
+    parser.add_argument('--huge-attachment-size', type=int,
+                        default=16 * 1024 * 1024,
+                        help='size of huge attachments in bytes '
+                        '(default: 16777216)')
+    parser.add_argument('--uuencode-rate', type=float, default=0.0,
+                        help='fraction of messages with a uuencoded '
+                        'file in their text (default: 0)')
+    parser.add_argument('--uuencode-size', type=int, default=32 * 1024,
+                        help='mean size in bytes of the uuencoded files '
+                        '(default: 32768)')
+    parser.add_argument('--duplicate-rate', type=float, default=0.02,
+                        help='fraction of messages stored in a second file '
+                        '(default: 0.02)')
+    parser.add_argument('--tags', type=int, default=50,
+                        help='number of distinct tags (default: 50)')
+    parser.add_argument('--tags-per-message', type=float, default=2.0,
+                        help='mean number of tags per message (default: 2)')
+    parser.add_argument('--messages-per-directory', type=int, default=5000,
+                        help='files per maildir (default: 5000)')
+    return parser.parse_args()
+
+
+def zipf_choice(rng, n, exponent, weights_cache={}):
+    """Return an integer in [1, n], k with probability proportional to
+    1 / k**exponent."""
+    key = (n, exponent)
+    if key not in weights_cache:
+        total = 0.0
+        cumulative = []
+        for k in range(1, n + 1):
+            total += 1.0 / k ** exponent
+            cumulative.append(total)
+        weights_cache[key] = cumulative
+    cumulative = weights_cache[key]
+    x = rng.random() * cumulative[-1]
+    lo, hi = 0, n - 1
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if cumulative[mid] < x:
+            lo = mid + 1
+        else:
+            hi = mid
+    return lo + 1
+
+
+def thread_sizes(rng, args):
+    """Return the list of thread sizes, adding up to --messages."""
+    sizes = [args.giant_thread_size] * args.giant_threads
+    remaining = args.messages - sum(sizes)
+    while remaining > 0:
+        size = min(zipf_choice(rng, args.max_thread_size,
+                               args.thread_exponent), remaining)
+        sizes.append(size)
+        remaining -= size
+    rng.shuffle(sizes)
+    return sizes
+
+
+def sentence(rng, words):
+    return ' '.join(rng.choice(WORDS) for _ in range(words))
+
+
+def address(rng, people):
+    person = rng.randrange(people)
+    return ('Person %d <person%d@%s>' %
+            (person, person, DOMAINS[person % len(DOMAINS)]))
+
+
+def attachment(rng, args):
+    """Return the size of the attachment of a message, or 0."""
+    if rng.random() >= args.attachment_rate:
+        return 0
+    if rng.random() < args.huge_attachment_rate:
+        return args.huge_attachment_size
+    return max(1, int(rng.expovariate(1.0 / args.attachment_size)))
+
+
+def attachment_part(rng, size):
+    # Repeat a random block rather than drawing every byte, which
+    # keeps huge attachments cheap to generate.
+    block = bytearray(rng.getrandbits(8) for _ in range(min(size, 4096)))
+    data = bytes(block) * (size // len(block)) + bytes(block[:size % len(block)])
+    encoded = base64.encodestring(data) if sys.version_info[0] == 2 \
+        else base64.encodebytes(data).decode('ascii')
+    return ('--boundary\n'
+            'Content-Type: application/octet-stream\n'
+            'Content-Disposition: attachment; filename="data.bin"\n'
+            'Content-Transfer-Encoding: base64\n\n' + encoded)
+
+
+def uuencoded_file(rng, args):
+    """Return a uuencoded file to put in the text of a message, or ''."""
+    # Draw nothing by default, which keeps older corpora the same.
+    if args.uuencode_rate <= 0 or rng.random() >= args.uuencode_rate:
+        return ''
+    size = max(1, int(rng.expovariate(1.0 / args.uuencode_size)))
+    block = bytearray(rng.getrandbits(8) for _ in range(min(size, 4096)))
+    data = bytes(block) * (size // len(block)) + bytes(block[:size % len(block)])
+    lines = [binascii.b2a_uu(data[i:i + 45]).decode('ascii')
+             for i in range(0, len(data), 45)]
+    return 'begin 644 data.bin\n' + ''.join(lines) + '`\nend\n'
+
+
+def format_date(timestamp):
+    return time.strftime('%a, %d %b %Y %H:%M:%S +0000',
+                         time.gmtime(timestamp))
+
+
+def message_text(rng, args, message, people):
+    headers = [
+        'From: %s' % address(rng, people),
+        'To: %s' % address(rng, people),
+        'Subject: %s%s' % ('Re: ' if message['parent'] else '',
+                           message['subject']),
+        'Date: %s' % format_date(message['date']),
+        'Message-ID: <%s>' % message['id'],
+    ]
+    if message['parent']:
+        headers.append('In-Reply-To: <%s>' % message['parent'])
+        headers.append('References: %s' %
+                       ' '.join('<%s>' % ref for ref in message['references']))
+
+    body = '\n'.join(sentence(rng, rng.randint(5, 15))
+                     for _ in range(rng.randint(1, 20))) + '\n'
+    body += uuencoded_file(rng, args)
+
+    size = attachment(rng, args)
+    if size:
+        headers.append('MIME-Version: 1.0')
+        headers.append('Content-Type: multipart/mixed; boundary="boundary"')
+        body = ('--boundary\nContent-Type: text/plain\n\n' + body +
+                attachment_part(rng, size) + '--boundary--\n')
+
+    return '\n'.join(headers) + '\n\n' + body
+
+
+def message_tags(rng, args):
+    count = min(args.tags, int(rng.expovariate(1.0 / args.tags_per_message)
+                               + 0.5)) if args.tags_per_message > 0 else 0
+    tags = set()
+    while len(tags) < count:
+        tags.add('tag%d' % zipf_choice(rng, args.tags, 1.0))
+    return sorted(tags)
+
+
+def main():
+    args = parse_args()
+    rng = random.Random(args.seed)
+    people = max(10, args.messages // 20)
+
+    tags_dir = os.path.join(args.output, 'tags')
+    mail_dir = os.path.join(args.output, 'mail')
+    os.makedirs(tags_dir)
+    os.makedirs(mail_dir)
+
+    dump = open(os.path.join(tags_dir, 'nmbug.sup-dump'), 'w')
+    serial = 0
+    files = 0
+
+    def file_name(nfiles):
+        # Spread the files over maildirs of a bounded size.
+        index = nfiles // args.messages_per_directory
+        folder = os.path.join(mail_dir, '%s.%04d' %
+                              (FOLDERS[index % len(FOLDERS)], index))
+        if nfiles % args.messages_per_directory == 0:
+            for sub in ('cur', 'new', 'tmp'):
+                os.makedirs(os.path.join(folder, sub))
+        return os.path.join(folder, 'cur', '%09d.synthetic:2,S' % nfiles)
+
+    for thread, size in enumerate(thread_sizes(rng, args)):
+        subject = sentence(rng, rng.randint(2, 8))
+        thread_messages = []
+        for i in range(size):
+            serial += 1
+            message = {
+                'id': '%d.%d@synthetic.notmuchmail.org' % (thread, serial),
+                'subject': subject,
+                'date': EPOCH + serial * MESSAGE_INTERVAL +
+                rng.randrange(MESSAGE_INTERVAL),
+                'parent': None,
+                'references': [],
+            }
+            if thread_messages:
+                if rng.random() < args.chain_rate:
+                    parent = thread_messages[-1]
+                else:
+                    parent = rng.choice(thread_messages)
+                message['parent'] = parent['id']
+                references = parent['references'] + [parent['id']]
+                if len(references) > args.max_references:
+                    references = (references[:1] +
+                                  references[1 - args.max_references:])
+                message['references'] = references
+            thread_messages.append(message)
+
+            text = message_text(rng, args, message, people)
+            copies = 2 if rng.random() < args.duplicate_rate else 1
+            for _ in range(copies):
+                with open(file_name(files), 'w') as f:
+                    f.write(text)
+                files += 1
+
+            print('%s (%s)' % (message['id'],
+                               ' '.join(message_tags(rng, args))),
+                  file=dump)
+
+    dump.close()
+
+
+if __name__ == '__main__':
+    main()
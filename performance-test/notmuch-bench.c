@@ -0,0 +1,647 @@
+/* notmuch-bench - Micro-benchmarks for libnotmuch
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+/* Index a fixed set of messages into a fresh database, then time the
+ * library operations that dominate the commands: counting, searching,
+ * decoding message metadata, building threads, tagging, and the
+ * reading and writing done by dump and restore.
+ *
+ * Every operation is timed on its own, and each benchmark reports the
+ * mean time per operation, its 50th, 90th and 99th percentiles, and
+ * (with glibc) the number of heap allocations per operation.  Running
+ * the same binary on the same messages gives comparable numbers, so
+ * a regression in one hot path shows up in one line of the output.
+ *
+ *	notmuch-bench [--rounds=N] [--only=NAME] <mail-directory>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <talloc.h>
+
+#include "notmuch.h"
+#include "command-line-arguments.h"
+
+/* Count heap allocations by wrapping the allocator.  This catches
+ * Xapian's and GMime's allocations as well as talloc's. */
+#ifdef __GLIBC__
+#define HAVE_ALLOCATION_COUNT 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *
+malloc (size_t size)
+{
+    allocations++;
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+    allocations++;
+    return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc (ptr, size);
+}
+#else
+#define HAVE_ALLOCATION_COUNT 0
+static unsigned long allocations;
+#endif
+
+typedef struct bench_state {
+    void *ctx;
+    char *db_path;
+    notmuch_database_t *notmuch;
+    /* The files to index, and the message IDs once indexed. */
+    char **files;
+    unsigned int num_files;
+    char **message_ids;
+    unsigned int num_messages;
+} bench_state_t;
+
+/* The samples of one benchmark: nanoseconds and allocations of each
+ * operation timed. */
+typedef struct bench_samples {
+    double *ns;
+    unsigned long *allocations;
+    unsigned int count;
+    unsigned int size;
+    struct timespec start;
+    unsigned long start_allocations;
+} bench_samples_t;
+
+static void
+op_start (bench_samples_t *samples)
+{
+    samples->start_allocations = allocations;
+    clock_gettime (CLOCK_MONOTONIC, &samples->start);
+}
+
+static void
+op_stop (bench_samples_t *samples)
+{
+    struct timespec stop;
+    unsigned long op_allocations;
+
+    clock_gettime (CLOCK_MONOTONIC, &stop);
+    op_allocations = allocations - samples->start_allocations;
+
+    if (samples->count == samples->size) {
+	samples->size = samples->size ? 2 * samples->size : 1024;
+	samples->ns = talloc_realloc (NULL, samples->ns, double, samples->size);
+	samples->allocations = talloc_realloc (NULL, samples->allocations,
+					       unsigned long, samples->size);
+	if (samples->ns == NULL || samples->allocations == NULL) {
+	    fprintf (stderr, "Out of memory\n");
+	    exit (1);
+	}
+    }
+
+    samples->ns[samples->count] = (stop.tv_sec - samples->start.tv_sec) * 1e9 +
+				  (stop.tv_nsec - samples->start.tv_nsec);
+    samples->allocations[samples->count] = op_allocations;
+    samples->count++;
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+percentile (const double *sorted, unsigned int count, unsigned int p)
+{
+    return sorted[(unsigned long) (count - 1) * p / 100];
+}
+
+static void
+report (const char *name, bench_samples_t *samples)
+{
+    double total = 0;
+    unsigned long total_allocations = 0;
+    unsigned int i;
+
+    if (samples->count == 0) {
+	printf ("%-16s %10s\n", name, "(no operations)");
+	return;
+    }
+
+    for (i = 0; i < samples->count; i++) {
+	total += samples->ns[i];
+	total_allocations += samples->allocations[i];
+    }
+    qsort (samples->ns, samples->count, sizeof (double), compare_doubles);
+
+    printf ("%-16s %8u %12.0f %12.0f %12.0f %12.0f",
+	    name, samples->count, total / samples->count,
+	    percentile (samples->ns, samples->count, 50),
+	    percentile (samples->ns, samples->count, 90),
+	    percentile (samples->ns, samples->count, 99));
+    if (HAVE_ALLOCATION_COUNT)
+	printf (" %10.1f\n", (double) total_allocations / samples->count);
+    else
+	printf (" %10s\n", "-");
+}
+
+static int
+bench_fail (const char *what, notmuch_status_t status)
+{
+    fprintf (stderr, "Error: %s: %s\n", what, notmuch_status_to_string (status));
+    return 1;
+}
+
+/* nftw has no closure argument. */
+static bench_state_t *walk_state;
+
+static int
+add_file (const char *path, const struct stat *st, int type,
+	  struct FTW *ftw)
+{
+    (void) st;
+
+    if (type == FTW_D && strcmp (path + ftw->base, ".notmuch") == 0)
+	return FTW_SKIP_SUBTREE;
+    if (type != FTW_F)
+	return FTW_CONTINUE;
+
+    walk_state->files = talloc_realloc (walk_state->ctx, walk_state->files,
+					char *, walk_state->num_files + 1);
+    walk_state->files[walk_state->num_files++] =
+	talloc_strdup (walk_state->ctx, path);
+
+    return FTW_CONTINUE;
+}
+
+static int
+compare_strings (const void *a, const void *b)
+{
+    return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+/* Index every file below 'mail_dir' into a fresh database, timing
+ * each notmuch_database_add_message.  The files are linked into the
+ * database directory in a fixed order, so every run indexes the same
+ * messages the same way. */
+static int
+bench_index (bench_state_t *state, const char *mail_dir,
+	     bench_samples_t *samples)
+{
+    char *real_dir;
+    notmuch_status_t status;
+    unsigned int i;
+
+    real_dir = realpath (mail_dir, NULL);
+    if (real_dir == NULL) {
+	fprintf (stderr, "Error: %s: %s\n", mail_dir, strerror (errno));
+	return 1;
+    }
+
+    walk_state = state;
+    if (nftw (real_dir, add_file, 16, FTW_PHYS | FTW_ACTIONRETVAL)) {
+	fprintf (stderr, "Error reading %s\n", real_dir);
+	free (real_dir);
+	return 1;
+    }
+    free (real_dir);
+    qsort (state->files, state->num_files, sizeof (char *), compare_strings);
+
+    status = notmuch_database_create (state->db_path, &state->notmuch);
+    if (status)
+	return bench_fail ("creating database", status);
+
+    for (i = 0; i < state->num_files; i++) {
+	char *link = talloc_asprintf (state->ctx, "%s/%06u", state->db_path, i);
+	notmuch_message_t *message;
+
+	if (symlink (state->files[i], link)) {
+	    fprintf (stderr, "Error: %s: %s\n", link, strerror (errno));
+	    return 1;
+	}
+
+	op_start (samples);
+	status = notmuch_database_add_message (state->notmuch, link, &message);
+	op_stop (samples);
+
+	if (status == NOTMUCH_STATUS_SUCCESS ||
+	    status == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID)
+	    notmuch_message_destroy (message);
+	else if (status != NOTMUCH_STATUS_FILE_NOT_EMAIL)
+	    return bench_fail ("adding message", status);
+	talloc_free (link);
+    }
+
+    return 0;
+}
+
+/* Remember the message IDs of the database, for the benchmarks that
+ * look messages up. */
+static int
+collect_message_ids (bench_state_t *state)
+{
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+    notmuch_status_t status;
+
+    query = notmuch_query_create (state->notmuch, "*");
+    notmuch_query_set_sort (query, NOTMUCH_SORT_MESSAGE_ID);
+    status = notmuch_query_search_messages_st (query, &messages);
+    if (status)
+	return bench_fail ("searching messages", status);
+
+    for (; notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages)) {
+	notmuch_message_t *message = notmuch_messages_get (messages);
+
+	state->message_ids = talloc_realloc (state->ctx, state->message_ids,
+					     char *, state->num_messages + 1);
+	state->message_ids[state->num_messages++] =
+	    talloc_strdup (state->ctx, notmuch_message_get_message_id (message));
+	notmuch_message_destroy (message);
+    }
+
+    notmuch_query_destroy (query);
+    return 0;
+}
+
+static const char *bench_queries[] = {
+    "*",
+    "tag:inbox",
+    "tag:unread and not tag:inbox",
+    "from:cworth",
+    "subject:notmuch",
+    "date:2009..2010",
+    "thread",
+    "to:notmuch@notmuchmail.org or from:keithp",
+};
+
+#define NUM_BENCH_QUERIES (sizeof (bench_queries) / sizeof (bench_queries[0]))
+
+/* One operation: an exact message count. */
+static int
+bench_count (bench_state_t *state, bench_samples_t *samples)
+{
+    unsigned int i, count;
+    notmuch_status_t status;
+
+    for (i = 0; i < NUM_BENCH_QUERIES; i++) {
+	notmuch_query_t *query = notmuch_query_create (state->notmuch,
+						       bench_queries[i]);
+
+	op_start (samples);
+	status = notmuch_query_count_messages_st (query, &count);
+	op_stop (samples);
+
+	notmuch_query_destroy (query);
+	if (status)
+	    return bench_fail ("counting messages", status);
+    }
+
+    return 0;
+}
+
+/* One operation: fetching one search result and its message ID. */
+static int
+bench_search (bench_state_t *state, bench_samples_t *samples)
+{
+    unsigned int i;
+    notmuch_status_t status;
+
+    for (i = 0; i < NUM_BENCH_QUERIES; i++) {
+	notmuch_query_t *query = notmuch_query_create (state->notmuch,
+						       bench_queries[i]);
+	notmuch_messages_t *messages;
+
+	notmuch_query_set_sort (query, NOTMUCH_SORT_NEWEST_FIRST);
+	status = notmuch_query_search_messages_st (query, &messages);
+	if (status)
+	    return bench_fail ("searching messages", status);
+
+	for (; notmuch_messages_valid (messages);
+	     notmuch_messages_move_to_next (messages)) {
+	    notmuch_message_t *message;
+
+	    op_start (samples);
+	    message = notmuch_messages_get (messages);
+	    notmuch_message_get_message_id (message);
+	    notmuch_message_destroy (message);
+	    op_stop (samples);
+	}
+
+	notmuch_query_destroy (query);
+    }
+
+    return 0;
+}
+
+/* One operation: looking up a message and decoding its metadata
+ * (thread ID, date, tags and file names). */
+static int
+bench_metadata (bench_state_t *state, bench_samples_t *samples)
+{
+    unsigned int i;
+    notmuch_status_t status;
+
+    for (i = 0; i < state->num_messages; i++) {
+	notmuch_message_t *message;
+	notmuch_tags_t *tags;
+	notmuch_filenames_t *filenames;
+
+	op_start (samples);
+	status = notmuch_database_find_message (state->notmuch,
+						state->message_ids[i],
+						&message);
+	if (status || message == NULL)
+	    return bench_fail ("finding message", status);
+	notmuch_message_get_thread_id (message);
+	notmuch_message_get_date (message);
+	for (tags = notmuch_message_get_tags (message);
+	     notmuch_tags_valid (tags);
+	     notmuch_tags_move_to_next (tags))
+	    notmuch_tags_get (tags);
+	for (filenames = notmuch_message_get_filenames (message);
+	     notmuch_filenames_valid (filenames);
+	     notmuch_filenames_move_to_next (filenames))
+	    notmuch_filenames_get (filenames);
+	notmuch_message_destroy (message);
+	op_stop (samples);
+    }
+
+    return 0;
+}
+
+/* One operation: building one thread of a thread search and reading
+ * its summary, as notmuch search does. */
+static int
+bench_threads (bench_state_t *state, bench_samples_t *samples)
+{
+    unsigned int i;
+    notmuch_status_t status;
+
+    for (i = 0; i < NUM_BENCH_QUERIES; i++) {
+	notmuch_query_t *query = notmuch_query_create (state->notmuch,
+						       bench_queries[i]);
+	notmuch_threads_t *threads;
+
+	status = notmuch_query_search_threads_st (query, &threads);
+	if (status)
+	    return bench_fail ("searching threads", status);
+
+	for (; notmuch_threads_valid (threads);
+	     notmuch_threads_move_to_next (threads)) {
+	    notmuch_thread_t *thread;
+	    notmuch_tags_t *tags;
+
+	    op_start (samples);
+	    thread = notmuch_threads_get (threads);
+	    notmuch_thread_get_authors (thread);
+	    notmuch_thread_get_subject (thread);
+	    notmuch_thread_get_newest_date (thread);
+	    for (tags = notmuch_thread_get_tags (thread);
+		 notmuch_tags_valid (tags);
+		 notmuch_tags_move_to_next (tags))
+		notmuch_tags_get (tags);
+	    notmuch_thread_destroy (thread);
+	    op_stop (samples);
+	}
+
+	notmuch_query_destroy (query);
+    }
+
+    return 0;
+}
+
+/* One operation: adding a tag to one message and removing it. */
+static int
+bench_tag (bench_state_t *state, bench_samples_t *samples)
+{
+    unsigned int i;
+    notmuch_status_t status;
+
+    for (i = 0; i < state->num_messages; i++) {
+	notmuch_message_t *message;
+
+	status = notmuch_database_find_message (state->notmuch,
+						state->message_ids[i],
+						&message);
+	if (status || message == NULL)
+	    return bench_fail ("finding message", status);
+
+	op_start (samples);
+	status = notmuch_message_add_tag (message, "bench");
+	if (! status)
+	    status = notmuch_message_remove_tag (message, "bench");
+	op_stop (samples);
+
+	notmuch_message_destroy (message);
+	if (status)
+	    return bench_fail ("tagging message", status);
+    }
+
+    return 0;
+}
+
+/* One operation: reading one message's ID and tags, as notmuch dump
+ * does. */
+static int
+bench_dump (bench_state_t *state, bench_samples_t *samples)
+{
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+    notmuch_status_t status;
+
+    query = notmuch_query_create (state->notmuch, "*");
+    notmuch_query_set_sort (query, NOTMUCH_SORT_MESSAGE_ID);
+    status = notmuch_query_search_messages_st (query, &messages);
+    if (status)
+	return bench_fail ("searching messages", status);
+
+    for (; notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages)) {
+	notmuch_message_t *message;
+	notmuch_tags_t *tags;
+
+	op_start (samples);
+	message = notmuch_messages_get (messages);
+	notmuch_message_get_message_id (message);
+	for (tags = notmuch_message_get_tags (message);
+	     notmuch_tags_valid (tags);
+	     notmuch_tags_move_to_next (tags))
+	    notmuch_tags_get (tags);
+	notmuch_message_destroy (message);
+	op_stop (samples);
+    }
+
+    notmuch_query_destroy (query);
+    return 0;
+}
+
+/* One operation: replacing the tags of one message, as notmuch
+ * restore does. */
+static int
+bench_restore (bench_state_t *state, bench_samples_t *samples)
+{
+    static const char *restore_tags[] = { "inbox", "unread", "restored" };
+    unsigned int i, j;
+    notmuch_status_t status;
+
+    for (i = 0; i < state->num_messages; i++) {
+	notmuch_message_t *message;
+
+	op_start (samples);
+	status = notmuch_database_find_message (state->notmuch,
+						state->message_ids[i],
+						&message);
+	if (! status && message) {
+	    status = notmuch_message_freeze (message);
+	    if (! status)
+		status = notmuch_message_remove_all_tags (message);
+	    for (j = 0; ! status && j < 3; j++)
+		status = notmuch_message_add_tag (message, restore_tags[j]);
+	    if (! status)
+		status = notmuch_message_thaw (message);
+	    notmuch_message_destroy (message);
+	}
+	op_stop (samples);
+
+	if (status)
+	    return bench_fail ("restoring tags", status);
+    }
+
+    return 0;
+}
+
+typedef struct bench {
+    const char *name;
+    int (*run) (bench_state_t *state, bench_samples_t *samples);
+} bench_t;
+
+static const bench_t benches[] = {
+    { "count", bench_count },
+    { "search", bench_search },
+    { "metadata", bench_metadata },
+    { "threads", bench_threads },
+    { "tag", bench_tag },
+    { "dump", bench_dump },
+    { "restore", bench_restore },
+};
+
+static int
+remove_file (const char *path, const struct stat *st, int type,
+	     struct FTW *ftw)
+{
+    (void) st;
+    (void) type;
+    (void) ftw;
+
+    return remove (path);
+}
+
+int
+main (int argc, char **argv)
+{
+    bench_state_t state;
+    bench_samples_t samples;
+    const char *tmp_dir;
+    char *only = NULL;
+    int rounds = 3;
+    int opt_index, ret = 0;
+    unsigned int i;
+    int round;
+
+    notmuch_opt_desc_t options[] = {
+	{ NOTMUCH_OPT_INT, &rounds, "rounds", 'r', 0 },
+	{ NOTMUCH_OPT_STRING, &only, "only", 'o', 0 },
+	{ 0, 0, 0, 0, 0 }
+    };
+
+    opt_index = parse_arguments (argc, argv, options, 1);
+    if (opt_index < 0)
+	return 1;
+
+    if (opt_index != argc - 1 || rounds < 1) {
+	fprintf (stderr, "Usage: %s [--rounds=N] [--only=NAME] <mail-directory>\n",
+		 argv[0]);
+	return 1;
+    }
+
+    memset (&state, 0, sizeof (state));
+    memset (&samples, 0, sizeof (samples));
+    state.ctx = talloc_new (NULL);
+
+    tmp_dir = getenv ("TMPDIR");
+    state.db_path = talloc_asprintf (state.ctx, "%s/notmuch-bench.XXXXXX",
+				     tmp_dir ? tmp_dir : "/tmp");
+    if (mkdtemp (state.db_path) == NULL) {
+	fprintf (stderr, "Error: %s: %s\n", state.db_path, strerror (errno));
+	return 1;
+    }
+
+    printf ("%-16s %8s %12s %12s %12s %12s %10s\n", "benchmark", "ops",
+	    "ns/op", "p50 ns", "p90 ns", "p99 ns", "allocs/op");
+
+    ret = bench_index (&state, argv[opt_index], &samples);
+    if (ret)
+	goto DONE;
+    if (only == NULL || strcmp (only, "index") == 0)
+	report ("index", &samples);
+
+    ret = collect_message_ids (&state);
+    if (ret)
+	goto DONE;
+
+    for (i = 0; i < sizeof (benches) / sizeof (benches[0]); i++) {
+	if (only && strcmp (only, benches[i].name) != 0)
+	    continue;
+
+	samples.count = 0;
+	for (round = 0; round < rounds && ! ret; round++)
+	    ret = benches[i].run (&state, &samples);
+	if (ret)
+	    goto DONE;
+	report (benches[i].name, &samples);
+    }
+
+  DONE:
+    if (state.notmuch)
+	notmuch_database_destroy (state.notmuch);
+    nftw (state.db_path, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+    talloc_free (samples.ns);
+    talloc_free (samples.allocations);
+    talloc_free (state.ctx);
+
+    return ret;
+}
@@ -0,0 +1,106 @@
+#!/usr/bin/env python
+"""Compare two sets of performance test results.
+
+The results are files written by the performance tests with
+--results=<file> (or PERF_RESULTS), one measurement per line: test
+script, corpus, test, measurement and value, separated by tabs.  A
+file may hold several runs of the same tests, whose measurements are
+averaged.
+
+Every measurement is one where less is better, so a measurement is
+flagged as a regression when the new value exceeds the old one by
+more than --threshold percent, and by more than the resolution of the
+measurement (--min-seconds for times).  The exit status is 1 if there
+is any regression, so the comparison can gate a build.
+
+Usage: perf-compare.py [options] <old-results> <new-results>
+"""
+
+from __future__ import print_function
+
+import argparse
+import sys
+
+TIME_MEASUREMENTS = ('wall', 'user', 'sys', 'p50', 'p95', 'p99')
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description='Compare two sets of performance test results.')
+    parser.add_argument('old', help='results to compare against')
+    parser.add_argument('new', help='results to compare')
+    parser.add_argument('--threshold', type=float, default=10.0,
+                        help='largest increase, in percent, that is not '
+                        'a regression (default: 10)')
+    parser.add_argument('--min-seconds', type=float, default=0.05,
+                        help='largest increase in a time, in seconds, '
+                        'that is not a regression (default: 0.05)')
+    parser.add_argument('--all', action='store_true',
+                        help='show every measurement, not just those '
+                        'that changed by more than the threshold')
+    return parser.parse_args()
+
+
+def read_results(path):
+    """Return a dictionary from (script, corpus, test, measurement) to the
+    mean of the values recorded for it in 'path'."""
+    sums = {}
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.rstrip('\n')
+            if not line or line.startswith('#'):
+                continue
+            fields = line.split('\t')
+            try:
+                value = float(fields[4])
+            except (IndexError, ValueError):
+                print('%s:%d: malformed result line' % (path, number),
+                      file=sys.stderr)
+                continue
+            total, count = sums.get(tuple(fields[:4]), (0.0, 0))
+            sums[tuple(fields[:4])] = (total + value, count + 1)
+    return dict((key, total / count) for key, (total, count) in sums.items())
+
+
+def main():
+    args = parse_args()
+    old = read_results(args.old)
+    new = read_results(args.new)
+
+    common = sorted(set(old) & set(new))
+    if not common:
+        print('No measurements in common.', file=sys.stderr)
+        return 2
+
+    regressions = 0
+    for key in common:
+        before, after = old[key], new[key]
+        if before:
+            change = 100.0 * (after - before) / before
+        else:
+            change = 0.0 if after == before else float('inf')
+
+        slack = args.min_seconds if key[3] in TIME_MEASUREMENTS else 0
+        regressed = change > args.threshold and after - before > slack
+        improved = change < -args.threshold and before - after > slack
+        if regressed:
+            regressions += 1
+        if not (regressed or improved or args.all):
+            continue
+
+        print('%-10s %-14s %-30s %-12s %12g %12g %+8.1f%%%s' %
+              (key + (before, after, change,
+                      '  REGRESSION' if regressed else '')))
+
+    for key in sorted(set(old) - set(new)):
+        print('%-10s %-14s %-30s %-12s only in %s' % (key + (args.old,)))
+    for key in sorted(set(new) - set(old)):
+        print('%-10s %-14s %-30s %-12s only in %s' % (key + (args.new,)))
+
+    print('%d measurements compared, %d regressions.' %
+          (len(common), regressions))
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
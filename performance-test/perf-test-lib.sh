@@ -21,6 +21,14 @@ do
 		corpus_size=large;
 		shift
 		;;
+	--synthetic)
+		corpus_size=synthetic;
+		shift
+		;;
+	--results=*)
+		PERF_RESULTS="${1#--results=}";
+		shift
+		;;
 	*)
 		echo "error: unknown performance test option '$1'" >&2; exit 1 ;;
 	esac
@@ -35,8 +43,39 @@ then
 	exit 1
 fi
 
+# A synthetic corpus is named after the options it is generated
+# with, so that each set of options gets its own corpus and cached
+# database.
+if [[ "$corpus_size" = synthetic ]]; then
+    corpus_size=synthetic.$(printf '%s' "${PERF_SYNTHETIC_OPTIONS}" | cksum | cut -d' ' -f1)
+fi
+
 DB_CACHE_DIR=${TEST_DIRECTORY}/notmuch.cache.$corpus_size
 
+# The results file is written after the cd into the temporary
+# directory, so needs an absolute name.
+if [ -n "$PERF_RESULTS" ]; then
+    case "$PERF_RESULTS" in
+	/*) ;;
+	*) PERF_RESULTS="$(pwd)/$PERF_RESULTS" ;;
+    esac
+fi
+
+add_synthetic_corpus ()
+{
+    SYNTHETIC_DIR="${CORPUS_DIR}/${corpus_size}"
+
+    if [ ! -d "${SYNTHETIC_DIR}" ]; then
+	printf "Generating synthetic corpus\n"
+	python ${TEST_DIRECTORY}/gen-corpus.py ${PERF_SYNTHETIC_OPTIONS} \
+	       "${SYNTHETIC_DIR}.tmp"
+	mv "${SYNTHETIC_DIR}.tmp" "${SYNTHETIC_DIR}"
+    fi
+
+    cp -lr ${SYNTHETIC_DIR}/tags $TMP_DIRECTORY/corpus.tags
+    cp -lr ${SYNTHETIC_DIR}/mail $MAIL_DIR
+}
+
 add_email_corpus ()
 {
     rm -rf ${MAIL_DIR}
@@ -44,6 +83,11 @@ add_email_corpus ()
     CORPUS_DIR=${TEST_DIRECTORY}/corpus
     mkdir -p "${CORPUS_DIR}"
 
+    if [[ "$corpus_size" = synthetic.* ]]; then
+	add_synthetic_corpus
+	return
+    fi
+
     MAIL_CORPUS="${CORPUS_DIR}/mail.${corpus_size}"
     TAG_CORPUS="${CORPUS_DIR}/tags"
 
@@ -146,6 +190,7 @@ memory_run ()
 
     log_file=$log_dir/$test_count.log
     talloc_log=$log_dir/$test_count.talloc
+    massif_file=$log_dir/$test_count.massif
 
     printf "[ %d ]\t%s\n" $test_count "$1"
 
@@ -155,6 +200,27 @@ memory_run ()
     echo
     sed -n -e 's/.*[(]total *\([^)]*\)[)]/talloced at exit: \1/p' $talloc_log
     echo
+
+    if [ -n "$PERF_RESULTS" ]; then
+	record_result "$1" heap_allocs \
+	    "$(sed -n -e 's/,//g' -e 's/.*total heap usage: \([0-9]*\) allocs.*/\1/p' "$log_file")"
+	record_result "$1" heap_bytes \
+	    "$(sed -n -e 's/,//g' -e 's/.*frees, \([0-9]*\) bytes allocated.*/\1/p' "$log_file")"
+	record_result "$1" leaked_bytes \
+	    "$(sed -n -e 's/,//g' -e 's/.*definitely lost: \([0-9]*\) bytes.*/\1/p' "$log_file")"
+	record_result "$1" talloc_bytes \
+	    "$(sed -n -e 's/.*[(]total *\([0-9]*\) bytes.*/\1/p' $talloc_log)"
+
+	# memcheck only gives totals, so run the command again under
+	# massif for the peak size of the heap.
+	valgrind --tool=massif --massif-out-file="$massif_file" \
+		 --log-file="$log_dir/$test_count.massif.log" $2
+	peak=$(awk -F= '/^mem_heap_B=/ { heap = $2 }
+			/^mem_heap_extra_B=/ { if (heap + $2 > peak) peak = heap + $2 }
+			END { print peak + 0 }' "$massif_file")
+	printf "heap peak: %d bytes\n\n" "$peak"
+	record_result "$1" heap_peak "$peak"
+    fi
 }
 
 memory_done ()
@@ -181,16 +247,58 @@ print_header ()
     printf "\t\t\tWall(s)\tUsr(s)\tSys(s)\tRes(K)\tIn/Out(512B)\n"
 }
 
+# Append the measurement "$2" = "$3" of the test "$1" to the results
+# file named by --results or PERF_RESULTS, if any, as a line of tab
+# separated fields: script, corpus, test, measurement and value.  See
+# perf-compare.py.
+record_result ()
+{
+    if [ -n "$PERF_RESULTS" ] && [ -n "$3" ]; then
+	printf "%s\t%s\t%s\t%s\t%s\n" "$(basename "$0" .sh)" \
+	       "$corpus_size" "$1" "$2" "$3" >> "$PERF_RESULTS"
+    fi
+}
+
 time_run ()
 {
+    local time_file="$TMP_DIRECTORY/time.$test_count" status=0
     printf "  %-22s" "$1"
     test_count=$(($test_count+1))
     if test "$verbose" != "t"; then exec 4>test.output 3>&4; fi
-    if ! eval >&3 "/usr/bin/time -f '%e\t%U\t%S\t%M\t%I/%O' $2" ; then
+    if ! eval >&3 "/usr/bin/time -o '$time_file' -f '%e\t%U\t%S\t%M\t%I/%O' $2" ; then
+	test_failure=$(($test_failure + 1))
+	status=1
+    fi
+    cat "$time_file" >&2
+
+    if [ $status = 0 ]; then
+	local wall user sys rss io
+	IFS=$'\t' read -r wall user sys rss io < <(tail -n 1 "$time_file")
+	record_result "$1" wall "$wall"
+	record_result "$1" user "$user"
+	record_result "$1" sys "$sys"
+	record_result "$1" max_rss "$rss"
+    fi
+    rm -f "$time_file"
+    return $status
+}
+
+# Replay the trace "$2" of interactive commands with replay-trace.py,
+# reporting the latency percentiles of each type of command, and
+# recording them as the test "$1".  PERF_REPLAY_OPTIONS holds more
+# options of replay-trace.py, such as --rounds.
+latency_run ()
+{
+    test_count=$(($test_count+1))
+    printf "  %s\n" "$1"
+    if ! python ${TEST_DIRECTORY}/replay-trace.py \
+	   --script="$(basename "$0" .sh)" --corpus="$corpus_size" \
+	   --test="$1" --mail-dir="$MAIL_DIR" \
+	   ${PERF_RESULTS:+--results="$PERF_RESULTS"} ${PERF_REPLAY_OPTIONS} \
+	   "${TEST_DIRECTORY}/$2"; then
 	test_failure=$(($test_failure + 1))
 	return 1
     fi
-    return 0
 }
 
 time_done ()
@@ -0,0 +1,286 @@
+#!/usr/bin/env python
+"""Replay a trace of notmuch commands and report their latencies.
+
+A trace is what an interactive frontend asks of the command line
+while someone reads mail, one invocation per line as a JSON object:
+"argv", the arguments following "notmuch", and for commands reading
+their standard input, such as "count --batch" and "tag --batch",
+"stdin", what they read.  Blank lines and lines starting with '#' are
+ignored.  Since the thread and message IDs of a recorded trace only
+mean something on the corpus it was recorded on, the arguments may
+use these placeholders instead, which are replaced by search terms
+("thread:..." or "id:...") looked up before replaying:
+
+  @NEWEST_THREAD@   the newest thread     @NEWEST_MESSAGE@  its newest message
+  @LARGEST_THREAD@  the thread of the most messages ("notmuch stats")
+
+The commands are grouped by type, the subcommand followed by its
+--batch, --format and --output options, so that "search --format=sexp"
+and "search --output=tags" are told apart, and for each type the
+50th, 95th and 99th percentile wall time is reported, both with warm
+caches, replaying the trace --rounds times after an untimed pass, and
+with cold caches, where the database and the mail are evicted from
+the page cache (with posix_fadvise, or as root by dropping all caches)
+before each command.  With --results, the percentiles are appended to
+a results file for perf-compare.py.
+
+With --record, replay-trace.py instead runs notmuch with the arguments
+following "--" and appends the invocation to the trace, so that
+pointing a frontend at a two line wrapper records a session:
+
+  #!/bin/sh
+  exec .../replay-trace.py --record=$HOME/session.trace -- "$@"
+
+Usage: replay-trace.py [options] <trace>
+       replay-trace.py --record=<trace> -- <notmuch arguments>
+"""
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+PLACEHOLDERS = ('@NEWEST_THREAD@', '@NEWEST_MESSAGE@', '@LARGEST_THREAD@')
+
+TYPE_OPTIONS = ('--batch', '--format=', '--output=')
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description='Replay a trace of notmuch commands, or record one.')
+    parser.add_argument('trace', nargs='?', help='trace to replay')
+    parser.add_argument('arguments', nargs='*', help=argparse.SUPPRESS)
+    parser.add_argument('--notmuch', default='notmuch',
+                        help='notmuch command to run (default: notmuch)')
+    parser.add_argument('--rounds', type=int, default=5,
+                        help='times to replay the trace with warm caches '
+                        '(default: 5)')
+    parser.add_argument('--cold-rounds', type=int, default=1,
+                        help='times to replay the trace with cold caches '
+                        '(default: 1, 0 to skip)')
+    parser.add_argument('--mail-dir',
+                        help='mail and database to evict for the cold runs '
+                        '(default: database.path of the configuration)')
+    parser.add_argument('--results',
+                        help='append the percentiles to this results file')
+    parser.add_argument('--script', default='replay-trace',
+                        help='test script named in the results')
+    parser.add_argument('--corpus', default='unknown',
+                        help='corpus named in the results')
+    parser.add_argument('--test', help='test named in the results '
+                        '(default: the name of the trace)')
+    parser.add_argument('--record', metavar='TRACE',
+                        help='run notmuch and append its invocation to TRACE')
+    return parser.parse_args()
+
+
+def record(trace, notmuch, arguments):
+    """Run notmuch with 'arguments', recording them and the standard
+    input of batch commands in 'trace'.  Other commands keep the
+    standard input they were given, since a frontend may leave it open
+    without ever writing to it."""
+    entry = {'argv': arguments}
+    stdin = None
+    if '--batch' in arguments:
+        stdin = sys.stdin.read()
+        entry['stdin'] = stdin
+    with open(trace, 'a') as f:
+        f.write(json.dumps(entry) + '\n')
+    if stdin is None:
+        return subprocess.call([notmuch] + arguments)
+    process = subprocess.Popen([notmuch] + arguments, stdin=subprocess.PIPE)
+    process.communicate(stdin.encode('utf-8'))
+    return process.returncode
+
+
+def read_trace(path):
+    entries = []
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.strip()
+            if not line or line.startswith('#'):
+                continue
+            try:
+                entry = json.loads(line)
+                if not isinstance(entry.get('argv'), list):
+                    raise ValueError('no argv')
+            except ValueError:
+                sys.exit('%s:%d: malformed trace line' % (path, number))
+            entries.append(entry)
+    return entries
+
+
+def notmuch_output(notmuch, *arguments):
+    output = subprocess.check_output((notmuch,) + arguments)
+    return output.decode('utf-8').splitlines()
+
+
+def placeholder_values(notmuch, entries):
+    """The values of the placeholders 'entries' use."""
+    text = json.dumps(entries)
+    values = {}
+    if '@NEWEST_THREAD@' in text:
+        values['@NEWEST_THREAD@'] = notmuch_output(
+            notmuch, 'search', '--output=threads', '--sort=newest-first',
+            '--limit=1', '*')[0]
+    if '@NEWEST_MESSAGE@' in text:
+        values['@NEWEST_MESSAGE@'] = notmuch_output(
+            notmuch, 'search', '--output=messages', '--sort=newest-first',
+            '--limit=1', '*')[0]
+    if '@LARGEST_THREAD@' in text:
+        for line in notmuch_output(notmuch, 'stats', '--top=1'):
+            if line.startswith('thread:'):
+                values['@LARGEST_THREAD@'] = line.split('\t')[0]
+    missing = [p for p in PLACEHOLDERS if p in text and p not in values]
+    if missing:
+        sys.exit('No value for %s in this database' % ', '.join(missing))
+    return values
+
+
+def substitute(entries, values):
+    def expand(text):
+        for placeholder, value in values.items():
+            text = text.replace(placeholder, value)
+        return text
+    expanded = []
+    for entry in entries:
+        stdin = entry.get('stdin')
+        expanded.append({'argv': [expand(a) for a in entry['argv']],
+                         'stdin': expand(stdin) if stdin is not None else None})
+    return expanded
+
+
+def command_type(argv):
+    """The subcommand of 'argv' with the options telling what is asked
+    of it, skipping the options coming before the subcommand."""
+    words = []
+    for argument in argv:
+        if not words:
+            if not argument.startswith('-'):
+                words.append(argument)
+        elif argument == '--':
+            break
+        elif argument.startswith(TYPE_OPTIONS):
+            words.append(argument)
+    return ' '.join(words) or 'notmuch'
+
+
+def database_path(notmuch):
+    return notmuch_output(notmuch, 'config', 'get', 'database.path')[0]
+
+
+def evict(directory):
+    """Drop 'directory' and everything below it from the page cache.
+    Only clean pages can be dropped, which all are once the previous
+    command has exited and its writes were synced."""
+    if hasattr(os, 'posix_fadvise'):
+        for root, dirs, files in os.walk(directory):
+            for name in files:
+                try:
+                    fd = os.open(os.path.join(root, name), os.O_RDONLY)
+                except OSError:
+                    continue
+                try:
+                    os.fdatasync(fd)
+                    os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+                except OSError:
+                    pass
+                finally:
+                    os.close(fd)
+        return True
+    try:
+        subprocess.check_call(['sync'])
+        with open('/proc/sys/vm/drop_caches', 'w') as f:
+            f.write('3\n')
+        return True
+    except (IOError, OSError, subprocess.CalledProcessError):
+        return False
+
+
+def run(notmuch, entry):
+    """Run one command of the trace, reading its output as a frontend
+    would, and return its wall time in seconds."""
+    stdin = entry['stdin']
+    with open(os.devnull) as devnull:
+        start = time.time()
+        process = subprocess.Popen(
+            [notmuch] + entry['argv'],
+            stdin=subprocess.PIPE if stdin is not None else devnull,
+            stdout=subprocess.PIPE)
+        process.communicate(stdin.encode('utf-8')
+                            if stdin is not None else None)
+        elapsed = time.time() - start
+    if process.returncode:
+        sys.exit('notmuch %s failed with status %d' %
+                 (' '.join(entry['argv']), process.returncode))
+    return elapsed
+
+
+def percentile(values, p):
+    """The nearest rank 'p'th percentile of the sorted 'values'."""
+    rank = int(len(values) * p / 100.0 + 0.999999)
+    return values[max(rank, 1) - 1]
+
+
+def replay(args):
+    entries = read_trace(args.trace)
+    if not entries:
+        sys.exit('%s: empty trace' % args.trace)
+    entries = substitute(entries, placeholder_values(args.notmuch, entries))
+
+    times = {}
+    for entry in entries:
+        run(args.notmuch, entry)
+    for _ in range(args.rounds):
+        for entry in entries:
+            times.setdefault(('warm', command_type(entry['argv'])), []).append(
+                run(args.notmuch, entry))
+
+    mail_dir = None
+    if args.cold_rounds > 0:
+        mail_dir = args.mail_dir or database_path(args.notmuch)
+    if mail_dir and not evict(mail_dir):
+        print('Cannot evict %s from the page cache, skipping the cold runs'
+              % mail_dir, file=sys.stderr)
+        args.cold_rounds = 0
+    for _ in range(args.cold_rounds):
+        for entry in entries:
+            evict(mail_dir)
+            times.setdefault(('cold', command_type(entry['argv'])),
+                             []).append(run(args.notmuch, entry))
+
+    test = args.test or os.path.basename(args.trace)
+    results = open(args.results, 'a') if args.results else None
+    print('  %-34s %5s %9s %9s %9s' % ('command', 'runs', 'p50(ms)',
+                                       'p95(ms)', 'p99(ms)'))
+    for key in sorted(times, key=lambda k: (k[0] != 'warm', k[1])):
+        values = sorted(times[key])
+        ps = [percentile(values, p) for p in (50, 95, 99)]
+        print('  %-34s %5d %9.1f %9.1f %9.1f' %
+              (('%s %s' % key, len(values)) + tuple(1000 * v for v in ps)))
+        if results:
+            for name, value in zip(('p50', 'p95', 'p99'), ps):
+                results.write('%s\t%s\t%s\t%s\t%.6f\n' %
+                              (args.script, args.corpus,
+                               '%s: %s %s' % ((test,) + key), name, value))
+    if results:
+        results.close()
+    return 0
+
+
+def main():
+    args = parse_args()
+    if args.record:
+        arguments = ([args.trace] if args.trace else []) + args.arguments
+        return record(args.record, args.notmuch, arguments)
+    if not args.trace:
+        sys.exit('Usage: replay-trace.py [options] <trace>')
+    return replay(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
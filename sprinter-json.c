@@ -103,12 +103,25 @@ json_string_len (struct sprinter *sp, const char *val, size_t len)
     struct sprinter_json *spj = json_begin_value (sp);
 
     fputc ('"', spj->stream);
-    for (; len; ++val, --len) {
-	unsigned char ch = *val;
+    while (len) {
+	const char *run = val;
+	unsigned char ch;
+
+	/* Write runs of characters that need no escaping at once. */
+	while (len && (unsigned char) *val >= 32 &&
+	       *val != '"' && *val != '\\') {
+	    val++;
+	    len--;
+	}
+	if (val > run)
+	    fwrite (run, 1, val - run, spj->stream);
+	if (! len)
+	    break;
+
+	ch = *val++;
+	len--;
 	if (ch < ARRAY_SIZE (escapes) && escapes[ch])
 	    fputs (escapes[ch], spj->stream);
-	else if (ch >= 32)
-	    fputc (ch, spj->stream);
 	else
 	    fprintf (spj->stream, "\\u%04x", ch);
     }
@@ -118,12 +118,25 @@ sexp_string_len (struct sprinter *sp, const char *val, size_t len)
     struct sprinter_sexp *sps = sexp_begin_value (sp);
 
     fputc ('"', sps->stream);
-    for (; len; ++val, --len) {
-	unsigned char ch = *val;
+    while (len) {
+	const char *run = val;
+	unsigned char ch;
+
+	/* Write runs of characters that need no escaping at once. */
+	while (len && (unsigned char) *val >= 32 &&
+	       *val != '"' && *val != '\\') {
+	    val++;
+	    len--;
+	}
+	if (val > run)
+	    fwrite (run, 1, val - run, sps->stream);
+	if (! len)
+	    break;
+
+	ch = *val++;
+	len--;
 	if (ch < ARRAY_SIZE (escapes) && escapes[ch])
 	    fputs (escapes[ch], sps->stream);
-	else if (ch >= 32)
-	    fputc (ch, sps->stream);
 	else
 	    fprintf (sps->stream, "\\%03o", ch);
     }
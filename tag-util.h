@@ -26,7 +26,12 @@ typedef enum {
     /* Accept strange tags that might be user error;
      * intended for use by notmuch-restore.
      */
-    TAG_FLAG_BE_GENEROUS = (1 << 3)
+    TAG_FLAG_BE_GENEROUS = (1 << 3),
+
+    /* Journal the operations through a read-only database, with
+     * notmuch_message_journal_tag.
+     */
+    TAG_FLAG_JOURNAL = (1 << 4)
 
 } tag_op_flag_t;
 
@@ -41,4 +41,59 @@ thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; One (inbox tag1 unread)
 thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Two (inbox tag1 tag2 unread)
 thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Three (inbox tag3 unread)"
 
+test_expect_success "Running online compact" "notmuch compact --quiet --online"
+
+test_begin_subtest "Online compact preserves database"
+output=$(notmuch search \* | notmuch_search_sanitize)
+test_expect_equal "$output" "\
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; One (inbox tag1 unread)
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Two (inbox tag1 tag2 unread)
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Three (inbox tag3 unread)"
+
+test_begin_subtest "Online compact reports the changes copied"
+notmuch compact --online > OUTPUT
+sed -n -e 's/^copied [0-9]* changes with the database locked$/copied N changes with the database locked/p' \
+    < OUTPUT > OUTPUT.locked
+echo "copied N changes with the database locked" > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT.locked
+
+test_begin_subtest "Renumbering compact preserves the database"
+notmuch dump > BEFORE.dump
+notmuch search --output=files \* | sort > BEFORE.files
+notmuch compact --quiet --renumber=thread
+notmuch dump > AFTER.dump
+notmuch search --output=files \* | sort > AFTER.files
+output=$(notmuch search \* | notmuch_search_sanitize)
+test_expect_equal "$output
+$(cat AFTER.dump AFTER.files)" "\
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; One (inbox tag1 unread)
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Two (inbox tag1 tag2 unread)
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Three (inbox tag3 unread)
+$(cat BEFORE.dump BEFORE.files)"
+
+test_begin_subtest "Renumbering compact keeps directories"
+notmuch new > OUTPUT
+echo "No new mail." > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+test_expect_code 1 "Renumbering compact refuses --online" \
+    "notmuch compact --quiet --online --renumber=thread"
+
+test_begin_subtest "Online compact refuses to run alongside another compaction"
+test_python <<EOF
+import fcntl, subprocess
+lock = open("${MAIL_DIR}/.notmuch/xapian.compact.lock", "w")
+fcntl.lockf(lock, fcntl.LOCK_EX)
+compact = subprocess.Popen(["notmuch", "compact", "--quiet", "--online"],
+                           stderr=subprocess.PIPE, universal_newlines=True)
+print(compact.communicate()[1].rstrip())
+print("exit status %d" % compact.returncode)
+EOF
+cat <<EOF > EXPECTED
+Another compaction of ${MAIL_DIR} is in progress.
+Compaction failed: Something went wrong trying to read or write a file
+exit status 1
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
 test_done
@@ -291,6 +291,246 @@ test_expect_code 1 "Invalid tags set exit code" \
 
 notmuch config set new.tags $OLDCONFIG
 
+test_begin_subtest "Indexing with --jobs gives the same database"
+rm -rf "${MAIL_DIR}"/.notmuch
+NOTMUCH_NEW > /dev/null
+notmuch search --sort=oldest-first '*' > EXPECTED
+notmuch search --output=files --sort=oldest-first 'test message' >> EXPECTED
+notmuch dump >> EXPECTED
+rm -rf "${MAIL_DIR}"/.notmuch
+NOTMUCH_NEW --jobs=4 > /dev/null
+notmuch search --sort=oldest-first '*' > OUTPUT
+notmuch search --output=files --sort=oldest-first 'test message' >> OUTPUT
+notmuch dump >> OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Committing in batches gives the same database"
+notmuch config set new.batch_size 3
+rm -rf "${MAIL_DIR}"/.notmuch
+NOTMUCH_NEW > /dev/null
+notmuch search --sort=oldest-first '*' > OUTPUT
+notmuch search --output=files --sort=oldest-first 'test message' >> OUTPUT
+notmuch dump >> OUTPUT
+notmuch config set new.batch_size
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Deferred bodies are not searched"
+generate_message '[subject]="Deferred body"' '[body]="wombat frobnication"'
+NOTMUCH_NEW --defer-body > /dev/null
+output="$(notmuch count subject:deferred) $(notmuch count wombat)"
+test_expect_equal "$output" "1 0"
+
+test_begin_subtest "index-pending indexes deferred bodies"
+output=$(notmuch index-pending)
+output="$output $(notmuch count '"wombat frobnication"')"
+test_expect_equal "$output" "Indexed the bodies of 1 message. 1"
+
+test_begin_subtest "index-pending with nothing pending"
+output=$(notmuch index-pending)
+test_expect_equal "$output" "Indexed the bodies of 0 messages."
+
+test_begin_subtest "Moving a maildir file to cur is a rename"
+generate_message [dir]=moved/new [filename]=moved-msg
+mkdir -p "${MAIL_DIR}"/moved/cur "${MAIL_DIR}"/moved/tmp
+notmuch new > /dev/null
+mv "${MAIL_DIR}"/moved/new/moved-msg "${MAIL_DIR}"/moved/cur/moved-msg:2,S
+output=$(NOTMUCH_NEW)
+output="$output
+$(notmuch search --output=files id:${gen_msg_id})
+$(notmuch count id:${gen_msg_id} and tag:unread)"
+test_expect_equal "$output" "No new mail. Detected 1 file rename.
+${MAIL_DIR}/moved/cur/moved-msg:2,S
+0"
+
+test_begin_subtest "A reply to two threads joins them"
+generate_message '[subject]="first thread"'
+first_id=$gen_msg_id
+generate_message '[subject]="second thread"'
+second_id=$gen_msg_id
+notmuch new > /dev/null
+generate_message '[subject]="joining reply"' \
+		 "[in-reply-to]=\<$first_id\>" \
+		 "[references]=\"<$first_id> <$second_id>\""
+notmuch new > /dev/null
+thread=$(notmuch search --output=threads id:$second_id)
+output="$(notmuch search --output=threads id:$first_id OR id:$second_id OR subject:joining | sort -u)
+$(notmuch count --output=messages $thread)"
+test_expect_equal "$output" "$thread
+3"
+
+test_begin_subtest "index-pending finishes merging threads"
+output=$(notmuch index-pending)
+output="$output
+$(notmuch search --output=threads id:$first_id OR id:$second_id OR subject:joining | sort -u)
+$(notmuch count --output=messages $thread)"
+test_expect_equal "$output" "Indexed the bodies of 0 messages.
+Finished merging 1 thread.
+$thread
+3"
+
+test_begin_subtest "A stale message ID filter is not trusted"
+cp "${MAIL_DIR}"/.notmuch/message-id-filter "${TMP_DIRECTORY}"/stale-filter
+generate_message
+notmuch new > /dev/null
+cp "${TMP_DIRECTORY}"/stale-filter "${MAIL_DIR}"/.notmuch/message-id-filter
+cp "$gen_msg_filename" "${gen_msg_filename}"-copy
+output=$(NOTMUCH_NEW)
+output="$output $(notmuch count id:$gen_msg_id)"
+test_expect_equal "$output" "No new mail. 1"
+
+test_begin_subtest "--stats=json reports the run as JSON"
+generate_message
+notmuch new --stats=json > STATS
+test_python <<EOF
+import json
+stats = json.load(open("STATS"))
+print("%d %d" % (stats["added"], stats["files_opened"]))
+print(stats["skipped_directories"] > 0)
+print(" ".join(sorted(stats["phases"])))
+EOF
+cat <<EOF > EXPECTED
+1 1
+True
+add commit index_terms link_threads read_headers remove scan stat total write_documents
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "new.flush_budget flushes large messages"
+notmuch config set new.flush_budget 1
+generate_message '[subject]="Large body"' "[body]=\"$(seq 1 60000)\""
+generate_message '[subject]="Small body"'
+notmuch new --stats=json > STATS
+notmuch config set new.flush_budget
+test_python <<EOF
+import json
+stats = json.load(open("STATS"))
+print("%d %d" % (stats["added"], stats["flushes"]))
+EOF
+cat <<EOF > EXPECTED
+2 1
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Bodies indexed without positions match phrases as words"
+notmuch config set index.body_positions false
+generate_message '[subject]="Positionless body"' '[body]="quokka marsupial"'
+NOTMUCH_NEW > /dev/null
+output="$(notmuch count quokka) $(notmuch count '"marsupial quokka"')"
+output="$output $(notmuch count 'subject:"body positionless"')"
+test_expect_equal "$output" "1 1 1"
+
+test_begin_subtest "Body positions can be turned back on"
+notmuch config set index.body_positions
+generate_message '[subject]="Positional body"' '[body]="wallaby marsupial"'
+NOTMUCH_NEW > /dev/null
+output="$(notmuch count '"wallaby marsupial"') $(notmuch count '"marsupial wallaby"')"
+test_expect_equal "$output" "1 0"
+
+test_begin_subtest "new.manifests skips a directory whose entries are unchanged"
+notmuch config set new.manifests true
+generate_message [dir]=manifest
+notmuch new > /dev/null
+touch "${MAIL_DIR}"/manifest/transient
+rm "${MAIL_DIR}"/manifest/transient
+output=$(NOTMUCH_NEW --debug | grep "manifest of ${MAIL_DIR}/manifest ")
+test_expect_equal "$output" "(D) add_files, pass 2: manifest of ${MAIL_DIR}/manifest unchanged"
+
+test_begin_subtest "new.manifests still finds new files"
+generate_message [dir]=manifest
+output=$(NOTMUCH_NEW)
+notmuch config set new.manifests
+test_expect_equal "$output" "Added 1 new message to the database."
+
+test_begin_subtest "new.rules tags messages as they are added"
+cat <<EOF > "${TMP_DIRECTORY}/rules"
+# Lists stay out of the inbox.
++list -inbox -- subject:"rule list"
++urgent -- subject:urgent and not tag:list
+EOF
+notmuch config set new.rules "${TMP_DIRECTORY}/rules"
+generate_message '[subject]="Urgent: on the rule list"'
+listed=$gen_msg_id
+generate_message '[subject]="Urgent question"'
+urgent=$gen_msg_id
+NOTMUCH_NEW > /dev/null
+output="$(notmuch search --output=tags id:$listed | tr '\n' ' ')/$(notmuch search --output=tags id:$urgent | tr '\n' ' ')"
+test_expect_equal "$output" "list unread /inbox unread urgent "
+
+test_begin_subtest "new.rules that do not parse are reported"
+echo '+broken -- subject:"unterminated' >> "${TMP_DIRECTORY}/rules"
+generate_message
+NOTMUCH_NEW > OUTPUT 2>&1
+notmuch config set new.rules
+cat <<EOF > EXPECTED
+notmuch new: Illegal argument for function
+Error in tag rule 4: unterminated quoted value
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+mbox_message () {
+    cat <<EOF
+From: Archive Sender <archive@example.com>
+To: Notmuch Test Suite <test_suite@notmuchmail.org>
+Message-Id: <mbox-$1@example.com>
+Subject: Archived message $1
+Date: Fri, 05 Jan 2001 15:4$1:00 +0000
+
+From the archive, message $1.
+EOF
+}
+
+mbox_append () {
+    for n in "$@"; do
+	echo "From archive@example.com Fri Jan  5 15:4$n:00 2001"
+	mbox_message $n | sed '/^$/,$ s/^From />From /'
+	echo
+    done >> "${MAIL_DIR}/archive.mbox"
+}
+
+test_begin_subtest "new.mbox indexes the messages of an mbox in place"
+notmuch config set new.mbox true
+mbox_append 1 2
+output=$(NOTMUCH_NEW)
+test_expect_equal "$output" "Added 2 new messages to the database."
+
+test_begin_subtest "Messages of an mbox are shown as they were"
+notmuch show --format=raw id:mbox-2@example.com > OUTPUT
+mbox_message 2 | sed '/^$/,$ s/^From />From /' > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Only the messages appended to an mbox are read"
+mbox_append 3
+output=$(NOTMUCH_NEW --debug | grep -c '^(D) add_mbox_file: reading .* from byte [1-9]')
+output="$output $(notmuch count --output=files path:archive.mbox)"
+notmuch config set new.mbox
+test_expect_equal "$output" "1 3"
+
+test_begin_subtest "Compressed message files are indexed with their maildir flags"
+generate_message [dir]=zipped/cur '[filename]=zipped-msg:2,F' '[body]="compressed body"'
+mkdir -p "${MAIL_DIR}"/zipped/new "${MAIL_DIR}"/zipped/tmp
+gzip "$gen_msg_filename"
+output=$(NOTMUCH_NEW)
+output="$output
+$(notmuch count compressed and tag:flagged)"
+test_expect_equal "$output" "Added 1 new message to the database.
+1"
+
+test_begin_subtest "Compressed message files are shown as they were"
+notmuch show --format=raw id:${gen_msg_id} > OUTPUT
+gunzip -c "${gen_msg_filename}.gz" > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Compressing a maildir file is a rename"
+generate_message [dir]=zipped/cur '[filename]=plain-msg:2,S'
+notmuch new > /dev/null
+gzip "$gen_msg_filename"
+output=$(NOTMUCH_NEW)
+output="$output
+$(notmuch search --output=files id:${gen_msg_id})
+$(notmuch count id:${gen_msg_id} and tag:unread)"
+test_expect_equal "$output" "No new mail. Detected 1 file rename.
+${MAIL_DIR}/zipped/cur/plain-msg:2,S.gz
+0"
 
 test_begin_subtest "Xapian exception: read only files"
 chmod u-w  ${MAIL_DIR}/.notmuch/xapian/*.${db_ending}
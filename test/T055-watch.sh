@@ -0,0 +1,72 @@
+#!/usr/bin/env bash
+test_description='"notmuch watch"'
+. ./test-lib.sh || exit 1
+
+if [ $NOTMUCH_HAVE_INOTIFY -eq 0 ]; then
+    test_begin_subtest "Watch unsupported: error message"
+    output=$(notmuch watch 2>&1)
+    test_expect_equal "$output" "notmuch was compiled without inotify support; notmuch watch is unavailable."
+
+    test_expect_code 1 "Watch unsupported: status code" "notmuch watch"
+
+    test_done
+fi
+
+# Wait up to five seconds for the output of "$@" to be $expected.
+wait_for () {
+    local expected="$1"
+    shift
+    for i in $(seq 50); do
+	if [ "$("$@")" = "$expected" ]; then
+	    return 0
+	fi
+	sleep 0.1
+    done
+    return 1
+}
+
+mkdir -p "${MAIL_DIR}"/cur "${MAIL_DIR}"/new "${MAIL_DIR}"/tmp
+generate_message '[subject]="Before watching"' '[dir]=cur' '[filename]=before:2,'
+notmuch new > /dev/null
+
+notmuch watch --no-hooks > watch.log 2>&1 &
+watch_pid=$!
+
+test_begin_subtest "Watch starts up"
+wait_for "Watching ${MAIL_DIR} for changes." cat watch.log
+test_expect_equal "$(cat watch.log)" "Watching ${MAIL_DIR} for changes."
+
+test_begin_subtest "Delivered message is added"
+generate_message '[subject]="Delivered"' '[dir]=new' '[filename]=delivered'
+wait_for 1 notmuch count subject:Delivered
+output=$(notmuch search subject:Delivered | notmuch_search_sanitize)
+test_expect_equal "$output" "thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Delivered (inbox unread)"
+
+test_begin_subtest "Message moved to cur has its flags synchronized"
+notmuch tag +kept subject:Delivered
+mv "${MAIL_DIR}"/new/delivered "${MAIL_DIR}"/cur/delivered:2,S
+wait_for 1 notmuch count folder:cur and subject:Delivered
+output=$(notmuch search --output=files subject:Delivered)
+output="$output $(notmuch search subject:Delivered | notmuch_search_sanitize)"
+test_expect_equal "$output" "${MAIL_DIR}/cur/delivered:2,S thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Delivered (inbox kept)"
+
+test_begin_subtest "Deleted message is removed"
+rm "${MAIL_DIR}"/cur/before:2,
+wait_for 0 notmuch count subject:Before
+test_expect_equal "$(notmuch count subject:Before)" "0"
+
+test_begin_subtest "Messages in a new directory are added"
+generate_message '[subject]="In new folder"' '[dir]=folder/cur'
+wait_for 1 notmuch count folder:folder/cur
+test_expect_equal "$(notmuch count folder:folder/cur)" "1"
+
+test_begin_subtest "Stopping on SIGTERM"
+kill -TERM $watch_pid
+wait $watch_pid
+test_expect_equal "$?" "0"
+
+test_begin_subtest "notmuch new after watch"
+output=$(NOTMUCH_NEW)
+test_expect_equal "$output" "No new mail."
+
+test_done
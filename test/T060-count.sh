@@ -38,6 +38,13 @@ test_expect_equal \
     "2" \
     "`notmuch count --output=files id:20091117232137.GA7669@griffis1.net`"
 
+test_begin_subtest "files count with excludes"
+notmuch config set search.exclude_tags signed
+output=$(notmuch count --output=files '*')
+expected=$((`notmuch search --output=files '*' | wc -l`))
+notmuch config set search.exclude_tags
+test_expect_equal "$output" "$expected"
+
 test_begin_subtest "count with no matching messages"
 test_expect_equal \
     "0" \
@@ -93,6 +100,100 @@ notmuch count --output=messages >>EXPECTED
 notmuch count --output=messages tag:inbox >>EXPECTED
 test_expect_equal_file EXPECTED OUTPUT
 
+test_begin_subtest "parallel batch message count"
+cat >INPUT <<EOF
+from:cworth
+
+tag:inbox
+from:cworth and not from:cworth
+subject:notmuch
+EOF
+notmuch count --batch --output=messages <INPUT >EXPECTED
+notmuch count --batch --jobs=3 --output=messages <INPUT >OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "parallel batch thread count"
+notmuch count --batch --output=threads <INPUT >EXPECTED
+notmuch count --batch --jobs=3 --output=threads <INPUT >OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "thread count with excluded messages"
+notmuch config set search.exclude_tags inbox
+test_expect_equal \
+    "$((`notmuch search --output=threads --exclude=true from:cworth | wc -l`))" \
+    "`notmuch count --output=threads --exclude=true from:cworth`"
+notmuch config set search.exclude_tags
+
+test_begin_subtest "thread count after merging threads"
+first=$(notmuch search --output=messages --sort=oldest-first '*' | head -1 | sed 's/^id://')
+add_message '[in-reply-to]="<20091117232137.GA7669@griffis1.net>"' \
+    "[references]=\"<20091117232137.GA7669@griffis1.net> <$first>\""
+test_expect_equal \
+    "$((`notmuch search --output=threads '*' | wc -l`))" \
+    "`notmuch count --output=threads '*'`"
+
+test_begin_subtest "counts with search.cache_counts"
+notmuch count --batch --output=threads >EXPECTED <<EOF
+tag:inbox
+from:cworth
+EOF
+notmuch config set search.cache_counts true
+notmuch count --batch --output=threads >/dev/null <<EOF
+tag:inbox
+from:cworth
+EOF
+notmuch count --batch --output=threads >OUTPUT <<EOF
+tag:inbox
+from:cworth
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "tag facets"
+for tag in $(notmuch search --output=tags from:cworth); do
+    printf "%s\t%s\n" "$(notmuch count from:cworth and tag:$tag)" "$tag"
+done >EXPECTED
+notmuch count --facet=tag from:cworth >OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "tag facets omit excluded messages"
+notmuch config set search.exclude_tags inbox
+notmuch count --facet=tag '*' | grep -c 'inbox$' >OUTPUT
+notmuch config set search.exclude_tags
+echo 0 >EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "estimated counts of small results are exact"
+notmuch count from:cworth >EXPECTED
+notmuch count --estimate from:cworth >OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "estimated batch count"
+notmuch count --estimate --batch >OUTPUT <<EOF
+from:cworth
+tag:inbox
+EOF
+cat <<EOF >EXPECTED
+$(notmuch count from:cworth)
+$(notmuch count tag:inbox)
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "count cache is invalidated by database changes"
+notmuch count tag:inbox >/dev/null
+notmuch tag -inbox from:cworth
+output=$(notmuch count tag:inbox)
+notmuch config set search.cache_counts false
+test_expect_equal "$output" "$(notmuch count tag:inbox)"
+notmuch tag +inbox from:cworth
+
+test_begin_subtest "counts of relative date ranges are not cached"
+notmuch config set search.cache_counts true
+notmuch count date:2009-11-18..2009-11-19 >/dev/null
+notmuch count date:1w.. >/dev/null
+notmuch config set search.cache_counts false
+output="$(grep -c 2009-11-18 ${MAIL_DIR}/.notmuch/query-cache) $(grep -c 1w ${MAIL_DIR}/.notmuch/query-cache)"
+test_expect_equal "$output" "1 0"
+
 backup_database
 test_begin_subtest "error message for database open"
 dd if=/dev/zero of="${MAIL_DIR}/.notmuch/xapian/postlist.${db_ending}" count=3
@@ -103,7 +204,7 @@ restore_database
 
 cat <<EOF > count-files.gdb
 set breakpoint pending on
-break count_files
+break notmuch_query_count_files
 commands
 shell cp /dev/null ${MAIL_DIR}/.notmuch/xapian/postlist.${db_ending}
 continue
@@ -112,12 +213,12 @@ run
 EOF
 
 backup_database
-test_begin_subtest "error message from query_search_messages"
+test_begin_subtest "error message from query_count_files"
 gdb --batch-silent --return-child-result -x count-files.gdb \
     --args notmuch count --output=files '*' 2>OUTPUT 1>/dev/null
 cat <<EOF > EXPECTED
 notmuch count: A Xapian exception occurred
-A Xapian exception occurred performing query
+A Xapian exception occurred counting files
 Query string was: *
 EOF
 sed 's/^\(A Xapian exception [^:]*\):.*$/\1/' < OUTPUT > OUTPUT.clean
@@ -108,6 +108,36 @@ test_begin_subtest "Insert message with custom new.tags actually gets the tags"
 output=$(notmuch search --output=tags id:$gen_msg_id)
 test_expect_equal "$output" "test"
 
+test_begin_subtest "Insert a batch of messages from an mbox"
+rm -f batch.mbox
+for i in 1 2 3; do
+    generate_message "[subject]=\"insert-batch-$i\"" \
+	"[date]=\"Sat, 01 Jan 2000 12:00:00 -0000\"" \
+	"[body]=\"From the batch\""
+    echo "From MAILER-DAEMON Sat Jan  1 12:00:00 2000" >> batch.mbox
+    sed '/^$/,$ s/^From />From /' "$gen_msg_filename" >> batch.mbox
+    echo >> batch.mbox
+done
+notmuch insert --batch=mbox --folder=Batch --create-folder +batch < batch.mbox
+output=$(notmuch count path:Batch/new tag:batch)
+test_expect_equal "$output" "3"
+
+test_begin_subtest "Messages of an mbox batch are delivered as they were"
+cur_msg_filename=$(notmuch search --output=files "subject:insert-batch-3")
+test_expect_equal_file "$cur_msg_filename" "$gen_msg_filename"
+
+test_begin_subtest "Insert a batch of messages from a list of files"
+gen_insert_msg
+echo "$gen_msg_filename" > batch.list
+gen_insert_msg
+echo "$gen_msg_filename" >> batch.list
+notmuch insert --batch=files +listed < batch.list
+output=$(notmuch count tag:listed)
+test_expect_equal "$output" "2"
+
+test_expect_code 1 "Insert a batch that is not an mbox" \
+    "echo bad_message | notmuch insert --batch=mbox"
+
 test_begin_subtest "Insert message with maildir synced tags goes to cur/"
 gen_insert_msg
 notmuch insert +flagged < "$gen_msg_filename"
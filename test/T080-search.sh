@@ -183,4 +183,43 @@ test_begin_subtest "parts do not have adjacent term positions"
 output=$(notmuch search id:termpos and '"c x"')
 test_expect_equal "$output" ""
 
+test_begin_subtest "--profile leaves the results alone"
+notmuch search id:termpos > EXPECTED
+notmuch search --profile id:termpos > OUTPUT 2> PROFILE
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "--profile prints the phases and counts as JSON"
+test_python <<EOF
+import json
+profile = json.load(open("PROFILE"))
+print(" ".join(sorted(profile["phases"])))
+print("%s %s %d" % (profile["phases"]["parse"]["calls"] > 0,
+                    profile["matches"] > 0, profile["threads"]))
+EOF
+cat <<EOF > EXPECTED
+exclude match other parse threads total
+True True 1
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "--memstats reports the memory on stderr"
+notmuch --memstats search id:termpos > OUTPUT 2> MEMSTATS
+notmuch search id:termpos > EXPECTED
+sed -n -e 's/^memstats: \(peak RSS\|Xapian flush threshold\).*/\1/p' \
+    < MEMSTATS >> OUTPUT
+cat <<EOF >> EXPECTED
+peak RSS
+Xapian flush threshold
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "NOTMUCH_MEMSTATS reports the talloc memory by kind"
+NOTMUCH_MEMSTATS=1 notmuch search id:termpos 2>&1 >/dev/null |
+    sed -n -e 's/^memstats:   \(database\|queries\) .*/\1/p' > OUTPUT
+cat <<EOF > EXPECTED
+database
+queries
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
 test_done
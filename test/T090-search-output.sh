@@ -140,6 +140,11 @@ cat <<EOF >EXPECTED
 EOF
 test_expect_equal_file OUTPUT EXPECTED
 
+test_begin_subtest "--output=messages keeps the order of a window of results"
+notmuch search --output=messages --sort=oldest-first '*' | sed -n '6,15p' >EXPECTED
+notmuch search --output=messages --sort=oldest-first --offset=5 --limit=10 '*' >OUTPUT
+test_expect_equal_file OUTPUT EXPECTED
+
 test_begin_subtest "--output=messages --format=json"
 notmuch search --format=json --output=messages '*' >OUTPUT
 cat <<EOF >EXPECTED
@@ -424,6 +429,11 @@ cat <<EOF >EXPECTED
 EOF
 test_expect_equal_file OUTPUT EXPECTED
 
+test_begin_subtest "--output=tags for a query matching most messages"
+notmuch search --output=tags tag:inbox >OUTPUT
+notmuch search --output=tags '*' >EXPECTED
+test_expect_equal_file OUTPUT EXPECTED
+
 test_begin_subtest "sanitize output for quoted-printable line-breaks in author and subject"
 add_message "[subject]='two =?ISO-8859-1?Q?line=0A_subject?=
 	headers'"
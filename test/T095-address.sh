@@ -289,4 +289,41 @@ cat <<EOF >EXPECTED
 EOF
 test_expect_equal_file OUTPUT EXPECTED
 
+test_begin_subtest "--output=recipients reads the headers from the database"
+add_message '[subject]="recipient values"' \
+	    '[to]="Recipient To <to@recipients.example>"' \
+	    '[cc]="Recipient Cc <cc@recipients.example>"' \
+	    '[bcc]="Recipient Bcc <bcc@recipients.example>"'
+sed -i -e 's/recipients\.example/rewritten.example/' ${gen_msg_filename}
+notmuch address --output=recipients subject:"recipient values" >OUTPUT
+cat <<EOF >EXPECTED
+Recipient To <to@recipients.example>
+Recipient Cc <cc@recipients.example>
+Recipient Bcc <bcc@recipients.example>
+EOF
+test_expect_equal_file OUTPUT EXPECTED
+
+test_begin_subtest "--from-index agrees with --deduplicate=address"
+notmuch address --from-index --output=sender --output=count Foo.Bar >OUTPUT
+cat <<EOF >EXPECTED
+3	Baz <foo.bar+baz@example.com>
+7	Foo Bar <foo.bar@example.com>
+EOF
+test_expect_equal_file OUTPUT EXPECTED
+
+test_begin_subtest "--from-index follows added and removed messages"
+add_message '[subject]="contacts"' \
+	    '[from]="New Contact <Contact.New@contacts.example>"' \
+	    '[to]="Other Contact <contact.other@contacts.example>"' \
+	    '[cc]="New Contact <contact.new@contacts.example>"'
+notmuch address --from-index --output=sender --output=recipients --output=count contact. >OUTPUT
+rm ${gen_msg_filename}
+NOTMUCH_NEW >/dev/null
+notmuch address --from-index --output=sender --output=recipients --output=count contact. >>OUTPUT
+cat <<EOF >EXPECTED
+2	New Contact <contact.new@contacts.example>
+1	Other Contact <contact.other@contacts.example>
+EOF
+test_expect_equal_file OUTPUT EXPECTED
+
 test_done
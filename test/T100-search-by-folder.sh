@@ -146,4 +146,14 @@ MAIL_DIR/bar/new/22:2,
 MAIL_DIR/cur/51:2,
 MAIL_DIR/foo/05:2,"
 
+test_begin_subtest "recursive path: search finds a new subdirectory"
+generate_message '[dir]=bar/baz/deeper/cur' '[subject]="Deeper still"'
+notmuch new > /dev/null
+output=$(notmuch search --output=files path:bar/** and subject:deeper | notmuch_search_files_sanitize)
+test_expect_equal "$output" "MAIL_DIR/bar/baz/deeper/cur/${gen_msg_filename##*/}"
+
+test_begin_subtest "recursive path: search of an unknown directory"
+output=$(notmuch count path:nonexistent/**)
+test_expect_equal "$output" "0"
+
 test_done
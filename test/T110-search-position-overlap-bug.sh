@@ -34,4 +34,12 @@ test_begin_subtest "Search for a@y.c must not match"
 output=$(notmuch search a@y.c | notmuch_search_sanitize)
 test_expect_equal "$output" ""
 
+# Long bodies are indexed in 64 KiB pieces, which must not break
+# phrases apart.
+add_message '[subject]="Long body"' "[body]=\"$(printf 'x %.0s' $(seq 32767))chunky bacon\""
+
+test_begin_subtest "Phrase across a body chunk boundary matches"
+output=$(notmuch search '"x chunky bacon"' | notmuch_search_sanitize)
+test_expect_equal "$output" "thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Long body (inbox unread)"
+
 test_done
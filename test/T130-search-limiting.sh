@@ -66,6 +66,15 @@ for outp in messages threads; do
     notmuch search --output=${outp} "*" >expected
     notmuch search --output=${outp} --offset=-$((1 + ${N})) "*" >output
     test_expect_equal_file expected output
+
+    test_begin_subtest "${outp}: offset larger than results"
+    N=`notmuch count --output=${outp} "*"`
+    test_expect_equal "`notmuch search --output=${outp} --offset=${N} "*"`" ""
 done
 
+test_begin_subtest "summary: offset combined with limit"
+notmuch search "*" | tail -n +21 | head -n 10 >expected
+notmuch search --offset=20 --limit=10 "*" >output
+test_expect_equal_file expected output
+
 test_done
@@ -442,4 +442,32 @@ Subject: No messages excluded: single match: reply 4
 Subject: No messages excluded: single match: reply 5"
 
 
+test_begin_subtest "search.cache_excludes keeps a set of excluded messages"
+notmuch config set search.exclude_tags deleted
+notmuch config set search.cache_excludes true
+notmuch search --output=messages subject:deleted >OUTPUT
+notmuch config set search.cache_excludes false
+notmuch search --output=messages subject:deleted >EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "search.cache_excludes follows tag changes"
+notmuch config set search.cache_excludes true
+notmuch search --output=messages subject:deleted >/dev/null
+notmuch tag -deleted id:$deleted_id
+notmuch search --output=messages subject:deleted >OUTPUT
+notmuch count subject:deleted >>OUTPUT
+notmuch tag +deleted id:$not_deleted_id
+notmuch search --output=messages subject:deleted >>OUTPUT
+notmuch count subject:deleted >>OUTPUT
+notmuch config set search.cache_excludes false
+notmuch tag -deleted id:$not_deleted_id
+notmuch search --output=messages subject:deleted >EXPECTED
+notmuch count subject:deleted >>EXPECTED
+notmuch tag +deleted id:$not_deleted_id
+notmuch search --output=messages subject:deleted >>EXPECTED
+notmuch count subject:deleted >>EXPECTED
+notmuch tag -deleted id:$not_deleted_id
+notmuch tag +deleted id:$deleted_id
+test_expect_equal_file EXPECTED OUTPUT
+
 test_done
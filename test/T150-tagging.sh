@@ -113,6 +113,19 @@ notmuch search \* | notmuch_search_sanitize > OUTPUT
 notmuch restore --format=batch-tag < backup.tags
 test_expect_equal_file batch.expected OUTPUT
 
+test_begin_subtest "--batch --input --group-lines=1"
+notmuch dump --format=batch-tag > backup.tags
+notmuch tag --batch --input=batch.in --group-lines=1
+notmuch search \* | notmuch_search_sanitize > OUTPUT
+notmuch restore --format=batch-tag < backup.tags
+test_expect_equal_file batch.expected OUTPUT
+
+test_begin_subtest "--batch --verbose"
+notmuch dump --format=batch-tag > backup.tags
+notmuch tag --batch --input=batch.in --verbose > OUTPUT
+notmuch restore --format=batch-tag < backup.tags
+test_expect_equal "$(cat OUTPUT)" "Processed 4 lines in almost no time."
+
 test_begin_subtest "--batch --input --remove-all"
 notmuch dump --format=batch-tag > backup.tags
 notmuch tag +foo +bar -- One
@@ -286,6 +299,71 @@ test_expect_code 1 "Empty tag names" 'notmuch tag + One'
 
 test_expect_code 1 "Tag name beginning with -" 'notmuch tag +- One'
 
+test_begin_subtest "Tagging waits for a writer that yields"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+    notmuch_database_t *db;
+    notmuch_bool_t yielded = FALSE;
+    int i, status;
+    pid_t pid;
+
+    if (notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_WRITE, &db))
+	return 1;
+
+    pid = fork ();
+    if (pid == 0) {
+	execlp ("notmuch", "notmuch", "tag", "+waited", "*", (char *) NULL);
+	_exit (127);
+    }
+
+    for (i = 0; i < 1000 && ! yielded; i++) {
+	if (notmuch_database_yield (db, &yielded))
+	    return 1;
+	usleep (10000);
+    }
+
+    waitpid (pid, &status, 0);
+    printf ("yielded: %d\n", yielded);
+    printf ("tag exit status: %d\n", WEXITSTATUS (status));
+    notmuch_database_destroy (db);
+    return 0;
+}
+EOF
+cat <<'EOF' >EXPECTED
+== stdout ==
+yielded: 1
+tag exit status: 0
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Tags added while waiting"
+test_expect_equal "$(notmuch count tag:waited)" "$(notmuch count '*')"
+
+test_begin_subtest "Journaled tags are seen at once"
+notmuch config set tag.journal true
+notmuch config set maildir.synchronize_flags false
+notmuch tag --remove-all +journaled subject:One
+output=$(notmuch search subject:One | notmuch_search_sanitize)
+test_expect_equal "$output" "\
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; One (journaled)"
+
+test_begin_subtest "Journaled tags in queries"
+output="$(notmuch count tag:journaled) $(notmuch count subject:One and tag:inbox)"
+test_expect_equal "$output" "1 0"
+
+test_begin_subtest "Journaled tags are written by the next writer"
+notmuch new >/dev/null
+notmuch config set tag.journal false
+output="$(notmuch count tag:journaled) $(wc -l < ${MAIL_DIR}/.notmuch/tag-journal)"
+test_expect_equal "$output" "1 1"
+notmuch config set maildir.synchronize_flags true
+
 test_begin_subtest "Xapian exception: read only files"
 chmod u-w  ${MAIL_DIR}/.notmuch/xapian/*.${db_ending}
 output=$(notmuch tag +something '*' 2>&1 | sed 's/: .*$//' )
@@ -64,6 +64,61 @@ test_expect_equal_json "$output" "[{\"thread\": \"XXX\",
  \"tags\": [\"inbox\",
  \"unread\"]}]"
 
+test_begin_subtest "Search message: json, snippet"
+notmuch config set new.snippet_length 24
+body=$(printf 'You wrote:\n> json-search-snippet\n\n  which  is a long   reply')
+add_message "[subject]=\"json-search-snippet-subject\"" "[date]=\"Sat, 01 Jan 2000 12:00:00 -0000\"" "[body]=\"$body\""
+notmuch config set new.snippet_length
+output=$(notmuch search --format=json "json-search-snippet-subject" | notmuch_search_sanitize)
+test_expect_equal_json "$output" "[{\"thread\": \"XXX\",
+ \"timestamp\": 946728000,
+ \"date_relative\": \"2000-01-01\",
+ \"matched\": 1,
+ \"total\": 1,
+ \"authors\": \"Notmuch Test Suite\",
+ \"subject\": \"json-search-snippet-subject\",
+ \"snippet\": \"You wrote: which is a lo\",
+ \"query\": [\"id:$gen_msg_id\", null],
+ \"tags\": [\"inbox\",
+ \"unread\"]}]"
+
+add_message "[id]=json-big-0@example.com" "[subject]=json-big-thread" \
+    "[date]=\"Sat, 01 Jan 2000 12:00:00 -0000\"" "[body]=json-big-even"
+for i in $(seq 1 69); do
+    if [ $((i % 2)) = 0 ]; then body=json-big-even; else body=json-big-odd; fi
+    add_message "[id]=json-big-$i@example.com" "[subject]=json-big-thread" \
+	"[in-reply-to]=\<json-big-$((i - 1))@example.com\>" \
+	"[date]=\"Sat, 01 Jan 2000 12:00:00 -0000\"" "[body]=$body"
+done
+thread=$(notmuch search --output=threads id:json-big-0@example.com)
+
+search_queries () {
+    notmuch search --format=json "$1" | $NOTMUCH_PYTHON -c \
+	'import sys, json; print("\n".join(str(q) for q in json.load(sys.stdin)[0]["query"]))'
+}
+
+test_begin_subtest "Search thread: json, large thread query by search terms"
+search_queries json-big-even >OUTPUT
+cat <<EOF >EXPECTED
+$thread and date:..@946728000 and (json-big-even)
+$thread and date:..@946728000 and not (json-big-even)
+EOF
+test_expect_equal_file OUTPUT EXPECTED
+
+test_begin_subtest "Search thread: json, large thread query by complement"
+search_queries id:json-big-0@example.com >OUTPUT
+cat <<EOF >EXPECTED
+id:json-big-0@example.com
+$thread and date:..@946728000 and not (id:json-big-0@example.com)
+EOF
+test_expect_equal_file OUTPUT EXPECTED
+
+test_begin_subtest "Search thread: json, large thread queries match the thread"
+output=$(search_queries json-big-even | while read query; do
+	     notmuch count "$query"; done)
+test_expect_equal "$output" "35
+35"
+
 test_expect_code 20 "Format version: too low" \
     "notmuch search --format-version=0 \\*"
 
@@ -30,4 +30,13 @@ Date: GENERATED_DATE
 
 This is just a test message (#2)"
 
+test_begin_subtest "Raw message is the message file"
+file=$(notmuch search --output=files id:msg-002@notmuch-test-suite)
+notmuch show --format=raw id:msg-002@notmuch-test-suite > OUTPUT
+test_expect_equal_file "$file" OUTPUT
+
+test_begin_subtest "Raw message through a pipe is the message file"
+notmuch show --format=raw id:msg-002@notmuch-test-suite | cat > OUTPUT
+test_expect_equal_file "$file" OUTPUT
+
 test_done
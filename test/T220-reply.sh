@@ -254,4 +254,17 @@ test_expect_equal_json "$output" '
 }'
 
 
+test_begin_subtest "headers-only reply reads recorded headers"
+add_message '[subject]="recorded headers"' \
+	    '[id]="recorded-child@example.com"' \
+	    '[references]="<recorded-parent@example.com>"' \
+	    '[reply-to]="Recorded Reply <reply@recorded.example>"'
+rm ${gen_msg_filename}
+notmuch reply --format=headers-only id:recorded-child@example.com | grep -E '^(References|To):' >OUTPUT
+cat <<EOF >EXPECTED
+References: <recorded-parent@example.com> <recorded-child@example.com>
+To: Recorded Reply <reply@recorded.example>
+EOF
+test_expect_equal_file OUTPUT EXPECTED
+
 test_done
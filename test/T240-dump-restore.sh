@@ -323,6 +323,52 @@ test_begin_subtest 'roundtripping random message-ids and tags'
 
 test_expect_equal_file EXPECTED.$test_count OUTPUT.$test_count
 
+test_begin_subtest 'dump --since only dumps changed messages'
+notmuch dump --since=0 > BASE.dump
+base_revision=$(sed -n '1s/.* //p' BASE.dump)
+thread=$(notmuch search --output=threads --limit=1 '*')
+notmuch tag +incremental $thread
+notmuch dump --since=$base_revision > CHANGES.dump
+tail -n +2 CHANGES.dump | sort > OUTPUT.$test_count
+notmuch dump $thread | sort > EXPECTED.$test_count
+test_expect_equal_file EXPECTED.$test_count OUTPUT.$test_count
+
+test_begin_subtest 'restore a base dump followed by a dump of changes'
+notmuch dump | sort > EXPECTED.$test_count
+notmuch tag +scratch '*'
+cat BASE.dump CHANGES.dump | notmuch restore > RESTORE.$test_count 2>&1
+notmuch dump | sort >> RESTORE.$test_count
+mv RESTORE.$test_count OUTPUT.$test_count
+test_expect_equal_file EXPECTED.$test_count OUTPUT.$test_count
+
+test_begin_subtest 'restore warns about missing changes'
+notmuch dump --since=$((base_revision + 1)) > LATE.dump
+cat BASE.dump LATE.dump | notmuch restore > OUTPUT 2>&1
+cat <<EOF > EXPECTED
+Warning: changes between revisions $base_revision and $((base_revision + 1)) are missing
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest 'roundtripping in binary format'
+notmuch dump | sort > EXPECTED.$test_count
+notmuch dump --format=binary > BINARY.dump
+notmuch tag +this_tag_is_very_unlikely_to_be_random '*'
+notmuch restore < BINARY.dump
+notmuch dump | sort > OUTPUT.$test_count
+test_expect_equal_file EXPECTED.$test_count OUTPUT.$test_count
+
+test_begin_subtest 'roundtripping in gzipped binary format'
+notmuch dump | sort > EXPECTED.$test_count
+notmuch dump --gzip --format=binary > BINARY.dump.gz
+notmuch tag -inbox '*'
+notmuch restore --input=BINARY.dump.gz
+notmuch dump | sort > OUTPUT.$test_count
+test_expect_equal_file EXPECTED.$test_count OUTPUT.$test_count
+
+test_begin_subtest 'restore: truncated binary dump'
+head -c 100 BINARY.dump > TRUNCATED.dump
+test_expect_code 1 "notmuch restore < TRUNCATED.dump"
+
 test_done
 
 # Note the database is "poisoned" for sup format at this point.
@@ -44,4 +44,21 @@ add_message '[subject]="=?utf-8?q?encoded?=word without=?utf-8?q?space?=" '
 output=$(notmuch search id:${gen_msg_id} 2>&1 | notmuch_show_sanitize)
 test_expect_equal "$output" "thread:0000000000000005   2001-01-05 [1/1] Notmuch Test Suite; encodedword withoutspace (inbox unread)"
 
+test_begin_subtest "Search for ISO-8859-2 text after another in the same charset"
+add_message '[content-type]="text/plain; charset=iso-8859-2"' \
+            '[content-transfer-encoding]=8bit' \
+            '[subject]="Another ISO-8859-2 encoded message"' \
+            "[body]=$'Plain ASCII first.\nThen \350\362\341pavka.'"
+output=$(notmuch search --output=messages čňápavka)
+test_expect_equal "$output" "id:${gen_msg_id}"
+
+test_begin_subtest "Search long UTF-8 text read in several pieces"
+body=$(for i in $(seq 2000); do printf 'způsob žluťoučký '; done)
+add_message '[content-type]="text/plain; charset=utf-8"' \
+            '[content-transfer-encoding]=8bit' \
+            '[subject]="Long UTF-8 message"' \
+            "[body]=\"${body}kůň\""
+output=$(notmuch search --output=messages 'žluťoučký and kůň')
+test_expect_equal "$output" "id:${gen_msg_id}"
+
 test_done
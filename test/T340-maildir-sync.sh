@@ -186,4 +186,22 @@ notmuch search 'subject:"File in new"' | notmuch_search_sanitize > output
 test_expect_equal "$(< output)" \
 "thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; File in new/ (test unread)"
 
+test_begin_subtest "Tag changes rename the files of every message matched"
+add_message [subject]='"Bulk flag one"' [dir]=cur [filename]='bulk-flag-one:2,'
+add_message [subject]='"Bulk flag two"' [dir]=cur [filename]='bulk-flag-two:2,'
+notmuch tag +flagged subject:Bulk
+test_expect_equal "$(cd $MAIL_DIR/cur/; ls bulk-flag*)" "bulk-flag-one:2,F
+bulk-flag-two:2,F"
+
+test_begin_subtest "notmuch new detects no file rename after synchronizing several messages"
+output=$(NOTMUCH_NEW)
+test_expect_equal "$output" "No new mail."
+
+test_begin_subtest "Flags of a compressed file go before its suffix"
+generate_message [subject]='"Compressed flags"' [dir]=cur [filename]='compressed-flags:2,S'
+gzip "$gen_msg_filename"
+NOTMUCH_NEW > /dev/null
+notmuch tag +replied subject:"Compressed flags"
+test_expect_equal "$(cd $MAIL_DIR/cur/; ls compressed-flags*)" "compressed-flags:2,RS.gz"
+
 test_done
@@ -100,6 +100,16 @@ test_expect_equal_json \
     "$output" \
     "$expected"
 
+test_begin_subtest "cached signature verification"
+notmuch config set crypto.cache_signatures true
+notmuch show --format=json --verify subject:"test signed message 001" > EXPECTED
+notmuch config set crypto.gpg_path false
+notmuch show --format=json --verify subject:"test signed message 001" > OUTPUT
+notmuch config set crypto.gpg_path gpg
+notmuch config set crypto.cache_signatures
+rm -f "${MAIL_DIR}"/.notmuch/signatures
+test_expect_equal_file EXPECTED OUTPUT
+
 test_begin_subtest "signature verification with signer key unavailable"
 # move the gnupghome temporarily out of the way
 mv "${GNUPGHOME}"{,.bak}
@@ -304,6 +314,14 @@ test_expect_equal_json \
     "$output" \
     "$expected"
 
+test_begin_subtest "decryption of a thread with --jobs"
+parent_id=$(notmuch search --output=messages subject:"test encrypted message 002" | sed -e s/^id://)
+add_message '[subject]="Re: test encrypted message 002"' \
+	    "[in-reply-to]=\<$parent_id\>"
+notmuch show --format=json --decrypt id:$parent_id > EXPECTED
+notmuch show --format=json --decrypt --jobs=4 id:$parent_id > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
 test_begin_subtest "reply to encrypted message"
 output=$(notmuch reply --decrypt subject:"test encrypted message 002" \
     | grep -v -e '^In-Reply-To:' -e '^References:')
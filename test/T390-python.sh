@@ -30,6 +30,26 @@ EOF
 notmuch search --sort=oldest-first --output=messages tag:inbox | sed s/^id:// > EXPECTED
 test_expect_equal_file OUTPUT EXPECTED
 
+test_begin_subtest "compare message ids fetched as columns"
+test_python <<EOF
+import notmuch
+db = notmuch.Database(mode=notmuch.Database.MODE.READ_ONLY)
+q_new = notmuch.Query(db, 'tag:inbox')
+q_new.set_sort(notmuch.Query.SORT.OLDEST_FIRST)
+for (mid,) in q_new.search_messages_columns(('message_id',), batch_size=7):
+    print (mid)
+EOF
+notmuch search --sort=oldest-first --output=messages tag:inbox | sed s/^id:// > EXPECTED
+test_expect_equal_file OUTPUT EXPECTED
+
+test_begin_subtest "tag all messages of a query"
+test_python <<EOF
+import notmuch
+db = notmuch.Database(mode=notmuch.Database.MODE.READ_WRITE)
+print (notmuch.Query(db, 'from:cworth').tag_all(add=['python-bulk']))
+EOF
+test_expect_equal "$(cat OUTPUT)" "$(notmuch count tag:python-bulk)"
+
 test_begin_subtest "get non-existent file"
 test_python <<EOF
 import notmuch
@@ -83,4 +83,35 @@ EOF
 notmuch count --output=threads tag:inbox > EXPECTED
 test_expect_equal_file OUTPUT EXPECTED
 
+test_begin_subtest "message ids from each_row"
+test_ruby <<"EOF"
+require 'notmuch'
+$maildir = ENV['MAIL_DIR']
+if not $maildir then
+  abort('environment variable MAIL_DIR must be set')
+end
+@db = Notmuch::Database.new($maildir)
+@q = @db.query('tag:inbox')
+@q.sort = Notmuch::SORT_OLDEST_FIRST
+@q.search_messages.each_row(7) do |row|
+  print row.message_id, "\n"
+end
+EOF
+notmuch search --sort=oldest-first --output=messages tag:inbox | sed s/^id:// > EXPECTED
+test_expect_equal_file OUTPUT EXPECTED
+
+test_begin_subtest "tag all messages of a query"
+test_ruby <<"EOF"
+require 'notmuch'
+$maildir = ENV['MAIL_DIR']
+if not $maildir then
+  abort('environment variable MAIL_DIR must be set')
+end
+@db = Notmuch::Database.new($maildir, :mode => Notmuch::MODE_READ_WRITE)
+@q = @db.query('from:cworth')
+print @q.tag_all(:add => ['ruby-bulk']), "\n"
+EOF
+notmuch count tag:ruby-bulk > EXPECTED
+test_expect_equal_file OUTPUT EXPECTED
+
 test_done
@@ -91,6 +91,36 @@ test_expect_equal_file expected output
 # depends on the previous subtest leaving broken hook behind
 test_expect_code 1 "post-new non-zero exit status (notmuch status)" "notmuch new"
 
+test_begin_subtest "post-new is given the new message ids"
+rm_hooks
+mkdir -p ${HOOK_DIR}
+cat <<EOF >"${HOOK_DIR}/post-new"
+#!/bin/sh
+cat "\$NOTMUCH_NEW_MESSAGE_IDS" > ${PWD}/output
+EOF
+chmod +x "${HOOK_DIR}/post-new"
+generate_message
+echo "${gen_msg_id}" > expected
+generate_message
+echo "${gen_msg_id}" >> expected
+notmuch new > /dev/null
+sort output > output.sorted
+sort expected > expected.sorted
+test_expect_equal_file expected.sorted output.sorted
+
+test_begin_subtest "post-new is given the revision before new messages"
+rm_hooks
+mkdir -p ${HOOK_DIR}
+cat <<EOF >"${HOOK_DIR}/post-new"
+#!/bin/sh
+notmuch count "lastmod:\$((\$NOTMUCH_NEW_REVISION + 1)).." > ${PWD}/output
+EOF
+chmod +x "${HOOK_DIR}/post-new"
+generate_message
+generate_message
+notmuch new > /dev/null
+test_expect_equal "$(cat output)" "2"
+
 rm_hooks
 generate_message
 create_failing_hook "post-insert"
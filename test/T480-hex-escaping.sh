@@ -24,6 +24,10 @@ $TEST_DIRECTORY/hex-xcode --direction=decode  < EXPECTED.$test_count |\
     $TEST_DIRECTORY/hex-xcode --direction=encode > OUTPUT.$test_count
 test_expect_equal_file EXPECTED.$test_count OUTPUT.$test_count
 
+test_begin_subtest "upper case hex digits"
+tag_dec1=$($TEST_DIRECTORY/hex-xcode --direction=decode "comic_swear=%24%26%5E%25%2F")
+test_expect_equal "$tag_dec1" 'comic_swear=$&^%/'
+
 test_begin_subtest "round trip (in-place)"
 find $TEST_DIRECTORY/corpus -type f -print | sort | xargs cat > EXPECTED
 $TEST_DIRECTORY/hex-xcode --in-place --direction=encode < EXPECTED |\
@@ -10,4 +10,36 @@ notmuch show foo..
 exit_code=$?
 test_expect_equal 1 $exit_code
 
+add_message '[subject]="window a"' '[date]="Sat, 01 Jan 2000 12:00:00 -0000"'
+window_a=$gen_msg_id
+add_message '[subject]="window b"' '[date]="Sat, 01 Jan 2000 12:01:00 -0000"' \
+	    "[in-reply-to]=\<$window_a\>"
+window_b=$gen_msg_id
+add_message '[subject]="window c"' '[date]="Sat, 01 Jan 2000 12:02:00 -0000"' \
+	    "[in-reply-to]=\<$window_b\>"
+add_message '[subject]="window d"' '[date]="Sat, 01 Jan 2000 12:03:00 -0000"' \
+	    "[in-reply-to]=\<$window_a\>"
+
+test_begin_subtest "--message-offset and --message-limit keep the thread structure"
+notmuch show --format=json --body=false --message-offset=1 --message-limit=2 \
+	id:$window_a > WINDOW
+test_python <<EOF
+import json
+def skeleton(node):
+    if isinstance(node, dict):
+        return node["headers"]["Subject"]
+    if isinstance(node, list):
+        return [skeleton(n) for n in node]
+    return node
+print(json.dumps(skeleton(json.load(open("WINDOW")))))
+EOF
+cat <<EOF > EXPECTED
+[[[null, [["window b", [["window c", []]]]]]]]
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "--message-offset past the thread shows no message"
+notmuch show --format=text --message-offset=4 id:$window_a > OUTPUT
+test_expect_equal_file /dev/null OUTPUT
+
 test_done
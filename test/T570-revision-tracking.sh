@@ -90,4 +90,183 @@ subtotal=$(notmuch count lastmod:..$lastmod)
 result=$(($subtotal == $total-1))
 test_expect_equal 1 "$result"
 
+test_begin_subtest "notmuch_database_reopen"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+   notmuch_database_t *db;
+   notmuch_bool_t changed;
+   unsigned long before, after;
+
+   if (notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db))
+       fputs ("open failed\n", stderr);
+   before = notmuch_database_get_revision (db, NULL);
+
+   if (notmuch_database_reopen (db, &changed))
+       fputs ("reopen failed\n", stderr);
+   printf ("%d\n", changed);
+
+   system ("notmuch tag +reopened id:4EFC743A.3060609@april.org");
+
+   if (notmuch_database_reopen (db, &changed))
+       fputs ("reopen failed\n", stderr);
+   after = notmuch_database_get_revision (db, NULL);
+   printf ("%d %d\n", changed, after > before);
+}
+EOF
+cat <<'EOF' >EXPECTED
+== stdout ==
+0
+1 1
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "reads finish when the database is modified under them"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <notmuch.h>
+static int
+walk (notmuch_database_t *db, notmuch_sort_t sort)
+{
+   notmuch_query_t *query = notmuch_query_create (db, "*");
+   notmuch_messages_t *messages;
+   notmuch_tags_t *tags;
+   int count = 0, i;
+
+   notmuch_query_set_sort (query, sort);
+   if (notmuch_query_search_messages_st (query, &messages))
+       return -1;
+   for (; notmuch_messages_valid (messages);
+	notmuch_messages_move_to_next (messages)) {
+       notmuch_message_t *message = notmuch_messages_get (messages);
+
+       /* Commit often enough that the revision being read is gone,
+	* and under several reads, for more commits in all than one
+	* read may retry. */
+       if (count >= 1 && count <= 4)
+	   for (i = 0; i < 3; i++)
+	       system (i % 2 ? "notmuch tag -modified '*'" :
+		       "notmuch tag +modified '*'");
+       if (notmuch_message_get_message_id (message) == NULL)
+	   return -1;
+       for (tags = notmuch_message_get_tags (message);
+	    notmuch_tags_valid (tags); notmuch_tags_move_to_next (tags))
+	   ;
+       count++;
+   }
+   notmuch_query_destroy (query);
+   return count;
+}
+int main (int argc, char** argv)
+{
+   notmuch_database_t *db;
+
+   if (notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db))
+       fputs ("open failed\n", stderr);
+   printf ("%d\n", walk (db, NOTMUCH_SORT_NEWEST_FIRST));
+   printf ("%d\n", walk (db, NOTMUCH_SORT_UNSORTED));
+}
+EOF
+notmuch tag -modified '*'
+cat <<EOF >EXPECTED
+== stdout ==
+$(notmuch count '*')
+$(notmuch count '*')
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "notmuch_database_get_changes"
+revision=$(notmuch count --lastmod '*' | cut -f3)
+notmuch tag +synced id:4EFC743A.3060609@april.org
+add_message
+file=$(notmuch search --output=files id:4EFC743A.3060609@april.org)
+rm -f "$file"
+notmuch new > /dev/null
+cat <<EOF > EXPECTED
+== stdout ==
+$gen_msg_id inbox unread
+4EFC743A.3060609@april.org deleted
+== stderr ==
+EOF
+test_C ${MAIL_DIR} $revision <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+   notmuch_database_t *db;
+   notmuch_changes_t *changes;
+   notmuch_tags_t *tags;
+   unsigned long last = 0;
+
+   if (notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db))
+       fputs ("open failed\n", stderr);
+   if (notmuch_database_get_changes (db, strtoul (argv[2], NULL, 10), &changes))
+       fputs ("get_changes failed\n", stderr);
+
+   for (; notmuch_changes_valid (changes);
+	notmuch_changes_move_to_next (changes)) {
+       if (notmuch_changes_get_revision (changes) < last)
+	   fputs ("out of order\n", stderr);
+       last = notmuch_changes_get_revision (changes);
+
+       printf ("%s", notmuch_changes_get_message_id (changes));
+       if (notmuch_changes_get_deleted (changes)) {
+	   printf (" deleted");
+       } else {
+	   for (tags = notmuch_changes_get_tags (changes);
+		notmuch_tags_valid (tags);
+		notmuch_tags_move_to_next (tags))
+	       printf (" %s", notmuch_tags_get (tags));
+       }
+       printf ("\n");
+   }
+
+   notmuch_changes_destroy (changes);
+}
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "notmuch_query_change_tags only rewrites changed messages"
+cat <<EOF > EXPECTED
+== stdout ==
+$(notmuch count tag:inbox) 0 1 1
+== stderr ==
+EOF
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+   notmuch_database_t *db;
+   notmuch_query_t *query;
+   const char *add[] = { "bulk", NULL };
+   const char *uuid;
+   unsigned int first, second;
+   unsigned long revision;
+
+   if (notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_WRITE, &db))
+       fputs ("open failed\n", stderr);
+   query = notmuch_query_create (db, "tag:inbox");
+   if (notmuch_query_change_tags (query, add, NULL, FALSE, &first))
+       fputs ("first change failed\n", stderr);
+   revision = notmuch_database_get_revision (db, &uuid);
+   if (notmuch_query_change_tags (query, add, NULL, FALSE, &second))
+       fputs ("second change failed\n", stderr);
+   printf ("%u %u %d", first, second,
+	   notmuch_database_get_revision (db, &uuid) == revision);
+   notmuch_query_destroy (query);
+   query = notmuch_query_create (db, "tag:inbox and not tag:bulk");
+   printf (" %d\n", notmuch_query_count_messages (query) == 0);
+   notmuch_database_destroy (db);
+}
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
 test_done
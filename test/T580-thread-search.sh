@@ -38,5 +38,351 @@ done
 
 test_expect_equal "$count" "$success"
 
+test_begin_subtest "thread search returns each matching thread once"
+notmuch search --output=threads '*' > OUTPUT
+sort -u OUTPUT > EXPECTED
+output="$(wc -l < OUTPUT) $(notmuch count --output=threads '*')"
+expected="$(wc -l < EXPECTED) $(wc -l < EXPECTED)"
+test_expect_equal "$output" "$expected"
+
+test_begin_subtest "thread search order does not depend on the window"
+notmuch search --sort=oldest-first --output=threads '*' | head -n 5 > EXPECTED
+notmuch search --sort=oldest-first --output=threads --limit=5 '*' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "parallel thread search gives the same output"
+notmuch search --sort=oldest-first --format=json '*' > EXPECTED
+notmuch search --sort=oldest-first --format=json --jobs=4 '*' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "parallel thread search with offset and limit"
+notmuch search --offset=7 --limit=20 '*' > EXPECTED
+notmuch search --offset=7 --limit=20 --jobs=3 '*' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "thread summaries follow tag changes"
+notmuch tag +summary-tag id:1258471718-6781-2-git-send-email-dottedmag@dottedmag.net
+output=$(notmuch search --output=tags id:1258471718-6781-2-git-send-email-dottedmag@dottedmag.net | grep summary-tag)
+summary=$(notmuch search id:1258471718-6781-2-git-send-email-dottedmag@dottedmag.net | grep -c summary-tag)
+notmuch tag -summary-tag '*'
+after=$(notmuch search id:1258471718-6781-2-git-send-email-dottedmag@dottedmag.net | grep -c summary-tag)
+test_expect_equal "$output $summary $after" "summary-tag 1 0"
+
+test_begin_subtest "thread summaries follow new messages"
+before=$(notmuch search --sort=oldest-first '*' | notmuch_search_sanitize)
+generate_message '[subject]="Re: [notmuch] [PATCH 1/2] Close message file after parsing message headers"' \
+		 '[in-reply-to]="<1258471718-6781-1-git-send-email-dottedmag@dottedmag.net>"' \
+		 '[from]="Summary Tester <summary@example.com>"' \
+		 '[date]="Wed, 18 Nov 2009 12:00:00 +0000"'
+notmuch new > /dev/null
+output=$(notmuch search id:${gen_msg_id} | notmuch_search_sanitize)
+test_expect_equal "$output" "thread:XXX   2009-11-18 [1/6] Summary Tester| Mikhail Gusarov, Carl Worth, Keith Packard; [notmuch] [PATCH 1/2] Close message file after parsing message headers (inbox unread)"
+
+test_begin_subtest "thread summaries follow removed messages"
+rm ${gen_msg_filename}
+notmuch new > /dev/null
+output=$(notmuch search --sort=oldest-first '*' | notmuch_search_sanitize)
+test_expect_equal "$output" "$before"
+
+test_begin_subtest "cancelled thread search"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+    notmuch_database_t *db;
+    notmuch_query_t *query;
+    notmuch_threads_t *threads;
+    notmuch_status_t stat;
+    volatile int cancel = 1;
+
+    notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db);
+    query = notmuch_query_create (db, "*");
+    notmuch_query_set_cancel (query, &cancel);
+    stat = notmuch_query_search_threads_st (query, &threads);
+    printf ("%s\n", notmuch_status_to_string (stat));
+    cancel = 0;
+    stat = notmuch_query_search_threads_st (query, &threads);
+    printf ("%s\n", notmuch_status_to_string (stat));
+    return 0;
+}
+EOF
+cat <<EOF > EXPECTED
+== stdout ==
+Query ran out of time or was cancelled
+No error occurred
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "searches stop at their deadline"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+    notmuch_database_t *db;
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+    notmuch_threads_t *threads;
+    int count;
+
+    notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db);
+    query = notmuch_query_create (db, "*");
+
+    notmuch_query_set_deadline (query, 1e-9);
+    notmuch_query_search_messages_st (query, &messages);
+    for (count = 0; notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
+	count++;
+    printf ("%d %s\n", count,
+	    notmuch_status_to_string (notmuch_query_get_status (query)));
+
+    notmuch_query_search_threads_st (query, &threads);
+    for (count = 0; notmuch_threads_valid (threads);
+	 notmuch_threads_move_to_next (threads))
+	count++;
+    printf ("%d %s\n", count,
+	    notmuch_status_to_string (notmuch_query_get_status (query)));
+
+    notmuch_query_set_deadline (query, 0);
+    notmuch_query_search_messages_st (query, &messages);
+    for (count = 0; notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
+	count++;
+    printf ("%d %s\n", count,
+	    notmuch_status_to_string (notmuch_query_get_status (query)));
+    return 0;
+}
+EOF
+cat <<EOF > EXPECTED
+== stdout ==
+0 Query ran out of time or was cancelled
+0 Query ran out of time or was cancelled
+$(notmuch count '*') No error occurred
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "asynchronous searches return the threads in batches"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <poll.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+    notmuch_database_t *db;
+    notmuch_query_t *query;
+    notmuch_async_search_t *search;
+    notmuch_async_threads_t *threads;
+    struct pollfd pfd;
+
+    notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db);
+    query = notmuch_query_create (db, "*");
+    notmuch_query_set_sort (query, NOTMUCH_SORT_OLDEST_FIRST);
+
+    if (notmuch_query_search_threads_async (query, 7, &search))
+	return 1;
+
+    pfd.fd = notmuch_async_search_get_fd (search);
+    pfd.events = POLLIN;
+    while (! notmuch_async_search_finished (search)) {
+	poll (&pfd, 1, -1);
+	while (notmuch_async_search_next (search, &threads) == 0 && threads) {
+	    for (; notmuch_async_threads_valid (threads);
+		 notmuch_async_threads_move_to_next (threads))
+		printf ("thread:%s\n",
+			notmuch_async_threads_get_thread_id (threads));
+	    notmuch_async_threads_destroy (threads);
+	}
+    }
+    fprintf (stderr, "%s\n",
+	     notmuch_status_to_string (notmuch_async_search_get_status (search)));
+    notmuch_async_search_destroy (search);
+    return 0;
+}
+EOF
+cat <<EOF > EXPECTED
+== stdout ==
+$(notmuch search --sort=oldest-first --output=threads '*')
+== stderr ==
+No error occurred
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "asynchronous searches can be cancelled and destroyed early"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+    notmuch_database_t *db;
+    notmuch_query_t *query;
+    notmuch_async_search_t *search;
+
+    notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db);
+    query = notmuch_query_create (db, "*");
+
+    notmuch_query_search_threads_async (query, 1, &search);
+    notmuch_async_search_cancel (search);
+    notmuch_async_search_destroy (search);
+
+    /* And one left for the query to destroy. */
+    notmuch_query_search_threads_async (query, 1, &search);
+    notmuch_query_destroy (query);
+    printf ("done\n");
+    return 0;
+}
+EOF
+cat <<EOF > EXPECTED
+== stdout ==
+done
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "prepared queries are parsed once until the database changes"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <string.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+    notmuch_database_t *db;
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+    notmuch_message_t *message;
+    notmuch_profile_t profile;
+    unsigned int count;
+    int offset;
+
+    notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_WRITE, &db);
+    memset (&profile, 0, sizeof (profile));
+    notmuch_database_set_profile (db, &profile);
+
+    query = notmuch_query_create (db, "tag:inbox and not tag:prepared");
+    notmuch_query_prepare (query);
+    notmuch_query_count_messages_st (query, &count);
+    printf ("count %u\n", count);
+    for (offset = 0; offset < 2; offset++) {
+	notmuch_query_set_sort (query, offset ? NOTMUCH_SORT_NEWEST_FIRST :
+				NOTMUCH_SORT_OLDEST_FIRST);
+	notmuch_query_set_offset (query, offset);
+	notmuch_query_set_limit (query, 1);
+	notmuch_query_search_messages_st (query, &messages);
+	notmuch_messages_destroy (messages);
+    }
+    printf ("parses %lu\n", profile.parse.calls);
+
+    notmuch_query_set_offset (query, 0);
+    notmuch_query_search_messages_st (query, &messages);
+    message = notmuch_messages_get (messages);
+    notmuch_message_add_tag (message, "prepared");
+    notmuch_messages_destroy (messages);
+
+    notmuch_query_count_messages_st (query, &count);
+    printf ("count %u\n", count);
+    printf ("parses %lu\n", profile.parse.calls);
+    return 0;
+}
+EOF
+count=$(notmuch count tag:inbox)
+cat <<EOF > EXPECTED
+== stdout ==
+count ${count}
+parses 1
+count $((count - 1))
+parses 2
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "preparing a malformed query reports the error"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+    notmuch_database_t *db;
+    notmuch_query_t *query;
+
+    notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db);
+    query = notmuch_query_create (db, "tag:inbox and");
+    printf ("%s\n", notmuch_status_to_string (notmuch_query_prepare (query)));
+    return 0;
+}
+EOF
+cat <<EOF > EXPECTED
+== stdout ==
+A Xapian exception occurred
+== stderr ==
+A Xapian exception occurred parsing query: Syntax: <expression> AND <expression>
+Query string was: tag:inbox and
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+# Tagging a message drops the summary record of its thread, so the
+# summary-only search below builds the thread from the value streams.
+test_begin_subtest "summary-only thread search agrees with the messages"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <notmuch.h>
+static void
+print_threads (notmuch_database_t *db, unsigned int fields)
+{
+    notmuch_query_t *query;
+    notmuch_threads_t *threads;
+    notmuch_thread_t *thread;
+    notmuch_messages_t *messages;
+    notmuch_tags_t *tags;
+    int count;
+
+    query = notmuch_query_create (db, "from:cworth and tag:summary-only");
+    notmuch_query_set_fields (query, fields);
+    notmuch_query_search_threads_st (query, &threads);
+    for (; notmuch_threads_valid (threads); notmuch_threads_move_to_next (threads)) {
+	thread = notmuch_threads_get (threads);
+	printf ("thread:%s [%d/%d] %ld %s; %s (",
+		notmuch_thread_get_thread_id (thread),
+		notmuch_thread_get_matched_messages (thread),
+		notmuch_thread_get_total_messages (thread),
+		(long) notmuch_thread_get_newest_date (thread),
+		notmuch_thread_get_authors (thread),
+		notmuch_thread_get_subject (thread));
+	for (tags = notmuch_thread_get_tags (thread);
+	     notmuch_tags_valid (tags); notmuch_tags_move_to_next (tags))
+	    printf (" %s", notmuch_tags_get (tags));
+	count = 0;
+	for (messages = notmuch_thread_get_messages (thread);
+	     notmuch_messages_valid (messages);
+	     notmuch_messages_move_to_next (messages))
+	    count++;
+	printf (" ) %d\n", count);
+    }
+    notmuch_query_destroy (query);
+}
+int main (int argc, char** argv)
+{
+    notmuch_database_t *db;
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+
+    notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_WRITE, &db);
+    query = notmuch_query_create (db, "from:cworth");
+    notmuch_query_search_messages_st (query, &messages);
+    for (; notmuch_messages_valid (messages); notmuch_messages_move_to_next (messages))
+	notmuch_message_add_tag (notmuch_messages_get (messages), "summary-only");
+    notmuch_query_destroy (query);
+
+    print_threads (db, NOTMUCH_FIELD_THREAD_SUMMARY);
+    print_threads (db, NOTMUCH_FIELD_ALL);
+    return 0;
+}
+EOF
+sed -n '/== stdout ==/,/== stderr ==/p' OUTPUT | grep '^thread' > ACTUAL
+lines=$(wc -l < ACTUAL)
+head -n $((lines / 2)) ACTUAL > SUMMARY_ONLY
+tail -n $((lines / 2)) ACTUAL > FULL
+test_expect_equal_file FULL SUMMARY_ONLY
 
 test_done
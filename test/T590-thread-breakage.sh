@@ -121,4 +121,22 @@ test_content_count apple 0
 test_content_count banana 0
 test_ghost_count 0 'No ghosts should remain after full thread deletion'
 
+message_a
+message_b
+notmuch new >/dev/null
+rm -f ${MAIL_DIR}/cur/a ${MAIL_DIR}/cur/b
+notmuch new >/dev/null
+test_thread_count 0 'Whole thread removed in one run: no threads'
+test_ghost_count 0 'No ghosts should remain after removing the thread in one run'
+
+message_a
+message_b
+notmuch new >/dev/null
+mkdir -p ${MAIL_DIR}/other/cur
+mv ${MAIL_DIR}/cur/b ${MAIL_DIR}/other/cur/b
+rm -rf ${MAIL_DIR}/cur
+notmuch new >/dev/null
+test_thread_count 1 'Directory of the first message removed: one thread'
+test_ghost_count 1 'should be one ghost after the directory is removed'
+
 test_done
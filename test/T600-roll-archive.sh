@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+test_description='"notmuch roll-archive"'
+. ./test-lib.sh || exit 1
+
+add_email_corpus
+
+total=$(notmuch count '*')
+notmuch search --output=files --sort=oldest-first from:cworth > EXPECTED.files
+notmuch search --output=messages --sort=oldest-first date:2010-01-01.. > EXPECTED.recent
+cworth_day=$(notmuch count date:2009-11-18..2009-11-18 from:cworth)
+
+notmuch tag +hidden $(notmuch search --output=messages --sort=oldest-first --limit=1 from:cworth)
+notmuch config set search.exclude_tags hidden
+notmuch search --exclude=flag from:cworth > EXPECTED.flag
+notmuch config set search.exclude_tags
+
+test_begin_subtest "Rolling messages into an archive shard"
+count=$(notmuch count from:cworth)
+output=$(notmuch roll-archive 2009 from:cworth)
+test_expect_equal "$output" "Archived $count messages into 2009."
+
+test_begin_subtest "Archived messages are still searched"
+test_expect_equal "$(notmuch count '*')" "$total"
+
+test_begin_subtest "Archived messages keep their files"
+notmuch search --output=files --sort=oldest-first from:cworth > OUTPUT
+test_expect_equal_file EXPECTED.files OUTPUT
+
+test_begin_subtest "Excluded messages of the shard are flagged"
+notmuch config set search.exclude_tags hidden
+notmuch search --exclude=flag from:cworth > OUTPUT
+notmuch config set search.exclude_tags
+test_expect_equal_file EXPECTED.flag OUTPUT
+
+test_begin_subtest "Date ranges outside the shard skip it"
+notmuch search --output=messages --sort=oldest-first date:2010-01-01.. > OUTPUT
+test_expect_equal_file EXPECTED.recent OUTPUT
+
+test_begin_subtest "Date ranges within the shard still search it"
+test_expect_equal "$(notmuch count date:2009-11-18..2009-11-18 from:cworth)" "$cworth_day"
+
+test_begin_subtest "Archived messages are not tagged"
+notmuch tag +rolled from:cworth
+test_expect_equal "$(notmuch count tag:rolled)" "0"
+
+test_begin_subtest "Archived files are not added again"
+add_message
+test_expect_equal "$(notmuch count '*')" "$((total + 1))"
+
+test_begin_subtest "A reply to an archived message joins its thread"
+parent=$(notmuch search --output=messages --limit=1 from:cworth | sed 's/^id://')
+thread=$(notmuch search --output=threads id:$parent)
+add_message '[subject]="Re: archived"' "[in-reply-to]=\<$parent\>"
+output=$(notmuch search --output=threads id:${gen_msg_id})
+test_expect_equal "$output" "$thread"
+
+test_begin_subtest "A shard name cannot be used twice"
+test_expect_code 1 "notmuch roll-archive 2009 '*'"
+
+test_done
@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+test_description='"notmuch server"'
+. ./test-lib.sh || exit 1
+
+add_email_corpus
+
+socket=${MAIL_DIR}/.notmuch/server.sock
+
+notmuch search '*' > EXPECTED.search
+notmuch show --format=json id:20091117232137.GA7669@griffis1.net > EXPECTED.show
+notmuch count --output=threads tag:inbox > EXPECTED.count
+
+start_server () {
+    notmuch server --quiet &
+    server_pid=$!
+    for i in $(seq 1 50); do
+	[ -S "$socket" ] && return
+	sleep 0.1
+    done
+}
+
+stop_server () {
+    kill $server_pid
+    wait $server_pid
+}
+
+start_server
+
+test_begin_subtest "notmuch server creates its socket"
+test_expect_equal "$(test -S "$socket" && echo yes)" "yes"
+
+test_begin_subtest "Only one server runs at a time"
+test_expect_code 1 "notmuch server --quiet"
+
+test_begin_subtest "search through the server"
+notmuch search '*' > OUTPUT
+test_expect_equal_file EXPECTED.search OUTPUT
+
+test_begin_subtest "show through the server"
+notmuch show --format=json id:20091117232137.GA7669@griffis1.net > OUTPUT
+test_expect_equal_file EXPECTED.show OUTPUT
+
+test_begin_subtest "count through the server"
+notmuch count --output=threads tag:inbox > OUTPUT
+test_expect_equal_file EXPECTED.count OUTPUT
+
+test_begin_subtest "Exit status through the server"
+test_expect_code 1 "notmuch search"
+
+test_begin_subtest "The server sees changes made since it started"
+notmuch tag +served id:20091117232137.GA7669@griffis1.net
+output=$(notmuch count tag:served)
+test_expect_equal "$output" "1"
+
+test_begin_subtest "Relative paths are those of the client"
+mkdir -p subdir
+echo "+batch -- id:20091117232137.GA7669@griffis1.net" > subdir/batch
+(cd subdir && notmuch tag --batch --input=batch)
+output=$(notmuch count tag:batch)
+test_expect_equal "$output" "1"
+
+stop_server
+
+test_begin_subtest "notmuch server removes its socket"
+test_expect_equal "$(test -e "$socket" || echo gone)" "gone"
+
+test_begin_subtest "Commands run without a server"
+output=$(notmuch count tag:served)
+test_expect_equal "$output" "1"
+
+test_done
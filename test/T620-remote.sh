@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+test_description='databases named by a Xapian stub file'
+. ./test-lib.sh || exit 1
+
+test_declare_external_prereq xapian-progsrv
+
+add_email_corpus
+
+notmuch tag +hidden from:cworth
+notmuch search '*' > EXPECTED.search
+notmuch show --format=json id:20091117232137.GA7669@griffis1.net > EXPECTED.show
+notmuch count --output=files '*' > EXPECTED.files
+notmuch count --facet=tag '*' > EXPECTED.facet
+notmuch config set search.exclude_tags hidden
+notmuch search --exclude=flag '*' > EXPECTED.flag
+notmuch config set search.cache_excludes true
+notmuch search '*' > EXPECTED.excluded
+notmuch config set search.cache_excludes
+notmuch config set search.exclude_tags
+
+# Serve the database with xapian-progsrv, as a server would with
+# xapian-tcpsrv.
+server_db=${MAIL_DIR}/.notmuch/xapian.served
+mv ${MAIL_DIR}/.notmuch/xapian ${server_db}
+echo "remote xapian-progsrv ${server_db}" > ${MAIL_DIR}/.notmuch/xapian
+
+test_begin_subtest "Searching a remote database"
+test_require_external_prereq xapian-progsrv
+notmuch search '*' > OUTPUT
+test_expect_equal_file EXPECTED.search OUTPUT
+
+test_begin_subtest "Showing a message of a remote database"
+test_require_external_prereq xapian-progsrv
+notmuch show --format=json id:20091117232137.GA7669@griffis1.net > OUTPUT
+test_expect_equal_file EXPECTED.show OUTPUT
+
+# These go through the posting sources and match spies of the
+# library, which a remote database cannot be sent.
+
+test_begin_subtest "Flagging excluded messages of a remote database"
+test_require_external_prereq xapian-progsrv
+notmuch config set search.exclude_tags hidden
+notmuch search --exclude=flag '*' > OUTPUT
+notmuch config set search.exclude_tags
+test_expect_equal_file EXPECTED.flag OUTPUT
+
+test_begin_subtest "The exclude cache is not used for a remote database"
+test_require_external_prereq xapian-progsrv
+notmuch config set search.exclude_tags hidden
+notmuch config set search.cache_excludes true
+notmuch search '*' > OUTPUT
+notmuch config set search.cache_excludes
+notmuch config set search.exclude_tags
+test_expect_equal_file EXPECTED.excluded OUTPUT
+
+test_begin_subtest "Counting the files of a remote database"
+test_require_external_prereq xapian-progsrv
+notmuch count --output=files '*' > OUTPUT
+test_expect_equal_file EXPECTED.files OUTPUT
+
+test_begin_subtest "Counting the tags of a remote database"
+test_require_external_prereq xapian-progsrv
+notmuch count --facet=tag '*' > OUTPUT
+test_expect_equal_file EXPECTED.facet OUTPUT
+
+echo "remote xapian-progsrv --writable ${server_db}" > ${MAIL_DIR}/.notmuch/xapian
+
+test_begin_subtest "Tagging a remote database"
+test_require_external_prereq xapian-progsrv
+notmuch tag +remote id:20091117232137.GA7669@griffis1.net
+output=$(notmuch search --output=messages tag:remote)
+test_expect_equal "$output" "id:20091117232137.GA7669@griffis1.net"
+
+test_begin_subtest "The server's database has the tag"
+test_require_external_prereq xapian-progsrv
+rm ${MAIL_DIR}/.notmuch/xapian
+mv ${server_db} ${MAIL_DIR}/.notmuch/xapian
+output=$(notmuch search --output=messages tag:remote)
+mv ${MAIL_DIR}/.notmuch/xapian ${server_db}
+echo "remote xapian-progsrv --writable ${server_db}" > ${MAIL_DIR}/.notmuch/xapian
+test_expect_equal "$output" "id:20091117232137.GA7669@griffis1.net"
+
+test_expect_code 1 "Compacting through the stub is refused" \
+    'notmuch compact --quiet'
+
+test_done
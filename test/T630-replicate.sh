@@ -0,0 +1,48 @@
+#!/usr/bin/env bash
+test_description='read-only replicas with "notmuch replicate"'
+. ./test-lib.sh || exit 1
+
+add_email_corpus
+
+notmuch config set replicate.changesets 10
+
+REPLICA_DIR=${TMP_DIRECTORY}/replica
+REPLICA_CONFIG=${TMP_DIRECTORY}/replica-config
+sed -e "s,^path=.*,path=${REPLICA_DIR}," ${NOTMUCH_CONFIG} > ${REPLICA_CONFIG}
+mkdir -p ${REPLICA_DIR}
+
+pull () {
+    NOTMUCH_CONFIG=${REPLICA_CONFIG} notmuch replicate pull \
+	"notmuch --config=${NOTMUCH_CONFIG} replicate serve"
+}
+
+test_begin_subtest "Pulling a new replica"
+pull
+notmuch search '*' > EXPECTED
+NOTMUCH_CONFIG=${REPLICA_CONFIG} notmuch search '*' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "A replica has the UUID and revision of the primary"
+notmuch count --lastmod '*' > EXPECTED
+NOTMUCH_CONFIG=${REPLICA_CONFIG} notmuch count --lastmod '*' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Pulling changes to a replica"
+notmuch tag +replicated id:20091117232137.GA7669@griffis1.net
+pull
+output=$(NOTMUCH_CONFIG=${REPLICA_CONFIG} notmuch search --output=messages tag:replicated)
+test_expect_equal "$output" "id:20091117232137.GA7669@griffis1.net"
+
+test_begin_subtest "Pulling an unchanged replica"
+pull
+notmuch count --lastmod '*' > EXPECTED
+NOTMUCH_CONFIG=${REPLICA_CONFIG} notmuch count --lastmod '*' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_expect_code 1 "Tagging a replica is refused" \
+    "NOTMUCH_CONFIG=${REPLICA_CONFIG} notmuch tag +local '*'"
+
+test_expect_code 1 "Serving a malformed revision is refused" \
+    'notmuch replicate serve xyz > /dev/null'
+
+test_done
@@ -0,0 +1,97 @@
+#!/usr/bin/env bash
+test_description='"notmuch index-attachments"'
+. ./test-lib.sh || exit 1
+
+# An extractor that logs its calls and passes the attachment through.
+cat <<'EOF2' > ${TMP_DIRECTORY}/extract
+#!/bin/sh
+echo "$1" >> "${TMP_DIRECTORY}/extract.log"
+cat
+EOF2
+sed -i "s,\${TMP_DIRECTORY},${TMP_DIRECTORY}," ${TMP_DIRECTORY}/extract
+chmod +x ${TMP_DIRECTORY}/extract
+
+# Write a message with an attachment of type $2 holding the text $3.
+attached_message () {
+    cat <<EOF2 > ${MAIL_DIR}/$1
+From: Notmuch Test Suite <test_suite@notmuchmail.org>
+To: Notmuch Test Suite <test_suite@notmuchmail.org>
+Subject: $1
+Date: Fri, 05 Jan 2001 15:43:57 +0000
+Message-ID: <$1@example.com>
+MIME-Version: 1.0
+Content-Type: multipart/mixed; boundary="=-=-="
+
+--=-=-=
+Content-Type: text/plain
+
+See the attachment.
+
+--=-=-=
+Content-Type: $2
+Content-Disposition: attachment; filename=$1.dat
+Content-Transfer-Encoding: base64
+
+$(printf '%s' "$3" | base64)
+--=-=-=--
+EOF2
+}
+
+notmuch config set index.extractor "${TMP_DIRECTORY}/extract"
+notmuch config set index.extract_types "application/x-notmuch-test"
+
+attached_message first application/x-notmuch-test "quixotic zeppelins"
+attached_message second application/x-notmuch-test "quixotic zeppelins"
+attached_message third application/x-other "unwanted xylophones"
+NOTMUCH_NEW > /dev/null
+
+test_begin_subtest "Attachment text is not indexed by notmuch new"
+output=$(notmuch count zeppelins)
+test_expect_equal "$output" "0"
+
+test_begin_subtest "Extracting the text of attachments"
+output=$(notmuch index-attachments)
+test_expect_equal "$output" "Extracted the text of 1 attachment."
+
+test_begin_subtest "Searching the text of attachments"
+output=$(notmuch search --output=messages 'quixotic and zeppelins' | sort)
+test_expect_equal "$output" "id:first@example.com
+id:second@example.com"
+
+test_begin_subtest "The same attachment is extracted once"
+test_expect_equal "$(cat ${TMP_DIRECTORY}/extract.log)" "application/x-notmuch-test"
+
+test_begin_subtest "Other types are not extracted"
+output=$(notmuch count xylophones)
+test_expect_equal "$output" "0"
+
+test_begin_subtest "Nothing is left to extract"
+notmuch index-attachments > /dev/null
+test_expect_equal "$(wc -l < ${TMP_DIRECTORY}/extract.log)" "1"
+
+test_begin_subtest "Cached text is reused for new messages"
+attached_message fourth application/x-notmuch-test "quixotic zeppelins"
+NOTMUCH_NEW > /dev/null
+output=$(notmuch index-attachments)
+test_expect_equal "$output $(notmuch count id:fourth@example.com and zeppelins)" \
+    "Extracted the text of 0 attachments. 1"
+
+test_begin_subtest "A failing extractor gives no text"
+notmuch config set index.extractor "false"
+attached_message fifth application/x-notmuch-test "failing yodellers"
+NOTMUCH_NEW > /dev/null
+notmuch index-attachments > /dev/null 2>&1
+test_expect_equal "$(notmuch count yodellers)" "0"
+
+notmuch config set index.extractor "${TMP_DIRECTORY}/no-such-extractor"
+attached_message sixth application/x-notmuch-test "patient walruses"
+NOTMUCH_NEW > /dev/null
+test_expect_code 1 "An extractor that cannot run is an error" \
+    'notmuch index-attachments --quiet 2> /dev/null'
+
+test_begin_subtest "Messages are left marked when the extractor cannot run"
+notmuch config set index.extractor "${TMP_DIRECTORY}/extract"
+notmuch index-attachments > /dev/null
+test_expect_equal "$(notmuch count walruses)" "1"
+
+test_done
@@ -0,0 +1,53 @@
+#!/usr/bin/env bash
+test_description='"notmuch stats"'
+. ./test-lib.sh || exit 1
+
+add_email_corpus
+
+stats_value () {
+    sed -n "s/^$1	//p" OUTPUT
+}
+
+test_begin_subtest "stats count what other commands count"
+notmuch stats > OUTPUT
+cat <<EOF > EXPECTED
+messages $(notmuch count '*')
+filenames $(notmuch count --output=files '*')
+threads $(notmuch count --output=threads '*')
+tags $(notmuch search --output=tags '*' | wc -l)
+EOF
+cat <<EOF > ACTUAL
+messages $(stats_value messages)
+filenames $(stats_value filenames)
+threads $(stats_value threads)
+tags $(stats_value tags)
+EOF
+test_expect_equal_file EXPECTED ACTUAL
+
+test_begin_subtest "stats lists the largest threads and most used tags"
+notmuch stats --top=2 > OUTPUT
+output="$(grep -c '^thread:' OUTPUT) $(grep '^tag:' OUTPUT | head -1)"
+test_expect_equal "$output" "2 tag:inbox	$(notmuch count tag:inbox)"
+
+# Ghost messages count, so no thread has more messages than the
+# largest, and the largest has at least as many as it has in searches.
+test_begin_subtest "no thread has more messages than the largest"
+notmuch stats --top=1 > OUTPUT
+largest=$(grep '^thread:' OUTPUT | cut -f2)
+most=$(for thread in $(notmuch search --output=threads '*'); do
+	   notmuch count $thread
+       done | sort -n | tail -1)
+test_expect_success "test $most -le $largest"
+
+test_begin_subtest "stats reports the files of the Xapian database"
+notmuch stats > OUTPUT
+test_expect_success "grep -q '^table:' OUTPUT"
+
+test_begin_subtest "stats --format=json"
+notmuch stats --format=json --top=1 > OUTPUT
+output=$($NOTMUCH_PYTHON -c 'import json
+stats = json.load (open ("OUTPUT"))
+print (stats["messages"], len (stats["largest_threads"]), stats["top_tags"][0]["tag"])')
+test_expect_equal "$output" "$(notmuch count '*') 1 inbox"
+
+test_done
@@ -0,0 +1,72 @@
+/* gmime-extra.c -  Extra or enhanced routines for GMime streams.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "gmime-extra.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static GMimeStream *
+_stream_mmap (FILE *file)
+{
+    GMimeStream *stream;
+    struct stat st;
+    off_t start;
+    int fd;
+
+    start = ftello (file);
+    if (start < 0 || fstat (fileno (file), &st) != 0 ||
+	! S_ISREG (st.st_mode) || st.st_size <= start)
+	return NULL;
+
+    /* The stream closes its file descriptor when it is finalized. */
+    fd = dup (fileno (file));
+    if (fd == -1)
+	return NULL;
+
+    stream = g_mime_stream_mmap_new_with_bounds (fd, PROT_READ, MAP_PRIVATE,
+						 start, -1);
+    if (stream == NULL) {
+	close (fd);
+	return NULL;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise (GMIME_STREAM_MMAP (stream)->map,
+	     GMIME_STREAM_MMAP (stream)->maplen, MADV_SEQUENTIAL);
+#endif
+
+    return stream;
+}
+
+GMimeStream *
+gmime_stream_for_file (FILE *file)
+{
+    GMimeStream *stream;
+
+    stream = _stream_mmap (file);
+    if (stream)
+	return stream;
+
+    stream = g_mime_stream_file_new (file);
+    if (stream)
+	g_mime_stream_file_set_owner (GMIME_STREAM_FILE (stream), FALSE);
+
+    return stream;
+}
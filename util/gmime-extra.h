@@ -0,0 +1,26 @@
+#ifndef _GMIME_EXTRA_H
+#define _GMIME_EXTRA_H
+
+#include <stdio.h>
+#include <gmime/gmime.h>
+
+/* Return a new stream reading 'file' from its current position, for
+ * GMime to parse.
+ *
+ * Regular files are memory-mapped and marked for sequential access,
+ * so that GMime's parser, and the streams it keeps for the content of
+ * each MIME part, read straight from the page cache rather than
+ * through stdio buffers.  Anything that cannot be mapped (empty
+ * files, pipes, or filesystems without mmap support) is read with a
+ * stdio stream instead.
+ *
+ * In both cases the stream does not take ownership of 'file', which
+ * the caller must close after releasing the stream and everything
+ * parsed from it.
+ *
+ * Returns NULL if out of memory.
+ */
+GMimeStream *
+gmime_stream_for_file (FILE *file);
+
+#endif
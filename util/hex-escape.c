@@ -21,19 +21,47 @@
 #include <assert.h>
 #include <string.h>
 #include <talloc.h>
-#include <ctype.h>
 #include "error_util.h"
 #include "hex-escape.h"
 
-static const char *output_charset =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+-_@=.,";
+/* The bytes that are output unescaped:
+ *
+ *	ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+-_@=.,
+ *
+ * Tags and message IDs are encoded for every line of a dump, so this
+ * is a table rather than a search of the string above. */
+static const unsigned char output_table[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+};
+
+static const char hex_digits[] = "0123456789abcdef";
 
 static const char escape_char = '%';
 
 static int
 is_output (char c)
 {
-    return (strchr (output_charset, c) != NULL);
+    return output_table[(unsigned char) c];
+}
+
+/* Return the value of the hex digit 'c', or -1 if it is not one. */
+static int
+hex_value (char c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+	return c - 'A' + 10;
+    return -1;
 }
 
 static int
@@ -79,11 +107,20 @@ hex_encode (void *ctx, const char *in, char **out, size_t *out_size)
     p = in;
 
     while (*p) {
-	if (is_output (*p)) {
-	    *q++ = *p++;
-	} else {
-	    sprintf (q, "%%%02x", (unsigned char)*p++);
-	    q += 3;
+	const char *run = p;
+
+	/* Copy runs of unescaped bytes at once; most input is one. */
+	while (is_output (*p))
+	    p++;
+	memcpy (q, run, p - run);
+	q += p - run;
+
+	if (*p) {
+	    unsigned char c = *p++;
+
+	    *q++ = escape_char;
+	    *q++ = hex_digits[c >> 4];
+	    *q++ = hex_digits[c & 0xf];
 	}
     }
 
@@ -98,28 +135,18 @@ hex_encode (void *ctx, const char *in, char **out, size_t *out_size)
 static hex_status_t
 hex_decode_internal (const char *in, unsigned char *out)
 {
-    char buf[3];
-
     while (*in) {
 	if (*in == escape_char) {
-	    char *endp;
+	    int high, low;
 
 	    /* This also handles unexpected end-of-string. */
-	    if (!isxdigit ((unsigned char) in[1]) ||
-		!isxdigit ((unsigned char) in[2]))
-		return HEX_SYNTAX_ERROR;
-
-	    buf[0] = in[1];
-	    buf[1] = in[2];
-	    buf[2] = '\0';
-
-	    *out = strtoul (buf, &endp, 16);
-
-	    if (endp != buf + 2)
+	    high = hex_value (in[1]);
+	    low = high < 0 ? -1 : hex_value (in[2]);
+	    if (low < 0)
 		return HEX_SYNTAX_ERROR;
 
+	    *out++ = (high << 4) | low;
 	    in += 3;
-	    out++;
 	} else {
 	    *out++ = *in++;
 	}
@@ -147,7 +174,8 @@ hex_decode (void *ctx, const char *in, char **out, size_t * out_size)
     assert (ctx); assert (in); assert (out); assert (out_size);
 
     for (p = in; *p; p++)
-	if ((p[0] == escape_char) && isxdigit (p[1]) && isxdigit (p[2]))
+	if ((p[0] == escape_char) && hex_value (p[1]) >= 0 &&
+	    hex_value (p[2]) >= 0)
 	    needed -= 1;
 	else
 	    needed += 1;
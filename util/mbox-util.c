@@ -0,0 +1,182 @@
+/* mbox-util.c - Name and read the messages of mbox files in place.
+ *
+ * Copyright © 2016 The notmuch developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "mbox-util.h"
+#include "zlib-extra.h"
+#include <talloc.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+char *
+mbox_member_name (const void *ctx, const char *mbox_path,
+		  off_t offset, off_t length)
+{
+    return talloc_asprintf (ctx, "%s/%lld+%lld", mbox_path,
+			    (long long) offset, (long long) length);
+}
+
+/* Parse the decimal number at the start of 's', which must be
+ * followed by 'end', setting *value and returning a pointer past
+ * 'end', or NULL. */
+static const char *
+_parse_offset (const char *s, char end, off_t *value)
+{
+    unsigned long long n = 0;
+    const char *p;
+
+    for (p = s; isdigit ((unsigned char) *p); p++) {
+	if (n > (unsigned long long) (LLONG_MAX - 9) / 10)
+	    return NULL;
+	n = n * 10 + (*p - '0');
+    }
+
+    if (p == s || *p != end)
+	return NULL;
+
+    *value = n;
+    return p + 1;
+}
+
+int
+mbox_member_split (const void *ctx, const char *filename,
+		   char **mbox_path, off_t *offset, off_t *length)
+{
+    const char *name = strrchr (filename, '/');
+    const char *p;
+    char *path;
+
+    if (name == NULL || name == filename)
+	return -1;
+
+    p = _parse_offset (name + 1, '+', offset);
+    if (p)
+	p = _parse_offset (p, '\0', length);
+    if (p == NULL)
+	return -1;
+
+    path = talloc_strndup (ctx, filename, name - filename);
+    if (path == NULL)
+	return -1;
+
+    *mbox_path = path;
+    return 0;
+}
+
+int
+mbox_member_open (const char *filename, off_t *offset, off_t *length)
+{
+    char *mbox_path;
+    int fd, err;
+
+    *offset = 0;
+    *length = -1;
+
+    fd = open (filename, O_RDONLY);
+    if (fd >= 0 || errno != ENOTDIR)
+	return fd;
+
+    err = errno;
+    if (mbox_member_split (NULL, filename, &mbox_path, offset, length)) {
+	*offset = 0;
+	*length = -1;
+	errno = err;
+	return -1;
+    }
+
+    fd = open (mbox_path, O_RDONLY);
+    err = errno;
+    talloc_free (mbox_path);
+    errno = err;
+
+    return fd;
+}
+
+FILE *
+mbox_member_fopen (const char *filename)
+{
+    char buf[65536];
+    off_t offset, length;
+    FILE *file = NULL;
+    ssize_t size;
+    int fd, err;
+
+    if (gz_filename_suffix (filename))
+	return gz_fopen (filename);
+
+    fd = mbox_member_open (filename, &offset, &length);
+    if (fd < 0)
+	return NULL;
+
+    if (length < 0) {
+	file = fdopen (fd, "r");
+	if (file == NULL) {
+	    err = errno;
+	    close (fd);
+	    errno = err;
+	}
+	return file;
+    }
+
+    /* There is no portable way to hand a stream just part of a
+     * file, so the message is read into one of its own. */
+    if (length == 0) {
+	errno = EINVAL;
+	goto FAIL;
+    }
+
+    file = fmemopen (NULL, length, "w+");
+    if (file == NULL)
+	goto FAIL;
+
+    while (length > 0) {
+	size = pread (fd, buf, length < (off_t) sizeof (buf) ?
+		      (size_t) length : sizeof (buf), offset);
+	if (size < 0 && errno == EINTR)
+	    continue;
+	if (size <= 0) {
+	    /* The mbox was cut short since it was indexed. */
+	    if (size == 0)
+		errno = EIO;
+	    goto FAIL;
+	}
+	if (fwrite (buf, 1, size, file) != (size_t) size)
+	    goto FAIL;
+	offset += size;
+	length -= size;
+    }
+
+    close (fd);
+    rewind (file);
+
+    return file;
+
+  FAIL:
+    err = errno;
+    if (file)
+	fclose (file);
+    close (fd);
+    errno = err;
+
+    return NULL;
+}
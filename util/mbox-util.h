@@ -0,0 +1,55 @@
+#ifndef _MBOX_UTIL_H
+#define _MBOX_UTIL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A message kept in an mbox file is named as if the mbox were a
+ * directory holding one file per message:
+ *
+ *	MBOX/OFFSET+LENGTH
+ *
+ * names the LENGTH bytes at byte OFFSET of the file MBOX, which are
+ * the message that follows a From_ line (without the From_ line, or
+ * the empty line separating it from the next one).  No file can have
+ * such a name, since MBOX is not a directory, so opening it fails
+ * with ENOTDIR and the functions below can tell the two apart. */
+
+/* Return the talloced name of the message of 'length' bytes at
+ * 'offset' in the mbox 'mbox_path'. */
+char *
+mbox_member_name (const void *ctx, const char *mbox_path,
+		  off_t offset, off_t length);
+
+/* If 'filename' has the form of the name of a message of an mbox,
+ * set *mbox_path to the talloced name of the mbox, and *offset and
+ * *length to those of the message, and return 0.  Otherwise return
+ * -1.  The file system is not consulted. */
+int
+mbox_member_split (const void *ctx, const char *filename,
+		   char **mbox_path, off_t *offset, off_t *length);
+
+/* Open 'filename' for reading, returning a file descriptor, or -1
+ * with errno set.  If 'filename' names a message of an mbox, the
+ * descriptor is that of the mbox, and *offset and *length are set to
+ * where the message is in it; otherwise *offset is 0 and *length is
+ * -1, for the file as a whole. */
+int
+mbox_member_open (const char *filename, off_t *offset, off_t *length);
+
+/* Like fopen (filename, "r"), but for a message of an mbox, return a
+ * stream of just the message, read from the mbox with pread, and for
+ * a compressed file (see gz_filename_suffix), a stream of its
+ * decompressed contents.  Message files are best opened with this. */
+FILE *
+mbox_member_fopen (const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,10 +18,16 @@
  * Author: David Bremner <david@tethera.net>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for fopencookie */
+#endif
 #include "zlib-extra.h"
 #include <talloc.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 
 /* mimic POSIX/glibc getline, but on a zlib gzFile stream, and using talloc */
 util_status_t
@@ -83,3 +89,187 @@ const char *gz_error_string (util_status_t status, gzFile file)
     else
 	return util_error_string (status);
 }
+
+const char *
+gz_filename_suffix (const char *filename)
+{
+    size_t len = strlen (filename);
+
+    if (len > 3 && strcmp (filename + len - 3, ".gz") == 0)
+	return filename + len - 3;
+
+    return NULL;
+}
+
+#if HAVE_FOPENCOOKIE
+/* The stream of a compressed file keeps everything decompressed so
+ * far, so that it decompresses no more of the file than is read, yet
+ * seeks back, which zlib does by starting over, cost nothing. */
+typedef struct {
+    gzFile gz;
+    char *buf;
+    size_t len, size;
+    off64_t pos;
+    int eof;
+} gz_cookie_t;
+
+/* Decompress until at least 'want' bytes are in cookie->buf, or the
+ * end of the file, or all of it if 'want' is negative. */
+static int
+_gz_cookie_fill (gz_cookie_t *cookie, off64_t want)
+{
+    while ((want < 0 || (off64_t) cookie->len < want) && ! cookie->eof) {
+	int size;
+
+	if (cookie->len == cookie->size) {
+	    size_t new_size = cookie->size ? 2 * cookie->size : 65536;
+	    char *buf = realloc (cookie->buf, new_size);
+
+	    if (buf == NULL)
+		return -1;
+	    cookie->buf = buf;
+	    cookie->size = new_size;
+	}
+
+	size = gzread (cookie->gz, cookie->buf + cookie->len,
+		       cookie->size - cookie->len > INT_MAX ?
+		       INT_MAX : cookie->size - cookie->len);
+	if (size < 0) {
+	    errno = EIO;
+	    return -1;
+	}
+	if (size == 0)
+	    cookie->eof = 1;
+	cookie->len += size;
+    }
+
+    return 0;
+}
+
+static ssize_t
+_gz_cookie_read (void *c, char *buf, size_t size)
+{
+    gz_cookie_t *cookie = c;
+
+    if (_gz_cookie_fill (cookie, cookie->pos + size))
+	return -1;
+
+    if (cookie->pos >= (off64_t) cookie->len)
+	return 0;
+    if (size > cookie->len - cookie->pos)
+	size = cookie->len - cookie->pos;
+
+    memcpy (buf, cookie->buf + cookie->pos, size);
+    cookie->pos += size;
+
+    return size;
+}
+
+static int
+_gz_cookie_seek (void *c, off64_t *offset, int whence)
+{
+    gz_cookie_t *cookie = c;
+    off64_t pos;
+
+    switch (whence) {
+    case SEEK_SET:
+	pos = *offset;
+	break;
+    case SEEK_CUR:
+	pos = cookie->pos + *offset;
+	break;
+    case SEEK_END:
+	/* The size is only known at the end. */
+	if (_gz_cookie_fill (cookie, -1))
+	    return -1;
+	pos = cookie->len + *offset;
+	break;
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+
+    if (pos < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    *offset = cookie->pos = pos;
+    return 0;
+}
+
+static int
+_gz_cookie_close (void *c)
+{
+    gz_cookie_t *cookie = c;
+    int ret;
+
+    ret = gzclose (cookie->gz) == Z_OK ? 0 : EOF;
+    free (cookie->buf);
+    free (cookie);
+
+    return ret;
+}
+#endif
+
+FILE *
+gz_fopen (const char *path)
+{
+    gzFile gz;
+    FILE *file;
+    int err;
+
+    errno = 0;
+    gz = gzopen (path, "r");
+    if (gz == NULL) {
+	if (errno == 0)
+	    errno = ENOMEM;
+	return NULL;
+    }
+
+#if HAVE_FOPENCOOKIE
+    {
+	cookie_io_functions_t io = {
+	    _gz_cookie_read, NULL, _gz_cookie_seek, _gz_cookie_close
+	};
+	gz_cookie_t *cookie = calloc (1, sizeof (gz_cookie_t));
+
+	file = NULL;
+	if (cookie) {
+	    cookie->gz = gz;
+	    file = fopencookie (cookie, "r", io);
+	}
+	if (file == NULL) {
+	    err = cookie ? errno : ENOMEM;
+	    gzclose (gz);
+	    free (cookie);
+	    errno = err;
+	}
+    }
+#else
+    {
+	char buf[65536];
+	int size;
+
+	file = tmpfile ();
+	while (file && (size = gzread (gz, buf, sizeof (buf))) != 0) {
+	    if (size < 0 || fwrite (buf, 1, size, file) != (size_t) size) {
+		if (size < 0)
+		    errno = EIO;
+		err = errno;
+		fclose (file);
+		file = NULL;
+		errno = err;
+	    }
+	}
+
+	err = errno;
+	gzclose (gz);
+	errno = err;
+	if (file)
+	    rewind (file);
+    }
+#endif
+
+    return file;
+}
@@ -2,8 +2,13 @@
 #define _ZLIB_EXTRA_H
 
 #include "util.h"
+#include <stdio.h>
 #include <zlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Like getline, but read from a gzFile. Allocation is with talloc.
  * Returns:
  *
@@ -22,4 +27,22 @@ gz_getline (void *ctx, char **lineptr, ssize_t *bytes_read, gzFile stream);
 
 const char *
 gz_error_string (util_status_t status, gzFile stream);
+
+/* If 'filename' names a gzip-compressed file, by its ".gz" suffix,
+ * return a pointer to the suffix, otherwise NULL. */
+const char *
+gz_filename_suffix (const char *filename);
+
+/* Open the gzip-compressed file 'path' for reading, as a stream of
+ * its decompressed contents, or return NULL with errno set.  Where
+ * the C library allows, the file is only decompressed as far as the
+ * stream is read; otherwise it is decompressed to a temporary file
+ * first. */
+FILE *
+gz_fopen (const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif